@@ -196,6 +196,9 @@ extern RtVoid RiMatte(RtBoolean onoff);
 extern RtVoid RiMotionBegin(RtInt n, ...);
 extern RtVoid RiMotionBeginV(RtInt n, RtFloat times[]);
 extern RtVoid RiMotionEnd();
+extern RtObjectHandle RiObjectBegin(void);
+extern RtVoid RiObjectEnd(void);
+extern RtVoid RiObjectInstance(RtObjectHandle handle);
 extern RtFloat RiTriangleFilter(RtFloat x, RtFloat y,
 				RtFloat xwidth, RtFloat ywidth);
 extern RtFloat RiCatmullRomFilter(RtFloat x, RtFloat y,
@@ -55,6 +55,52 @@ static inline void ri_atomic_dec(int *ptr)
         : "+m" (*ptr));
 }
 
+/*
+ * Atomically adds `val' to `*ptr' and returns the value before addition.
+ */
+static inline int ri_atomic_add(int *ptr, int val)
+{
+    __asm__ __volatile__(
+        "lock;\n\t"
+        "xaddl %0, %1"
+        : "+r" (val), "+m" (*ptr)
+        :
+        : "memory");
+
+    return val;
+}
+
+/*
+ * 64-bit version of ri_atomic_add().
+ */
+static inline uint64_t ri_atomic_add64(uint64_t *ptr, uint64_t val)
+{
+#if defined(__64bit__)
+    __asm__ __volatile__(
+        "lock;\n\t"
+        "xaddq %0, %1"
+        : "+r" (val), "+m" (*ptr)
+        :
+        : "memory");
+
+    return val;
+#else
+    return __sync_fetch_and_add(ptr, val);
+#endif
+}
+
+/*
+ * Full memory barrier.
+ */
+static inline void ri_atomic_fence()
+{
+#if defined(__64bit__)
+    __asm__ __volatile__("mfence" : : : "memory");
+#else
+    __asm__ __volatile__("lock;\n\t" "addl $0, 0(%%esp)" : : : "memory");
+#endif
+}
+
 
 // the address of ptr must be on 16-byte boundary
 static inline uint32_t ri_atomic_cmpxchg32(
@@ -91,7 +137,7 @@ static inline uint64_t ri_atomic_cmpxchg64(void *ptr,
         "lock\n cmpxchgq %2,%1"
         : "=a" (out), "+m" (*(volatile uint64_t *)ptr)
         : "q" (newv), "0" (oldv)
-        : "cc");
+        : "cc", "memory");
 
     return out;
 }
@@ -149,10 +195,36 @@ static inline void ri_atomic_dec(int *ptr)
     /* TODO */
 }
 
+#if defined(__GNUC__)
+
+static inline int ri_atomic_add(int *ptr, int val)
+{
+    return __sync_fetch_and_add(ptr, val);
+}
+
+static inline uint64_t ri_atomic_add64(uint64_t *ptr, uint64_t val)
+{
+    return __sync_fetch_and_add(ptr, val);
+}
+
+static inline void ri_atomic_fence()
+{
+    __sync_synchronize();
+}
+
+#define RI_ATOMIC_CAS64(ptr, oldv, newv) \
+    __sync_bool_compare_and_swap((uint64_t *)(ptr), (oldv), (newv))
+#define RI_ATOMIC_CAS32(ptr, oldv, newv) \
+    __sync_bool_compare_and_swap((uint32_t *)(ptr), (oldv), (newv))
+
+#else
+
 /* TODO */
 #define RI_ATOMIC_CAS64(ptr, oldv, newv)
 #define RI_ATOMIC_CAS32(ptr, oldv, newv)
 
+#endif  /* __GNUC__ */
+
 
 #endif    /* __x86__ */
 
@@ -256,6 +256,66 @@ ri_matrix_copy(
     }
 }
 
+/*
+ * Inverts 4x4 matrix in ri_float_t precision by Gauss-Jordan elimination
+ * with partial pivoting. Unlike ri_matrix_inverse(), which computes in
+ * RtFloat, the source is not overwritten.
+ *
+ * Returns -1 if the matrix is singular, 0 otherwise.
+ */
+int
+ri_matrix_invert(
+    ri_matrix_t       *dst,
+    const ri_matrix_t *src)
+{
+    int         i, j, k;
+    int         pivot;
+    ri_float_t  a[4][8];
+    ri_float_t  tmp;
+
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 4; j++) {
+            a[i][j]     = src->f[i][j];
+            a[i][j + 4] = (i == j) ? 1.0 : 0.0;
+        }
+    }
+
+    for (k = 0; k < 4; k++) {
+
+        pivot = k;
+        for (i = k + 1; i < 4; i++) {
+            if (fabs(a[i][k]) > fabs(a[pivot][k])) pivot = i;
+        }
+
+        if (fabs(a[pivot][k]) < RI_EPS) return -1;
+
+        if (pivot != k) {
+            for (j = 0; j < 8; j++) {
+                tmp         = a[k][j];
+                a[k][j]     = a[pivot][j];
+                a[pivot][j] = tmp;
+            }
+        }
+
+        tmp = 1.0 / a[k][k];
+        for (j = 0; j < 8; j++) a[k][j] *= tmp;
+
+        for (i = 0; i < 4; i++) {
+            if ((i == k) || (a[i][k] == 0.0)) continue;
+            tmp = a[i][k];
+            for (j = 0; j < 8; j++) a[i][j] -= tmp * a[k][j];
+        }
+    }
+
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 4; j++) {
+            dst->f[i][j] = a[i][j + 4];
+        }
+    }
+
+    return 0;
+}
+
 void 
 ri_matrix_inverse(
     ri_matrix_t *dst)
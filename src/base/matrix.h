@@ -55,6 +55,8 @@ void ri_matrix_perspective (      ri_matrix_t *dst,
                                   RtFloat      d);
 void ri_matrix_transpose   (      ri_matrix_t *dst);
 void ri_matrix_inverse     (      ri_matrix_t *dst);
+int  ri_matrix_invert      (      ri_matrix_t *dst,
+                            const ri_matrix_t *src);
 void ri_matrix_print       (const ri_matrix_t *mat);
 
 /* create ri_matrix_t type  vector from RtVector */
@@ -59,9 +59,17 @@
 #endif
 #include "memory.h"
 #include "list.h"
+#include "atomic.h"
 
 #include <stdint.h>
 
+/*
+ * Counters of heap allocations.
+ */
+static uint64_t gnallocs = 0;
+static uint64_t gnfrees  = 0;
+static uint64_t gnbytes  = 0;
+
 
 
 static inline uint64_t alignsize(uint64_t sz, uint32_t align)
@@ -94,6 +102,9 @@ ri_mem_alloc(size_t byte)
     p = malloc(byte);
     assert(p != NULL);
 
+    ri_atomic_add64(&gnallocs, 1);
+    ri_atomic_add64(&gnbytes, byte);
+
     return p;
 }
 
@@ -121,15 +132,16 @@ ri_mem_alloc_aligned(size_t sz, uint32_t align)
     assert(align > 0);
     assert(align % 16 == 0);
 
-    size = alignup((uint64_t)sz, align);
-
-    size += 8;   /* room for embed the address */
+    /*
+     * Room for embed the address before the aligned point, and for
+     * shifting the aligned point by at most (align - 1) bytes.
+     */
+    size = (uint64_t)sz + align + 8;
 
     p       = malloc(size);
-    aligned = alignptr(p, align);
-    if (aligned == p) {
-        aligned += align;       // align up
-    }
+    assert(p != NULL);
+
+    aligned = alignptr((uint8_t *)p + 8, align);
 
     diff = (uintptr_t)(aligned - p);
     /*
@@ -146,6 +158,9 @@ ri_mem_alloc_aligned(size_t sz, uint32_t align)
 
     assert(aligned != NULL);
 
+    ri_atomic_add64(&gnallocs, 1);
+    ri_atomic_add64(&gnbytes, sz);
+
     return aligned;
 }
 
@@ -159,6 +174,8 @@ ri_mem_free(void *ptr)
 
     free(ptr);
 
+    ri_atomic_add64(&gnfrees, 1);
+
     return 0;   // OK
 
 }
@@ -186,6 +203,8 @@ ri_mem_free_aligned(void *ptr)
 
     free(free_addr);
 
+    ri_atomic_add64(&gnfrees, 1);
+
     return 0;
 }
 
@@ -197,3 +216,260 @@ ri_mem_copy(void *dest, const void *src, size_t n)
 
     return dest;
 }
+
+void
+ri_mem_get_stat(ri_mem_stat_t *stat_out)
+{
+    stat_out->nallocs = gnallocs;
+    stat_out->nfrees  = gnfrees;
+    stat_out->nbytes  = gnbytes;
+}
+
+/* ---------------------------------------------------------------------------
+ *
+ * Arena allocator
+ *
+ * ------------------------------------------------------------------------ */
+
+#define ARENA_BLOCK_ALIGN   (64)
+
+ri_arena_t *
+ri_arena_new(size_t size)
+{
+    ri_arena_t *arena;
+
+    assert(size > 0);
+
+    arena = (ri_arena_t *)ri_mem_alloc(sizeof(ri_arena_t));
+
+    arena->base          = (uint8_t *)ri_mem_alloc_aligned(size,
+                                                           ARENA_BLOCK_ALIGN);
+    arena->size          = size;
+    arena->used          = 0;
+    arena->overflow      = NULL;
+    arena->overflow_size = 0;
+
+    arena->nallocs       = 0;
+    arena->nheap_allocs  = 1;
+    arena->peak          = 0;
+
+    return arena;
+}
+
+static void
+arena_free_overflow(ri_arena_t *arena)
+{
+    ri_arena_block_t *block;
+    ri_arena_block_t *next;
+
+    for (block = arena->overflow; block != NULL; block = next) {
+        next = block->next;
+        ri_mem_free(block);
+    }
+
+    arena->overflow      = NULL;
+    arena->overflow_size = 0;
+}
+
+void
+ri_arena_free(ri_arena_t *arena)
+{
+    assert(arena != NULL);
+
+    arena_free_overflow(arena);
+
+    ri_mem_free_aligned(arena->base);
+    ri_mem_free(arena);
+}
+
+void *
+ri_arena_alloc(ri_arena_t *arena, size_t size, uint32_t align)
+{
+    uint64_t          offset;
+    ri_arena_block_t *block;
+    uint8_t          *p;
+
+    assert(arena != NULL);
+    assert(align > 0);
+    assert((align & (align - 1)) == 0);
+
+    arena->nallocs++;
+
+    /* base is ARENA_BLOCK_ALIGN aligned. */
+    if (align <= ARENA_BLOCK_ALIGN) {
+        offset = alignsize((uint64_t)arena->used, align);
+    } else {
+        offset = (uint64_t)((uint8_t *)alignptr(arena->base + arena->used,
+                                                align) - arena->base);
+    }
+
+    if (offset + size <= arena->size) {
+
+        arena->used = (size_t)(offset + size);
+        if (arena->used > arena->peak) arena->peak = arena->used;
+
+        return arena->base + offset;
+    }
+
+    /*
+     * The block is full. Take a new block from the heap. The block header
+     * is placed before the aligned point.
+     */
+    block = (ri_arena_block_t *)ri_mem_alloc(sizeof(ri_arena_block_t) +
+                                             size + align);
+    block->next     = arena->overflow;
+    arena->overflow = block;
+
+    arena->overflow_size += size + align;
+    arena->nheap_allocs++;
+
+    if (arena->used + arena->overflow_size > arena->peak) {
+        arena->peak = arena->used + arena->overflow_size;
+    }
+
+    p = (uint8_t *)alignptr((uint8_t *)(block + 1), align);
+
+    return p;
+}
+
+void
+ri_arena_reset(ri_arena_t *arena)
+{
+    size_t size;
+
+    assert(arena != NULL);
+
+    if (arena->overflow) {
+
+        /*
+         * Enlarge the block so that all allocations since the last reset
+         * fit into one block.
+         */
+        size = arena->size * 2;
+        if (size < arena->used + arena->overflow_size) {
+            size = arena->used + arena->overflow_size;
+        }
+
+        arena_free_overflow(arena);
+
+        ri_mem_free_aligned(arena->base);
+
+        arena->base = (uint8_t *)ri_mem_alloc_aligned(size,
+                                                      ARENA_BLOCK_ALIGN);
+        arena->size = size;
+        arena->nheap_allocs++;
+    }
+
+    arena->used = 0;
+}
+
+size_t
+ri_arena_mark(const ri_arena_t *arena)
+{
+    return arena->used;
+}
+
+void
+ri_arena_release(ri_arena_t *arena, size_t mark)
+{
+    assert(mark <= arena->used);
+
+    /* Overflow blocks are kept until ri_arena_reset(). */
+    arena->used = mark;
+}
+
+/* ---------------------------------------------------------------------------
+ *
+ * Fixed size object pool
+ *
+ * ------------------------------------------------------------------------ */
+
+ri_pool_t *
+ri_pool_new(size_t elem_size, uint32_t nelems_per_chunk)
+{
+    ri_pool_t *pool;
+
+    assert(nelems_per_chunk > 0);
+
+    pool = (ri_pool_t *)ri_mem_alloc(sizeof(ri_pool_t));
+
+    /* An object must be able to hold the link of the free list. */
+    if (elem_size < sizeof(void *)) elem_size = sizeof(void *);
+
+    pool->elem_size        = alignsize(elem_size, RI_MEM_DEFAULT_ALIGN);
+    pool->nelems_per_chunk = nelems_per_chunk;
+    pool->free_list        = NULL;
+    pool->chunks           = NULL;
+    pool->nallocs          = 0;
+    pool->nheap_allocs     = 0;
+
+    return pool;
+}
+
+void
+ri_pool_free(ri_pool_t *pool)
+{
+    void *chunk;
+    void *next;
+
+    assert(pool != NULL);
+
+    for (chunk = pool->chunks; chunk != NULL; chunk = next) {
+        next = *(void **)chunk;
+        ri_mem_free_aligned(chunk);
+    }
+
+    ri_mem_free(pool);
+}
+
+void *
+ri_pool_alloc(ri_pool_t *pool)
+{
+    uint32_t  i;
+    uint8_t  *chunk;
+    uint8_t  *elem;
+    void     *p;
+
+    assert(pool != NULL);
+
+    if (pool->free_list == NULL) {
+
+        /*
+         * Take a new chunk. The first RI_MEM_DEFAULT_ALIGN bytes hold the
+         * link to the next chunk.
+         */
+        chunk = (uint8_t *)ri_mem_alloc_aligned(
+                    RI_MEM_DEFAULT_ALIGN +
+                    pool->elem_size * pool->nelems_per_chunk,
+                    RI_MEM_DEFAULT_ALIGN);
+
+        *(void **)chunk = pool->chunks;
+        pool->chunks    = chunk;
+
+        for (i = 0; i < pool->nelems_per_chunk; i++) {
+            elem = chunk + RI_MEM_DEFAULT_ALIGN + i * pool->elem_size;
+            *(void **)elem  = pool->free_list;
+            pool->free_list = elem;
+        }
+
+        pool->nheap_allocs++;
+    }
+
+    p               = pool->free_list;
+    pool->free_list = *(void **)p;
+
+    pool->nallocs++;
+
+    return p;
+}
+
+void
+ri_pool_release(ri_pool_t *pool, void *ptr)
+{
+    assert(pool != NULL);
+
+    if (ptr == NULL) return;
+
+    *(void **)ptr   = pool->free_list;
+    pool->free_list = ptr;
+}
@@ -70,6 +70,96 @@ extern int   ri_mem_free_aligned (void *ptr);
 
 extern void *ri_mem_copy (void *dest, const void *src,     size_t n);
 
+/*
+ * Struct: ri_mem_stat_t
+ *
+ *   Counters of heap allocations made through ri_mem_alloc() and
+ *   ri_mem_alloc_aligned().
+ */
+typedef struct _ri_mem_stat_t {
+
+    uint64_t    nallocs;
+    uint64_t    nfrees;
+    uint64_t    nbytes;         /* total bytes requested so far */
+
+} ri_mem_stat_t;
+
+extern void  ri_mem_get_stat(ri_mem_stat_t *stat_out);
+
+/*
+ * Struct: ri_arena_t
+ *
+ *   Bump allocator. Memory is carved out of one block and released all at
+ *   once by ri_arena_reset(). When the block is full, extra blocks are taken
+ *   from the heap, and the block is enlarged at the next reset so that
+ *   the same sequence of allocations never touches the heap again.
+ *
+ *   Not thread-safe. Use one arena per thread.
+ */
+typedef struct _ri_arena_block_t {
+
+    struct _ri_arena_block_t *next;
+
+} ri_arena_block_t;
+
+typedef struct _ri_arena_t {
+
+    uint8_t            *base;
+    size_t              size;
+    size_t              used;
+
+    ri_arena_block_t   *overflow;       /* blocks taken when base is full */
+    size_t              overflow_size;
+
+    /* statistics */
+    uint64_t            nallocs;        /* # of ri_arena_alloc() calls    */
+    uint64_t            nheap_allocs;   /* # of heap allocations          */
+    size_t              peak;           /* max bytes used between resets  */
+
+} ri_arena_t;
+
+extern ri_arena_t *ri_arena_new    (size_t size);
+extern void        ri_arena_free   (ri_arena_t *arena);
+
+/* `align' must be power of 2. */
+extern void       *ri_arena_alloc  (ri_arena_t *arena, size_t size,
+                                    uint32_t align);
+
+/* Releases all memory allocated from the arena. */
+extern void        ri_arena_reset  (ri_arena_t *arena);
+
+/* Releases memory allocated after ri_arena_mark(). */
+extern size_t      ri_arena_mark   (const ri_arena_t *arena);
+extern void        ri_arena_release(ri_arena_t *arena, size_t mark);
+
+/*
+ * Struct: ri_pool_t
+ *
+ *   Pool of fixed size objects. Objects are taken from chunks of
+ *   `nelems_per_chunk' objects and recycled through a free list.
+ *
+ *   Not thread-safe.
+ */
+typedef struct _ri_pool_t {
+
+    size_t              elem_size;
+    uint32_t            nelems_per_chunk;
+
+    void               *free_list;
+    void               *chunks;         /* linked list of chunks          */
+
+    /* statistics */
+    uint64_t            nallocs;        /* # of ri_pool_alloc() calls     */
+    uint64_t            nheap_allocs;   /* # of chunks allocated          */
+
+} ri_pool_t;
+
+extern ri_pool_t  *ri_pool_new     (size_t elem_size,
+                                    uint32_t nelems_per_chunk);
+extern void        ri_pool_free    (ri_pool_t *pool);
+extern void       *ri_pool_alloc   (ri_pool_t *pool);
+extern void        ri_pool_release (ri_pool_t *pool, void *ptr);
+
 #ifdef __cplusplus
 }    /* extern "C" */
 #endif
@@ -43,7 +43,8 @@
  *
  *   Provides message passing facility which is used for rendering over
  *   the network.
- *   If WITH_MPI wasn't declared, functions does nothing.
+ *   If WITH_MPI wasn't declared, messages are sent over TCP sockets on
+ *   POSIX systems(see parallel.h). Otherwise functions does nothing.
  *
  * ------------------------------------------------------------------------- */
 
@@ -52,20 +53,659 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(WITH_MPI) && (defined(LINUX) || defined(__MACH__))
+#define RI_PARALLEL_SOCKET
+#endif
+
+#ifdef RI_PARALLEL_SOCKET
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
 
 #include "memory.h"
+#include "log.h"
 #include "parallel.h"
 
 static int ntasks;
 static int taskid;
 
+#ifdef RI_PARALLEL_SOCKET
+
+#define DEFAULT_MASTER          "127.0.0.1:7432"
+#define CONNECT_RETRY_SECONDS   30
+
+/*
+ * Tags used internally. User tags are not negative.
+ */
+#define TAG_GATHER              (-2)
+#define TAG_BARRIER             (-3)
+#define TAG_BCAST               (-4)
+
+/*
+ * Every message is preceded by this header.
+ */
+typedef struct _msg_header_t
+{
+    int32_t  tag;
+    int32_t  source;
+    uint64_t size;
+} msg_header_t;
+
+/*
+ * Task 0: connection to task i in gfds[i].
+ * Others: connection to task 0 in gfds[0].
+ */
+static int   *gfds      = NULL;
+static pid_t *gchildren = NULL;         /* tasks forked by task 0 */
+static int    nchildren = 0;
+
+static int    gnext_source = 1;         /* round robin of ANY_SOURCE */
+
+/*
+ * Messages which arrived before the matching ri_parallel_recv(), in the
+ * order of arrival.
+ */
+typedef struct _pending_msg_t
+{
+    msg_header_t           header;
+    char                  *data;
+    struct _pending_msg_t *next;
+} pending_msg_t;
+
+static pending_msg_t *gpending = NULL;
+
+/*
+ * RI_PARALLEL_ANY_TAG does not match tags used internally, like MPI
+ * point-to-point messages never match collective operations.
+ */
+static int
+tag_match(int tag, int msgtag)
+{
+    if (tag == RI_PARALLEL_ANY_TAG) return (msgtag >= 0);
+
+    return (tag == msgtag);
+}
+
+static int
+write_all(int fd, const void *buf, size_t size)
+{
+    const char *p = (const char *)buf;
+    ssize_t     n;
+
+    while (size > 0) {
+        n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p    += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+static int
+read_all(int fd, void *buf, size_t size)
+{
+    char    *p = (char *)buf;
+    ssize_t  n;
+
+    while (size > 0) {
+        n = read(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return -1;          /* connection closed */
+        p    += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Splits "host:port".
+ */
+static void
+parse_master(const char *master, char *host, int hostlen, int *port)
+{
+    const char *colon;
+    int         len;
+
+    colon = strrchr(master, ':');
+
+    if (colon == NULL) {
+        strncpy(host, master, hostlen - 1);
+        host[hostlen - 1] = '\0';
+        *port = atoi(strrchr(DEFAULT_MASTER, ':') + 1);
+        return;
+    }
+
+    len = (int)(colon - master);
+    if (len > hostlen - 1) len = hostlen - 1;
+
+    memcpy(host, master, len);
+    host[len] = '\0';
+
+    *port = atoi(colon + 1);
+}
+
+static void
+set_nodelay(int fd)
+{
+    int on = 1;
+
+    /* Messages are small. Don't wait for more data. */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&on, sizeof(on));
+}
+
+static int
+listen_master(int *port)
+{
+    int                 fd;
+    int                 on = 1;
+    struct sockaddr_in  addr;
+    socklen_t           len;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port        = htons((unsigned short)(*port));
+
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+        (listen(fd, ntasks) != 0)) {
+        close(fd);
+        return -1;
+    }
+
+    /* Port 0 lets the system choose one. */
+    len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    *port = ntohs(addr.sin_port);
+
+    return fd;
+}
+
+static int
+connect_master(const char *host, int port)
+{
+    int              fd;
+    int              ret;
+    int              retry;
+    char             service[32];
+    int32_t          id;
+    struct addrinfo  hints;
+    struct addrinfo *res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    sprintf(service, "%d", port);
+
+    if (getaddrinfo(host, service, &hints, &res) != 0) return -1;
+
+    /*
+     * Task 0 may not be listening yet.
+     */
+    fd = -1;
+    for (retry = 0; retry < CONNECT_RETRY_SECONDS * 10; retry++) {
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) break;
+
+        ret = connect(fd, res->ai_addr, res->ai_addrlen);
+        if (ret == 0) break;
+
+        close(fd);
+        fd = -1;
+
+        usleep(100000);
+    }
+
+    freeaddrinfo(res);
+
+    if (fd < 0) return -1;
+
+    set_nodelay(fd);
+
+    /* Tell task 0 who I am. */
+    id = taskid;
+    if (write_all(fd, &id, sizeof(int32_t)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+accept_tasks(int listenfd)
+{
+    int     i;
+    int     fd;
+    int32_t id;
+
+    for (i = 1; i < ntasks; i++) {
+
+        fd = accept(listenfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) { i--; continue; }
+            return -1;
+        }
+
+        if ((read_all(fd, &id, sizeof(int32_t)) != 0) ||
+            (id <= 0) || (id >= ntasks) || (gfds[id] >= 0)) {
+            close(fd);
+            return -1;
+        }
+
+        set_nodelay(fd);
+
+        gfds[id] = fd;
+    }
+
+    return 0;
+}
+
+static void
+socket_init()
+{
+    int         i;
+    int         port;
+    int         listenfd;
+    int         local;
+    char        host[256];
+    const char *env;
+    pid_t       pid;
+
+    env = getenv("LUCILLE_NTASKS");
+    if ((env == NULL) || (atoi(env) <= 1)) return;
+
+    ntasks = atoi(env);
+
+    env = getenv("LUCILLE_MASTER");
+    parse_master(env ? env : DEFAULT_MASTER, host, sizeof(host), &port);
+
+    env   = getenv("LUCILLE_TASKID");
+    local = (env == NULL);
+
+    gfds = (int *)ri_mem_alloc(sizeof(int) * ntasks);
+    for (i = 0; i < ntasks; i++) gfds[i] = -1;
+
+    if (!local) taskid = atoi(env);
+
+    if (taskid == 0) {
+
+        /*
+         * Local tasks connect through the port chosen by the system.
+         */
+        if (local) {
+            port = 0;
+            strcpy(host, "127.0.0.1");
+        }
+
+        listenfd = listen_master(&port);
+        if (listenfd < 0) {
+            ri_log(LOG_FATAL, "(Parallel) Can't listen on port %d", port);
+            exit(-1);
+        }
+
+        if (local) {
+
+            fflush(stdout);
+
+            gchildren = (pid_t *)ri_mem_alloc(sizeof(pid_t) * ntasks);
+
+            for (i = 1; i < ntasks; i++) {
+
+                pid = fork();
+
+                if (pid == 0) {
+                    close(listenfd);
+                    taskid = i;
+                    break;
+                }
+
+                if (pid < 0) {
+                    ri_log(LOG_FATAL, "(Parallel) Can't fork task %d", i);
+                    exit(-1);
+                }
+
+                gchildren[nchildren++] = pid;
+            }
+        }
+
+        if (taskid == 0) {
+
+            if (accept_tasks(listenfd) != 0) {
+                ri_log(LOG_FATAL, "(Parallel) Failed to accept tasks");
+                exit(-1);
+            }
+
+            close(listenfd);
+
+            ri_log(LOG_INFO, "(Parallel) %d tasks connected on port %d",
+                   ntasks, port);
+
+            return;
+        }
+    }
+
+    gfds[0] = connect_master(host, port);
+    if (gfds[0] < 0) {
+        ri_log(LOG_FATAL, "(Parallel) Task %d can't connect to %s:%d",
+               taskid, host, port);
+        exit(-1);
+    }
+}
+
+static void
+socket_send(
+    const void *src,
+    size_t      size,
+    int         dest,
+    int         tag)
+{
+    int          fd;
+    msg_header_t header;
+
+    if (taskid != 0 && dest != 0) {
+        ri_log(LOG_ERROR, "(Parallel) Task %d can't send to task %d",
+               taskid, dest);
+        return;
+    }
+
+    fd = gfds[dest];
+
+    header.tag    = tag;
+    header.source = taskid;
+    header.size   = size;
+
+    if ((write_all(fd, &header, sizeof(msg_header_t)) != 0) ||
+        (write_all(fd, src, size) != 0)) {
+        ri_log(LOG_FATAL, "(Parallel) Lost connection to task %d", dest);
+        exit(-1);
+    }
+}
+
+/*
+ * Waits for a message from any task and returns its source.
+ */
+static int
+socket_select(int *source)
+{
+    int    i;
+    int    id;
+    int    maxfd;
+    int    ret;
+    fd_set fds;
+
+    while (1) {
+
+        FD_ZERO(&fds);
+        maxfd = 0;
+
+        for (i = 1; i < ntasks; i++) {
+            if (gfds[i] < 0) continue;
+            FD_SET(gfds[i], &fds);
+            if (gfds[i] > maxfd) maxfd = gfds[i];
+        }
+
+        ret = select(maxfd + 1, &fds, NULL, NULL, NULL);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        /* Round robin not to starve tasks with larger ids. */
+        for (i = 0; i < ntasks - 1; i++) {
+
+            id = 1 + (gnext_source - 1 + i) % (ntasks - 1);
+
+            if ((gfds[id] >= 0) && FD_ISSET(gfds[id], &fds)) {
+                gnext_source = 1 + id % (ntasks - 1);
+                *source = id;
+                return 0;
+            }
+        }
+    }
+}
+
+static void
+set_status(
+    ri_parallel_status_t *status,
+    int                   source,
+    int                   tag,
+    size_t                size)
+{
+    if (status == NULL) return;
+
+    status->source = source;
+    status->tag    = tag;
+    status->size   = size;
+}
+
+/*
+ * Takes the first pending message which matches.
+ */
+static int
+recv_pending(
+    void                 *dst,
+    size_t                size,
+    int                   source,
+    int                   tag,
+    ri_parallel_status_t *status)
+{
+    size_t          n;
+    pending_msg_t  *msg;
+    pending_msg_t **prev;
+
+    for (prev = &gpending; (*prev) != NULL; prev = &((*prev)->next)) {
+
+        msg = (*prev);
+
+        if ((source != RI_PARALLEL_ANY_SOURCE) &&
+            (source != msg->header.source)) continue;
+        if (!tag_match(tag, msg->header.tag)) continue;
+
+        n = msg->header.size;
+        if (n > size) {
+            ri_log(LOG_ERROR, "(Parallel) Message from task %d is truncated",
+                   msg->header.source);
+            n = size;
+        }
+
+        memcpy(dst, msg->data, n);
+
+        set_status(status, msg->header.source, msg->header.tag, n);
+
+        (*prev) = msg->next;
+
+        ri_mem_free(msg->data);
+        ri_mem_free(msg);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+static void
+socket_recv(
+    void                 *dst,
+    size_t                size,
+    int                   source,
+    int                   tag,
+    ri_parallel_status_t *status)
+{
+    int             fd;
+    int             from;
+    size_t          n;
+    char            buf[256];
+    msg_header_t    header;
+    pending_msg_t  *msg;
+    pending_msg_t **last;
+
+    if (taskid != 0) source = 0;
+
+    if (recv_pending(dst, size, source, tag, status)) return;
+
+    while (1) {
+
+        from = source;
+
+        if (from == RI_PARALLEL_ANY_SOURCE) {
+            if (socket_select(&from) != 0) {
+                ri_log(LOG_FATAL, "(Parallel) select() failed");
+                exit(-1);
+            }
+        }
+
+        fd = gfds[from];
+
+        if (read_all(fd, &header, sizeof(msg_header_t)) != 0) {
+            ri_log(LOG_FATAL, "(Parallel) Lost connection to task %d", from);
+            exit(-1);
+        }
+
+        if (tag_match(tag, header.tag)) break;
+
+        /*
+         * Keep the message for a later ri_parallel_recv().
+         */
+        msg = (pending_msg_t *)ri_mem_alloc(sizeof(pending_msg_t));
+
+        msg->header = header;
+        msg->data   = (char *)ri_mem_alloc(header.size > 0 ? header.size : 1);
+        msg->next   = NULL;
+
+        if (read_all(fd, msg->data, header.size) != 0) {
+            ri_log(LOG_FATAL, "(Parallel) Lost connection to task %d", from);
+            exit(-1);
+        }
+
+        for (last = &gpending; (*last) != NULL; last = &((*last)->next)) ;
+        (*last) = msg;
+    }
+
+    n = header.size;
+    if (n > size) {
+        ri_log(LOG_ERROR, "(Parallel) Message from task %d is truncated",
+               from);
+        n = size;
+    }
+
+    if (read_all(fd, dst, n) != 0) {
+        ri_log(LOG_FATAL, "(Parallel) Lost connection to task %d", from);
+        exit(-1);
+    }
+
+    set_status(status, from, header.tag, n);
+
+    /* Discard the rest of truncated message. */
+    header.size -= n;
+    while (header.size > 0) {
+        n = header.size > sizeof(buf) ? sizeof(buf) : header.size;
+        if (read_all(fd, buf, n) != 0) break;
+        header.size -= n;
+    }
+}
+
+/*
+ * Returns 1 if a message from `source' can be read without blocking.
+ */
+static int
+socket_poll(int source)
+{
+    int            i;
+    int            maxfd;
+    fd_set         fds;
+    struct timeval tv;
+
+    FD_ZERO(&fds);
+    maxfd = 0;
+
+    for (i = 0; i < ntasks; i++) {
+
+        if (gfds[i] < 0) continue;
+        if ((source != RI_PARALLEL_ANY_SOURCE) && (i != source)) continue;
+
+        FD_SET(gfds[i], &fds);
+        if (gfds[i] > maxfd) maxfd = gfds[i];
+    }
+
+    tv.tv_sec  = 0;
+    tv.tv_usec = 0;
+
+    return (select(maxfd + 1, &fds, NULL, NULL, &tv) > 0);
+}
+
+static void
+socket_finalize()
+{
+    int            i;
+    int            st;
+    pending_msg_t *msg;
+
+    if (gfds == NULL) return;
+
+    for (i = 0; i < ntasks; i++) {
+        if (gfds[i] >= 0) close(gfds[i]);
+    }
+
+    for (i = 0; i < nchildren; i++) {
+        waitpid(gchildren[i], &st, 0);
+    }
+
+    while (gpending) {
+        msg      = gpending;
+        gpending = msg->next;
+        ri_mem_free(msg->data);
+        ri_mem_free(msg);
+    }
+
+    ri_mem_free(gfds);
+    ri_mem_free(gchildren);
+
+    gfds      = NULL;
+    gchildren = NULL;
+    nchildren = 0;
+}
+
+#endif  /* RI_PARALLEL_SOCKET */
+
 void
 ri_parallel_init(
     int    *argc,
     char ***argv)
 {
 #ifdef WITH_MPI
-    MPI_Init(argc, argv);
+    int provided;
+
+    /*
+     * Render threads call MPI functions one at a time.
+     */
+    MPI_Init_thread(argc, argv, MPI_THREAD_SERIALIZED, &provided);
     MPI_Comm_rank(MPI_COMM_WORLD, &taskid);
     MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
 
@@ -75,6 +715,10 @@ ri_parallel_init(
     taskid = 0;
     (void)argc;
     (void)argv;
+
+#ifdef RI_PARALLEL_SOCKET
+    socket_init();
+#endif
 #endif
 }
 
@@ -83,6 +727,8 @@ ri_parallel_finalize()
 {
 #ifdef WITH_MPI
     MPI_Finalize();
+#elif defined(RI_PARALLEL_SOCKET)
+    socket_finalize();
 #endif
 }
 
@@ -113,6 +759,17 @@ ri_parallel_gather(
     if (ret != MPI_SUCCESS) {
         printf("err: [%d]\n", ret);
     }
+#elif defined(RI_PARALLEL_SOCKET)
+    int i;
+
+    if (taskid == 0) {
+        ri_mem_copy(dst, src, size);
+        for (i = 1; i < ntasks; i++) {
+            socket_recv((char *)dst + i * size, size, i, TAG_GATHER, NULL);
+        }
+    } else {
+        socket_send(src, size, 0, TAG_GATHER);
+    }
 #else
     ri_mem_copy(dst, src, size);
 #endif
@@ -123,6 +780,24 @@ ri_parallel_barrier()
 {
 #ifdef WITH_MPI
     MPI_Barrier(MPI_COMM_WORLD);
+#elif defined(RI_PARALLEL_SOCKET)
+    int i;
+    int dummy = 0;
+
+    if (ntasks < 2) return;
+
+    /* Everyone reports to task 0, then task 0 releases them. */
+    if (taskid == 0) {
+        for (i = 1; i < ntasks; i++) {
+            socket_recv(&dummy, sizeof(int), i, TAG_BARRIER, NULL);
+        }
+        for (i = 1; i < ntasks; i++) {
+            socket_send(&dummy, sizeof(int), i, TAG_BARRIER);
+        }
+    } else {
+        socket_send(&dummy, sizeof(int), 0, TAG_BARRIER);
+        socket_recv(&dummy, sizeof(int), 0, TAG_BARRIER, NULL);
+    }
 #endif
 }
 
@@ -135,6 +810,9 @@ ri_parallel_send(
 {
 #ifdef WITH_MPI
     MPI_Send(src, size, MPI_BYTE, dest, tag, MPI_COMM_WORLD);
+#elif defined(RI_PARALLEL_SOCKET)
+    if (ntasks < 2) return;
+    socket_send(src, size, dest, tag);
 #else
     (void)src;
     (void)size;
@@ -154,6 +832,9 @@ ri_parallel_recv(
 #ifdef WITH_MPI
     MPI_Recv(src, size, MPI_BYTE, source, tag, MPI_COMM_WORLD,
          &(status->status));
+#elif defined(RI_PARALLEL_SOCKET)
+    if (ntasks < 2) return;
+    socket_recv(src, size, source, tag, status);
 #else
     (void)src;
     (void)size;
@@ -175,11 +856,10 @@ ri_parallel_irecv(
     MPI_Irecv(src, size, MPI_BYTE, source, tag, MPI_COMM_WORLD,
          &(request->request));
 #else
-    (void)src;
-    (void)size;
-    (void)source;
-    (void)tag;
-    (void)request;
+    request->dst    = src;
+    request->size   = size;
+    request->source = source;
+    request->tag    = tag;
 #endif
 }
 
@@ -188,6 +868,18 @@ ri_parallel_bcast(void *src, size_t size)
 {
 #ifdef WITH_MPI
     MPI_Bcast(src, size, MPI_BYTE, 0, MPI_COMM_WORLD);
+#elif defined(RI_PARALLEL_SOCKET)
+    int i;
+
+    if (ntasks < 2) return;
+
+    if (taskid == 0) {
+        for (i = 1; i < ntasks; i++) {
+            socket_send(src, size, i, TAG_BCAST);
+        }
+    } else {
+        socket_recv(src, size, 0, TAG_BCAST, NULL);
+    }
 #else
     (void)src;
     (void)size;
@@ -205,6 +897,18 @@ ri_parallel_test(
     MPI_Test(&(request->request), &flag, &(status->status));
 
     return flag;
+#elif defined(RI_PARALLEL_SOCKET)
+    if (ntasks < 2) return 1;
+
+    if (recv_pending(request->dst, request->size, request->source,
+                     request->tag, status)) return 1;
+
+    if (!socket_poll(request->source)) return 0;
+
+    socket_recv(request->dst, request->size, request->source, request->tag,
+                status);
+
+    return 1;
 #else
     (void)request;
     (void)status;
@@ -223,6 +927,13 @@ ri_parallel_wait(ri_parallel_request_t *request,
     ret = MPI_Wait(&(request->request), &(status->status));
 
     return ret;
+#elif defined(RI_PARALLEL_SOCKET)
+    if (ntasks < 2) return 1;
+
+    socket_recv(request->dst, request->size, request->source, request->tag,
+                status);
+
+    return 1;
 #else
     (void)request;
     (void)status;
@@ -230,3 +941,37 @@ ri_parallel_wait(ri_parallel_request_t *request,
     return 1;
 #endif
 }
+
+int
+ri_parallel_status_source(const ri_parallel_status_t *status)
+{
+#ifdef WITH_MPI
+    return status->status.MPI_SOURCE;
+#else
+    return status->source;
+#endif
+}
+
+int
+ri_parallel_status_tag(const ri_parallel_status_t *status)
+{
+#ifdef WITH_MPI
+    return status->status.MPI_TAG;
+#else
+    return status->tag;
+#endif
+}
+
+size_t
+ri_parallel_status_size(const ri_parallel_status_t *status)
+{
+#ifdef WITH_MPI
+    int count;
+
+    MPI_Get_count((MPI_Status *)&(status->status), MPI_BYTE, &count);
+
+    return (size_t)count;
+#else
+    return status->size;
+#endif
+}
@@ -43,6 +43,18 @@
  *
  *   Header file for wrapper API of message passing interface
  *
+ *   Without MPI, tasks are connected with TCP sockets on POSIX systems.
+ *   Tasks are configured with environment variables:
+ *
+ *     LUCILLE_NTASKS    Number of tasks.
+ *     LUCILLE_TASKID    Task id of this process. If not set, task 0 forks
+ *                       the other tasks on the local machine.
+ *     LUCILLE_MASTER    "host:port" of task 0. Default "127.0.0.1:7432".
+ *
+ *   The socket transport connects task 0 with each of other tasks, thus
+ *   other tasks can only talk to task 0. Messages from a task are received
+ *   in the order they were sent.
+ *
  * ------------------------------------------------------------------------- */
 
 #ifndef LUCILLE_PARALLEL_H
@@ -52,16 +64,31 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 #ifdef WITH_MPI
 #include <mpi.h>
 #endif
 
+/*
+ * Wildcards for ri_parallel_recv().
+ */
+#ifdef WITH_MPI
+#define RI_PARALLEL_ANY_SOURCE  MPI_ANY_SOURCE
+#define RI_PARALLEL_ANY_TAG     MPI_ANY_TAG
+#else
+#define RI_PARALLEL_ANY_SOURCE  (-1)
+#define RI_PARALLEL_ANY_TAG     (-1)
+#endif
+
 typedef struct _ri_parallel_status_t
 {
 #ifdef WITH_MPI
     MPI_Status status;
 #else
-    int status;        /* dummy    */
+    int    source;
+    int    tag;
+    size_t size;            /* bytes received */
 #endif
 } ri_parallel_status_t;
 
@@ -71,7 +98,11 @@ typedef struct _ri_parallel_request_t
 #ifdef WITH_MPI
     MPI_Request request;
 #else
-    int request;        /* dummy */
+    /* The socket transport receives the message in test() or wait(). */
+    void   *dst;
+    size_t  size;
+    int     source;
+    int     tag;
 #endif
 } ri_parallel_request_t;
 
@@ -105,6 +136,13 @@ extern int  ri_parallel_test    (ri_parallel_request_t *request,
 extern int  ri_parallel_wait    (ri_parallel_request_t *request,
                                  ri_parallel_status_t  *status);
 
+/*
+ * Source task, tag and size in bytes of the received message.
+ */
+extern int    ri_parallel_status_source(const ri_parallel_status_t *status);
+extern int    ri_parallel_status_tag   (const ri_parallel_status_t *status);
+extern size_t ri_parallel_status_size  (const ri_parallel_status_t *status);
+
 #ifdef __cplusplus
 }    /* extern "C" */
 #endif
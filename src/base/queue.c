@@ -474,6 +474,7 @@ ri_mt_queue_new()
     q->mutex    = ri_mutex_new(); 
     q->nodes    = ri_list_new(); 
     q->nnodes   = 0; 
+    q->item_pool = ri_pool_new(sizeof(mt_queue_item_t), 256);
 
     ri_mutex_init(q->mutex);
 
@@ -496,7 +497,7 @@ ri_mt_queue_push(
         // Alloate memory and copy content
         mt_queue_item_t *item;
 
-        item       = ri_mem_alloc(sizeof(mt_queue_item_t));
+        item       = ri_pool_alloc(queue->item_pool);
         item->data = ri_mem_alloc(size);
         item->len  = size;
 
@@ -549,6 +550,8 @@ ri_mt_queue_pop(
 
         queue->nnodes--; 
 
+        ri_pool_release(queue->item_pool, item);
+
     }
 
     ri_mutex_unlock(queue->mutex);
@@ -585,6 +588,7 @@ ri_mt_queue_free(
 
     ri_mutex_free(queue->mutex);
     ri_list_free(queue->nodes);
+    ri_pool_free(queue->item_pool);
     ri_mem_free(queue);
 
     return 0;
@@ -26,6 +26,7 @@ extern "C" {
 
 #include "thread.h"
 #include "list.h"
+#include "memory.h"
 
 typedef struct _ri_entry_tag_t
 {
@@ -85,6 +86,8 @@ typedef struct _ri_mt_queue_t
 
     ri_list_t  *nodes;
     int         nnodes;
+
+    ri_pool_t  *item_pool;      /* pool of queue items. guarded by mutex */
     
 } ri_mt_queue_t;
 
@@ -37,8 +37,16 @@
  * 
  */
 
+#include <stdint.h>
+
 #include "system.h"
 
+#if defined(__x86__) && defined(__GNUC__)
+#include <cpuid.h>
+#elif defined(__x86__) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 void
 ri_system_exit(
     int         code,
@@ -51,3 +59,43 @@ ri_system_exit(
     fflush(stdout);
     exit(code);
 }
+
+int
+ri_system_cpu_has_avx()
+{
+#if defined(__x86__) && (defined(__GNUC__) || defined(_MSC_VER))
+
+    unsigned int ecx;
+    uint64_t     xcr0;
+
+#if defined(__GNUC__)
+    unsigned int eax, ebx, edx;
+    unsigned int xcr0_lo, xcr0_hi;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+#else
+    int info[4];
+
+    __cpuid(info, 1);
+    ecx = (unsigned int)info[2];
+#endif
+
+    /* CPUID.1:ECX.OSXSAVE[bit 27] and CPUID.1:ECX.AVX[bit 28] */
+    if (!(ecx & (1 << 27)) || !(ecx & (1 << 28))) return 0;
+
+    /* Check if the OS saves XMM and YMM state. */
+#if defined(__GNUC__)
+    __asm__ __volatile__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    xcr0 = ((uint64_t)xcr0_hi << 32) | xcr0_lo;
+#else
+    xcr0 = _xgetbv(0);
+#endif
+
+    return ((xcr0 & 0x6) == 0x6);
+
+#else
+
+    return 0;
+
+#endif
+}
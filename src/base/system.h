@@ -59,6 +59,9 @@ extern "C" {
 
 extern void ri_system_exit(int code, const char *filename, int line);
 
+/* Returns 1 if the processor and the OS support AVX instructions. */
+extern int  ri_system_cpu_has_avx();
+
 #ifdef __cplusplus
 }
 #endif
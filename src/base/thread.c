@@ -17,6 +17,7 @@
 
 #ifdef WITH_PTHREAD
 #include <pthread.h>
+#include <sched.h>
 #endif
 
 #include "thread.h"
@@ -292,6 +293,19 @@ ri_thread_exit(void *val_ptr)
 #endif
 }
 
+/*
+ * Relinquishes the processor so that other threads can run.
+ */
+void
+ri_thread_yield()
+{
+#if !defined(NOTHREAD) && defined(WIN32)
+    SwitchToThread();
+#elif defined(WITH_PTHREAD)
+    sched_yield();
+#endif
+}
+
 void
 ri_thread_free(ri_thread_t *thread)
 {
@@ -125,6 +125,7 @@ extern int         ri_thread_create      (ri_thread_t      *thread,
 extern int         ri_thread_join        (ri_thread_t      *thread);
 extern void        ri_thread_exit        (void             *valptr);
 extern void        ri_thread_free        (ri_thread_t      *thread);
+extern void        ri_thread_yield       ();
 
 #ifdef __cplusplus
 }    /* extern "C" */
@@ -135,6 +135,7 @@ void
 ri_timer_free(ri_timer_t *timer)
 {
     ri_hash_traverse(timer->entrylist, timerinfo_free_func, NULL);
+    ri_hash_free(timer->entrylist);
     ri_mem_free(timer);
 }
 
@@ -0,0 +1,162 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Lock-free work-stealing deque, based on
+ *
+ * David Chase and Yossi Lev.
+ * Dynamic circular work-stealing deque.
+ * SPAA 2005. pp. 21--28.
+ *
+ * The circular buffer does not grow. The owner must not push more than
+ * `capacity' items.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+
+#include "memory.h"
+#include "atomic.h"
+#include "wsdeque.h"
+
+ri_ws_deque_t *
+ri_ws_deque_new(int64_t capacity)
+{
+    ri_ws_deque_t *deque;
+    int64_t        size;
+
+    assert(capacity > 0);
+
+    /* round up to the power of 2. */
+    size = 1;
+    while (size < capacity) size <<= 1;
+
+    deque = (ri_ws_deque_t *)ri_mem_alloc_aligned(sizeof(ri_ws_deque_t),
+                                                  RI_WS_DEQUE_CACHELINE);
+
+    deque->top    = 0;
+    deque->bottom = 0;
+    deque->mask   = size - 1;
+    deque->items  = (volatile int64_t *)ri_mem_alloc(sizeof(int64_t) * size);
+
+    return deque;
+}
+
+void
+ri_ws_deque_free(ri_ws_deque_t *deque)
+{
+    assert(deque != NULL);
+
+    ri_mem_free((void *)deque->items);
+    ri_mem_free_aligned(deque);
+}
+
+int
+ri_ws_deque_push(
+    ri_ws_deque_t *deque,
+    int64_t        item)
+{
+    int64_t b, t;
+
+    b = deque->bottom;
+    t = deque->top;
+
+    if (b - t > deque->mask) {
+        return -1;      /* full */
+    }
+
+    deque->items[b & deque->mask] = item;
+
+    /* item must be visible before bottom is published. */
+    ri_atomic_fence();
+
+    deque->bottom = b + 1;
+
+    return 0;
+}
+
+int
+ri_ws_deque_pop(
+    ri_ws_deque_t *deque,
+    int64_t       *item_out)
+{
+    int64_t b, t;
+    int64_t item;
+
+    b = deque->bottom - 1;
+    deque->bottom = b;
+
+    /* store to bottom must be ordered before load of top. */
+    ri_atomic_fence();
+
+    t = deque->top;
+
+    if (t > b) {
+        /* empty */
+        deque->bottom = b + 1;
+        return -1;
+    }
+
+    item = deque->items[b & deque->mask];
+
+    if (t == b) {
+
+        /*
+         * Last item. Race against stealers.
+         */
+        if (!RI_ATOMIC_CAS64((void *)&deque->top,
+                             (uint64_t)t, (uint64_t)(t + 1))) {
+            deque->bottom = b + 1;
+            return -1;
+        }
+
+        deque->bottom = b + 1;
+    }
+
+    (*item_out) = item;
+
+    return 0;
+}
+
+int
+ri_ws_deque_steal(
+    ri_ws_deque_t *deque,
+    int64_t       *item_out)
+{
+    int64_t b, t;
+    int64_t item;
+
+    t = deque->top;
+
+    ri_atomic_fence();
+
+    b = deque->bottom;
+
+    if (t >= b) {
+        return -1;      /* empty */
+    }
+
+    item = deque->items[t & deque->mask];
+
+    if (!RI_ATOMIC_CAS64((void *)&deque->top, (uint64_t)t, (uint64_t)(t + 1))) {
+        return 1;       /* lost the race */
+    }
+
+    (*item_out) = item;
+
+    return 0;
+}
+
+int64_t
+ri_ws_deque_size(const ri_ws_deque_t *deque)
+{
+    int64_t size;
+
+    size = deque->bottom - deque->top;
+
+    return (size < 0) ? 0 : size;
+}
@@ -0,0 +1,95 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * ri_ws_deque_t: lock-free work-stealing deque.
+ *
+ * The owner thread pushes and pops items at the bottom end, other threads
+ * steal items from the top end. Capacity is fixed at creation time.
+ *
+ * reference:
+ *
+ * David Chase and Yossi Lev.
+ * Dynamic circular work-stealing deque.
+ * SPAA 2005. pp. 21--28.
+ *
+ * $Id$
+ */
+
+#ifndef LUCILLE_WSDEQUE_H
+#define LUCILLE_WSDEQUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define RI_WS_DEQUE_CACHELINE   (64)
+
+typedef struct _ri_ws_deque_t
+{
+    /*
+     * top and bottom are placed on separate cache lines so that stealers
+     * do not disturb the owner. top must be 16-byte aligned for CAS.
+     */
+    volatile int64_t  top;
+    uint8_t           pad0[RI_WS_DEQUE_CACHELINE - sizeof(int64_t)];
+
+    volatile int64_t  bottom;
+    uint8_t           pad1[RI_WS_DEQUE_CACHELINE - sizeof(int64_t)];
+
+    int64_t           mask;             /* capacity - 1             */
+    volatile int64_t *items;
+    uint8_t           pad2[RI_WS_DEQUE_CACHELINE - sizeof(int64_t) -
+                           sizeof(int64_t *)];
+
+} ri_ws_deque_t;
+
+/*
+ * Creates a deque which can hold at least `capacity' items.
+ */
+extern ri_ws_deque_t *ri_ws_deque_new (
+                            int64_t         capacity);      /* [in]  */
+
+extern void           ri_ws_deque_free(
+                            ri_ws_deque_t  *deque);         /* [in]  */
+
+/*
+ * Owner only. Returns 0 on success, -1 if the deque is full.
+ */
+extern int            ri_ws_deque_push(
+                            ri_ws_deque_t  *deque,          /* [inout] */
+                            int64_t         item);          /* [in]    */
+
+/*
+ * Owner only. Returns 0 on success, -1 if the deque is empty.
+ */
+extern int            ri_ws_deque_pop (
+                            ri_ws_deque_t  *deque,          /* [inout] */
+                            int64_t        *item_out);      /* [out]   */
+
+/*
+ * Any thread. Returns 0 on success, -1 if the deque is empty and 1 if the
+ * item was taken by another thread concurrently(caller may retry).
+ */
+extern int            ri_ws_deque_steal(
+                            ri_ws_deque_t  *deque,          /* [inout] */
+                            int64_t        *item_out);      /* [out]   */
+
+/*
+ * Any thread. Returns the number of items in the deque. The value may be
+ * stale when other threads operate on the deque concurrently.
+ */
+extern int64_t        ri_ws_deque_size(
+                            const ri_ws_deque_t *deque);    /* [in]    */
+
+#ifdef __cplusplus
+}    /* extern "C" */
+#endif
+
+#endif  /* LUCILLE_WSDEQUE_H */
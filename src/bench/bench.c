@@ -0,0 +1,894 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Microbenchmark for spatial accelerators.
+ *
+ *   Loads OBJ scenes, builds each accelerator and measures build time,
+ *   bytes allocated during the build and ray throughput for the following
+ *   ray distributions, in single ray and packet(stream) mode:
+ *
+ *     primary  : camera rays, ordered in 4x4 pixel tiles.
+ *     shadow   : rays toward a directional light from primary hit points.
+ *     diffuse  : cosine distributed rays from primary hit points(closest hit).
+ *     ao       : same as diffuse, but any-hit query with short distance.
+ *
+ *   Results are written in CSV(default) or JSON so that they can be
+ *   compared between releases.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(LINUX) || defined(__MACH__)
+#include <unistd.h>
+#endif
+
+#include "vector.h"
+#include "memory.h"
+#include "timer.h"
+#include "thread.h"
+#include "atomic.h"
+#include "random.h"
+#include "log.h"
+#include "geom.h"
+#include "scene.h"
+#include "accel.h"
+#include "raytrace.h"
+#include "reflection.h"
+#include "render.h"
+#include "option.h"
+#include "profile.h"
+
+#define BENCH_CHUNK_SIZE        (1024)      /* rays per job             */
+#define BENCH_TILE_SIZE         (4)         /* primary ray ordering     */
+#define BENCH_RAY_EPSILON       (1.0e-4)    /* relative to scene size   */
+
+enum {
+    BENCH_RAY_PRIMARY = 0,
+    BENCH_RAY_SHADOW,
+    BENCH_RAY_DIFFUSE,
+    BENCH_RAY_AO,
+    BENCH_RAY_NDISTRIBUTIONS
+};
+
+static const char *ray_names[BENCH_RAY_NDISTRIBUTIONS] = {
+    "primary", "shadow", "diffuse", "ao"
+};
+
+/* Closest hit or any-hit query for each distribution. */
+static const int ray_occluded[BENCH_RAY_NDISTRIBUTIONS] = {
+    0, 1, 0, 1
+};
+
+/*
+ * Accelerators to be measured.
+ */
+typedef struct _bench_method_t {
+
+    const char     *name;
+    int             method;         /* RI_ACCEL_*                       */
+    int             traceable;      /* 0 = measure construction only    */
+
+} bench_method_t;
+
+static const bench_method_t methods[] = {
+    { "bvh",   RI_ACCEL_BVH,   1 },
+    { "ugrid", RI_ACCEL_UGRID, 0 },     /* ri_ugrid_intersect() is a stub */
+};
+
+#define BENCH_NMETHODS  (int)(sizeof(methods) / sizeof(bench_method_t))
+
+typedef struct _bench_rays_t {
+
+    ri_ray_t       *rays;
+    int             nrays;
+    ri_float_t      tmax;           /* for any-hit query    */
+
+} bench_rays_t;
+
+/*
+ * Shared state of one measurement.
+ */
+typedef struct _bench_job_t {
+
+    bench_rays_t   *rays;
+    int             occluded;
+    int             packet;
+
+    int             next;           /* next ray to be traced. atomic */
+
+} bench_job_t;
+
+typedef struct _bench_worker_t {
+
+    int                      id;
+    bench_job_t             *job;
+    ri_intersection_state_t *states;        /* [BENCH_CHUNK_SIZE]   */
+    int                     *hits;          /* [BENCH_CHUNK_SIZE]   */
+    uint64_t                 nhits;
+
+} bench_worker_t;
+
+typedef struct _bench_config_t {
+
+    int             width;
+    int             height;
+    int             nsamples;       /* secondary rays per hit point */
+    int             nthreads;
+    int             niterations;    /* best of N                    */
+    int             json;
+    const char     *accel;          /* NULL = all                   */
+
+} bench_config_t;
+
+static int          load_obj        (ri_scene_t          *scene,
+                                     const char          *filename,
+                                     uint64_t            *ntriangles_out);
+static void         scene_bbox      (ri_scene_t          *scene,
+                                     ri_vector_t          center,
+                                     ri_float_t          *width);
+static void         gen_primary     (bench_rays_t        *out,
+                                     const ri_vector_t    center,
+                                     ri_float_t           width,
+                                     int                  imgw,
+                                     int                  imgh);
+static void         gen_secondary   (bench_rays_t         out[BENCH_RAY_NDISTRIBUTIONS],
+                                     ri_render_t         *render,
+                                     ri_float_t           width,
+                                     int                  nsamples);
+static double       run             (bench_job_t         *job,
+                                     int                  nthreads,
+                                     uint64_t            *nhits_out);
+static void         report          (FILE                *fp,
+                                     const bench_config_t *config,
+                                     const char          *scene,
+                                     uint64_t             ntriangles,
+                                     const char          *accel,
+                                     double               build_time,
+                                     uint64_t             build_bytes,
+                                     const char          *rayname,
+                                     const char          *mode,
+                                     int                  nthreads,
+                                     int                  nrays,
+                                     uint64_t             nhits,
+                                     double               elapsed);
+
+static int          gnreports = 0;
+
+
+static void
+usage(const char *progname)
+{
+    fprintf(stderr,
+        "Usage: %s [options] scene.obj ...\n"
+        "\n"
+        "  -a bvh|ugrid|all  Accelerator to measure(default: all)\n"
+        "  -r WxH            Resolution of primary rays(default: 512x512)\n"
+        "  -s N              Secondary rays per hit point(default: 4)\n"
+        "  -t N              Max number of threads(default: # of CPUs)\n"
+        "  -n N              Take the best of N runs(default: 3)\n"
+        "  -f csv|json       Output format(default: csv)\n"
+        "  -o file           Output file(default: stdout)\n",
+        progname);
+}
+
+static int
+ncpus()
+{
+#if defined(LINUX) || defined(__MACH__)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n > 0) return (int)n;
+#endif
+
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    int             i, k, m, d, p, t;
+    int             nthreads_list[2];
+    int             nthreads_count;
+    const char     *outname = NULL;
+    FILE           *fp;
+    bench_config_t  config;
+    ri_render_t    *render;
+    ri_scene_t     *scene;
+    ri_list_t      *itr;
+    ri_timer_t     *tm;
+    ri_mem_stat_t   mstat0, mstat1;
+    ri_vector_t     center;
+    ri_float_t      width;
+    uint64_t        ntriangles;
+    uint64_t        nhits = 0;
+    double          build_time;
+    double          elapsed;
+    bench_rays_t    rays[BENCH_RAY_NDISTRIBUTIONS];
+    bench_job_t     job;
+
+    config.width       = 512;
+    config.height      = 512;
+    config.nsamples    = 4;
+    config.nthreads    = ncpus();
+    config.niterations = 3;
+    config.json        = 0;
+    config.accel       = NULL;
+
+    for (i = 1; i < argc; i++) {
+
+        if (argv[i][0] != '-') break;
+
+        if ((i + 1) >= argc) {
+            usage(argv[0]);
+            exit(1);
+        }
+
+        switch (argv[i][1]) {
+        case 'a':
+            i++;
+            config.accel = (strcmp(argv[i], "all") == 0) ? NULL : argv[i];
+            break;
+        case 'r':
+            i++;
+            if (sscanf(argv[i], "%dx%d", &config.width, &config.height) != 2) {
+                config.height = config.width;
+            }
+            break;
+        case 's':
+            config.nsamples = atoi(argv[++i]);
+            break;
+        case 't':
+            config.nthreads = atoi(argv[++i]);
+            break;
+        case 'n':
+            config.niterations = atoi(argv[++i]);
+            break;
+        case 'f':
+            config.json = (strcmp(argv[++i], "json") == 0);
+            break;
+        case 'o':
+            outname = argv[++i];
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (i >= argc) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (config.nthreads < 1)              config.nthreads = 1;
+    if (config.nthreads > RI_MAX_THREADS) config.nthreads = RI_MAX_THREADS;
+    if (config.niterations < 1)           config.niterations = 1;
+    if (config.nsamples < 1)              config.nsamples = 1;
+
+    nthreads_list[0] = 1;
+    nthreads_list[1] = config.nthreads;
+    nthreads_count   = (config.nthreads > 1) ? 2 : 1;
+
+    fp = stdout;
+    if (outname) {
+        fp = fopen(outname, "w");
+        if (!fp) {
+            fprintf(stderr, "Can't open file [ %s ]\n", outname);
+            exit(1);
+        }
+    }
+
+    /* Keep stdout clean for the result. */
+    ri_log_set_level(RI_LOG_LEVEL_WARN);
+
+    ri_render_init();
+
+    render = ri_render_get();
+
+    seedMT(5489UL);
+
+    if (config.json) {
+        fprintf(fp, "[\n");
+    } else {
+        fprintf(fp, "scene,ntriangles,accel,build_sec,build_mb,"
+                    "rays,mode,nthreads,nrays,nhits,sec,mrays_per_sec\n");
+    }
+
+    for (; i < argc; i++) {
+
+        scene         = ri_scene_new();
+        render->scene = scene;
+
+        if (load_obj(scene, argv[i], &ntriangles) != 0) {
+            fprintf(stderr, "Can't load scene [ %s ]\n", argv[i]);
+            continue;
+        }
+
+        scene_bbox(scene, center, &width);
+
+        for (m = 0; m < BENCH_NMETHODS; m++) {
+
+            if (config.accel && strcmp(config.accel, methods[m].name) != 0) {
+                continue;
+            }
+
+            /*
+             * Build
+             */
+            render->context->option->accel_method = methods[m].method;
+
+            tm = ri_timer_new();
+
+            ri_mem_get_stat(&mstat0);
+            ri_timer_start(tm, "Build");
+
+            ri_scene_setup(scene);
+
+            ri_timer_end(tm, "Build");
+            ri_mem_get_stat(&mstat1);
+
+            build_time = ri_timer_elapsed(tm, "Build");
+
+            ri_timer_free(tm);
+
+            if (!methods[m].traceable) {
+
+                report(fp, &config,
+                       argv[i], ntriangles,
+                       methods[m].name, build_time,
+                       mstat1.nbytes - mstat0.nbytes,
+                       "none", "none", 1, 0, 0, 0.0);
+
+                scene->accel->free(scene->accel->data);
+                scene->accel->data = NULL;
+                scene->accel->free = NULL;
+
+                continue;
+            }
+
+            /*
+             * Rays. Secondary rays are spawned from the hit points of
+             * primary rays, thus they depend on the accelerator only by
+             * numerical errors.
+             */
+            gen_primary(&rays[BENCH_RAY_PRIMARY], center, width,
+                        config.width, config.height);
+            gen_secondary(rays, render, width, config.nsamples);
+
+            for (d = 0; d < BENCH_RAY_NDISTRIBUTIONS; d++) {
+                for (p = 0; p < 2; p++) {
+                    for (t = 0; t < nthreads_count; t++) {
+
+                        double best = 0.0;
+
+                        job.rays     = &rays[d];
+                        job.occluded = ray_occluded[d];
+                        job.packet   = p;
+
+                        for (k = 0; k < config.niterations; k++) {
+                            elapsed = run(&job, nthreads_list[t], &nhits);
+                            if ((k == 0) || (elapsed < best)) best = elapsed;
+                        }
+
+                        report(fp, &config,
+                               argv[i], ntriangles,
+                               methods[m].name, build_time,
+                               mstat1.nbytes - mstat0.nbytes,
+                               ray_names[d], p ? "packet" : "single",
+                               nthreads_list[t],
+                               rays[d].nrays, nhits, best);
+                    }
+                }
+            }
+
+            for (d = 0; d < BENCH_RAY_NDISTRIBUTIONS; d++) {
+                ri_mem_free(rays[d].rays);
+            }
+
+            scene->accel->free(scene->accel->data);
+            scene->accel->data = NULL;
+            scene->accel->free = NULL;
+        }
+
+        for (itr  = ri_list_first(scene->geom_list);
+             itr != NULL;
+             itr  = ri_list_next(itr)) {
+            ri_geom_free((ri_geom_t *)itr->data);
+        }
+
+        ri_scene_free(scene);
+        render->scene = NULL;
+    }
+
+    if (config.json) {
+        fprintf(fp, "\n]\n");
+    }
+
+    if (fp != stdout) fclose(fp);
+
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ *
+ * Private functions
+ *
+ * ------------------------------------------------------------------------ */
+
+static void
+report(
+    FILE                 *fp,
+    const bench_config_t *config,
+    const char           *scene,
+    uint64_t              ntriangles,
+    const char           *accel,
+    double                build_time,
+    uint64_t              build_bytes,
+    const char           *rayname,
+    const char           *mode,
+    int                   nthreads,
+    int                   nrays,
+    uint64_t              nhits,
+    double                elapsed)
+{
+    double mb     = build_bytes / (1024.0 * 1024.0);
+    double mrays  = (elapsed > 0.0) ? (nrays / elapsed) / 1.0e6 : 0.0;
+
+    if (config->json) {
+
+        fprintf(fp, "%s  {\"scene\": \"%s\", \"ntriangles\": %llu, "
+                    "\"accel\": \"%s\", \"build_sec\": %f, "
+                    "\"build_mb\": %f, \"rays\": \"%s\", \"mode\": \"%s\", "
+                    "\"nthreads\": %d, \"nrays\": %d, \"nhits\": %llu, "
+                    "\"sec\": %f, \"mrays_per_sec\": %f}",
+            (gnreports > 0) ? ",\n" : "",
+            scene, (unsigned long long)ntriangles,
+            accel, build_time, mb, rayname, mode,
+            nthreads, nrays, (unsigned long long)nhits,
+            elapsed, mrays);
+
+    } else {
+
+        fprintf(fp, "%s,%llu,%s,%f,%f,%s,%s,%d,%d,%llu,%f,%f\n",
+            scene, (unsigned long long)ntriangles,
+            accel, build_time, mb, rayname, mode,
+            nthreads, nrays, (unsigned long long)nhits,
+            elapsed, mrays);
+
+    }
+
+    fflush(fp);
+
+    gnreports++;
+}
+
+/*
+ * Loads vertices and faces of OBJ. Polygons are triangulated as fans.
+ */
+static int
+load_obj(
+    ri_scene_t *scene,
+    const char *filename,
+    uint64_t   *ntriangles_out)
+{
+    FILE         *fp;
+    char          line[4096];
+    char         *s, *tok;
+    int           idx[64];
+    int           n, k;
+    unsigned int  npositions = 0, maxpositions = 1024;
+    unsigned int  nindices   = 0, maxindices   = 1024;
+    ri_vector_t  *positions;
+    unsigned int *indices;
+    ri_geom_t    *geom;
+
+    fp = fopen(filename, "r");
+    if (!fp) return -1;
+
+    positions = (ri_vector_t *)malloc(sizeof(ri_vector_t) * maxpositions);
+    indices   = (unsigned int *)malloc(sizeof(unsigned int) * maxindices);
+
+    while (fgets(line, sizeof(line), fp)) {
+
+        if ((line[0] == 'v') && (line[1] == ' ')) {
+
+            if (npositions == maxpositions) {
+                maxpositions *= 2;
+                positions = (ri_vector_t *)realloc(positions,
+                                sizeof(ri_vector_t) * maxpositions);
+            }
+
+            positions[npositions][0] = 0.0;
+            positions[npositions][1] = 0.0;
+            positions[npositions][2] = 0.0;
+            positions[npositions][3] = 1.0;
+
+            sscanf(line + 2, "%lf %lf %lf",
+                   &positions[npositions][0],
+                   &positions[npositions][1],
+                   &positions[npositions][2]);
+
+            npositions++;
+
+        } else if ((line[0] == 'f') && (line[1] == ' ')) {
+
+            /* "f v v v", "f v/vt v/vt v/vt", "f v//vn ..", etc. */
+            n = 0;
+            s = line + 2;
+            while ((n < 64) && (tok = strtok(s, " \t\r\n"))) {
+                s      = NULL;
+                idx[n] = atoi(tok);
+                if (idx[n] < 0) idx[n] += npositions;   /* relative */
+                else            idx[n] -= 1;
+                n++;
+            }
+
+            for (k = 1; k + 1 < n; k++) {
+
+                if (nindices + 3 > maxindices) {
+                    maxindices *= 2;
+                    indices = (unsigned int *)realloc(indices,
+                                  sizeof(unsigned int) * maxindices);
+                }
+
+                indices[nindices++] = idx[0];
+                indices[nindices++] = idx[k];
+                indices[nindices++] = idx[k + 1];
+            }
+        }
+    }
+
+    fclose(fp);
+
+    if ((npositions == 0) || (nindices == 0)) {
+        free(positions);
+        free(indices);
+        return -1;
+    }
+
+    geom = ri_geom_new();
+    ri_geom_add_positions(geom, npositions, positions);
+    ri_geom_add_indices(geom, nindices, indices);
+
+    ri_scene_add_geom(scene, geom);
+
+    free(positions);
+    free(indices);
+
+    (*ntriangles_out) = nindices / 3;
+
+    return 0;
+}
+
+static void
+scene_bbox(
+    ri_scene_t *scene,
+    ri_vector_t center,
+    ri_float_t *width)
+{
+    unsigned int i;
+    int          k;
+    ri_vector_t  bmin, bmax;
+    ri_list_t   *itr;
+    ri_geom_t   *geom;
+
+    ri_vector_set1(bmin,  RI_INFINITY);
+    ri_vector_set1(bmax, -RI_INFINITY);
+
+    for (itr  = ri_list_first(scene->geom_list);
+         itr != NULL;
+         itr  = ri_list_next(itr)) {
+
+        geom = (ri_geom_t *)itr->data;
+
+        for (i = 0; i < geom->npositions; i++) {
+            vmin(bmin, bmin, geom->positions[i]);
+            vmax(bmax, bmax, geom->positions[i]);
+        }
+    }
+
+    (*width) = 0.0;
+    for (k = 0; k < 3; k++) {
+        center[k] = 0.5 * (bmin[k] + bmax[k]);
+        if ((bmax[k] - bmin[k]) > (*width)) (*width) = bmax[k] - bmin[k];
+    }
+}
+
+static void
+setup_ray(
+    ri_ray_t          *ray,
+    const ri_vector_t  org,
+    const ri_vector_t  dir)
+{
+    memset(ray, 0, sizeof(ri_ray_t));
+
+    ri_vector_copy(ray->org, org);
+    ri_vector_copy(ray->dir, dir);
+    ri_vector_normalize(ray->dir);
+}
+
+/*
+ * Pinhole camera looking at the center of the scene. Rays are stored
+ * in 4x4 pixel tiles so that consecutive rays form coherent packets.
+ */
+static void
+gen_primary(
+    bench_rays_t      *out,
+    const ri_vector_t  center,
+    ri_float_t         width,
+    int                imgw,
+    int                imgh)
+{
+    int         x, y, tx, ty;
+    int         n = 0;
+    ri_float_t  flen;
+    ri_vector_t eye, dir;
+
+    out->rays  = (ri_ray_t *)ri_mem_alloc(sizeof(ri_ray_t) * imgw * imgh);
+    out->tmax  = RI_INFINITY;
+
+    eye[0] = center[0];
+    eye[1] = center[1];
+    eye[2] = center[2] + 2.0 * width;
+    eye[3] = 1.0;
+
+    /* fov = 45 degree. */
+    flen = 0.5 * imgw / tan(0.5 * (45.0 * M_PI / 180.0));
+
+    for (ty = 0; ty < imgh; ty += BENCH_TILE_SIZE) {
+        for (tx = 0; tx < imgw; tx += BENCH_TILE_SIZE) {
+            for (y = ty; (y < ty + BENCH_TILE_SIZE) && (y < imgh); y++) {
+                for (x = tx; (x < tx + BENCH_TILE_SIZE) && (x < imgw); x++) {
+
+                    dir[0] =  (x + 0.5) - 0.5 * imgw;
+                    dir[1] = -(y + 0.5) + 0.5 * imgh;
+                    dir[2] = -flen;
+                    dir[3] =  0.0;
+
+                    setup_ray(&out->rays[n], eye, dir);
+                    n++;
+                }
+            }
+        }
+    }
+
+    out->nrays = n;
+}
+
+/*
+ * Traces primary rays once, then spawns shadow, diffuse and AO rays from
+ * the hit points.
+ */
+static void
+gen_secondary(
+    bench_rays_t  out[BENCH_RAY_NDISTRIBUTIONS],
+    ri_render_t  *render,
+    ri_float_t    width,
+    int           nsamples)
+{
+    int                      i, j, k;
+    int                      nhits;
+    ri_float_t               eps;
+    ri_float_t               r, phi;
+    ri_vector_t              light_dir;
+    ri_vector_t              N, org, dir, local;
+    ri_vector_t              basis[3];
+    ri_intersection_state_t  state;
+    ri_ray_t                 ray;
+    bench_rays_t            *primary = &out[BENCH_RAY_PRIMARY];
+
+    eps = BENCH_RAY_EPSILON * width;
+
+    ri_vector_set4(light_dir, 0.3, 1.0, 0.2, 0.0);
+    ri_vector_normalize(light_dir);
+
+    out[BENCH_RAY_SHADOW].rays  = (ri_ray_t *)ri_mem_alloc(
+                                      sizeof(ri_ray_t) * primary->nrays);
+    out[BENCH_RAY_SHADOW].nrays = 0;
+    out[BENCH_RAY_SHADOW].tmax  = RI_INFINITY;
+
+    out[BENCH_RAY_DIFFUSE].rays  = (ri_ray_t *)ri_mem_alloc(
+                                       sizeof(ri_ray_t) * primary->nrays *
+                                       nsamples);
+    out[BENCH_RAY_DIFFUSE].nrays = 0;
+    out[BENCH_RAY_DIFFUSE].tmax  = RI_INFINITY;
+
+    out[BENCH_RAY_AO].rays  = (ri_ray_t *)ri_mem_alloc(
+                                  sizeof(ri_ray_t) * primary->nrays *
+                                  nsamples);
+    out[BENCH_RAY_AO].nrays = 0;
+    out[BENCH_RAY_AO].tmax  = 0.25 * width;
+
+    nhits = 0;
+
+    for (i = 0; i < primary->nrays; i++) {
+
+        ray = primary->rays[i];
+        ray.has_differentials = 0;
+
+        if (!ri_raytrace(render, &ray, &state)) continue;
+
+        nhits++;
+
+        /* Face forward. */
+        ri_vector_copy(N, state.Ng);
+        ri_vector_normalize(N);
+        if (vdot(N, primary->rays[i].dir) > 0.0) {
+            ri_vector_neg(N);
+        }
+
+        for (k = 0; k < 3; k++) {
+            org[k] = state.P[k] + eps * N[k];
+        }
+        org[3] = 1.0;
+
+        setup_ray(&out[BENCH_RAY_SHADOW].rays[out[BENCH_RAY_SHADOW].nrays++],
+                  org, light_dir);
+
+        ri_ortho_basis(basis, N);
+
+        for (j = 0; j < nsamples; j++) {
+
+            /* Cosine weighted. */
+            r   = sqrt(randomMT());
+            phi = 2.0 * M_PI * randomMT();
+
+            local[0] = r * cos(phi);
+            local[1] = r * sin(phi);
+            local[2] = sqrt(1.0 - r * r);
+
+            for (k = 0; k < 3; k++) {
+                dir[k] = local[0] * basis[0][k] +
+                         local[1] * basis[1][k] +
+                         local[2] * basis[2][k];
+            }
+            dir[3] = 0.0;
+
+            setup_ray(
+                &out[BENCH_RAY_DIFFUSE].rays[out[BENCH_RAY_DIFFUSE].nrays++],
+                org, dir);
+            setup_ray(
+                &out[BENCH_RAY_AO].rays[out[BENCH_RAY_AO].nrays++],
+                org, dir);
+        }
+    }
+
+    if (nhits == 0) {
+        fprintf(stderr, "Warning: no primary ray hits the scene.\n");
+    }
+}
+
+static void *
+worker(void *arg)
+{
+    int              i, n, begin;
+    bench_worker_t  *w   = (bench_worker_t *)arg;
+    bench_job_t     *job = w->job;
+    ri_render_t     *render = ri_render_get();
+    ri_ray_t        *rays;
+
+    w->nhits = 0;
+
+    ri_prof_set_thread(w->id);
+
+    while (1) {
+
+        begin = ri_atomic_add(&job->next, BENCH_CHUNK_SIZE);
+        if (begin >= job->rays->nrays) break;
+
+        n = job->rays->nrays - begin;
+        if (n > BENCH_CHUNK_SIZE) n = BENCH_CHUNK_SIZE;
+
+        rays = job->rays->rays + begin;
+
+        for (i = 0; i < n; i++) {
+            rays[i].thread_num        = w->id;
+            rays[i].has_differentials = 0;
+            rays[i].time              = 0.0f;
+        }
+
+        if (job->packet) {
+
+            if (job->occluded) {
+                w->nhits += ri_raytrace_stream_occluded(
+                                render, rays, n,
+                                0.0, job->rays->tmax, NULL);
+            } else {
+                w->nhits += ri_raytrace_stream(
+                                render, rays, n, w->states, w->hits);
+            }
+
+        } else {
+
+            for (i = 0; i < n; i++) {
+
+                if (job->occluded) {
+                    w->nhits += ri_raytrace_occluded(
+                                    render, &rays[i], 0.0, job->rays->tmax);
+                } else {
+                    w->nhits += ri_raytrace(render, &rays[i], &w->states[0]);
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Traces all rays of the job with `nthreads' threads and returns the
+ * elapsed time in seconds.
+ */
+static double
+run(
+    bench_job_t *job,
+    int          nthreads,
+    uint64_t    *nhits_out)
+{
+    int             i;
+    double          elapsed;
+    ri_timer_t     *tm;
+    ri_thread_t     threads[RI_MAX_THREADS];
+    bench_worker_t  workers[RI_MAX_THREADS];
+
+    for (i = 0; i < nthreads; i++) {
+        workers[i].id     = i;
+        workers[i].job    = job;
+        workers[i].states = (ri_intersection_state_t *)ri_mem_alloc(
+                                sizeof(ri_intersection_state_t) *
+                                BENCH_CHUNK_SIZE);
+        workers[i].hits   = (int *)ri_mem_alloc(sizeof(int) *
+                                                BENCH_CHUNK_SIZE);
+    }
+
+    job->next = 0;
+
+    tm = ri_timer_new();
+
+    ri_timer_start(tm, "Trace");
+
+    if (nthreads == 1) {
+
+        worker(&workers[0]);
+
+    } else {
+
+        for (i = 0; i < nthreads; i++) {
+            ri_thread_create(&threads[i], worker, &workers[i]);
+        }
+
+        for (i = 0; i < nthreads; i++) {
+            ri_thread_join(&threads[i]);
+        }
+    }
+
+    ri_timer_end(tm, "Trace");
+
+    elapsed = ri_timer_elapsed(tm, "Trace");
+
+    ri_timer_free(tm);
+
+    (*nhits_out) = 0;
+
+    for (i = 0; i < nthreads; i++) {
+        (*nhits_out) += workers[i].nhits;
+        ri_mem_free(workers[i].states);
+        ri_mem_free(workers[i].hits);
+    }
+
+    return elapsed;
+}
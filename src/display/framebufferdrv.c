@@ -36,12 +36,15 @@
 #include <string.h>
 
 #include "memory.h"
+#include "thread.h"
 #include "framebufferdrv.h"
 
 static char *gbuf;
 static char *gmask;
 static int   gwidth, gheight;
 
+static ri_mutex_t *gmutex = NULL;	/* guards fb_dd_write() */
+
 #ifdef WIN32
 static int       gactive = 1;
 static HWND      ghwnd  = NULL;
@@ -310,6 +313,9 @@ fb_dd_open(const char *name, int width, int height,
 	gwidth     = width;	
 	gheight    = height;
 
+	gmutex = ri_mutex_new();
+	ri_mutex_init(gmutex);
+
 #ifdef WIN32
 	gbuf  = (char *)ri_mem_alloc(width * height * 4);
 	gmask = (char *)ri_mem_alloc(width * height);
@@ -519,6 +525,76 @@ fb_dd_write(int x, int y, const void *pixel)
 	return 1;
 }
 
+/*
+ * Thread-safe. Converts float pixels to 8-bit and writes them under the
+ * driver's lock.
+ */
+int
+fb_dd_write_bucket(int x, int y, int w, int h,
+		   const float *rgba, int stride)
+{
+	int           i, j;
+	const float  *src;
+	unsigned char col[3];
+
+	if (gmutex == NULL) return 0;
+
+	ri_mutex_lock(gmutex);
+
+	for (j = 0; j < h; j++) {
+
+		src = rgba + j * stride;
+
+		for (i = 0; i < w; i++, src += 4) {
+
+			col[0] = (unsigned char)(src[0] * 255.0);
+			col[1] = (unsigned char)(src[1] * 255.0);
+			col[2] = (unsigned char)(src[2] * 255.0);
+
+			fb_dd_write(x + i, y + j, col);
+		}
+	}
+
+	ri_mutex_unlock(gmutex);
+
+	return 1;
+}
+
+/*
+ * Overwriting version of fb_dd_write_bucket(). Pixels are marked as not
+ * written yet so that fb_dd_write() replaces them.
+ */
+int
+fb_dd_update_bucket(int x, int y, int w, int h,
+		    const float *rgba, int stride)
+{
+#if defined(WIN32) || defined(WITH_X11)
+	int           i, j;
+
+	if (gmutex == NULL) return 0;
+
+	ri_mutex_lock(gmutex);
+
+	for (j = 0; j < h; j++) {
+
+		if (y + j < 0) continue;
+		if (y + j >= gheight) continue;
+
+		for (i = 0; i < w; i++) {
+
+			if (x + i < 0) continue;
+			if (x + i >= gwidth) continue;
+
+			gmask[(x + i) + (gheight - (y + j) - 1) * gwidth] = 1;
+		}
+	}
+
+	ri_mutex_unlock(gmutex);
+#endif
+
+	return fb_dd_write_bucket(x, y, w, h, rgba, stride);
+}
+
 int
 fb_dd_close(void)
 {
@@ -572,6 +648,11 @@ fb_dd_close(void)
 
 	ri_mem_free(gmask);
 
+	if (gmutex) {
+		ri_mutex_free(gmutex);
+		gmutex = NULL;
+	}
+
 	return 1;
 }
 
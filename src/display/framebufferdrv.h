@@ -15,6 +15,10 @@ extern "C" {
 int fb_dd_open(const char *name, int width, int height,
 		 int bits, RtToken component, const char *format);
 int fb_dd_write(int x, int y, const void *pixel);
+int fb_dd_write_bucket(int x, int y, int w, int h,
+		       const float *rgba, int stride);
+int fb_dd_update_bucket(int x, int y, int w, int h,
+		        const float *rgba, int stride);
 int fb_dd_close(void);
 int fb_dd_progress(void);
 
@@ -87,6 +87,76 @@ hdr_dd_write(int x, int y, const void *pixel)
 	return 1;
 }
 
+/*
+ * Buckets never overlap each other, thus this can be called concurrently
+ * without a lock.
+ */
+int
+hdr_dd_write_bucket(int x, int y, int w, int h,
+		    const float *rgba, int stride)
+{
+	int          i, j;
+	int          index;
+	const float *src;
+
+	for (j = 0; j < h; j++) {
+
+		if (y + j < 0) continue;
+		if (y + j >= gheight) continue;
+
+		src = rgba + j * stride;
+
+		for (i = 0; i < w; i++, src += 4) {
+
+			if (x + i < 0) continue;
+			if (x + i >= gwidth) continue;
+
+			index = 3 * ((x + i) + (y + j) * gwidth);
+
+			/* additive pixel writing */
+			if (src[0] > 0.0) gbuf[index + 0] += src[0];
+			if (src[1] > 0.0) gbuf[index + 1] += src[1];
+			if (src[2] > 0.0) gbuf[index + 2] += src[2];
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Overwriting version of hdr_dd_write_bucket().
+ */
+int
+hdr_dd_update_bucket(int x, int y, int w, int h,
+		     const float *rgba, int stride)
+{
+	int          i, j;
+	int          index;
+	const float *src;
+
+	for (j = 0; j < h; j++) {
+
+		if (y + j < 0) continue;
+		if (y + j >= gheight) continue;
+
+		src = rgba + j * stride;
+
+		for (i = 0; i < w; i++, src += 4) {
+
+			if (x + i < 0) continue;
+			if (x + i >= gwidth) continue;
+
+			index = 3 * ((x + i) + (y + j) * gwidth);
+
+			gbuf[index + 0] = (src[0] > 0.0) ? src[0] : 0.0;
+			gbuf[index + 1] = (src[1] > 0.0) ? src[1] : 0.0;
+			gbuf[index + 2] = (src[2] > 0.0) ? src[2] : 0.0;
+		}
+	}
+
+	return 1;
+}
+
 int
 hdr_dd_close()
 {
@@ -14,6 +14,10 @@ extern "C" {
 int hdr_dd_open(const char *name, int width, int height,
 		 int bits, RtToken component, const char *format);
 int hdr_dd_write(int x, int y, const void *pixel);
+int hdr_dd_write_bucket(int x, int y, int w, int h,
+			const float *rgba, int stride);
+int hdr_dd_update_bucket(int x, int y, int w, int h,
+			 const float *rgba, int stride);
 int hdr_dd_close(void);
 int hdr_dd_progress(void);
 
@@ -115,6 +115,104 @@ openexr_dd_write(int x, int y, const void *pixel)
 	return 1;
 }
 
+/*
+ * Buckets never overlap each other, thus this can be called concurrently
+ * without a lock.
+ */
+int
+openexr_dd_write_bucket(int x, int y, int w, int h,
+			const float *rgba, int stride)
+{
+#if HAVE_OPENEXR
+	int          i, j;
+	int          index;
+	const float *src;
+	ImfHalf      hf[3];
+
+	for (j = 0; j < h; j++) {
+
+		if (y + j < 0) continue;
+		if (y + j >= gheight) continue;
+
+		src = rgba + j * stride;
+
+		for (i = 0; i < w; i++, src += 4) {
+
+			if (x + i < 0) continue;
+			if (x + i >= gwidth) continue;
+
+			index = (x + i) + (y + j) * gwidth;
+
+			ImfFloatToHalf(src[0], &hf[0]);
+			ImfFloatToHalf(src[1], &hf[1]);
+			ImfFloatToHalf(src[2], &hf[2]);
+
+			gbuf[index].r += hf[0];
+			gbuf[index].g += hf[1];
+			gbuf[index].b += hf[2];
+		}
+	}
+
+#else
+
+	(void)x;
+	(void)y;
+	(void)w;
+	(void)h;
+	(void)rgba;
+	(void)stride;
+
+#endif
+
+	return 1;
+}
+
+/*
+ * Overwriting version of openexr_dd_write_bucket().
+ */
+int
+openexr_dd_update_bucket(int x, int y, int w, int h,
+			 const float *rgba, int stride)
+{
+#if HAVE_OPENEXR
+	int          i, j;
+	int          index;
+	const float *src;
+
+	for (j = 0; j < h; j++) {
+
+		if (y + j < 0) continue;
+		if (y + j >= gheight) continue;
+
+		src = rgba + j * stride;
+
+		for (i = 0; i < w; i++, src += 4) {
+
+			if (x + i < 0) continue;
+			if (x + i >= gwidth) continue;
+
+			index = (x + i) + (y + j) * gwidth;
+
+			ImfFloatToHalf(src[0], &gbuf[index].r);
+			ImfFloatToHalf(src[1], &gbuf[index].g);
+			ImfFloatToHalf(src[2], &gbuf[index].b);
+		}
+	}
+
+#else
+
+	(void)x;
+	(void)y;
+	(void)w;
+	(void)h;
+	(void)rgba;
+	(void)stride;
+
+#endif
+
+	return 1;
+}
+
 int
 openexr_dd_close()
 {
@@ -15,6 +15,10 @@ extern "C" {
 int openexr_dd_open(const char *name, int width, int height,
 		    int bits, RtToken component, const char *format);
 int openexr_dd_write(int x, int y, const void *pixel);
+int openexr_dd_write_bucket(int x, int y, int w, int h,
+			    const float *rgba, int stride);
+int openexr_dd_update_bucket(int x, int y, int w, int h,
+			     const float *rgba, int stride);
 int openexr_dd_close(void);
 int openexr_dd_progress(void);
 
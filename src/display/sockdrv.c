@@ -29,6 +29,7 @@ WSADATA   wsa;
 #endif
 
 #include "memory.h"
+#include "thread.h"
 #include "sockdrv.h"
 #include "log.h"
 
@@ -43,6 +44,8 @@ static int gfd = 0;
 
 static int gcount = 0;
 
+static ri_mutex_t *gmutex = NULL;	/* guards gpackets and the socket */
+
 typedef struct _pixpacket
 {
 	int   x;
@@ -203,6 +206,9 @@ sock_dd_open(const char *name, int width, int height,
 	send(gfd, (char *)&len, sizeof(int), 0);
 	send(gfd, (char *)&info, len, 0);
 
+	gmutex = ri_mutex_new();
+	ri_mutex_init(gmutex);
+
 	(void)name;
 	(void)bits;
 	(void)component;
@@ -247,6 +253,30 @@ sock_dd_write(int x, int y, const void *pixel)
 	return 1;
 }
 
+/*
+ * Thread-safe. Pixels are packed under the driver's lock.
+ */
+int
+sock_dd_write_bucket(int x, int y, int w, int h,
+		     const float *rgba, int stride)
+{
+	int i, j;
+
+	if (gfd == 0) return 0;
+
+	ri_mutex_lock(gmutex);
+
+	for (j = 0; j < h; j++) {
+		for (i = 0; i < w; i++) {
+			sock_dd_write(x + i, y + j, &rgba[j * stride + 4 * i]);
+		}
+	}
+
+	ri_mutex_unlock(gmutex);
+
+	return 1;
+}
+
 int
 sock_dd_close()
 {
@@ -255,6 +285,11 @@ sock_dd_close()
 	comm = COMMAND_FINISH;
 	send(gfd, (char *)&comm, sizeof(int), 0);
 
+	if (gmutex) {
+		ri_mutex_free(gmutex);
+		gmutex = NULL;
+	}
+
 
 #ifdef WIN32
 	closesocket(gfd);
@@ -14,6 +14,8 @@ extern "C" {
 int sock_dd_open(const char *name, int width, int height,
 		 int bits, RtToken component, const char *format);
 int sock_dd_write(int x, int y, const void *pixel);
+int sock_dd_write_bucket(int x, int y, int w, int h,
+			 const float *rgba, int stride);
 int sock_dd_close();
 int sock_dd_progress();
 
@@ -12,6 +12,7 @@
 
 #include "ri.h"
 #include "array.h"
+#include "hash.h"
 #include "memory.h"
 #include "log.h"
 
@@ -38,6 +39,9 @@ RtToken        *rib_param_tokens      = NULL;
 RtPointer      *rib_param_args        = NULL;
 RtInt          *rib_param_arg_size    = NULL;
 
+/* RIB object handle(number or string) -> RtObjectHandle */
+static ri_hash_t   *object_handles = NULL;
+
 static const int    max_unknown_commands = 30;
 static int          nunknown_commands = 0;
 
@@ -61,6 +65,37 @@ static void strptrfree(void *data)
     ri_mem_free(p);
 }
 
+static void object_begin(const char *key)
+{
+    RtObjectHandle handle;
+
+    handle = RiObjectBegin();
+
+    if (handle == NULL) return;
+
+    if (object_handles == NULL) {
+        object_handles = ri_hash_new();
+    }
+
+    ri_hash_insert(object_handles, key, handle);
+}
+
+static void object_instance(const char *key)
+{
+    RtObjectHandle handle = NULL;
+
+    if (object_handles) {
+        handle = (RtObjectHandle)ri_hash_lookup(object_handles, key);
+    }
+
+    if (handle == NULL) {
+        ri_log(LOG_WARN, "ObjectInstance: undefined object \"%s\". line = %d\n", key, line_num);
+        return;
+    }
+
+    RiObjectInstance(handle);
+}
+
 static void enter_mode_param()
 {
     lexrib_mode_param = 1;
@@ -145,6 +180,7 @@ ri_ptr_array_t *paramarray;
 %token IMAGER
 %token LIGHTSOURCE
 %token MOTIONBEGIN MOTIONEND
+%token OBJECTBEGIN OBJECTEND OBJECTINSTANCE
 %token OPACITY
 %token OPTION
 %token ORIENTATION
@@ -524,6 +560,32 @@ protocol: ribversion NUM
 {
     RiMotionEnd();
 }
+| objectbegin NUM
+{
+    char key[64];
+
+    sprintf(key, "%d", (int)$2);
+    object_begin(key);
+}
+| objectbegin STRING
+{
+    object_begin($2);
+}
+| objectend
+{
+    RiObjectEnd();
+}
+| objectinstance NUM
+{
+    char key[64];
+
+    sprintf(key, "%d", (int)$2);
+    object_instance(key);
+}
+| objectinstance STRING
+{
+    object_instance($2);
+}
 | opacity param_num_array
 {
     int     i;
@@ -927,6 +989,12 @@ motionbegin             : MOTIONBEGIN           { enter_mode_param();    }
 ;
 motionend               : MOTIONEND             { enter_mode_param();    }
 ;
+objectbegin             : OBJECTBEGIN           { enter_mode_param();    }
+;
+objectend               : OBJECTEND             { enter_mode_param();    }
+;
+objectinstance          : OBJECTINSTANCE        { enter_mode_param();    }
+;
 opacity                 : OPACITY               { enter_mode_param();    }
 ;
 option                  : OPTION                { enter_mode_param();    }
@@ -17,6 +17,8 @@
 
 #include "ugrid.h"
 #include "bvh.h"
+#include "instance.h"
+#include "motionbvh.h"
 
 
 /* ---------------------------------------------------------------------------
@@ -85,7 +87,12 @@ ri_accel_bind(
 
             accel->build     = ri_ugrid_build;
             accel->free      = ri_ugrid_free;
+            accel->update    = NULL;
             accel->intersect = ri_ugrid_intersect;
+            accel->occluded  = NULL;
+
+            accel->intersect_packet = NULL;
+            accel->occluded_packet  = NULL;
 
             break;
 
@@ -95,7 +102,42 @@ ri_accel_bind(
 
             accel->build     = ri_bvh_build;
             accel->free      = ri_bvh_free;
+            accel->update    = ri_bvh_update;
             accel->intersect = ri_bvh_intersect;
+            accel->occluded  = ri_bvh_occluded;
+
+            accel->intersect_packet = ri_bvh_intersect_packet;
+            accel->occluded_packet  = ri_bvh_occluded_packet;
+
+            break;
+
+        case RI_ACCEL_BVH_INSTANCE:
+
+            ri_log(LOG_DEBUG, "(Accel ) Use two-level BVH accelerator");
+
+            accel->build     = ri_instance_bvh_build;
+            accel->free      = ri_instance_bvh_free;
+            accel->update    = NULL;
+            accel->intersect = ri_instance_bvh_intersect;
+            accel->occluded  = ri_instance_bvh_occluded;
+
+            accel->intersect_packet = NULL;
+            accel->occluded_packet  = NULL;
+
+            break;
+
+        case RI_ACCEL_BVH_MOTION:
+
+            ri_log(LOG_DEBUG, "(Accel ) Use motion BVH accelerator");
+
+            accel->build     = ri_motion_bvh_build;
+            accel->free      = ri_motion_bvh_free;
+            accel->update    = NULL;
+            accel->intersect = ri_motion_bvh_intersect;
+            accel->occluded  = ri_motion_bvh_occluded;
+
+            accel->intersect_packet = NULL;
+            accel->occluded_packet  = NULL;
 
             break;
 
@@ -105,5 +147,7 @@ ri_accel_bind(
             return -1;
     }
 
+    accel->method = method;
+
     return 0;
 }
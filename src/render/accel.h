@@ -19,6 +19,29 @@ extern "C" {
  */
 #define RI_ACCEL_UGRID          0
 #define RI_ACCEL_BVH            1
+#define RI_ACCEL_BVH_INSTANCE   2   /* two-level BVH. Selected by
+                                     * ri_scene_setup() if the scene
+                                     * has instances.               */
+#define RI_ACCEL_BVH_MOTION     3   /* BVH with bounds at shutter
+                                     * open and close. Selected by
+                                     * ri_scene_setup() if the scene
+                                     * has moving geometries.       */
+
+/*
+ * Precision of the geometry(node boxes and triangles) stored in the
+ * acceleration structure. Hit points and shading are always computed in
+ * ri_float_t.
+ */
+#define RI_ACCEL_PRECISION_DOUBLE   0
+#define RI_ACCEL_PRECISION_FLOAT    1   /* half the memory. BVH only.   */
+
+/*
+ * Default of "raytrace" "accel_rebuild_threshold" option. When an
+ * acceleration structure is updated for the next frame, a refitted subtree
+ * is rebuilt if its SAH cost grows by more than this factor from the cost
+ * at construction.
+ */
+#define RI_ACCEL_REBUILD_THRESHOLD_DEFAULT  1.5f
 
 
 typedef void *( *accel_build_func )
@@ -27,12 +50,43 @@ typedef void *( *accel_build_func )
 typedef void  ( *accel_free_func )
               ( void                    *accel);
 
+/*
+ * Returns 0 if the accel is updated to the scene `data', -1 if it must be
+ * rebuilt.
+ */
+typedef int   ( *accel_update_func )
+              ( void                    *accel,
+                const void              *data);
+
 typedef int   ( *accel_intersect_func )
               ( void                    *accel,
                 ri_ray_t                *ray,           /* [in]         */
                 ri_intersection_state_t *state,         /* [inout]      */
                 void                    *user );        /* user data    */
 
+typedef int   ( *accel_occluded_func )
+              ( void                    *accel,
+                ri_ray_t                *ray,           /* [in]         */
+                ri_float_t               tmin,
+                ri_float_t               tmax,
+                void                    *user );        /* user data    */
+
+/*
+ * Packet queries return the bit mask of rays which hit(i'th bit for i'th ray
+ * in the packet).
+ */
+typedef uint32_t ( *accel_intersect_packet_func )
+              ( void                    *accel,
+                ri_ray_packet_t         *packet,        /* [inout]      */
+                ri_intersection_state_t *states,        /* [out]        */
+                void                    *user );        /* user data    */
+
+typedef uint32_t ( *accel_occluded_packet_func )
+              ( void                    *accel,
+                ri_ray_packet_t         *packet,        /* [inout]      */
+                ri_float_t               tmin,
+                ri_float_t               tmax,
+                void                    *user );        /* user data    */
 
 
 /*
@@ -61,17 +115,40 @@ typedef struct _ri_accel_t
      */
     accel_free_func      free;
 
+    /*
+     * Updates the acceleration structure of the previous frame for the
+     * scene of the current frame, e.g. refits it for deformed geometries,
+     * instead of building it from scratch. Optional. The accel is rebuilt
+     * if NULL or it fails.
+     */
+    accel_update_func    update;
+
     /*
      * Do raytracing with accel structure 
      */
     accel_intersect_func intersect;
 
+    /*
+     * Any-hit query. Returns 1 as soon as some hit in [tmin, tmax] is found.
+     * Optional. ri_raytrace_occluded() falls back to intersect() if NULL.
+     */
+    accel_occluded_func  occluded;
+
+    /*
+     * Packet version of intersect() and occluded(). Optional.
+     * ri_raytrace_packet*() falls back to single ray queries if NULL.
+     */
+    accel_intersect_packet_func intersect_packet;
+    accel_occluded_packet_func  occluded_packet;
+
     /*
      * -- Members
      */
 
     void *data;        /* spatial data structure */
 
+    int   method;      /* RI_ACCEL_* bound by ri_accel_bind() */
+
 } ri_accel_t;
 
 extern ri_accel_t *ri_accel_new();
@@ -11,12 +11,40 @@
  * BVH Construction uses binning-based SAH [2] for fast and robust BVH
  * constriction.
  *
- * At this time, 2-ary BVH is constructed while data structure uses qbvh node.
+ * 2-ary BVH is constructed first, then it is collapsed into 4-ary BVH(QBVH)
+ * and flattened into one contiguous node array in depth-first order.
+ * Child nodes and leaves are referenced by 32-bit offsets. Leaves do not
+ * copy vertices: triangles of every leaf are stored in one array of
+ * (geom id, primitive index) references(8 bytes each), and vertices are
+ * fetched from the geometry. The SoA blocks of leaf triangles for SIMD
+ * intersection are the only packed copy of the vertices. During
+ * construction only the triangle bboxes with their references are kept, and
+ * they are released before leaf data is packed to bound peak memory.
+ *
+ * Construction is task-parallel when multi-threading is enabled: triangle
+ * list creation and binning of large splits are distributed over threads,
+ * and subtrees of large splits are forked onto worker threads. Since every
+ * split decision only depends on the input data, the parallel build produces
+ * the identical tree to the serial one.
+ *
+ * Ray traversal tests 4 children of QBVH node at once and intersects leaf
+ * triangles in groups of 4 using SSE2 or AVX. The SIMD mode is chosen at
+ * runtime by CPUID(see ri_bvh_set_simd_mode()). SIMD paths perform the same
+ * floating point operations as the scalar path, thus give the same result.
+ *
+ * With RI_ACCEL_PRECISION_FLOAT, the QBVH is converted into the fp32 BVH
+ * after construction: node boxes are rounded outward to float, and leaf
+ * triangles are kept as fp32 vertices, which is about 1/3 of the double
+ * precision SoA leaf data. Rays are tested with the
+ * watertight ray-triangle test [4] against the fp32 vertices, thus no ray
+ * leaks through shared edges. Each candidate hit is then refined with the
+ * double precision vertices of the geometry, so t, u and v given to
+ * ri_intersection_state_build() are computed in double.
  *
  * TODO:
  *
- *   - Construct 4-ary BVH [1].
- *   - Optimize BVH construction and traversal by MUDA language.
+ *   - Construct 4-ary BVH directly [1].
+ *   - Optimize BVH construction by MUDA language.
  *   - Reduce memory consuption for large data.
  *     - e.g. LBVH(lightweight BVH)
  *   - Out-of-core construction and traversal for massive data?
@@ -41,6 +69,14 @@
  *     (conditionally accepted at ACM Transactions on Graphics), 2006
  *     <http://www.sci.utah.edu/~wald/Publications/index.html>
  *
+ * [4] Watertight Ray/Triangle Intersection
+ *     Sven Woop, Carsten Benthin and Ingo Wald.
+ *     Journal of Computer Graphics Techniques, Vol. 2, No. 1, 2013
+ *
+ * [5] Robust BVH Ray Traversal
+ *     Thiago Ize.
+ *     Journal of Computer Graphics Techniques, Vol. 2, No. 2, 2013
+ *
  * $Id$
  *
  */
@@ -60,11 +96,26 @@
 #include "beam.h"
 #include "raster.h"
 #include "log.h"
+#include "thread.h"
+#include "system.h"
+#include "profile.h"
 
 #ifdef WITH_SSE
-#include <xmmintrin.h>
+#include <emmintrin.h>              /* SSE2 */
+
+#if defined(__GNUC__)
+/* AVX code is compiled per function and selected at runtime by CPUID. */
+#include <immintrin.h>
+#define BVH_WITH_AVX
+#define BVH_TARGET_AVX  __attribute__((target("avx")))
+#elif defined(_MSC_VER)
+#include <immintrin.h>
+#define BVH_WITH_AVX
+#define BVH_TARGET_AVX
 #endif
 
+#endif  /* WITH_SSE */
+
 #ifdef WITH_MUDA
 #include "muda/rayaabb.c"
 #endif  /* WITH_MUDA */
@@ -80,7 +131,26 @@
 #define BVH_MAXDEPTH          100
 #define BVH_NTRIS_LEAF         16        /* TODO: parameterize.  */
 #define BVH_BIN_SIZE           64
-#define BVH_MAXMISSBEAMS     1024
+#define BVH_STACK_SIZE       (4 * BVH_MAXDEPTH)
+#define BVH_PACKET_MIN_ACTIVE   2        /* trace per ray below this  */
+
+/*
+ * fp32 BVH settings.
+ *
+ * The far distance of fp32 ray-box test is enlarged by 1 + 2 * gamma(3)[5],
+ * with some more room for the rounding of the reciprocal direction.
+ * Candidate hits of the fp32 triangle test are searched in the t range
+ * widened by BVH_FLT_T_MARGIN, then decided with the refined t in double.
+ */
+#define BVH_FLT_TFAR_SCALE     (1.0f + 8.0f * FLT_EPSILON)
+#define BVH_FLT_T_MARGIN       (1.0e-5)
+
+/*
+ * Parallel construction settings
+ */
+#define BVH_PARALLEL_LIST_MIN_TRIS      (1 << 14)   /* create_triangle_list */
+#define BVH_PARALLEL_BINNING_MIN_TRIS   (1 << 17)   /* bin_triangle_edge    */
+#define BVH_PARALLEL_SUBTREE_MIN_TRIS   (1 << 12)   /* fork subtree task    */
 
 /*
  * Buffer for binning to compute approximated SAH 
@@ -91,26 +161,36 @@ typedef struct _bvh_bin_buffer_t {
 
 } bvh_bin_buffer_t;
 
-bvh_bin_buffer_t g_binbuf;
-
 
-typedef struct _triangle4_t {
-
-    ri_vector_t p0x, p0y, p0z;
-    ri_vector_t e1x, e1y, e1z;
-    ri_vector_t e2x, e2y, e2z;
+/*
+ * Bbox of a triangle and its reference, used during construction.
+ * Only xyz are stored to keep build temporaries small.
+ */
+typedef struct _tri_bbox_t {
 
-} triangle4_t;
+    ri_float_t  bmin[3];
+    ri_float_t  bmax[3];
 
+    uint32_t    geom_id;
+    uint32_t    index;          /* primitive index  */
 
-typedef struct _tri_bbox_t {
+} tri_bbox_t;   /* 56 bytes. */
 
-    ri_vector_t bmin;
-    ri_vector_t bmax;
+#define vcpy3(dst, src) do { \
+    (dst)[0] = (src)[0]; (dst)[1] = (src)[1]; (dst)[2] = (src)[2]; \
+} while (0)
 
-    uint64_t    index;          /* TODO: compaction.   */
+#define vmin3(dst, a, b) do { \
+    (dst)[0] = ((a)[0] < (b)[0]) ? (a)[0] : (b)[0]; \
+    (dst)[1] = ((a)[1] < (b)[1]) ? (a)[1] : (b)[1]; \
+    (dst)[2] = ((a)[2] < (b)[2]) ? (a)[2] : (b)[2]; \
+} while (0)
 
-} tri_bbox_t;
+#define vmax3(dst, a, b) do { \
+    (dst)[0] = ((a)[0] > (b)[0]) ? (a)[0] : (b)[0]; \
+    (dst)[1] = ((a)[1] > (b)[1]) ? (a)[1] : (b)[1]; \
+    (dst)[2] = ((a)[2] > (b)[2]) ? (a)[2] : (b)[2]; \
+} while (0)
 
 
 
@@ -119,13 +199,85 @@ typedef struct _interval_t {
 } interval_t;
 
 /*
- * Traversal stack
+ * Binary BVH node used during construction. Collapsed into QBVH nodes by
+ * flatten_bvh() and then released.
+ */
+typedef struct _bvh_build_node_t {
+
+    ri_vector_t                 bmin[2];        /* bbox of left, right child */
+    ri_vector_t                 bmax[2];
+    struct _bvh_build_node_t   *child[2];
+    int                         axis;
+
+    int                         is_leaf;
+    uint64_t                    offset;         /* leaf: first triangle */
+    uint32_t                    ntriangles;     /* leaf: # of triangles */
+
+} bvh_build_node_t;
+
+/*
+ * Subtree construction task. Each task owns its bin buffer, thus tasks
+ * running on different threads never share a scratch buffer.
+ */
+typedef struct _bvh_build_task_t {
+
+    bvh_build_node_t *root;
+    ri_vector_t       bmin;
+    ri_vector_t       bmax;
+    tri_bbox_t       *tri_bboxes;
+    tri_bbox_t       *tri_bboxes_buf;
+    uint64_t          index_left;
+    uint64_t          index_right;
+    int               depth;
+
+    int               nthreads;     /* # of threads given to this subtree */
+
+    bvh_bin_buffer_t  binbuf;
+
+} bvh_build_task_t;
+
+/*
+ * Data-parallel job over the range [begin, end) of triangles.
+ * Used for parallel triangle list creation and parallel binning.
+ */
+typedef struct _bvh_range_job_t {
+
+    uint64_t           begin;
+    uint64_t           end;
+
+    /* create_triangle_list */
+    ri_geom_t        **geoms;
+    uint64_t          *geom_offsets;    /* first triangle index of geoms[i] */
+    uint32_t           ngeoms;
+    tri_bbox_t        *tri_bboxes;
+
+    /* bin_triangle_edge */
+    const ri_float_t  *scene_bmin;
+    const ri_float_t  *scene_bmax;
+    const tri_bbox_t  *bin_tri_bboxes;
+    bvh_bin_buffer_t   binbuf;
+
+    /* calc_scene_bbox */
+    const tri_bbox_t  *scene_tri_bboxes;
+    ri_vector_t        bmin;
+    ri_vector_t        bmax;
+
+} bvh_range_job_t;
+
+/*
+ * Traversal stack. Each QBVH node pushes up to 4 children.
+ * Also counts traversal statistics of a query, which are flushed into the
+ * thread's profile counters once the query is done.
  */
 typedef struct _bvh_stack_t {
 
-    ri_qbvh_node_t *nodestack[BVH_MAXDEPTH + 1];
+    uint32_t        nodestack[BVH_STACK_SIZE];      /* child reference */
     int             depth;
 
+    uint32_t        ninner;                         /* inner nodes visited */
+    uint32_t        nleaf;                          /* leaf nodes visited  */
+    uint32_t        ntris;                          /* triangles tested    */
+
 } bvh_stack_t;
 
 /*
@@ -138,14 +290,28 @@ typedef struct _bvh_miss_beam_stack_t {
 
 } bvh_miss_beam_stack_t;
 
-ri_beam_t  g_miss_beams[BVH_MAXMISSBEAMS];
-
 /*
  * Singleton
  */
-ri_bvh_stat_traversal_t       g_stattrav;
 ri_bvh_stat_beam_traversal_t  g_beamstattrav;
 
+static inline void
+bvh_stack_init( bvh_stack_t *stack )
+{
+    stack->depth  = 0;
+    stack->ninner = 0;
+    stack->nleaf  = 0;
+    stack->ntris  = 0;
+}
+
+static inline void
+bvh_stack_flush_stat( const bvh_stack_t *stack )
+{
+    ri_prof_add( RI_PROF_NINNER_NODES,    stack->ninner );
+    ri_prof_add( RI_PROF_NLEAF_NODES,     stack->nleaf  );
+    ri_prof_add( RI_PROF_NTRIANGLE_TESTS, stack->ntris  );
+}
+
 
 /* ----------------------------------------------------------------------------
  *
@@ -153,24 +319,30 @@ ri_bvh_stat_beam_traversal_t  g_beamstattrav;
  *
  * ------------------------------------------------------------------------- */
 
-static ri_qbvh_node_t *ri_qbvh_node_new();
+static bvh_build_node_t *bvh_build_node_new();
+static void bvh_build_node_free( bvh_build_node_t *node );
 
 static void get_bbox_of_triangle(
-          ri_vector_t        bmin_out,           /* [out] */  
-          ri_vector_t        bmax_out,           /* [out] */  
-    const ri_triangle_t     *triangle);
+          ri_float_t         bmin_out[3],        /* [out] */
+          ri_float_t         bmax_out[3],        /* [out] */
+    const ri_float_t        *v0,
+    const ri_float_t        *v1,
+    const ri_float_t        *v2);
 
 static void calc_scene_bbox(
           ri_vector_t        bmin_out,           /* [out]    */
           ri_vector_t        bmax_out,           /* [out]    */
     const tri_bbox_t        *tri_bboxes,
-          uint64_t           ntriangles);
+          uint64_t           ntriangles,
+          int                nthreads);
 
 static void create_triangle_list(
-          ri_triangle_t    **triangles_out,      /* [out]    */
           tri_bbox_t       **tri_bboxes_out,     /* [out]    */
           uint64_t          *ntriangles,         /* [out]    */
-    const ri_list_t         *geom_list);
+          ri_geom_t       ***geoms_out,          /* [out]    */
+          uint32_t          *ngeoms_out,         /* [out]    */
+    const ri_list_t         *geom_list,
+          int                nthreads);
 
 static void bbox_add_margin(
           ri_vector_t        bmin,               /* [inout]  */
@@ -183,18 +355,20 @@ static int bin_triangle_edge(
     const tri_bbox_t        *tri_bboxes,
           uint64_t           ntriangles);
 
+static int bin_triangle_edge_parallel(
+          bvh_bin_buffer_t  *binbuf,             /* [inout]  */
+    const ri_vector_t        scene_bmin,
+    const ri_vector_t        scene_bmax,
+    const tri_bbox_t        *tri_bboxes,
+          uint64_t           ntriangles,
+          int                nthreads);
+
 static void calc_bbox_of_triangles(
           ri_vector_t        bmin_out,           /* [out]    */
           ri_vector_t        bmax_out,           /* [out]    */
     const tri_bbox_t        *tri_bboxes,
           uint64_t           ntriangles);
 
-static int gather_triangles(
-          ri_triangle_t     *triangles_to_out,   /* [out]    */
-    const ri_triangle_t     *triangles_from,
-    const tri_bbox_t        *tri_bboxes,
-          uint64_t           ntriangles);
-
 static inline int test_ray_aabb(
           ri_float_t        *tmin_out,           /* [out]    */
           ri_float_t        *tmax_out,           /* [out]    */
@@ -203,40 +377,77 @@ static inline int test_ray_aabb(
           ri_ray_t          *ray);
 
 static int bvh_construct(
-          ri_qbvh_node_t    *root,
+          bvh_build_node_t  *root,
           ri_vector_t        bmin,
           ri_vector_t        bmax,
-          ri_triangle_t     *triangles,
-          ri_triangle_t     *triangles_buf,
           tri_bbox_t        *tri_bboxes,
           tri_bbox_t        *tri_bboxes_buf,
           uint64_t           index_left,
-          uint64_t           index_right);
+          uint64_t           index_right,
+          int                depth,
+          bvh_bin_buffer_t  *binbuf,             /* [buffer] */
+          int                nthreads);
+
+static int bvh_get_build_nthreads();
+
+static void flatten_bvh(
+          ri_bvh_t          *bvh,                /* [inout]  */
+    const bvh_build_node_t  *root);
 
 static int bvh_traverse(
           ri_intersection_state_t *state_out,   /* [out]                */
-    const ri_qbvh_node_t          *root,
+    const ri_bvh_t                *bvh,
           ri_bvh_diag_t           *diag,        /* [modified]           */
           ri_ray_t                *ray,
           bvh_stack_t             *stack );     /* [buffer]             */
 
+static int bvh_traverse_subtree(
+          ri_intersection_state_t *state_out,   /* [inout]              */
+    const ri_bvh_t                *bvh,
+          ri_ray_t                *ray,
+          uint32_t                 root,
+          bvh_stack_t             *stack );     /* [buffer]             */
+
+static int bvh_traverse_occluded(
+    const ri_bvh_t                *bvh,
+          ri_ray_t                *ray,
+          ri_float_t               tmin,
+          ri_float_t               tmax,
+          uint32_t                 root,
+          bvh_stack_t             *stack );     /* [buffer]             */
+
+static uint32_t bvh_traverse_packet(
+          ri_intersection_state_t *states_out,  /* [out]                */
+    const ri_bvh_t                *bvh,
+          ri_ray_packet_t         *packet,
+          uint32_t                 active,
+          ri_float_t               tmin,
+          ri_float_t               tmax );
+
+static void bvh_setup_ray(
+          ri_ray_t                *ray);        /* [inout]              */
+
+static void bvh_setup_ray32(
+          ri_ray_t                *ray);        /* [inout]              */
+
 
 static int bvh_traverse_beam(
           ri_raster_plane_t       *raster_inout,/* [inout]              */
-          ri_qbvh_node_t          *root,
+          ri_bvh_t                *bvh,
           ri_bvh_diag_t           *diag,        /* [modified]           */
           ri_beam_t               *beam,
           bvh_stack_t             *stack );     /* [buffer]             */
 
 static int bvh_traverse_beam_visibility(
-          ri_qbvh_node_t          *root,
+    const ri_bvh_t                *bvh,
           ri_bvh_diag_t           *diag,        /* [modified]           */
           ri_beam_t               *beam,
           bvh_stack_t             *stack );     /* [buffer]             */
 
 static void project_triangles(
           ri_triangle2d_t *tri2d_out,              /* [out]                */
-    const ri_triangle_t   *triangles,              /* [in]                 */
+    const ri_bvh_t        *bvh,
+    const ri_bvh_triref_t *refs,                   /* [in]                 */
           uint32_t         ntriangles,
           int              axis,
           ri_float_t       d,
@@ -248,10 +459,79 @@ static int test_beam_aabb(
     const ri_beam_t   *beam);
 
 
-static void bvh_invalidate_cache_node( ri_qbvh_node_t *node );
+static ri_bvh_diag_t *gdiag;                    /* TODO: thread-safe    */
 
+static int            g_simd_mode = -1;         /* -1 = not initialized */
 
-static ri_bvh_diag_t *gdiag;                    /* TODO: thread-safe    */
+static uint64_t       g_beam_cache_size = RI_BVH_TRI2D_CACHE_SIZE_DEFAULT;
+
+static void build_triangle4s( ri_bvh_t *bvh );
+static void build_fp32_bvh( ri_bvh_t *bvh );
+static void calc_bvh_nbytes( ri_bvh_t *bvh );
+
+/*
+ * Incremental update
+ */
+typedef struct _bvh_subtree_t {
+
+    uint32_t          node;             /* root QBVH node of the subtree    */
+    uint32_t          offset;           /* trirefs[offset, offset + n)      */
+    uint32_t          ntriangles;
+    bvh_build_node_t *root;             /* rebuilt binary BVH               */
+
+} bvh_subtree_t;
+
+static void calc_node_costs(
+          float             *costs_out,          /* [out] [nnodes] */
+    const ri_bvh_t          *bvh);
+
+static uint32_t refit_bvh(
+          ri_bvh_t          *bvh,                /* [inout]  */
+    const uint8_t           *dirty);             /* [ngeoms] */
+
+static void calc_subtree_range(
+          uint32_t          *offset_out,         /* [out]    */
+          uint32_t          *ntriangles_out,     /* [out]    */
+    const ri_bvh_t          *bvh,
+          uint32_t           node);
+
+static void select_subtrees(
+          int32_t           *selected_inout,     /* [inout] [nnodes] */
+          uint32_t          *nselected_inout,    /* [inout]  */
+    const ri_bvh_t          *bvh,
+    const float             *costs,
+          float              threshold,
+          uint32_t           node);
+
+static void rebuild_subtrees(
+          ri_bvh_t          *bvh,                /* [inout]  */
+    const int32_t           *selected,
+          bvh_subtree_t     *subtrees,           /* [inout]  */
+          uint32_t           nsubtrees,
+          int                nthreads);
+
+/*
+ * 2D triangle cache for beam tracing
+ */
+static void tri2d_cache_init(
+    ri_bvh_tri2d_cache_t  *cache,
+    uint32_t               nslots,
+    uint64_t               budget);
+
+static void tri2d_cache_clear(
+    ri_bvh_tri2d_cache_t  *cache);
+
+static void tri2d_cache_free(
+    ri_bvh_tri2d_cache_t  *cache);
+
+static ri_bvh_tri2d_entry_t *tri2d_cache_acquire(
+    ri_bvh_t              *bvh,
+    uint32_t               leaf,
+    const ri_beam_t       *beam);
+
+static void tri2d_cache_release(
+    ri_bvh_tri2d_cache_t  *cache,
+    ri_bvh_tri2d_entry_t  *entry);
 
 
 /* ----------------------------------------------------------------------------
@@ -276,56 +556,83 @@ static ri_bvh_diag_t *gdiag;                    /* TODO: thread-safe    */
 void *
 ri_bvh_build(
     const void *data)
+{
+    const ri_scene_t *scene = (const ri_scene_t *)data;
+
+    return ri_bvh_build_geoms( scene->geom_list );
+}
+
+/*
+ * Function: ri_bvh_build_geoms
+ *
+ *     Same as ri_bvh_build(), but builds the BVH over `geom_list'.
+ *
+ * Parameters:
+ *
+ *     geom_list - list of ri_geom_t.
+ *
+ * Returns:
+ *
+ *     Built BVH data strucure.
+ */
+void *
+ri_bvh_build_geoms(
+    const ri_list_t *geom_list)
 {
     ri_bvh_t           *bvh;
-    ri_qbvh_node_t     *root;
+    bvh_build_node_t   *root;
     ri_timer_t         *tm;
     ri_vector_t         bmin, bmax;
 
-    ri_scene_t         *scene = (ri_scene_t *)data;
-    
-    ri_triangle_t      *triangles;
-    ri_triangle_t      *triangles_buf;          /* temporal buffer  */
     tri_bbox_t         *tri_bboxes;
     tri_bbox_t         *tri_bboxes_buf;         /* temporal buffer  */
     uint64_t            ntriangles;
+    uint64_t            i;
+
+    int                 nthreads;
+    bvh_bin_buffer_t   *binbuf;
 
     tm = ri_render_get()->context->timer;
 
+    nthreads = bvh_get_build_nthreads();
+
     ri_log( LOG_INFO, "(BVH   ) Building BVH ... " );
     ri_timer_start( tm, "BVH Construction" );
 
     bvh = ( ri_bvh_t * )ri_mem_alloc( sizeof( ri_bvh_t ) );
     memset( bvh, 0, sizeof( ri_bvh_t ));
 
+    bvh->precision = ri_render_get()->context->option->accel_precision;
+
 
     /*
-     * 1. Create 1D array of triangle and its bbox.
+     * 1. Create 1D array of triangle bbox and its reference.
+     *    Vertices are not copied; they are fetched from the geometry.
      */
     {
-        create_triangle_list(&triangles,
-                             &tri_bboxes,
+        create_triangle_list(&tri_bboxes,
                              &ntriangles,
-                              scene->geom_list);
+                             &bvh->geoms,
+                             &bvh->ngeoms,
+                              geom_list,
+                              nthreads);
 
         if (ntriangles == 0) {
             /* No geometry in the scene. We build empty bvh structure. */
             bvh->empty = 1;
+            ri_timer_end( tm, "BVH Construction" );
             return bvh;
         }
 
         tri_bboxes_buf = ri_mem_alloc(sizeof(tri_bbox_t) * ntriangles);
         ri_mem_copy(tri_bboxes_buf, tri_bboxes, sizeof(tri_bbox_t)*ntriangles);
-
-        triangles_buf = ri_mem_alloc(sizeof(ri_triangle_t) * ntriangles);
-        ri_mem_copy(triangles_buf, triangles, sizeof(ri_triangle_t)*ntriangles);
     }
 
     /*
      * 2. Calculate bounding box of the scene.
      */
     {
-        calc_scene_bbox( bmin, bmax, tri_bboxes, ntriangles );
+        calc_scene_bbox( bmin, bmax, tri_bboxes, ntriangles, nthreads );
 
         bbox_add_margin( bmin, bmax );
 
@@ -345,29 +652,101 @@ ri_bvh_build(
     
     ri_log(LOG_INFO, "(BVH   )    # of input tris = %d", ntriangles);
 
+    if (nthreads > 1) {
+        ri_log(LOG_INFO, "(BVH   )    # of build threads = %d", nthreads);
+    }
+
 
     /*
      * 3. Construct BVH.
      */
-    root      = ri_qbvh_node_new();
-    bvh->root = root;
+    root      = bvh_build_node_new();
+
+    binbuf    = (bvh_bin_buffer_t *)ri_mem_alloc(sizeof(bvh_bin_buffer_t));
     
     bvh_construct(
-        bvh->root,
+        root,
         bvh->bmin,
         bvh->bmax,
-        triangles,
-        triangles_buf,
         tri_bboxes,
         tri_bboxes_buf,
         0,
-        ntriangles);
+        ntriangles,
+        0,
+        binbuf,
+        nthreads);
+
+    ri_mem_free( binbuf );
+
+    /*
+     * 4. Collapse into QBVH and flatten nodes.
+     *    tri_bboxes is sorted by leaf. Keep only the references of it and
+     *    release build temporaries before the leaf data is packed.
+     */
+    assert( ntriangles < 0x100000000ULL );
+
+    bvh->trirefs = (ri_bvh_triref_t *)ri_mem_alloc(
+                       sizeof(ri_bvh_triref_t) * ntriangles);
+
+    for (i = 0; i < ntriangles; i++) {
+        bvh->trirefs[i].geom_id = tri_bboxes[i].geom_id;
+        bvh->trirefs[i].index   = tri_bboxes[i].index;
+    }
 
+    bvh->ntriangles = ntriangles;
 
-    ri_mem_free( triangles_buf );
     ri_mem_free( tri_bboxes );
     ri_mem_free( tri_bboxes_buf );
 
+    flatten_bvh( bvh, root );
+
+    bvh_build_node_free( root );
+
+    /*
+     * 5. Pack leaf triangles for SIMD intersection, or convert the BVH
+     *    into the fp32 one.
+     */
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+
+        build_fp32_bvh( bvh );
+
+    } else {
+
+        build_triangle4s( bvh );
+
+        tri2d_cache_init( &bvh->tri2d_cache, 3 * bvh->nleaves,
+                          g_beam_cache_size );
+    }
+
+    /*
+     * 6. Record the cost of nodes for the incremental update.
+     */
+    bvh->node_costs = (float *)ri_mem_alloc(sizeof(float) * bvh->nnodes);
+    calc_node_costs( bvh->node_costs, bvh );
+
+    calc_bvh_nbytes( bvh );
+
+    bvh->stat_construction.ninner_nodes = bvh->nnodes;
+    bvh->stat_construction.nleaf_nodes  = bvh->nleaves;
+    bvh->stat_construction.naverage_triangels_per_leaf =
+        ntriangles / bvh->nleaves;
+
+    ri_log(LOG_INFO, "(BVH   )    # of QBVH nodes = %u (%.2f MB)",
+        bvh->nnodes,
+        ((bvh->precision == RI_ACCEL_PRECISION_FLOAT) ?
+            sizeof(ri_qbvh_node32_t) : sizeof(ri_qbvh_node_t)) *
+        bvh->nnodes / (1024.0 * 1024.0));
+    ri_log(LOG_INFO, "(BVH   )    # of leaves     = %u", bvh->nleaves);
+    ri_log(LOG_INFO, "(BVH   )    Precision       = %s",
+        (bvh->precision == RI_ACCEL_PRECISION_FLOAT) ? "float" : "double");
+    ri_log(LOG_INFO, "(BVH   )    Memory          = %.2f MB "
+                     "(%.1f bytes/triangle)",
+        bvh->nbytes / (1024.0 * 1024.0),
+        (double)bvh->nbytes / (double)ntriangles);
+    ri_log(LOG_INFO, "(BVH   )    SIMD mode       = %s",
+        (ri_bvh_get_simd_mode() == RI_BVH_SIMD_AVX) ? "AVX" :
+        (ri_bvh_get_simd_mode() == RI_BVH_SIMD_SSE) ? "SSE2" : "scalar");
+
     ri_timer_end( tm, "BVH Construction" );
 
     ri_log( LOG_INFO, "(BVH   ) Construction time: %f sec",
@@ -383,48 +762,242 @@ ri_bvh_free( void *accel )
 {
     ri_bvh_t *bvh = (ri_bvh_t *)accel;
 
+    if (!bvh->empty) {
+
+        if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+
+            ri_mem_free_aligned( bvh->nodes32 );
+            ri_mem_free_aligned( bvh->triangle4fs );
+
+        } else {
+
+            tri2d_cache_free( &bvh->tri2d_cache );
+
+            ri_mem_free_aligned( bvh->nodes );
+
+            if (bvh->triangle4s) {
+                ri_mem_free_aligned( bvh->triangle4s );
+            }
+
+        }
+
+        ri_mem_free( bvh->leaves );
+        ri_mem_free( bvh->trirefs );
+        ri_mem_free( bvh->geoms );
+        ri_mem_free( bvh->node_costs );
+
+    }
+
     ri_mem_free(bvh);
 }
 
 void
-bvh_invalidate_cache_node( ri_qbvh_node_t *node )
+ri_bvh_invalidate_cache( void *accel )
 {
-    int   i;
-    void *ptr;
+    assert( accel != NULL );
 
-    if (node->is_leaf) {
+    ri_bvh_t *bvh = (ri_bvh_t *)accel;
+
+    if (bvh->empty) return;
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) return;
+
+    tri2d_cache_clear( &bvh->tri2d_cache );
+}
+
+/*
+ * Function: ri_bvh_update
+ *
+ *     Updates the BVH built for the last frame to the scene of the next
+ *     frame. See bvh.h.
+ *
+ * Parameters:
+ *
+ *     accel - BVH built for the last frame.
+ *     data  - scene data of type ri_scene_t.
+ *
+ * Returns:
+ *
+ *     0 if the BVH is updated, -1 if the BVH must be rebuilt.
+ */
+int
+ri_bvh_update(
+    void       *accel,
+    const void *data)
+{
+    ri_bvh_t          *bvh   = (ri_bvh_t *)accel;
+    const ri_scene_t  *scene = (const ri_scene_t *)data;
+
+    uint32_t           i, j;
+    uint32_t           ngeoms;
+    uint32_t           ndirty;
+    uint32_t           nrefitted;
+    uint32_t           nsubtrees;
+    uint64_t           nrebuilt;
+    ri_list_t         *itr;
+    ri_geom_t        **geoms;
+    const ri_geom_t   *prev;
+    uint8_t           *dirty;
+    float             *costs;
+    float              threshold;
+    int32_t           *selected;
+    bvh_subtree_t     *subtrees;
+    ri_timer_t        *tm;
+
+    if (bvh->empty) return -1;
+
+    /*
+     * 1. Match geometries with the last frame. Any change of the topology
+     *    requires a full rebuild.
+     */
+    ngeoms = 0;
+    for (itr  = ri_list_first( scene->geom_list );
+         itr != NULL;
+         itr  = ri_list_next( itr ) ) {
+        ngeoms++;
+    }
+
+    if (ngeoms != bvh->ngeoms) return -1;
+
+    geoms = (ri_geom_t **)ri_mem_alloc(sizeof(ri_geom_t *) * ngeoms);
+    dirty = (uint8_t *)ri_mem_alloc(sizeof(uint8_t) * ngeoms);
+
+    ndirty = 0;
+
+    for (i = 0, itr  = ri_list_first( scene->geom_list );
+                itr != NULL;
+         i++,   itr  = ri_list_next( itr ) ) {
+
+        geoms[i] = (ri_geom_t *)itr->data;
+        dirty[i] = 0;
+
+        prev = bvh->geoms[i];
+
+        if (geoms[i] == prev) continue;
+
+        if ((geoms[i]->nindices   != prev->nindices  ) ||
+            (geoms[i]->npositions != prev->npositions) ||
+            (memcmp(geoms[i]->indices, prev->indices,
+                    sizeof(unsigned int) * prev->nindices) != 0)) {
+
+            ri_mem_free( geoms );
+            ri_mem_free( dirty );
+
+            return -1;
+        }
+
+        for (j = 0; j < prev->npositions; j++) {
+            if ((geoms[i]->positions[j][0] != prev->positions[j][0]) ||
+                (geoms[i]->positions[j][1] != prev->positions[j][1]) ||
+                (geoms[i]->positions[j][2] != prev->positions[j][2])) {
+                dirty[i] = 1;
+                ndirty++;
+                break;
+            }
+        }
+    }
+
+    /* Geometries of the last frame are released after this call. */
+    ri_mem_free( bvh->geoms );
+    bvh->geoms = geoms;
+
+    if (ndirty == 0) {
+
+        ri_mem_free( dirty );
+
+        ri_log( LOG_INFO, "(BVH   ) Geometries are not changed. Reuse BVH." );
 
-        for (i = 0; i < 3; i++) {   /* for each axis */
+        return 0;
+    }
+
+    tm = ri_render_get()->context->timer;
+
+    ri_log( LOG_INFO, "(BVH   ) Updating BVH ... " );
+    ri_timer_start( tm, "BVH Update" );
+
+    /*
+     * 2. Refit boxes of deformed geometries.
+     */
+    nrefitted = refit_bvh( bvh, dirty );
+
+    ri_mem_free( dirty );
+
+    if (bvh->precision != RI_ACCEL_PRECISION_FLOAT) {
+        tri2d_cache_clear( &bvh->tri2d_cache );
+    }
+
+    /*
+     * 3. Find subtrees degraded by the refit.
+     */
+    threshold = ri_render_get()->context->option->accel_rebuild_threshold;
+
+    costs     = (float *)ri_mem_alloc(sizeof(float) * bvh->nnodes);
+    selected  = (int32_t *)ri_mem_alloc(sizeof(int32_t) * bvh->nnodes);
+
+    calc_node_costs( costs, bvh );
 
-            ptr = (void *)node->child[1+i];
+    for (i = 0; i < bvh->nnodes; i++) {
+        selected[i] = -1;
+    }
+
+    nsubtrees = 0;
+    select_subtrees( selected, &nsubtrees, bvh, costs, threshold, 0 );
+
+    ri_mem_free( costs );
+
+    /*
+     * 4. Rebuild the degraded subtrees. If the root or most of the
+     *    triangles are degraded, the full rebuild is cheaper.
+     */
+    nrebuilt = 0;
+    subtrees = NULL;
 
-            if (ptr) {  /* 2D triangle cache was created, release it */
+    if (nsubtrees > 0) {
 
-                ri_mem_free(ptr);
+        subtrees = (bvh_subtree_t *)ri_mem_alloc(
+                       sizeof(bvh_subtree_t) * nsubtrees);
 
-                node->child[1+i] = NULL;
+        for (i = 0; i < bvh->nnodes; i++) {
+            if (selected[i] >= 0) {
+                subtrees[selected[i]].node = i;
             }
+        }
 
+        for (i = 0; i < nsubtrees; i++) {
+            calc_subtree_range( &subtrees[i].offset, &subtrees[i].ntriangles,
+                                bvh, subtrees[i].node );
+            nrebuilt += subtrees[i].ntriangles;
         }
 
-    } else {
+        if ((selected[0] >= 0) || (2 * nrebuilt > bvh->ntriangles)) {
 
-        for (i = 0; i < 2; i++) {
-            bvh_invalidate_cache_node(node->child[i]);
+            ri_log( LOG_INFO, "(BVH   )    BVH is degraded. Rebuild." );
+
+            ri_mem_free( subtrees );
+            ri_mem_free( selected );
+
+            ri_timer_end( tm, "BVH Update" );
+
+            return -1;
         }
 
+        rebuild_subtrees( bvh, selected, subtrees, nsubtrees,
+                          bvh_get_build_nthreads() );
+
+        ri_mem_free( subtrees );
     }
 
-}
+    ri_mem_free( selected );
 
-void
-ri_bvh_invalidate_cache( void *accel )
-{
-    assert( accel != NULL );
+    ri_timer_end( tm, "BVH Update" );
 
-    ri_bvh_t *bvh = (ri_bvh_t *)accel;
+    ri_log( LOG_INFO, "(BVH   )    # of deformed geoms   = %u", ndirty );
+    ri_log( LOG_INFO, "(BVH   )    # of refitted leaves  = %u", nrefitted );
+    ri_log( LOG_INFO, "(BVH   )    # of rebuilt subtrees = %u (%llu tris)",
+        nsubtrees, (unsigned long long)nrebuilt );
+    ri_log( LOG_INFO, "(BVH   ) Update time: %f sec",
+           ri_timer_elapsed( tm, "BVH Update" ) );
 
-    bvh_invalidate_cache_node(bvh->root);
+    return 0;
 }
 
 int
@@ -457,90 +1030,344 @@ ri_bvh_intersect(
     
     int ret;
 
-#ifdef RI_BVH_TRACE_STATISTICS
-    g_stattrav.nrays++;
-#endif
+    ri_prof_inc( RI_PROF_NBVH_QUERIES );
 
-    /*
-     * TODO: Provide indivisual stack for each thread.
-     */
     bvh_stack_t stack;
-    stack.depth = 0;
+    bvh_stack_init( &stack );
 
     /*
      * Precalculate ray coefficient.
      */
-    ray->dir_sign[0] = (ray->dir[0] < 0.0) ? 1 : 0;
-    ray->dir_sign[1] = (ray->dir[1] < 0.0) ? 1 : 0;
-    ray->dir_sign[2] = (ray->dir[2] < 0.0) ? 1 : 0;
+    bvh_setup_ray( ray );
 
-    if (fabs(ray->dir[0]) > RI_EPS) {
-        ray->invdir[0] = 1.0 / ray->dir[0];
-    } else {
-        ray->invdir[0] = (ray->dir[0] < 0.0) ? -RI_FLT_MAX : RI_FLT_MAX;
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+        bvh_setup_ray32( ray );
     }
 
-    if (fabs(ray->dir[1]) > RI_EPS) {
-        ray->invdir[1] = 1.0 / ray->dir[1];
-    } else {
-        ray->invdir[2] = (ray->dir[2] < 0.0) ? -RI_FLT_MAX : RI_FLT_MAX;
+    /*
+     * Firstly check if the ray hits scene bbox.
+     */
+    int hit;
+    ri_float_t tmin, tmax;
+    
+    hit = test_ray_aabb( &tmin, &tmax, bvh->bmin, bvh->bmax, ray );
+        
+    if (!hit) {
+        return 0;
     }
 
-    if (fabs(ray->dir[2]) > RI_EPS) {
-        ray->invdir[2] = 1.0 / ray->dir[2];
-    } else {
-        ray->invdir[2] = (ray->dir[2] < 0.0) ? -RI_FLT_MAX : RI_FLT_MAX;
+    ret = bvh_traverse(  state_out,
+                         bvh,
+                         diag_ptr, 
+                         ray,
+                        &stack );
+
+    bvh_stack_flush_stat( &stack );
+
+    /*
+     * If there's a hit, build intersection state.
+     */
+    if (ret) {
+        ri_intersection_state_build( state_out, ray );
     }
+                        
+    return ret;
+}
 
-    ray->dir_sign[0] = (ray->dir[0] < 0.0) ? 1 : 0;
-    ray->dir_sign[1] = (ray->dir[1] < 0.0) ? 1 : 0;
-    ray->dir_sign[2] = (ray->dir[2] < 0.0) ? 1 : 0;
+/*
+ * Function: ri_bvh_intersect_nearest
+ *
+ *   Finds a hit nearer than state_inout->t. t, u, v, geom and index of
+ *   `state_inout' are updated only if such a hit is found.
+ *
+ * Parameters:
+ *
+ *   accel       - BVH data.
+ *   ray         - The ray to be tested.
+ *   state_inout - Nearest hit found so far. state_inout->t must be set
+ *                 (RI_INFINITY if none).
+ *
+ * Returns:
+ *
+ *   1 if the hit is updated, 0 if not.
+ */
+int
+ri_bvh_intersect_nearest(
+    void                    *accel,
+    ri_ray_t                *ray,
+    ri_intersection_state_t *state_inout)
+{
+    int            hit;
+    ri_float_t     tmin, tmax;
+    ri_float_t     tprev;
+    ri_bvh_t      *bvh;
+    bvh_stack_t    stack;
 
-#if defined(WITH_MUDA) || defined(WITH_SSE)
+    assert( accel       != NULL );
+    assert( ray         != NULL );
+    assert( state_inout != NULL );
 
-    {
-        uint64_t ones;
-        uint64_t *ptr;
+    bvh = (ri_bvh_t *)accel;
 
-        ones = 0xffffffffffffffffULL;
-        ptr = &ray->dir_signv[0];
+    if (bvh->empty) {
+        return 0;
+    }
 
-        (*ptr++) = (ray->dir[0] < 0.0) ? ones : 0;
-        (*ptr++) = (ray->dir[1] < 0.0) ? ones : 0;
-        (*ptr  ) = (ray->dir[2] < 0.0) ? ones : 0;
+    ri_prof_inc( RI_PROF_NBVH_QUERIES );
+
+    bvh_setup_ray( ray );
+
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+        bvh_setup_ray32( ray );
+    }
+
+    hit = test_ray_aabb( &tmin, &tmax, bvh->bmin, bvh->bmax, ray );
 
+    if (!hit || (tmin > state_inout->t)) {
+        return 0;
     }
 
+#ifdef RI_BVH_ENABLE_DIAGNOSTICS
+    gdiag = NULL;
 #endif
 
-    /*
-     * Firstly check if the ray hits scene bbox.
-     */
-    int hit;
-    ri_float_t tmin, tmax;
-    
-    hit = test_ray_aabb( &tmin, &tmax, bvh->bmin, bvh->bmax, ray );
+    bvh_stack_init( &stack );
+
+    tprev = state_inout->t;
+
+    bvh_traverse_subtree( state_inout, bvh, ray, 0, &stack );
+
+    bvh_stack_flush_stat( &stack );
+
+    return (state_inout->t < tprev);
+}
+
+/*
+ * Function: ri_bvh_occluded
+ *
+ *   Any-hit query. Returns as soon as some triangle is found in [tmin, tmax]
+ *   along the ray. Neither the nearest hit is searched nor intersection
+ *   state is built, thus this is much cheaper than ri_bvh_intersect() for
+ *   shadow and ambient occlusion rays.
+ *
+ * Parameters:
+ *
+ *   accel - BVH data.
+ *   ray   - The ray to be tested.
+ *   tmin  - Minimum distance of the hit.
+ *   tmax  - Maximum distance of the hit.
+ *   user  - Not used.
+ *
+ * Returns:
+ *
+ *   1 if the ray is occluded, 0 if not.
+ */
+int
+ri_bvh_occluded(
+    void                    *accel,
+    ri_ray_t                *ray,
+    ri_float_t               tmin,
+    ri_float_t               tmax,
+    void                    *user)
+{
+    int            hit;
+    int            ret;
+    ri_float_t     tmin_scene, tmax_scene;
+    ri_bvh_t      *bvh;
+    bvh_stack_t    stack;
+
+    (void)user;
+
+    assert( accel     != NULL );
+    assert( ray       != NULL );
+
+    bvh = (ri_bvh_t *)accel;
+
+    if (bvh->empty) {
+        return 0;
+    }
+
+    ri_prof_inc( RI_PROF_NBVH_QUERIES );
+
+    bvh_stack_init( &stack );
+
+    bvh_setup_ray( ray );
+
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+        bvh_setup_ray32( ray );
+    }
+
+    hit = test_ray_aabb( &tmin_scene, &tmax_scene, bvh->bmin, bvh->bmax, ray );
         
     if (!hit) {
         return 0;
     }
 
-    ret = bvh_traverse(  state_out,
-                         bvh->root,
-                         diag_ptr, 
-                         ray,
-                        &stack );
-
-    /*
-     * If there's a hit, build intersection state.
-     */
-    if (ret) {
-        ri_intersection_state_build( state_out, ray->org, ray->dir );
+    if ((tmin_scene > tmax) || (tmax_scene < tmin)) {
+        return 0;
     }
-                        
+
+    ret = bvh_traverse_occluded( bvh, ray, tmin, tmax, 0, &stack );
+
+    bvh_stack_flush_stat( &stack );
+
     return ret;
 }
 
+/*
+ * Sets up rays in the packet for traversal and returns the mask of rays
+ * which hit the scene bounding box.
+ */
+static uint32_t
+bvh_setup_packet(
+    const ri_bvh_t          *bvh,
+    ri_ray_packet_t         *packet)        /* [inout]  */
+{
+    int        i, k;
+    int        hit;
+    uint32_t   active = 0;
+    ri_float_t tmin, tmax;
+
+    for (i = 0; i < packet->nrays; i++) {
+
+        bvh_setup_ray( &packet->rays[i] );
+
+        if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+            bvh_setup_ray32( &packet->rays[i] );
+        }
+
+        for (k = 0; k < 3; k++) {
+            packet->invdir[k][i] = packet->rays[i].invdir[k];
+        }
+
+        hit = test_ray_aabb( &tmin, &tmax, bvh->bmin, bvh->bmax,
+                             &packet->rays[i] );
+
+        if (hit) {
+            active |= (1 << i);
+        }
+    }
+
+    return active;
+}
+
+/*
+ * Function: ri_bvh_intersect_packet
+ *
+ *   Packet version of ri_bvh_intersect(). The packet is traversed together
+ *   while its rays are coherent, and rest of traversal is done per ray when
+ *   the packet diverges.
+ *
+ * Parameters:
+ *
+ *   accel      - BVH data.
+ *   packet     - Ray packet to be traced.
+ *   states_out - Array of packet->nrays intersection states. i'th state is
+ *                filled only when i'th ray hits.
+ *   user       - Not used.
+ *
+ * Returns:
+ *
+ *   Bit mask of rays which hit.
+ */
+uint32_t
+ri_bvh_intersect_packet(
+    void                    *accel,
+    ri_ray_packet_t         *packet,
+    ri_intersection_state_t *states_out,
+    void                    *user)
+{
+    int            i;
+    uint32_t       active;
+    uint32_t       hitmask;
+    ri_bvh_t      *bvh;
+
+    (void)user;
+
+    assert( accel      != NULL );
+    assert( packet     != NULL );
+    assert( states_out != NULL );
+    assert( packet->nrays <= RI_RAY_PACKET_MAX );
+
+    bvh = (ri_bvh_t *)accel;
+
+    if (bvh->empty) {
+        return 0;
+    }
+
+    ri_prof_add( RI_PROF_NBVH_QUERIES, packet->nrays );
+
+    active = bvh_setup_packet( bvh, packet );
+
+    for (i = 0; i < packet->nrays; i++) {
+        states_out[i].t     = RI_INFINITY;
+        states_out[i].u     = 0.0;
+        states_out[i].v     = 0.0;
+        states_out[i].geom  = NULL;
+        states_out[i].index = 0;
+    }
+
+    if (!active) {
+        return 0;
+    }
+
+    hitmask = bvh_traverse_packet( states_out, bvh, packet, active,
+                                   0.0, RI_INFINITY );
+
+    for (i = 0; i < packet->nrays; i++) {
+
+        if (hitmask & (1 << i)) {
+            ri_intersection_state_build( &states_out[i],
+                                         &packet->rays[i] );
+        }
+    }
+
+    return hitmask;
+}
+
+/*
+ * Function: ri_bvh_occluded_packet
+ *
+ *   Packet version of ri_bvh_occluded().
+ *
+ * Returns:
+ *
+ *   Bit mask of rays which are occluded in [tmin, tmax].
+ */
+uint32_t
+ri_bvh_occluded_packet(
+    void                    *accel,
+    ri_ray_packet_t         *packet,
+    ri_float_t               tmin,
+    ri_float_t               tmax,
+    void                    *user)
+{
+    uint32_t       active;
+    ri_bvh_t      *bvh;
+
+    (void)user;
+
+    assert( accel      != NULL );
+    assert( packet     != NULL );
+    assert( packet->nrays <= RI_RAY_PACKET_MAX );
+
+    bvh = (ri_bvh_t *)accel;
+
+    if (bvh->empty) {
+        return 0;
+    }
+
+    ri_prof_add( RI_PROF_NBVH_QUERIES, packet->nrays );
+
+    active = bvh_setup_packet( bvh, packet );
+
+    if (!active) {
+        return 0;
+    }
+
+    return bvh_traverse_packet( NULL, bvh, packet, active, tmin, tmax );
+}
+
 int
 ri_bvh_intersect_beam(
     void                    *accel,
@@ -562,6 +1389,11 @@ ri_bvh_intersect_beam(
         return 0;
     }
 
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+        /* Not supported. */
+        return 0;
+    }
+
     if (user) {
         diag_ptr = (ri_bvh_diag_t *)user;
         memset( diag_ptr, 0, sizeof(ri_bvh_diag_t));
@@ -571,15 +1403,10 @@ ri_bvh_intersect_beam(
     
     int ret;
 
-#ifdef RI_BVH_TRACE_STATISTICS
-    g_stattrav.nbeams++;
-#endif
+    ri_prof_inc( RI_PROF_NBEAMS );
 
-    /*
-     * TODO: Provide indivisual stack for each thread.
-     */
     bvh_stack_t stack;
-    stack.depth = 0;
+    bvh_stack_init( &stack );
 
     /*
      * Firstly check if the beam hits scene bbox.
@@ -593,11 +1420,13 @@ ri_bvh_intersect_beam(
     }
 
     ret = bvh_traverse_beam(  raster_out,
-                              bvh->root,
+                              bvh,
                               diag_ptr, 
                               beam,
                              &stack );
 
+    bvh_stack_flush_stat( &stack );
+
     /*
      * If there's a hit, build intersection state.
      */
@@ -628,6 +1457,11 @@ ri_bvh_intersect_beam_visibility(
         return 0;
     }
 
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+        /* Not supported. Let the caller trace rays. */
+        return RI_BEAM_HIT_PARTIALLY;
+    }
+
     if (user) {
         diag_ptr = (ri_bvh_diag_t *)user;
         memset( diag_ptr, 0, sizeof(ri_bvh_diag_t));
@@ -637,15 +1471,10 @@ ri_bvh_intersect_beam_visibility(
     
     int ret;
 
-#ifdef RI_BVH_TRACE_STATISTICS
-    g_stattrav.nbeams++;
-#endif
+    ri_prof_inc( RI_PROF_NBEAMS );
 
-    /*
-     * TODO: Provide indivisual stack for each thread.
-     */
     bvh_stack_t stack;
-    stack.depth = 0;
+    bvh_stack_init( &stack );
 
     /*
      * Firstly check if the beam hits scene bbox.
@@ -658,47 +1487,98 @@ ri_bvh_intersect_beam_visibility(
         return RI_BEAM_MISS_COMPLETELY;       /* Completely misses */
     }
 
-    ret = bvh_traverse_beam_visibility(  bvh->root,
+    ret = bvh_traverse_beam_visibility(  bvh,
                                          diag_ptr, 
                                          beam,
                                         &stack );
 
+    bvh_stack_flush_stat( &stack );
+
     return ret;
 }
 
+int
+ri_bvh_get_simd_mode()
+{
+    if (g_simd_mode < 0) {
+
+        /* Select the fastest one. */
+        ri_bvh_set_simd_mode( RI_BVH_SIMD_AVX );
+
+    }
+
+    return g_simd_mode;
+}
+
 void
-ri_bvh_clear_stat_traversal()
+ri_bvh_set_simd_mode( int mode )
+{
+#ifndef WITH_SSE
+    mode = RI_BVH_SIMD_SCALAR;
+#endif
+
+#ifdef BVH_WITH_AVX
+    if ((mode == RI_BVH_SIMD_AVX) && !ri_system_cpu_has_avx()) {
+        mode = RI_BVH_SIMD_SSE;
+    }
+#else
+    if (mode == RI_BVH_SIMD_AVX) {
+        mode = RI_BVH_SIMD_SSE;
+    }
+#endif
+
+    if ((mode < RI_BVH_SIMD_SCALAR) || (mode > RI_BVH_SIMD_AVX)) {
+        mode = RI_BVH_SIMD_SCALAR;
+    }
+
+    g_simd_mode = mode;
+}
+
+void
+ri_bvh_set_beam_cache_size( uint64_t size )
 {
-    memset( &g_stattrav, 0, sizeof(ri_bvh_stat_traversal_t));
+    g_beam_cache_size = size;
 }
 
-static double
-percentage( double val, double maxval )
+/*
+ * Traversal statistics are now counted per thread in the profile
+ * counters(see profile.h). These are kept for the testbed.
+ */
+void
+ri_bvh_clear_stat_traversal()
 {
-    return 100.0 * (val / maxval);
+    ri_prof_reset();
 }
 
 void
 ri_bvh_report_stat_traversal()
 {
-    double nrays = g_stattrav.nrays;
+    ri_prof_result_t result;
+    double           nrays;
+
+    ri_prof_merge( &result );
 
-    double inner_node_travs_per_ray = g_stattrav.ninner_node_traversals / nrays;
-    double leaf_node_travs_per_ray  = g_stattrav.nleaf_node_traversals / nrays;
-    double tested_triangles_per_ray = g_stattrav.ntested_triangles / nrays;
-    double actually_hit_triangles_per_ray = g_stattrav.nactually_hit_triangles / nrays;
+    nrays = (double)result.counters[RI_PROF_NBVH_QUERIES];
+
+    double inner_node_travs_per_ray =
+        result.counters[RI_PROF_NINNER_NODES] / nrays;
+    double leaf_node_travs_per_ray  =
+        result.counters[RI_PROF_NLEAF_NODES] / nrays;
+    double tested_triangles_per_ray =
+        result.counters[RI_PROF_NTRIANGLE_TESTS] / nrays;
 
     printf("== BVH traversal statistiscs ==================================================\n");
-    printf("# of rays                    %lld\n", g_stattrav.nrays);
-    printf("# of inner node travs        %lld\n", g_stattrav.ninner_node_traversals);
+    printf("# of rays                    %llu\n",
+        (unsigned long long)result.counters[RI_PROF_NBVH_QUERIES]);
+    printf("# of inner node travs        %llu\n",
+        (unsigned long long)result.counters[RI_PROF_NINNER_NODES]);
     printf("  Per ray                    %f\n", inner_node_travs_per_ray);
-    printf("# of leaf node travs         %lld\n", g_stattrav.nleaf_node_traversals);
+    printf("# of leaf node travs         %llu\n",
+        (unsigned long long)result.counters[RI_PROF_NLEAF_NODES]);
     printf("  Per ray                    %f\n", leaf_node_travs_per_ray);
-    printf("# of tested triangles        %lld\n", g_stattrav.ntested_triangles);
+    printf("# of tested triangles        %llu\n",
+        (unsigned long long)result.counters[RI_PROF_NTRIANGLE_TESTS]);
     printf("  Per ray                    %f\n", tested_triangles_per_ray);
-    printf("# of actually hit triangles  %lld\n", g_stattrav.nactually_hit_triangles);
-    printf("  Per ray                    %f\n", actually_hit_triangles_per_ray);
-    printf("  Hit rate                   %f %%\n", percentage(actually_hit_triangles_per_ray, tested_triangles_per_ray));
 
 
     printf("===============================================================================\n");
@@ -712,32 +1592,87 @@ ri_bvh_report_stat_traversal()
  *
  * ------------------------------------------------------------------------ */
 
-ri_qbvh_node_t *
-ri_qbvh_node_new()
+bvh_build_node_t *
+bvh_build_node_new()
 {
-    ri_qbvh_node_t *node;
+    bvh_build_node_t *node;
 
-    node = (ri_qbvh_node_t *)ri_mem_alloc(sizeof(ri_qbvh_node_t));
+    node = (bvh_build_node_t *)ri_mem_alloc(sizeof(bvh_build_node_t));
 
-    memset( node, 0, sizeof( ri_qbvh_node_t ));
+    memset( node, 0, sizeof( bvh_build_node_t ));
 
     return node;
 }
 
+void
+bvh_build_node_free( bvh_build_node_t *node )
+{
+    if (!node->is_leaf) {
+        bvh_build_node_free( node->child[0] );
+        bvh_build_node_free( node->child[1] );
+    }
+
+    ri_mem_free( node );
+}
+
+/*
+ * Fetches vertices of the referenced triangle from its geometry.
+ */
+static inline void
+bvh_get_vertices(
+    const ri_float_t      **v0_out,     /* [out] */
+    const ri_float_t      **v1_out,     /* [out] */
+    const ri_float_t      **v2_out,     /* [out] */
+    const ri_bvh_t         *bvh,
+    const ri_bvh_triref_t  *ref)
+{
+    const ri_geom_t    *geom = bvh->geoms[ref->geom_id];
+    const unsigned int *idx  = geom->indices + 3 * (uint64_t)ref->index;
+
+    (*v0_out) = geom->positions[idx[0]];
+    (*v1_out) = geom->positions[idx[1]];
+    (*v2_out) = geom->positions[idx[2]];
+}
+
+/*
+ * Makes a temporary ri_triangle_t of the referenced triangle, for the beam
+ * tracing routines which work on ri_triangle_t.
+ */
+static inline void
+bvh_get_triangle(
+    ri_triangle_t          *tri_out,    /* [out] */
+    const ri_bvh_t         *bvh,
+    const ri_bvh_triref_t  *ref)
+{
+    const ri_float_t *v0, *v1, *v2;
+
+    bvh_get_vertices( &v0, &v1, &v2, bvh, ref );
+
+    vcpy( tri_out->v[0], v0 );
+    vcpy( tri_out->v[1], v1 );
+    vcpy( tri_out->v[2], v2 );
+
+    tri_out->geom  = bvh->geoms[ref->geom_id];
+    tri_out->index = 3 * ref->index;
+}
+
 /*
  * TODO: SIMD optimzation.
  */
 static inline int
 triangle_isect(
-    uint32_t            *tid_inout,
-    ri_float_t          *t_inout,
-    ri_float_t          *u_inout,
-    ri_float_t          *v_inout,
-    const ri_triangle_t *triangle,
-    ri_vector_t          rayorg,
-    ri_vector_t          raydir,
-    uint32_t             tid)
+    uint32_t              *tid_inout,
+    ri_float_t            *t_inout,
+    ri_float_t            *u_inout,
+    ri_float_t            *v_inout,
+    ri_float_t             tmin,        /* lower bound of t     */
+    const ri_bvh_t        *bvh,
+    const ri_bvh_triref_t *ref,
+    ri_vector_t            rayorg,
+    ri_vector_t            raydir,
+    uint32_t               tid)
 {
+    const ri_float_t *p0, *p1, *p2;
     ri_vector_t v0, v1, v2; 
     ri_vector_t e1, e2; 
     ri_vector_t p, s, q;
@@ -745,9 +1680,11 @@ triangle_isect(
     ri_float_t  t, u, v;
     double      eps = 1.0e-14;
 
-    vcpy( v0, triangle->v[0] );
-    vcpy( v1, triangle->v[1] );
-    vcpy( v2, triangle->v[2] );
+    bvh_get_vertices( &p0, &p1, &p2, bvh, ref );
+
+    vcpy( v0, p0 );
+    vcpy( v1, p1 );
+    vcpy( v2, p2 );
 
     vsub( e1, v1, v0 );
     vsub( e2, v2, v0 );
@@ -777,7 +1714,7 @@ triangle_isect(
         return 0;
     }
 
-    if ( (t < 0.0) || (t > (*t_inout)) ) {
+    if ( (t < tmin) || (t > (*t_inout)) ) {
         return 0;
     }
 
@@ -790,780 +1727,4004 @@ triangle_isect(
 
 }
 
-int
-bvh_intersect_leaf_node(
-    ri_intersection_state_t *state_out,     /* [out]    */
-    const ri_qbvh_node_t    *node,
-    ri_ray_t                *ray )
-{
-    double         t, u, v;
-    uint32_t       tid;
-
-    int            hit;
-    int            hitsum;
-    uint32_t       i;
-    uint32_t       ntriangles;
-    ri_triangle_t *triangles;
-
-    ri_vector_t rayorg; 
-    ri_vector_t raydir; 
-
-    /*
-     * Init
-     */
-    t      = RI_INFINITY;
-    u      = 0.0;
-    v      = 0.0;
-    tid    = 0;
-    hit    = 0;
-    hitsum = 0;
-    vcpy( rayorg, ray->org );
-    vcpy( raydir, ray->dir );
+#ifdef WITH_SSE
 
-    triangles  = (ri_triangle_t *)node->child[0];
-    ntriangles = *((uint32_t *)&node->bbox[0]);
+/*
+ * Selects the nearest hit among SIMD lanes. Follows the scalar loop's rule:
+ * a later triangle with equal distance wins.
+ */
+static inline void
+select_hit_lanes(
+    uint32_t            *tid_inout,
+    ri_float_t          *t_inout,
+    ri_float_t          *u_inout,
+    ri_float_t          *v_inout,
+    int                  mask,
+    const ri_float_t    *t,
+    const ri_float_t    *u,
+    const ri_float_t    *v,
+    uint32_t             tid,           /* tid of lane 0 */
+    int                  nlanes)
+{
+    int i;
 
-#ifdef RI_BVH_ENABLE_DIAGNOSTICS
-    if (gdiag) gdiag->ntriangle_isects++;
-#endif
-#ifdef RI_BVH_TRACE_STATISTICS
-    g_stattrav.ntested_triangles += ntriangles;
-#endif
+    for (i = 0; i < nlanes; i++) {
 
-    for (i = 0; i < ntriangles; i++) {
+        if ((mask & (1 << i)) && (t[i] <= (*t_inout))) {
 
-        hit = triangle_isect(
-                    &tid, &t, &u, &v,
-                    &triangles[i],
-                    rayorg, raydir,
-                    i);
+            (*t_inout)   = t[i];
+            (*u_inout)   = u[i];
+            (*v_inout)   = v[i];
+            (*tid_inout) = tid + i;
 
-#ifdef RI_BVH_TRACE_STATISTICS
-        if (hit) {
-            g_stattrav.nactually_hit_triangles++;
         }
-#endif
-       
-        hitsum |= hit;
     }
+}
 
-    if (hitsum && (t < state_out->t)) {
-
-        /* 
-         * Update isect state
-         */
-        state_out->t     = t;
-        state_out->u     = u;
-        state_out->v     = v;
-        state_out->geom  = triangles[tid].geom;
-        state_out->index = triangles[tid].index;
+/*
+ * Intersects 4 triangles using SSE2. 2 triangles are processed at a time.
+ */
+static inline int
+triangle4_isect_sse(
+    uint32_t             *tid_inout,
+    ri_float_t           *t_inout,
+    ri_float_t           *u_inout,
+    ri_float_t           *v_inout,
+    ri_float_t            tmin,         /* lower bound of t     */
+    const ri_triangle4_t *tri4,
+    const ri_ray_t       *ray,
+    uint32_t              tid)
+{
+    int     k;
+    int     mask;
+    int     hitsum = 0;
+
+    double  t[2], u[2], v[2];
+
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d one  = _mm_set1_pd(1.0);
+    const __m128d eps  = _mm_set1_pd(1.0e-14);
+    const __m128d sgn  = _mm_set1_pd(-0.0);
+
+    const __m128d ox   = _mm_set1_pd(ray->org[0]);
+    const __m128d oy   = _mm_set1_pd(ray->org[1]);
+    const __m128d oz   = _mm_set1_pd(ray->org[2]);
+    const __m128d dx   = _mm_set1_pd(ray->dir[0]);
+    const __m128d dy   = _mm_set1_pd(ray->dir[1]);
+    const __m128d dz   = _mm_set1_pd(ray->dir[2]);
+
+    for (k = 0; k < 4; k += 2) {
+
+        __m128d e1x = _mm_load_pd(&tri4->e1x[k]);
+        __m128d e1y = _mm_load_pd(&tri4->e1y[k]);
+        __m128d e1z = _mm_load_pd(&tri4->e1z[k]);
+        __m128d e2x = _mm_load_pd(&tri4->e2x[k]);
+        __m128d e2y = _mm_load_pd(&tri4->e2y[k]);
+        __m128d e2z = _mm_load_pd(&tri4->e2z[k]);
+
+        /* p = dir x e2 */
+        __m128d px  = _mm_sub_pd(_mm_mul_pd(dy, e2z), _mm_mul_pd(dz, e2y));
+        __m128d py  = _mm_sub_pd(_mm_mul_pd(dz, e2x), _mm_mul_pd(dx, e2z));
+        __m128d pz  = _mm_sub_pd(_mm_mul_pd(dx, e2y), _mm_mul_pd(dy, e2x));
+
+        /* a = e1 . p */
+        __m128d a   = _mm_add_pd(_mm_add_pd(_mm_mul_pd(e1x, px),
+                                            _mm_mul_pd(e1y, py)),
+                                 _mm_mul_pd(e1z, pz));
+
+        __m128d valid = _mm_cmpgt_pd(_mm_andnot_pd(sgn, a), eps);
+
+        if (_mm_movemask_pd(valid) == 0) continue;
+
+        __m128d inva = _mm_div_pd(one, a);
+
+        /* s = org - v0 */
+        __m128d sx  = _mm_sub_pd(ox, _mm_load_pd(&tri4->p0x[k]));
+        __m128d sy  = _mm_sub_pd(oy, _mm_load_pd(&tri4->p0y[k]));
+        __m128d sz  = _mm_sub_pd(oz, _mm_load_pd(&tri4->p0z[k]));
+
+        /* q = s x e1 */
+        __m128d qx  = _mm_sub_pd(_mm_mul_pd(sy, e1z), _mm_mul_pd(sz, e1y));
+        __m128d qy  = _mm_sub_pd(_mm_mul_pd(sz, e1x), _mm_mul_pd(sx, e1z));
+        __m128d qz  = _mm_sub_pd(_mm_mul_pd(sx, e1y), _mm_mul_pd(sy, e1x));
+
+        __m128d vu  = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(sx, px),
+                                                       _mm_mul_pd(sy, py)),
+                                            _mm_mul_pd(sz, pz)), inva);
+        __m128d vv  = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(qx, dx),
+                                                       _mm_mul_pd(qy, dy)),
+                                            _mm_mul_pd(qz, dz)), inva);
+        __m128d vt  = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(e2x, qx),
+                                                       _mm_mul_pd(e2y, qy)),
+                                            _mm_mul_pd(e2z, qz)), inva);
+
+        /* Negated compares to give the same result as scalar code for NaN */
+        valid = _mm_and_pd(valid, _mm_cmpnlt_pd(vu, zero));
+        valid = _mm_and_pd(valid, _mm_cmpngt_pd(vu, one));
+        valid = _mm_and_pd(valid, _mm_cmpnlt_pd(vv, zero));
+        valid = _mm_and_pd(valid, _mm_cmpngt_pd(_mm_add_pd(vu, vv), one));
+        valid = _mm_and_pd(valid, _mm_cmpnlt_pd(vt, _mm_set1_pd(tmin)));
+        valid = _mm_and_pd(valid, _mm_cmpngt_pd(vt, _mm_set1_pd(*t_inout)));
+
+        mask = _mm_movemask_pd(valid);
+
+        if (mask) {
+
+            _mm_storeu_pd(t, vt);
+            _mm_storeu_pd(u, vu);
+            _mm_storeu_pd(v, vv);
+
+            select_hit_lanes( tid_inout, t_inout, u_inout, v_inout,
+                              mask, t, u, v, tid + k, 2 );
+
+            hitsum = 1;
+        }
 
     }
 
     return hitsum;
 }
 
+#ifdef BVH_WITH_AVX
+
 /*
- * Ray - AABB intersection test
+ * Intersects 4 triangles at once using AVX.
  */
-static inline int
-test_ray_aabb(
-    ri_float_t        *tmin_out,             /* [out]    */
-    ri_float_t        *tmax_out,             /* [out]    */
-    const ri_vector_t  bmin,
-    const ri_vector_t  bmax,
-    ri_ray_t          *ray)
+static BVH_TARGET_AVX int
+triangle4_isect_avx(
+    uint32_t             *tid_inout,
+    ri_float_t           *t_inout,
+    ri_float_t           *u_inout,
+    ri_float_t           *v_inout,
+    ri_float_t            tmin,         /* lower bound of t     */
+    const ri_triangle4_t *tri4,
+    const ri_ray_t       *ray,
+    uint32_t              tid)
 {
-    /* TODO: handle extreme case: NaN, Inf */
+    int     mask;
+
+    double  t[4], u[4], v[4];
+
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one  = _mm256_set1_pd(1.0);
+    const __m256d eps  = _mm256_set1_pd(1.0e-14);
+    const __m256d sgn  = _mm256_set1_pd(-0.0);
+
+    const __m256d dx   = _mm256_broadcast_sd(&ray->dir[0]);
+    const __m256d dy   = _mm256_broadcast_sd(&ray->dir[1]);
+    const __m256d dz   = _mm256_broadcast_sd(&ray->dir[2]);
+
+    __m256d e1x = _mm256_load_pd(tri4->e1x);
+    __m256d e1y = _mm256_load_pd(tri4->e1y);
+    __m256d e1z = _mm256_load_pd(tri4->e1z);
+    __m256d e2x = _mm256_load_pd(tri4->e2x);
+    __m256d e2y = _mm256_load_pd(tri4->e2y);
+    __m256d e2z = _mm256_load_pd(tri4->e2z);
+
+    /* p = dir x e2 */
+    __m256d px  = _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+    __m256d py  = _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+    __m256d pz  = _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+
+    /* a = e1 . p */
+    __m256d a   = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e1x, px),
+                                              _mm256_mul_pd(e1y, py)),
+                                _mm256_mul_pd(e1z, pz));
+
+    __m256d valid = _mm256_cmp_pd(_mm256_andnot_pd(sgn, a), eps, _CMP_GT_OQ);
+
+    if (_mm256_movemask_pd(valid) == 0) return 0;
+
+    __m256d inva = _mm256_div_pd(one, a);
+
+    /* s = org - v0 */
+    __m256d sx  = _mm256_sub_pd(_mm256_broadcast_sd(&ray->org[0]),
+                                _mm256_load_pd(tri4->p0x));
+    __m256d sy  = _mm256_sub_pd(_mm256_broadcast_sd(&ray->org[1]),
+                                _mm256_load_pd(tri4->p0y));
+    __m256d sz  = _mm256_sub_pd(_mm256_broadcast_sd(&ray->org[2]),
+                                _mm256_load_pd(tri4->p0z));
+
+    /* q = s x e1 */
+    __m256d qx  = _mm256_sub_pd(_mm256_mul_pd(sy, e1z), _mm256_mul_pd(sz, e1y));
+    __m256d qy  = _mm256_sub_pd(_mm256_mul_pd(sz, e1x), _mm256_mul_pd(sx, e1z));
+    __m256d qz  = _mm256_sub_pd(_mm256_mul_pd(sx, e1y), _mm256_mul_pd(sy, e1x));
+
+    __m256d vu  = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(sx, px),
+                                                            _mm256_mul_pd(sy, py)),
+                                              _mm256_mul_pd(sz, pz)), inva);
+    __m256d vv  = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(qx, dx),
+                                                            _mm256_mul_pd(qy, dy)),
+                                              _mm256_mul_pd(qz, dz)), inva);
+    __m256d vt  = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e2x, qx),
+                                                            _mm256_mul_pd(e2y, qy)),
+                                              _mm256_mul_pd(e2z, qz)), inva);
+
+    /* Negated compares to give the same result as scalar code for NaN */
+    valid = _mm256_and_pd(valid, _mm256_cmp_pd(vu, zero, _CMP_NLT_UQ));
+    valid = _mm256_and_pd(valid, _mm256_cmp_pd(vu, one , _CMP_NGT_UQ));
+    valid = _mm256_and_pd(valid, _mm256_cmp_pd(vv, zero, _CMP_NLT_UQ));
+    valid = _mm256_and_pd(valid, _mm256_cmp_pd(_mm256_add_pd(vu, vv), one,
+                                               _CMP_NGT_UQ));
+    valid = _mm256_and_pd(valid, _mm256_cmp_pd(vt, _mm256_set1_pd(tmin),
+                                               _CMP_NLT_UQ));
+    valid = _mm256_and_pd(valid, _mm256_cmp_pd(vt,
+                                               _mm256_set1_pd(*t_inout),
+                                               _CMP_NGT_UQ));
+
+    mask = _mm256_movemask_pd(valid);
+
+    if (mask == 0) return 0;
+
+    _mm256_storeu_pd(t, vt);
+    _mm256_storeu_pd(u, vu);
+    _mm256_storeu_pd(v, vv);
+
+    select_hit_lanes( tid_inout, t_inout, u_inout, v_inout,
+                      mask, t, u, v, tid, 4 );
 
-    double tmin, tmax;
-    
-    const double min_x = ray->dir_sign[0] ? bmax[0] : bmin[0];
-    const double min_y = ray->dir_sign[1] ? bmax[1] : bmin[1];
-    const double min_z = ray->dir_sign[2] ? bmax[2] : bmin[2];
-    const double max_x = ray->dir_sign[0] ? bmin[0] : bmax[0];
-    const double max_y = ray->dir_sign[1] ? bmin[1] : bmax[1];
-    const double max_z = ray->dir_sign[2] ? bmin[2] : bmax[2];
-
-    /*
-     * X
-     */
-    const double tmin_x = (min_x - ray->org[0]) * ray->invdir[0];
-    const double tmax_x = (max_x - ray->org[0]) * ray->invdir[0];
-
-    /*
-     * Y
-     */
-    const double tmin_y = (min_y - ray->org[1]) * ray->invdir[1];
-    const double tmax_y = (max_y - ray->org[1]) * ray->invdir[1];
+    return 1;
+}
 
-    /* Early exit: (tmin_x > tmax_y) || (tmin_y > tmax_x) => false  */
-    // if ( (tmin_x > tmax_y) || (tmin_y > tmax_x) ) {
-    //     return 0;
-    // }
+#endif  /* BVH_WITH_AVX */
 
-    tmin = (tmin_x > tmin_y) ? tmin_x : tmin_y;
-    tmax = (tmax_x < tmax_y) ? tmax_x : tmax_y;
+#endif  /* WITH_SSE */
 
-    /*
-     * Z
-     */
-    const double tmin_z = (min_z - ray->org[2]) * ray->invdir[2];
-    const double tmax_z = (max_z - ray->org[2]) * ray->invdir[2];
+/*
+ * fp32 BVH.
+ *
+ * Rounds double to float toward -inf(round_down) or +inf(round_up).
+ */
+static inline float
+flt_round_down(
+    double x)
+{
+    float f = (float)x;
 
-    /* Early exit: (tmin > tmax_z) || (tmin_z > tmax) => false  */
-    // if ( (tmin > tmax_z) || (tmin_z > tmax) ) {
-    //     return 0;
-    // }
+    if ((double)f > x) f = nextafterf(f, -HUGE_VALF);
 
-    tmin = (tmin > tmin_z) ? tmin : tmin_z;
-    tmax = (tmax < tmax_z) ? tmax : tmax_z;
+    return f;
+}
 
-    /* (tmax > 0.0) && (tmin <= tmax) => hit
-     *
-     * Include tmin == tmax case(hit 2D plane).
-     */
-    if ( (tmax > 0.0) && (tmin <= tmax) ) {
+static inline float
+flt_round_up(
+    double x)
+{
+    float f = (float)x;
 
-        (*tmin_out) = tmin;
-        (*tmax_out) = tmax;
+    if ((double)f < x) f = nextafterf(f, HUGE_VALF);
 
-        return 1;
-    }
+    return f;
+}
 
-    return 0;   /* no hit */
+/*
+ * Widened t range for fp32 tests. Hits found in this range are decided
+ * with the t refined in double.
+ */
+static inline float
+flt_t_lower(
+    ri_float_t tmin)
+{
+    return flt_round_down(tmin - BVH_FLT_T_MARGIN * fabs(tmin));
+}
 
+static inline float
+flt_t_upper(
+    ri_float_t tmax)
+{
+    return flt_round_up(tmax + BVH_FLT_T_MARGIN * fabs(tmax));
 }
 
+/*
+ * Watertight ray-triangle test[4] against k'th triangle of tri4f.
+ * Edge functions which are exactly 0 in float are recomputed in double,
+ * so that the ray hits exactly one of the triangles sharing an edge or
+ * a vertex.
+ *
+ * Returns:
+ *
+ *   1 and t if the ray hits the triangle in [tlo, thi], 0 if not.
+ */
 static inline int
-test_ray_node(
-    int                  *order_out,      /* [out]    */
-    ri_float_t            tmax,
-    const ri_qbvh_node_t *node,
-    ri_ray_t             *ray)
+triangle_isect_wt(
+    float                 *t_out,           /* [out]    */
+    const ri_triangle4f_t *tri4f,
+    int                    k,
+    const ri_ray_t        *ray,
+    float                  tlo,
+    float                  thi)
 {
-    ri_vector_t bmin_left  , bmax_left;
-    ri_vector_t bmin_right , bmax_right;
-
-    ri_float_t  tmin_left  = 0.0, tmax_left  = 0.0;
-    ri_float_t  tmin_right = 0.0, tmax_right = 0.0;
-
-    int         hit_left   , hit_right;
+    float a[3], b[3], c[3];
+    float ax, ay, bx, by, cx, cy;
+    float u, v, w, det, t;
+
+    const int   kx = ray->wt_k[0];
+    const int   ky = ray->wt_k[1];
+    const int   kz = ray->wt_k[2];
+    const float sx = ray->wt_s[0];
+    const float sy = ray->wt_s[1];
+    const float sz = ray->wt_s[2];
+
+    /* Vertices relative to the ray origin. */
+    a[0] = tri4f->p0x[k] - ray->org32[0];
+    a[1] = tri4f->p0y[k] - ray->org32[1];
+    a[2] = tri4f->p0z[k] - ray->org32[2];
+    b[0] = tri4f->p1x[k] - ray->org32[0];
+    b[1] = tri4f->p1y[k] - ray->org32[1];
+    b[2] = tri4f->p1z[k] - ray->org32[2];
+    c[0] = tri4f->p2x[k] - ray->org32[0];
+    c[1] = tri4f->p2y[k] - ray->org32[1];
+    c[2] = tri4f->p2z[k] - ray->org32[2];
+
+    /* Shear so that the ray is +z. */
+    ax = a[kx] - sx * a[kz];
+    ay = a[ky] - sy * a[kz];
+    bx = b[kx] - sx * b[kz];
+    by = b[ky] - sy * b[kz];
+    cx = c[kx] - sx * c[kz];
+    cy = c[ky] - sy * c[kz];
+
+    /* Scaled barycentric coordinates. */
+    u = cx * by - cy * bx;
+    v = ax * cy - ay * cx;
+    w = bx * ay - by * ax;
+
+    if ((u == 0.0f) || (v == 0.0f) || (w == 0.0f)) {
+        u = (float)((double)cx * (double)by - (double)cy * (double)bx);
+        v = (float)((double)ax * (double)cy - (double)ay * (double)cx);
+        w = (float)((double)bx * (double)ay - (double)by * (double)ax);
+    }
 
-    int         retcode = 0;
+    if (((u < 0.0f) || (v < 0.0f) || (w < 0.0f)) &&
+        ((u > 0.0f) || (v > 0.0f) || (w > 0.0f))) {
+        return 0;
+    }
 
-    bmin_left[0]  = node->bbox[BMIN_X0];
-    bmin_left[1]  = node->bbox[BMIN_Y0];
-    bmin_left[2]  = node->bbox[BMIN_Z0];
-    bmax_left[0]  = node->bbox[BMAX_X0];
-    bmax_left[1]  = node->bbox[BMAX_Y0];
-    bmax_left[2]  = node->bbox[BMAX_Z0];
-    bmin_right[0] = node->bbox[BMIN_X1];
-    bmin_right[1] = node->bbox[BMIN_Y1];
-    bmin_right[2] = node->bbox[BMIN_Z1];
-    bmax_right[0] = node->bbox[BMAX_X1];
-    bmax_right[1] = node->bbox[BMAX_Y1];
-    bmax_right[2] = node->bbox[BMAX_Z1];
+    det = u + v + w;
 
-#ifdef WITH_SSE
+    if (det == 0.0f) {
+        return 0;
+    }
 
-#define VSEL(a, b, mask) _mm_or_pd(_mm_and_pd(b, mask), _mm_andnot_pd(mask, a))
+    t = sz * (u * a[kz] + v * b[kz] + w * c[kz]) / det;
 
-#if 0
-    __m128d vbmin[3], vbmax[3];
-
-    vbmin[0]   = _mm_loadu_pd(&node->bbox[BMIN_X0]); // 0, 1
-    vbmin[1]   = _mm_loadu_pd(&node->bbox[BMIN_Y0]); // 0, 1
-    vbmin[2]   = _mm_loadu_pd(&node->bbox[BMIN_Z0]); // 0, 1
-    vbmax[0]   = _mm_loadu_pd(&node->bbox[BMAX_X0]); // 0, 1
-    vbmax[1]   = _mm_loadu_pd(&node->bbox[BMAX_Y0]); // 0, 1
-    vbmax[2]   = _mm_loadu_pd(&node->bbox[BMAX_Z0]); // 0, 1
-
-    __m128d vminval[3], vmaxval[3];
-    __m128d vraysign[3];
-
-    vraysign[0] = _mm_set_pd1(ray->dir_signv[0]);
-    vraysign[1] = _mm_set_pd1(ray->dir_signv[1]);
-    vraysign[2] = _mm_set_pd1(ray->dir_signv[2]);
-
-    vminval[0] = VSEL(vbmin[0], vbmax[0], vraysign[0]);
-    vminval[1] = VSEL(vbmin[1], vbmax[1], vraysign[1]);
-    vminval[2] = VSEL(vbmin[2], vbmax[2], vraysign[2]);
-
-    vmaxval[0] = VSEL(vbmax[0], vbmin[0], vraysign[0]);
-    vmaxval[1] = VSEL(vbmax[1], vbmin[1], vraysign[1]);
-    vmaxval[2] = VSEL(vbmax[2], vbmin[2], vraysign[2]);
-
-    __m128d vtmin[3], vtmax[3];
-    __m128d vrayorg[3], vrayinvdir[3];
-
-    vrayorg[0] = _mm_set_pd1(ray->org[0]);
-    vrayorg[1] = _mm_set_pd1(ray->org[1]);
-    vrayorg[2] = _mm_set_pd1(ray->org[2]);
-
-    vrayinvdir[0] = _mm_set_pd1(ray->invdir[0]);
-    vrayinvdir[1] = _mm_set_pd1(ray->invdir[1]);
-    vrayinvdir[2] = _mm_set_pd1(ray->invdir[2]);
-
-    vtmin[0] = _mm_mul_pd(_mm_sub_pd(vminval[0], vrayorg[0]), vrayinvdir[0]);
-    vtmin[1] = _mm_mul_pd(_mm_sub_pd(vminval[1], vrayorg[1]), vrayinvdir[1]);
-    vtmin[2] = _mm_mul_pd(_mm_sub_pd(vminval[2], vrayorg[2]), vrayinvdir[2]);
-
-    vtmax[0] = _mm_mul_pd(_mm_sub_pd(vmaxval[0], vrayorg[0]), vrayinvdir[0]);
-    vtmax[1] = _mm_mul_pd(_mm_sub_pd(vmaxval[1], vrayorg[1]), vrayinvdir[1]);
-    vtmax[2] = _mm_mul_pd(_mm_sub_pd(vmaxval[2], vrayorg[2]), vrayinvdir[2]);
-
-    __m128d vtmin_max = _mm_max_pd(vtmin[0], _mm_max_pd(vtmin[1], vtmin[2]));
-    __m128d vtmax_min = _mm_min_pd(vtmax[0], _mm_min_pd(vtmax[1], vtmax[2]));
-
-    // tmax_min > 0.0 & tmin_max <= tmax_min && tmin_max < tmax
-    __m128d vmask = _mm_and_pd(
-                        _mm_and_pd(
-                            _mm_cmpgt_pd(vtmax_min, _mm_set_pd1(0.0)),
-                            _mm_cmple_pd(vtmin_max, vtmax_min)),
-                        _mm_cmplt_pd(vtmin_max, _mm_set_pd1(tmax)));
-                        
-    retcode = _mm_movemask_pd(vmask);   // 00, 01, 10 or 11
+    /* Negated to reject NaN */
+    if (!((t >= tlo) && (t <= thi))) {
+        return 0;
+    }
 
-#endif
+    (*t_out) = t;
 
-    hit_left = test_ray_aabb( &tmin_left, &tmax_left,
-                               bmin_left,  bmax_left,
-                               ray );
+    return 1;
+}
 
-    hit_right = test_ray_aabb( &tmin_right, &tmax_right,
-                                bmin_right,  bmax_right,
-                                ray );
+#ifdef WITH_SSE
 
-    if ( hit_left && (tmin_left < tmax) ) {
-        retcode |= 1;
-    }
+/*
+ * SSE version of triangle_isect_wt() for 4 triangles. Performs the same
+ * floating point operations. Falls back to triangle_isect_wt() when some
+ * edge function is 0.
+ */
+static inline int
+triangle4f_isect_sse(
+    float                  t_out[4],        /* [out]    */
+    const ri_triangle4f_t *tri4f,
+    const ri_ray_t        *ray,
+    float                  tlo,
+    float                  thi,
+    int                    lanes)           /* mask of valid lanes */
+{
+    int k;
+    int mask;
+
+    const float *p0[3] = { tri4f->p0x, tri4f->p0y, tri4f->p0z };
+    const float *p1[3] = { tri4f->p1x, tri4f->p1y, tri4f->p1z };
+    const float *p2[3] = { tri4f->p2x, tri4f->p2y, tri4f->p2z };
+
+    const int    kx = ray->wt_k[0];
+    const int    ky = ray->wt_k[1];
+    const int    kz = ray->wt_k[2];
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 sx   = _mm_set1_ps(ray->wt_s[0]);
+    const __m128 sy   = _mm_set1_ps(ray->wt_s[1]);
+    const __m128 sz   = _mm_set1_ps(ray->wt_s[2]);
+    const __m128 ox   = _mm_set1_ps(ray->org32[kx]);
+    const __m128 oy   = _mm_set1_ps(ray->org32[ky]);
+    const __m128 oz   = _mm_set1_ps(ray->org32[kz]);
+
+    __m128 az = _mm_sub_ps(_mm_load_ps(p0[kz]), oz);
+    __m128 bz = _mm_sub_ps(_mm_load_ps(p1[kz]), oz);
+    __m128 cz = _mm_sub_ps(_mm_load_ps(p2[kz]), oz);
+
+    __m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p0[kx]), ox),
+                           _mm_mul_ps(sx, az));
+    __m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p0[ky]), oy),
+                           _mm_mul_ps(sy, az));
+    __m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p1[kx]), ox),
+                           _mm_mul_ps(sx, bz));
+    __m128 by = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p1[ky]), oy),
+                           _mm_mul_ps(sy, bz));
+    __m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p2[kx]), ox),
+                           _mm_mul_ps(sx, cz));
+    __m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p2[ky]), oy),
+                           _mm_mul_ps(sy, cz));
+
+    __m128 u  = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+    __m128 v  = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+    __m128 w  = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+    __m128 edge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero),
+                                      _mm_cmpeq_ps(v, zero)),
+                            _mm_cmpeq_ps(w, zero));
+
+    if (_mm_movemask_ps(edge) & lanes) {
+
+        /* Rare. Let the scalar code recompute edge functions in double. */
+        mask = 0;
+
+        for (k = 0; k < 4; k++) {
+            if ((lanes & (1 << k)) &&
+                triangle_isect_wt( &t_out[k], tri4f, k, ray, tlo, thi )) {
+                mask |= (1 << k);
+            }
+        }
 
-    if ( hit_right && (tmin_right < tmax) ) {
-        retcode |= 2;
+        return mask;
     }
 
-#else
-
+    __m128 neg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero),
+                                     _mm_cmplt_ps(v, zero)),
+                           _mm_cmplt_ps(w, zero));
+    __m128 pos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero),
+                                     _mm_cmpgt_ps(v, zero)),
+                           _mm_cmpgt_ps(w, zero));
 
+    __m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
 
+    __m128 t   = _mm_div_ps(_mm_mul_ps(sz,
+                                _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, az),
+                                                      _mm_mul_ps(v, bz)),
+                                           _mm_mul_ps(w, cz))),
+                            det);
 
-#if defined(WITH_MUDA)
+    __m128 valid = _mm_andnot_ps(_mm_and_ps(neg, pos),
+                                 _mm_cmpneq_ps(det, zero));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(t, _mm_set1_ps(tlo)));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(t, _mm_set1_ps(thi)));
 
-    ray_aabb_mu(&hit_left, &tmin_left, &tmax_left,
-                ray->org, ray->dir_signv, ray->invdir, bmin_left, bmax_left);
-    ray_aabb_mu(&hit_right, &tmin_right, &tmax_right,
-                ray->org, ray->dir_signv, ray->invdir, bmin_right, bmax_right);
+    mask = _mm_movemask_ps(valid) & lanes;
 
-#else
+    if (mask) {
+        _mm_storeu_ps(t_out, t);
+    }
 
-    hit_left = test_ray_aabb( &tmin_left, &tmax_left,
-                               bmin_left,  bmax_left,
-                               ray );
+    return mask;
+}
 
-    hit_right = test_ray_aabb( &tmin_right, &tmax_right,
-                                bmin_right,  bmax_right,
-                                ray );
-#endif
+#endif  /* WITH_SSE */
 
-    if ( hit_left && (tmin_left < tmax) ) {
-        retcode |= 1;
-    }
+/*
+ * Tests 4 triangles of the fp32 BVH. The 4-wide SSE code is used for both
+ * SSE and AVX modes, since 8-wide AVX needs groups of 8 triangles.
+ *
+ * Returns:
+ *
+ *   Bit mask of hit triangles. t_out[i] is set for i'th bit.
+ */
+static inline int
+triangle4f_isect(
+    float                  t_out[4],        /* [out]    */
+    const ri_triangle4f_t *tri4f,
+    const ri_ray_t        *ray,
+    float                  tlo,
+    float                  thi,
+    int                    lanes)           /* mask of valid lanes */
+{
+    int k;
+    int mask = 0;
 
-    if ( hit_right && (tmin_right < tmax) ) {
-        retcode |= 2;
+#ifdef WITH_SSE
+    if (g_simd_mode != RI_BVH_SIMD_SCALAR) {
+        return triangle4f_isect_sse( t_out, tri4f, ray, tlo, thi, lanes );
     }
-
 #endif
-    
 
-    (*order_out) = ray->dir_sign[node->axis0];
+    for (k = 0; k < 4; k++) {
+        if ((lanes & (1 << k)) &&
+            triangle_isect_wt( &t_out[k], tri4f, k, ray, tlo, thi )) {
+            mask |= (1 << k);
+        }
+    }
 
-    return retcode;
+    return mask;
 }
 
 /*
- * BVH traversal routine.
+ * Computes t, u and v of the hit with the double precision vertices of the
+ * source triangle. The fp32 test already decided that the ray hits the
+ * triangle, thus u and v are only clamped into the triangle.
  *
  * Returns:
  *
- *   1 if ray hits any occluder, 0 if no hit.
+ *   0 if the triangle is degenerate in double, 1 otherwise.
  */
-int
-bvh_traverse(
-    ri_intersection_state_t *state_out,     /* [out]        */
-    const ri_qbvh_node_t    *root,
-    ri_bvh_diag_t           *diag,          /* [modified]   */
-    ri_ray_t                *ray,
-    bvh_stack_t             *stack )        /* [buffer]     */
+static inline int
+refine_hit(
+    ri_float_t            *t_out,           /* [out]    */
+    ri_float_t            *u_out,           /* [out]    */
+    ri_float_t            *v_out,           /* [out]    */
+    const ri_bvh_t        *bvh,
+    const ri_bvh_triref_t *ref,
+    const ri_ray_t        *ray)
 {
-    
-    const ri_qbvh_node_t *node;
-    int                   ret;
-    int                   order;            /* traversal order  */
+    const ri_float_t *p0, *p1, *p2;
 
-    assert( root != NULL );
+    ri_vector_t v0, v1, v2;
+    ri_vector_t e1, e2;
+    ri_vector_t p, s, q;
+    ri_float_t  a, inva;
+    ri_float_t  u, v;
 
-#ifdef RI_BVH_ENABLE_DIAGNOSTICS
-    gdiag = diag;
-#endif
+    bvh_get_vertices( &p0, &p1, &p2, bvh, ref );
 
-    /*
-     * Initialize intersection state.
-     */ 
-    state_out->t     = RI_INFINITY;
-    state_out->u     = 0.0;
-    state_out->v     = 0.0;
-    state_out->geom  = NULL;
-    state_out->index = 0;
+    vcpy( v0, p0 );
+    vcpy( v1, p1 );
+    vcpy( v2, p2 );
 
-    node = root;
+    vsub( e1, v1, v0 );
+    vsub( e2, v2, v0 );
 
-    while (1) {
+    vcross( p, ray->dir, e2 );
 
-        if ( node->is_leaf ) {
+    a = vdot( e1, p );
 
-#ifdef RI_BVH_ENABLE_DIAGNOSTICS
-            if (gdiag) gdiag->nleaf_node_traversals++;
-#endif
-#ifdef RI_BVH_TRACE_STATISTICS
-            g_stattrav.nleaf_node_traversals++;
-#endif
+    if (a == 0.0) {
+        return 0;
+    }
 
-            bvh_intersect_leaf_node( state_out,
-                                     node,
-                                     ray );
+    inva = 1.0 / a;
 
-            /* pop */
-            if (stack->depth < 1) goto end_traverse;
-            stack->depth--;
-            assert(stack->depth >= 0);
-            node = stack->nodestack[stack->depth];
+    vsub( s, ray->org, v0 );
+    vcross( q, s, e1 );
 
-        } else {
+    u = vdot( s, p ) * inva;
+    v = vdot( q, ray->dir ) * inva;
 
-#ifdef RI_BVH_ENABLE_DIAGNOSTICS
-            if (gdiag) gdiag->ninner_node_traversals++;
-#endif
+    if (u < 0.0) u = 0.0;
+    if (v < 0.0) v = 0.0;
+    if (u + v > 1.0) {
+        a  = u + v;
+        u /= a;
+        v /= a;
+    }
 
-#ifdef RI_BVH_TRACE_STATISTICS
-            g_stattrav.ninner_node_traversals++;
-#endif
+    (*t_out) = vdot( e2, q ) * inva;
+    (*u_out) = u;
+    (*v_out) = v;
 
-            ret = test_ray_node( &order, state_out->t, node, ray );
+    return 1;
+}
 
-            if (ret == 0) {
+/*
+ * Valid lanes of i'th triangle4f of a leaf having ntriangles.
+ */
+static inline int
+triangle4f_lanes(
+    uint32_t ntriangles,
+    uint32_t i)
+{
+    uint32_t n = ntriangles - 4 * i;
 
-                /* pop */
-                if (stack->depth < 1) goto end_traverse;
-                stack->depth--;
-                assert(stack->depth >= 0);
-                node = stack->nodestack[stack->depth];
+    return (n >= 4) ? 0xf : ((1 << n) - 1);
+}
 
-            } else if (ret == 1) {
+/*
+ * fp32 version of bvh_intersect_leaf_node().
+ */
+static int
+bvh_intersect_leaf_node32(
+    ri_intersection_state_t *state_out,     /* [inout]  */
+    const ri_bvh_t          *bvh,
+    uint32_t                 leaf,          /* leaf index */
+    ri_ray_t                *ray )
+{
+    int                    k;
+    int                    mask;
+    int                    hitsum = 0;
+    uint32_t               i;
+    uint32_t               n4;
+    uint32_t               ntriangles;
+    float                  tf[4];
+    float                  tlo, thi;
+    ri_float_t             t, u, v;
+    const ri_triangle4f_t *tri4f;
+    const ri_bvh_triref_t *refs;
 
-                node = node->child[0];
+    ntriangles = bvh->leaves[leaf].ntriangles;
+    tri4f      = bvh->triangle4fs + bvh->leaves[leaf].triangle4_offset;
+    refs       = bvh->trirefs + bvh->leaves[leaf].offset;
+    n4         = (ntriangles + 3) / 4;
 
-            } else if (ret == 2) {
+    tlo = flt_t_lower( 0.0 );
+    thi = flt_t_upper( state_out->t );
 
-                node = node->child[1];
+    for (i = 0; i < n4; i++) {
 
-            } else {    /* traverse both nodes */
+        mask = triangle4f_isect( tf, &tri4f[i], ray, tlo, thi,
+                                 triangle4f_lanes( ntriangles, i ) );
 
-                /* push */
-                stack->nodestack[stack->depth] = node->child[1 - order];
-                stack->depth++;
-                assert( stack->depth < BVH_MAXDEPTH );
-                node = node->child[order];
-            
-            }
+        for (k = 0; k < 4; k++) {
 
-        }
+            if (!(mask & (1 << k))) continue;
 
+            if (!refine_hit( &t, &u, &v, bvh, &refs[4 * i + k], ray )) continue;
+
+            if ((t < 0.0) || (t > state_out->t)) continue;
+
+            state_out->t     = t;
+            state_out->u     = u;
+            state_out->v     = v;
+            state_out->geom  = bvh->geoms[refs[4 * i + k].geom_id];
+            state_out->index = 3 * refs[4 * i + k].index;
+
+            thi    = flt_t_upper( t );
+            hitsum = 1;
+        }
+    }
+
+    return hitsum;
+}
+
+/*
+ * fp32 version of bvh_occluded_leaf_node().
+ */
+static int
+bvh_occluded_leaf_node32(
+    const ri_bvh_t          *bvh,
+    uint32_t                 leaf,          /* leaf index */
+    ri_ray_t                *ray,
+    ri_float_t               tmin,
+    ri_float_t               tmax)
+{
+    int                    k;
+    int                    mask;
+    uint32_t               i;
+    uint32_t               n4;
+    uint32_t               ntriangles;
+    float                  tf[4];
+    float                  tlo, thi;
+    ri_float_t             t, u, v;
+    const ri_triangle4f_t *tri4f;
+    const ri_bvh_triref_t *refs;
+
+    ntriangles = bvh->leaves[leaf].ntriangles;
+    tri4f      = bvh->triangle4fs + bvh->leaves[leaf].triangle4_offset;
+    refs       = bvh->trirefs + bvh->leaves[leaf].offset;
+    n4         = (ntriangles + 3) / 4;
+
+    tlo = flt_t_lower( tmin );
+    thi = flt_t_upper( tmax );
+
+    for (i = 0; i < n4; i++) {
+
+        mask = triangle4f_isect( tf, &tri4f[i], ray, tlo, thi,
+                                 triangle4f_lanes( ntriangles, i ) );
+
+        for (k = 0; k < 4; k++) {
+
+            if (!(mask & (1 << k))) continue;
+
+            if (!refine_hit( &t, &u, &v, bvh, &refs[4 * i + k], ray )) continue;
+
+            if ((t >= tmin) && (t <= tmax)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int
+bvh_intersect_leaf_node(
+    ri_intersection_state_t *state_out,     /* [out]    */
+    const ri_bvh_t          *bvh,
+    uint32_t                 leaf,          /* leaf index */
+    ri_ray_t                *ray )
+{
+    double         t, u, v;
+    uint32_t       tid;
+
+    int            hit;
+    int            hitsum;
+    uint32_t       i;
+    uint32_t       ntriangles;
+    const ri_bvh_triref_t *refs;
+
+    ri_vector_t rayorg; 
+    ri_vector_t raydir; 
+
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+        return bvh_intersect_leaf_node32( state_out, bvh, leaf, ray );
+    }
+
+    /*
+     * Init
+     */
+    t      = RI_INFINITY;
+    u      = 0.0;
+    v      = 0.0;
+    tid    = 0;
+    hit    = 0;
+    hitsum = 0;
+
+    refs       = bvh->trirefs + bvh->leaves[leaf].offset;
+    ntriangles = bvh->leaves[leaf].ntriangles;
+
+#ifdef RI_BVH_ENABLE_DIAGNOSTICS
+    if (gdiag) gdiag->ntriangle_isects++;
+#endif
+#ifdef WITH_SSE
+    if (g_simd_mode != RI_BVH_SIMD_SCALAR) {
+
+        const ri_triangle4_t *tri4;
+        uint32_t              n4;
+
+        tri4 = bvh->triangle4s + bvh->leaves[leaf].triangle4_offset;
+        n4   = (ntriangles + 3) / 4;
+
+        for (i = 0; i < n4; i++) {
+
+#ifdef BVH_WITH_AVX
+            if (g_simd_mode == RI_BVH_SIMD_AVX) {
+                hit = triangle4_isect_avx( &tid, &t, &u, &v, 0.0,
+                                           &tri4[i], ray, 4 * i );
+            } else
+#endif
+            {
+                hit = triangle4_isect_sse( &tid, &t, &u, &v, 0.0,
+                                           &tri4[i], ray, 4 * i );
+            }
+
+            hitsum |= hit;
+        }
+
+        goto update_state;
+    }
+#endif
+
+    vcpy( rayorg, ray->org );
+    vcpy( raydir, ray->dir );
+
+    for (i = 0; i < ntriangles; i++) {
+
+        hit = triangle_isect(
+                    &tid, &t, &u, &v, 0.0,
+                    bvh, &refs[i],
+                    rayorg, raydir,
+                    i);
+       
+        hitsum |= hit;
+    }
+
+#ifdef WITH_SSE
+update_state:
+#endif
+
+    if (hitsum && (t < state_out->t)) {
+
+        /* 
+         * Update isect state
+         */
+        state_out->t     = t;
+        state_out->u     = u;
+        state_out->v     = v;
+        state_out->geom  = bvh->geoms[refs[tid].geom_id];
+        state_out->index = 3 * refs[tid].index;
+
+    }
+
+    return hitsum;
+}
+
+/*
+ * Precomputes direction sign and reciprocal direction of the ray, which are
+ * used in ray-AABB test.
+ */
+static void
+bvh_setup_ray(
+    ri_ray_t *ray)                          /* [inout]  */
+{
+    ray->dir_sign[0] = (ray->dir[0] < 0.0) ? 1 : 0;
+    ray->dir_sign[1] = (ray->dir[1] < 0.0) ? 1 : 0;
+    ray->dir_sign[2] = (ray->dir[2] < 0.0) ? 1 : 0;
+
+    if (fabs(ray->dir[0]) > RI_EPS) {
+        ray->invdir[0] = 1.0 / ray->dir[0];
+    } else {
+        ray->invdir[0] = (ray->dir[0] < 0.0) ? -RI_FLT_MAX : RI_FLT_MAX;
+    }
+
+    if (fabs(ray->dir[1]) > RI_EPS) {
+        ray->invdir[1] = 1.0 / ray->dir[1];
+    } else {
+        ray->invdir[1] = (ray->dir[1] < 0.0) ? -RI_FLT_MAX : RI_FLT_MAX;
+    }
+
+    if (fabs(ray->dir[2]) > RI_EPS) {
+        ray->invdir[2] = 1.0 / ray->dir[2];
+    } else {
+        ray->invdir[2] = (ray->dir[2] < 0.0) ? -RI_FLT_MAX : RI_FLT_MAX;
+    }
+
+#if defined(WITH_MUDA) || defined(WITH_SSE)
+
+    {
+        uint64_t ones;
+        uint64_t *ptr;
+
+        ones = 0xffffffffffffffffULL;
+        ptr = (uint64_t *)&ray->dir_signv[0];
+
+        (*ptr++) = (ray->dir[0] < 0.0) ? ones : 0;
+        (*ptr++) = (ray->dir[1] < 0.0) ? ones : 0;
+        (*ptr  ) = (ray->dir[2] < 0.0) ? ones : 0;
+
+    }
+
+#endif
+}
+
+/*
+ * Precomputes single precision ray data for the fp32 BVH: rounded origin
+ * and reciprocal direction for ray-box test, and the axis permutation and
+ * shear of the watertight ray-triangle test[4].
+ */
+static void
+bvh_setup_ray32(
+    ri_ray_t *ray)                          /* [inout]  */
+{
+    int        i;
+    int        kx, ky, kz;
+    ri_float_t d;
+
+    for (i = 0; i < 3; i++) {
+
+        ray->org32[i] = (float)ray->org[i];
+
+        /* Keep finite, so that (bbox - org) * invdir never gives NaN */
+        d = ray->invdir[i];
+        if (d >  FLT_MAX) d =  FLT_MAX;
+        if (d < -FLT_MAX) d = -FLT_MAX;
+
+        ray->invdir32[i] = (float)d;
+    }
+
+    ray->org32[3]    = 0.0f;
+    ray->invdir32[3] = 0.0f;
+
+    /* kz is the major axis of the direction. */
+    kz = 0;
+    if (fabs(ray->dir[1]) > fabs(ray->dir[kz])) kz = 1;
+    if (fabs(ray->dir[2]) > fabs(ray->dir[kz])) kz = 2;
+
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+
+    /* Swap kx and ky to preserve the winding. */
+    if (ray->dir[kz] < 0.0) {
+        i  = kx;
+        kx = ky;
+        ky = i;
     }
+
+    ray->wt_k[0] = kx;
+    ray->wt_k[1] = ky;
+    ray->wt_k[2] = kz;
+
+    ray->wt_s[0] = (float)(ray->dir[kx] / ray->dir[kz]);
+    ray->wt_s[1] = (float)(ray->dir[ky] / ray->dir[kz]);
+    ray->wt_s[2] = (float)(1.0 / ray->dir[kz]);
+}
+
+/*
+ * Ray - AABB intersection test
+ */
+static inline int
+test_ray_aabb(
+    ri_float_t        *tmin_out,             /* [out]    */
+    ri_float_t        *tmax_out,             /* [out]    */
+    const ri_vector_t  bmin,
+    const ri_vector_t  bmax,
+    ri_ray_t          *ray)
+{
+    /* TODO: handle extreme case: NaN, Inf */
+
+    double tmin, tmax;
     
-end_traverse:
+    const double min_x = ray->dir_sign[0] ? bmax[0] : bmin[0];
+    const double min_y = ray->dir_sign[1] ? bmax[1] : bmin[1];
+    const double min_z = ray->dir_sign[2] ? bmax[2] : bmin[2];
+    const double max_x = ray->dir_sign[0] ? bmin[0] : bmax[0];
+    const double max_y = ray->dir_sign[1] ? bmin[1] : bmax[1];
+    const double max_z = ray->dir_sign[2] ? bmin[2] : bmax[2];
+
+    /*
+     * X
+     */
+    const double tmin_x = (min_x - ray->org[0]) * ray->invdir[0];
+    const double tmax_x = (max_x - ray->org[0]) * ray->invdir[0];
+
+    /*
+     * Y
+     */
+    const double tmin_y = (min_y - ray->org[1]) * ray->invdir[1];
+    const double tmax_y = (max_y - ray->org[1]) * ray->invdir[1];
+
+    /* Early exit: (tmin_x > tmax_y) || (tmin_y > tmax_x) => false  */
+    // if ( (tmin_x > tmax_y) || (tmin_y > tmax_x) ) {
+    //     return 0;
+    // }
+
+    tmin = (tmin_x > tmin_y) ? tmin_x : tmin_y;
+    tmax = (tmax_x < tmax_y) ? tmax_x : tmax_y;
+
+    /*
+     * Z
+     */
+    const double tmin_z = (min_z - ray->org[2]) * ray->invdir[2];
+    const double tmax_z = (max_z - ray->org[2]) * ray->invdir[2];
+
+    /* Early exit: (tmin > tmax_z) || (tmin_z > tmax) => false  */
+    // if ( (tmin > tmax_z) || (tmin_z > tmax) ) {
+    //     return 0;
+    // }
+
+    tmin = (tmin > tmin_z) ? tmin : tmin_z;
+    tmax = (tmax < tmax_z) ? tmax : tmax_z;
+
+    /* (tmax > 0.0) && (tmin <= tmax) => hit
+     *
+     * Include tmin == tmax case(hit 2D plane).
+     */
+    if ( (tmax > 0.0) && (tmin <= tmax) ) {
+
+        (*tmin_out) = tmin;
+        (*tmax_out) = tmax;
+
+        return 1;
+    }
+
+    return 0;   /* no hit */
+
+}
+
+/*
+ * Tests the ray against 4 children of the node.
+ *
+ * Returns:
+ *
+ *   Bit mask of hit children. i'th bit is set if child[i] is hit in
+ *   [0, tmax).
+ */
+#ifdef WITH_SSE
+
+/*
+ * SSE2 version. 2 children are tested at a time.
+ */
+static inline int
+test_ray_node_sse(
+    ri_float_t            tmax,
+    const ri_qbvh_node_t *node,
+    ri_ray_t             *ray)
+{
+    int         i;
+    int         retcode = 0;
+
+    /* Near and far planes are selected by the sign of the ray direction. */
+    const int   nx = ray->dir_sign[0] ? BMAX_X0 : BMIN_X0;
+    const int   ny = ray->dir_sign[1] ? BMAX_Y0 : BMIN_Y0;
+    const int   nz = ray->dir_sign[2] ? BMAX_Z0 : BMIN_Z0;
+    const int   fx = ray->dir_sign[0] ? BMIN_X0 : BMAX_X0;
+    const int   fy = ray->dir_sign[1] ? BMIN_Y0 : BMAX_Y0;
+    const int   fz = ray->dir_sign[2] ? BMIN_Z0 : BMAX_Z0;
+
+    const __m128d ox    = _mm_set1_pd(ray->org[0]);
+    const __m128d oy    = _mm_set1_pd(ray->org[1]);
+    const __m128d oz    = _mm_set1_pd(ray->org[2]);
+    const __m128d idx   = _mm_set1_pd(ray->invdir[0]);
+    const __m128d idy   = _mm_set1_pd(ray->invdir[1]);
+    const __m128d idz   = _mm_set1_pd(ray->invdir[2]);
+    const __m128d zero  = _mm_setzero_pd();
+    const __m128d vtmax = _mm_set1_pd(tmax);
+
+    for (i = 0; i < 4; i += 2) {
+
+        __m128d tmin_x = _mm_mul_pd(_mm_sub_pd(_mm_load_pd(node->bbox + nx + i), ox), idx);
+        __m128d tmin_y = _mm_mul_pd(_mm_sub_pd(_mm_load_pd(node->bbox + ny + i), oy), idy);
+        __m128d tmin_z = _mm_mul_pd(_mm_sub_pd(_mm_load_pd(node->bbox + nz + i), oz), idz);
+        __m128d tmax_x = _mm_mul_pd(_mm_sub_pd(_mm_load_pd(node->bbox + fx + i), ox), idx);
+        __m128d tmax_y = _mm_mul_pd(_mm_sub_pd(_mm_load_pd(node->bbox + fy + i), oy), idy);
+        __m128d tmax_z = _mm_mul_pd(_mm_sub_pd(_mm_load_pd(node->bbox + fz + i), oz), idz);
+
+        /* Same operand order as test_ray_aabb() for identical NaN handling */
+        __m128d tnear  = _mm_max_pd(_mm_max_pd(tmin_x, tmin_y), tmin_z);
+        __m128d tfar   = _mm_min_pd(_mm_min_pd(tmax_x, tmax_y), tmax_z);
+
+        __m128d hit    = _mm_and_pd(_mm_cmpgt_pd(tfar, zero),
+                                    _mm_cmple_pd(tnear, tfar));
+        hit            = _mm_and_pd(hit, _mm_cmplt_pd(tnear, vtmax));
+
+        retcode |= _mm_movemask_pd(hit) << i;
+    }
+
+    return retcode;
+}
+
+#ifdef BVH_WITH_AVX
+
+/*
+ * AVX version. All 4 children are tested at once.
+ */
+static BVH_TARGET_AVX int
+test_ray_node_avx(
+    ri_float_t            tmax,
+    const ri_qbvh_node_t *node,
+    ri_ray_t             *ray)
+{
+    const int   nx = ray->dir_sign[0] ? BMAX_X0 : BMIN_X0;
+    const int   ny = ray->dir_sign[1] ? BMAX_Y0 : BMIN_Y0;
+    const int   nz = ray->dir_sign[2] ? BMAX_Z0 : BMIN_Z0;
+    const int   fx = ray->dir_sign[0] ? BMIN_X0 : BMAX_X0;
+    const int   fy = ray->dir_sign[1] ? BMIN_Y0 : BMAX_Y0;
+    const int   fz = ray->dir_sign[2] ? BMIN_Z0 : BMAX_Z0;
+
+    const __m256d ox    = _mm256_broadcast_sd(&ray->org[0]);
+    const __m256d oy    = _mm256_broadcast_sd(&ray->org[1]);
+    const __m256d oz    = _mm256_broadcast_sd(&ray->org[2]);
+    const __m256d idx   = _mm256_broadcast_sd(&ray->invdir[0]);
+    const __m256d idy   = _mm256_broadcast_sd(&ray->invdir[1]);
+    const __m256d idz   = _mm256_broadcast_sd(&ray->invdir[2]);
+
+    __m256d tmin_x = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(node->bbox + nx), ox), idx);
+    __m256d tmin_y = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(node->bbox + ny), oy), idy);
+    __m256d tmin_z = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(node->bbox + nz), oz), idz);
+    __m256d tmax_x = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(node->bbox + fx), ox), idx);
+    __m256d tmax_y = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(node->bbox + fy), oy), idy);
+    __m256d tmax_z = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(node->bbox + fz), oz), idz);
+
+    __m256d tnear  = _mm256_max_pd(_mm256_max_pd(tmin_x, tmin_y), tmin_z);
+    __m256d tfar   = _mm256_min_pd(_mm256_min_pd(tmax_x, tmax_y), tmax_z);
+
+    __m256d hit    = _mm256_and_pd(
+                        _mm256_cmp_pd(tfar, _mm256_setzero_pd(), _CMP_GT_OQ),
+                        _mm256_cmp_pd(tnear, tfar, _CMP_LE_OQ));
+    hit            = _mm256_and_pd(hit,
+                        _mm256_cmp_pd(tnear, _mm256_set1_pd(tmax), _CMP_LT_OQ));
+
+    return _mm256_movemask_pd(hit);
+}
+
+#endif  /* BVH_WITH_AVX */
+
+#endif  /* WITH_SSE */
+
+static inline int
+test_ray_node(
+    ri_float_t            tmax,
+    const ri_qbvh_node_t *node,
+    ri_ray_t             *ray)
+{
+    int         i;
+    int         hit;
+    int         retcode = 0;
+
+    ri_vector_t bmin, bmax;
+    ri_float_t  tmin_child = 0.0, tmax_child = 0.0;
+
+#ifdef WITH_SSE
+#ifdef BVH_WITH_AVX
+    if (g_simd_mode == RI_BVH_SIMD_AVX) {
+        return test_ray_node_avx( tmax, node, ray );
+    }
+#endif
+    if (g_simd_mode == RI_BVH_SIMD_SSE) {
+        return test_ray_node_sse( tmax, node, ray );
+    }
+#endif
+
+    for (i = 0; i < 4; i++) {
+
+        bmin[0] = node->bbox[BMIN_X0 + i];
+        bmin[1] = node->bbox[BMIN_Y0 + i];
+        bmin[2] = node->bbox[BMIN_Z0 + i];
+        bmax[0] = node->bbox[BMAX_X0 + i];
+        bmax[1] = node->bbox[BMAX_Y0 + i];
+        bmax[2] = node->bbox[BMAX_Z0 + i];
+
+#if defined(WITH_MUDA)
+
+        ray_aabb_mu(&hit, &tmin_child, &tmax_child,
+                    ray->org, ray->dir_signv, ray->invdir, bmin, bmax);
+
+#else
+
+        hit = test_ray_aabb( &tmin_child, &tmax_child,
+                              bmin, bmax,
+                              ray );
+
+#endif
+
+        if ( hit && (tmin_child < tmax) ) {
+            retcode |= (1 << i);
+        }
+
+    }
+
+    return retcode;
+}
+
+/*
+ * Tests the ray against 4 children of the fp32 node. The far distance is
+ * enlarged so that the test is conservative under float rounding[5].
+ */
+#ifdef WITH_SSE
+
+static inline int
+test_ray_node32_sse(
+    ri_float_t              tmax,
+    const ri_qbvh_node32_t *node,
+    const ri_ray_t         *ray)
+{
+    const int   nx = ray->dir_sign[0] ? BMAX_X0 : BMIN_X0;
+    const int   ny = ray->dir_sign[1] ? BMAX_Y0 : BMIN_Y0;
+    const int   nz = ray->dir_sign[2] ? BMAX_Z0 : BMIN_Z0;
+    const int   fx = ray->dir_sign[0] ? BMIN_X0 : BMAX_X0;
+    const int   fy = ray->dir_sign[1] ? BMIN_Y0 : BMAX_Y0;
+    const int   fz = ray->dir_sign[2] ? BMIN_Z0 : BMAX_Z0;
+
+    const __m128 ox   = _mm_set1_ps(ray->org32[0]);
+    const __m128 oy   = _mm_set1_ps(ray->org32[1]);
+    const __m128 oz   = _mm_set1_ps(ray->org32[2]);
+    const __m128 idx  = _mm_set1_ps(ray->invdir32[0]);
+    const __m128 idy  = _mm_set1_ps(ray->invdir32[1]);
+    const __m128 idz  = _mm_set1_ps(ray->invdir32[2]);
+
+    __m128 tmin_x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->bbox + nx), ox), idx);
+    __m128 tmin_y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->bbox + ny), oy), idy);
+    __m128 tmin_z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->bbox + nz), oz), idz);
+    __m128 tmax_x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->bbox + fx), ox), idx);
+    __m128 tmax_y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->bbox + fy), oy), idy);
+    __m128 tmax_z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->bbox + fz), oz), idz);
+
+    __m128 tnear  = _mm_max_ps(_mm_max_ps(tmin_x, tmin_y), tmin_z);
+    __m128 tfar   = _mm_mul_ps(_mm_min_ps(_mm_min_ps(tmax_x, tmax_y), tmax_z),
+                               _mm_set1_ps(BVH_FLT_TFAR_SCALE));
+
+    __m128 hit    = _mm_and_ps(_mm_cmpgt_ps(tfar, _mm_setzero_ps()),
+                               _mm_cmple_ps(tnear, tfar));
+    hit           = _mm_and_ps(hit, _mm_cmplt_ps(tnear,
+                                        _mm_set1_ps(flt_t_upper(tmax))));
+
+    return _mm_movemask_ps(hit);
+}
+
+#endif  /* WITH_SSE */
+
+static inline int
+test_ray_node32(
+    ri_float_t              tmax,
+    const ri_qbvh_node32_t *node,
+    const ri_ray_t         *ray)
+{
+    int   i;
+    int   retcode = 0;
+    float tmin_x, tmin_y, tmin_z;
+    float tmax_x, tmax_y, tmax_z;
+    float tnear, tfar;
+    float tlimit;
+
+    const int   nx = ray->dir_sign[0] ? BMAX_X0 : BMIN_X0;
+    const int   ny = ray->dir_sign[1] ? BMAX_Y0 : BMIN_Y0;
+    const int   nz = ray->dir_sign[2] ? BMAX_Z0 : BMIN_Z0;
+    const int   fx = ray->dir_sign[0] ? BMIN_X0 : BMAX_X0;
+    const int   fy = ray->dir_sign[1] ? BMIN_Y0 : BMAX_Y0;
+    const int   fz = ray->dir_sign[2] ? BMIN_Z0 : BMAX_Z0;
+
+#ifdef WITH_SSE
+    if (g_simd_mode != RI_BVH_SIMD_SCALAR) {
+        return test_ray_node32_sse( tmax, node, ray );
+    }
+#endif
+
+    tlimit = flt_t_upper( tmax );
+
+    for (i = 0; i < 4; i++) {
+
+        tmin_x = (node->bbox[nx + i] - ray->org32[0]) * ray->invdir32[0];
+        tmin_y = (node->bbox[ny + i] - ray->org32[1]) * ray->invdir32[1];
+        tmin_z = (node->bbox[nz + i] - ray->org32[2]) * ray->invdir32[2];
+        tmax_x = (node->bbox[fx + i] - ray->org32[0]) * ray->invdir32[0];
+        tmax_y = (node->bbox[fy + i] - ray->org32[1]) * ray->invdir32[1];
+        tmax_z = (node->bbox[fz + i] - ray->org32[2]) * ray->invdir32[2];
+
+        tnear = (tmin_x > tmin_y) ? tmin_x : tmin_y;
+        tnear = (tnear  > tmin_z) ? tnear  : tmin_z;
+        tfar  = (tmax_x < tmax_y) ? tmax_x : tmax_y;
+        tfar  = (tfar   < tmax_z) ? tfar   : tmax_z;
+        tfar *= BVH_FLT_TFAR_SCALE;
+
+        if ( (tfar > 0.0f) && (tnear <= tfar) && (tnear < tlimit) ) {
+            retcode |= (1 << i);
+        }
+    }
+
+    return retcode;
+}
+
+/*
+ * Computes front-to-back visiting order of 4 children from the split axes
+ * of the node and the sign of direction vector.
+ */
+static inline void
+get_child_order(
+    int                  order_out[4],      /* [out]    */
+    int                  axis0,
+    int                  axis1,
+    int                  axis2,
+    const int            dir_sign[3])
+{
+    int first;
+    int sign[2];
+
+    first   = dir_sign[axis0];              /* 0 -> left half first */
+    sign[0] = dir_sign[axis1];
+    sign[1] = dir_sign[axis2];
+
+    order_out[0] = 2 * first       +     sign[first];
+    order_out[1] = 2 * first       + 1 - sign[first];
+    order_out[2] = 2 * (1 - first) +     sign[1 - first];
+    order_out[3] = 2 * (1 - first) + 1 - sign[1 - first];
+}
+
+/*
+ * Tests the ray against 4 children of the node `ref' of either precision.
+ *
+ * Returns:
+ *
+ *   Bit mask of hit children. Children of the node and their visiting
+ *   order are returned if some child is hit.
+ */
+static inline int
+test_node(
+    const uint32_t          **child_out,    /* [out]    */
+    int                       order_out[4], /* [out]    */
+    const ri_bvh_t           *bvh,
+    uint32_t                  ref,
+    ri_float_t                tmax,
+    ri_ray_t                 *ray)
+{
+    int                     mask;
+    const ri_qbvh_node_t   *node;
+    const ri_qbvh_node32_t *node32;
+
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+
+        node32 = &bvh->nodes32[ref];
+
+        mask = test_ray_node32( tmax, node32, ray );
+
+        if (mask) {
+            get_child_order( order_out, node32->axis0, node32->axis1,
+                             node32->axis2, ray->dir_sign );
+            (*child_out) = node32->child;
+        }
+
+    } else {
+
+        node = &bvh->nodes[ref];
+
+        mask = test_ray_node( tmax, node, ray );
+
+        if (mask) {
+            get_child_order( order_out, node->axis0, node->axis1,
+                             node->axis2, ray->dir_sign );
+            (*child_out) = node->child;
+        }
+
+    }
+
+    return mask;
+}
+
+/*
+ * BVH traversal routine.
+ *
+ * Returns:
+ *
+ *   1 if ray hits any occluder, 0 if no hit.
+ */
+int
+bvh_traverse(
+    ri_intersection_state_t *state_out,     /* [out]        */
+    const ri_bvh_t          *bvh,
+    ri_bvh_diag_t           *diag,          /* [modified]   */
+    ri_ray_t                *ray,
+    bvh_stack_t             *stack )        /* [buffer]     */
+{
+    assert( (bvh->nodes != NULL) || (bvh->nodes32 != NULL) );
+
+#ifdef RI_BVH_ENABLE_DIAGNOSTICS
+    gdiag = diag;
+#endif
+
+    /*
+     * Initialize intersection state.
+     */ 
+    state_out->t     = RI_INFINITY;
+    state_out->u     = 0.0;
+    state_out->v     = 0.0;
+    state_out->geom  = NULL;
+    state_out->index = 0;
+
+    return bvh_traverse_subtree( state_out, bvh, ray, 0, stack );
+}
+
+/*
+ * Traverses the subtree rooted at `root' and updates the nearest hit in
+ * `state_out'. Used directly from packet traversal when the packet
+ * diverges.
+ *
+ * Returns:
+ *
+ *   1 if ray has a hit(including the hit already recorded in
+ *   `state_out'), 0 if no hit.
+ */
+static int
+bvh_traverse_subtree(
+    ri_intersection_state_t *state_out,     /* [inout]      */
+    const ri_bvh_t          *bvh,
+    ri_ray_t                *ray,
+    uint32_t                 root,
+    bvh_stack_t             *stack )        /* [buffer]     */
+{
+    const uint32_t       *child = NULL;
+    uint32_t              ref;
+    int                   i;
+    int                   mask;
+    int                   order[4];         /* traversal order  */
+
+    stack->depth = 0;
+
+    ref = root;
+
+    while (1) {
+
+        if ( RI_QBVH_IS_LEAF(ref) ) {
+
+            assert( !RI_QBVH_IS_EMPTY(ref) );
+
+#ifdef RI_BVH_ENABLE_DIAGNOSTICS
+            if (gdiag) gdiag->nleaf_node_traversals++;
+#endif
+            stack->nleaf++;
+            stack->ntris += bvh->leaves[RI_QBVH_LEAF_INDEX(ref)].ntriangles;
+
+            bvh_intersect_leaf_node( state_out,
+                                     bvh,
+                                     RI_QBVH_LEAF_INDEX(ref),
+                                     ray );
+
+        } else {
+
+#ifdef RI_BVH_ENABLE_DIAGNOSTICS
+            if (gdiag) gdiag->ninner_node_traversals++;
+#endif
+
+            stack->ninner++;
+
+            mask = test_node( &child, order, bvh, ref, state_out->t, ray );
+
+            if (mask) {
+
+                /* push hit children in far-to-near order */
+                for (i = 3; i >= 0; i--) {
+
+                    if (mask & (1 << order[i])) {
+
+                        stack->nodestack[stack->depth] = child[order[i]];
+                        stack->depth++;
+                        assert( stack->depth < BVH_STACK_SIZE );
+
+                    }
+                }
+
+            }
+
+        }
+
+        /* pop */
+        if (stack->depth < 1) goto end_traverse;
+        stack->depth--;
+        ref = stack->nodestack[stack->depth];
+
+    }
+    
+end_traverse:
+
+    return (state_out->t < RI_INFINITY);
+}
+
+/*
+ * Any-hit test against triangles in the leaf.
+ *
+ * Returns:
+ *
+ *   1 if some triangle is hit in [tmin, tmax], 0 if not.
+ */
+static int
+bvh_occluded_leaf_node(
+    const ri_bvh_t          *bvh,
+    uint32_t                 leaf,          /* leaf index */
+    ri_ray_t                *ray,
+    ri_float_t               tmin,
+    ri_float_t               tmax)
+{
+    double         t, u, v;
+    uint32_t       tid;
+    uint32_t       i;
+    uint32_t       ntriangles;
+    const ri_bvh_triref_t *refs;
+
+    ri_vector_t rayorg; 
+    ri_vector_t raydir; 
+
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+        return bvh_occluded_leaf_node32( bvh, leaf, ray, tmin, tmax );
+    }
+
+    refs       = bvh->trirefs + bvh->leaves[leaf].offset;
+    ntriangles = bvh->leaves[leaf].ntriangles;
+
+#ifdef WITH_SSE
+    if (g_simd_mode != RI_BVH_SIMD_SCALAR) {
+
+        const ri_triangle4_t *tri4;
+        uint32_t              n4;
+
+        tri4 = bvh->triangle4s + bvh->leaves[leaf].triangle4_offset;
+        n4   = (ntriangles + 3) / 4;
+
+        for (i = 0; i < n4; i++) {
+
+            t = tmax;
+
+#ifdef BVH_WITH_AVX
+            if (g_simd_mode == RI_BVH_SIMD_AVX) {
+                if (triangle4_isect_avx( &tid, &t, &u, &v, tmin,
+                                         &tri4[i], ray, 4 * i )) {
+                    return 1;
+                }
+            } else
+#endif
+            {
+                if (triangle4_isect_sse( &tid, &t, &u, &v, tmin,
+                                         &tri4[i], ray, 4 * i )) {
+                    return 1;
+                }
+            }
+        }
+
+        return 0;
+    }
+#endif
+
+    vcpy( rayorg, ray->org );
+    vcpy( raydir, ray->dir );
+
+    for (i = 0; i < ntriangles; i++) {
+
+        t = tmax;
+
+        if (triangle_isect( &tid, &t, &u, &v, tmin,
+                            bvh, &refs[i],
+                            rayorg, raydir,
+                            i)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Any-hit BVH traversal routine. Terminates at the first hit found.
+ *
+ * Returns:
+ *
+ *   1 if ray hits any occluder in [tmin, tmax], 0 if no hit.
+ */
+static int
+bvh_traverse_occluded(
+    const ri_bvh_t          *bvh,
+    ri_ray_t                *ray,
+    ri_float_t               tmin,
+    ri_float_t               tmax,
+    uint32_t                 root,
+    bvh_stack_t             *stack )        /* [buffer]     */
+{
+    const uint32_t       *child = NULL;
+    uint32_t              ref;
+    int                   i;
+    int                   mask;
+    int                   order[4];         /* traversal order  */
+
+    assert( (bvh->nodes != NULL) || (bvh->nodes32 != NULL) );
+
+    stack->depth = 0;
+
+    ref = root;
+
+    while (1) {
+
+        if ( RI_QBVH_IS_LEAF(ref) ) {
+
+            assert( !RI_QBVH_IS_EMPTY(ref) );
+
+            stack->nleaf++;
+            stack->ntris += bvh->leaves[RI_QBVH_LEAF_INDEX(ref)].ntriangles;
+
+            if (bvh_occluded_leaf_node( bvh,
+                                        RI_QBVH_LEAF_INDEX(ref),
+                                        ray, tmin, tmax )) {
+                return 1;
+            }
+
+        } else {
+
+            stack->ninner++;
+
+            /*
+             * Near children are still visited first since they are
+             * more likely to occlude the ray.
+             */
+            mask = test_node( &child, order, bvh, ref, tmax, ray );
+
+            if (mask) {
+
+                for (i = 3; i >= 0; i--) {
+
+                    if (mask & (1 << order[i])) {
+
+                        stack->nodestack[stack->depth] = child[order[i]];
+                        stack->depth++;
+                        assert( stack->depth < BVH_STACK_SIZE );
+
+                    }
+                }
+
+            }
+
+        }
+
+        /* pop */
+        if (stack->depth < 1) break;
+        stack->depth--;
+        ref = stack->nodestack[stack->depth];
+
+    }
+
+    return 0;
+}
+
+/*
+ * Tests rays in the packet against 4 children of the node.
+ * Gives the same result as test_ray_node() for each ray.
+ */
+#ifdef WITH_SSE
+
+/*
+ * SSE2 version. 2 rays are tested at a time.
+ */
+static inline __m128d
+select_pd(__m128d mask, __m128d a, __m128d b)      /* mask ? a : b */
+{
+    return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+
+static inline void
+test_packet_node_sse(
+    uint32_t               mask_out[4],     /* [out]    */
+    const ri_qbvh_node_t  *node,
+    const ri_ray_packet_t *packet,
+    uint32_t               active,
+    const ri_float_t      *tlimit)
+{
+    int     c, i;
+    int     m;
+
+    const __m128d zero = _mm_setzero_pd();
+
+    mask_out[0] = mask_out[1] = mask_out[2] = mask_out[3] = 0;
+
+    for (i = 0; i < packet->nrays; i += 2) {
+
+        if (((active >> i) & 0x3) == 0) continue;
+
+        __m128d ox  = _mm_loadu_pd(&packet->org[0][i]);
+        __m128d oy  = _mm_loadu_pd(&packet->org[1][i]);
+        __m128d oz  = _mm_loadu_pd(&packet->org[2][i]);
+        __m128d idx = _mm_loadu_pd(&packet->invdir[0][i]);
+        __m128d idy = _mm_loadu_pd(&packet->invdir[1][i]);
+        __m128d idz = _mm_loadu_pd(&packet->invdir[2][i]);
+        __m128d tl  = _mm_loadu_pd(&tlimit[i]);
+
+        /* dir < 0 -> near plane is bmax */
+        __m128d sx  = _mm_cmplt_pd(_mm_loadu_pd(&packet->dir[0][i]), zero);
+        __m128d sy  = _mm_cmplt_pd(_mm_loadu_pd(&packet->dir[1][i]), zero);
+        __m128d sz  = _mm_cmplt_pd(_mm_loadu_pd(&packet->dir[2][i]), zero);
+
+        for (c = 0; c < 4; c++) {
+
+            __m128d bminx = _mm_set1_pd(node->bbox[BMIN_X0 + c]);
+            __m128d bminy = _mm_set1_pd(node->bbox[BMIN_Y0 + c]);
+            __m128d bminz = _mm_set1_pd(node->bbox[BMIN_Z0 + c]);
+            __m128d bmaxx = _mm_set1_pd(node->bbox[BMAX_X0 + c]);
+            __m128d bmaxy = _mm_set1_pd(node->bbox[BMAX_Y0 + c]);
+            __m128d bmaxz = _mm_set1_pd(node->bbox[BMAX_Z0 + c]);
+
+            __m128d tmin_x = _mm_mul_pd(_mm_sub_pd(
+                                select_pd(sx, bmaxx, bminx), ox), idx);
+            __m128d tmin_y = _mm_mul_pd(_mm_sub_pd(
+                                select_pd(sy, bmaxy, bminy), oy), idy);
+            __m128d tmin_z = _mm_mul_pd(_mm_sub_pd(
+                                select_pd(sz, bmaxz, bminz), oz), idz);
+            __m128d tmax_x = _mm_mul_pd(_mm_sub_pd(
+                                select_pd(sx, bminx, bmaxx), ox), idx);
+            __m128d tmax_y = _mm_mul_pd(_mm_sub_pd(
+                                select_pd(sy, bminy, bmaxy), oy), idy);
+            __m128d tmax_z = _mm_mul_pd(_mm_sub_pd(
+                                select_pd(sz, bminz, bmaxz), oz), idz);
+
+            __m128d tnear  = _mm_max_pd(_mm_max_pd(tmin_x, tmin_y), tmin_z);
+            __m128d tfar   = _mm_min_pd(_mm_min_pd(tmax_x, tmax_y), tmax_z);
+
+            __m128d hit    = _mm_and_pd(_mm_cmpgt_pd(tfar, zero),
+                                        _mm_cmple_pd(tnear, tfar));
+            hit            = _mm_and_pd(hit, _mm_cmplt_pd(tnear, tl));
+
+            m = _mm_movemask_pd(hit);
+
+            mask_out[c] |= ((uint32_t)m << i);
+        }
+    }
+
+    for (c = 0; c < 4; c++) {
+        mask_out[c] &= active;
+    }
+}
+
+#endif  /* WITH_SSE */
+
+#ifdef BVH_WITH_AVX
+
+/*
+ * AVX version. 4 rays are tested at a time.
+ */
+static BVH_TARGET_AVX void
+test_packet_node_avx(
+    uint32_t               mask_out[4],     /* [out]    */
+    const ri_qbvh_node_t  *node,
+    const ri_ray_packet_t *packet,
+    uint32_t               active,
+    const ri_float_t      *tlimit)
+{
+    int     c, i;
+    int     m;
+
+    const __m256d zero = _mm256_setzero_pd();
+
+    mask_out[0] = mask_out[1] = mask_out[2] = mask_out[3] = 0;
+
+    for (i = 0; i < packet->nrays; i += 4) {
+
+        if (((active >> i) & 0xf) == 0) continue;
+
+        __m256d ox  = _mm256_loadu_pd(&packet->org[0][i]);
+        __m256d oy  = _mm256_loadu_pd(&packet->org[1][i]);
+        __m256d oz  = _mm256_loadu_pd(&packet->org[2][i]);
+        __m256d idx = _mm256_loadu_pd(&packet->invdir[0][i]);
+        __m256d idy = _mm256_loadu_pd(&packet->invdir[1][i]);
+        __m256d idz = _mm256_loadu_pd(&packet->invdir[2][i]);
+        __m256d tl  = _mm256_loadu_pd(&tlimit[i]);
+
+        /* dir < 0 -> near plane is bmax */
+        __m256d sx  = _mm256_cmp_pd(_mm256_loadu_pd(&packet->dir[0][i]),
+                                    zero, _CMP_LT_OQ);
+        __m256d sy  = _mm256_cmp_pd(_mm256_loadu_pd(&packet->dir[1][i]),
+                                    zero, _CMP_LT_OQ);
+        __m256d sz  = _mm256_cmp_pd(_mm256_loadu_pd(&packet->dir[2][i]),
+                                    zero, _CMP_LT_OQ);
+
+        for (c = 0; c < 4; c++) {
+
+            __m256d bminx = _mm256_broadcast_sd(&node->bbox[BMIN_X0 + c]);
+            __m256d bminy = _mm256_broadcast_sd(&node->bbox[BMIN_Y0 + c]);
+            __m256d bminz = _mm256_broadcast_sd(&node->bbox[BMIN_Z0 + c]);
+            __m256d bmaxx = _mm256_broadcast_sd(&node->bbox[BMAX_X0 + c]);
+            __m256d bmaxy = _mm256_broadcast_sd(&node->bbox[BMAX_Y0 + c]);
+            __m256d bmaxz = _mm256_broadcast_sd(&node->bbox[BMAX_Z0 + c]);
+
+            __m256d tmin_x = _mm256_mul_pd(_mm256_sub_pd(
+                                _mm256_blendv_pd(bminx, bmaxx, sx), ox), idx);
+            __m256d tmin_y = _mm256_mul_pd(_mm256_sub_pd(
+                                _mm256_blendv_pd(bminy, bmaxy, sy), oy), idy);
+            __m256d tmin_z = _mm256_mul_pd(_mm256_sub_pd(
+                                _mm256_blendv_pd(bminz, bmaxz, sz), oz), idz);
+            __m256d tmax_x = _mm256_mul_pd(_mm256_sub_pd(
+                                _mm256_blendv_pd(bmaxx, bminx, sx), ox), idx);
+            __m256d tmax_y = _mm256_mul_pd(_mm256_sub_pd(
+                                _mm256_blendv_pd(bmaxy, bminy, sy), oy), idy);
+            __m256d tmax_z = _mm256_mul_pd(_mm256_sub_pd(
+                                _mm256_blendv_pd(bmaxz, bminz, sz), oz), idz);
+
+            __m256d tnear  = _mm256_max_pd(_mm256_max_pd(tmin_x, tmin_y),
+                                           tmin_z);
+            __m256d tfar   = _mm256_min_pd(_mm256_min_pd(tmax_x, tmax_y),
+                                           tmax_z);
+
+            __m256d hit    = _mm256_and_pd(
+                                _mm256_cmp_pd(tfar, zero, _CMP_GT_OQ),
+                                _mm256_cmp_pd(tnear, tfar, _CMP_LE_OQ));
+            hit            = _mm256_and_pd(hit,
+                                _mm256_cmp_pd(tnear, tl, _CMP_LT_OQ));
+
+            m = _mm256_movemask_pd(hit);
+
+            mask_out[c] |= ((uint32_t)m << i);
+        }
+    }
+
+    for (c = 0; c < 4; c++) {
+        mask_out[c] &= active;
+    }
+}
+
+#endif  /* BVH_WITH_AVX */
+
+static inline void
+test_packet_node(
+    uint32_t               mask_out[4],     /* [out]    */
+    const ri_qbvh_node_t  *node,
+    const ri_ray_packet_t *packet,
+    uint32_t               active,
+    const ri_float_t      *tlimit)
+{
+    int        c, i;
+    ri_float_t near_x, near_y, near_z;
+    ri_float_t far_x, far_y, far_z;
+    ri_float_t tmin, tmax;
+    ri_float_t tmin_x, tmin_y, tmin_z;
+    ri_float_t tmax_x, tmax_y, tmax_z;
+
+#ifdef WITH_SSE
+#ifdef BVH_WITH_AVX
+    if (g_simd_mode == RI_BVH_SIMD_AVX) {
+        test_packet_node_avx( mask_out, node, packet, active, tlimit );
+        return;
+    }
+#endif
+    if (g_simd_mode == RI_BVH_SIMD_SSE) {
+        test_packet_node_sse( mask_out, node, packet, active, tlimit );
+        return;
+    }
+#endif
+
+    for (c = 0; c < 4; c++) {
+
+        mask_out[c] = 0;
+
+        for (i = 0; i < packet->nrays; i++) {
+
+            if (!(active & (1 << i))) continue;
+
+            near_x = (packet->dir[0][i] < 0.0) ? node->bbox[BMAX_X0 + c]
+                                               : node->bbox[BMIN_X0 + c];
+            near_y = (packet->dir[1][i] < 0.0) ? node->bbox[BMAX_Y0 + c]
+                                               : node->bbox[BMIN_Y0 + c];
+            near_z = (packet->dir[2][i] < 0.0) ? node->bbox[BMAX_Z0 + c]
+                                               : node->bbox[BMIN_Z0 + c];
+            far_x  = (packet->dir[0][i] < 0.0) ? node->bbox[BMIN_X0 + c]
+                                               : node->bbox[BMAX_X0 + c];
+            far_y  = (packet->dir[1][i] < 0.0) ? node->bbox[BMIN_Y0 + c]
+                                               : node->bbox[BMAX_Y0 + c];
+            far_z  = (packet->dir[2][i] < 0.0) ? node->bbox[BMIN_Z0 + c]
+                                               : node->bbox[BMAX_Z0 + c];
+
+            tmin_x = (near_x - packet->org[0][i]) * packet->invdir[0][i];
+            tmin_y = (near_y - packet->org[1][i]) * packet->invdir[1][i];
+            tmin_z = (near_z - packet->org[2][i]) * packet->invdir[2][i];
+            tmax_x = (far_x  - packet->org[0][i]) * packet->invdir[0][i];
+            tmax_y = (far_y  - packet->org[1][i]) * packet->invdir[1][i];
+            tmax_z = (far_z  - packet->org[2][i]) * packet->invdir[2][i];
+
+            /* Same operation as test_ray_aabb() */
+            tmin = (tmin_x > tmin_y) ? tmin_x : tmin_y;
+            tmax = (tmax_x < tmax_y) ? tmax_x : tmax_y;
+            tmin = (tmin   > tmin_z) ? tmin   : tmin_z;
+            tmax = (tmax   < tmax_z) ? tmax   : tmax_z;
+
+            if ( (tmax > 0.0) && (tmin <= tmax) && (tmin < tlimit[i]) ) {
+                mask_out[c] |= (1 << i);
+            }
+        }
+    }
+}
+
+/*
+ * fp32 version of test_packet_node(). Rays are tested one by one, since
+ * test_ray_node32() already tests 4 children at once.
+ */
+static inline void
+test_packet_node32(
+    uint32_t                mask_out[4],    /* [out]    */
+    const ri_qbvh_node32_t *node,
+    const ri_ray_packet_t  *packet,
+    uint32_t                active,
+    const ri_float_t       *tlimit)
+{
+    int c, i;
+    int m;
+
+    mask_out[0] = mask_out[1] = mask_out[2] = mask_out[3] = 0;
+
+    for (i = 0; i < packet->nrays; i++) {
+
+        if (!(active & (1 << i))) continue;
+
+        m = test_ray_node32( tlimit[i], node, &packet->rays[i] );
+
+        for (c = 0; c < 4; c++) {
+            if (m & (1 << c)) mask_out[c] |= (1 << i);
+        }
+    }
+}
+
+static inline int
+count_bits(
+    uint32_t x)
+{
+    int n = 0;
+
+    while (x) {
+        x &= x - 1;
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Packet traversal routine. Traverses the QBVH once for all active rays.
+ * If the number of active rays in a subtree falls below
+ * BVH_PACKET_MIN_ACTIVE, remaining rays traverse the subtree one by one.
+ *
+ * Performs any-hit query in [tmin, tmax] if `states_out' is NULL,
+ * nearest hit query otherwise.
+ *
+ * Returns:
+ *
+ *   Bit mask of rays which hit.
+ */
+static uint32_t
+bvh_traverse_packet(
+    ri_intersection_state_t *states_out,    /* [inout]      */
+    const ri_bvh_t          *bvh,
+    ri_ray_packet_t         *packet,
+    uint32_t                 active,
+    ri_float_t               tmin,
+    ri_float_t               tmax )
+{
+    const ri_qbvh_node_t   *node;
+    const ri_qbvh_node32_t *node32;
+    const uint32_t         *child;
+    uint32_t              ref;
+    uint32_t              mask;
+    uint32_t              hitmask = 0;
+    uint32_t              child_mask[4];
+    int                   i;
+    int                   order[4];         /* traversal order  */
+    int                   first;
+
+    ri_float_t            tlimit[RI_RAY_PACKET_MAX];
+    ri_ray_t             *rays;
+
+    uint32_t              refstack [BVH_STACK_SIZE];
+    uint32_t              maskstack[BVH_STACK_SIZE];
+    int                   depth = 0;
+
+    bvh_stack_t           stack;            /* for single ray traversal */
+
+    assert( (bvh->nodes != NULL) || (bvh->nodes32 != NULL) );
+
+    rays = packet->rays;
+
+    bvh_stack_init( &stack );
+
+    for (i = 0; i < RI_RAY_PACKET_MAX; i++) {
+        tlimit[i] = (states_out && i < packet->nrays) ? states_out[i].t
+                                                       : tmax;
+    }
+
+    ref  = 0;                               /* root */
+    mask = active;
+
+    while (1) {
+
+        if (states_out == NULL) {
+            mask &= ~hitmask;               /* already occluded */
+        }
+
+        if (mask == 0) {
+
+            /* nothing to do */
+
+        } else if ((g_simd_mode == RI_BVH_SIMD_SCALAR) ||
+                   (count_bits(mask) < BVH_PACKET_MIN_ACTIVE)) {
+
+            /*
+             * The packet diverged. Trace the rest of the subtree per ray.
+             * Scalar node test gains nothing from packets, so rays are
+             * always traced one by one in scalar mode.
+             */
+            for (i = 0; i < packet->nrays; i++) {
+
+                if (!(mask & (1 << i))) continue;
+
+                if (states_out) {
+
+                    bvh_traverse_subtree( &states_out[i], bvh,
+                                          &rays[i], ref, &stack );
+                    tlimit[i] = states_out[i].t;
+
+                } else if (bvh_traverse_occluded( bvh, &rays[i], tmin, tmax,
+                                                  ref, &stack )) {
+                    hitmask |= (1 << i);
+                }
+            }
+
+        } else if ( RI_QBVH_IS_LEAF(ref) ) {
+
+            assert( !RI_QBVH_IS_EMPTY(ref) );
+
+            stack.nleaf++;
+            stack.ntris += bvh->leaves[RI_QBVH_LEAF_INDEX(ref)].ntriangles;
+
+            for (i = 0; i < packet->nrays; i++) {
+
+                if (!(mask & (1 << i))) continue;
+
+                if (states_out) {
+
+                    bvh_intersect_leaf_node( &states_out[i], bvh,
+                                             RI_QBVH_LEAF_INDEX(ref),
+                                             &rays[i] );
+                    tlimit[i] = states_out[i].t;
+
+                } else if (bvh_occluded_leaf_node( bvh,
+                                                   RI_QBVH_LEAF_INDEX(ref),
+                                                   &rays[i], tmin, tmax )) {
+                    hitmask |= (1 << i);
+                }
+            }
+
+        } else {
+
+            stack.ninner++;
+
+            /* Visiting order is decided by the first active ray. */
+            for (first = 0; !(mask & (1 << first)); first++) ;
+
+            if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+
+                node32 = &bvh->nodes32[ref];
+
+                test_packet_node32( child_mask, node32, packet, mask, tlimit );
+
+                get_child_order( order, node32->axis0, node32->axis1,
+                                 node32->axis2, rays[first].dir_sign );
+                child = node32->child;
+
+            } else {
+
+                node = &bvh->nodes[ref];
+
+                test_packet_node( child_mask, node, packet, mask, tlimit );
+
+                get_child_order( order, node->axis0, node->axis1,
+                                 node->axis2, rays[first].dir_sign );
+                child = node->child;
+
+            }
+
+            /* push hit children in far-to-near order */
+            for (i = 3; i >= 0; i--) {
+
+                if (child_mask[order[i]]) {
+
+                    refstack [depth] = child[order[i]];
+                    maskstack[depth] = child_mask[order[i]];
+                    depth++;
+                    assert( depth < BVH_STACK_SIZE );
+
+                }
+            }
+
+        }
+
+        /* pop */
+        if (depth < 1) break;
+        depth--;
+        ref  = refstack [depth];
+        mask = maskstack[depth];
+
+    }
+
+    if (states_out) {
+        for (i = 0; i < packet->nrays; i++) {
+            if ((active & (1 << i)) && (states_out[i].t < RI_INFINITY)) {
+                hitmask |= (1 << i);
+            }
+        }
+    }
+
+    bvh_stack_flush_stat( &stack );
+
+    return hitmask;
+}
+
+static inline ri_float_t
+calc_surface_area(
+    ri_vector_t bmin,
+    ri_vector_t bmax)
+{
+    ri_float_t sa;
+
+    assert( bmax[0] >= bmin[0] );
+    assert( bmax[1] >= bmin[1] );
+    assert( bmax[2] >= bmin[2] );
+
+    sa = (bmax[0] - bmin[0]) * (bmax[1] - bmin[1]) +
+         (bmax[1] - bmin[1]) * (bmax[2] - bmin[2]) +
+         (bmax[2] - bmin[2]) * (bmax[0] - bmin[0]);
+
+    sa *= 2.0;
+
+    return sa;
+}
+
+static inline ri_float_t
+SAH(
+    int        ns1,
+    ri_float_t left_area,
+    int        ns2,
+    ri_float_t right_area,
+    ri_float_t s)
+{
+    const float Taabb = 0.2f;
+    const float Ttri  = 0.8f;
+
+    float T;
+
+    T = 2.0f * Taabb
+      + (left_area / s) * (ri_float_t)ns1 * Ttri
+      + (right_area / s) * (ri_float_t)ns2 * Ttri; 
+
+    return T;
+}
+
+int 
+find_cut_from_bin(
+    ri_float_t             *cut_pos_out,        /* [out]    */
+    int                    *cut_axis_out,       /* [out]    */ 
+    const bvh_bin_buffer_t *binbuf,
+    ri_vector_t             bmin,
+    ri_vector_t             bmax,
+    uint64_t                ntriangles)
+{
+    int         i, j;
+
+    ri_float_t  cost;
+    int         min_cost_axis = 0;
+    ri_float_t  min_cost_pos  = 0.0;
+    ri_float_t  min_cost      = RI_INFINITY;
+        
+    uint64_t    tris_left; 
+    uint64_t    tris_right;
+
+    ri_vector_t bsize;
+    ri_vector_t bstep;
+
+    ri_vector_t bmin_left, bmax_left;
+    ri_vector_t bmin_right, bmax_right;
+    ri_float_t  sa_left, sa_right, sa_total;
+
+    ri_float_t  pos;
+
+    bsize[0]    = bmax[0] - bmin[0];
+    bsize[1]    = bmax[1] - bmin[1];
+    bsize[2]    = bmax[2] - bmin[2];
+
+    bstep[0] = bsize[0] / (ri_float_t)BVH_BIN_SIZE;
+    bstep[1] = bsize[1] / (ri_float_t)BVH_BIN_SIZE;
+    bstep[2] = bsize[2] / (ri_float_t)BVH_BIN_SIZE;
+
+    sa_total    = calc_surface_area( bmin, bmax );
+
+    for (j = 0; j < 3; j++) {   /* axis */
+
+        /*
+         *  Compute SAH cost for right side of each cell of the bbox.
+         *  Exclude both extreme side of the bbox.
+         *     
+         *  i:      0    1    2    3    
+         *     +----+----+----+----+----+
+         *     |    |    |    |    |    |
+         *     +----+----+----+----+----+
+         *
+         */
+
+        tris_left  = 0; 
+        tris_right = ntriangles;
+
+        vcpy( bmin_left, bmin ); vcpy( bmin_right, bmin );
+        vcpy( bmax_left, bmax ); vcpy( bmax_right, bmax );
+
+        for (i = 0; i < BVH_BIN_SIZE - 1; i++) {
+
+            tris_left  += binbuf->bin[0][j][i];
+            tris_right -= binbuf->bin[1][j][i];
+
+            assert(tris_left  <=  ntriangles);
+            assert(tris_right <=  ntriangles);
+
+            /*
+             * split pos = bmin + (i + 1) * (bsize / BIN_SIZE)
+             * +1 for i since we want a position on right side of the cell.
+             */
+            
+
+            pos = bmin[j] + (i + 1) * bstep[j];
+
+            bmax_left[j]  = pos;
+            bmin_right[j] = pos;
+
+            sa_left  = calc_surface_area( bmin_left, bmax_left );
+            sa_right = calc_surface_area( bmin_right, bmax_right );
+
+            cost = SAH( tris_left, sa_left, tris_right, sa_right, sa_total );
+            
+            if (cost < min_cost) {  /* update mincost   */
+                min_cost      = cost;
+                min_cost_axis = j;
+                min_cost_pos  = pos; 
+            }
+        }
+
+    }
+
+    (*cut_axis_out) = min_cost_axis;
+    (*cut_pos_out)  = min_cost_pos;
+
+
+    return 0;   /* OK */
+   
+}
+
+/*
+ * Returns # of threads used for BVH construction.
+ * Follows the renderer's thread setting. 0 or 1 means serial build.
+ */
+static int
+bvh_get_build_nthreads()
+{
+    int            nthreads;
+    ri_option_t   *option;
+
+    if (!ri_thread_supported()) return 1;
+
+    option = ri_render_get()->context->option;
+
+    nthreads = option->nthreads;
+
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > RI_MAX_THREADS) nthreads = RI_MAX_THREADS;
+
+    return nthreads;
+}
+
+/*
+ * Thread entry for subtree construction task.
+ */
+static void *
+bvh_construct_task_func(void *arg)
+{
+    bvh_build_task_t *task = (bvh_build_task_t *)arg;
+
+    bvh_construct(
+        task->root,
+        task->bmin,
+        task->bmax,
+        task->tri_bboxes,
+        task->tri_bboxes_buf,
+        task->index_left,
+        task->index_right,
+        task->depth,
+        &task->binbuf,
+        task->nthreads);
+
+    return NULL;
+}
+
+int
+bvh_construct(
+    bvh_build_node_t *root,
+    ri_vector_t       bmin,
+    ri_vector_t       bmax,
+    tri_bbox_t       *tri_bboxes,
+    tri_bbox_t       *tri_bboxes_buf,
+    uint64_t          index_left,           /* [index_left, index_right)    */
+    uint64_t          index_right,
+    int               depth,
+    bvh_bin_buffer_t *binbuf,               /* [buffer]                     */
+    int               nthreads)             /* # of threads for this subtree */
+{
+
+    uint64_t n;
+    uint32_t n32;
+
+    n = index_right - index_left;
+
+    ri_float_t cut_pos;
+    int        cut_axis;
+
+    /*
+     * 1. If # of triangles are less than threshold or the tree is too deep,
+     *    make a leaf node.
+     */
+    if ((n <= BVH_NTRIS_LEAF) || (depth >= BVH_MAXDEPTH)) {
+
+        /*
+         * tri_bboxes[index_left, index_right) is sorted at (3.) and holds
+         * the references of the leaf triangles.
+         */
+
+        assert( n < 0x100000000ULL );
+        n32 = (uint32_t)n;
+
+        root->offset     = index_left;
+        root->ntriangles = n32;
+        root->is_leaf    = 1;
+
+        return 0;
+    }
+
+
+    /*
+     * 2. Bin edges of triangles.
+     */
+    {
+        if (nthreads > 1 && n >= BVH_PARALLEL_BINNING_MIN_TRIS) {
+
+            bin_triangle_edge_parallel(
+                binbuf,
+                bmin,
+                bmax,
+                tri_bboxes + index_left, 
+                n,
+                nthreads);
+
+        } else {
+
+            bin_triangle_edge(
+                binbuf,
+                bmin,
+                bmax,
+                tri_bboxes + index_left, 
+                n);
+
+        }
+             
+
+        find_cut_from_bin(
+            &cut_pos,
+            &cut_axis,
+            binbuf,
+             bmin,
+             bmax,
+             n);
+    }
+
+    uint64_t i;
+    uint64_t ntris_left  = 0;
+    uint64_t ntris_right = n - 1;
+
+    /*
+     * 3. Partition triangles into left and right.
+     * 
+     * bbox data is read from tri_bboxes_buf, then left-right separated
+     * bbox data is wrote to tri_bboxes.
+     * Use the same range [index_left, index_right) of tri_bboxes_buf as a
+     * scratch so that concurrently built subtrees never overlap.
+     */
+    {
+        tri_bbox_t *scratch = tri_bboxes_buf + index_left;
+
+        memcpy(scratch, tri_bboxes + index_left, sizeof(tri_bbox_t) * n);
+
+        for (i = 0; i < n; i++) {
+
+            if (scratch[i].bmax[cut_axis] < cut_pos) {
+
+                /* left   */
+
+                assert(ntris_left < n);
+
+                memcpy(tri_bboxes + index_left + ntris_left,
+                       scratch + i,
+                       sizeof(tri_bbox_t));
+
+                ntris_left++;
+        
+            } else {
+
+                /* right    */
+
+                assert(ntris_right < n);
+
+                memcpy(tri_bboxes + index_left + ntris_right,
+                       scratch + i,
+                       sizeof(tri_bbox_t));
+
+                ntris_right--;
+
+            }
+
+        }
+
+
+        if( ntris_left == 0 || ntris_left == n ) {
+
+            /* Couldn't partition bboxes into left and right.
+             * Force split at object median.
+             */
+            ntris_left = n / 2;
+            
+        }
+
+    }
+
+
+    /*
+     * 4. Subdivide.
+     */
+    {
+        ri_vector_t     bmin_left ,  bmax_left;
+        ri_vector_t     bmin_right,  bmax_right;
+        bvh_build_node_t *node_left , *node_right;
+
+        node_left      = bvh_build_node_new();
+        root->child[0] = node_left;
+
+        node_right     = bvh_build_node_new();
+        root->child[1] = node_right;
+
+        root->axis     = cut_axis;
+
+        /*
+         * left
+         */
+        calc_bbox_of_triangles(
+            bmin_left,
+            bmax_left, 
+            tri_bboxes + index_left,
+            ntris_left);
+
+        /*
+         * Slightly extend bbox to avoid numeric error.
+         */
+        bbox_add_margin( bmin_left, bmax_left );
+
+        vcpy( root->bmin[0], bmin_left );
+        vcpy( root->bmax[0], bmax_left );
+
+        /*
+         * right
+         */
+        calc_bbox_of_triangles(
+            bmin_right,
+            bmax_right, 
+            tri_bboxes + index_left + ntris_left,
+            n - ntris_left);
+
+        bbox_add_margin( bmin_right, bmax_right );
+
+        vcpy( root->bmin[1], bmin_right );
+        vcpy( root->bmax[1], bmax_right );
+
+        if (nthreads > 1 && n >= BVH_PARALLEL_SUBTREE_MIN_TRIS) {
+
+            /*
+             * Fork the left subtree onto a worker thread, and build the
+             * right subtree in this thread. Both subtrees touch disjoint
+             * ranges of the bbox arrays.
+             */
+            bvh_build_task_t *task;
+            ri_thread_t       thread;
+            int               nthreads_left;
+
+            nthreads_left = nthreads / 2;
+
+            task = (bvh_build_task_t *)ri_mem_alloc(sizeof(bvh_build_task_t));
+
+            task->root           = node_left;
+            vcpy( task->bmin, bmin_left );
+            vcpy( task->bmax, bmax_left );
+            task->tri_bboxes     = tri_bboxes;
+            task->tri_bboxes_buf = tri_bboxes_buf;
+            task->index_left     = index_left;
+            task->index_right    = index_left + ntris_left;
+            task->depth          = depth + 1;
+            task->nthreads       = nthreads_left;
+
+            ri_thread_create( &thread, bvh_construct_task_func, task );
+
+            bvh_construct( 
+                node_right,
+                bmin_right,
+                bmax_right,
+                tri_bboxes,
+                tri_bboxes_buf,
+                index_left + ntris_left,
+                index_right,
+                depth + 1,
+                binbuf,
+                nthreads - nthreads_left);
+
+            ri_thread_join( &thread );
+
+            ri_mem_free( task );
+
+        } else {
+
+            bvh_construct( 
+                node_left,
+                bmin_left,
+                bmax_left,
+                tri_bboxes,
+                tri_bboxes_buf,
+                index_left,
+                index_left + ntris_left,
+                depth + 1,
+                binbuf,
+                nthreads);
+
+            bvh_construct( 
+                node_right,
+                bmin_right,
+                bmax_right,
+                tri_bboxes,
+                tri_bboxes_buf,
+                index_left + ntris_left,
+                index_right,
+                depth + 1,
+                binbuf,
+                nthreads);
+
+        }
+
+    }
+
+    return 0;   /* OK */
+}
+
+
+
+/*
+ * Collapsing binary BVH into flattened QBVH.
+ */
+typedef struct _bvh_flatten_t {
+
+    ri_qbvh_node_t   *nodes;
+    uint32_t          nnodes;
+    ri_qbvh_leaf_t   *leaves;
+    uint32_t          nleaves;
+
+} bvh_flatten_t;
+
+/*
+ * Counts # of QBVH nodes and leaves made from the binary (sub)tree.
+ * 'node' must be an inner node.
+ */
+static void
+count_qbvh_nodes(
+    uint64_t                *nnodes_inout,      /* [inout] */
+    uint64_t                *nleaves_inout,     /* [inout] */
+    const bvh_build_node_t  *node)
+{
+    int                      i, j;
+    const bvh_build_node_t  *half;
+
+    (*nnodes_inout)++;
+
+    for (i = 0; i < 2; i++) {
+
+        half = node->child[i];
+
+        if (half->is_leaf) {
+
+            (*nleaves_inout)++;
+
+        } else {
+
+            for (j = 0; j < 2; j++) {
+
+                if (half->child[j]->is_leaf) {
+                    (*nleaves_inout)++;
+                } else {
+                    count_qbvh_nodes( nnodes_inout, nleaves_inout,
+                                      half->child[j] );
+                }
+            }
+        }
+    }
+}
+
+static void
+set_qbvh_child_bbox(
+    ri_qbvh_node_t    *node,
+    int                i,
+    const ri_vector_t  bmin,
+    const ri_vector_t  bmax)
+{
+    node->bbox[BMIN_X0 + i] = bmin[0];
+    node->bbox[BMIN_Y0 + i] = bmin[1];
+    node->bbox[BMIN_Z0 + i] = bmin[2];
+    node->bbox[BMAX_X0 + i] = bmax[0];
+    node->bbox[BMAX_Y0 + i] = bmax[1];
+    node->bbox[BMAX_Z0 + i] = bmax[2];
+}
+
+/*
+ * Empty child has inverted bbox so that ray-box test always misses.
+ */
+static void
+set_qbvh_child_empty(
+    ri_qbvh_node_t    *node,
+    int                i)
+{
+    ri_vector_t bmin, bmax;
+
+    bmin[0] = bmin[1] = bmin[2] =  RI_FLT_MAX;
+    bmax[0] = bmax[1] = bmax[2] = -RI_FLT_MAX;
+
+    set_qbvh_child_bbox( node, i, bmin, bmax );
+
+    node->child[i] = RI_QBVH_EMPTY;
+}
+
+static uint32_t
+flatten_leaf(
+    bvh_flatten_t          *ctx,
+    const bvh_build_node_t *leaf)
+{
+    uint32_t idx;
+
+    assert( leaf->is_leaf );
+    assert( leaf->offset < 0x100000000ULL );
+
+    idx = ctx->nleaves++;
+
+    ctx->leaves[idx].offset     = (uint32_t)leaf->offset;
+    ctx->leaves[idx].ntriangles = leaf->ntriangles;
+
+    return RI_QBVH_LEAF_FLAG | idx;
+}
+
+/*
+ * Emits a QBVH node for the inner binary node 'bnode' and its subtree in
+ * depth-first order. Returns the offset of emitted node.
+ */
+static uint32_t
+flatten_node(
+    bvh_flatten_t          *ctx,
+    const bvh_build_node_t *bnode)
+{
+    int                      i, j;
+    uint32_t                 idx;
+    uint32_t                 ref;
+    int                      axis[2];
+    ri_qbvh_node_t          *node;
+    const bvh_build_node_t  *half;
+    const bvh_build_node_t  *grandchild;
+
+    assert( !bnode->is_leaf );
+
+    idx  = ctx->nnodes++;
+    node = &ctx->nodes[idx];
+
+    memset( node, 0, sizeof(ri_qbvh_node_t) );
+
+    node->axis0 = bnode->axis;
+
+    for (i = 0; i < 2; i++) {
+
+        half = bnode->child[i];
+
+        if (half->is_leaf) {
+
+            axis[i] = 0;
+
+            set_qbvh_child_bbox( node, 2 * i, bnode->bmin[i], bnode->bmax[i] );
+            set_qbvh_child_empty( node, 2 * i + 1 );
+
+            node->child[2 * i] = flatten_leaf( ctx, half );
+
+        } else {
+
+            axis[i] = half->axis;
+
+            for (j = 0; j < 2; j++) {
+
+                grandchild = half->child[j];
+
+                set_qbvh_child_bbox( node, 2 * i + j,
+                                     half->bmin[j], half->bmax[j] );
+
+                if (grandchild->is_leaf) {
+                    ref = flatten_leaf( ctx, grandchild );
+                } else {
+                    ref = flatten_node( ctx, grandchild );
+                }
+
+                /* ctx->nodes is preallocated, thus 'node' is still valid. */
+                node->child[2 * i + j] = ref;
+
+            }
+
+        }
+    }
+
+    node->axis1 = axis[0];
+    node->axis2 = axis[1];
+
+    return idx;
+}
+
+/*
+ * Collapses binary BVH into QBVH and stores it into bvh->nodes and
+ * bvh->leaves.
+ */
+void
+flatten_bvh(
+    ri_bvh_t               *bvh,            /* [inout] */
+    const bvh_build_node_t *root)
+{
+    int            i;
+    uint64_t       nnodes  = 0;
+    uint64_t       nleaves = 0;
+    bvh_flatten_t  ctx;
+
+    if (root->is_leaf) {
+
+        /* Tiny scene. A root QBVH node which has only one leaf. */
+        nnodes  = 1;
+        nleaves = 1;
+
+    } else {
+
+        count_qbvh_nodes( &nnodes, &nleaves, root );
+
+    }
+
+    assert( nnodes  < RI_QBVH_LEAF_FLAG );
+    assert( nleaves < RI_QBVH_LEAF_FLAG );
+
+    ctx.nodes   = (ri_qbvh_node_t *)ri_mem_alloc_aligned(
+                      sizeof(ri_qbvh_node_t) * nnodes, RI_QBVH_NODE_ALIGN);
+    ctx.leaves  = (ri_qbvh_leaf_t *)ri_mem_alloc(
+                      sizeof(ri_qbvh_leaf_t) * nleaves);
+    ctx.nnodes  = 0;
+    ctx.nleaves = 0;
+
+    if (root->is_leaf) {
+
+        memset( ctx.nodes, 0, sizeof(ri_qbvh_node_t) );
+        ctx.nnodes = 1;
+
+        set_qbvh_child_bbox( &ctx.nodes[0], 0, bvh->bmin, bvh->bmax );
+        ctx.nodes[0].child[0] = flatten_leaf( &ctx, root );
+
+        for (i = 1; i < 4; i++) {
+            set_qbvh_child_empty( &ctx.nodes[0], i );
+        }
+
+    } else {
+
+        flatten_node( &ctx, root );
+
+    }
+
+    assert( ctx.nnodes  == nnodes  );
+    assert( ctx.nleaves == nleaves );
+
+    bvh->nodes   = ctx.nodes;
+    bvh->nnodes  = ctx.nnodes;
+    bvh->leaves  = ctx.leaves;
+    bvh->nleaves = ctx.nleaves;
+}
+
+
+#ifdef WITH_SSE
+/*
+ * Packs triangles of leaf `i' into bvh->triangle4s, from
+ * leaves[i].triangle4_offset.
+ */
+static void
+pack_leaf_triangle4s(
+    ri_bvh_t *bvh,
+    uint32_t  i)
+{
+    uint32_t               j, k;
+    const ri_float_t      *v0, *v1, *v2;
+    const ri_bvh_triref_t *refs;
+    ri_triangle4_t        *tri4;
+
+    refs = bvh->trirefs + bvh->leaves[i].offset;
+
+    for (j = 0; j < bvh->leaves[i].ntriangles; j++) {
+
+        tri4 = bvh->triangle4s + bvh->leaves[i].triangle4_offset + (j / 4);
+        k    = j % 4;
+
+        bvh_get_vertices( &v0, &v1, &v2, bvh, &refs[j] );
+
+        tri4->p0x[k] = v0[0];
+        tri4->p0y[k] = v0[1];
+        tri4->p0z[k] = v0[2];
+
+        tri4->e1x[k] = v1[0] - v0[0];
+        tri4->e1y[k] = v1[1] - v0[1];
+        tri4->e1z[k] = v1[2] - v0[2];
+
+        tri4->e2x[k] = v2[0] - v0[0];
+        tri4->e2y[k] = v2[1] - v0[1];
+        tri4->e2z[k] = v2[2] - v0[2];
+    }
+}
+#endif
+
+/*
+ * fp32 version of pack_leaf_triangle4s(). Vertices are rounded to nearest.
+ */
+static void
+pack_leaf_triangle4fs(
+    ri_bvh_t *bvh,
+    uint32_t  i)
+{
+    uint32_t               j, k;
+    const ri_float_t      *v0, *v1, *v2;
+    const ri_bvh_triref_t *refs;
+    ri_triangle4f_t       *tri4f;
+
+    refs = bvh->trirefs + bvh->leaves[i].offset;
+
+    for (j = 0; j < bvh->leaves[i].ntriangles; j++) {
+
+        tri4f = bvh->triangle4fs + bvh->leaves[i].triangle4_offset + (j / 4);
+        k     = j % 4;
+
+        bvh_get_vertices( &v0, &v1, &v2, bvh, &refs[j] );
+
+        tri4f->p0x[k] = (float)v0[0];
+        tri4f->p0y[k] = (float)v0[1];
+        tri4f->p0z[k] = (float)v0[2];
+        tri4f->p1x[k] = (float)v1[0];
+        tri4f->p1y[k] = (float)v1[1];
+        tri4f->p1z[k] = (float)v1[2];
+        tri4f->p2x[k] = (float)v2[0];
+        tri4f->p2y[k] = (float)v2[1];
+        tri4f->p2z[k] = (float)v2[2];
+    }
+}
+
+/*
+ * Packs triangles of each leaf into SoA form(4 triangles per ri_triangle4_t)
+ * for SIMD intersection. Unused lanes are filled with degenerate triangles,
+ * which never hit.
+ */
+static void
+build_triangle4s(
+    ri_bvh_t *bvh)
+{
+#ifdef WITH_SSE
+    uint32_t         i;
+    uint32_t         n4;
+    uint32_t         offset;
+
+    n4 = 0;
+    for (i = 0; i < bvh->nleaves; i++) {
+        n4 += (bvh->leaves[i].ntriangles + 3) / 4;
+    }
+
+    bvh->ntriangle4s = n4;
+
+    if (n4 == 0) {
+        bvh->triangle4s = NULL;
+        return;
+    }
+
+    bvh->triangle4s = (ri_triangle4_t *)ri_mem_alloc_aligned(
+                        sizeof(ri_triangle4_t) * n4, 32);
+    memset(bvh->triangle4s, 0, sizeof(ri_triangle4_t) * n4);
+
+    offset = 0;
+
+    for (i = 0; i < bvh->nleaves; i++) {
+
+        bvh->leaves[i].triangle4_offset = offset;
+
+        pack_leaf_triangle4s( bvh, i );
+
+        offset += (bvh->leaves[i].ntriangles + 3) / 4;
+    }
+
+    assert(offset == n4);
+#else
+    bvh->triangle4s  = NULL;
+    bvh->ntriangle4s = 0;
+#endif
+}
+
+/*
+ * Converts the QBVH into the fp32 BVH. Boxes are rounded outward, and leaf
+ * triangles are packed into ri_triangle4f_t. Double precision nodes are
+ * released.
+ */
+static void
+build_fp32_bvh(
+    ri_bvh_t *bvh)
+{
+    uint32_t          i, k;
+    uint32_t          n4;
+    uint32_t          offset;
+    ri_qbvh_node32_t *node32;
+
+    /*
+     * Nodes.
+     */
+    bvh->nodes32 = (ri_qbvh_node32_t *)ri_mem_alloc_aligned(
+                       sizeof(ri_qbvh_node32_t) * bvh->nnodes,
+                       RI_QBVH_NODE_ALIGN);
+
+    for (i = 0; i < bvh->nnodes; i++) {
+
+        node32 = &bvh->nodes32[i];
+
+        memset( node32, 0, sizeof(ri_qbvh_node32_t) );
+
+        for (k = 0; k < 12; k++) {
+            node32->bbox[BMIN_X0 + k] = flt_round_down(
+                                            bvh->nodes[i].bbox[BMIN_X0 + k] );
+            node32->bbox[BMAX_X0 + k] = flt_round_up(
+                                            bvh->nodes[i].bbox[BMAX_X0 + k] );
+        }
+
+        for (k = 0; k < 4; k++) {
+            node32->child[k] = bvh->nodes[i].child[k];
+        }
+
+        node32->axis0 = bvh->nodes[i].axis0;
+        node32->axis1 = bvh->nodes[i].axis1;
+        node32->axis2 = bvh->nodes[i].axis2;
+    }
+
+    ri_mem_free_aligned( bvh->nodes );
+    bvh->nodes = NULL;
+
+    /*
+     * Triangles. Vertices are rounded to nearest. They stay inside of the
+     * outward rounded boxes.
+     */
+    n4 = 0;
+    for (i = 0; i < bvh->nleaves; i++) {
+        n4 += (bvh->leaves[i].ntriangles + 3) / 4;
+    }
+
+    bvh->ntriangle4fs = n4;
+    bvh->triangle4fs  = (ri_triangle4f_t *)ri_mem_alloc_aligned(
+                            sizeof(ri_triangle4f_t) * n4, 32);
+    memset( bvh->triangle4fs, 0, sizeof(ri_triangle4f_t) * n4 );
+
+    offset = 0;
+
+    for (i = 0; i < bvh->nleaves; i++) {
+
+        bvh->leaves[i].triangle4_offset = offset;
+
+        pack_leaf_triangle4fs( bvh, i );
+
+        offset += (bvh->leaves[i].ntriangles + 3) / 4;
+    }
+
+    assert(offset == n4);
+
+}
+
+static void
+calc_bvh_nbytes(
+    ri_bvh_t *bvh)
+{
+    bvh->nbytes = sizeof(ri_qbvh_leaf_t)  * bvh->nleaves +
+                  sizeof(ri_bvh_triref_t) * bvh->ntriangles +
+                  sizeof(ri_geom_t *)     * bvh->ngeoms +
+                  sizeof(float)           * bvh->nnodes;
+
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+        bvh->nbytes += sizeof(ri_qbvh_node32_t) * bvh->nnodes +
+                       sizeof(ri_triangle4f_t)  * bvh->ntriangle4fs;
+    } else {
+        bvh->nbytes += sizeof(ri_qbvh_node_t)   * bvh->nnodes +
+                       sizeof(ri_triangle4_t)   * bvh->ntriangle4s;
+    }
+}
+
+/*
+ * Incremental update.
+ *
+ * Deformed geometries are handled by refitting the boxes bottom-up [3].
+ * Refitting keeps the tree, which degrades as triangles move away from
+ * their neighbors at the build. The cost of each node is the expected SAH
+ * cost of a ray which enters the node, thus it can be compared with the
+ * cost at the build regardless of the size of the node. Subtrees whose
+ * cost grew over the threshold are rebuilt. Since the triangles of a
+ * subtree are a contiguous range of trirefs, the rebuilt subtree reuses
+ * the range, and the other subtrees are copied as they are.
+ */
+#define BVH_COST_TNODE      (0.8f)      /* 4 * Taabb of SAH()   */
+#define BVH_COST_TTRI       (0.8f)
+
+static inline uint32_t
+get_node_child(
+    const ri_bvh_t *bvh,
+    uint32_t        node,
+    int             k)
+{
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+        return bvh->nodes32[node].child[k];
+    } else {
+        return bvh->nodes[node].child[k];
+    }
+}
+
+static void
+get_node_child_bbox(
+    ri_vector_t     bmin_out,           /* [out] */
+    ri_vector_t     bmax_out,           /* [out] */
+    const ri_bvh_t *bvh,
+    uint32_t        node,
+    int             k)
+{
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+
+        const float *bbox = bvh->nodes32[node].bbox;
+
+        bmin_out[0] = bbox[BMIN_X0 + k];
+        bmin_out[1] = bbox[BMIN_Y0 + k];
+        bmin_out[2] = bbox[BMIN_Z0 + k];
+        bmax_out[0] = bbox[BMAX_X0 + k];
+        bmax_out[1] = bbox[BMAX_Y0 + k];
+        bmax_out[2] = bbox[BMAX_Z0 + k];
+
+    } else {
+
+        const ri_float_t *bbox = bvh->nodes[node].bbox;
+
+        bmin_out[0] = bbox[BMIN_X0 + k];
+        bmin_out[1] = bbox[BMIN_Y0 + k];
+        bmin_out[2] = bbox[BMIN_Z0 + k];
+        bmax_out[0] = bbox[BMAX_X0 + k];
+        bmax_out[1] = bbox[BMAX_Y0 + k];
+        bmax_out[2] = bbox[BMAX_Z0 + k];
+
+    }
+}
+
+/*
+ * The fp32 box is rounded outward as build_fp32_bvh() does.
+ */
+static void
+set_node_child_bbox(
+    ri_bvh_t          *bvh,             /* [inout] */
+    uint32_t           node,
+    int                k,
+    const ri_vector_t  bmin,
+    const ri_vector_t  bmax)
+{
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+
+        float *bbox = bvh->nodes32[node].bbox;
+
+        bbox[BMIN_X0 + k] = flt_round_down( bmin[0] );
+        bbox[BMIN_Y0 + k] = flt_round_down( bmin[1] );
+        bbox[BMIN_Z0 + k] = flt_round_down( bmin[2] );
+        bbox[BMAX_X0 + k] = flt_round_up( bmax[0] );
+        bbox[BMAX_Y0 + k] = flt_round_up( bmax[1] );
+        bbox[BMAX_Z0 + k] = flt_round_up( bmax[2] );
+
+    } else {
+
+        set_qbvh_child_bbox( &bvh->nodes[node], k, bmin, bmax );
+
+    }
+}
+
+/*
+ * Bbox of the triangles of leaf `i' with the margin, as bvh_construct()
+ * gives to its children.
+ */
+static void
+calc_leaf_bbox(
+    ri_vector_t     bmin_out,           /* [out] */
+    ri_vector_t     bmax_out,           /* [out] */
+    const ri_bvh_t *bvh,
+    uint32_t        i)
+{
+    uint32_t               j;
+    const ri_float_t      *v0, *v1, *v2;
+    const ri_bvh_triref_t *refs;
+    ri_float_t             bmin[3], bmax[3];
+
+    refs = bvh->trirefs + bvh->leaves[i].offset;
+
+    for (j = 0; j < bvh->leaves[i].ntriangles; j++) {
+
+        bvh_get_vertices( &v0, &v1, &v2, bvh, &refs[j] );
+
+        get_bbox_of_triangle( bmin, bmax, v0, v1, v2 );
+
+        if (j == 0) {
+            vcpy3( bmin_out, bmin );
+            vcpy3( bmax_out, bmax );
+        } else {
+            vmin3( bmin_out, bmin_out, bmin );
+            vmax3( bmax_out, bmax_out, bmax );
+        }
+    }
+
+    bbox_add_margin( bmin_out, bmax_out );
+}
+
+/*
+ * Computes the cost of each node normalized by the area of the node:
+ *
+ *   C(node) = Tnode + sum_k A(child_k) / A(node) * C(child_k)
+ *   C(leaf) = ntriangles * Ttri
+ *
+ * Nodes are visited in reverse order, thus children come before parents.
+ */
+static void
+calc_node_costs(
+    float          *costs_out,          /* [out] [nnodes] */
+    const ri_bvh_t *bvh)
+{
+    int64_t     i;
+    int         k;
+    int         nchildren;
+    uint32_t    c;
+    ri_vector_t bmin, bmax;
+    ri_vector_t umin, umax;
+    ri_float_t  area[4];
+    ri_float_t  uarea;
+    ri_float_t  cost;
+
+    for (i = (int64_t)bvh->nnodes - 1; i >= 0; i--) {
+
+        nchildren = 0;
+
+        for (k = 0; k < 4; k++) {
+
+            c = get_node_child( bvh, (uint32_t)i, k );
+            if (RI_QBVH_IS_EMPTY(c)) continue;
+
+            get_node_child_bbox( bmin, bmax, bvh, (uint32_t)i, k );
+
+            area[k] = calc_surface_area( bmin, bmax );
+
+            if (nchildren == 0) {
+                vcpy3( umin, bmin );
+                vcpy3( umax, bmax );
+            } else {
+                vmin3( umin, umin, bmin );
+                vmax3( umax, umax, bmax );
+            }
+
+            nchildren++;
+        }
+
+        cost = 0.0;
+
+        if (nchildren > 0) {
+
+            for (k = 0; k < 4; k++) {
+
+                c = get_node_child( bvh, (uint32_t)i, k );
+                if (RI_QBVH_IS_EMPTY(c)) continue;
+
+                if (RI_QBVH_IS_LEAF(c)) {
+                    cost += area[k] * BVH_COST_TTRI *
+                        bvh->leaves[RI_QBVH_LEAF_INDEX(c)].ntriangles;
+                } else {
+                    cost += area[k] * costs_out[c];
+                }
+            }
+
+            uarea = calc_surface_area( umin, umax );
+
+            cost = (uarea > 0.0) ? (cost / uarea) : 0.0;
+        }
+
+        costs_out[i] = (float)(BVH_COST_TNODE + cost);
+    }
+}
+
+/*
+ * Refits boxes of the leaves which have triangles of dirty geometries and
+ * of their ancestors. Returns # of refitted leaves.
+ */
+static uint32_t
+refit_bvh(
+    ri_bvh_t      *bvh,                 /* [inout]  */
+    const uint8_t *dirty)               /* [ngeoms] */
+{
+    int64_t                i;
+    uint32_t               j;
+    int                    k;
+    uint32_t               c, l;
+    uint32_t               nrefitted;
+    uint8_t               *leaf_dirty;
+    uint8_t               *node_dirty;
+    ri_vector_t           *node_bmin;
+    ri_vector_t           *node_bmax;
+    ri_vector_t            bmin, bmax;
+    int                    nchildren;
+    const ri_bvh_triref_t *refs;
+
+    leaf_dirty = (uint8_t *)ri_mem_alloc(sizeof(uint8_t) * bvh->nleaves);
+    node_dirty = (uint8_t *)ri_mem_alloc(sizeof(uint8_t) * bvh->nnodes);
+    node_bmin  = (ri_vector_t *)ri_mem_alloc(sizeof(ri_vector_t) * bvh->nnodes);
+    node_bmax  = (ri_vector_t *)ri_mem_alloc(sizeof(ri_vector_t) * bvh->nnodes);
+
+    memset( node_dirty, 0, sizeof(uint8_t) * bvh->nnodes );
+
+    nrefitted = 0;
+
+    for (l = 0; l < bvh->nleaves; l++) {
+
+        leaf_dirty[l] = 0;
+
+        refs = bvh->trirefs + bvh->leaves[l].offset;
+
+        for (j = 0; j < bvh->leaves[l].ntriangles; j++) {
+            if (dirty[refs[j].geom_id]) {
+                leaf_dirty[l] = 1;
+                nrefitted++;
+                break;
+            }
+        }
+    }
+
+    for (i = (int64_t)bvh->nnodes - 1; i >= 0; i--) {
+
+        for (k = 0; k < 4; k++) {
+
+            c = get_node_child( bvh, (uint32_t)i, k );
+            if (RI_QBVH_IS_EMPTY(c)) continue;
+
+            if (RI_QBVH_IS_LEAF(c)) {
+
+                l = RI_QBVH_LEAF_INDEX(c);
+                if (!leaf_dirty[l]) continue;
+
+                calc_leaf_bbox( bmin, bmax, bvh, l );
+
+                set_node_child_bbox( bvh, (uint32_t)i, k, bmin, bmax );
+
+            } else {
+
+                if (!node_dirty[c]) continue;
+
+                set_node_child_bbox( bvh, (uint32_t)i, k,
+                                     node_bmin[c], node_bmax[c] );
+
+            }
+
+            node_dirty[i] = 1;
+        }
+
+        if (!node_dirty[i]) continue;
+
+        /* Union of children, which is the box of the node in its parent. */
+        nchildren = 0;
+
+        for (k = 0; k < 4; k++) {
+
+            c = get_node_child( bvh, (uint32_t)i, k );
+            if (RI_QBVH_IS_EMPTY(c)) continue;
+
+            get_node_child_bbox( bmin, bmax, bvh, (uint32_t)i, k );
+
+            if (nchildren == 0) {
+                vcpy3( node_bmin[i], bmin );
+                vcpy3( node_bmax[i], bmax );
+            } else {
+                vmin3( node_bmin[i], node_bmin[i], bmin );
+                vmax3( node_bmax[i], node_bmax[i], bmax );
+            }
+
+            nchildren++;
+        }
+    }
+
+    if (node_dirty[0]) {
+        vcpy3( bvh->bmin, node_bmin[0] );
+        vcpy3( bvh->bmax, node_bmax[0] );
+    }
+
+    /*
+     * Repack triangles of the refitted leaves.
+     */
+    for (l = 0; l < bvh->nleaves; l++) {
+
+        if (!leaf_dirty[l]) continue;
+
+        if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+            pack_leaf_triangle4fs( bvh, l );
+        }
+#ifdef WITH_SSE
+        else if (bvh->triangle4s) {
+            pack_leaf_triangle4s( bvh, l );
+        }
+#endif
+    }
+
+    ri_mem_free( leaf_dirty );
+    ri_mem_free( node_dirty );
+    ri_mem_free( node_bmin );
+    ri_mem_free( node_bmax );
+
+    return nrefitted;
+}
+
+/*
+ * Selects the degraded subtrees under `node'. A degraded node is selected
+ * if none of its inner children is degraded, i.e. the degradation is at
+ * this level. Otherwise the degraded children are looked into.
+ */
+static void
+select_subtrees(
+    int32_t        *selected_inout,     /* [inout] [nnodes] */
+    uint32_t       *nselected_inout,    /* [inout]  */
+    const ri_bvh_t *bvh,
+    const float    *costs,
+    float           threshold,
+    uint32_t        node)
+{
+    int      k;
+    uint32_t c;
+    int      degraded_child = 0;
+
+    for (k = 0; k < 4; k++) {
+
+        c = get_node_child( bvh, node, k );
+        if (RI_QBVH_IS_EMPTY(c) || RI_QBVH_IS_LEAF(c)) continue;
+
+        if (costs[c] > threshold * bvh->node_costs[c]) {
+            degraded_child = 1;
+        }
+    }
+
+    if (!degraded_child && (costs[node] > threshold * bvh->node_costs[node])) {
+
+        selected_inout[node] = (int32_t)(*nselected_inout);
+        (*nselected_inout)++;
+
+        return;
+    }
+
+    for (k = 0; k < 4; k++) {
+
+        c = get_node_child( bvh, node, k );
+        if (RI_QBVH_IS_EMPTY(c) || RI_QBVH_IS_LEAF(c)) continue;
+
+        select_subtrees( selected_inout, nselected_inout, bvh, costs,
+                         threshold, c );
+    }
+}
+
+static void
+get_subtree_range(
+    uint32_t       *begin_inout,        /* [inout] */
+    uint32_t       *end_inout,          /* [inout] */
+    const ri_bvh_t *bvh,
+    uint32_t        node)
+{
+    int                   k;
+    uint32_t              c;
+    const ri_qbvh_leaf_t *leaf;
+
+    for (k = 0; k < 4; k++) {
+
+        c = get_node_child( bvh, node, k );
+        if (RI_QBVH_IS_EMPTY(c)) continue;
+
+        if (RI_QBVH_IS_LEAF(c)) {
+
+            leaf = &bvh->leaves[RI_QBVH_LEAF_INDEX(c)];
+
+            if (leaf->offset < (*begin_inout)) {
+                (*begin_inout) = leaf->offset;
+            }
+            if (leaf->offset + leaf->ntriangles > (*end_inout)) {
+                (*end_inout) = leaf->offset + leaf->ntriangles;
+            }
+
+        } else {
+
+            get_subtree_range( begin_inout, end_inout, bvh, c );
+
+        }
+    }
+}
+
+/*
+ * Range of trirefs of the subtree. Leaves are emitted in depth-first
+ * order, thus the range is contiguous.
+ */
+static void
+calc_subtree_range(
+    uint32_t       *offset_out,         /* [out] */
+    uint32_t       *ntriangles_out,     /* [out] */
+    const ri_bvh_t *bvh,
+    uint32_t        node)
+{
+    uint32_t begin = 0xffffffff;
+    uint32_t end   = 0;
+
+    get_subtree_range( &begin, &end, bvh, node );
+
+    assert( begin < end );
+
+    (*offset_out)     = begin;
+    (*ntriangles_out) = end - begin;
+}
+
+static void
+count_subtree_nodes(
+    uint64_t       *nnodes_inout,       /* [inout] */
+    uint64_t       *nleaves_inout,      /* [inout] */
+    const ri_bvh_t *bvh,
+    uint32_t        node)
+{
+    int      k;
+    uint32_t c;
+
+    (*nnodes_inout)++;
+
+    for (k = 0; k < 4; k++) {
+
+        c = get_node_child( bvh, node, k );
+        if (RI_QBVH_IS_EMPTY(c)) continue;
+
+        if (RI_QBVH_IS_LEAF(c)) {
+            (*nleaves_inout)++;
+        } else {
+            count_subtree_nodes( nnodes_inout, nleaves_inout, bvh, c );
+        }
+    }
+}
 
-    return (state_out->t < RI_INFINITY);
+static void
+offset_build_leaves(
+    bvh_build_node_t *node,
+    uint64_t          offset)
+{
+    if (node->is_leaf) {
+        node->offset += offset;
+    } else {
+        offset_build_leaves( node->child[0], offset );
+        offset_build_leaves( node->child[1], offset );
+    }
 }
 
-static inline ri_float_t
-calc_surface_area(
-    ri_vector_t bmin,
-    ri_vector_t bmax)
+/*
+ * Builds the binary BVH over trirefs[offset, offset + ntriangles) with the
+ * current vertices, and sorts the range by leaf.
+ */
+static bvh_build_node_t *
+rebuild_subtree(
+    ri_bvh_t *bvh,                      /* [inout] */
+    uint32_t  offset,
+    uint32_t  ntriangles,
+    int       nthreads)
 {
-    ri_float_t sa;
+    uint32_t               i;
+    const ri_float_t      *v0, *v1, *v2;
+    ri_vector_t            bmin, bmax;
+    tri_bbox_t            *tri_bboxes;
+    tri_bbox_t            *tri_bboxes_buf;
+    bvh_bin_buffer_t      *binbuf;
+    bvh_build_node_t      *root;
+    ri_bvh_triref_t       *refs;
 
-    assert( bmax[0] >= bmin[0] );
-    assert( bmax[1] >= bmin[1] );
-    assert( bmax[2] >= bmin[2] );
+    refs = bvh->trirefs + offset;
 
-    sa = (bmax[0] - bmin[0]) * (bmax[1] - bmin[1]) +
-         (bmax[1] - bmin[1]) * (bmax[2] - bmin[2]) +
-         (bmax[2] - bmin[2]) * (bmax[0] - bmin[0]);
+    tri_bboxes     = ri_mem_alloc(sizeof(tri_bbox_t) * ntriangles);
+    tri_bboxes_buf = ri_mem_alloc(sizeof(tri_bbox_t) * ntriangles);
 
-    sa *= 2.0;
+    for (i = 0; i < ntriangles; i++) {
 
-    return sa;
-}
+        bvh_get_vertices( &v0, &v1, &v2, bvh, &refs[i] );
 
-static inline ri_float_t
-SAH(
-    int        ns1,
-    ri_float_t left_area,
-    int        ns2,
-    ri_float_t right_area,
-    ri_float_t s)
-{
-    const float Taabb = 0.2f;
-    const float Ttri  = 0.8f;
+        get_bbox_of_triangle( tri_bboxes[i].bmin, tri_bboxes[i].bmax,
+                              v0, v1, v2 );
 
-    float T;
+        tri_bboxes[i].geom_id = refs[i].geom_id;
+        tri_bboxes[i].index   = refs[i].index;
+    }
 
-    T = 2.0f * Taabb
-      + (left_area / s) * (ri_float_t)ns1 * Ttri
-      + (right_area / s) * (ri_float_t)ns2 * Ttri; 
+    ri_mem_copy(tri_bboxes_buf, tri_bboxes, sizeof(tri_bbox_t) * ntriangles);
 
-    return T;
+    calc_bbox_of_triangles( bmin, bmax, tri_bboxes, ntriangles );
+
+    bbox_add_margin( bmin, bmax );
+
+    root   = bvh_build_node_new();
+    binbuf = (bvh_bin_buffer_t *)ri_mem_alloc(sizeof(bvh_bin_buffer_t));
+
+    bvh_construct(
+        root,
+        bmin,
+        bmax,
+        tri_bboxes,
+        tri_bboxes_buf,
+        0,
+        ntriangles,
+        0,
+        binbuf,
+        nthreads);
+
+    ri_mem_free( binbuf );
+
+    for (i = 0; i < ntriangles; i++) {
+        refs[i].geom_id = tri_bboxes[i].geom_id;
+        refs[i].index   = tri_bboxes[i].index;
+    }
+
+    ri_mem_free( tri_bboxes );
+    ri_mem_free( tri_bboxes_buf );
+
+    offset_build_leaves( root, offset );
+
+    return root;
 }
 
-int 
-find_cut_from_bin(
-    ri_float_t             *cut_pos_out,        /* [out]    */
-    int                    *cut_axis_out,       /* [out]    */ 
-    const bvh_bin_buffer_t *binbuf,
-    ri_vector_t             bmin,
-    ri_vector_t             bmax,
-    uint64_t                ntriangles)
+/*
+ * Copies the subtree of `node' into ctx in depth-first order. Selected
+ * subtrees are replaced with their rebuilt binary BVH. old_index_out
+ * records the node index before the update, or -1 for rebuilt nodes.
+ */
+static uint32_t
+reflatten_node(
+    bvh_flatten_t       *ctx,
+    int64_t             *old_index_out,     /* [out] */
+    const ri_bvh_t      *bvh,
+    const int32_t       *selected,
+    const bvh_subtree_t *subtrees,
+    uint32_t             node)
 {
-    int         i, j;
+    int                     k;
+    uint32_t                i;
+    uint32_t                c, l;
+    uint32_t                idx;
+    uint32_t                first;
+    ri_vector_t             bmin, bmax;
+    ri_qbvh_node_t         *dst;
+    const bvh_build_node_t *root;
 
-    ri_float_t  cost;
-    int         min_cost_axis = 0;
-    ri_float_t  min_cost_pos  = 0.0;
-    ri_float_t  min_cost      = RI_INFINITY;
-        
-    uint64_t    tris_left; 
-    uint64_t    tris_right;
+    if (selected[node] >= 0) {
 
-    ri_vector_t bsize;
-    ri_vector_t bstep;
+        first = ctx->nnodes;
 
-    ri_vector_t bmin_left, bmax_left;
-    ri_vector_t bmin_right, bmax_right;
-    ri_float_t  sa_left, sa_right, sa_total;
+        idx = flatten_node( ctx, subtrees[selected[node]].root );
 
-    ri_float_t  pos;
+        for (i = first; i < ctx->nnodes; i++) {
+            old_index_out[i] = -1;
+        }
 
-    bsize[0]    = bmax[0] - bmin[0];
-    bsize[1]    = bmax[1] - bmin[1];
-    bsize[2]    = bmax[2] - bmin[2];
+        return idx;
+    }
 
-    bstep[0] = bsize[0] / (ri_float_t)BVH_BIN_SIZE;
-    bstep[1] = bsize[1] / (ri_float_t)BVH_BIN_SIZE;
-    bstep[2] = bsize[2] / (ri_float_t)BVH_BIN_SIZE;
+    idx = ctx->nnodes++;
+    dst = &ctx->nodes[idx];
 
-    sa_total    = calc_surface_area( bmin, bmax );
+    old_index_out[idx] = node;
 
-    for (j = 0; j < 3; j++) {   /* axis */
+    memset( dst, 0, sizeof(ri_qbvh_node_t) );
 
-        /*
-         *  Compute SAH cost for right side of each cell of the bbox.
-         *  Exclude both extreme side of the bbox.
-         *     
-         *  i:      0    1    2    3    
-         *     +----+----+----+----+----+
-         *     |    |    |    |    |    |
-         *     +----+----+----+----+----+
-         *
-         */
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
+        dst->axis0 = bvh->nodes32[node].axis0;
+        dst->axis1 = bvh->nodes32[node].axis1;
+        dst->axis2 = bvh->nodes32[node].axis2;
+    } else {
+        dst->axis0 = bvh->nodes[node].axis0;
+        dst->axis1 = bvh->nodes[node].axis1;
+        dst->axis2 = bvh->nodes[node].axis2;
+    }
 
-        tris_left  = 0; 
-        tris_right = ntriangles;
+    for (k = 0; k < 4; k++) {
 
-        vcpy( bmin_left, bmin ); vcpy( bmin_right, bmin );
-        vcpy( bmax_left, bmax ); vcpy( bmax_right, bmax );
+        c = get_node_child( bvh, node, k );
 
-        for (i = 0; i < BVH_BIN_SIZE - 1; i++) {
+        if (RI_QBVH_IS_EMPTY(c)) {
+            set_qbvh_child_empty( dst, k );
+            continue;
+        }
 
-            tris_left  += binbuf->bin[0][j][i];
-            tris_right -= binbuf->bin[1][j][i];
+        /* fp32 boxes are exact in double. */
+        get_node_child_bbox( bmin, bmax, bvh, node, k );
 
-            assert(tris_left  <=  ntriangles);
-            assert(tris_right <=  ntriangles);
+        if (RI_QBVH_IS_LEAF(c)) {
 
-            /*
-             * split pos = bmin + (i + 1) * (bsize / BIN_SIZE)
-             * +1 for i since we want a position on right side of the cell.
-             */
-            
+            l = ctx->nleaves++;
+            ctx->leaves[l] = bvh->leaves[RI_QBVH_LEAF_INDEX(c)];
 
-            pos = bmin[j] + (i + 1) * bstep[j];
+            dst->child[k] = RI_QBVH_LEAF_FLAG | l;
 
-            bmax_left[j]  = pos;
-            bmin_right[j] = pos;
+        } else {
 
-            sa_left  = calc_surface_area( bmin_left, bmax_left );
-            sa_right = calc_surface_area( bmin_right, bmax_right );
+            /* ctx->nodes is preallocated, thus 'dst' is still valid. */
+            dst->child[k] = reflatten_node( ctx, old_index_out, bvh,
+                                            selected, subtrees, c );
 
-            cost = SAH( tris_left, sa_left, tris_right, sa_right, sa_total );
-            
-            if (cost < min_cost) {  /* update mincost   */
-                min_cost      = cost;
-                min_cost_axis = j;
-                min_cost_pos  = pos; 
+            if (selected[c] >= 0) {
+                root = subtrees[selected[c]].root;
+                vcpy3( bmin, root->bmin[0] );
+                vcpy3( bmax, root->bmax[0] );
+                vmin3( bmin, bmin, root->bmin[1] );
+                vmax3( bmax, bmax, root->bmax[1] );
             }
         }
 
+        set_qbvh_child_bbox( dst, k, bmin, bmax );
     }
 
-    (*cut_axis_out) = min_cost_axis;
-    (*cut_pos_out)  = min_cost_pos;
-
-
-    return 0;   /* OK */
-   
+    return idx;
 }
 
-int
-bvh_construct(
-    ri_qbvh_node_t *root,
-    ri_vector_t     bmin,
-    ri_vector_t     bmax,
-    ri_triangle_t  *triangles,
-    ri_triangle_t  *triangles_buf,
-    tri_bbox_t     *tri_bboxes,
-    tri_bbox_t     *tri_bboxes_buf,
-    uint64_t        index_left,             /* [index_left, index_right)    */
-    uint64_t        index_right)
+/*
+ * Rebuilds the selected subtrees and flattens the whole BVH again. Nodes
+ * which are not rebuilt keep their costs at the build.
+ */
+static void
+rebuild_subtrees(
+    ri_bvh_t          *bvh,             /* [inout]  */
+    const int32_t     *selected,
+    bvh_subtree_t     *subtrees,        /* [inout]  */
+    uint32_t           nsubtrees,
+    int                nthreads)
 {
+    uint32_t       i;
+    uint64_t       nnodes, nleaves;
+    uint64_t       nold_nodes, nold_leaves;
+    int64_t       *old_index;
+    float         *costs;
+    bvh_flatten_t  ctx;
 
-    uint64_t n;
-    uint32_t n32;
+    nnodes  = bvh->nnodes;
+    nleaves = bvh->nleaves;
 
-    n = index_right - index_left;
+    for (i = 0; i < nsubtrees; i++) {
 
-    ri_float_t cut_pos;
-    int        cut_axis;
+        subtrees[i].root = rebuild_subtree( bvh, subtrees[i].offset,
+                                            subtrees[i].ntriangles, nthreads );
+
+        /* A QBVH node has more triangles than a leaf. */
+        assert( !subtrees[i].root->is_leaf );
+
+        nold_nodes  = 0;
+        nold_leaves = 0;
+        count_subtree_nodes( &nold_nodes, &nold_leaves, bvh,
+                             subtrees[i].node );
+
+        nnodes  -= nold_nodes;
+        nleaves -= nold_leaves;
+
+        count_qbvh_nodes( &nnodes, &nleaves, subtrees[i].root );
+    }
+
+    assert( nnodes  < RI_QBVH_LEAF_FLAG );
+    assert( nleaves < RI_QBVH_LEAF_FLAG );
+
+    ctx.nodes   = (ri_qbvh_node_t *)ri_mem_alloc_aligned(
+                      sizeof(ri_qbvh_node_t) * nnodes, RI_QBVH_NODE_ALIGN);
+    ctx.leaves  = (ri_qbvh_leaf_t *)ri_mem_alloc(
+                      sizeof(ri_qbvh_leaf_t) * nleaves);
+    ctx.nnodes  = 0;
+    ctx.nleaves = 0;
+
+    old_index = (int64_t *)ri_mem_alloc(sizeof(int64_t) * nnodes);
+
+    reflatten_node( &ctx, old_index, bvh, selected, subtrees, 0 );
+
+    assert( ctx.nnodes  == nnodes  );
+    assert( ctx.nleaves == nleaves );
+
+    for (i = 0; i < nsubtrees; i++) {
+        bvh_build_node_free( subtrees[i].root );
+    }
 
     /*
-     * 1. If # of triangles are less than threshold, make a leaf node.
+     * Replace nodes and leaves, then pack leaf triangles again.
      */
-    if (n <= BVH_NTRIS_LEAF) {
+    ri_mem_free( bvh->leaves );
 
-        /*
-         * trianble bbox list is sorted at (3.), but triangle data itself is
-         * not.
-         * Defer sorting triangle data until making a leaf.
-         *
-         * 'triangles' contains sorted list of triangles.
-         * 'triangles_buf' contains unmodifiled list of triangles.
-         * if the tri_bbox has index 'i', we can pick up triangle data
-         * the tri_bbox points to by expressing triangles_buf[i].
-         */
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
 
-        gather_triangles(
-            triangles + index_left,
-            triangles_buf,                          /* No offset    */
-            tri_bboxes + index_left,
-            n);
+        ri_mem_free_aligned( bvh->nodes32 );
+        ri_mem_free_aligned( bvh->triangle4fs );
 
-        /*
-         * After gather_triangles() was called,
-         * triangles[index_left, index_right) contains sorted list of
-         * triangles.
-         */
+    } else {
 
-        /*
-         * bbox[0]    -> # of triangles.
-         * child[0]   -> ptr to 3D triangles.
-         * child[1:3] -> ptr to 2D triangles.
-         */
-        
-        assert( n < 0x100000000ULL );
-        n32 = (uint32_t)n;
+        ri_mem_free_aligned( bvh->nodes );
 
-        uint32_t *ptr;
+        if (bvh->triangle4s) {
+            ri_mem_free_aligned( bvh->triangle4s );
+        }
 
-        ptr = (uint32_t *)&root->bbox[0];
+        tri2d_cache_free( &bvh->tri2d_cache );
+    }
 
-        (*ptr)         = n32;       /* root->bbox[0] = n32  */
-        root->child[0] = (ri_qbvh_node_t *)(triangles + index_left);
+    bvh->nodes   = ctx.nodes;
+    bvh->nnodes  = ctx.nnodes;
+    bvh->leaves  = ctx.leaves;
+    bvh->nleaves = ctx.nleaves;
 
-        /*
-         * 2D triangles are generated on demand during beam traing.
-         */
-        root->child[1] = NULL;
-        root->child[2] = NULL;
-        root->child[3] = NULL;
+    if (bvh->precision == RI_ACCEL_PRECISION_FLOAT) {
 
-        root->is_leaf = 1;
+        build_fp32_bvh( bvh );
 
-        return 0;
-    }
+    } else {
+
+        build_triangle4s( bvh );
 
+        tri2d_cache_init( &bvh->tri2d_cache, 3 * bvh->nleaves,
+                          g_beam_cache_size );
+    }
 
     /*
-     * 2. Bin edges of triangles.
+     * Costs.
      */
-    {
-        bin_triangle_edge(
-            &g_binbuf,
-            bmin,
-            bmax,
-            tri_bboxes + index_left, 
-            n);
-             
+    costs = (float *)ri_mem_alloc(sizeof(float) * bvh->nnodes);
 
-        find_cut_from_bin(
-            &cut_pos,
-            &cut_axis,
-            &g_binbuf,
-             bmin,
-             bmax,
-             n);
+    calc_node_costs( costs, bvh );
+
+    for (i = 0; i < bvh->nnodes; i++) {
+        if (old_index[i] >= 0) {
+            costs[i] = bvh->node_costs[old_index[i]];
+        }
     }
 
-    uint64_t i;
-    uint64_t ntris_left  = 0;
-    uint64_t ntris_right = n - 1;
+    ri_mem_free( bvh->node_costs );
+    bvh->node_costs = costs;
 
-    /*
-     * 3. Partition triangles into left and right.
-     * 
-     * bbox data is read from tri_bboxes_buf, then left-right separated
-     * bbox data is wrote to tri_bboxes.
-     */
-    {
-        memcpy(tri_bboxes_buf, tri_bboxes + index_left, sizeof(tri_bbox_t) * n);
+    ri_mem_free( old_index );
 
-        for (i = 0; i < n; i++) {
+    calc_bvh_nbytes( bvh );
 
-            if (tri_bboxes_buf[i].bmax[cut_axis] < cut_pos) {
+    bvh->stat_construction.ninner_nodes = bvh->nnodes;
+    bvh->stat_construction.nleaf_nodes  = bvh->nleaves;
+}
 
-                /* left   */
+/*
+ * 2D triangle cache.
+ *
+ * Projected triangles are created outside of the lock, then published to
+ * the slot under the shard lock. If another thread published the same
+ * projection in the meantime, ours is discarded. Users pin the entry with
+ * refcount, so eviction only unlinks a pinned entry and the last user
+ * frees it.
+ */
+static void
+tri2d_cache_init(
+    ri_bvh_tri2d_cache_t  *cache,
+    uint32_t               nslots,
+    uint64_t               budget)
+{
+    int i;
 
-                assert(ntris_left < n);
+    cache->slots  = (ri_bvh_tri2d_entry_t **)ri_mem_alloc(
+                        sizeof(ri_bvh_tri2d_entry_t *) * nslots);
+    memset( cache->slots, 0, sizeof(ri_bvh_tri2d_entry_t *) * nslots );
 
-                memcpy(tri_bboxes + index_left + ntris_left,
-                       tri_bboxes_buf + i,
-                       sizeof(tri_bbox_t));
+    cache->nslots = nslots;
+    cache->budget = budget;
 
-                ntris_left++;
-        
-            } else {
+    for (i = 0; i < RI_BVH_TRI2D_CACHE_NSHARDS; i++) {
 
-                /* right    */
+        ri_mutex_init( &cache->shards[i].lock );
 
-                assert(ntris_right < n);
+        cache->shards[i].head       = NULL;
+        cache->shards[i].tail       = NULL;
+        cache->shards[i].size       = 0;
+        cache->shards[i].nhits      = 0;
+        cache->shards[i].nmisses    = 0;
+        cache->shards[i].nevictions = 0;
+    }
+}
+
+/*
+ * Removes the entry from the slot and the LRU list. Frees it if nobody
+ * uses it. Must be called with the shard lock held.
+ */
+static void
+tri2d_cache_unlink(
+    ri_bvh_tri2d_cache_t  *cache,
+    ri_bvh_tri2d_shard_t  *shard,
+    ri_bvh_tri2d_entry_t  *entry)
+{
+    if (entry->prev) entry->prev->next = entry->next;
+    else             shard->head       = entry->next;
+
+    if (entry->next) entry->next->prev = entry->prev;
+    else             shard->tail       = entry->prev;
+
+    entry->prev   = NULL;
+    entry->next   = NULL;
+    entry->linked = 0;
+
+    cache->slots[entry->slot] = NULL;
+    shard->size -= entry->size;
+
+    if (entry->refcount == 0) {
+        ri_mem_free( entry );
+    }
+}
+
+/* Moves the entry to the head of the LRU list. */
+static void
+tri2d_cache_touch(
+    ri_bvh_tri2d_shard_t  *shard,
+    ri_bvh_tri2d_entry_t  *entry)
+{
+    if (shard->head == entry) return;
+
+    entry->prev->next = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else             shard->tail       = entry->prev;
+
+    entry->prev       = NULL;
+    entry->next       = shard->head;
+    shard->head->prev = entry;
+    shard->head       = entry;
+}
+
+static int
+tri2d_cache_match(
+    const ri_bvh_tri2d_entry_t *entry,
+    const ri_beam_t            *beam)
+{
+    return ((entry->d      == beam->d     ) &&
+            (entry->org[0] == beam->org[0]) &&
+            (entry->org[1] == beam->org[1]) &&
+            (entry->org[2] == beam->org[2]));
+}
+
+static ri_bvh_tri2d_entry_t *
+tri2d_cache_acquire(
+    ri_bvh_t              *bvh,
+    uint32_t               leaf,
+    const ri_beam_t       *beam)
+{
+    uint32_t              slot;
+    uint32_t              ntriangles;
+    uint64_t              size;
+    uint64_t              shard_budget;
+    ri_bvh_tri2d_cache_t *cache = &bvh->tri2d_cache;
+    ri_bvh_tri2d_shard_t *shard;
+    ri_bvh_tri2d_entry_t *entry;
+    ri_bvh_tri2d_entry_t *found;
+
+    slot  = 3 * leaf + beam->dominant_axis;
+    shard = &cache->shards[slot % RI_BVH_TRI2D_CACHE_NSHARDS];
+
+    assert( slot < cache->nslots );
+
+    /*
+     * 1. Lookup.
+     */
+    ri_mutex_lock( &shard->lock );
+
+    entry = cache->slots[slot];
+    if (entry && tri2d_cache_match( entry, beam )) {
+
+        entry->refcount++;
+        tri2d_cache_touch( shard, entry );
+        shard->nhits++;
+
+        ri_mutex_unlock( &shard->lock );
+
+        return entry;
+    }
+
+    shard->nmisses++;
+
+    ri_mutex_unlock( &shard->lock );
 
-                memcpy(tri_bboxes + index_left + ntris_right,
-                       tri_bboxes_buf + i,
-                       sizeof(tri_bbox_t));
+    /*
+     * 2. Project triangles outside of the lock.
+     */
+    ntriangles = bvh->leaves[leaf].ntriangles;
+    size       = sizeof(ri_bvh_tri2d_entry_t) +
+                 sizeof(ri_triangle2d_t) * ntriangles;
+
+    entry = (ri_bvh_tri2d_entry_t *)ri_mem_alloc( size );
+
+    entry->prev        = NULL;
+    entry->next        = NULL;
+    entry->slot        = slot;
+    entry->refcount    = 1;
+    entry->linked      = 0;
+    entry->org[0]      = beam->org[0];
+    entry->org[1]      = beam->org[1];
+    entry->org[2]      = beam->org[2];
+    entry->org[3]      = 0.0;
+    entry->d           = beam->d;
+    entry->size        = size;
+    entry->triangle2ds = (ri_triangle2d_t *)(entry + 1);
+
+    project_triangles( entry->triangle2ds,
+                       bvh,
+                       bvh->trirefs + bvh->leaves[leaf].offset,
+                       ntriangles,
+                       beam->dominant_axis,
+                       beam->d,
+                       entry->org );
 
-                ntris_right--;
+    /*
+     * 3. Publish. Prefer the one published by another thread.
+     */
+    ri_mutex_lock( &shard->lock );
 
-            }
+    found = cache->slots[slot];
+    if (found && tri2d_cache_match( found, beam )) {
 
-        }
+        found->refcount++;
+        tri2d_cache_touch( shard, found );
 
+        ri_mutex_unlock( &shard->lock );
 
-        if( ntris_left == 0 || ntris_left == n ) {
+        ri_mem_free( entry );
 
-            /* Couldn't partition bboxes into left and right.
-             * Force split at object median.
-             */
-            ntris_left = n / 2;
-            
-        }
+        return found;
+    }
 
+    if (found) {
+        /* Projected with another beam origin. Replace it. */
+        tri2d_cache_unlink( cache, shard, found );
     }
 
+    entry->linked       = 1;
+    entry->next         = shard->head;
+    if (shard->head) shard->head->prev = entry;
+    shard->head         = entry;
+    if (shard->tail == NULL) shard->tail = entry;
+
+    cache->slots[slot]  = entry;
+    shard->size        += size;
 
     /*
-     * 4. Subdivide.
+     * 4. Evict least recently used entries while the shard is over budget.
+     *    The entry just published may also be evicted when the budget is
+     *    too small. It is then freed at tri2d_cache_release().
      */
-    {
-        ri_vector_t     bmin_left ,  bmax_left;
-        ri_vector_t     bmin_right,  bmax_right;
-        ri_qbvh_node_t *node_left , *node_right;
+    shard_budget = cache->budget / RI_BVH_TRI2D_CACHE_NSHARDS;
 
-        node_left      = ri_qbvh_node_new();
-        root->child[0] = node_left;
+    while ((shard->size > shard_budget) && shard->tail) {
 
-        node_right     = ri_qbvh_node_new();
-        root->child[1] = node_right;
+        tri2d_cache_unlink( cache, shard, shard->tail );
+        shard->nevictions++;
+    }
 
-        root->axis0    = cut_axis;
+    ri_mutex_unlock( &shard->lock );
 
-        /*
-         * left
-         */
-        calc_bbox_of_triangles(
-            bmin_left,
-            bmax_left, 
-            tri_bboxes + index_left,
-            ntris_left);
+    return entry;
+}
 
-        /*
-         * Slightly extend bbox to avoid numeric error.
-         */
-        bbox_add_margin( bmin_left, bmax_left );
+static void
+tri2d_cache_release(
+    ri_bvh_tri2d_cache_t  *cache,
+    ri_bvh_tri2d_entry_t  *entry)
+{
+    ri_bvh_tri2d_shard_t *shard;
+    int                   unused;
 
-        root->bbox[BMIN_X0] = bmin_left[0];
-        root->bbox[BMIN_Y0] = bmin_left[1];
-        root->bbox[BMIN_Z0] = bmin_left[2];
-        root->bbox[BMAX_X0] = bmax_left[0];
-        root->bbox[BMAX_Y0] = bmax_left[1];
-        root->bbox[BMAX_Z0] = bmax_left[2];
+    shard = &cache->shards[entry->slot % RI_BVH_TRI2D_CACHE_NSHARDS];
 
-        bvh_construct( 
-            node_left,
-            bmin_left,
-            bmax_left,
-            triangles,
-            triangles_buf,
-            tri_bboxes,
-            tri_bboxes_buf,
-            index_left,
-            index_left + ntris_left);
+    ri_mutex_lock( &shard->lock );
 
+    entry->refcount--;
+    unused = ((entry->refcount == 0) && !entry->linked);
 
-        /*
-         * right
-         */
-        calc_bbox_of_triangles(
-            bmin_right,
-            bmax_right, 
-            tri_bboxes + index_left + ntris_left,
-            n - ntris_left);
+    ri_mutex_unlock( &shard->lock );
 
-        bbox_add_margin( bmin_right, bmax_right );
+    if (unused) {
+        ri_mem_free( entry );
+    }
+}
+
+/*
+ * Drops all entries. Entries still in use are freed by their last user.
+ */
+static void
+tri2d_cache_clear(
+    ri_bvh_tri2d_cache_t  *cache)
+{
+    int                   i;
+    ri_bvh_tri2d_shard_t *shard;
 
-        root->bbox[BMIN_X1] = bmin_right[0];
-        root->bbox[BMIN_Y1] = bmin_right[1];
-        root->bbox[BMIN_Z1] = bmin_right[2];
-        root->bbox[BMAX_X1] = bmax_right[0];
-        root->bbox[BMAX_Y1] = bmax_right[1];
-        root->bbox[BMAX_Z1] = bmax_right[2];
+    for (i = 0; i < RI_BVH_TRI2D_CACHE_NSHARDS; i++) {
 
-        bvh_construct( 
-            node_right,
-            bmin_right,
-            bmax_right,
-            triangles,
-            triangles_buf,
-            tri_bboxes,
-            tri_bboxes_buf,
-            index_left + ntris_left,
-            index_right);
+        shard = &cache->shards[i];
 
-    }
+        ri_mutex_lock( &shard->lock );
 
-    return 0;   /* OK */
+        while (shard->head) {
+            tri2d_cache_unlink( cache, shard, shard->head );
+        }
+
+        ri_mutex_unlock( &shard->lock );
+    }
 }
 
+static void
+tri2d_cache_free(
+    ri_bvh_tri2d_cache_t  *cache)
+{
+    int      i;
+    uint64_t nhits      = 0;
+    uint64_t nmisses    = 0;
+    uint64_t nevictions = 0;
+
+    tri2d_cache_clear( cache );
+
+    for (i = 0; i < RI_BVH_TRI2D_CACHE_NSHARDS; i++) {
+        nhits      += cache->shards[i].nhits;
+        nmisses    += cache->shards[i].nmisses;
+        nevictions += cache->shards[i].nevictions;
+    }
+
+    if (nhits + nmisses > 0) {
+        ri_log(LOG_INFO, "(BVH   ) Beam cache: hits = %llu, misses = %llu, "
+                         "evictions = %llu",
+            (unsigned long long)nhits,
+            (unsigned long long)nmisses,
+            (unsigned long long)nevictions);
+    }
 
+    ri_mem_free( cache->slots );
+}
 
 /*
  * Record the edge of triangle into the bin buffer.
@@ -1640,8 +5801,8 @@ bin_triangle_edge(
          *  q[i] = (int)(p[i] - scene_bmin) / scene_size
          */
 
-        vcpy(bmin, tri_bboxes[i].bmin);
-        vcpy(bmax, tri_bboxes[i].bmax);
+        vcpy3(bmin, tri_bboxes[i].bmin);
+        vcpy3(bmax, tri_bboxes[i].bmax);
 
 
         quantized_bmin[0] = (bmin[0] - scene_bmin[0]) * scene_invsize[0];
@@ -1691,6 +5852,101 @@ bin_triangle_edge(
 
 }
 
+/*
+ * Split [0, n) into njobs ranges and run func on each range. jobs[0] is
+ * processed in the calling thread, others are processed by worker threads.
+ */
+static void
+bvh_run_range_jobs(
+    bvh_range_job_t   *jobs,            /* [inout] */
+    int                njobs,
+    uint64_t           n,
+    void            *(*func)(void *))
+{
+    int          i;
+    ri_thread_t  threads[RI_MAX_THREADS];
+
+    assert(njobs > 0);
+    assert(njobs <= RI_MAX_THREADS);
+
+    for (i = 0; i < njobs; i++) {
+        jobs[i].begin = (n * i) / njobs;
+        jobs[i].end   = (n * (i + 1)) / njobs;
+    }
+
+    for (i = 1; i < njobs; i++) {
+        ri_thread_create( &threads[i], func, &jobs[i] );
+    }
+
+    func( &jobs[0] );
+
+    for (i = 1; i < njobs; i++) {
+        ri_thread_join( &threads[i] );
+    }
+}
+
+static void *
+bin_triangle_edge_job_func(void *arg)
+{
+    bvh_range_job_t *job = (bvh_range_job_t *)arg;
+
+    bin_triangle_edge(
+        &job->binbuf,
+        job->scene_bmin,
+        job->scene_bmax,
+        job->bin_tri_bboxes + job->begin,
+        job->end - job->begin);
+
+    return NULL;
+}
+
+/*
+ * Data-parallel version of bin_triangle_edge(). Each thread bins its own
+ * range of triangles into a private bin buffer, then bin counts are
+ * summed up. The result is identical to bin_triangle_edge().
+ */
+int 
+bin_triangle_edge_parallel(
+    bvh_bin_buffer_t  *binbuf,          /* [inout] */
+    const ri_vector_t  scene_bmin,
+    const ri_vector_t  scene_bmax,
+    const tri_bbox_t  *tri_bboxes,
+    uint64_t           ntriangles,
+    int                nthreads)
+{
+    int              i, j, k, t;
+    bvh_range_job_t *jobs;
+
+    jobs = (bvh_range_job_t *)ri_mem_alloc(sizeof(bvh_range_job_t) *
+                                           nthreads);
+    memset(jobs, 0, sizeof(bvh_range_job_t) * nthreads);
+
+    for (t = 0; t < nthreads; t++) {
+        jobs[t].scene_bmin     = scene_bmin;
+        jobs[t].scene_bmax     = scene_bmax;
+        jobs[t].bin_tri_bboxes = tri_bboxes;
+    }
+
+    bvh_run_range_jobs( jobs, nthreads, ntriangles,
+                        bin_triangle_edge_job_func );
+
+    memset(binbuf, 0, sizeof(bvh_bin_buffer_t));
+
+    for (t = 0; t < nthreads; t++) {
+        for (i = 0; i < 2; i++) {
+            for (j = 0; j < 3; j++) {
+                for (k = 0; k < BVH_BIN_SIZE; k++) {
+                    binbuf->bin[i][j][k] += jobs[t].binbuf.bin[i][j][k];
+                }
+            }
+        }
+    }
+
+    ri_mem_free( jobs );
+
+    return 0;   /* OK */
+}
+
 /*
  * Add margin for bbox to avoid numeric problem.
  */
@@ -1731,22 +5987,73 @@ bbox_add_margin(
 }
 
 /*
- * Create an array of triangles and its bbox from the list of geometory.
+ * Fill bboxes of triangles and their references in the range [begin, end).
+ */
+static void *
+create_triangle_list_job_func(void *arg)
+{
+    bvh_range_job_t *job = (bvh_range_job_t *)arg;
+
+    uint32_t     g;
+    uint64_t     i;
+    uint64_t     idx;
+    ri_geom_t   *geom;
+
+    if (job->begin >= job->end) return NULL;
+
+    /*
+     * Find the geometry which contains the first triangle of the range.
+     */
+    g = 0;
+    while (job->geom_offsets[g + 1] <= job->begin) g++;
+
+    for (idx = job->begin; idx < job->end; idx++) {
+
+        while (job->geom_offsets[g + 1] <= idx) g++;
+
+        geom = job->geoms[g];
+        i    = idx - job->geom_offsets[g];
+
+        get_bbox_of_triangle( job->tri_bboxes[idx].bmin,
+                              job->tri_bboxes[idx].bmax,
+                              geom->positions[geom->indices[3 * i + 0]],
+                              geom->positions[geom->indices[3 * i + 1]],
+                              geom->positions[geom->indices[3 * i + 2]] );
+
+        assert( i < 0x100000000ULL );
+        job->tri_bboxes[idx].geom_id = g;
+        job->tri_bboxes[idx].index   = (uint32_t)i;
+
+    }
+
+    return NULL;
+}
+
+/*
+ * Create an array of triangle bboxes and their references from the list of
+ * geometory. geoms_out receives the table of geometries which
+ * tri_bbox_t::geom_id indexes.
  */
 void
 create_triangle_list(
-    ri_triangle_t    **triangles_out,       /* [out] */
     tri_bbox_t       **tri_bboxes_out,      /* [out] */
     uint64_t          *ntriangles,          /* [out] */
-    const ri_list_t   *geom_list)
+    ri_geom_t       ***geoms_out,           /* [out] */
+    uint32_t          *ngeoms_out,          /* [out] */
+    const ri_list_t   *geom_list,
+    int                nthreads)
 {
-    uint32_t     i;
-    ri_vector_t  v[3];
-    ri_list_t   *itr;
-    ri_geom_t   *geom;
+    uint32_t         i;
+    ri_list_t       *itr;
+    ri_geom_t       *geom;
 
-    uint64_t     n = 0;
-    uint64_t     idx;
+    uint64_t         n = 0;
+    uint32_t         ngeoms = 0;
+
+    ri_geom_t      **geoms;
+    uint64_t        *geom_offsets;
+    bvh_range_job_t *jobs;
+    int              njobs;
 
     assert(geom_list != NULL);
 
@@ -1763,6 +6070,7 @@ create_triangle_list(
         assert(geom != NULL);
 
         n += geom->nindices / 3;
+        ngeoms++;
 
     }
 
@@ -1770,28 +6078,29 @@ create_triangle_list(
 
         /* Empty scene */
 
-        (*triangles_out)  = NULL;
         (*tri_bboxes_out) = NULL;
         (*ntriangles)     = 0;
+        (*geoms_out)      = NULL;
+        (*ngeoms_out)     = 0;
 
         return;
     }
 
 
-    (*triangles_out)  = ri_mem_alloc(sizeof(ri_triangle_t) * n);
     (*tri_bboxes_out) = ri_mem_alloc(sizeof(tri_bbox_t) * n);
     (*ntriangles)     = n;
 
 
     /*
-     * Construct array of triangles and array of bbox of triangles.
+     * Flatten the geometry list so that the triangle index can be mapped
+     * to the geometry it belongs to.
+     * geom_offsets[i] is the index of the first triangle of geoms[i].
      */
+    geoms        = ri_mem_alloc(sizeof(ri_geom_t *) * ngeoms);
+    geom_offsets = ri_mem_alloc(sizeof(uint64_t) * (ngeoms + 1));
 
-    ri_vector_t bmin, bmax;
-
-    idx = 0;
-    vzero( bmin );
-    vzero( bmax );
+    i = 0;
+    geom_offsets[0] = 0;
 
     for (itr  = ri_list_first( (ri_list_t *)geom_list );
          itr != NULL;
@@ -1799,71 +6108,130 @@ create_triangle_list(
 
         geom = ( ri_geom_t * )itr->data;
 
-        for (i = 0; i < geom->nindices / 3; i++) {
+        geoms[i]            = geom;
+        geom_offsets[i + 1] = geom_offsets[i] + geom->nindices / 3;
+        i++;
+
+    }
+
 
-            vcpy(v[0], geom->positions[geom->indices[3 * i + 0]]);    
-            vcpy(v[1], geom->positions[geom->indices[3 * i + 1]]);    
-            vcpy(v[2], geom->positions[geom->indices[3 * i + 2]]);    
+    /*
+     * Construct array of bbox of triangles.
+     */
+
+    njobs = 1;
+    if (nthreads > 1 && n >= BVH_PARALLEL_LIST_MIN_TRIS) {
+        njobs = nthreads;
+    }
 
-            vcpy( (*triangles_out)[idx].v[0], v[0] );
-            vcpy( (*triangles_out)[idx].v[1], v[1] );
-            vcpy( (*triangles_out)[idx].v[2], v[2] );
+    jobs = (bvh_range_job_t *)ri_mem_alloc(sizeof(bvh_range_job_t) * njobs);
+    memset(jobs, 0, sizeof(bvh_range_job_t) * njobs);
 
-            (*triangles_out)[idx].geom  = geom;
-            (*triangles_out)[idx].index = 3 * i;
+    for (i = 0; i < (uint32_t)njobs; i++) {
+        jobs[i].geoms        = geoms;
+        jobs[i].geom_offsets = geom_offsets;
+        jobs[i].ngeoms       = ngeoms;
+        jobs[i].tri_bboxes   = (*tri_bboxes_out);
+    }
+
+    bvh_run_range_jobs( jobs, njobs, n, create_triangle_list_job_func );
 
-            get_bbox_of_triangle( bmin, bmax, &((*triangles_out)[idx]) );
+    ri_mem_free( jobs );
+    ri_mem_free( geom_offsets );
 
-            vcpy( (*tri_bboxes_out)[idx].bmin, bmin );
-            vcpy( (*tri_bboxes_out)[idx].bmax, bmax );
-            (*tri_bboxes_out)[idx].index = idx;
+    (*geoms_out)  = geoms;
+    (*ngeoms_out) = ngeoms;
+}
 
-            idx++;
 
-        }
+static void *
+calc_scene_bbox_job_func(void *arg)
+{
+    bvh_range_job_t *job = (bvh_range_job_t *)arg;
+
+    uint64_t i;
+
+    if (job->begin >= job->end) return NULL;
+
+    vcpy3( job->bmin, job->scene_tri_bboxes[job->begin].bmin );
+    vcpy3( job->bmax, job->scene_tri_bboxes[job->begin].bmax );
+
+    for (i = job->begin + 1; i < job->end; i++) {
+
+        vmin3( job->bmin, job->bmin, job->scene_tri_bboxes[i].bmin );
+        vmax3( job->bmax, job->bmax, job->scene_tri_bboxes[i].bmax );
 
     }
-}
 
+    return NULL;
+}
 
 static void
 calc_scene_bbox(
     ri_vector_t        bmin_out,        /* [out] */
     ri_vector_t        bmax_out,        /* [out] */
     const tri_bbox_t  *tri_bboxes,
-    uint64_t           ntriangles)
+    uint64_t           ntriangles,
+    int                nthreads)
 {
-    uint64_t i;
+    int              i;
+    int              njobs;
+    bvh_range_job_t *jobs;
 
     assert(tri_bboxes != NULL);
+    assert(ntriangles > 0);
+
+    njobs = 1;
+    if (nthreads > 1 && ntriangles >= BVH_PARALLEL_LIST_MIN_TRIS) {
+        njobs = nthreads;
+    }
 
-    vcpy( bmin_out, tri_bboxes[0].bmin );
-    vcpy( bmax_out, tri_bboxes[0].bmax );
+    jobs = (bvh_range_job_t *)ri_mem_alloc(sizeof(bvh_range_job_t) * njobs);
+    memset(jobs, 0, sizeof(bvh_range_job_t) * njobs);
 
-    for (i = 1; i < ntriangles; i++) {
+    for (i = 0; i < njobs; i++) {
+        jobs[i].scene_tri_bboxes = tri_bboxes;
+    }
+
+    bvh_run_range_jobs( jobs, njobs, ntriangles, calc_scene_bbox_job_func );
 
-        vmin( bmin_out, bmin_out, tri_bboxes[i].bmin );
-        vmax( bmax_out, bmax_out, tri_bboxes[i].bmax );
+    /*
+     * Reduce. min/max is order independent, thus the result is identical
+     * to the serial one.
+     */
+    vcpy( bmin_out, jobs[0].bmin );
+    vcpy( bmax_out, jobs[0].bmax );
+
+    for (i = 1; i < njobs; i++) {
+
+        if (jobs[i].begin >= jobs[i].end) continue;
+
+        vmin( bmin_out, bmin_out, jobs[i].bmin );
+        vmax( bmax_out, bmax_out, jobs[i].bmax );
 
     }
+
+    ri_mem_free( jobs );
 }
 
 
 static void
 get_bbox_of_triangle(
-    ri_vector_t           bmin_out,         /* [out] */  
-    ri_vector_t           bmax_out,         /* [out] */  
-    const ri_triangle_t  *triangle)
+    ri_float_t            bmin_out[3],      /* [out] */
+    ri_float_t            bmax_out[3],      /* [out] */
+    const ri_float_t     *v0,
+    const ri_float_t     *v1,
+    const ri_float_t     *v2)
 {
 
-    vcpy( bmin_out, triangle->v[0] );
-    vcpy( bmax_out, triangle->v[0] );
+    vcpy3( bmin_out, v0 );
+    vcpy3( bmax_out, v0 );
 
-    vmin( bmin_out, bmin_out, triangle->v[1] );
-    vmin( bmin_out, bmin_out, triangle->v[2] );
+    vmin3( bmin_out, bmin_out, v1 );
+    vmin3( bmin_out, bmin_out, v2 );
 
-    vmax( bmax_out, bmax_out, triangle->v[1] );
-    vmax( bmax_out, bmax_out, triangle->v[2] );
+    vmax3( bmax_out, bmax_out, v1 );
+    vmax3( bmax_out, bmax_out, v2 );
 
 }
 
@@ -1879,41 +6247,19 @@ calc_bbox_of_triangles(
     ri_vector_t bmin;
     ri_vector_t bmax;
 
-    vcpy( bmin, tri_bboxes[0].bmin );
-    vcpy( bmax, tri_bboxes[0].bmax );
+    vcpy3( bmin, tri_bboxes[0].bmin );
+    vcpy3( bmax, tri_bboxes[0].bmax );
 
     for (i = 1; i < ntriangles; i++) {
 
-        vmin( bmin, bmin, tri_bboxes[i].bmin );
-        vmax( bmax, bmax, tri_bboxes[i].bmax );
+        vmin3( bmin, bmin, tri_bboxes[i].bmin );
+        vmax3( bmax, bmax, tri_bboxes[i].bmax );
 
     }
 
-    vcpy( bmin_out, bmin );
-    vcpy( bmax_out, bmax );
-
-}
-
-int
-gather_triangles(
-    ri_triangle_t       *triangles_to_out,    /* [out]    */
-    const ri_triangle_t *triangles_from,
-    const tri_bbox_t    *tri_bboxes,
-    uint64_t             ntriangles)
-{
-    uint64_t i;
-    uint64_t j;
-
-    for (i = 0; i < ntriangles; i++) {
-
-        j = tri_bboxes[i].index;
-
-        memcpy( triangles_to_out + i, triangles_from + j, sizeof(ri_triangle_t));
-        
-
-    }
+    vcpy3( bmin_out, bmin );
+    vcpy3( bmax_out, bmax );
 
-    return 0;   /* OK */
 }
 
 #if 0   /* Future */
@@ -1925,7 +6271,7 @@ get_bbox_of_triangle4(
     ri_vector_t        bmaxx_out,        /* [out] */  
     ri_vector_t        bmaxy_out,        /* [out] */  
     ri_vector_t        bmaxz_out,        /* [out] */  
-    const triangle4_t *triangles)
+    const ri_triangle4_t *triangles)
 {
     vec bminx, bminy, bminz;
     vec bmaxx, bmaxy, bmaxz;
@@ -2089,39 +6435,35 @@ test_beam_aabb(
 }
 
 /*
- * 0 - no hit.
- * 1 - hit left node
- * 2 - hit right node
- * 3 - hit both
+ * Returns bit mask of children the beam hits. i'th bit for child[i].
  */
 int
 test_beam_node(
     const ri_qbvh_node_t *node,
     const ri_beam_t      *beam)
 {
-    ri_vector_t bmin_left , bmax_left;
-    ri_vector_t bmin_right, bmax_right;
+    int         i;
+    int         mask = 0;
+    ri_vector_t bmin, bmax;
 
-    bmin_left[0]  = node->bbox[ BMIN_X0 ];
-    bmin_left[1]  = node->bbox[ BMIN_Y0 ];
-    bmin_left[2]  = node->bbox[ BMIN_Z0 ];
-    bmax_left[0]  = node->bbox[ BMAX_X0 ];
-    bmax_left[1]  = node->bbox[ BMAX_Y0 ];
-    bmax_left[2]  = node->bbox[ BMAX_Z0 ];
-
-    bmin_right[0] = node->bbox[ BMIN_X1 ];
-    bmin_right[1] = node->bbox[ BMIN_Y1 ];
-    bmin_right[2] = node->bbox[ BMIN_Z1 ];
-    bmax_right[0] = node->bbox[ BMAX_X1 ];
-    bmax_right[1] = node->bbox[ BMAX_Y1 ];
-    bmax_right[2] = node->bbox[ BMAX_Z1 ];
-    
-    int hit_left, hit_right;
+    for (i = 0; i < 4; i++) {
+
+        if (RI_QBVH_IS_EMPTY(node->child[i])) continue;
+
+        bmin[0] = node->bbox[ BMIN_X0 + i ];
+        bmin[1] = node->bbox[ BMIN_Y0 + i ];
+        bmin[2] = node->bbox[ BMIN_Z0 + i ];
+        bmax[0] = node->bbox[ BMAX_X0 + i ];
+        bmax[1] = node->bbox[ BMAX_Y0 + i ];
+        bmax[2] = node->bbox[ BMAX_Z0 + i ];
+
+        if (test_beam_aabb( bmin, bmax, beam )) {
+            mask |= (1 << i);
+        }
 
-    hit_left  = test_beam_aabb( bmin_left , bmax_left , beam );
-    hit_right = test_beam_aabb( bmin_right, bmax_right, beam );
+    }
 
-    return hit_left | (hit_right << 1);
+    return mask;
 
 }
 
@@ -2315,15 +6657,19 @@ test_triangle2d_beam2d_cull_x(
 int
 bvh_intersect_leaf_node_beam(
     ri_raster_plane_t       *plane_inout,
-    ri_qbvh_node_t          *node,
+    ri_bvh_t                *bvh,
+    uint32_t                 leaf,          /* leaf index */
     ri_beam_t               *beam )
 {
     uint32_t         tid;
     uint32_t         i;
     uint32_t         ntriangles;
-    ri_triangle_t   *triangles;
+    ri_triangle_t    triangle;
     ri_triangle2d_t *triangle2ds;
 
+    const ri_bvh_triref_t *refs;
+    ri_bvh_tri2d_entry_t  *entry;
+
     (void)plane_inout;
 
     /*
@@ -2331,46 +6677,20 @@ bvh_intersect_leaf_node_beam(
      */
     tid    = 0;
 
-    ntriangles = *((uint32_t *)&node->bbox[0]);
-    triangles  = (ri_triangle_t *)node->child[0];
+    ntriangles = bvh->leaves[leaf].ntriangles;
+    refs       = bvh->trirefs + bvh->leaves[leaf].offset;
 
     /*
-     * Firstly, check if it is the first time visiting to this node.
-     * This is determined whether child[1:3] is NULL or not.
-     * If NULL, it is the first time, so we create list of 2d projected
-     * triangles.
+     * Get 2D projected triangles of the leaf. They are created at the
+     * first visit and pinned until tri2d_cache_release().
      */
-    triangle2ds = (ri_triangle2d_t *)node->child[beam->dominant_axis + 1];
-    if (triangle2ds == NULL) {
-
-        printf("proj: %p, n = %d\n", &node->child[beam->dominant_axis + 1], ntriangles);
-
-        triangle2ds = ri_mem_alloc(sizeof(ri_triangle2d_t) * ntriangles);
-        
-        project_triangles( triangle2ds,
-                           triangles,
-                           ntriangles,
-                           beam->dominant_axis,
-                           beam->d,
-                           beam->org );
-
-        /*
-         * TODO: sort triangles in its projectd size.
-         */
-
-        node->child[beam->dominant_axis + 1] = (ri_qbvh_node_t *)triangle2ds;
-
-        printf("node set: %p\n", node->child[beam->dominant_axis + 1]);
-    }
+    entry       = tri2d_cache_acquire( bvh, leaf, beam );
+    triangle2ds = entry->triangle2ds;
 
 #ifdef RI_BVH_ENABLE_DIAGNOSTICS
     if (gdiag) gdiag->ntriangle_isects++;
 #endif
 
-#ifdef RI_BVH_TRACE_STATISTICS
-    g_stattrav.ntested_triangles += ntriangles;
-#endif
-
     {
         int         j;
         int         nhit_beams;
@@ -2380,15 +6700,18 @@ bvh_intersect_leaf_node_beam(
         ri_beam_t   outer_beams[8];
         ri_beam_t   inner_beams[8];
         ri_beam_t   hit_beams[8];
+        ri_beam_t   miss_beams[8];
 
         for (i = 0; i < ntriangles; i++) {
 
             ri_beam_clip_by_triangle2d(
-                &hit_beams[0], &g_miss_beams[0],
+                &hit_beams[0], &miss_beams[0],
                 &nhit_beams, &nmiss_beams,
                 &triangle2ds[i], beam);
 
-            printf("hit beams = %d, miss beams = %d\n", nhit_beams, nmiss_beams);
+            if (nhit_beams > 0) {
+                bvh_get_triangle( &triangle, bvh, &refs[i] );
+            }
 
             /*
              * Raster hit beam
@@ -2396,7 +6719,7 @@ bvh_intersect_leaf_node_beam(
             for (j = 0; j < nhit_beams; j++) {
 
                 // Provide unprojectd(3D) triangle.
-                ri_rasterize_beam( plane_inout, &hit_beams[j], &triangles[i]);
+                ri_rasterize_beam( plane_inout, &hit_beams[j], &triangle);
                     
             }
 
@@ -2404,6 +6727,8 @@ bvh_intersect_leaf_node_beam(
 
     }
 
+    tri2d_cache_release( &bvh->tri2d_cache, entry );
+
 #if 0
         ret = test_beam_triangle( u, v, t, triangles + i, beam );
 
@@ -2434,63 +6759,30 @@ bvh_intersect_leaf_node_beam(
  */
 int
 bvh_intersect_leaf_node_beam_visibility(
-    ri_qbvh_node_t          *node,
+    const ri_bvh_t          *bvh,
+    uint32_t                 leaf,          /* leaf index */
     ri_beam_t               *beam )
 {
     uint32_t         tid;
     uint32_t         i;
     uint32_t         ntriangles;
-    ri_triangle_t   *triangles;
+    ri_triangle_t    triangle;
     ri_triangle2d_t *triangle2ds;
 
+    const ri_bvh_triref_t *refs;
+
     /*
      * Init
      */
     tid    = 0;
 
-    ntriangles = *((uint32_t *)&node->bbox[0]);
-    triangles  = (ri_triangle_t *)node->child[0];
-
-#if 0   // TODO: remove
-
-    /*
-     * Firstly, check if it is the first time visiting to this node.
-     * This is determined whether child[1:3] is NULL or not.
-     * If NULL, it is the first time, so we create list of 2d projected
-     * triangles.
-     */
-    triangle2ds = (ri_triangle2d_t *)node->child[beam->dominant_axis + 1];
-    if (triangle2ds == NULL) {
-
-        printf("proj: %p, n = %d\n", &node->child[beam->dominant_axis + 1], ntriangles);
-
-        triangle2ds = ri_mem_alloc(sizeof(ri_triangle2d_t) * ntriangles);
-        
-        project_triangles( triangle2ds,
-                           triangles,
-                           ntriangles,
-                           beam->dominant_axis,
-                           beam->d,
-                           beam->org );
-
-        /*
-         * TODO: sort triangles in its projectd size.
-         */
-
-        node->child[beam->dominant_axis + 1] = (ri_qbvh_node_t *)triangle2ds;
-
-        printf("node set: %p\n", node->child[beam->dominant_axis + 1]);
-    }
-#endif
+    ntriangles = bvh->leaves[leaf].ntriangles;
+    refs       = bvh->trirefs + bvh->leaves[leaf].offset;
 
 #ifdef RI_BVH_ENABLE_DIAGNOSTICS
     if (gdiag) gdiag->ntriangle_isects++;
 #endif
 
-#ifdef RI_BVH_TRACE_STATISTICS
-    g_stattrav.ntested_triangles += ntriangles;
-#endif
-
     {
 
         int             ret;
@@ -2507,9 +6799,11 @@ bvh_intersect_leaf_node_beam_visibility(
 
         for (i = 0; i < ntriangles; i++) {
 
+            bvh_get_triangle( &triangle, bvh, &refs[i] );
+
             ret = test_beam_triangle(
                         u, v, t,
-                        &triangles[i],
+                        &triangle,
                         beam);
 
             if ((ret == RI_BEAM_HIT_COMPLETELY) ||
@@ -2547,17 +6841,19 @@ bvh_intersect_leaf_node_beam_visibility(
 int
 bvh_traverse_beam(
     ri_raster_plane_t       *raster_inout,  /* [inout]      */
-    ri_qbvh_node_t          *root,
+    ri_bvh_t                *bvh,
     ri_bvh_diag_t           *diag,          /* [modified]   */
     ri_beam_t               *beam,
     bvh_stack_t             *stack )        /* [buffer]     */
 {
 
     ri_qbvh_node_t       *node;
-    int                   ret;
-    int                   order;            /* traversal order  */
+    uint32_t              ref;
+    int                   i;
+    int                   mask;
+    int                   order[4];         /* traversal order  */
 
-    assert( root != NULL );
+    assert( bvh->nodes != NULL );
 
 #ifdef RI_BVH_ENABLE_DIAGNOSTICS
     gdiag = diag;
@@ -2570,71 +6866,61 @@ bvh_traverse_beam(
             0,
             sizeof(ri_float_t) * raster_inout->width * raster_inout->height ); 
 
-    node = root;
+    ref = 0;                                /* root */
 
     while (1) {
 
-        if ( node->is_leaf ) {
+        if ( RI_QBVH_IS_LEAF(ref) ) {
 
 #ifdef RI_BVH_ENABLE_DIAGNOSTICS
             if (gdiag) gdiag->nleaf_node_traversals++;
 #endif
-#ifdef RI_BVH_TRACE_STATISTICS
-            g_stattrav.nleaf_node_traversals++;
-#endif
+            stack->nleaf++;
+            stack->ntris += bvh->leaves[RI_QBVH_LEAF_INDEX(ref)].ntriangles;
 
             bvh_intersect_leaf_node_beam( raster_inout,
-                                          node,
+                                          bvh,
+                                          RI_QBVH_LEAF_INDEX(ref),
                                           beam );
 
-            /* pop */
-            if (stack->depth < 1) goto end_traverse;
-            stack->depth--;
-            assert(stack->depth >= 0);
-            node = stack->nodestack[stack->depth];
-
         } else {
 
 #ifdef RI_BVH_ENABLE_DIAGNOSTICS
             if (gdiag) gdiag->ninner_node_traversals++;
 #endif
 
-#ifdef RI_BVH_TRACE_STATISTICS
-            g_stattrav.ninner_node_traversals++;
-#endif
-
-            ret = test_beam_node( node, beam );
+            stack->ninner++;
 
-            if (ret == 0) {
+            node = &bvh->nodes[ref];
 
-                /* pop */
-                if (stack->depth < 1) goto end_traverse;
-                stack->depth--;
-                assert(stack->depth >= 0);
-                node = stack->nodestack[stack->depth];
+            mask = test_beam_node( node, beam );
 
-            } else if (ret == 1) {
+            if (mask) {
 
-                node = node->child[0];
+                get_child_order( order, node->axis0, node->axis1,
+                                 node->axis2, beam->dirsign );
 
-            } else if (ret == 2) {
+                /* push hit children in far-to-near order */
+                for (i = 3; i >= 0; i--) {
 
-                node = node->child[1];
+                    if (mask & (1 << order[i])) {
 
-            } else {    /* both */
+                        stack->nodestack[stack->depth] = node->child[order[i]];
+                        stack->depth++;
+                        assert( stack->depth < BVH_STACK_SIZE );
 
-                order = beam->dirsign[beam->dominant_axis];
+                    }
+                }
 
-                /* push */
-                stack->nodestack[stack->depth] = node->child[1 - order];
-                stack->depth++;
-                assert( stack->depth < BVH_MAXDEPTH );
-                node = node->child[order];
-            
             }
 
         }
 
+        /* pop */
+        if (stack->depth < 1) goto end_traverse;
+        stack->depth--;
+        ref = stack->nodestack[stack->depth];
+
     }
     
 end_traverse:
@@ -2647,36 +6933,39 @@ end_traverse:
  */
 int
 bvh_traverse_beam_visibility(
-    ri_qbvh_node_t          *root,
+    const ri_bvh_t          *bvh,
     ri_bvh_diag_t           *diag,          /* [modified]   */
     ri_beam_t               *beam,
     bvh_stack_t             *stack )        /* [buffer]     */
 {
 
-    ri_qbvh_node_t       *node;
+    const ri_qbvh_node_t *node;
+    uint32_t              ref;
+    int                   i;
     int                   ret;
-    int                   order;            /* traversal order  */
+    int                   mask;
+    int                   order[4];         /* traversal order  */
 
-    assert( root != NULL );
+    assert( bvh->nodes != NULL );
 
 #ifdef RI_BVH_ENABLE_DIAGNOSTICS
     gdiag = diag;
 #endif
 
-    node = root;
+    ref = 0;                                /* root */
 
     while (1) {
 
-        if ( node->is_leaf ) {
+        if ( RI_QBVH_IS_LEAF(ref) ) {
 
 #ifdef RI_BVH_ENABLE_DIAGNOSTICS
             if (gdiag) gdiag->nleaf_node_traversals++;
 #endif
-#ifdef RI_BVH_TRACE_STATISTICS
-            g_stattrav.nleaf_node_traversals++;
-#endif
+            stack->nleaf++;
+            stack->ntris += bvh->leaves[RI_QBVH_LEAF_INDEX(ref)].ntriangles;
 
-            ret = bvh_intersect_leaf_node_beam_visibility( node, beam );
+            ret = bvh_intersect_leaf_node_beam_visibility(
+                    bvh, RI_QBVH_LEAF_INDEX(ref), beam );
 
             if ((ret == RI_BEAM_HIT_PARTIALLY) ||
                 (ret == RI_BEAM_HIT_COMPLETELY)) {
@@ -2686,60 +6975,47 @@ bvh_traverse_beam_visibility(
 
             }
 
-            /* pop */
-            if (stack->depth < 1) {
-                return RI_BEAM_MISS_COMPLETELY;
-            }
-
-            stack->depth--;
-            assert(stack->depth >= 0);
-            node = stack->nodestack[stack->depth];
-
         } else {
 
 #ifdef RI_BVH_ENABLE_DIAGNOSTICS
             if (gdiag) gdiag->ninner_node_traversals++;
 #endif
 
-#ifdef RI_BVH_TRACE_STATISTICS
-            g_stattrav.ninner_node_traversals++;
-#endif
-
-            ret = test_beam_node( node, beam );
+            stack->ninner++;
 
-            if (ret == 0) {
-
-                /* pop */
-                if (stack->depth < 1) {
-                    return RI_BEAM_MISS_COMPLETELY;
-                }
+            node = &bvh->nodes[ref];
 
-                stack->depth--;
-                assert(stack->depth >= 0);
-                node = stack->nodestack[stack->depth];
+            mask = test_beam_node( node, beam );
 
-            } else if (ret == 1) {
+            if (mask) {
 
-                node = node->child[0];
+                get_child_order( order, node->axis0, node->axis1,
+                                 node->axis2, beam->dirsign );
 
-            } else if (ret == 2) {
+                /* push hit children in far-to-near order */
+                for (i = 3; i >= 0; i--) {
 
-                node = node->child[1];
+                    if (mask & (1 << order[i])) {
 
-            } else {    /* both */
+                        stack->nodestack[stack->depth] = node->child[order[i]];
+                        stack->depth++;
+                        assert( stack->depth < BVH_STACK_SIZE );
 
-                order = beam->dirsign[beam->dominant_axis];
+                    }
+                }
 
-                /* push */
-                stack->nodestack[stack->depth] = node->child[1 - order];
-                stack->depth++;
-                assert( stack->depth < BVH_MAXDEPTH );
-                node = node->child[order];
-            
             }
 
         }
 
+        /* pop */
+        if (stack->depth < 1) {
+            return RI_BEAM_MISS_COMPLETELY;
+        }
+
+        stack->depth--;
+        ref = stack->nodestack[stack->depth];
+
     }
     
     return RI_BEAM_MISS_COMPLETELY;
@@ -2751,7 +7027,8 @@ bvh_traverse_beam_visibility(
 void
 project_triangles(
           ri_triangle2d_t *tri2d_out,      /* [out]                */
-    const ri_triangle_t   *triangles,      /* [in]                 */
+    const ri_bvh_t        *bvh,
+    const ri_bvh_triref_t *refs,           /* [in]                 */
           uint32_t         ntriangles,
           int              axis,
           ri_float_t       d,              /* distant to the plane         */
@@ -2766,15 +7043,16 @@ project_triangles(
         { 0.0, 1.0, 0.0 },              /* y    */
         { 0.0, 0.0, 1.0 } };            /* z    */
 
-    uint32_t    i, j;
-    ri_vector_t n;
-    ri_vector_t vo;
-    ri_float_t  t;
-    ri_float_t  k;
+    uint32_t      i, j;
+    ri_vector_t   n;
+    ri_vector_t   vo;
+    ri_float_t    t;
+    ri_float_t    k;
+    ri_triangle_t tri;
 
     assert( axis < 3 );
     assert( ntriangles > 0 );
-    assert( triangles != NULL );
+    assert( refs != NULL );
     assert( tri2d_out != NULL );
 
 
@@ -2783,6 +7061,8 @@ project_triangles(
 
     for (i = 0; i < ntriangles; i++) {
 
+        bvh_get_triangle( &tri, bvh, &refs[i] );
+
         /*
          * pv = prjected point of triangle's vertex P.
          * pv = O + vO * (d / (vO . N))
@@ -2790,7 +7070,7 @@ project_triangles(
 
         for (j = 0; j < 3; j++) {
 
-            vsub( vo, triangles[i].v[j], org );
+            vsub( vo, tri.v[j], org );
 
             t = vdot( vo, n );
 
@@ -2802,13 +7082,13 @@ project_triangles(
 
             //tri2d_out[i].v[j][0] = org[uv[axis][0]] + k * vo[uv[axis][0]];
             //tri2d_out[i].v[j][1] = org[uv[axis][1]] + k * vo[uv[axis][1]];
-            tri2d_out[i].v[j][0] = k * triangles[i].v[j][uv[axis][0]];
-            tri2d_out[i].v[j][1] = k * triangles[i].v[j][uv[axis][1]];
+            tri2d_out[i].v[j][0] = k * tri.v[j][uv[axis][0]];
+            tri2d_out[i].v[j][1] = k * tri.v[j][uv[axis][1]];
 
             printf("tri[%d] v[%d] = %f, %f, %f\n",  i, j,
-                triangles[i].v[j][0],
-                triangles[i].v[j][1],
-                triangles[i].v[j][2]);
+                tri.v[j][0],
+                tri.v[j][1],
+                tri.v[j][2]);
 
             printf("tri[%d] pv[%d] = %f, %f\n",  i, j,
                 tri2d_out[i].v[j][0],
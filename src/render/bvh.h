@@ -13,18 +13,19 @@
  */
 
 //
-// TODO: SIMD(SSE) optimizatio for Bounding Volume Hierarcies construction and
-//       traversal.
+// TODO: SIMD(SSE) optimizatio for Bounding Volume Hierarcies construction.
 //
 
 #ifndef LUCILLE_BVH_H
 #define LUCILLE_BVH_H
 
 #include "vector.h"
+#include "list.h"
 #include "ray.h"
 #include "beam.h"
 #include "raster.h"
 #include "intersection_state.h"
+#include "thread.h"
 
 
 #ifdef __cplusplus
@@ -36,7 +37,6 @@ extern "C" {
  * Flags for (Visual) debugging.
  */
 //#define RI_BVH_ENABLE_DIAGNOSTICS
-//#define RI_BVH_TRACE_STATISTICS
 //#define RI_BVH_TRACE_BEAM_STATISTICS
 
 #define BMIN_X0    (0      )
@@ -64,11 +64,39 @@ extern "C" {
 #define BMAX_Z2    (12 + 10)
 #define BMAX_Z3    (12 + 11)
 
+/*
+ * SIMD mode of ray traversal.
+ */
+#define RI_BVH_SIMD_SCALAR  0
+#define RI_BVH_SIMD_SSE     1           /* SSE2                         */
+#define RI_BVH_SIMD_AVX     2           /* AVX. Selected by CPUID.      */
+
+
+/*
+ * Child reference of QBVH node.
+ *
+ *   RI_QBVH_EMPTY            : No child.
+ *   RI_QBVH_LEAF_FLAG | i    : Leaf. i is the index to ri_bvh_t::leaves.
+ *   i                        : Inner node. i is the offset to ri_bvh_t::nodes.
+ *
+ * RI_QBVH_EMPTY also has the leaf flag, thus test emptiness first.
+ */
+#define RI_QBVH_LEAF_FLAG        (0x80000000)
+#define RI_QBVH_EMPTY            (0xffffffff)
+#define RI_QBVH_IS_EMPTY(c)      ((c) == RI_QBVH_EMPTY)
+#define RI_QBVH_IS_LEAF(c)       ((c) & RI_QBVH_LEAF_FLAG)
+#define RI_QBVH_LEAF_INDEX(c)    ((c) & ~RI_QBVH_LEAF_FLAG)
+
+#define RI_QBVH_NODE_ALIGN       (64)
 
 /*
  * Struct: ri_qbvh_node_t
  *
  *   Structure for QBVH(Quad BVH) node
+ *
+ *   QBVH is made by collapsing 2 levels of binary BVH into 1 node.
+ *   axis0 is the split axis of the node, axis1 and axis2 are the split axes
+ *   of its left(child[0:1]) and right(child[2:3]) halves.
  */
 typedef struct _ri_qbvh_node_t {
 
@@ -84,14 +112,161 @@ typedef struct _ri_qbvh_node_t {
      */
 
     ri_float_t              bbox[4 * 3 * 2];
-    struct _ri_qbvh_node_t *child[4];         /* ptr to child node    
-                                               * TODO: make this offset
-                                               */
+    uint32_t                child[4];         /* child reference      */
     
-    int                     axis0, axis1, axis2;
-    int                     is_leaf;
+    int32_t                 axis0, axis1, axis2;
+
+    /* Pad to the multiple of cache line size. */
+    uint8_t                 pad[RI_QBVH_NODE_ALIGN -
+                                ((sizeof(ri_float_t) * 24 + 28) %
+                                 RI_QBVH_NODE_ALIGN)];
     
-} ri_qbvh_node_t;   /* 128 bytes. */
+} ri_qbvh_node_t;   /* 256 bytes(double), 128 bytes(float). */
+
+/*
+ * Struct: ri_qbvh_leaf_t
+ *
+ *   Leaf of QBVH. Triangles of the leaf are referenced by
+ *   ri_bvh_t::trirefs[offset, offset + ntriangles).
+ */
+typedef struct _ri_qbvh_leaf_t {
+
+    uint32_t                offset;
+    uint32_t                ntriangles;
+    uint32_t                triangle4_offset;   /* to ri_bvh_t::triangle4s */
+
+} ri_qbvh_leaf_t;
+
+/*
+ * Struct: ri_triangle4_t
+ *
+ *   4 triangles packed in SoA layout for SIMD ray-triangle intersection.
+ *   Unused slots are filled with degenerate triangles.
+ */
+typedef struct _ri_triangle4_t {
+
+    ri_vector_t p0x, p0y, p0z;          /* vertex 0         */
+    ri_vector_t e1x, e1y, e1z;          /* v1 - v0          */
+    ri_vector_t e2x, e2y, e2z;          /* v2 - v0          */
+
+} ri_triangle4_t;
+
+/*
+ * Struct: ri_qbvh_node32_t
+ *
+ *   QBVH node of the fp32 BVH(RI_ACCEL_PRECISION_FLOAT). Same layout as
+ *   ri_qbvh_node_t with single precision bbox, which is rounded outward
+ *   from the double precision bbox so that it always encloses the child.
+ */
+typedef struct _ri_qbvh_node32_t {
+
+    float                   bbox[4 * 3 * 2];
+    uint32_t                child[4];         /* child reference      */
+
+    int32_t                 axis0, axis1, axis2;
+
+    uint8_t                 pad[4];
+
+} ri_qbvh_node32_t;   /* 128 bytes. */
+
+/*
+ * Struct: ri_triangle4f_t
+ *
+ *   4 triangles of the fp32 BVH in SoA layout. Vertices are kept instead of
+ *   edges, since the watertight ray-triangle test works on vertices
+ *   relative to the ray origin.
+ */
+typedef struct _ri_triangle4f_t {
+
+    float p0x[4], p0y[4], p0z[4];       /* vertex 0         */
+    float p1x[4], p1y[4], p1z[4];       /* vertex 1         */
+    float p2x[4], p2y[4], p2z[4];       /* vertex 2         */
+
+} ri_triangle4f_t;
+
+/*
+ * Struct: ri_bvh_triref_t
+ *
+ *   Reference to the source triangle. Vertices are not copied into the
+ *   BVH but fetched from the geometry:
+ *
+ *     geom = ri_bvh_t::geoms[geom_id]
+ *     v[i] = geom->positions[geom->indices[3 * index + i]]
+ */
+typedef struct _ri_bvh_triref_t {
+
+    uint32_t                geom_id;        /* index to ri_bvh_t::geoms */
+    uint32_t                index;          /* primitive index          */
+
+} ri_bvh_triref_t;   /* 8 bytes. */
+
+/*
+ * Default memory budget of the 2D triangle cache for beam tracing.
+ * Can be changed with ri_bvh_set_beam_cache_size().
+ */
+#define RI_BVH_TRI2D_CACHE_SIZE_DEFAULT   (64 * 1024 * 1024)
+#define RI_BVH_TRI2D_CACHE_NSHARDS        (64)
+
+/*
+ * Struct: ri_bvh_tri2d_entry_t
+ *
+ *   Projected triangles of a leaf for one dominant axis. The projection
+ *   depends on the beam origin and the distance to the projection plane,
+ *   thus they are kept as the key of the entry.
+ *   triangle2ds[] is allocated right after this header.
+ */
+typedef struct _ri_bvh_tri2d_entry_t {
+
+    struct _ri_bvh_tri2d_entry_t *prev, *next;  /* LRU list of the shard */
+
+    uint32_t                slot;           /* 3 * leaf_index + axis    */
+    int                     refcount;       /* # of users. Not evicted
+                                             * while > 0                */
+    int                     linked;         /* in the slot & LRU list?  */
+
+    ri_vector_t             org;            /* key                      */
+    ri_float_t              d;              /* key                      */
+
+    uint64_t                size;           /* in bytes                 */
+    ri_triangle2d_t        *triangle2ds;
+
+} ri_bvh_tri2d_entry_t;
+
+/*
+ * Struct: ri_bvh_tri2d_shard_t
+ *
+ *   Slots are distributed to shards by (slot % NSHARDS). Each shard has
+ *   its own lock, LRU list and the share of the memory budget.
+ */
+typedef struct _ri_bvh_tri2d_shard_t {
+
+    ri_mutex_t              lock;
+
+    ri_bvh_tri2d_entry_t   *head;           /* most recently used       */
+    ri_bvh_tri2d_entry_t   *tail;           /* least recently used      */
+    uint64_t                size;
+
+    uint64_t                nhits;
+    uint64_t                nmisses;
+    uint64_t                nevictions;
+
+} ri_bvh_tri2d_shard_t;
+
+/*
+ * Struct: ri_bvh_tri2d_cache_t
+ *
+ *   Bounded cache of 2D projected triangles for beam tracing.
+ */
+typedef struct _ri_bvh_tri2d_cache_t {
+
+    ri_bvh_tri2d_entry_t  **slots;          /* [3 * nleaves]            */
+    uint32_t                nslots;
+
+    uint64_t                budget;         /* in bytes                 */
+
+    ri_bvh_tri2d_shard_t    shards[RI_BVH_TRI2D_CACHE_NSHARDS];
+
+} ri_bvh_tri2d_cache_t;
 
 /*
  * Struct: ri_bvh_diag_t
@@ -171,13 +346,66 @@ typedef struct _ri_bvh_t {
      */
     int                         empty;
 
+    /*
+     * RI_ACCEL_PRECISION_DOUBLE or RI_ACCEL_PRECISION_FLOAT.
+     * The fp32 BVH uses nodes32 and triangle4fs instead of nodes and
+     * triangle4s, which are NULL.
+     */
+    int                         precision;
+
     /*
      * Scene bounding box
      */
     ri_vector_t                 bmin;
     ri_vector_t                 bmax;
 
-    ri_qbvh_node_t              *root;
+    /*
+     * Nodes are stored in one 64-byte aligned array in depth-first order.
+     * nodes[0] is the root.
+     */
+    ri_qbvh_node_t              *nodes;
+    uint32_t                     nnodes;
+
+    ri_qbvh_leaf_t              *leaves;
+    uint32_t                     nleaves;
+
+    /*
+     * Triangle references sorted by leaf, and the geometries they refer.
+     */
+    ri_bvh_triref_t             *trirefs;
+    uint64_t                     ntriangles;
+
+    ri_geom_t                  **geoms;
+    uint32_t                     ngeoms;
+
+    /*
+     * Triangles of each leaf packed into groups of 4 for SIMD traversal.
+     * NULL if SIMD is not available.
+     */
+    ri_triangle4_t              *triangle4s;
+    uint32_t                     ntriangle4s;
+
+    /*
+     * fp32 BVH. leaves[i].triangle4_offset indexes triangle4fs.
+     */
+    ri_qbvh_node32_t            *nodes32;
+    ri_triangle4f_t             *triangle4fs;
+    uint32_t                     ntriangle4fs;
+
+    uint64_t                     nbytes;        /* memory of the BVH */
+
+    /*
+     * SAH cost of each node normalized by the area of the node, recorded
+     * when the node is built. Compared with the cost of the refitted node
+     * to find degraded subtrees(see ri_bvh_update()).
+     */
+    float                       *node_costs;
+
+    /*
+     * Cache of 2D projected triangles for beam tracing.
+     * Indexed by 3 * leaf_index + axis. Created on demand.
+     */
+    ri_bvh_tri2d_cache_t         tri2d_cache;
 
     /*
      * Statistics
@@ -193,13 +421,67 @@ typedef struct _ri_bvh_t {
  */
 extern void *ri_bvh_build         (const void                    *data);
 extern void  ri_bvh_free          (      void                    *arg);
+
+/*
+ * Builds a BVH over the given list of geometries rather than the scene.
+ * Used for prototypes of object instancing(see instance.h).
+ */
+extern void *ri_bvh_build_geoms   (const ri_list_t               *geom_list);
+
+/*
+ * Updates the BVH to the geometries of the scene `data' for the next frame.
+ * Geometries are matched to those of the last frame by order. Boxes of
+ * deformed geometries are refitted, and subtrees whose SAH cost grew over
+ * the "accel_rebuild_threshold" option are rebuilt. Returns -1 if the
+ * topology is changed or most of the BVH is degraded, which requires a
+ * full rebuild.
+ */
+extern int   ri_bvh_update        (      void                    *accel,
+                                   const void                    *data);
 extern void  ri_bvh_invalidate_cache
                                   (      void                    *data);
 extern int   ri_bvh_intersect     (      void                    *accel,
                                          ri_ray_t                *ray,
                                          ri_intersection_state_t *state_out,
                                          void                    *user);
+extern int   ri_bvh_occluded      (      void                    *accel,
+                                         ri_ray_t                *ray,
+                                         ri_float_t               tmin,
+                                         ri_float_t               tmax,
+                                         void                    *user);
+
+/*
+ * Updates the nearest hit in `state_inout' only if some triangle is hit
+ * closer than state_inout->t. Unlike ri_bvh_intersect(), `state_inout' is
+ * not initialized and intersection state is not built, thus hits of
+ * several BVHs can be merged(e.g. instances sharing the ray parameter t).
+ * Returns 1 if the hit is updated.
+ */
+extern int   ri_bvh_intersect_nearest(
+                                         void                    *accel,
+                                         ri_ray_t                *ray,
+                                         ri_intersection_state_t *state_inout);
+
+/*
+ * Packet traversal. Returns the bit mask of rays which hit.
+ */
+extern uint32_t ri_bvh_intersect_packet(
+                                         void                    *accel,
+                                         ri_ray_packet_t         *packet,
+                                         ri_intersection_state_t *states_out,
+                                         void                    *user);
+extern uint32_t ri_bvh_occluded_packet(
+                                         void                    *accel,
+                                         ri_ray_packet_t         *packet,
+                                         ri_float_t               tmin,
+                                         ri_float_t               tmax,
+                                         void                    *user);
 
+/*
+ * Beam queries are not supported by the fp32 BVH. ri_bvh_intersect_beam()
+ * reports no hit, and ri_bvh_intersect_beam_visibility() reports
+ * RI_BEAM_HIT_PARTIALLY so that the caller falls back to rays.
+ */
 extern int   ri_bvh_intersect_beam(      void                    *accel,
                                          ri_beam_t               *beam,
                                          ri_raster_plane_t       *raster_out,
@@ -220,6 +502,20 @@ extern int   ri_bvh_intersect_beam_visibility(
                                          ri_beam_t               *beam,
                                          void                    *user);
 
+/*
+ * SIMD mode control. ri_bvh_set_simd_mode() falls back to the fastest mode
+ * supported by the running processor if the requested one is not supported.
+ */
+extern int   ri_bvh_get_simd_mode ();
+extern void  ri_bvh_set_simd_mode (      int                      mode);
+
+/*
+ * Memory budget(in bytes) of the 2D triangle cache for beam tracing.
+ * Applied to BVHs built after the call.
+ */
+extern void  ri_bvh_set_beam_cache_size(
+                                         uint64_t                 size);
+
 /*
  * Debug
  */
@@ -0,0 +1,618 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Frame checkpoint for resuming an interrupted render.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "memory.h"
+#include "log.h"
+#include "atomic.h"
+#include "checkpoint.h"
+
+#define CHECKPOINT_ALIGN    64
+
+static void *writer_thread_func(void *arg);
+static void  checkpoint_write  (ri_checkpoint_t *checkpoint);
+
+static uint64_t
+align_offset(uint64_t offset)
+{
+    return (offset + CHECKPOINT_ALIGN - 1) & ~((uint64_t)CHECKPOINT_ALIGN - 1);
+}
+
+/*
+ * Writes `size' bytes of `data' at `offset', filling the gap with zeros.
+ */
+static int
+write_section(
+    FILE            *fp,
+    uint64_t        *pos,               /* [inout] */
+    uint64_t         offset,
+    const void      *data,
+    size_t           size)
+{
+    static const char zeros[CHECKPOINT_ALIGN] = { 0 };
+
+    if (offset == 0) return 0;
+
+    assert(offset >= (*pos));
+    assert(offset - (*pos) <= CHECKPOINT_ALIGN);
+
+    if (fwrite(zeros, 1, (size_t)(offset - (*pos)), fp) !=
+        (size_t)(offset - (*pos))) {
+        return -1;
+    }
+
+    if (fwrite(data, 1, size, fp) != size) return -1;
+
+    (*pos) = offset + size;
+
+    return 0;
+}
+
+static int
+read_section(
+    FILE            *fp,
+    uint64_t         offset,
+    void            *data,
+    size_t           size)
+{
+    if (offset == 0) return -1;
+
+    if (fseek(fp, (long)offset, SEEK_SET) != 0) return -1;
+
+    if (fread(data, 1, size, fp) != size) return -1;
+
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ *
+ * Public functions
+ *
+ * ------------------------------------------------------------------------ */
+
+ri_checkpoint_t *
+ri_checkpoint_new(
+    const char      *path,
+    int              width,
+    int              height,
+    uint64_t         signature,
+    int              progressive,
+    double           interval)
+{
+    int                     npixels;
+    uint64_t                offset;
+    ri_checkpoint_t        *p;
+    ri_checkpoint_header_t *header;
+
+    assert(sizeof(ri_checkpoint_header_t) == 128);
+
+    p = (ri_checkpoint_t *)ri_mem_alloc(sizeof(ri_checkpoint_t));
+    memset(p, 0, sizeof(ri_checkpoint_t));
+
+    p->path    = strdup(path);
+    p->tmppath = (char *)ri_mem_alloc(strlen(path) + 5);
+    strcpy(p->tmppath, path);
+    strcat(p->tmppath, ".tmp");
+
+    npixels    = width * height;
+    p->npixels = npixels;
+
+    header = &p->header;
+
+    memcpy(header->magic, RI_CHECKPOINT_MAGIC, 8);
+    header->version   = RI_CHECKPOINT_VERSION;
+    header->flags     = progressive ? RI_CHECKPOINT_PROGRESSIVE : 0;
+    header->width     = width;
+    header->height    = height;
+    header->signature = signature;
+    header->pass      = -1;
+
+    /*
+     * Layout the arrays.
+     */
+    offset = sizeof(ri_checkpoint_header_t);
+
+    if (progressive) {
+
+        header->radiance_offset = offset = align_offset(offset);
+        offset += sizeof(double) * 3 * npixels;
+        header->lumsum_offset   = offset = align_offset(offset);
+        offset += sizeof(double) * npixels;
+        header->lumsqsum_offset = offset = align_offset(offset);
+        offset += sizeof(double) * npixels;
+        header->nsamples_offset = offset = align_offset(offset);
+        offset += sizeof(int32_t) * npixels;
+
+        p->radiance = (double *)ri_mem_alloc(sizeof(double) * 3 * npixels);
+        p->lumsum   = (double *)ri_mem_alloc(sizeof(double) * npixels);
+        p->lumsqsum = (double *)ri_mem_alloc(sizeof(double) * npixels);
+        p->nsamples = (int32_t *)ri_mem_alloc(sizeof(int32_t) * npixels);
+
+        memset(p->radiance, 0, sizeof(double) * 3 * npixels);
+        memset(p->lumsum,   0, sizeof(double) * npixels);
+        memset(p->lumsqsum, 0, sizeof(double) * npixels);
+        memset(p->nsamples, 0, sizeof(int32_t) * npixels);
+
+    } else {
+
+        header->done_offset   = offset = align_offset(offset);
+        offset += sizeof(uint8_t) * npixels;
+        header->pixels_offset = offset = align_offset(offset);
+        offset += sizeof(float) * 3 * npixels;
+
+        p->done          = (uint8_t *)ri_mem_alloc(npixels);
+        p->done_snapshot = (uint8_t *)ri_mem_alloc(npixels);
+        p->pixels        = (float *)ri_mem_alloc(sizeof(float) * 3 * npixels);
+
+        memset(p->done,   0, npixels);
+        memset(p->pixels, 0, sizeof(float) * 3 * npixels);
+    }
+
+    header->size = offset;
+
+    p->interval   = interval;
+    p->last_write = time(NULL);
+
+    p->mutex = ri_mutex_new();
+    ri_mutex_init(p->mutex);
+    p->cond  = ri_thread_cond_new();
+    ri_thread_cond_init(p->cond);
+
+    /*
+     * Without thread support, the frame is written by the caller of
+     * ri_checkpoint_request().
+     */
+    if (ri_thread_supported()) {
+        ri_thread_create(&p->thread, writer_thread_func, p);
+        p->threaded = 1;
+    }
+
+    return p;
+}
+
+int
+ri_checkpoint_load(
+    ri_checkpoint_t *checkpoint)
+{
+    int                     n;
+    int                     ok;
+    FILE                   *fp;
+    ri_checkpoint_header_t  header;
+    ri_checkpoint_header_t *expected;
+
+    expected = &checkpoint->header;
+    n        = checkpoint->npixels;
+
+    fp = fopen(checkpoint->path, "rb");
+    if (!fp) return 0;
+
+    if (fread(&header, sizeof(ri_checkpoint_header_t), 1, fp) != 1) {
+        fclose(fp);
+        return 0;
+    }
+
+    if ((memcmp(header.magic, RI_CHECKPOINT_MAGIC, 8) != 0) ||
+        (header.version   != expected->version)             ||
+        (header.flags     != expected->flags)               ||
+        (header.width     != expected->width)               ||
+        (header.height    != expected->height)              ||
+        (header.signature != expected->signature)) {
+
+        ri_log(LOG_WARN, "(Checkpoint) \"%s\" was saved for another frame. "
+               "Ignored.", checkpoint->path);
+        fclose(fp);
+        return 0;
+    }
+
+    if (header.flags & RI_CHECKPOINT_PROGRESSIVE) {
+
+        ok = (read_section(fp, header.radiance_offset, checkpoint->radiance,
+                           sizeof(double) * 3 * n) == 0) &&
+             (read_section(fp, header.lumsum_offset, checkpoint->lumsum,
+                           sizeof(double) * n) == 0) &&
+             (read_section(fp, header.lumsqsum_offset, checkpoint->lumsqsum,
+                           sizeof(double) * n) == 0) &&
+             (read_section(fp, header.nsamples_offset, checkpoint->nsamples,
+                           sizeof(int32_t) * n) == 0);
+
+        if (ok) {
+            expected->pass           = header.pass;
+            expected->nsamples_pass  = header.nsamples_pass;
+            expected->nsamples_total = header.nsamples_total;
+        }
+
+    } else {
+
+        ok = (read_section(fp, header.done_offset, checkpoint->done,
+                           n) == 0) &&
+             (read_section(fp, header.pixels_offset, checkpoint->pixels,
+                           sizeof(float) * 3 * n) == 0);
+
+        if (!ok) memset(checkpoint->done, 0, n);
+    }
+
+    fclose(fp);
+
+    if (!ok) {
+        ri_log(LOG_WARN, "(Checkpoint) \"%s\" is truncated. Ignored.",
+               checkpoint->path);
+    }
+
+    return ok;
+}
+
+int
+ri_checkpoint_region_done(
+    const ri_checkpoint_t *checkpoint,
+    int              x,
+    int              y,
+    int              w,
+    int              h)
+{
+    int i, j;
+    int width;
+
+    if (checkpoint->done == NULL) return 0;
+
+    width = checkpoint->header.width;
+
+    for (j = y; j < y + h; j++) {
+        for (i = x; i < x + w; i++) {
+            if (!checkpoint->done[j * width + i]) return 0;
+        }
+    }
+
+    return 1;
+}
+
+void
+ri_checkpoint_put_region(
+    ri_checkpoint_t *checkpoint,
+    int              x,
+    int              y,
+    int              w,
+    int              h,
+    const ri_vector_t *pixels)
+{
+    int    i, j;
+    int    idx;
+    int    width;
+    float *dst;
+
+    if (checkpoint->done == NULL) return;
+
+    width = checkpoint->header.width;
+
+    for (j = 0; j < h; j++) {
+        for (i = 0; i < w; i++) {
+
+            idx = (y + j) * width + (x + i);
+            dst = &checkpoint->pixels[3 * idx];
+
+            dst[0] = (float)pixels[j * w + i][0];
+            dst[1] = (float)pixels[j * w + i][1];
+            dst[2] = (float)pixels[j * w + i][2];
+        }
+    }
+
+    /*
+     * Pixels must be visible to the writer before the done flags.
+     */
+    ri_atomic_fence();
+
+    for (j = y; j < y + h; j++) {
+        memset(&checkpoint->done[j * width + x], 1, w);
+    }
+}
+
+int
+ri_checkpoint_put_progressive(
+    ri_checkpoint_t *checkpoint,
+    int              pass,
+    int              nsamples_pass,
+    uint64_t         nsamples_total,
+    const ri_vector_t *radiance,
+    const ri_float_t *lumsum,
+    const ri_float_t *lumsqsum,
+    const int       *nsamples)
+{
+    int i;
+
+    if (checkpoint->radiance == NULL) return 0;
+
+    /*
+     * The previous state is still being written. Skip this one rather than
+     * holding another copy of the frame. The check and the copy are done
+     * under the lock, so that the writer never starts on a half copied
+     * state.
+     */
+    ri_mutex_lock(checkpoint->mutex);
+
+    if (checkpoint->busy || checkpoint->request) {
+        ri_mutex_unlock(checkpoint->mutex);
+        return 0;
+    }
+
+    for (i = 0; i < checkpoint->npixels; i++) {
+        checkpoint->radiance[3 * i + 0] = radiance[i][0];
+        checkpoint->radiance[3 * i + 1] = radiance[i][1];
+        checkpoint->radiance[3 * i + 2] = radiance[i][2];
+        checkpoint->lumsum[i]           = lumsum[i];
+        checkpoint->lumsqsum[i]         = lumsqsum[i];
+        checkpoint->nsamples[i]         = nsamples[i];
+    }
+
+    checkpoint->header.pass           = pass;
+    checkpoint->header.nsamples_pass  = nsamples_pass;
+    checkpoint->header.nsamples_total = nsamples_total;
+
+    ri_mutex_unlock(checkpoint->mutex);
+
+    ri_checkpoint_request(checkpoint);
+
+    return 1;
+}
+
+void
+ri_checkpoint_get_progressive(
+    const ri_checkpoint_t *checkpoint,
+    ri_vector_t     *radiance,
+    ri_float_t      *lumsum,
+    ri_float_t      *lumsqsum,
+    int             *nsamples)
+{
+    int i;
+
+    assert(checkpoint->radiance != NULL);
+
+    for (i = 0; i < checkpoint->npixels; i++) {
+        radiance[i][0] = checkpoint->radiance[3 * i + 0];
+        radiance[i][1] = checkpoint->radiance[3 * i + 1];
+        radiance[i][2] = checkpoint->radiance[3 * i + 2];
+        radiance[i][3] = 0.0;
+        lumsum[i]      = checkpoint->lumsum[i];
+        lumsqsum[i]    = checkpoint->lumsqsum[i];
+        nsamples[i]    = checkpoint->nsamples[i];
+    }
+}
+
+int
+ri_checkpoint_due(
+    const ri_checkpoint_t *checkpoint)
+{
+    return (difftime(time(NULL), checkpoint->last_write) >=
+            checkpoint->interval);
+}
+
+void
+ri_checkpoint_request(
+    ri_checkpoint_t *checkpoint)
+{
+    checkpoint->last_write = time(NULL);
+
+    if (!checkpoint->threaded) {
+        checkpoint_write(checkpoint);
+        return;
+    }
+
+    ri_mutex_lock(checkpoint->mutex);
+
+    checkpoint->request = 1;
+    ri_thread_cond_signal(checkpoint->cond);
+
+    ri_mutex_unlock(checkpoint->mutex);
+}
+
+void
+ri_checkpoint_finish(
+    ri_checkpoint_t *checkpoint,
+    int              complete)
+{
+    if (checkpoint->threaded) {
+
+        ri_mutex_lock(checkpoint->mutex);
+
+        checkpoint->quit = 1;
+        ri_thread_cond_signal(checkpoint->cond);
+
+        ri_mutex_unlock(checkpoint->mutex);
+
+        ri_thread_join(&checkpoint->thread);
+        checkpoint->threaded = 0;
+    }
+
+    if (complete) {
+
+        remove(checkpoint->path);
+
+    } else {
+
+        checkpoint_write(checkpoint);
+        ri_log(LOG_INFO, "(Checkpoint) Saved unfinished frame to \"%s\"",
+               checkpoint->path);
+    }
+}
+
+void
+ri_checkpoint_free(
+    ri_checkpoint_t *checkpoint)
+{
+    assert(!checkpoint->threaded);
+
+    ri_mem_free(checkpoint->done);
+    ri_mem_free(checkpoint->done_snapshot);
+    ri_mem_free(checkpoint->pixels);
+    ri_mem_free(checkpoint->radiance);
+    ri_mem_free(checkpoint->lumsum);
+    ri_mem_free(checkpoint->lumsqsum);
+    ri_mem_free(checkpoint->nsamples);
+
+    ri_thread_cond_free(checkpoint->cond);
+    ri_mutex_free(checkpoint->mutex);
+
+    free(checkpoint->path);
+    ri_mem_free(checkpoint->tmppath);
+
+    ri_mem_free(checkpoint);
+}
+
+uint64_t
+ri_checkpoint_hash(
+    uint64_t         hash,
+    const void      *data,
+    int              size)
+{
+    int            i;
+    const uint8_t *p = (const uint8_t *)data;
+
+    for (i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/* ---------------------------------------------------------------------------
+ *
+ * Private functions
+ *
+ * ------------------------------------------------------------------------ */
+
+/*
+ * Saves the frame to the temporary file and renames it to the checkpoint
+ * file.
+ */
+static void
+checkpoint_write(
+    ri_checkpoint_t *checkpoint)
+{
+    int                     n;
+    int                     err;
+    uint64_t                pos;
+    FILE                   *fp;
+    ri_checkpoint_header_t *header;
+
+    header = &checkpoint->header;
+    n      = checkpoint->npixels;
+
+    /*
+     * Only finished pixels are meaningful. Take the done flags first, then
+     * their pixels are never changed while being written.
+     */
+    if (checkpoint->done) {
+        memcpy(checkpoint->done_snapshot, checkpoint->done, n);
+        ri_atomic_fence();
+    }
+
+    fp = fopen(checkpoint->tmppath, "wb");
+    if (!fp) {
+        if (!checkpoint->failed) {
+            ri_log(LOG_WARN, "(Checkpoint) Can't open \"%s\"",
+                   checkpoint->tmppath);
+            checkpoint->failed = 1;
+        }
+        return;
+    }
+
+    err = 0;
+    pos = sizeof(ri_checkpoint_header_t);
+
+    if (fwrite(header, sizeof(ri_checkpoint_header_t), 1, fp) != 1) err = 1;
+
+    if (!err && (header->flags & RI_CHECKPOINT_PROGRESSIVE)) {
+
+        err = write_section(fp, &pos, header->radiance_offset,
+                            checkpoint->radiance, sizeof(double) * 3 * n) ||
+              write_section(fp, &pos, header->lumsum_offset,
+                            checkpoint->lumsum, sizeof(double) * n)       ||
+              write_section(fp, &pos, header->lumsqsum_offset,
+                            checkpoint->lumsqsum, sizeof(double) * n)     ||
+              write_section(fp, &pos, header->nsamples_offset,
+                            checkpoint->nsamples, sizeof(int32_t) * n);
+
+    } else if (!err) {
+
+        err = write_section(fp, &pos, header->done_offset,
+                            checkpoint->done_snapshot, n)                 ||
+              write_section(fp, &pos, header->pixels_offset,
+                            checkpoint->pixels, sizeof(float) * 3 * n);
+    }
+
+    if (fclose(fp) != 0) err = 1;
+
+    if (err) {
+        if (!checkpoint->failed) {
+            ri_log(LOG_WARN, "(Checkpoint) Failed to write \"%s\"",
+                   checkpoint->tmppath);
+            checkpoint->failed = 1;
+        }
+        remove(checkpoint->tmppath);
+        return;
+    }
+
+#ifdef WIN32
+    /* rename() does not replace an existing file on Windows. */
+    remove(checkpoint->path);
+#endif
+
+    if (rename(checkpoint->tmppath, checkpoint->path) != 0) {
+        if (!checkpoint->failed) {
+            ri_log(LOG_WARN, "(Checkpoint) Can't rename \"%s\" to \"%s\"",
+                   checkpoint->tmppath, checkpoint->path);
+            checkpoint->failed = 1;
+        }
+    }
+}
+
+static void *
+writer_thread_func(void *arg)
+{
+    ri_checkpoint_t *checkpoint;
+
+    checkpoint = (ri_checkpoint_t *)arg;
+
+    ri_mutex_lock(checkpoint->mutex);
+
+    while (1) {
+
+        while (!checkpoint->request && !checkpoint->quit) {
+            ri_thread_cond_wait(checkpoint->cond, checkpoint->mutex);
+        }
+
+        if (!checkpoint->request) break;    /* quit */
+
+        checkpoint->busy    = 1;
+        checkpoint->request = 0;
+
+        ri_mutex_unlock(checkpoint->mutex);
+
+        checkpoint_write(checkpoint);
+
+        ri_mutex_lock(checkpoint->mutex);
+
+        checkpoint->busy    = 0;
+    }
+
+    ri_mutex_unlock(checkpoint->mutex);
+
+    return NULL;
+}
@@ -0,0 +1,212 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Frame checkpoint for resuming an interrupted render.
+ *
+ * Render threads store finished buckets(or, in progressive mode, the main
+ * thread stores the accumulation state after a pass) into an in-memory
+ * frame. A writer thread saves the frame to the checkpoint file, so render
+ * threads never wait for the disk. Memory use is bounded by the frame
+ * size: a request is dropped while the writer is still busy.
+ *
+ * The file is written to `<path>.tmp' and renamed, so a crash never leaves
+ * a broken checkpoint. It consists of a 128 byte header followed by raw
+ * per pixel arrays at 64 byte aligned offsets recorded in the header, thus
+ * it can be mmap()'ed as is.
+ *
+ * $Id$
+ */
+
+#ifndef LUCILLE_CHECKPOINT_H
+#define LUCILLE_CHECKPOINT_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <time.h>
+
+#include "vector.h"
+#include "thread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RI_CHECKPOINT_MAGIC         "LUCICKPT"
+#define RI_CHECKPOINT_VERSION       1
+
+/* header flags */
+#define RI_CHECKPOINT_PROGRESSIVE   1
+
+typedef struct _ri_checkpoint_header_t {
+
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    flags;
+    uint32_t    width;
+    uint32_t    height;
+    uint64_t    signature;          /* identifies the scene and options */
+
+    /* progressive mode only */
+    int32_t     pass;               /* last finished pass               */
+    int32_t     nsamples_pass;      /* samples per pixel of the pass    */
+    uint64_t    nsamples_total;     /* samples taken so far             */
+
+    /* byte offsets of arrays from the top of the file. 0 = not present */
+    uint64_t    done_offset;        /* uint8_t [npixels]                */
+    uint64_t    pixels_offset;      /* float   [npixels][3]             */
+    uint64_t    radiance_offset;    /* double  [npixels][3]             */
+    uint64_t    lumsum_offset;      /* double  [npixels]                */
+    uint64_t    lumsqsum_offset;    /* double  [npixels]                */
+    uint64_t    nsamples_offset;    /* int32_t [npixels]                */
+    uint64_t    size;               /* file size                        */
+
+    uint8_t     pad[24];            /* pad to 128 bytes                 */
+
+} ri_checkpoint_header_t;
+
+typedef struct _ri_checkpoint_t {
+
+    char                   *path;
+    char                   *tmppath;
+
+    ri_checkpoint_header_t  header;
+    int                     npixels;
+
+    /*
+     * Frame. done/pixels are written by render threads, the others are
+     * the snapshot of the progressive accumulation state.
+     */
+    uint8_t                *done;       /* 1 if the pixel is finished   */
+    float                  *pixels;
+    double                 *radiance;
+    double                 *lumsum;
+    double                 *lumsqsum;
+    int32_t                *nsamples;
+
+    uint8_t                *done_snapshot;  /* done flags being written */
+
+    double                  interval;       /* in seconds               */
+    time_t                  last_write;
+
+    ri_thread_t             thread;
+    ri_mutex_t             *mutex;
+    ri_thread_cond_t       *cond;
+    int                     threaded;       /* has the writer thread?   */
+    volatile int            request;
+    volatile int            busy;
+    volatile int            quit;
+    int                     failed;         /* write error was reported */
+
+} ri_checkpoint_t;
+
+/*
+ * Creates a checkpoint for the frame of `width' x `height' and starts the
+ * writer thread. Nothing is written until the first request.
+ */
+extern ri_checkpoint_t *ri_checkpoint_new(
+    const char      *path,
+    int              width,
+    int              height,
+    uint64_t         signature,
+    int              progressive,
+    double           interval);
+
+/*
+ * Loads the checkpoint file if it was saved for the same frame.
+ * Returns 1 if the frame is restored, 0 if not.
+ */
+extern int  ri_checkpoint_load(
+    ri_checkpoint_t *checkpoint);                          /* [inout]  */
+
+/*
+ * Returns 1 if all pixels in the region are restored from the file.
+ */
+extern int  ri_checkpoint_region_done(
+    const ri_checkpoint_t *checkpoint,
+    int              x,
+    int              y,
+    int              w,
+    int              h);
+
+/*
+ * Stores finished pixels of the region. Called from render threads.
+ * Regions of threads must not overlap.
+ */
+extern void ri_checkpoint_put_region(
+    ri_checkpoint_t *checkpoint,                           /* [inout]  */
+    int              x,
+    int              y,
+    int              w,
+    int              h,
+    const ri_vector_t *pixels);
+
+/*
+ * Stores the progressive accumulation state and requests a write. The
+ * state is not copied if the writer is busy. Returns 1 if stored.
+ */
+extern int  ri_checkpoint_put_progressive(
+    ri_checkpoint_t *checkpoint,                           /* [inout]  */
+    int              pass,
+    int              nsamples_pass,
+    uint64_t         nsamples_total,
+    const ri_vector_t *radiance,
+    const ri_float_t *lumsum,
+    const ri_float_t *lumsqsum,
+    const int       *nsamples);
+
+/*
+ * Copies the restored progressive accumulation state.
+ */
+extern void ri_checkpoint_get_progressive(
+    const ri_checkpoint_t *checkpoint,
+    ri_vector_t     *radiance,                             /* [out]    */
+    ri_float_t      *lumsum,                               /* [out]    */
+    ri_float_t      *lumsqsum,                             /* [out]    */
+    int             *nsamples);                            /* [out]    */
+
+/*
+ * Returns 1 if `interval' seconds have passed since the last write.
+ */
+extern int  ri_checkpoint_due(
+    const ri_checkpoint_t *checkpoint);
+
+/*
+ * Asks the writer thread to save the frame. Never blocks on the disk.
+ */
+extern void ri_checkpoint_request(
+    ri_checkpoint_t *checkpoint);                          /* [inout]  */
+
+/*
+ * Stops the writer thread. If the frame is `complete', the checkpoint file
+ * is removed. Otherwise the frame is saved for the next run.
+ */
+extern void ri_checkpoint_finish(
+    ri_checkpoint_t *checkpoint,                           /* [inout]  */
+    int              complete);
+
+extern void ri_checkpoint_free(
+    ri_checkpoint_t *checkpoint);
+
+/*
+ * 64-bit FNV-1a hash to build the signature of the frame.
+ */
+extern uint64_t ri_checkpoint_hash(
+    uint64_t         hash,
+    const void      *data,
+    int              size);
+
+#define RI_CHECKPOINT_HASH_INIT     0xcbf29ce484222325ULL
+
+#ifdef __cplusplus
+}    /* extern "C" */
+#endif
+
+#endif    /* LUCILLE_CHECKPOINT_H */
@@ -22,6 +22,7 @@ ri_geom_new()
     p = ( ri_geom_t * )ri_mem_alloc( sizeof( ri_geom_t ) );
 
     p->positions            = NULL;
+    p->positions_close      = NULL;
     p->normals              = NULL;
     p->tangents             = NULL;
     p->binormals            = NULL;
@@ -62,6 +63,7 @@ ri_geom_free(
     if (geom) {
 
         ri_mem_free( geom->positions );
+        ri_mem_free( geom->positions_close );
         ri_mem_free( geom->normals );
         ri_mem_free( geom->tangents );
         ri_mem_free( geom->binormals );
@@ -350,3 +352,23 @@ ri_geom_area(
 
     return area;
 }
+
+void
+ri_geom_position_at(
+    ri_vector_t      p,
+    const ri_geom_t *geom,
+    unsigned int     i,
+    float            time )
+{
+    int k;
+
+    if (geom->positions_close == NULL) {
+        ri_vector_copy(p, geom->positions[i]);
+        return;
+    }
+
+    for (k = 0; k < 4; k++) {
+        p[k] = (1.0 - time) * geom->positions[i][k]
+             + time * geom->positions_close[i][k];
+    }
+}
@@ -29,6 +29,13 @@ struct _ri_light_t;
 typedef struct _ri_geom_t {
     ri_vector_t        *positions;  /* vertex position(P)                   */
     unsigned int        npositions;
+
+    /*
+     * Vertex positions at shutter close for motion blur, or NULL if the
+     * geometry does not move. `positions' holds the ones at shutter open,
+     * and a vertex moves linearly between them in the shutter interval.
+     */
+    ri_vector_t        *positions_close;
     ri_vector_t        *normals;    /* vertex normal(N)                     */
     unsigned int        nnormals;
     ri_vector_t        *tangents;   /* tangent vector                       */
@@ -133,6 +140,15 @@ extern void         ri_geom_add_indices(
 extern ri_float_t   ri_geom_area(
     ri_geom_t           *geom );
 
+/*
+ * Position of the i'th vertex at the shutter time `time'(see ri_ray_t).
+ */
+extern void         ri_geom_position_at(
+    ri_vector_t          p,             /* [out] */
+    const ri_geom_t     *geom,
+    unsigned int         i,
+    float                time );
+
 #ifdef __cplusplus
 }       /* extern "C" */
 #endif
@@ -11,16 +11,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
 
 #include "memory.h"
+#include "log.h"
 #include "vector.h"
 #include "ibl.h"
 #include "reflection.h"
 #include "random.h"
 #include "brdf.h"
 #include "qmc.h"
+#include "irradcache.h"
+#include "profile.h"
+#include "render.h"
 
 #ifndef M_PI
 #define M_PI 3.1415926535
@@ -39,8 +44,16 @@ typedef struct _histgram_t
 } histgram_t;
 
 static ri_float_t sinc(ri_float_t x);
-static void gen_qmc_samples(ri_float_t *samples,
-                int nsamples, int instancenum, int **perm);
+static void gen_qmc_sample(ri_float_t *sample,
+                int i, int instancenum, int **perm);
+static void angular_to_dir(ri_vector_t dir, ri_float_t *sinc_theta,
+                           ri_float_t u, ri_float_t v);
+static void dir_to_angular(ri_float_t *u, ri_float_t *v,
+                           const ri_vector_t dir);
+static ri_ibl_table_t *build_importance_table(const ri_texture_t *texture);
+static int load_sisfile(ri_ibl_table_t *table, const char *filename);
+static void trace_shadow_packet(ri_vector_t power, ri_ray_t *rays,
+                                ri_vector_t *weights, int n);
 
 /*
  * Cosine weighted sampling.
@@ -67,12 +80,11 @@ ri_ibl_sample_cosweight(
     ri_float_t dpower[3];
     ri_float_t theta, phi;
     ri_float_t brdf;
-    ri_float_t *samples;
+    ri_float_t sample[2];
     ri_vector_t rad;
     ri_vector_t dir;
     ri_vector_t basis[3];
     ri_ray_t r;
-    ri_intersection_state_t state;
     ri_option_t *opt;
     
 #if 0
@@ -106,14 +118,11 @@ ri_ibl_sample_cosweight(
 
     if (opt->use_qmc) {    /* quasi-Monte Carlo sampling */
 
-        samples = (ri_float_t *)ri_mem_alloc(sizeof(ri_float_t) * nsamples * 2);
-
-        gen_qmc_samples(samples,
-                nsamples, inray->i, ri_render_get()->perm_table);
-
         for (i = 0; i < nsamples; i++) {
-            theta = sqrt(samples[2 * i + 0]);
-            phi = 2.0 * M_PI * samples[2 * i + 1];        
+            gen_qmc_sample(sample, i, inray->i, ri_render_get()->perm_table);
+
+            theta = sqrt(sample[0]);
+            phi = 2.0 * M_PI * sample[1];        
             dir[0] = cos(phi) * theta;
             dir[1] = sin(phi) * theta;
             dir[2] = sqrt(1.0 - theta * theta);
@@ -126,8 +135,8 @@ ri_ibl_sample_cosweight(
 
             ri_vector_normalize(r.dir);
 
-            hit = ri_raytrace(ri_render_get(),
-                      &r, &state);
+            hit = ri_raytrace_occluded(ri_render_get(),
+                      &r, 0.0, RI_INFINITY);
 
             if (!hit) {
                 ri_texture_ibl_fetch(
@@ -147,11 +156,9 @@ ri_ibl_sample_cosweight(
             //hemi->rtotal += hemi->samples[i][j].r;
         }
 
-        power[0] = dpower[0] / (ri_float_t)nsamples;
-        power[1] = dpower[1] / (ri_float_t)nsamples;
-        power[2] = dpower[2] / (ri_float_t)nsamples;
-
-        ri_mem_free(samples);
+        power[0] = M_PI * dpower[0] / (ri_float_t)nsamples;
+        power[1] = M_PI * dpower[1] / (ri_float_t)nsamples;
+        power[2] = M_PI * dpower[2] / (ri_float_t)nsamples;
 
     } else {    /* Monte Carlo sampling */
         /* theta * phi = total samples.
@@ -192,8 +199,8 @@ ri_ibl_sample_cosweight(
 
                 ri_vector_normalize(r.dir);
 
-                hit = ri_raytrace(ri_render_get(),
-                          &r, &state);
+                hit = ri_raytrace_occluded(ri_render_get(),
+                          &r, 0.0, RI_INFINITY);
 
                 if (!hit) {
                     ri_texture_ibl_fetch(
@@ -227,6 +234,29 @@ ri_ibl_sample_cosweight(
 }
 
 
+/*
+ * Incident radiance from the dome light for the irradiance cache.
+ */
+static void
+domelight_radiance(
+    ri_vector_t                    L,
+    const ri_ray_t                *ray,
+    int                            hit,
+    const ri_intersection_state_t *state,
+    void                          *data)
+{
+    const ri_light_t *light = (const ri_light_t *)data;
+
+    (void)ray;
+    (void)state;
+
+    if (hit) {
+        ri_vector_setzero(L);
+    } else {
+        ri_vector_scale(L, light->col, (ri_float_t)light->intensity);
+    }
+}
+
 void
 ri_domelight_sample(
     ri_vector_t        power,           /* [out] */
@@ -244,12 +274,11 @@ ri_domelight_sample(
     ri_float_t theta, phi;
     ri_float_t brdf;
     ri_float_t  u, v;
-    ri_float_t *samples;
+    ri_float_t  sample[2];
     //ri_float_t *samplepoints;
     ri_vector_t rad;
     ri_vector_t dir;
     ri_ray_t r;
-    ri_intersection_state_t state;
     ri_option_t *opt;
 
     opt = ri_render_get()->context->option;
@@ -263,42 +292,49 @@ ri_domelight_sample(
 
     ri_ortho_basis(hemi->basis, hemi->basis[2]);
 
-    if (opt->use_qmc) {    /* quasi-Monte Carlo sampling */
+    if (ri_render_get()->irradcache) {
 
-        samples = (ri_float_t *)ri_mem_alloc(sizeof(ri_float_t) * nsamples * 2);
+        /*
+         * power = pi * (mean of radiance * brdf) = mean of radiance.
+         */
+        hemi->ntheta = (int)sqrt((ri_float_t)nsamples);
+        if (hemi->ntheta < 1) hemi->ntheta = 1;
+        hemi->nphi   = hemi->ntheta;
 
+        ri_irradcache_gather(ri_render_get()->irradcache, power, inray,
+                             pos, hemi->basis[2],
+                             hemi->ntheta, hemi->nphi,
+                             domelight_radiance, (void *)light);
 
+    } else if (opt->use_qmc) {    /* quasi-Monte Carlo sampling */
 
 #if 0 
         u = randomMT();
         v = randomMT();
 #endif
 
+        /* The offset is the same for all samples of this ray. */
+        u = generalized_scrambled_halton(
+                    inray->i, 0, inray->d,
+                    ri_render_get()->perm_table);
+        v = generalized_scrambled_halton(
+                    inray->i, 0, inray->d+1,
+                    ri_render_get()->perm_table);
+        (void)v;
+
         for (i = 0; i < nsamples; i++) {
-            samples[2 * i + 0] = generalized_scrambled_hammersley(
+            sample[0] = generalized_scrambled_hammersley(
                         i, 0, nsamples, 1,
                         ri_render_get()->perm_table);
-            samples[2 * i + 1] = generalized_scrambled_hammersley(
+            sample[1] = generalized_scrambled_hammersley(
                         i, 0, nsamples, 2,
                         ri_render_get()->perm_table);
 
-#if 1
-            u = generalized_scrambled_halton(
-                        inray->i, 0, inray->d,
-                        ri_render_get()->perm_table);
-            v = generalized_scrambled_halton(
-                        inray->i, 0, inray->d+1,
-                        ri_render_get()->perm_table);
+            sample[0] = mod_1(u + sample[0]);
+            sample[1] = mod_1(u + sample[1]);
 
-#endif
-
-            samples[2 * i + 0] = mod_1(u + samples[2 * i + 0]);
-            samples[2 * i + 1] = mod_1(u + samples[2 * i + 1]);
-        }
-
-        for (i = 0; i < nsamples; i++) {
-            theta = sqrt(samples[2 * i + 0]);
-            phi = 2.0 * M_PI * samples[2 * i + 1];        
+            theta = sqrt(sample[0]);
+            phi = 2.0 * M_PI * sample[1];        
             dir[0] = cos(phi) * theta;
             dir[1] = sin(phi) * theta;
             dir[2] = sqrt(1.0 - theta * theta);
@@ -311,8 +347,9 @@ ri_domelight_sample(
 
             ri_vector_normalize(r.dir);
 
-            hit = ri_raytrace(ri_render_get(),
-                      &r, &state);
+            hit = ri_raytrace_occluded(ri_render_get(),
+                      &r, 0.0, RI_INFINITY);
+            ri_prof_inc(RI_PROF_NHEMISPHERE_RAYS);
 
             if (!hit) {
                 ri_vector_copy(rad, light->col);
@@ -331,8 +368,6 @@ ri_domelight_sample(
         power[1] = M_PI * dpower[1] / (ri_float_t)nsamples;
         power[2] = M_PI * dpower[2] / (ri_float_t)nsamples;
 
-        ri_mem_free(samples);
-
     } else { /* Monte Carlo sampling, */
 
         /* theta * phi = total samples.
@@ -365,8 +400,9 @@ ri_domelight_sample(
 
                 ri_vector_normalize(r.dir);
 
-                hit = ri_raytrace(ri_render_get(),
-                          &r, &state);
+                hit = ri_raytrace_occluded(ri_render_get(),
+                          &r, 0.0, RI_INFINITY);
+                ri_prof_inc(RI_PROF_NHEMISPHERE_RAYS);
 
                 if (!hit) {
                     ri_vector_copy(rad, light->col);
@@ -413,7 +449,6 @@ ri_ibl_sample_bruteforce(
     ri_vector_t rad;
     ri_vector_t dist;
     ri_ray_t ray;
-    ri_intersection_state_t state;
 
     (void)eye;
     (void)nsamples;
@@ -484,7 +519,7 @@ ri_ibl_sample_bruteforce(
                 //domega = (2.0*M_PI/width)*(2.0*M_PI/width)*sinc(acos(y)) ;
 
 
-            hit = ri_raytrace(ri_render_get(), &ray, &state);
+            hit = ri_raytrace_occluded(ri_render_get(), &ray, 0.0, RI_INFINITY);
 
             if (!hit) {
                 ri_texture_ibl_fetch(
@@ -517,6 +552,404 @@ ri_ibl_sample_bruteforce(
     power[2] = dpower[2];
 }
 
+/*
+ * Builds the sampling table of the light. The structured importance
+ * sampling file is used if given, otherwise the luminance distribution of
+ * the IBL texture is tabulated.
+ */
+void
+ri_ibl_setup(ri_light_t *light)
+{
+    ri_ibl_table_t *table;
+
+    if (light->ibltable) return;    /* already built */
+    if (!light->texture) return;
+
+    if ((light->iblsampler == IBL_SAMPLING_STRUCTURED) && light->sisfile) {
+
+        table = (ri_ibl_table_t *)ri_mem_alloc(sizeof(ri_ibl_table_t));
+        memset(table, 0, sizeof(ri_ibl_table_t));
+
+        if (load_sisfile(table, light->sisfile) == 0) {
+            ri_log(LOG_INFO, "(IBL   ) Loaded %d SIS samples from [ %s ]\n",
+                   table->nsis, light->sisfile);
+            light->ibltable = table;
+            return;
+        }
+
+        ri_log(LOG_WARN, "(IBL   ) Can't read SIS file [ %s ]. "
+                         "Use importance sampling instead.\n",
+               light->sisfile);
+        ri_ibl_table_free(table);
+    }
+
+    if ((light->iblsampler == IBL_SAMPLING_IMPORTANCE) ||
+        (light->iblsampler == IBL_SAMPLING_STRUCTURED)) {
+
+        light->ibltable = build_importance_table(light->texture);
+
+        if (light->ibltable) {
+            ri_log(LOG_INFO, "(IBL   ) Built importance table of %d x %d\n",
+                   light->ibltable->width, light->ibltable->height);
+        }
+    }
+}
+
+void
+ri_ibl_table_free(ri_ibl_table_t *table)
+{
+    if (table == NULL) return;
+
+    ri_mem_free(table->func);
+    ri_mem_free(table->cdf);
+    ri_mem_free(table->marginal);
+    ri_mem_free(table->sisdir);
+    ri_mem_free(table->siscol);
+    ri_mem_free(table);
+}
+
+ri_float_t
+ri_ibl_table_sample(
+    ri_vector_t           dir,          /* [out] */
+    const ri_ibl_table_t *table,
+    ri_float_t            u0,
+    ri_float_t            u1)
+{
+    int          x, y;
+    int          lo, hi, mid;
+    ri_float_t   fx, fy;
+    ri_float_t   c0, c1;
+    ri_float_t   s;
+    ri_float_t   pdf;
+    const float *cdf;
+
+    if (table == NULL || table->func == NULL) return 0.0;
+
+    /*
+     * Invert the marginal CDF to choose a row, then the conditional CDF
+     * of the row to choose a column. Cells of zero probability have empty
+     * intervals and are never chosen.
+     */
+    lo = 0; hi = table->height;
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (table->marginal[mid] <= u0) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    y  = lo;
+    c0 = table->marginal[y];
+    c1 = table->marginal[y + 1];
+    fy = (c1 > c0) ? (u0 - c0) / (c1 - c0) : 0.5;
+
+    cdf = table->cdf + y * (table->width + 1);
+    lo = 0; hi = table->width;
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (cdf[mid] <= u1) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    x  = lo;
+    c0 = cdf[x];
+    c1 = cdf[x + 1];
+    fx = (c1 > c0) ? (u1 - c0) / (c1 - c0) : 0.5;
+
+    pdf = table->func[y * table->width + x];
+    if (pdf <= 0.0) return 0.0;
+
+    angular_to_dir(dir, &s,
+                   (x + fx) / (ri_float_t)table->width,
+                   (y + fy) / (ri_float_t)table->height);
+
+    if (s < 1.0e-6) return 0.0;     /* outside of the map, or the pole  */
+
+    /*
+     * Convert the PDF of the cell to the PDF over the solid angle.
+     * A cell of the angular map covers 4 / (width * height) of the unit
+     * disk, and d(omega) = pi^2 * sinc(theta) dx dy on the disk.
+     */
+    return pdf * table->width * table->height / (4.0 * M_PI * M_PI * s);
+}
+
+ri_float_t
+ri_ibl_table_pdf(
+    const ri_ibl_table_t *table,
+    const ri_vector_t     dir)
+{
+    int        x, y;
+    ri_float_t u, v;
+    ri_float_t s;
+    ri_float_t z;
+    ri_float_t pdf;
+
+    if (table == NULL || table->func == NULL) return 0.0;
+
+    dir_to_angular(&u, &v, dir);
+
+    x = (int)(u * table->width);
+    y = (int)(v * table->height);
+    if (x < 0) x = 0;
+    if (x >= table->width)  x = table->width  - 1;
+    if (y < 0) y = 0;
+    if (y >= table->height) y = table->height - 1;
+
+    pdf = table->func[y * table->width + x];
+    if (pdf <= 0.0) return 0.0;
+
+    z = dir[2];
+    if (z < -1.0) z = -1.0;
+    if (z >  1.0) z =  1.0;
+
+    s = sinc(acos(z));
+    if (s < 1.0e-6) return 0.0;
+
+    return pdf * table->width * table->height / (4.0 * M_PI * M_PI * s);
+}
+
+/*
+ * Importance sampling of the IBL texture.
+ * Half of the samples are drawn from the luminance distribution of the
+ * texture and the other half with cosine weighting, and both are combined
+ * with the power heuristic of multiple importance sampling. The former
+ * finds small bright sources such as the sun, and the latter handles
+ * directions near the horizon of the surface.
+ */
+void
+ri_ibl_sample_importance(
+    ri_vector_t        power,           /* [out] */
+    const ri_vector_t  normal,
+    int                nsamples,
+    const ri_ray_t    *inray,
+    const ri_vector_t  pos,
+    const ri_vector_t  eye,
+    const ri_light_t  *light)
+{
+    int          i, k;
+    int          n;
+    int          strategy;
+    int          nstrategy[2];
+    int          tid = inray->thread_num;
+    ri_float_t   u[2];
+    ri_float_t   cos_theta, phi;
+    ri_float_t   pdf_light, pdf_brdf;
+    ri_float_t   w;
+    ri_float_t   eps;
+    ri_vector_t  rad;
+    ri_vector_t  dir;
+    ri_vector_t  basis[3];
+    ri_ray_t     r;
+    ri_ray_t     rays[RI_RAY_PACKET_MAX];
+    ri_vector_t  weights[RI_RAY_PACKET_MAX];
+    ri_option_t *opt;
+
+    ri_vector_setzero(power);
+
+    if (light->ibltable == NULL || light->ibltable->func == NULL) {
+        ri_ibl_sample_cosweight(power, normal, nsamples, inray,
+                                pos, eye, light);
+        return;
+    }
+
+    opt = ri_render_get()->context->option;
+
+    ri_ray_copy(&r, inray);
+
+    /* slightly move the shading point towards the surface normal */
+    eps = 1.0e-5 * ri_render_get()->scene->maxwidth;
+    r.org[0] = pos[0] + normal[0] * eps;
+    r.org[1] = pos[1] + normal[1] * eps;
+    r.org[2] = pos[2] + normal[2] * eps;
+
+    r.thread_num = tid;
+
+    ri_ortho_basis(basis, normal);
+
+    nstrategy[0] = nsamples - nsamples / 2;         /* light    */
+    nstrategy[1] = nsamples / 2;                    /* BRDF     */
+
+    n = 0;
+
+    for (strategy = 0; strategy < 2; strategy++) {
+
+        for (i = 0; i < nstrategy[strategy]; i++) {
+
+            if (opt->use_qmc) {
+                u[0] = generalized_scrambled_halton(
+                           i, inray->i, 2 * strategy + 1,
+                           ri_render_get()->perm_table);
+                u[1] = generalized_scrambled_halton(
+                           i, inray->i, 2 * strategy + 2,
+                           ri_render_get()->perm_table);
+            } else {
+                /* stratify the first dimension */
+                u[0] = (i + randomMT2(tid)) / (ri_float_t)nstrategy[strategy];
+                u[1] = randomMT2(tid);
+            }
+
+            if (strategy == 0) {
+
+                pdf_light = ri_ibl_table_sample(r.dir, light->ibltable,
+                                                u[0], u[1]);
+                if (pdf_light <= 0.0) continue;
+
+                cos_theta = ri_vector_dot(r.dir, normal);
+                if (cos_theta <= 0.0) continue;
+
+            } else {
+
+                cos_theta = sqrt(u[0]);
+                phi       = 2.0 * M_PI * u[1];
+                dir[0]    = cos(phi) * cos_theta;
+                dir[1]    = sin(phi) * cos_theta;
+                dir[2]    = sqrt(1.0 - cos_theta * cos_theta);
+
+                for (k = 0; k < 3; k++) {
+                    r.dir[k] = dir[0]*basis[0][k]
+                             + dir[1]*basis[1][k]
+                             + dir[2]*basis[2][k];
+                }
+
+                ri_vector_normalize(r.dir);
+
+                cos_theta = dir[2];
+                if (cos_theta <= 0.0) continue;
+
+                pdf_light = ri_ibl_table_pdf(light->ibltable, r.dir);
+            }
+
+            pdf_brdf = cos_theta / M_PI;
+
+            /*
+             * f * L * cos / (n_s * p_s) * w_s, where f = 1 / pi and w_s is
+             * the power heuristic,
+             *
+             *   w_s = (n_s p_s)^2 / ((n_l p_l)^2 + (n_b p_b)^2)
+             */
+            pdf_light *= (ri_float_t)nstrategy[0];
+            pdf_brdf  *= (ri_float_t)nstrategy[1];
+
+            w = (strategy == 0) ? pdf_light : pdf_brdf;
+            w = w / (pdf_light * pdf_light + pdf_brdf * pdf_brdf);
+            w *= cos_theta / M_PI;
+
+            ri_texture_ibl_fetch(rad, light->texture, r.dir);
+            if (rad[0] <= 0.0 && rad[1] <= 0.0 && rad[2] <= 0.0) continue;
+
+            ri_vector_scale(weights[n], rad, w);
+            rays[n++] = r;
+
+            if (n == RI_RAY_PACKET_MAX) {
+                trace_shadow_packet(power, rays, weights, n);
+                n = 0;
+            }
+        }
+    }
+
+    if (n > 0) {
+        trace_shadow_packet(power, rays, weights, n);
+    }
+}
+
+/*
+ * Structured importance sampling.
+ * Each sample of the SIS file is a directional light whose power already
+ * accounts for the solid angle of its stratum, so every sample above the
+ * surface is traced and `nsamples' is not referenced.
+ */
+void
+ri_ibl_sample_structured(
+    ri_vector_t        power,           /* [out] */
+    const ri_vector_t  normal,
+    int                nsamples,
+    const ri_ray_t    *inray,
+    const ri_vector_t  pos,
+    const ri_vector_t  eye,
+    const ri_light_t  *light)
+{
+    int          i;
+    int          n;
+    ri_float_t   cos_theta;
+    ri_float_t   eps;
+    ri_ray_t     r;
+    ri_ray_t     rays[RI_RAY_PACKET_MAX];
+    ri_vector_t  weights[RI_RAY_PACKET_MAX];
+    const ri_ibl_table_t *table = light->ibltable;
+
+    ri_vector_setzero(power);
+
+    if (table == NULL || table->nsis == 0) {
+        ri_ibl_sample_importance(power, normal, nsamples, inray,
+                                 pos, eye, light);
+        return;
+    }
+
+    ri_ray_copy(&r, inray);
+
+    eps = 1.0e-5 * ri_render_get()->scene->maxwidth;
+    r.org[0] = pos[0] + normal[0] * eps;
+    r.org[1] = pos[1] + normal[1] * eps;
+    r.org[2] = pos[2] + normal[2] * eps;
+
+    n = 0;
+
+    for (i = 0; i < table->nsis; i++) {
+
+        cos_theta = ri_vector_dot(table->sisdir[i], normal);
+        if (cos_theta <= 0.0) continue;
+
+        ri_vector_copy(r.dir, table->sisdir[i]);
+
+        /* lambert */
+        ri_vector_scale(weights[n], table->siscol[i], cos_theta / M_PI);
+        rays[n++] = r;
+
+        if (n == RI_RAY_PACKET_MAX) {
+            trace_shadow_packet(power, rays, weights, n);
+            n = 0;
+        }
+    }
+
+    if (n > 0) {
+        trace_shadow_packet(power, rays, weights, n);
+    }
+}
+
+void
+ri_ibl_sample(
+    ri_vector_t        power,           /* [out] */
+    const ri_vector_t  normal,
+    int                nsamples,
+    const ri_ray_t    *inray,
+    const ri_vector_t  pos,
+    const ri_vector_t  eye,
+    const ri_light_t  *light)
+{
+    if (light->texture == NULL) {
+        ri_vector_setzero(power);
+        return;
+    }
+
+    switch (light->iblsampler) {
+    case IBL_SAMPLING_IMPORTANCE:
+        ri_ibl_sample_importance(power, normal, nsamples, inray,
+                                 pos, eye, light);
+        break;
+    case IBL_SAMPLING_STRUCTURED:
+        ri_ibl_sample_structured(power, normal, nsamples, inray,
+                                 pos, eye, light);
+        break;
+    default:
+        ri_ibl_sample_cosweight(power, normal, nsamples, inray,
+                                pos, eye, light);
+        break;
+    }
+}
+
 
 /* --- private functions --- */
 
@@ -537,45 +970,261 @@ sinc(ri_float_t x)
  *       in "Monte Carlo Ray Tracing", SIGGRAPH'2003 Course #44.
  */
 static void
-gen_qmc_samples(ri_float_t *samples, int nsamples, int instancenum, int **perm)
+gen_qmc_sample(ri_float_t *sample, int i, int instancenum, int **perm)
 {
-#if 1
-    int    i;
-    ri_float_t u[2];
-
-    for (i = 0; i < nsamples; i++) {
-        //samples[2 * i + 0] = generalized_scrambled_hammersley(
-        //            i, instancenum, nsamples, 1,
-        //            perm);
-        //samples[2 * i + 1] = generalized_scrambled_hammersley(
-        //            i, instancenum, nsamples, 2,
-        //            perm);
-        samples[2 * i + 0] = generalized_scrambled_halton(
-                    i, instancenum, 1,
-                    perm);
-        samples[2 * i + 1] = generalized_scrambled_halton(
-                    i, instancenum, 2,
-                    perm);
+    sample[0] = generalized_scrambled_halton(i, instancenum, 1, perm);
+    sample[1] = generalized_scrambled_halton(i, instancenum, 2, perm);
+}
 
-#if 0
-        u[0] = generalized_scrambled_halton(
-                    i, instancenum, 3,
-                    perm);
-        u[1] = generalized_scrambled_halton(
-                    i, instancenum, 4,
-                    perm);
-#endif
-        u[0] = 0.0; u[1] = 0.0;
+/*
+ * Conversion between directions and (u, v) of the angular map, with the
+ * same mapping as ri_texture_ibl_fetch().
+ */
+static void
+angular_to_dir(ri_vector_t dir, ri_float_t *sinc_theta,
+               ri_float_t u, ri_float_t v)
+{
+    ri_float_t x, y;
+    ri_float_t r;
+    ri_float_t theta;
 
-        samples[2 * i + 0] = mod_1(u[0] + samples[2 * i + 0]);
-        samples[2 * i + 1] = mod_1(u[1] + samples[2 * i + 1]);
+    x = 2.0 * u - 1.0;
+    y = 1.0 - 2.0 * v;
+
+    r = sqrt(x * x + y * y);
+    if (r > 1.0) {
+        ri_vector_setzero(dir);
+        (*sinc_theta) = 0.0;
+        return;
     }
 
-#else
-    (void)nsamples;
-    (void)instancenum;
-    (void)perm;
+    theta = M_PI * r;
 
-    fibonacci_lattice_2D(samples, 10);
-#endif
+    if (r > 1.0e-12) {
+        x /= r;
+        y /= r;
+    } else {
+        x = 1.0;
+        y = 0.0;
+    }
+
+    dir[0] = sin(theta) * x;
+    dir[1] = sin(theta) * y;
+    dir[2] = cos(theta);
+    dir[3] = 0.0;
+
+    (*sinc_theta) = sinc(theta);
+}
+
+static void
+dir_to_angular(ri_float_t *u, ri_float_t *v, const ri_vector_t dir)
+{
+    ri_float_t r;
+    ri_float_t norm2;
+
+    if (dir[2] >= -1.0 && dir[2] < 1.0) {
+        r = (1.0 / M_PI) * acos(dir[2]);
+    } else {
+        r = 0.0;
+    }
+
+    norm2 = dir[0] * dir[0] + dir[1] * dir[1];
+    if (norm2 > 1.0e-6) {
+        r /= sqrt(norm2);
+    }
+
+    (*u) = 0.5 + 0.5 * dir[0] * r;
+    (*v) = 0.5 - 0.5 * dir[1] * r;
+}
+
+/*
+ * Tabulates luminance times solid angle of each cell of the angular map.
+ */
+static ri_ibl_table_t *
+build_importance_table(const ri_texture_t *texture)
+{
+    static const ri_float_t corner[5][2] = {
+        { 0.0, 0.0 }, { -0.5, -0.5 }, { 0.5, -0.5 }, { -0.5, 0.5 }, { 0.5, 0.5 }
+    };
+
+    int             x, y, k;
+    int             w, h;
+    ri_float_t      u, v;
+    ri_float_t      s;
+    ri_float_t      l, lum;
+    ri_float_t      sum;
+    ri_float_t      rowsum;
+    ri_float_t      total;
+    ri_vector_t     col;
+    ri_vector_t     dir;
+    float          *func;
+    float          *cdf;
+    ri_ibl_table_t *table;
+
+    w = texture->width;
+    h = texture->height;
+    if (w <= 0 || h <= 0) return NULL;
+
+    table = (ri_ibl_table_t *)ri_mem_alloc(sizeof(ri_ibl_table_t));
+    memset(table, 0, sizeof(ri_ibl_table_t));
+
+    table->width    = w;
+    table->height   = h;
+    table->func     = (float *)ri_mem_alloc(sizeof(float) * w * h);
+    table->cdf      = (float *)ri_mem_alloc(sizeof(float) * (w + 1) * h);
+    table->marginal = (ri_float_t *)ri_mem_alloc(sizeof(ri_float_t) * (h + 1));
+
+    total = 0.0;
+
+    table->marginal[0] = 0.0;
+
+    for (y = 0; y < h; y++) {
+
+        func = table->func + y * w;
+        cdf  = table->cdf  + y * (w + 1);
+
+        rowsum = 0.0;
+
+        for (x = 0; x < w; x++) {
+
+            u = (x + 0.5) / (ri_float_t)w;
+            v = (y + 0.5) / (ri_float_t)h;
+
+            angular_to_dir(dir, &s, u, v);
+
+            /*
+             * Take the maximum over the center and the corners of the cell,
+             * since the texture is bilinearly filtered and a small bright
+             * source also lights the neighboring cells.
+             */
+            lum = 0.0;
+            if (s > 0.0) {
+                for (k = 0; k < 5; k++) {
+                    ri_texture_fetch(col, texture,
+                                     u + corner[k][0] / (ri_float_t)w,
+                                     v + corner[k][1] / (ri_float_t)h);
+                    l = 0.2126 * col[0] + 0.7152 * col[1] + 0.0722 * col[2];
+                    if (l > lum) lum = l;
+                }
+            }
+
+            func[x] = (float)(lum * s);
+            rowsum += lum * s;
+        }
+
+        /* conditional CDF of the row */
+        cdf[0] = 0.0f;
+        sum    = 0.0;
+        for (x = 0; x < w; x++) {
+            sum += func[x];
+            if (rowsum > 0.0) {
+                cdf[x + 1] = (float)(sum / rowsum);
+            } else {
+                cdf[x + 1] = (float)(x + 1) / (float)w;
+            }
+        }
+        cdf[w] = 1.0f;
+
+        /* row integrals for now. normalized below. */
+        total += rowsum;
+        table->marginal[y + 1] = total;
+    }
+
+    if (total <= 0.0) {
+        ri_log(LOG_WARN, "(IBL   ) IBL texture is black. "
+                         "No importance table is built.\n");
+        ri_ibl_table_free(table);
+        return NULL;
+    }
+
+    for (y = 1; y < h; y++) {
+        table->marginal[y] /= total;
+    }
+    table->marginal[h] = 1.0;
+
+    for (x = 0; x < w * h; x++) {
+        table->func[x] = (float)(table->func[x] / total);
+    }
+
+    return table;
+}
+
+/*
+ * Reads sample points generated by tools/sis(gensamples.dat).
+ *
+ *   NSAMPLES
+ *   WIDTH HEIGHT
+ *   X Y R G B
+ *   ...
+ *
+ * where (X, Y) is the pixel position in the angular map.
+ */
+static int
+load_sisfile(ri_ibl_table_t *table, const char *filename)
+{
+    int         i;
+    int         n;
+    int         w, h;
+    int         x, y;
+    float       col[3];
+    ri_float_t  s;
+    FILE       *fp;
+
+    fp = fopen(filename, "r");
+    if (!fp) return -1;
+
+    if (fscanf(fp, "%d", &n) != 1 || n <= 0 ||
+        fscanf(fp, "%d %d", &w, &h) != 2 || w <= 0 || h <= 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    table->sisdir = (ri_vector_t *)ri_mem_alloc(sizeof(ri_vector_t) * n);
+    table->siscol = (ri_vector_t *)ri_mem_alloc(sizeof(ri_vector_t) * n);
+    table->nsis   = 0;
+
+    for (i = 0; i < n; i++) {
+
+        if (fscanf(fp, "%d %d %f %f %f",
+                   &x, &y, &col[0], &col[1], &col[2]) != 5) {
+            break;
+        }
+
+        angular_to_dir(table->sisdir[table->nsis], &s,
+                       (x + 0.5) / (ri_float_t)w,
+                       (y + 0.5) / (ri_float_t)h);
+        if (s <= 0.0) continue;
+
+        ri_vector_set4(table->siscol[table->nsis],
+                       col[0], col[1], col[2], 0.0);
+        table->nsis++;
+    }
+
+    fclose(fp);
+
+    return (table->nsis > 0) ? 0 : -1;
+}
+
+/*
+ * Traces shadow rays in a packet, and accumulates weights of unoccluded
+ * rays.
+ */
+static void
+trace_shadow_packet(ri_vector_t power, ri_ray_t *rays,
+                    ri_vector_t *weights, int n)
+{
+    int i;
+    int hits[RI_RAY_PACKET_MAX];
+
+    ri_raytrace_stream_occluded(ri_render_get(), rays, n,
+                                0.0, RI_INFINITY, hits);
+    ri_prof_add(RI_PROF_NHEMISPHERE_RAYS, n);
+
+    for (i = 0; i < n; i++) {
+        if (hits[i]) continue;
+
+        power[0] += weights[i][0];
+        power[1] += weights[i][1];
+        power[2] += weights[i][2];
+    }
 }
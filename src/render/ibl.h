@@ -36,6 +36,66 @@ typedef struct _ri_hemisphere_t
 					/* [theta][phi]	*/
 } ri_hemisphere_t;
 
+/*
+ * Sampling table of the IBL texture, built once at scene setup.
+ *
+ * The angular map is discretized into width x height cells. A cell is
+ * chosen with probability proportional to its luminance times its solid
+ * angle, by inverting the marginal CDF over rows and then the conditional
+ * CDF of the chosen row. When a structured importance sampling file is
+ * given, its precomputed sample points are kept instead.
+ */
+typedef struct _ri_ibl_table_t
+{
+	int             width, height;
+	float          *func;		/* [height][width] cell probability */
+	float          *cdf;		/* [height][width + 1] conditional  */
+	ri_float_t     *marginal;	/* [height + 1]                     */
+
+	int             nsis;		/* # of structured samples          */
+	ri_vector_t    *sisdir;		/* direction of structured samples  */
+	ri_vector_t    *siscol;		/* power of structured samples      */
+} ri_ibl_table_t;
+
+/*
+ * Builds the sampling table of `light' according to its IBL sampling
+ * method. Called once before rendering.
+ */
+extern void ri_ibl_setup(
+	ri_light_t        *light);
+
+extern void ri_ibl_table_free(
+	ri_ibl_table_t    *table);
+
+/*
+ * Samples a direction with the luminance distribution of the IBL texture.
+ * Returns its PDF with respect to solid angle, or 0 if no direction is
+ * sampled.
+ */
+extern ri_float_t ri_ibl_table_sample(
+	ri_vector_t           dir,		/* [out] */
+	const ri_ibl_table_t *table,
+	ri_float_t            u0,
+	ri_float_t            u1);
+
+/* PDF with respect to solid angle of sampling `dir' */
+extern ri_float_t ri_ibl_table_pdf(
+	const ri_ibl_table_t *table,
+	const ri_vector_t     dir);
+
+/*
+ * Reflected radiance of a white lambertian surface lit by the IBL light,
+ * with the sampling method of the light.
+ */
+extern void ri_ibl_sample(
+	ri_vector_t        power,               /* [out] */
+	const ri_vector_t  normal,
+	int                nsamples,
+	const ri_ray_t    *inray,
+	const ri_vector_t  pos,
+	const ri_vector_t  eye,
+	const ri_light_t  *light);
+
 /* cosine weighted sampling(or stratified sampling + ) */
 extern void ri_ibl_sample_cosweight(
 	ri_vector_t        power,               /* [out] */
@@ -46,11 +106,12 @@ extern void ri_ibl_sample_cosweight(
 	const ri_vector_t  eye,
 	const ri_light_t  *light);
 
-/* importance sampling */
+/* importance sampling, combined with cosine weighted sampling by MIS */
 extern void ri_ibl_sample_importance(
 	ri_vector_t        power,               /* [out] */
-	ri_hemisphere_t   *hemi,
+	const ri_vector_t  normal,
 	int                nsamples,
+	const ri_ray_t    *inray,
 	const ri_vector_t  pos,
 	const ri_vector_t  eye,
 	const ri_light_t  *light);
@@ -64,11 +125,12 @@ extern void ri_ibl_sample_stratified(
 	const ri_vector_t  eye,
 	const ri_light_t  *light);
 
-/* structured importance sampling */
+/* structured importance sampling with the samples of tools/sis */
 extern void ri_ibl_sample_structured(
 	ri_vector_t        power,               /* [out] */
-	ri_hemisphere_t   *hemi,
+	const ri_vector_t  normal,
 	int                nsamples,
+	const ri_ray_t    *inray,
 	const ri_vector_t  pos,
 	const ri_vector_t  eye,
 	const ri_light_t  *light);
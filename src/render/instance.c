@@ -0,0 +1,938 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Object instancing and the two-level BVH.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "memory.h"
+#include "log.h"
+#include "render.h"
+#include "context.h"
+#include "apitable.h"
+#include "geom.h"
+#include "bvh.h"
+#include "instance.h"
+
+#define INSTANCE_BVH_NLEAF      2       /* max # of instances in a leaf */
+#define INSTANCE_BVH_MAXDEPTH   64
+#define INSTANCE_BVH_MARGIN     1.0e-6  /* relative to the extent       */
+
+static void get_modelview(
+          ri_matrix_t            *om_out);
+
+static void transform_bbox(
+          ri_vector_t             bmin_out,
+          ri_vector_t             bmax_out,
+    const ri_vector_t             bmin,
+    const ri_vector_t             bmax,
+    const ri_matrix_t            *m);
+
+static uint32_t build_node(
+          ri_instance_bvh_t      *ibvh,
+          uint32_t                begin,
+          uint32_t                end,
+          int                     depth);
+
+static int  test_ray_box(
+          ri_float_t             *tmin_out,
+    const ri_float_t             *bmin,
+    const ri_float_t             *bmax,
+    const ri_ray_t               *ray,
+    const ri_vector_t             invdir,
+          ri_float_t              tmax);
+
+static void transform_ray(
+          ri_ray_t               *oray_out,
+    const ri_ray_t               *ray,
+    const ri_instance_t          *instance);
+
+static void transform_state(
+          ri_intersection_state_t *state_inout,
+    const ri_ray_t               *ray,
+    const ri_instance_t          *instance);
+
+/* ---------------------------------------------------------------------------
+ *
+ * Public functions
+ *
+ * ------------------------------------------------------------------------ */
+
+ri_object_t *
+ri_object_new()
+{
+    ri_object_t *p;
+
+    p = (ri_object_t *)ri_mem_alloc(sizeof(ri_object_t));
+    memset(p, 0, sizeof(ri_object_t));
+
+    p->geom_list = ri_list_new();
+
+    ri_matrix_identity(&p->om);
+
+    p->bmin[0] = p->bmin[1] = p->bmin[2] =  RI_INFINITY;
+    p->bmax[0] = p->bmax[1] = p->bmax[2] = -RI_INFINITY;
+
+    return p;
+}
+
+void
+ri_object_free(
+    ri_object_t *object)
+{
+    if (object == NULL) return;
+
+    if (object->accel) {
+        ri_bvh_free(object->accel);
+    }
+
+    ri_list_free(object->geom_list);
+
+    ri_mem_free(object);
+}
+
+void
+ri_object_finish(
+    ri_object_t *object)
+{
+    unsigned int  i;
+    ri_list_t    *itr;
+    ri_geom_t    *geom;
+
+    assert(object != NULL);
+
+    object->ntriangles = 0;
+
+    for (itr  = ri_list_first(object->geom_list);
+         itr != NULL;
+         itr  = ri_list_next(itr)) {
+
+        geom = (ri_geom_t *)itr->data;
+
+        for (i = 0; i < geom->npositions; i++) {
+            vmin(object->bmin, object->bmin, geom->positions[i]);
+            vmax(object->bmax, object->bmax, geom->positions[i]);
+        }
+
+        object->ntriangles += geom->nindices / 3;
+    }
+}
+
+/*
+ * Function: ri_instance_new
+ *
+ *     Places the prototype with the modelview `om'.
+ *
+ * Returns:
+ *
+ *     New instance, or NULL if the transformation is singular.
+ */
+ri_instance_t *
+ri_instance_new(
+    ri_object_t       *object,
+    const ri_matrix_t *om)
+{
+    ri_matrix_t    inv_object_om;
+    ri_instance_t *p;
+
+    assert(object != NULL);
+    assert(om     != NULL);
+
+    p = (ri_instance_t *)ri_mem_alloc(sizeof(ri_instance_t));
+
+    p->object = object;
+
+    /*
+     * Geometries of the prototype are already transformed with object->om,
+     * so the object to world transformation of the instance is
+     *
+     *   xform = object->om^-1 . om
+     */
+    if ((ri_matrix_invert(&inv_object_om, &object->om) != 0)                ||
+        (ri_matrix_mul(&p->xform, &inv_object_om, om),
+         ri_matrix_invert(&p->invxform, &p->xform) != 0)) {
+
+        ri_log(LOG_WARN, "(Inst  ) Singular transformation. Instance ignored.");
+        ri_mem_free(p);
+        return NULL;
+    }
+
+    transform_bbox(p->bmin, p->bmax, object->bmin, object->bmax, &p->xform);
+
+    return p;
+}
+
+void
+ri_instance_free(
+    ri_instance_t *instance)
+{
+    ri_mem_free(instance);
+}
+
+/*
+ * Function: ri_instance_bvh_build
+ *
+ *     Builds BVHs of prototypes which are not built yet, the BVH of the
+ *     geometries not instanced and the top-level BVH over instances.
+ *
+ * Parameters:
+ *
+ *     data - scene data of type ri_scene_t.
+ *
+ * Returns:
+ *
+ *     Built two-level BVH.
+ */
+void *
+ri_instance_bvh_build(
+    const void *data)
+{
+    const ri_scene_t  *scene = (const ri_scene_t *)data;
+
+    ri_instance_bvh_t *ibvh;
+    ri_list_t         *itr;
+    ri_object_t       *object;
+    ri_instance_t     *instance;
+    uint32_t           n;
+    uint32_t           nobjects   = 0;
+    uint64_t           nunique    = 0;
+    uint64_t           ninstanced = 0;
+
+    ibvh = (ri_instance_bvh_t *)ri_mem_alloc(sizeof(ri_instance_bvh_t));
+    memset(ibvh, 0, sizeof(ri_instance_bvh_t));
+
+    ri_log(LOG_INFO, "(Inst  ) Building two-level BVH ... ");
+
+    /*
+     * 1. BVH per prototype. Built once and kept in the prototype.
+     */
+    for (itr  = ri_list_first(scene->object_list);
+         itr != NULL;
+         itr  = ri_list_next(itr)) {
+
+        object = (ri_object_t *)itr->data;
+
+        if (object->ninstances == 0) continue;
+
+        if (object->accel == NULL) {
+            object->accel = ri_bvh_build_geoms(object->geom_list);
+        }
+
+        nobjects++;
+        nunique += object->ntriangles;
+    }
+
+    /*
+     * 2. BVH of the geometries not instanced.
+     */
+    if (ri_list_first(scene->geom_list) != NULL) {
+        ibvh->bvh = ri_bvh_build_geoms(scene->geom_list);
+    }
+
+    /*
+     * 3. Top-level BVH over instances with geometry.
+     */
+    n = 0;
+    for (itr  = ri_list_first(scene->instance_list);
+         itr != NULL;
+         itr  = ri_list_next(itr)) {
+        n++;
+    }
+
+    ibvh->instances = (ri_instance_t **)ri_mem_alloc(
+                          sizeof(ri_instance_t *) * (n + 1));
+
+    n = 0;
+    for (itr  = ri_list_first(scene->instance_list);
+         itr != NULL;
+         itr  = ri_list_next(itr)) {
+
+        instance = (ri_instance_t *)itr->data;
+
+        if (instance->object->ntriangles == 0) continue;
+
+        ibvh->instances[n++] = instance;
+        ninstanced += instance->object->ntriangles;
+    }
+
+    ibvh->ninstances = n;
+
+    if (n > 0) {
+        ibvh->nodes = (ri_instance_bvh_node_t *)ri_mem_alloc(
+                          sizeof(ri_instance_bvh_node_t) * (2 * n - 1));
+        ibvh->nnodes = 0;
+
+        build_node(ibvh, 0, n, 0);
+    }
+
+    ri_log(LOG_INFO, "(Inst  )    # of prototypes   = %u", nobjects);
+    ri_log(LOG_INFO, "(Inst  )    # of instances    = %u", ibvh->ninstances);
+    ri_log(LOG_INFO, "(Inst  )    # of unique tris  = %llu",
+        (unsigned long long)nunique);
+    ri_log(LOG_INFO, "(Inst  )    # of instanced tris = %llu",
+        (unsigned long long)ninstanced);
+    ri_log(LOG_INFO, "(Inst  )    # of top-level nodes = %u (%.2f KB)",
+        ibvh->nnodes,
+        sizeof(ri_instance_bvh_node_t) * ibvh->nnodes / 1024.0);
+
+    ri_log(LOG_INFO, "(Inst  ) Built two-level BVH.");
+
+    return (void *)ibvh;
+}
+
+/*
+ * Prototype BVHs are owned by prototypes(see ri_object_free()).
+ */
+void
+ri_instance_bvh_free(
+    void *accel)
+{
+    ri_instance_bvh_t *ibvh = (ri_instance_bvh_t *)accel;
+
+    if (ibvh == NULL) return;
+
+    if (ibvh->bvh) {
+        ri_bvh_free(ibvh->bvh);
+    }
+
+    ri_mem_free(ibvh->nodes);
+    ri_mem_free(ibvh->instances);
+    ri_mem_free(ibvh);
+}
+
+/*
+ * Function: ri_instance_bvh_intersect
+ *
+ *     Finds the nearest hit among the geometries not instanced and the
+ *     instances. Intersection state is built in world space.
+ */
+int
+ri_instance_bvh_intersect(
+    void                    *accel,
+    ri_ray_t                *ray,
+    ri_intersection_state_t *state_out,
+    void                    *user)
+{
+    int                     i;
+    int                     depth;
+    uint32_t                ref;
+    uint32_t                near_ref, far_ref;
+    uint32_t                stack[INSTANCE_BVH_MAXDEPTH + 1];
+    ri_float_t              tnear, tfar, tbox;
+    ri_vector_t             invdir;
+    ri_ray_t                oray;
+    ri_instance_bvh_t      *ibvh;
+    ri_instance_bvh_node_t *node;
+    ri_instance_t          *instance;
+    const ri_instance_t    *hit_instance = NULL;
+
+    (void)user;
+
+    assert(accel     != NULL);
+    assert(ray       != NULL);
+    assert(state_out != NULL);
+
+    ibvh = (ri_instance_bvh_t *)accel;
+
+    state_out->t     = RI_INFINITY;
+    state_out->u     = 0.0;
+    state_out->v     = 0.0;
+    state_out->geom  = NULL;
+    state_out->index = 0;
+
+    if (ibvh->bvh) {
+        ri_bvh_intersect_nearest(ibvh->bvh, ray, state_out);
+    }
+
+    if (ibvh->nnodes > 0) {
+
+        invdir[0] = 1.0 / ray->dir[0];
+        invdir[1] = 1.0 / ray->dir[1];
+        invdir[2] = 1.0 / ray->dir[2];
+
+        depth = 0;
+        ref   = 0;
+
+        if (!test_ray_box(&tbox, ibvh->nodes[0].bmin, ibvh->nodes[0].bmax,
+                          ray, invdir, state_out->t)) {
+            depth = -1;
+        }
+
+        while (depth >= 0) {
+
+            node = &ibvh->nodes[ref];
+
+            if (node->ninstances > 0) {
+
+                for (i = 0; i < (int)node->ninstances; i++) {
+
+                    instance = ibvh->instances[node->offset + i];
+
+                    if (!test_ray_box(&tbox, instance->bmin, instance->bmax,
+                                      ray, invdir, state_out->t)) {
+                        continue;
+                    }
+
+                    transform_ray(&oray, ray, instance);
+
+                    if (ri_bvh_intersect_nearest(instance->object->accel,
+                                                 &oray, state_out)) {
+                        hit_instance = instance;
+                    }
+                }
+
+            } else {
+
+                /* Visit the nearer child first. */
+                near_ref = ref + 1;
+                far_ref  = node->offset;
+
+                i  = test_ray_box(&tnear, ibvh->nodes[near_ref].bmin,
+                                  ibvh->nodes[near_ref].bmax,
+                                  ray, invdir, state_out->t);
+                i |= test_ray_box(&tfar,  ibvh->nodes[far_ref].bmin,
+                                  ibvh->nodes[far_ref].bmax,
+                                  ray, invdir, state_out->t) << 1;
+
+                if (i == 3) {
+
+                    if (tfar < tnear) {
+                        ref      = near_ref;
+                        near_ref = far_ref;
+                        far_ref  = ref;
+                    }
+
+                    assert(depth < INSTANCE_BVH_MAXDEPTH);
+                    stack[depth++] = far_ref;
+                    ref = near_ref;
+                    continue;
+
+                } else if (i == 1) {
+
+                    ref = near_ref;
+                    continue;
+
+                } else if (i == 2) {
+
+                    ref = far_ref;
+                    continue;
+
+                }
+            }
+
+            /* pop */
+            if (depth == 0) break;
+            ref = stack[--depth];
+        }
+    }
+
+    if (state_out->geom == NULL) {
+        return 0;
+    }
+
+    if (hit_instance) {
+
+        transform_ray(&oray, ray, hit_instance);
+
+        ri_intersection_state_build(state_out, &oray);
+
+        transform_state(state_out, ray, hit_instance);
+
+    } else {
+
+        ri_intersection_state_build(state_out, ray);
+
+    }
+
+    return 1;
+}
+
+/*
+ * Function: ri_instance_bvh_occluded
+ *
+ *     Any-hit query for the two-level BVH.
+ */
+int
+ri_instance_bvh_occluded(
+    void                    *accel,
+    ri_ray_t                *ray,
+    ri_float_t               tmin,
+    ri_float_t               tmax,
+    void                    *user)
+{
+    int                     i;
+    int                     depth;
+    uint32_t                ref;
+    uint32_t                stack[INSTANCE_BVH_MAXDEPTH + 1];
+    ri_float_t              tbox;
+    ri_vector_t             invdir;
+    ri_ray_t                oray;
+    ri_instance_bvh_t      *ibvh;
+    ri_instance_bvh_node_t *node;
+    ri_instance_t          *instance;
+
+    (void)user;
+
+    assert(accel != NULL);
+    assert(ray   != NULL);
+
+    ibvh = (ri_instance_bvh_t *)accel;
+
+    if (ibvh->bvh) {
+        if (ri_bvh_occluded(ibvh->bvh, ray, tmin, tmax, NULL)) {
+            return 1;
+        }
+    }
+
+    if (ibvh->nnodes == 0) {
+        return 0;
+    }
+
+    invdir[0] = 1.0 / ray->dir[0];
+    invdir[1] = 1.0 / ray->dir[1];
+    invdir[2] = 1.0 / ray->dir[2];
+
+    depth = 0;
+    stack[depth++] = 0;
+
+    while (depth > 0) {
+
+        ref  = stack[--depth];
+        node = &ibvh->nodes[ref];
+
+        if (!test_ray_box(&tbox, node->bmin, node->bmax, ray, invdir, tmax)) {
+            continue;
+        }
+
+        if (node->ninstances == 0) {
+
+            assert(depth + 2 <= INSTANCE_BVH_MAXDEPTH);
+            stack[depth++] = node->offset;
+            stack[depth++] = ref + 1;
+            continue;
+
+        }
+
+        for (i = 0; i < (int)node->ninstances; i++) {
+
+            instance = ibvh->instances[node->offset + i];
+
+            if (!test_ray_box(&tbox, instance->bmin, instance->bmax,
+                              ray, invdir, tmax)) {
+                continue;
+            }
+
+            transform_ray(&oray, ray, instance);
+
+            if (ri_bvh_occluded(instance->object->accel,
+                                &oray, tmin, tmax, NULL)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * RI API.
+ */
+RtObjectHandle
+ri_api_object_begin()
+{
+    ri_object_t *object;
+    ri_scene_t  *scene = ri_render_get()->scene;
+
+    if (scene->object_block != NULL) {
+        ri_log(LOG_ERROR, "(RI    ) Nested RiObjectBegin() is not allowed.");
+        return NULL;
+    }
+
+    object = ri_object_new();
+
+    get_modelview(&object->om);
+
+    ri_list_append(scene->object_list, (void *)object);
+
+    scene->object_block = object;
+
+    return (RtObjectHandle)object;
+}
+
+void
+ri_api_object_end()
+{
+    ri_scene_t  *scene = ri_render_get()->scene;
+
+    if (scene->object_block == NULL) {
+        ri_log(LOG_ERROR, "(RI    ) RiObjectEnd() without RiObjectBegin().");
+        return;
+    }
+
+    ri_object_finish(scene->object_block);
+
+    scene->object_block = NULL;
+}
+
+void
+ri_api_object_instance(
+    RtObjectHandle handle)
+{
+    ri_matrix_t    om;
+    ri_object_t   *object   = (ri_object_t *)handle;
+    ri_scene_t    *scene    = ri_render_get()->scene;
+    ri_instance_t *instance;
+
+    if (object == NULL) {
+        ri_log(LOG_WARN, "(RI    ) RiObjectInstance(): invalid handle.");
+        return;
+    }
+
+    if (scene->object_block != NULL) {
+        ri_log(LOG_WARN, "(RI    ) RiObjectInstance() in object definition "
+                         "is not supported. Ignored.");
+        return;
+    }
+
+    get_modelview(&om);
+
+    instance = ri_instance_new(object, &om);
+
+    if (instance == NULL) return;
+
+    object->ninstances++;
+
+    ri_list_append(scene->instance_list, (void *)instance);
+}
+
+/* ---------------------------------------------------------------------------
+ *
+ * Private functions
+ *
+ * ------------------------------------------------------------------------ */
+
+/*
+ * Modelview used to transform geometries into world space, i.e. the
+ * current transformation with the orientation(see ri_polygon_parse()).
+ */
+static void
+get_modelview(
+    ri_matrix_t *om_out)
+{
+    ri_context_t *ctx = ri_render_get()->context;
+    ri_matrix_t  *m;
+    ri_matrix_t   orientation;
+
+    m = (ri_matrix_t *)ri_stack_get(ctx->trans_stack);
+
+    ri_matrix_identity(&orientation);
+    if (strcmp(ctx->option->orientation, RI_RH) == 0) {
+        orientation.f[2][2] = -orientation.f[2][2];
+    }
+
+    ri_matrix_mul(om_out, m, &orientation);
+}
+
+/*
+ * p * m for a vector p(no translation).
+ */
+static inline void
+xform_vector(
+    ri_vector_t        dst,
+    const ri_vector_t  src,
+    const ri_matrix_t *m)
+{
+    ri_vector_t v;
+
+    v[0] = src[0] * m->f[0][0] + src[1] * m->f[1][0] + src[2] * m->f[2][0];
+    v[1] = src[0] * m->f[0][1] + src[1] * m->f[1][1] + src[2] * m->f[2][1];
+    v[2] = src[0] * m->f[0][2] + src[1] * m->f[1][2] + src[2] * m->f[2][2];
+
+    dst[0] = v[0];
+    dst[1] = v[1];
+    dst[2] = v[2];
+}
+
+/*
+ * Transforms a normal vector with the inverse transpose, given the inverse
+ * matrix `invm'.
+ */
+static inline void
+xform_normal(
+    ri_vector_t        dst,
+    const ri_vector_t  src,
+    const ri_matrix_t *invm)
+{
+    ri_vector_t v;
+
+    v[0] = src[0] * invm->f[0][0] + src[1] * invm->f[0][1] + src[2] * invm->f[0][2];
+    v[1] = src[0] * invm->f[1][0] + src[1] * invm->f[1][1] + src[2] * invm->f[1][2];
+    v[2] = src[0] * invm->f[2][0] + src[1] * invm->f[2][1] + src[2] * invm->f[2][2];
+
+    dst[0] = v[0];
+    dst[1] = v[1];
+    dst[2] = v[2];
+}
+
+static void
+transform_bbox(
+    ri_vector_t        bmin_out,
+    ri_vector_t        bmax_out,
+    const ri_vector_t  bmin,
+    const ri_vector_t  bmax,
+    const ri_matrix_t *m)
+{
+    int         i, k;
+    ri_vector_t p;
+    ri_float_t  margin;
+
+    bmin_out[0] = bmin_out[1] = bmin_out[2] =  RI_INFINITY;
+    bmax_out[0] = bmax_out[1] = bmax_out[2] = -RI_INFINITY;
+    bmin_out[3] = bmax_out[3] = 0.0;
+
+    if (bmin[0] > bmax[0]) return;      /* empty */
+
+    for (i = 0; i < 8; i++) {
+
+        p[0] = (i & 1) ? bmax[0] : bmin[0];
+        p[1] = (i & 2) ? bmax[1] : bmin[1];
+        p[2] = (i & 4) ? bmax[2] : bmin[2];
+        p[3] = 1.0;
+
+        ri_vector_transform(p, p, m);
+
+        for (k = 0; k < 3; k++) {
+            if (bmin_out[k] > p[k]) bmin_out[k] = p[k];
+            if (bmax_out[k] < p[k]) bmax_out[k] = p[k];
+        }
+    }
+
+    /*
+     * Add a small margin, since the ray in object space is tested against
+     * the untransformed geometry.
+     */
+    for (k = 0; k < 3; k++) {
+        margin = INSTANCE_BVH_MARGIN * (bmax_out[k] - bmin_out[k] + 1.0);
+        bmin_out[k] -= margin;
+        bmax_out[k] += margin;
+    }
+}
+
+static int          g_sort_axis;
+
+static int
+compare_instance(
+    const void *a,
+    const void *b)
+{
+    const ri_instance_t *ia = *(const ri_instance_t **)a;
+    const ri_instance_t *ib = *(const ri_instance_t **)b;
+
+    ri_float_t ca = ia->bmin[g_sort_axis] + ia->bmax[g_sort_axis];
+    ri_float_t cb = ib->bmin[g_sort_axis] + ib->bmax[g_sort_axis];
+
+    if (ca < cb) return -1;
+    if (ca > cb) return  1;
+    return 0;
+}
+
+/*
+ * Builds the subtree over instances[begin, end) by the object median split
+ * along the largest extent of instance centers. Instances are much fewer
+ * than triangles, thus SAH is not used here.
+ *
+ * Returns the index of the node.
+ */
+static uint32_t
+build_node(
+    ri_instance_bvh_t *ibvh,
+    uint32_t           begin,
+    uint32_t           end,
+    int                depth)
+{
+    int                     k;
+    int                     axis;
+    uint32_t                i;
+    uint32_t                idx;
+    uint32_t                mid;
+    ri_float_t              c;
+    ri_float_t              cmin[3], cmax[3];
+    ri_instance_bvh_node_t *node;
+
+    idx  = ibvh->nnodes++;
+    node = &ibvh->nodes[idx];
+
+    for (k = 0; k < 3; k++) {
+        node->bmin[k] =  RI_INFINITY;
+        node->bmax[k] = -RI_INFINITY;
+        cmin[k]       =  RI_INFINITY;
+        cmax[k]       = -RI_INFINITY;
+    }
+
+    for (i = begin; i < end; i++) {
+        for (k = 0; k < 3; k++) {
+            if (node->bmin[k] > ibvh->instances[i]->bmin[k]) {
+                node->bmin[k] = ibvh->instances[i]->bmin[k];
+            }
+            if (node->bmax[k] < ibvh->instances[i]->bmax[k]) {
+                node->bmax[k] = ibvh->instances[i]->bmax[k];
+            }
+
+            c = ibvh->instances[i]->bmin[k] + ibvh->instances[i]->bmax[k];
+            if (cmin[k] > c) cmin[k] = c;
+            if (cmax[k] < c) cmax[k] = c;
+        }
+    }
+
+    axis = 0;
+    if ((cmax[1] - cmin[1]) > (cmax[axis] - cmin[axis])) axis = 1;
+    if ((cmax[2] - cmin[2]) > (cmax[axis] - cmin[axis])) axis = 2;
+
+    if (((end - begin) <= INSTANCE_BVH_NLEAF) ||
+        (depth >= INSTANCE_BVH_MAXDEPTH - 1)  ||
+        (cmax[axis] <= cmin[axis])) {
+
+        node->offset     = begin;
+        node->ninstances = end - begin;
+
+        return idx;
+    }
+
+    g_sort_axis = axis;
+    qsort(ibvh->instances + begin, end - begin, sizeof(ri_instance_t *),
+          compare_instance);
+
+    mid = begin + (end - begin) / 2;
+
+    build_node(ibvh, begin, mid, depth + 1);            /* idx + 1 */
+
+    /* `node' may not be used here; take the index. */
+    ibvh->nodes[idx].offset     = build_node(ibvh, mid, end, depth + 1);
+    ibvh->nodes[idx].ninstances = 0;
+
+    return idx;
+}
+
+/*
+ * Slab test. Returns 1 and the entry distance if the ray hits the box in
+ * [0, tmax].
+ */
+static int
+test_ray_box(
+    ri_float_t        *tmin_out,
+    const ri_float_t  *bmin,
+    const ri_float_t  *bmax,
+    const ri_ray_t    *ray,
+    const ri_vector_t  invdir,
+    ri_float_t         tmax)
+{
+    int        k;
+    ri_float_t t0, t1, tmp;
+    ri_float_t tmin = 0.0;
+
+    for (k = 0; k < 3; k++) {
+
+        t0 = (bmin[k] - ray->org[k]) * invdir[k];
+        t1 = (bmax[k] - ray->org[k]) * invdir[k];
+
+        if (t0 > t1) {
+            tmp = t0; t0 = t1; t1 = tmp;
+        }
+
+        /* NaN(0 * inf) compares false and leaves the interval as is. */
+        if (t0 > tmin) tmin = t0;
+        if (t1 < tmax) tmax = t1;
+
+        if (tmin > tmax) return 0;
+    }
+
+    (*tmin_out) = tmin;
+
+    return 1;
+}
+
+/*
+ * Transforms the ray into the object space of the instance. The direction
+ * is not normalized so that the ray parameter t is preserved.
+ */
+static void
+transform_ray(
+    ri_ray_t            *oray_out,
+    const ri_ray_t      *ray,
+    const ri_instance_t *instance)
+{
+    const ri_matrix_t *m = &instance->invxform;
+
+    memcpy(oray_out, ray, sizeof(ri_ray_t));
+
+    ri_vector_transform(oray_out->org, ray->org, m);
+    oray_out->org[3] = ray->org[3];
+
+    xform_vector(oray_out->dir, ray->dir, m);
+
+    if (ray->has_differentials) {
+        xform_vector(oray_out->dPdx, ray->dPdx, m);
+        xform_vector(oray_out->dPdy, ray->dPdy, m);
+        xform_vector(oray_out->dDdx, ray->dDdx, m);
+        xform_vector(oray_out->dDdy, ray->dDdy, m);
+    }
+}
+
+/*
+ * Brings the intersection state built in the object space of the instance
+ * back into world space.
+ */
+static void
+transform_state(
+    ri_intersection_state_t *state_inout,
+    const ri_ray_t          *ray,
+    const ri_instance_t     *instance)
+{
+    int                i;
+    const ri_matrix_t *m    = &instance->xform;
+    const ri_matrix_t *invm = &instance->invxform;
+
+    for (i = 0; i < 3; i++) {
+        state_inout->P[i] = ray->org[i] + ray->dir[i] * state_inout->t;
+    }
+    state_inout->P[3] = 0.0;
+
+    ri_vector_copy(state_inout->E, ray->org);
+    ri_vector_copy(state_inout->I, ray->dir);
+    ri_vector_normalize(state_inout->I);
+
+    xform_normal(state_inout->Ng, state_inout->Ng, invm);
+    xform_normal(state_inout->Ns, state_inout->Ns, invm);
+    ri_vector_normalize(state_inout->Ng);
+    ri_vector_normalize(state_inout->Ns);
+
+    xform_vector(state_inout->tangent,  state_inout->tangent,  m);
+    xform_vector(state_inout->binormal, state_inout->binormal, m);
+    ri_vector_normalize(state_inout->tangent);
+    ri_vector_normalize(state_inout->binormal);
+
+    if (state_inout->has_differentials) {
+        xform_vector(state_inout->dPdx, state_inout->dPdx, m);
+        xform_vector(state_inout->dPdy, state_inout->dPdy, m);
+        xform_normal(state_inout->dNdx, state_inout->dNdx, invm);
+        xform_normal(state_inout->dNdy, state_inout->dNdy, invm);
+        ri_vector_copy(state_inout->dDdx, ray->dDdx);
+        ri_vector_copy(state_inout->dDdy, ray->dDdy);
+    }
+}
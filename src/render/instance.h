@@ -0,0 +1,161 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Object instancing.
+ *
+ * Geometries defined in RiObjectBegin()/RiObjectEnd() block are stored
+ * once as a prototype(ri_object_t), and RiObjectInstance() places the
+ * prototype with the current transformation(ri_instance_t).
+ *
+ * Scenes with instances are raytraced with the two-level BVH: a BVH is
+ * built once per prototype in its object space, and the top-level BVH is
+ * built over world space bounds of instances. A ray which reaches an
+ * instance is transformed into the object space of the instance and traced
+ * against the prototype BVH. Since the ray direction is not renormalized,
+ * the ray parameter t is shared by every level, and hits of instances are
+ * compared directly. Thus memory and build time scale with the unique
+ * geometry, not with the number of instances.
+ *
+ * Geometries outside of object blocks are put into one BVH, which is
+ * tested before the top-level BVH.
+ *
+ * $Id$
+ */
+
+#ifndef LUCILLE_INSTANCE_H
+#define LUCILLE_INSTANCE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+
+#include "ri.h"
+#include "vector.h"
+#include "matrix.h"
+#include "list.h"
+
+#include "ray.h"
+#include "intersection_state.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Struct: ri_object_t
+ *
+ *   Prototype of instances. Geometries are in the object space of the
+ *   prototype.
+ */
+typedef struct _ri_object_t {
+
+    ri_list_t      *geom_list;      /* list of ri_geom_t                */
+
+    /*
+     * Modelview(including the orientation) at RiObjectBegin(). Geometries
+     * are transformed with it when they are parsed, thus its inverse
+     * brings them back into the object space.
+     */
+    ri_matrix_t     om;
+
+    ri_vector_t     bmin;           /* bounds of the geometries         */
+    ri_vector_t     bmax;
+
+    uint32_t        ntriangles;
+    uint32_t        ninstances;
+
+    void           *accel;          /* BVH of the prototype. Built once
+                                     * at the first scene setup.        */
+
+} ri_object_t;
+
+/*
+ * Struct: ri_instance_t
+ *
+ *   Placement of a prototype.
+ */
+typedef struct _ri_instance_t {
+
+    ri_object_t    *object;
+
+    ri_matrix_t     xform;          /* object to world                  */
+    ri_matrix_t     invxform;       /* world to object                  */
+
+    ri_vector_t     bmin;           /* world space bounds               */
+    ri_vector_t     bmax;
+
+} ri_instance_t;
+
+/*
+ * Node of the top-level BVH. Inner node has 2 children: the left child
+ * follows the node, and the right child is nodes[offset]. Leaf node
+ * refers to instances[offset, offset + ninstances).
+ */
+typedef struct _ri_instance_bvh_node_t {
+
+    ri_float_t      bmin[3];
+    ri_float_t      bmax[3];
+
+    uint32_t        offset;
+    uint32_t        ninstances;     /* 0 for inner node                 */
+
+} ri_instance_bvh_node_t;
+
+/*
+ * Struct: ri_instance_bvh_t
+ *
+ *   Two-level BVH.
+ */
+typedef struct _ri_instance_bvh_t {
+
+    void                    *bvh;           /* BVH of the geometries not
+                                             * instanced. NULL if none.     */
+
+    ri_instance_t          **instances;     /* sorted by leaf               */
+    uint32_t                 ninstances;
+
+    ri_instance_bvh_node_t  *nodes;
+    uint32_t                 nnodes;
+
+} ri_instance_bvh_t;
+
+extern ri_object_t   *ri_object_new     ();
+extern void           ri_object_free    (ri_object_t         *object);
+
+/*
+ * Computes bounds of the geometries of the prototype. Called at
+ * RiObjectEnd().
+ */
+extern void           ri_object_finish  (ri_object_t         *object);
+
+extern ri_instance_t *ri_instance_new   (ri_object_t         *object,
+                                         const ri_matrix_t   *om);
+extern void           ri_instance_free  (ri_instance_t       *instance);
+
+/*
+ * ri_accel_t interface of the two-level BVH. Bound as RI_ACCEL_BVH_INSTANCE.
+ */
+extern void *ri_instance_bvh_build      (const void              *data);
+extern void  ri_instance_bvh_free       (      void              *accel);
+extern int   ri_instance_bvh_intersect  (      void              *accel,
+                                               ri_ray_t          *ray,
+                                         ri_intersection_state_t *state_out,
+                                               void              *user);
+extern int   ri_instance_bvh_occluded   (      void              *accel,
+                                               ri_ray_t          *ray,
+                                               ri_float_t         tmin,
+                                               ri_float_t         tmax,
+                                               void              *user);
+
+#ifdef __cplusplus
+}    /* extern "C" */
+#endif
+
+#endif  /* LUCILLE_INSTANCE_H */
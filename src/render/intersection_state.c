@@ -7,6 +7,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #include "vector.h"
 #include "geometric.h"
@@ -29,6 +30,10 @@ static void lerp_uv(
     ri_float_t u,
     ri_float_t v );
 
+static void transfer_differentials(
+    ri_intersection_state_t *state_inout,   /* [inout]  */
+    const ri_ray_t          *ray );
+
 
 /* ----------------------------------------------------------------------------
  *
@@ -89,8 +94,8 @@ ri_intersection_state_free(
  *
  *    state_inout - Pointer to ri_intersection_state_t object to be filled &
  *                  updated.
- *    eye         - rayorg
- *    dir         - raydir
+ *    ray         - the ray which hits the surface. Its differentials are
+ *                  transferred to the hit point if it has them.
  *
  * Returns:
  *
@@ -99,8 +104,7 @@ ri_intersection_state_free(
 void
 ri_intersection_state_build(
     ri_intersection_state_t *state_inout,    /* [inout] */
-    const ri_vector_t        eye,
-    const ri_vector_t        dir)
+    const ri_ray_t          *ray)
 {
     ri_vector_t tmpbasis[3];
     ri_vector_t defcol;
@@ -123,6 +127,9 @@ ri_intersection_state_build(
     ri_geom_t   *geom;
     uint32_t     index;
 
+    const ri_float_t *eye = ray->org;
+    const ri_float_t *dir = ray->dir;
+
     t     = state_inout->t;
     u     = state_inout->u;
     v     = state_inout->v;
@@ -145,9 +152,10 @@ ri_intersection_state_build(
     i1 = geom->indices[index + 1];
     i2 = geom->indices[index + 2];
 
-    ri_vector_copy(v0, geom->positions[i0]);
-    ri_vector_copy(v1, geom->positions[i1]);
-    ri_vector_copy(v2, geom->positions[i2]);
+    /* The vertices at the time of the ray if the geometry moves. */
+    ri_geom_position_at(v0, geom, i0, ray->time);
+    ri_geom_position_at(v1, geom, i1, ray->time);
+    ri_geom_position_at(v2, geom, i2, ray->time);
 
     if (geom->normals) {
         ri_vector_copy(n0, geom->normals[i0]);
@@ -245,6 +253,110 @@ ri_intersection_state_build(
     state_inout->index = index;
     //state->kd    = geom->kd;
     //state->ks    = geom->ks;
+
+    transfer_differentials( state_inout, ray );
+}
+
+void
+ri_intersection_state_reflect_differentials(
+    ri_ray_t                      *ray_inout,
+    const ri_intersection_state_t *state)
+{
+    int         i;
+    ri_float_t  DN;
+    ri_float_t  dDNdx, dDNdy;
+    const ri_float_t *D = state->I;
+    const ri_float_t *N = state->Ns;
+
+    ray_inout->has_differentials = state->has_differentials;
+    if (!state->has_differentials) return;
+
+    /*
+     * R = D - 2 (D.N) N
+     *
+     * dR/dx = dD/dx - 2 ((D.N) dN/dx + d(D.N)/dx N)
+     *
+     * The result does not depend on the side of N.
+     */
+    DN    = ri_vector_dot( D, N );
+    dDNdx = ri_vector_dot( state->dDdx, N ) + ri_vector_dot( D, state->dNdx );
+    dDNdy = ri_vector_dot( state->dDdy, N ) + ri_vector_dot( D, state->dNdy );
+
+    for (i = 0; i < 3; i++) {
+        ray_inout->dPdx[i] = state->dPdx[i];
+        ray_inout->dPdy[i] = state->dPdy[i];
+        ray_inout->dDdx[i] = state->dDdx[i]
+                           - 2.0 * (DN * state->dNdx[i] + dDNdx * N[i]);
+        ray_inout->dDdy[i] = state->dDdy[i]
+                           - 2.0 * (DN * state->dNdy[i] + dDNdy * N[i]);
+    }
+}
+
+void
+ri_intersection_state_refract_differentials(
+    ri_ray_t                      *ray_inout,
+    const ri_intersection_state_t *state,
+    ri_float_t                     eta)
+{
+    int         i;
+    ri_float_t  e;
+    ri_float_t  cos1, cos2;
+    ri_float_t  k;
+    ri_float_t  mu;
+    ri_float_t  dcdx, dcdy;
+    ri_float_t  dmudx, dmudy;
+    ri_vector_t N, dNdx, dNdy;
+    const ri_float_t *D = state->I;
+
+    ray_inout->has_differentials = state->has_differentials;
+    if (!state->has_differentials) return;
+
+    /* Same orientation and ratio of indices as ri_refract(). */
+    cos1 = ri_vector_dot( D, state->Ns );
+    if (cos1 < 0.0) {
+        cos1 = -cos1;
+        e    = 1.0 / eta;
+        ri_vector_copy( N, state->Ns );
+        ri_vector_copy( dNdx, state->dNdx );
+        ri_vector_copy( dNdy, state->dNdy );
+    } else {
+        e    = eta;
+        for (i = 0; i < 3; i++) {
+            N[i]    = -state->Ns[i];
+            dNdx[i] = -state->dNdx[i];
+            dNdy[i] = -state->dNdy[i];
+        }
+    }
+
+    k = 1.0 - (e * e) * (1.0 - cos1 * cos1);
+    if (k <= 0.0) {
+        /* ri_refract() reflects the ray for total internal reflection. */
+        ri_intersection_state_reflect_differentials( ray_inout, state );
+        return;
+    }
+
+    /*
+     * T = e D + mu N, mu = e cos1 - cos2, cos1 = -D.N,
+     * cos2 = sqrt(1 - e^2 (1 - cos1^2))
+     *
+     * dT/dx = e dD/dx + mu dN/dx + dmu/dx N,
+     * dmu/dx = (e - e^2 cos1 / cos2) dcos1/dx
+     */
+    cos2 = sqrt(k);
+    mu   = e * cos1 - cos2;
+
+    dcdx = -(ri_vector_dot( state->dDdx, N ) + ri_vector_dot( D, dNdx ));
+    dcdy = -(ri_vector_dot( state->dDdy, N ) + ri_vector_dot( D, dNdy ));
+
+    dmudx = (e - e * e * cos1 / cos2) * dcdx;
+    dmudy = (e - e * e * cos1 / cos2) * dcdy;
+
+    for (i = 0; i < 3; i++) {
+        ray_inout->dPdx[i] = state->dPdx[i];
+        ray_inout->dPdy[i] = state->dPdy[i];
+        ray_inout->dDdx[i] = e * state->dDdx[i] + mu * dNdx[i] + dmudx * N[i];
+        ray_inout->dDdy[i] = e * state->dDdy[i] + mu * dNdy[i] + dmudy * N[i];
+    }
 }
 
 void
@@ -263,6 +375,135 @@ ri_intersection_state_clear(
  *
  * ------------------------------------------------------------------------- */
 
+/*
+ * Transfers the ray differentials to the hit point(Igehy 99), and derives
+ * the differentials of the barycentric coord, the texture coord and the
+ * shading normal from them.
+ */
+static void
+transfer_differentials(
+    ri_intersection_state_t *state_inout,
+    const ri_ray_t          *ray)
+{
+    int          i;
+    ri_float_t   DN;
+    ri_float_t   dtdx, dtdy;
+    ri_float_t   a00, a01, a11, det;
+    ri_float_t   bx0, bx1, by0, by1;
+    ri_vector_t  e1, e2;
+    uint32_t     i0, i1, i2;
+    ri_float_t   t;
+    uint32_t     index;
+    ri_geom_t   *geom;
+    const ri_float_t *st0, *st1, *st2;
+
+    state_inout->has_differentials = 0;
+
+    ri_vector_setzero( state_inout->dPdx );
+    ri_vector_setzero( state_inout->dPdy );
+    ri_vector_setzero( state_inout->dNdx );
+    ri_vector_setzero( state_inout->dNdy );
+    ri_vector_setzero( state_inout->dDdx );
+    ri_vector_setzero( state_inout->dDdy );
+    state_inout->dudx = state_inout->dvdx = 0.0;
+    state_inout->dudy = state_inout->dvdy = 0.0;
+    state_inout->dsdx = state_inout->dtdx = 0.0;
+    state_inout->dsdy = state_inout->dtdy = 0.0;
+
+    if (!ray->has_differentials) return;
+
+    DN = ri_vector_dot( ray->dir, state_inout->Ng );
+    if (fabs(DN) < 1.0e-8) return;  /* grazing */
+
+    t = state_inout->t;
+
+    /*
+     * P' = P + t dD + dt D, where dt is chosen to keep P' on the plane
+     * of the triangle.
+     */
+    dtdx = -( ri_vector_dot( ray->dPdx, state_inout->Ng ) +
+              t * ri_vector_dot( ray->dDdx, state_inout->Ng ) ) / DN;
+    dtdy = -( ri_vector_dot( ray->dPdy, state_inout->Ng ) +
+              t * ri_vector_dot( ray->dDdy, state_inout->Ng ) ) / DN;
+
+    for (i = 0; i < 3; i++) {
+        state_inout->dPdx[i] = ray->dPdx[i] + t * ray->dDdx[i]
+                             + dtdx * ray->dir[i];
+        state_inout->dPdy[i] = ray->dPdy[i] + t * ray->dDdy[i]
+                             + dtdy * ray->dir[i];
+    }
+
+    ri_vector_copy( state_inout->dDdx, ray->dDdx );
+    ri_vector_copy( state_inout->dDdy, ray->dDdy );
+
+    /*
+     * Solve dP = du (p1 - p0) + dv (p2 - p0) in the least squares sense.
+     */
+    geom  = state_inout->geom;
+    index = state_inout->index;
+
+    i0 = geom->indices[index + 0];
+    i1 = geom->indices[index + 1];
+    i2 = geom->indices[index + 2];
+
+    ri_vector_sub( e1, geom->positions[i1], geom->positions[i0] );
+    ri_vector_sub( e2, geom->positions[i2], geom->positions[i0] );
+
+    a00 = ri_vector_dot( e1, e1 );
+    a01 = ri_vector_dot( e1, e2 );
+    a11 = ri_vector_dot( e2, e2 );
+    det = a00 * a11 - a01 * a01;
+
+    if (fabs(det) < 1.0e-20) return;    /* degenerated */
+
+    bx0 = ri_vector_dot( e1, state_inout->dPdx );
+    bx1 = ri_vector_dot( e2, state_inout->dPdx );
+    by0 = ri_vector_dot( e1, state_inout->dPdy );
+    by1 = ri_vector_dot( e2, state_inout->dPdy );
+
+    state_inout->dudx = ( a11 * bx0 - a01 * bx1 ) / det;
+    state_inout->dvdx = ( a00 * bx1 - a01 * bx0 ) / det;
+    state_inout->dudy = ( a11 * by0 - a01 * by1 ) / det;
+    state_inout->dvdy = ( a00 * by1 - a01 * by0 ) / det;
+
+    if (geom->normals) {
+        for (i = 0; i < 3; i++) {
+            e1[i] = geom->normals[i1][i] - geom->normals[i0][i];
+            e2[i] = geom->normals[i2][i] - geom->normals[i0][i];
+
+            state_inout->dNdx[i] = state_inout->dudx * e1[i]
+                                 + state_inout->dvdx * e2[i];
+            state_inout->dNdy[i] = state_inout->dudy * e1[i]
+                                 + state_inout->dvdy * e2[i];
+        }
+    }
+
+    st0 = st1 = st2 = NULL;
+
+    if (geom->texcoords) {
+        st0 = (const ri_float_t *)&geom->texcoords[2 * i0];
+        st1 = (const ri_float_t *)&geom->texcoords[2 * i1];
+        st2 = (const ri_float_t *)&geom->texcoords[2 * i2];
+    } else if (geom->texcoords_unshared) {
+        st0 = (const ri_float_t *)&geom->texcoords_unshared[2 * (index + 0)];
+        st1 = (const ri_float_t *)&geom->texcoords_unshared[2 * (index + 1)];
+        st2 = (const ri_float_t *)&geom->texcoords_unshared[2 * (index + 2)];
+    }
+
+    if (st0) {
+        state_inout->dsdx = state_inout->dudx * (st1[0] - st0[0])
+                          + state_inout->dvdx * (st2[0] - st0[0]);
+        state_inout->dtdx = state_inout->dudx * (st1[1] - st0[1])
+                          + state_inout->dvdx * (st2[1] - st0[1]);
+        state_inout->dsdy = state_inout->dudy * (st1[0] - st0[0])
+                          + state_inout->dvdy * (st2[0] - st0[0]);
+        state_inout->dtdy = state_inout->dudy * (st1[1] - st0[1])
+                          + state_inout->dvdy * (st2[1] - st0[1]);
+    }
+
+    state_inout->has_differentials = 1;
+}
+
 void
 lerp_uv(
     ri_float_t *newu,
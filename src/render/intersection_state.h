@@ -21,6 +21,7 @@ extern "C"
 #include "vector.h"
 #include "brdf.h"
 #include "geom.h"
+#include "ray.h"
 
 
 /*
@@ -58,6 +59,20 @@ typedef struct _ri_intersection_state_t {
 
     ri_float_t      u, v;           /* barycentric coord            */
 
+    /*
+     * Differentials w.r.t. the screen x and y, transferred from the ray
+     * differentials. All zero if the ray has no differentials.
+     */
+    char            has_differentials;
+
+    ri_vector_t     dPdx, dPdy;     /* position                     */
+    ri_vector_t     dNdx, dNdy;     /* shading normal               */
+    ri_vector_t     dDdx, dDdy;     /* ray direction                */
+    ri_float_t      dudx, dvdx;     /* barycentric coord            */
+    ri_float_t      dudy, dvdy;
+    ri_float_t      dsdx, dtdx;     /* texture coord(stqr[0..1])    */
+    ri_float_t      dsdy, dtdy;
+
 } ri_intersection_state_t;
 
 extern ri_intersection_state_t *ri_intersection_state_new();
@@ -68,8 +83,24 @@ extern void                     ri_intersection_state_clear(
 
 extern void                     ri_intersection_state_build(
     ri_intersection_state_t *state_inout,   /* [inout] */
-    const ri_vector_t        eye,
-    const ri_vector_t        dir);
+    const ri_ray_t          *ray);
+
+/*
+ * Sets the differentials of the ray reflected at the hit point. `ray_inout'
+ * must have its origin and direction set already. Does nothing but
+ * clearing has_differentials if the state has no differentials.
+ */
+extern void                     ri_intersection_state_reflect_differentials(
+    ri_ray_t                      *ray_inout,   /* [inout] */
+    const ri_intersection_state_t *state);
+
+/*
+ * Same as above for the ray refracted by ri_refract() with `eta'.
+ */
+extern void                     ri_intersection_state_refract_differentials(
+    ri_ray_t                      *ray_inout,   /* [inout] */
+    const ri_intersection_state_t *state,
+    ri_float_t                     eta);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,747 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Irradiance cache.
+ *
+ * References:
+ *
+ *   Gregory J. Ward, Francis M. Rubinstein and Robert D. Clear,
+ *   "A Ray Tracing Solution for Diffuse Interreflection",
+ *   SIGGRAPH 88.
+ *
+ *   Gregory J. Ward and Paul S. Heckbert,
+ *   "Irradiance Gradients",
+ *   Eurographics Workshop on Rendering 1992.
+ *
+ *   Jaroslav Krivanek et al.,
+ *   "Practical Global Illumination with Irradiance Caching",
+ *   SIGGRAPH 2008 course.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "irradcache.h"
+
+#include "memory.h"
+#include "log.h"
+#include "atomic.h"
+#include "random.h"
+#include "render.h"
+#include "raytrace.h"
+#include "reflection.h"
+#include "profile.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/*
+ * Size of a memory block for records and nodes.
+ */
+#define IRRADCACHE_BLOCK_SIZE       (256 * 1024)
+
+/*
+ * The octree is not subdivided below this depth.
+ */
+#define IRRADCACHE_MAX_DEPTH        20
+
+/*
+ * A record is not used at points which are in front of it by more than
+ * IRRADCACHE_FRONT_TOLERANCE * R. Such a record lies in a crease below the
+ * point, and is darker than the point.
+ */
+#define IRRADCACHE_FRONT_TOLERANCE  0.05
+
+/* ---------------------------------------------------------------------------
+ *
+ * Private functions
+ *
+ * ------------------------------------------------------------------------ */
+
+/*
+ * Allocates memory for a record or a node. Must be called with the lock.
+ */
+static void *
+block_alloc(
+    ri_irradcache_t *cache,
+    size_t           size)
+{
+    void   *p;
+    char   *block;
+    size_t  header;
+
+    size = (size + 15) & ~((size_t)15);
+
+    if (cache->left < size) {
+
+        header = 16;        /* link to the previous block */
+
+        block = (char *)ri_mem_alloc(IRRADCACHE_BLOCK_SIZE);
+        *(void **)block = cache->blocks;
+        cache->blocks   = block;
+
+        cache->curr     = block + header;
+        cache->left     = IRRADCACHE_BLOCK_SIZE - header;
+    }
+
+    p = cache->curr;
+
+    cache->curr += size;
+    cache->left -= size;
+
+    return p;
+}
+
+static ri_irradcache_node_t *
+node_new(
+    ri_irradcache_t   *cache,
+    const ri_vector_t  center,
+    ri_float_t         size)
+{
+    ri_irradcache_node_t *node;
+
+    node = (ri_irradcache_node_t *)block_alloc(cache,
+                                               sizeof(ri_irradcache_node_t));
+    memset(node, 0, sizeof(ri_irradcache_node_t));
+
+    ri_vector_copy(node->center, center);
+    node->size = size;
+
+    return node;
+}
+
+/*
+ * Accumulates weighted records of `node' and its descendants around P.
+ */
+static void
+lookup_node(
+    const ri_irradcache_t      *cache,
+    const ri_irradcache_node_t *node,
+    const ri_vector_t           P,
+    const ri_vector_t           N,
+    ri_vector_t                 E,                  /* [inout]  */
+    ri_float_t                 *wsum)               /* [inout]  */
+{
+    int                           k;
+    ri_float_t                    dot;
+    ri_float_t                    dist;
+    ri_float_t                    err;
+    ri_float_t                    w;
+    ri_float_t                    d;
+    ri_float_t                    e;
+    ri_vector_t                   D;
+    ri_vector_t                   NxN;
+    const ri_irradcache_record_t *rec;
+
+    for (rec = node->records; rec != NULL; rec = rec->next) {
+
+        dot = N[0] * rec->N[0] + N[1] * rec->N[1] + N[2] * rec->N[2];
+        if (dot <= 0.0) continue;
+
+        D[0] = P[0] - rec->P[0];
+        D[1] = P[1] - rec->P[1];
+        D[2] = P[2] - rec->P[2];
+
+        /*
+         * Ward's error estimate of using the record at (P, N).
+         */
+        dist = sqrt(D[0] * D[0] + D[1] * D[1] + D[2] * D[2]);
+        err  = dist / rec->R + sqrt(1.0 - (dot > 1.0 ? 1.0 : dot));
+
+        if (err >= cache->a) continue;
+
+        /* Is P in front of the record? */
+        d = 0.5 * (D[0] * (N[0] + rec->N[0]) +
+                   D[1] * (N[1] + rec->N[1]) +
+                   D[2] * (N[2] + rec->N[2]));
+        if (d > IRRADCACHE_FRONT_TOLERANCE * rec->R) continue;
+
+        /*
+         * The weight falls to zero at the border of the valid region,
+         * which avoids discontinuities of Ward's 1 / err weight.
+         */
+        w = 1.0 - err / cache->a;
+
+        /* N_i x N for the rotational gradient */
+        NxN[0] = rec->N[1] * N[2] - rec->N[2] * N[1];
+        NxN[1] = rec->N[2] * N[0] - rec->N[0] * N[2];
+        NxN[2] = rec->N[0] * N[1] - rec->N[1] * N[0];
+
+        for (k = 0; k < 3; k++) {
+            e = rec->E[k]
+              + vdot(NxN, rec->grad_r[k])
+              + vdot(D,   rec->grad_t[k]);
+
+            if (e < 0.0) e = 0.0;
+
+            E[k] += w * e;
+        }
+
+        (*wsum) += w;
+    }
+}
+
+static void
+lookup_tree(
+    const ri_irradcache_t      *cache,
+    const ri_irradcache_node_t *node,
+    const ri_vector_t           P,
+    const ri_vector_t           N,
+    ri_vector_t                 E,                  /* [inout]  */
+    ri_float_t                 *wsum)               /* [inout]  */
+{
+    int                         i;
+    ri_float_t                  ext;
+    const ri_irradcache_node_t *child;
+
+    lookup_node(cache, node, P, N, E, wsum);
+
+    for (i = 0; i < 8; i++) {
+
+        child = node->children[i];
+        if (child == NULL) continue;
+
+        /*
+         * Records in the child lie in the cube and are valid within
+         * `size' from them.
+         */
+        ext = 2.0 * child->size;
+
+        if (fabs(P[0] - child->center[0]) > ext) continue;
+        if (fabs(P[1] - child->center[1]) > ext) continue;
+        if (fabs(P[2] - child->center[2]) > ext) continue;
+
+        lookup_tree(cache, child, P, N, E, wsum);
+    }
+}
+
+/*
+ * Computes translational and rotational gradients of the cosine weighted
+ * mean radiance from stratified samples [Ward and Heckbert 1992].
+ * L[k * ntheta + j] and R[k * ntheta + j] are the radiance and the hit
+ * distance of the sample in the j'th theta and the k'th phi stratum.
+ * Gradients are in the local frame whose z axis is the normal.
+ */
+static void
+compute_gradients(
+    ri_vector_t        grad_t[3],                   /* [out]    */
+    ri_vector_t        grad_r[3],                   /* [out]    */
+    const ri_vector_t *L,
+    const ri_float_t  *R,
+    int                ntheta,
+    int                nphi)
+{
+    int         j, k, km;
+    int         c;
+    int         s, sm;
+    ri_float_t  phi;
+    ri_float_t  sin_tm, cos_tm, cos_tp;
+    ri_float_t  sin_tc, cos_tc;
+    ri_float_t  rmin;
+    ri_float_t  coeff;
+    ri_vector_t u, v;               /* u_k and v_k^- in the local frame */
+    ri_vector_t vc;                 /* v_k at the center of the stratum */
+    ri_vector_t sum_u, sum_v, sum_r;
+
+    for (c = 0; c < 3; c++) {
+        ri_vector_setzero(grad_t[c]);
+        ri_vector_setzero(grad_r[c]);
+    }
+
+    for (k = 0; k < nphi; k++) {
+
+        km = (k + nphi - 1) % nphi;
+
+        phi   = 2.0 * M_PI * (k + 0.5) / (ri_float_t)nphi;
+        u[0]  = cos(phi);
+        u[1]  = sin(phi);
+        u[2]  = 0.0;
+
+        vc[0] = -sin(phi);
+        vc[1] =  cos(phi);
+        vc[2] =  0.0;
+
+        phi   = 2.0 * M_PI * k / (ri_float_t)nphi;
+        v[0]  = -sin(phi);
+        v[1]  =  cos(phi);
+        v[2]  =  0.0;
+
+        ri_vector_setzero(sum_u);
+        ri_vector_setzero(sum_v);
+        ri_vector_setzero(sum_r);
+
+        for (j = 0; j < ntheta; j++) {
+
+            s  = k  * ntheta + j;
+            sm = km * ntheta + j;
+
+            /* theta_j^- and theta_j^+ are borders of the stratum. */
+            sin_tm = sqrt(j / (ri_float_t)ntheta);
+            cos_tm = sqrt(1.0 - j / (ri_float_t)ntheta);
+            cos_tp = sqrt(1.0 - (j + 1) / (ri_float_t)ntheta);
+
+            sin_tc = sqrt((j + 0.5) / (ri_float_t)ntheta);
+            cos_tc = sqrt(1.0 - (j + 0.5) / (ri_float_t)ntheta);
+
+            /* Change across the border between theta strata. */
+            if (j > 0) {
+                rmin  = R[s] < R[s - 1] ? R[s] : R[s - 1];
+                coeff = sin_tm * cos_tm * cos_tm / rmin;
+
+                for (c = 0; c < 3; c++) {
+                    sum_u[c] += coeff * (L[s][c] - L[s - 1][c]);
+                }
+            }
+
+            /* Change across the border between phi strata. */
+            rmin  = R[s] < R[sm] ? R[s] : R[sm];
+            coeff = (cos_tm - cos_tp) / (sin_tc * rmin);
+
+            for (c = 0; c < 3; c++) {
+                sum_v[c] += coeff * (L[s][c] - L[sm][c]);
+                sum_r[c] -= (sin_tc / cos_tc) * L[s][c];
+            }
+        }
+
+        for (c = 0; c < 3; c++) {
+            grad_t[c][0] += u[0] * (2.0 * M_PI / nphi) * sum_u[c]
+                          + v[0] * sum_v[c];
+            grad_t[c][1] += u[1] * (2.0 * M_PI / nphi) * sum_u[c]
+                          + v[1] * sum_v[c];
+
+            grad_r[c][0] += vc[0] * sum_r[c];
+            grad_r[c][1] += vc[1] * sum_r[c];
+        }
+    }
+
+    /*
+     * The formulas are for the irradiance E = pi / (M N) sum L. Scale them
+     * for the mean radiance(1 / (M N) sum L).
+     */
+    for (c = 0; c < 3; c++) {
+        ri_vector_scale(grad_t[c], grad_t[c], 1.0 / M_PI);
+        ri_vector_scale(grad_r[c], grad_r[c], 1.0 / (ntheta * nphi));
+    }
+}
+
+static void
+local_to_world(
+    ri_vector_t        out,
+    const ri_vector_t  in,
+    const ri_vector_t  basis[3])
+{
+    int k;
+
+    for (k = 0; k < 3; k++) {
+        out[k] = in[0] * basis[0][k]
+               + in[1] * basis[1][k]
+               + in[2] * basis[2][k];
+    }
+}
+
+static void
+dump_node(
+    FILE                       *fp,
+    const ri_irradcache_node_t *node)
+{
+    int                           i;
+    ri_float_t                    lum_t[3], lum_r[3];
+    const ri_irradcache_record_t *rec;
+
+    for (rec = node->records; rec != NULL; rec = rec->next) {
+
+        /*
+         * icview shows a gradient per record. Write the mean of the
+         * gradients of RGB.
+         */
+        for (i = 0; i < 3; i++) {
+            lum_t[i] = (rec->grad_t[0][i] + rec->grad_t[1][i] +
+                        rec->grad_t[2][i]) / 3.0;
+            lum_r[i] = (rec->grad_r[0][i] + rec->grad_r[1][i] +
+                        rec->grad_r[2][i]) / 3.0;
+        }
+
+        fprintf(fp, "%f %f %f\n", rec->P[0], rec->P[1], rec->P[2]);
+        fprintf(fp, "%f %f %f\n", rec->N[0], rec->N[1], rec->N[2]);
+        fprintf(fp, "%f %f %f\n", rec->E[0], rec->E[1], rec->E[2]);
+        fprintf(fp, "%f %f %f\n", lum_t[0], lum_t[1], lum_t[2]);
+        fprintf(fp, "%f %f %f\n", lum_r[0], lum_r[1], lum_r[2]);
+        fprintf(fp, "%f\n", rec->R);
+    }
+
+    for (i = 0; i < 8; i++) {
+        if (node->children[i]) dump_node(fp, node->children[i]);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ *
+ * Public functions
+ *
+ * ------------------------------------------------------------------------ */
+
+ri_irradcache_t *
+ri_irradcache_new(
+    const ri_vector_t  bmin,
+    const ri_vector_t  bmax,
+    ri_float_t         a,
+    ri_float_t         rmin,
+    ri_float_t         rmax)
+{
+    int              i;
+    ri_float_t       size;
+    ri_vector_t      center;
+    ri_irradcache_t *cache;
+
+    cache = (ri_irradcache_t *)ri_mem_alloc(sizeof(ri_irradcache_t));
+    memset(cache, 0, sizeof(ri_irradcache_t));
+
+    cache->a        = a;
+    cache->rmin     = rmin;
+    cache->rmax     = rmax;
+    cache->mutex    = ri_mutex_new();
+    ri_mutex_init(cache->mutex);
+
+    /*
+     * The root is a cube which encloses the box.
+     */
+    size = 0.0;
+    for (i = 0; i < 3; i++) {
+        center[i] = 0.5 * (bmin[i] + bmax[i]);
+        if (size < 0.5 * (bmax[i] - bmin[i])) {
+            size = 0.5 * (bmax[i] - bmin[i]);
+        }
+    }
+    center[3] = 0.0;
+
+    /* Leave a margin for points on the border. */
+    size = 1.01 * size + 1.0e-6;
+
+    cache->root = node_new(cache, center, size);
+
+    return cache;
+}
+
+void
+ri_irradcache_free(
+    ri_irradcache_t   *cache)
+{
+    void *block;
+    void *next;
+
+    if (cache == NULL) return;
+
+    for (block = cache->blocks; block != NULL; block = next) {
+        next = *(void **)block;
+        ri_mem_free(block);
+    }
+
+    ri_mutex_free(cache->mutex);
+
+    ri_mem_free(cache);
+}
+
+int
+ri_irradcache_lookup(
+    ri_irradcache_t   *cache,
+    ri_vector_t        E,
+    const ri_vector_t  P,
+    const ri_vector_t  N)
+{
+    ri_float_t  wsum = 0.0;
+    ri_vector_t sum;
+
+    ri_prof_inc(RI_PROF_NIRRADCACHE_LOOKUPS);
+
+    ri_vector_setzero(sum);
+
+    lookup_tree(cache, cache->root, P, N, sum, &wsum);
+
+    if (wsum <= 0.0) {
+        return 0;
+    }
+
+    E[0] = sum[0] / wsum;
+    E[1] = sum[1] / wsum;
+    E[2] = sum[2] / wsum;
+
+    ri_prof_inc(RI_PROF_NIRRADCACHE_HITS);
+
+    return 1;
+}
+
+void
+ri_irradcache_insert(
+    ri_irradcache_t   *cache,
+    const ri_irradcache_record_t *record)
+{
+    int                     i;
+    int                     depth;
+    int                     idx;
+    ri_float_t              radius;
+    ri_float_t              half;
+    ri_vector_t             center;
+    ri_irradcache_node_t   *node;
+    ri_irradcache_node_t   *child;
+    ri_irradcache_record_t *rec;
+
+    /* The record is used within a * R from it. */
+    radius = cache->a * record->R;
+
+    ri_mutex_lock(cache->mutex);
+
+    /*
+     * Go down while the child is large enough for the valid region of the
+     * record.
+     */
+    node  = cache->root;
+    depth = 0;
+
+    while ((depth < IRRADCACHE_MAX_DEPTH) && (0.5 * node->size >= radius)) {
+
+        idx = 0;
+        for (i = 0; i < 3; i++) {
+            if (record->P[i] > node->center[i]) idx |= (1 << i);
+        }
+
+        /* Records outside of the root stay in the root. */
+        if (depth == 0) {
+            if (fabs(record->P[0] - node->center[0]) > node->size) break;
+            if (fabs(record->P[1] - node->center[1]) > node->size) break;
+            if (fabs(record->P[2] - node->center[2]) > node->size) break;
+        }
+
+        child = node->children[idx];
+
+        if (child == NULL) {
+
+            half = 0.5 * node->size;
+            for (i = 0; i < 3; i++) {
+                center[i] = node->center[i] + ((idx & (1 << i)) ? half : -half);
+            }
+            center[3] = 0.0;
+
+            child = node_new(cache, center, half);
+
+            /* Publish the node after it is initialized. */
+            ri_atomic_fence();
+            node->children[idx] = child;
+        }
+
+        node = child;
+        depth++;
+    }
+
+    rec = (ri_irradcache_record_t *)block_alloc(cache,
+                                         sizeof(ri_irradcache_record_t));
+    memcpy(rec, record, sizeof(ri_irradcache_record_t));
+
+    rec->next = node->records;
+
+    /* Publish the record after it is initialized. */
+    ri_atomic_fence();
+    node->records = rec;
+
+    cache->nrecords++;
+
+    ri_mutex_unlock(cache->mutex);
+}
+
+void
+ri_irradcache_gather(
+    ri_irradcache_t   *cache,
+    ri_vector_t        E,
+    const ri_ray_t    *inray,
+    const ri_vector_t  P,
+    const ri_vector_t  N,
+    int                ntheta,
+    int                nphi,
+    ri_irradcache_radiance_func radiance,
+    void              *data)
+{
+    int                     i, j, k;
+    int                     s;
+    int                     hit;
+    int                     thread_id;
+    int                     nsamples;
+
+    ri_float_t              z0, z1;
+    ri_float_t              sin_theta, phi;
+    ri_float_t              rsum;
+    ri_float_t              lum, lumgrad;
+    ri_float_t              eps = 1.0e-5;
+
+    ri_vector_t             dir;
+    ri_vector_t             basis[3];
+    ri_vector_t             grad_t[3];
+    ri_vector_t             grad_r[3];
+
+    ri_vector_t             L[RI_IRRADCACHE_MAX_SAMPLES];
+    ri_float_t              R[RI_IRRADCACHE_MAX_SAMPLES];
+
+    ri_ray_t                ray;
+    ri_intersection_state_t state;
+    ri_irradcache_record_t  rec;
+
+    if (ri_irradcache_lookup(cache, E, P, N)) {
+        return;
+    }
+
+    if (ntheta < 1) ntheta = 1;
+    if (nphi   < 1) nphi   = 1;
+
+    while (ntheta * nphi > RI_IRRADCACHE_MAX_SAMPLES) {
+        if (ntheta > 1) ntheta--;
+        if (nphi   > 1) nphi--;
+    }
+
+    nsamples = ntheta * nphi;
+
+    ri_ortho_basis(basis, N);
+
+    ri_ray_copy(&ray, inray);
+    ray.has_differentials = 0;      /* gather rays have no footprint */
+
+    /*
+     * Slightly move the shading point towards the surface normal.
+     * FIXME: Choose eps relative to scene scale, not as an absolute value.
+     */
+    ray.org[0] = P[0] + N[0] * eps;
+    ray.org[1] = P[1] + N[1] * eps;
+    ray.org[2] = P[2] + N[2] * eps;
+
+    thread_id = inray->thread_num;
+
+    /*
+     * Cosine weighted stratified sampling. Hit distances are needed for
+     * the record, so rays are traced to the closest hit.
+     */
+    for (k = 0; k < nphi; k++) {
+        for (j = 0; j < ntheta; j++) {
+
+            z0 = (j + randomMT2(thread_id)) / (ri_float_t)ntheta;
+            z1 = (k + randomMT2(thread_id)) / (ri_float_t)nphi;
+
+            sin_theta = sqrt(z0);
+            phi       = 2.0 * M_PI * z1;
+
+            dir[0]    = cos(phi) * sin_theta;
+            dir[1]    = sin(phi) * sin_theta;
+            dir[2]    = sqrt(1.0 - z0);
+
+            local_to_world(ray.dir, dir, basis);
+
+            hit = ri_raytrace(ri_render_get(), &ray, &state);
+
+            s = k * ntheta + j;
+
+            radiance(L[s], &ray, hit, &state, data);
+
+            R[s] = hit ? state.t : RI_INFINITY;
+            if (R[s] < cache->rmin) R[s] = cache->rmin;
+        }
+    }
+
+    ri_prof_add(RI_PROF_NHEMISPHERE_RAYS, nsamples);
+
+    ri_vector_setzero(rec.E);
+    rsum = 0.0;
+
+    for (s = 0; s < nsamples; s++) {
+        ri_vector_add(rec.E, rec.E, L[s]);
+        if (R[s] < RI_INFINITY) rsum += 1.0 / R[s];
+    }
+
+    ri_vector_scale(rec.E, rec.E, 1.0 / (ri_float_t)nsamples);
+
+    /*
+     * Gradients can't be computed from a single stratum.
+     */
+    if (ntheta > 1 && nphi > 1) {
+        compute_gradients(grad_t, grad_r, L, R, ntheta, nphi);
+    } else {
+        for (i = 0; i < 3; i++) {
+            ri_vector_setzero(grad_t[i]);
+            ri_vector_setzero(grad_r[i]);
+        }
+    }
+
+    /*
+     * Harmonic mean distance, clamped into [rmin, rmax]. It is also
+     * limited so that the translational gradient doesn't extrapolate
+     * below zero within the record.
+     */
+    rec.R = (rsum > 0.0) ? (nsamples / rsum) : cache->rmax;
+
+    lum     = (rec.E[0] + rec.E[1] + rec.E[2]) / 3.0;
+    lumgrad = 0.0;
+    for (i = 0; i < 3; i++) {
+        dir[i] = (grad_t[0][i] + grad_t[1][i] + grad_t[2][i]) / 3.0;
+        lumgrad += dir[i] * dir[i];
+    }
+    lumgrad = sqrt(lumgrad);
+
+    if (lumgrad * rec.R > lum && lumgrad > 0.0) {
+        rec.R = lum / lumgrad;
+    }
+
+    if (rec.R < cache->rmin) rec.R = cache->rmin;
+    if (rec.R > cache->rmax) rec.R = cache->rmax;
+
+    vcpy(rec.P, P);
+    vcpy(rec.N, N);
+    rec.P[3] = rec.N[3] = 0.0;
+    rec.E[3] = 0.0;
+
+    for (i = 0; i < 3; i++) {
+        local_to_world(rec.grad_t[i], grad_t[i], basis);
+        local_to_world(rec.grad_r[i], grad_r[i], basis);
+        rec.grad_t[i][3] = rec.grad_r[i][3] = 0.0;
+    }
+
+    rec.next = NULL;
+
+    ri_irradcache_insert(cache, &rec);
+
+    ri_vector_copy(E, rec.E);
+}
+
+int
+ri_irradcache_dump(
+    const ri_irradcache_t *cache,
+    const char        *filename)
+{
+    FILE *fp;
+
+    fp = fopen(filename, "w");
+    if (!fp) {
+        ri_log(LOG_WARN, "(IrradCache) Can't open file \"%s\"", filename);
+        return -1;
+    }
+
+    fprintf(fp, "%d\n", cache->nrecords);
+
+    dump_node(fp, cache->root);
+
+    fclose(fp);
+
+    ri_log(LOG_INFO, "(IrradCache) Saved %d records to \"%s\"",
+           cache->nrecords, filename);
+
+    return 0;
+}
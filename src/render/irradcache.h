@@ -0,0 +1,161 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Irradiance cache.
+ *
+ * Hemisphere gathering(ambient occlusion, dome light, final gathering) is
+ * done at sparse points only, and the result is interpolated between them
+ * as in [Ward 1988]. Each record keeps the translational and rotational
+ * gradients of [Ward and Heckbert 1992] for better interpolation.
+ *
+ * Records are stored in an octree. A record is put in the node whose width
+ * is about the size of the record's valid region. Lookups don't take a
+ * lock: a record or a node is fully written before it is linked to the
+ * tree, so readers see either the old or the new list. Insertions are
+ * serialized by the mutex.
+ *
+ * $Id$
+ */
+
+#ifndef LUCILLE_IRRADCACHE_H
+#define LUCILLE_IRRADCACHE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "vector.h"
+#include "thread.h"
+#include "ray.h"
+#include "intersection_state.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Max number of hemisphere samples(ntheta x nphi) for a record.
+ */
+#define RI_IRRADCACHE_MAX_SAMPLES   1024
+
+typedef struct _ri_irradcache_record_t {
+
+    ri_vector_t     P;                  /* position                     */
+    ri_vector_t     N;                  /* normal                       */
+    ri_vector_t     E;                  /* cosine weighted mean of the
+                                         * incident radiance            */
+    ri_vector_t     grad_t[3];          /* translational gradient of
+                                         * E[0], E[1] and E[2]          */
+    ri_vector_t     grad_r[3];          /* rotational gradient          */
+    ri_float_t      R;                  /* harmonic mean distance to the
+                                         * surroundings(clamped)        */
+
+    struct _ri_irradcache_record_t * volatile next;
+
+} ri_irradcache_record_t;
+
+typedef struct _ri_irradcache_node_t {
+
+    ri_vector_t     center;
+    ri_float_t      size;               /* half width of the cube       */
+
+    struct _ri_irradcache_node_t * volatile children[8];
+    ri_irradcache_record_t       * volatile records;
+
+} ri_irradcache_node_t;
+
+/*
+ * Computes incident radiance `L' from the direction of `ray'. `state' is
+ * valid only if `hit' is nonzero.
+ */
+typedef void (*ri_irradcache_radiance_func)(
+    ri_vector_t                    L,               /* [out]    */
+    const ri_ray_t                *ray,
+    int                            hit,
+    const ri_intersection_state_t *state,
+    void                          *data);
+
+typedef struct _ri_irradcache_t {
+
+    ri_irradcache_node_t   *root;
+
+    ri_float_t              a;          /* allowed error                */
+    ri_float_t              rmin;       /* clamping range of R          */
+    ri_float_t              rmax;
+
+    int                     nrecords;
+
+    /*
+     * Records and nodes are allocated from blocks, and freed all at once.
+     */
+    void                   *blocks;
+    char                   *curr;
+    size_t                  left;
+
+    ri_mutex_t             *mutex;
+
+} ri_irradcache_t;
+
+/*
+ * Creates an empty cache covering the box [bmin, bmax]. `a' is the allowed
+ * error of the interpolation. Record radii are clamped into
+ * [rmin, rmax].
+ */
+extern ri_irradcache_t *ri_irradcache_new(
+    const ri_vector_t  bmin,
+    const ri_vector_t  bmax,
+    ri_float_t         a,
+    ri_float_t         rmin,
+    ri_float_t         rmax);
+
+extern void ri_irradcache_free(
+    ri_irradcache_t   *cache);
+
+/*
+ * Interpolates records around (P, N). Returns 1 and E if there is a valid
+ * record, 0 if not.
+ */
+extern int  ri_irradcache_lookup(
+    ri_irradcache_t   *cache,
+    ri_vector_t        E,                               /* [out]    */
+    const ri_vector_t  P,
+    const ri_vector_t  N);
+
+extern void ri_irradcache_insert(
+    ri_irradcache_t   *cache,                           /* [inout]  */
+    const ri_irradcache_record_t *record);
+
+/*
+ * Returns the cosine weighted mean of the incident radiance over the
+ * hemisphere at (P, N), interpolated from the cache if possible. If not,
+ * the hemisphere is sampled with ntheta x nphi stratified rays, whose
+ * radiance is given by `radiance', and a new record is added.
+ */
+extern void ri_irradcache_gather(
+    ri_irradcache_t   *cache,                           /* [inout]  */
+    ri_vector_t        E,                               /* [out]    */
+    const ri_ray_t    *inray,
+    const ri_vector_t  P,
+    const ri_vector_t  N,
+    int                ntheta,
+    int                nphi,
+    ri_irradcache_radiance_func radiance,
+    void              *data);
+
+/*
+ * Writes records in the text format of tools/icview.
+ */
+extern int  ri_irradcache_dump(
+    const ri_irradcache_t *cache,
+    const char        *filename);
+
+#ifdef __cplusplus
+}    /* extern "C" */
+#endif
+
+#endif    /* LUCILLE_IRRADCACHE_H */
@@ -21,6 +21,7 @@
 #include "qmc.h"
 #include "option.h"
 #include "sunsky.h"
+#include "ibl.h"
 
 ri_light_t *
 ri_light_new()
@@ -90,6 +91,7 @@ ri_light_new()
     light->iblsampler = IBL_SAMPLING_COSWEIGHT;
 
     light->sisfile = NULL;
+    light->ibltable = NULL;
 
     light->geom = NULL;
 
@@ -100,6 +102,7 @@ void
 ri_light_free(ri_light_t *light)
 {
     ri_mem_free(light->sisfile);
+    ri_ibl_table_free(light->ibltable);
     ri_geom_free(light->geom);
     ri_mem_free(light);
 }
@@ -53,6 +53,8 @@ typedef struct _ri_light_t
 
     char           *eihdrifile;         /* for EIHDRI smpling.              */
     int             iblsampler;         /* IBL sampling method              */
+    struct _ri_ibl_table_t
+                   *ibltable;           /* precomputed IBL sampling table   */
 
     /*
      * For sunsky
@@ -0,0 +1,825 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * BVH for motion blur.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "memory.h"
+#include "log.h"
+#include "list.h"
+#include "render.h"
+#include "scene.h"
+#include "bvh.h"
+#include "motionbvh.h"
+
+#define MOTION_BVH_NLEAF        4       /* # of triangles to stop split */
+#define MOTION_BVH_MAXLEAF      16      /* max # of triangles in a leaf
+                                         * made by the SAH termination  */
+#define MOTION_BVH_MAXDEPTH     64
+#define MOTION_BVH_NBINS        16
+#define MOTION_BVH_COST_NODE    1.0     /* SAH cost of node traversal   */
+#define MOTION_BVH_COST_TRI     1.0     /* SAH cost of triangle test    */
+
+/*
+ * Bounds of a triangle at shutter open and close, used in construction.
+ */
+typedef struct _motion_tri_box_t {
+
+    ri_float_t      bmin[2][3];
+    ri_float_t      bmax[2][3];
+    ri_float_t      center[3];      /* of the bounds at shutter
+                                     * open and close               */
+
+} motion_tri_box_t;
+
+static uint32_t build_node(
+          ri_motion_bvh_t        *mbvh,
+          motion_tri_box_t       *boxes,
+          uint32_t                begin,
+          uint32_t                end,
+          int                     depth);
+
+static int  test_ray_box(
+          ri_float_t             *tmin_out,
+    const ri_motion_bvh_node_t   *node,
+    const ri_ray_t               *ray,
+    const ri_vector_t             invdir,
+          ri_float_t              tmax);
+
+static int  triangle_isect(
+          ri_float_t             *t_inout,
+          ri_float_t             *u_out,
+          ri_float_t             *v_out,
+          ri_float_t              tmin,
+    const ri_motion_bvh_tri_t    *tri,
+    const ri_ray_t               *ray);
+
+/* ---------------------------------------------------------------------------
+ *
+ * Public functions
+ *
+ * ------------------------------------------------------------------------ */
+
+/*
+ * Function: ri_motion_bvh_build
+ *
+ *     Builds the BVH of the static geometries and the motion BVH of the
+ *     moving geometries.
+ *
+ * Parameters:
+ *
+ *     data - scene data of type ri_scene_t.
+ *
+ * Returns:
+ *
+ *     Built motion BVH.
+ */
+void *
+ri_motion_bvh_build(
+    const void *data)
+{
+    const ri_scene_t  *scene = (const ri_scene_t *)data;
+
+    int                j, k, v;
+    uint32_t           i, n;
+    uint32_t           nstatic;
+    ri_motion_bvh_t   *mbvh;
+    ri_list_t         *static_list;
+    ri_list_t         *itr;
+    ri_geom_t         *geom;
+    ri_vector_t        p;
+    motion_tri_box_t  *boxes;
+    ri_timer_t        *tm;
+
+    tm = ri_render_get()->context->timer;
+
+    mbvh = (ri_motion_bvh_t *)ri_mem_alloc(sizeof(ri_motion_bvh_t));
+    memset(mbvh, 0, sizeof(ri_motion_bvh_t));
+
+    /*
+     * 1. BVH of the static geometries.
+     */
+    static_list = ri_list_new();
+
+    nstatic = 0;
+    n       = 0;
+    for (itr  = ri_list_first(scene->geom_list);
+         itr != NULL;
+         itr  = ri_list_next(itr)) {
+
+        geom = (ri_geom_t *)itr->data;
+
+        if (geom->positions_close) {
+            n += geom->nindices / 3;
+        } else {
+            ri_list_append(static_list, (void *)geom);
+            nstatic += geom->nindices / 3;
+        }
+    }
+
+    if (nstatic > 0) {
+        mbvh->bvh = ri_bvh_build_geoms(static_list);
+    }
+
+    ri_list_free(static_list);
+
+    ri_log(LOG_INFO, "(MBVH  ) Building motion BVH ... ");
+    ri_timer_start(tm, "Motion BVH Construction");
+
+    /*
+     * 2. Triangles of the moving geometries and their bounds at shutter
+     *    open and close.
+     */
+    mbvh->tris  = (ri_motion_bvh_tri_t *)ri_mem_alloc(
+                      sizeof(ri_motion_bvh_tri_t) * (n + 1));
+    boxes       = (motion_tri_box_t *)ri_mem_alloc(
+                      sizeof(motion_tri_box_t) * (n + 1));
+
+    n = 0;
+    for (itr  = ri_list_first(scene->geom_list);
+         itr != NULL;
+         itr  = ri_list_next(itr)) {
+
+        geom = (ri_geom_t *)itr->data;
+
+        if (geom->positions_close == NULL) continue;
+
+        for (i = 0; i < geom->nindices / 3; i++) {
+
+            mbvh->tris[n].geom  = geom;
+            mbvh->tris[n].index = 3 * i;
+
+            /* j = 0: shutter open, j = 1: shutter close */
+            for (j = 0; j < 2; j++) {
+
+                for (k = 0; k < 3; k++) {
+                    boxes[n].bmin[j][k] =  RI_INFINITY;
+                    boxes[n].bmax[j][k] = -RI_INFINITY;
+                }
+
+                for (v = 0; v < 3; v++) {
+                    ri_geom_position_at(p, geom, geom->indices[3 * i + v],
+                                        (float)j);
+                    for (k = 0; k < 3; k++) {
+                        if (boxes[n].bmin[j][k] > p[k]) {
+                            boxes[n].bmin[j][k] = p[k];
+                        }
+                        if (boxes[n].bmax[j][k] < p[k]) {
+                            boxes[n].bmax[j][k] = p[k];
+                        }
+                    }
+                }
+            }
+
+            for (k = 0; k < 3; k++) {
+                boxes[n].center[k] = 0.25 * (boxes[n].bmin[0][k] +
+                                             boxes[n].bmax[0][k] +
+                                             boxes[n].bmin[1][k] +
+                                             boxes[n].bmax[1][k]);
+            }
+
+            n++;
+        }
+    }
+
+    mbvh->ntriangles = n;
+
+    /*
+     * 3. SAH build.
+     */
+    if (n > 0) {
+        mbvh->nodes  = (ri_motion_bvh_node_t *)ri_mem_alloc(
+                           sizeof(ri_motion_bvh_node_t) * (2 * n - 1));
+        mbvh->nnodes = 0;
+
+        build_node(mbvh, boxes, 0, n, 0);
+    }
+
+    ri_mem_free(boxes);
+
+    ri_timer_end(tm, "Motion BVH Construction");
+
+    ri_log(LOG_INFO, "(MBVH  )    # of static tris  = %u", nstatic);
+    ri_log(LOG_INFO, "(MBVH  )    # of moving tris  = %u", mbvh->ntriangles);
+    ri_log(LOG_INFO, "(MBVH  )    # of nodes        = %u (%.2f KB)",
+        mbvh->nnodes,
+        sizeof(ri_motion_bvh_node_t) * mbvh->nnodes / 1024.0);
+    ri_log(LOG_INFO, "(MBVH  ) Construction time: %f sec",
+        ri_timer_elapsed(tm, "Motion BVH Construction"));
+
+    ri_log(LOG_INFO, "(MBVH  ) Built motion BVH.");
+
+    return (void *)mbvh;
+}
+
+void
+ri_motion_bvh_free(
+    void *accel)
+{
+    ri_motion_bvh_t *mbvh = (ri_motion_bvh_t *)accel;
+
+    if (mbvh == NULL) return;
+
+    if (mbvh->bvh) {
+        ri_bvh_free(mbvh->bvh);
+    }
+
+    ri_mem_free(mbvh->nodes);
+    ri_mem_free(mbvh->tris);
+    ri_mem_free(mbvh);
+}
+
+/*
+ * Function: ri_motion_bvh_intersect
+ *
+ *     Finds the nearest hit among the static geometries and the moving
+ *     geometries at the time of the ray.
+ */
+int
+ri_motion_bvh_intersect(
+    void                    *accel,
+    ri_ray_t                *ray,
+    ri_intersection_state_t *state_out,
+    void                    *user)
+{
+    int                     i;
+    int                     depth;
+    uint32_t                ref;
+    uint32_t                near_ref, far_ref;
+    uint32_t                stack[MOTION_BVH_MAXDEPTH + 1];
+    ri_float_t              tnear, tfar, tbox;
+    ri_float_t              t, u, v;
+    ri_vector_t             invdir;
+    ri_motion_bvh_t        *mbvh;
+    ri_motion_bvh_node_t   *node;
+    ri_motion_bvh_tri_t    *tri;
+
+    (void)user;
+
+    assert(accel     != NULL);
+    assert(ray       != NULL);
+    assert(state_out != NULL);
+
+    mbvh = (ri_motion_bvh_t *)accel;
+
+    state_out->t     = RI_INFINITY;
+    state_out->u     = 0.0;
+    state_out->v     = 0.0;
+    state_out->geom  = NULL;
+    state_out->index = 0;
+
+    if (mbvh->bvh) {
+        ri_bvh_intersect_nearest(mbvh->bvh, ray, state_out);
+    }
+
+    if (mbvh->nnodes > 0) {
+
+        invdir[0] = 1.0 / ray->dir[0];
+        invdir[1] = 1.0 / ray->dir[1];
+        invdir[2] = 1.0 / ray->dir[2];
+
+        depth = 0;
+        ref   = 0;
+
+        if (!test_ray_box(&tbox, &mbvh->nodes[0], ray, invdir, state_out->t)) {
+            depth = -1;
+        }
+
+        while (depth >= 0) {
+
+            node = &mbvh->nodes[ref];
+
+            if (node->ntriangles > 0) {
+
+                for (i = 0; i < (int)node->ntriangles; i++) {
+
+                    tri = &mbvh->tris[node->offset + i];
+
+                    t = state_out->t;
+
+                    if (triangle_isect(&t, &u, &v, 0.0, tri, ray)) {
+                        state_out->t     = t;
+                        state_out->u     = u;
+                        state_out->v     = v;
+                        state_out->geom  = tri->geom;
+                        state_out->index = tri->index;
+                    }
+                }
+
+            } else {
+
+                /* Visit the nearer child first. */
+                near_ref = ref + 1;
+                far_ref  = node->offset;
+
+                i  = test_ray_box(&tnear, &mbvh->nodes[near_ref],
+                                  ray, invdir, state_out->t);
+                i |= test_ray_box(&tfar,  &mbvh->nodes[far_ref],
+                                  ray, invdir, state_out->t) << 1;
+
+                if (i == 3) {
+
+                    if (tfar < tnear) {
+                        ref      = near_ref;
+                        near_ref = far_ref;
+                        far_ref  = ref;
+                    }
+
+                    assert(depth < MOTION_BVH_MAXDEPTH);
+                    stack[depth++] = far_ref;
+                    ref = near_ref;
+                    continue;
+
+                } else if (i == 1) {
+
+                    ref = near_ref;
+                    continue;
+
+                } else if (i == 2) {
+
+                    ref = far_ref;
+                    continue;
+
+                }
+            }
+
+            /* pop */
+            if (depth == 0) break;
+            ref = stack[--depth];
+        }
+    }
+
+    if (state_out->geom == NULL) {
+        return 0;
+    }
+
+    ri_intersection_state_build(state_out, ray);
+
+    return 1;
+}
+
+/*
+ * Function: ri_motion_bvh_occluded
+ *
+ *     Any-hit query for the motion BVH.
+ */
+int
+ri_motion_bvh_occluded(
+    void                    *accel,
+    ri_ray_t                *ray,
+    ri_float_t               tmin,
+    ri_float_t               tmax,
+    void                    *user)
+{
+    int                     i;
+    int                     depth;
+    uint32_t                ref;
+    uint32_t                stack[MOTION_BVH_MAXDEPTH + 1];
+    ri_float_t              tbox;
+    ri_float_t              t, u, v;
+    ri_vector_t             invdir;
+    ri_motion_bvh_t        *mbvh;
+    ri_motion_bvh_node_t   *node;
+
+    (void)user;
+
+    assert(accel != NULL);
+    assert(ray   != NULL);
+
+    mbvh = (ri_motion_bvh_t *)accel;
+
+    if (mbvh->bvh) {
+        if (ri_bvh_occluded(mbvh->bvh, ray, tmin, tmax, NULL)) {
+            return 1;
+        }
+    }
+
+    if (mbvh->nnodes == 0) {
+        return 0;
+    }
+
+    invdir[0] = 1.0 / ray->dir[0];
+    invdir[1] = 1.0 / ray->dir[1];
+    invdir[2] = 1.0 / ray->dir[2];
+
+    depth = 0;
+    stack[depth++] = 0;
+
+    while (depth > 0) {
+
+        ref  = stack[--depth];
+        node = &mbvh->nodes[ref];
+
+        if (!test_ray_box(&tbox, node, ray, invdir, tmax)) {
+            continue;
+        }
+
+        if (node->ntriangles == 0) {
+
+            assert(depth + 2 <= MOTION_BVH_MAXDEPTH);
+            stack[depth++] = node->offset;
+            stack[depth++] = ref + 1;
+            continue;
+
+        }
+
+        for (i = 0; i < (int)node->ntriangles; i++) {
+
+            t = tmax;
+
+            if (triangle_isect(&t, &u, &v, tmin,
+                               &mbvh->tris[node->offset + i], ray)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ *
+ * Private functions
+ *
+ * ------------------------------------------------------------------------ */
+
+/*
+ * Surface area of the box averaged over shutter open and close. Used as the
+ * probability of a ray with uniformly distributed time hitting the box.
+ */
+static ri_float_t
+box_area(
+    ri_float_t bmin[2][3],
+    ri_float_t bmax[2][3])
+{
+    int        j;
+    ri_float_t dx, dy, dz;
+    ri_float_t area = 0.0;
+
+    for (j = 0; j < 2; j++) {
+
+        if (bmin[j][0] > bmax[j][0]) continue;      /* empty */
+
+        dx = bmax[j][0] - bmin[j][0];
+        dy = bmax[j][1] - bmin[j][1];
+        dz = bmax[j][2] - bmin[j][2];
+
+        area += dx * dy + dy * dz + dz * dx;
+    }
+
+    /* Sum of the half areas is the average area. */
+    return area;
+}
+
+static void
+box_init(
+    ri_float_t bmin[2][3],
+    ri_float_t bmax[2][3])
+{
+    int j, k;
+
+    for (j = 0; j < 2; j++) {
+        for (k = 0; k < 3; k++) {
+            bmin[j][k] =  RI_INFINITY;
+            bmax[j][k] = -RI_INFINITY;
+        }
+    }
+}
+
+static void
+box_merge(
+          ri_float_t        bmin[2][3],
+          ri_float_t        bmax[2][3],
+    const motion_tri_box_t *box)
+{
+    int j, k;
+
+    for (j = 0; j < 2; j++) {
+        for (k = 0; k < 3; k++) {
+            if (bmin[j][k] > box->bmin[j][k]) bmin[j][k] = box->bmin[j][k];
+            if (bmax[j][k] < box->bmax[j][k]) bmax[j][k] = box->bmax[j][k];
+        }
+    }
+}
+
+static void
+swap_tri(
+    ri_motion_bvh_t  *mbvh,
+    motion_tri_box_t *boxes,
+    uint32_t          a,
+    uint32_t          b)
+{
+    ri_motion_bvh_tri_t tri;
+    motion_tri_box_t    box;
+
+    tri           = mbvh->tris[a];
+    mbvh->tris[a] = mbvh->tris[b];
+    mbvh->tris[b] = tri;
+
+    box           = boxes[a];
+    boxes[a]      = boxes[b];
+    boxes[b]      = box;
+}
+
+static int
+get_bin(
+    ri_float_t c,
+    ri_float_t cmin,
+    ri_float_t scale)
+{
+    int bin;
+
+    bin = (int)((c - cmin) * scale);
+    if (bin < 0) bin = 0;
+    if (bin > MOTION_BVH_NBINS - 1) bin = MOTION_BVH_NBINS - 1;
+
+    return bin;
+}
+
+/*
+ * Builds the subtree over tris[begin, end) by the binned SAH along the
+ * largest extent of triangle centers.
+ *
+ * Returns the index of the node.
+ */
+static uint32_t
+build_node(
+    ri_motion_bvh_t  *mbvh,
+    motion_tri_box_t *boxes,
+    uint32_t          begin,
+    uint32_t          end,
+    int               depth)
+{
+    int                     k;
+    int                     axis;
+    int                     b, best;
+    uint32_t                i;
+    uint32_t                idx;
+    uint32_t                mid;
+    uint32_t                n;
+    uint32_t                counts[MOTION_BVH_NBINS];
+    uint32_t                nleft;
+    ri_float_t              cmin[3], cmax[3];
+    ri_float_t              scale;
+    ri_float_t              area;
+    ri_float_t              cost, best_cost;
+    ri_float_t              right_area[MOTION_BVH_NBINS];
+    ri_float_t              bin_bmin[MOTION_BVH_NBINS][2][3];
+    ri_float_t              bin_bmax[MOTION_BVH_NBINS][2][3];
+    ri_float_t              acc_bmin[2][3], acc_bmax[2][3];
+    ri_motion_bvh_node_t   *node;
+
+    idx  = mbvh->nnodes++;
+    node = &mbvh->nodes[idx];
+    n    = end - begin;
+
+    box_init(node->bmin, node->bmax);
+
+    for (k = 0; k < 3; k++) {
+        cmin[k] =  RI_INFINITY;
+        cmax[k] = -RI_INFINITY;
+    }
+
+    for (i = begin; i < end; i++) {
+
+        box_merge(node->bmin, node->bmax, &boxes[i]);
+
+        for (k = 0; k < 3; k++) {
+            if (cmin[k] > boxes[i].center[k]) cmin[k] = boxes[i].center[k];
+            if (cmax[k] < boxes[i].center[k]) cmax[k] = boxes[i].center[k];
+        }
+    }
+
+    axis = 0;
+    if ((cmax[1] - cmin[1]) > (cmax[axis] - cmin[axis])) axis = 1;
+    if ((cmax[2] - cmin[2]) > (cmax[axis] - cmin[axis])) axis = 2;
+
+    if ((n <= MOTION_BVH_NLEAF)                  ||
+        (depth >= MOTION_BVH_MAXDEPTH - 1)       ||
+        (cmax[axis] <= cmin[axis])) {
+
+        node->offset     = begin;
+        node->ntriangles = n;
+
+        return idx;
+    }
+
+    /*
+     * Bin triangles and sweep bins to find the split with the least SAH
+     * cost.
+     */
+    scale = MOTION_BVH_NBINS / (cmax[axis] - cmin[axis]);
+
+    for (b = 0; b < MOTION_BVH_NBINS; b++) {
+        counts[b] = 0;
+        box_init(bin_bmin[b], bin_bmax[b]);
+    }
+
+    for (i = begin; i < end; i++) {
+        b = get_bin(boxes[i].center[axis], cmin[axis], scale);
+        counts[b]++;
+        box_merge(bin_bmin[b], bin_bmax[b], &boxes[i]);
+    }
+
+    box_init(acc_bmin, acc_bmax);
+    for (b = MOTION_BVH_NBINS - 1; b > 0; b--) {
+        for (k = 0; k < 3; k++) {
+            if (acc_bmin[0][k] > bin_bmin[b][0][k]) acc_bmin[0][k] = bin_bmin[b][0][k];
+            if (acc_bmax[0][k] < bin_bmax[b][0][k]) acc_bmax[0][k] = bin_bmax[b][0][k];
+            if (acc_bmin[1][k] > bin_bmin[b][1][k]) acc_bmin[1][k] = bin_bmin[b][1][k];
+            if (acc_bmax[1][k] < bin_bmax[b][1][k]) acc_bmax[1][k] = bin_bmax[b][1][k];
+        }
+        right_area[b] = box_area(acc_bmin, acc_bmax);
+    }
+
+    area = box_area(node->bmin, node->bmax);
+
+    best      = -1;
+    best_cost = RI_INFINITY;
+    nleft     = 0;
+
+    box_init(acc_bmin, acc_bmax);
+    for (b = 0; b < MOTION_BVH_NBINS - 1; b++) {
+
+        for (k = 0; k < 3; k++) {
+            if (acc_bmin[0][k] > bin_bmin[b][0][k]) acc_bmin[0][k] = bin_bmin[b][0][k];
+            if (acc_bmax[0][k] < bin_bmax[b][0][k]) acc_bmax[0][k] = bin_bmax[b][0][k];
+            if (acc_bmin[1][k] > bin_bmin[b][1][k]) acc_bmin[1][k] = bin_bmin[b][1][k];
+            if (acc_bmax[1][k] < bin_bmax[b][1][k]) acc_bmax[1][k] = bin_bmax[b][1][k];
+        }
+
+        nleft += counts[b];
+
+        if ((nleft == 0) || (nleft == n)) continue;
+
+        cost = MOTION_BVH_COST_NODE + MOTION_BVH_COST_TRI *
+               (box_area(acc_bmin, acc_bmax) * nleft +
+                right_area[b + 1] * (n - nleft)) / area;
+
+        if (cost < best_cost) {
+            best_cost = cost;
+            best      = b;
+        }
+    }
+
+    if ((best >= 0) &&
+        (best_cost >= MOTION_BVH_COST_TRI * n) &&
+        (n <= MOTION_BVH_MAXLEAF)) {
+
+        /* Splitting does not pay. */
+        node->offset     = begin;
+        node->ntriangles = n;
+
+        return idx;
+    }
+
+    if (best >= 0) {
+
+        mid = begin;
+        for (i = begin; i < end; i++) {
+            if (get_bin(boxes[i].center[axis], cmin[axis], scale) <= best) {
+                swap_tri(mbvh, boxes, i, mid);
+                mid++;
+            }
+        }
+
+    } else {
+
+        /* Centers can't be separated. Split in the middle. */
+        mid = begin + n / 2;
+
+    }
+
+    assert(mid > begin && mid < end);
+
+    build_node(mbvh, boxes, begin, mid, depth + 1);         /* idx + 1 */
+
+    /* `node' may not be used here; take the index. */
+    mbvh->nodes[idx].offset     = build_node(mbvh, boxes, mid, end, depth + 1);
+    mbvh->nodes[idx].ntriangles = 0;
+
+    return idx;
+}
+
+/*
+ * Slab test against the bounds of the node at the time of the ray. Returns
+ * 1 and the entry distance if the ray hits the box in [0, tmax].
+ */
+static int
+test_ray_box(
+    ri_float_t                 *tmin_out,
+    const ri_motion_bvh_node_t *node,
+    const ri_ray_t             *ray,
+    const ri_vector_t           invdir,
+    ri_float_t                  tmax)
+{
+    int        k;
+    ri_float_t t0, t1, tmp;
+    ri_float_t bmin, bmax;
+    ri_float_t tmin = 0.0;
+    ri_float_t time = ray->time;
+
+    for (k = 0; k < 3; k++) {
+
+        bmin = (1.0 - time) * node->bmin[0][k] + time * node->bmin[1][k];
+        bmax = (1.0 - time) * node->bmax[0][k] + time * node->bmax[1][k];
+
+        t0 = (bmin - ray->org[k]) * invdir[k];
+        t1 = (bmax - ray->org[k]) * invdir[k];
+
+        if (t0 > t1) {
+            tmp = t0; t0 = t1; t1 = tmp;
+        }
+
+        /* NaN(0 * inf) compares false and leaves the interval as is. */
+        if (t0 > tmin) tmin = t0;
+        if (t1 < tmax) tmax = t1;
+
+        if (tmin > tmax) return 0;
+    }
+
+    (*tmin_out) = tmin;
+
+    return 1;
+}
+
+/*
+ * Ray-triangle test(Moller and Trumbore) against the triangle at the time
+ * of the ray. Same as the one in bvh.c except for the vertices.
+ */
+static int
+triangle_isect(
+    ri_float_t                *t_inout,
+    ri_float_t                *u_out,
+    ri_float_t                *v_out,
+    ri_float_t                 tmin,
+    const ri_motion_bvh_tri_t *tri,
+    const ri_ray_t            *ray)
+{
+    const ri_geom_t *geom = tri->geom;
+    ri_vector_t v0, v1, v2;
+    ri_vector_t e1, e2;
+    ri_vector_t p, s, q;
+    ri_float_t  a, inva;
+    ri_float_t  t, u, v;
+    double      eps = 1.0e-14;
+
+    ri_geom_position_at(v0, geom, geom->indices[tri->index + 0], ray->time);
+    ri_geom_position_at(v1, geom, geom->indices[tri->index + 1], ray->time);
+    ri_geom_position_at(v2, geom, geom->indices[tri->index + 2], ray->time);
+
+    vsub( e1, v1, v0 );
+    vsub( e2, v2, v0 );
+
+    vcross( p, ray->dir, e2 );
+
+    a = vdot( e1, p );
+
+    if (fabs(a) > eps) {
+        inva = 1.0 / a;
+    } else {
+        return 0;
+    }
+
+    vsub( s, ray->org, v0 );
+    vcross( q, s, e1 );
+
+    u = vdot( s, p ) * inva;
+    v = vdot( q, ray->dir ) * inva;
+    t = vdot( e2, q ) * inva;
+
+    if ( (u < 0.0) || (u > 1.0)) {
+        return 0;
+    }
+
+    if ( (v < 0.0) || ((u + v) > 1.0)) {
+        return 0;
+    }
+
+    if ( (t < tmin) || (t > (*t_inout)) ) {
+        return 0;
+    }
+
+    (*t_inout) = t;
+    (*u_out)   = u;
+    (*v_out)   = v;
+
+    return 1;   /* hit */
+}
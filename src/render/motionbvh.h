@@ -0,0 +1,111 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * BVH for motion blur.
+ *
+ * A moving geometry has its vertex positions at shutter open and close
+ * (ri_geom_t::positions_close), and a ray sees them linearly interpolated
+ * by its time(ri_ray_t::time). Triangles of moving geometries are put into
+ * a binary BVH whose nodes have bounds at shutter open and close. Since
+ * every vertex moves linearly, the bounds interpolated by the ray time
+ * enclose the triangles at that time. Thus a ray traverses tight boxes of
+ * the scene at its time, rather than boxes swept over the shutter interval
+ * which overlap much for fast motion. The tree is built by SAH with the
+ * surface area averaged over the shutter open and close.
+ *
+ * Static geometries are put into the regular BVH(see bvh.h), which is
+ * tested before the motion BVH, so that static parts of the scene are
+ * traced at the same cost as without motion blur.
+ *
+ * $Id$
+ */
+
+#ifndef LUCILLE_MOTIONBVH_H
+#define LUCILLE_MOTIONBVH_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+
+#include "vector.h"
+#include "geom.h"
+
+#include "ray.h"
+#include "intersection_state.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Reference to a triangle of a moving geometry.
+ */
+typedef struct _ri_motion_bvh_tri_t {
+
+    ri_geom_t      *geom;
+    uint32_t        index;          /* first index of the triangle in
+                                     * geom->indices                    */
+
+} ri_motion_bvh_tri_t;
+
+/*
+ * Node of the motion BVH. bmin[0]/bmax[0] are the bounds at shutter open,
+ * bmin[1]/bmax[1] at shutter close. Inner node has 2 children: the left
+ * child follows the node, and the right child is nodes[offset]. Leaf node
+ * refers to tris[offset, offset + ntriangles).
+ */
+typedef struct _ri_motion_bvh_node_t {
+
+    ri_float_t      bmin[2][3];
+    ri_float_t      bmax[2][3];
+
+    uint32_t        offset;
+    uint32_t        ntriangles;     /* 0 for inner node                 */
+
+} ri_motion_bvh_node_t;
+
+/*
+ * Struct: ri_motion_bvh_t
+ *
+ *   BVH of a scene with moving geometries.
+ */
+typedef struct _ri_motion_bvh_t {
+
+    void                    *bvh;           /* BVH of the static
+                                             * geometries. NULL if none.    */
+
+    ri_motion_bvh_tri_t     *tris;          /* sorted by leaf               */
+    uint32_t                 ntriangles;
+
+    ri_motion_bvh_node_t    *nodes;
+    uint32_t                 nnodes;
+
+} ri_motion_bvh_t;
+
+/*
+ * ri_accel_t interface of the motion BVH. Bound as RI_ACCEL_BVH_MOTION.
+ */
+extern void *ri_motion_bvh_build        (const void              *data);
+extern void  ri_motion_bvh_free         (      void              *accel);
+extern int   ri_motion_bvh_intersect    (      void              *accel,
+                                               ri_ray_t          *ray,
+                                         ri_intersection_state_t *state_out,
+                                               void              *user);
+extern int   ri_motion_bvh_occluded     (      void              *accel,
+                                               ri_ray_t          *ray,
+                                               ri_float_t         tmin,
+                                               ri_float_t         tmax,
+                                               void              *user);
+
+#ifdef __cplusplus
+}    /* extern "C" */
+#endif
+
+#endif  /* LUCILLE_MOTIONBVH_H */
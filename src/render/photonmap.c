@@ -0,0 +1,800 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Photon map and its kd-tree.
+ *
+ * References:
+ *
+ *   Henrik Wann Jensen,
+ *   "Realistic Image Synthesis Using Photon Mapping",
+ *   A K Peters, 2001.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#ifdef WITH_SSE
+#include <xmmintrin.h>
+#endif
+
+#include "photonmap.h"
+#include "memory.h"
+#include "log.h"
+
+#define PHOTONMAP_MAGIC     "LPM1"
+
+#define MAX_TREE_DEPTH      64
+
+/*
+ * Tables to decode photon directions.
+ */
+static double costheta[256];
+static double sintheta[256];
+static double cosphi[256];
+static double sinphi[256];
+static int    dir_table_initialized = 0;
+
+static void init_dir_table();
+static int  leaf_begin(
+    const ri_photonmap_t *map,
+    int                   leaf);
+static void balance_node(
+    ri_photonmap_t       *map,
+    int                   node,
+    int                   lo_leaf,
+    int                   hi_leaf);
+static void build_soa(
+    ri_photonmap_t       *map);
+static void heap_insert(
+    ri_photon_nearest_t  *nearest,
+    int                  *n,
+    int                   k,
+    float                 dist2,
+    int                   index,
+    float                *maxdist2);
+
+/* ---------------------------------------------------------------------------
+ *
+ * Public functions
+ *
+ * ------------------------------------------------------------------------ */
+
+ri_photonmap_t *
+ri_photonmap_new(
+    int                max_photons)
+{
+    ri_photonmap_t *map;
+
+    init_dir_table();
+
+    map = (ri_photonmap_t *)ri_mem_alloc(sizeof(ri_photonmap_t));
+    memset(map, 0, sizeof(ri_photonmap_t));
+
+    if (max_photons < 1) max_photons = 1;
+
+    map->photons     = (ri_photon_t *)ri_mem_alloc(sizeof(ri_photon_t) *
+                                                   max_photons);
+    map->max_photons = max_photons;
+    map->nphotons    = 0;
+
+    map->bmin[0] = map->bmin[1] = map->bmin[2] =  RI_INFINITY;
+    map->bmax[0] = map->bmax[1] = map->bmax[2] = -RI_INFINITY;
+
+    return map;
+}
+
+void
+ri_photonmap_free(
+    ri_photonmap_t    *map)
+{
+    if (map == NULL) return;
+
+    ri_mem_free(map->photons);
+    ri_mem_free(map->split);
+    ri_mem_free(map->axis);
+    ri_mem_free(map->px);
+    ri_mem_free(map->py);
+    ri_mem_free(map->pz);
+    ri_mem_free(map);
+}
+
+int
+ri_photonmap_store(
+    ri_photonmap_t    *map,
+    const ri_vector_t  pos,
+    const ri_vector_t  dir,
+    const ri_vector_t  power)
+{
+    int          i;
+    int          theta, phi;
+    ri_photon_t *photon;
+
+    if (map->nphotons >= map->max_photons) return 0;
+
+    photon = &map->photons[map->nphotons++];
+
+    for (i = 0; i < 3; i++) {
+        photon->pos[i]   = (float)pos[i];
+        photon->power[i] = (float)power[i];
+
+        if (pos[i] < map->bmin[i]) map->bmin[i] = pos[i];
+        if (pos[i] > map->bmax[i]) map->bmax[i] = pos[i];
+    }
+
+    /*
+     * Compress the direction into 2 bytes as in [Jensen 2001].
+     */
+    theta = (int)(acos(dir[2] < -1.0 ? -1.0 : (dir[2] > 1.0 ? 1.0 : dir[2]))
+                  * (256.0 / M_PI));
+    phi   = (int)(atan2(dir[1], dir[0]) * (256.0 / (2.0 * M_PI)));
+
+    if (theta > 255) theta = 255;
+    if (phi < 0)     phi  += 256;
+    if (phi > 255)   phi   = 255;
+
+    photon->theta = (unsigned char)theta;
+    photon->phi   = (unsigned char)phi;
+    photon->pad   = 0;
+
+    return 1;
+}
+
+void
+ri_photonmap_merge(
+    ri_photonmap_t    *dst,
+    const ri_photonmap_t *src,
+    ri_float_t         scale)
+{
+    int          i, j;
+    ri_photon_t *photon;
+
+    for (i = 0; i < src->nphotons; i++) {
+
+        if (dst->nphotons >= dst->max_photons) break;
+
+        photon = &dst->photons[dst->nphotons++];
+
+        *photon = src->photons[i];
+
+        for (j = 0; j < 3; j++) {
+            photon->power[j] *= (float)scale;
+
+            if (photon->pos[j] < dst->bmin[j]) dst->bmin[j] = photon->pos[j];
+            if (photon->pos[j] > dst->bmax[j]) dst->bmax[j] = photon->pos[j];
+        }
+    }
+}
+
+void
+ri_photonmap_balance(
+    ri_photonmap_t    *map)
+{
+    int nleaves;
+
+    ri_mem_free(map->split);
+    ri_mem_free(map->axis);
+    map->split = NULL;
+    map->axis  = NULL;
+
+    nleaves = 1;
+    while (nleaves * RI_PHOTONMAP_LEAF_SIZE < map->nphotons) {
+        nleaves *= 2;
+    }
+
+    map->nleaves = nleaves;
+
+    if (nleaves > 1) {
+        map->split = (float *)ri_mem_alloc(sizeof(float) * (nleaves - 1));
+        map->axis  = (unsigned char *)ri_mem_alloc(nleaves - 1);
+
+        balance_node(map, 0, 0, nleaves);
+    }
+
+    build_soa(map);
+
+    map->balanced = 1;
+}
+
+int
+ri_photonmap_locate(
+    const ri_photonmap_t *map,
+    ri_photon_nearest_t *nearest,
+    const ri_vector_t  P,
+    ri_float_t         maxdist2,
+    int                k)
+{
+    int          i, j;
+    int          n;
+    int          node;
+    int          near, far;
+    int          begin, end;
+    int          ninner;
+    int          sp;
+    int          stack_node[MAX_TREE_DEPTH];
+    float        stack_dist2[MAX_TREE_DEPTH];
+    float        d, d2;
+    float        r2;
+    float        q[3];
+#ifdef WITH_SSE
+    __m128       qx, qy, qz;
+    __m128       dx, dy, dz, dd;
+    float        d2s[4] __attribute__((aligned(16)));
+#endif
+
+    assert(map->balanced);
+
+    n = 0;
+
+    if (map->nphotons == 0 || k < 1) return 0;
+
+    q[0]   = (float)P[0];
+    q[1]   = (float)P[1];
+    q[2]   = (float)P[2];
+    r2     = (float)maxdist2;
+    ninner = map->nleaves - 1;
+
+#ifdef WITH_SSE
+    qx = _mm_set1_ps(q[0]);
+    qy = _mm_set1_ps(q[1]);
+    qz = _mm_set1_ps(q[2]);
+#endif
+
+    sp   = 0;
+    node = 0;
+
+    while (1) {
+
+        /*
+         * Descend to the leaf containing P, remembering far children.
+         */
+        while (node < ninner) {
+
+            d = q[map->axis[node]] - map->split[node];
+
+            if (d < 0.0f) {
+                near = 2 * node + 1;
+                far  = 2 * node + 2;
+            } else {
+                near = 2 * node + 2;
+                far  = 2 * node + 1;
+            }
+
+            if (d * d < r2) {
+                assert(sp < MAX_TREE_DEPTH);
+                stack_node[sp]  = far;
+                stack_dist2[sp] = d * d;
+                sp++;
+            }
+
+            node = near;
+        }
+
+        begin = leaf_begin(map, node - ninner);
+        end   = leaf_begin(map, node - ninner + 1);
+
+#ifdef WITH_SSE
+        /*
+         * 4 photons at a time. SoA arrays are padded so that loading past
+         * the end of the leaf is safe.
+         */
+        for (i = begin; i < end; i += 4) {
+
+            dx = _mm_sub_ps(_mm_loadu_ps(&map->px[i]), qx);
+            dy = _mm_sub_ps(_mm_loadu_ps(&map->py[i]), qy);
+            dz = _mm_sub_ps(_mm_loadu_ps(&map->pz[i]), qz);
+
+            dd = _mm_add_ps(_mm_mul_ps(dx, dx),
+                            _mm_add_ps(_mm_mul_ps(dy, dy),
+                                       _mm_mul_ps(dz, dz)));
+
+            if (!_mm_movemask_ps(_mm_cmplt_ps(dd, _mm_set1_ps(r2)))) {
+                continue;
+            }
+
+            _mm_store_ps(d2s, dd);
+
+            for (j = 0; j < 4 && i + j < end; j++) {
+                if (d2s[j] < r2) {
+                    heap_insert(nearest, &n, k, d2s[j], i + j, &r2);
+                }
+            }
+        }
+#else
+        for (i = begin; i < end; i++) {
+
+            d  = map->px[i] - q[0];
+            d2 = d * d;
+            d  = map->py[i] - q[1];
+            d2 += d * d;
+            d  = map->pz[i] - q[2];
+            d2 += d * d;
+
+            if (d2 < r2) {
+                heap_insert(nearest, &n, k, d2, i, &r2);
+            }
+        }
+#endif
+
+        /*
+         * Pop the next subtree which may still contain nearer photons.
+         */
+        node = -1;
+        while (sp > 0) {
+            sp--;
+            if (stack_dist2[sp] < r2) {
+                node = stack_node[sp];
+                break;
+            }
+        }
+
+        if (node < 0) break;
+    }
+
+    (void)d2;
+
+    return n;
+}
+
+void
+ri_photonmap_irradiance(
+    const ri_photonmap_t *map,
+    ri_vector_t        E,
+    const ri_vector_t  P,
+    const ri_vector_t  N,
+    ri_float_t         maxdist,
+    int                nphotons)
+{
+    int                 i;
+    int                 n;
+    ri_float_t          r2;
+    ri_float_t          dot;
+    ri_float_t          power[3];
+    const ri_photon_t  *photon;
+    ri_photon_nearest_t nearest[RI_PHOTONMAP_MAX_ESTIMATE];
+
+    ri_vector_setzero(E);
+
+    if (nphotons > RI_PHOTONMAP_MAX_ESTIMATE) {
+        nphotons = RI_PHOTONMAP_MAX_ESTIMATE;
+    }
+
+    n = ri_photonmap_locate(map, nearest, P, maxdist * maxdist, nphotons);
+
+    if (n < 1) return;
+
+    power[0] = power[1] = power[2] = 0.0;
+
+    for (i = 0; i < n; i++) {
+
+        photon = &map->photons[nearest[i].index];
+
+        /* Photons arriving at the front side only. */
+        dot = sintheta[photon->theta] * cosphi[photon->phi] * N[0]
+            + sintheta[photon->theta] * sinphi[photon->phi] * N[1]
+            + costheta[photon->theta] * N[2];
+
+        if (dot < 0.0) {
+            power[0] += photon->power[0];
+            power[1] += photon->power[1];
+            power[2] += photon->power[2];
+        }
+    }
+
+    /* nearest[0] is the farthest photon found. */
+    r2 = nearest[0].dist2;
+    if (r2 <= 0.0) return;
+
+    E[0] = power[0] / (M_PI * r2);
+    E[1] = power[1] / (M_PI * r2);
+    E[2] = power[2] / (M_PI * r2);
+}
+
+void
+ri_photonmap_photon_dir(
+    ri_vector_t        dir,
+    const ri_photon_t *photon)
+{
+    init_dir_table();
+
+    dir[0] = sintheta[photon->theta] * cosphi[photon->phi];
+    dir[1] = sintheta[photon->theta] * sinphi[photon->phi];
+    dir[2] = costheta[photon->theta];
+}
+
+int
+ri_photonmap_save(
+    const ri_photonmap_t *map,
+    const char        *filename)
+{
+    int   i;
+    int   ok;
+    float bbox[6];
+    FILE *fp;
+
+    assert(map->balanced);
+
+    fp = fopen(filename, "wb");
+    if (!fp) {
+        ri_log(LOG_WARN, "(PMap   ) Can't open file \"%s\"", filename);
+        return -1;
+    }
+
+    for (i = 0; i < 3; i++) {
+        bbox[i]     = (float)map->bmin[i];
+        bbox[i + 3] = (float)map->bmax[i];
+    }
+
+    ok = 1;
+    ok &= fwrite(PHOTONMAP_MAGIC, 1, 4, fp) == 4;
+    ok &= fwrite(&map->nphotons, sizeof(int), 1, fp) == 1;
+    ok &= fwrite(&map->nleaves, sizeof(int), 1, fp) == 1;
+    ok &= fwrite(bbox, sizeof(float), 6, fp) == 6;
+    ok &= fwrite(map->photons, sizeof(ri_photon_t), map->nphotons, fp) ==
+          (size_t)map->nphotons;
+
+    if (map->nleaves > 1) {
+        ok &= fwrite(map->split, sizeof(float), map->nleaves - 1, fp) ==
+              (size_t)(map->nleaves - 1);
+        ok &= fwrite(map->axis, 1, map->nleaves - 1, fp) ==
+              (size_t)(map->nleaves - 1);
+    }
+
+    fclose(fp);
+
+    if (!ok) {
+        ri_log(LOG_WARN, "(PMap   ) Failed to write \"%s\"", filename);
+        return -1;
+    }
+
+    ri_log(LOG_INFO, "(PMap   ) Saved %d photons to \"%s\"",
+           map->nphotons, filename);
+
+    return 0;
+}
+
+ri_photonmap_t *
+ri_photonmap_load(
+    const char        *filename)
+{
+    int             i;
+    int             ok;
+    int             nphotons, nleaves;
+    char            magic[4];
+    float           bbox[6];
+    FILE           *fp;
+    ri_photonmap_t *map;
+
+    fp = fopen(filename, "rb");
+    if (!fp) return NULL;
+
+    ok = 1;
+    ok &= fread(magic, 1, 4, fp) == 4;
+    ok &= fread(&nphotons, sizeof(int), 1, fp) == 1;
+    ok &= fread(&nleaves, sizeof(int), 1, fp) == 1;
+    ok &= fread(bbox, sizeof(float), 6, fp) == 6;
+
+    if (!ok || memcmp(magic, PHOTONMAP_MAGIC, 4) != 0 ||
+        nphotons < 0 || nleaves < 1 ||
+        (nleaves & (nleaves - 1)) != 0) {
+
+        ri_log(LOG_WARN, "(PMap   ) \"%s\" is not a photon map", filename);
+        fclose(fp);
+        return NULL;
+    }
+
+    map = ri_photonmap_new(nphotons);
+
+    map->nphotons = nphotons;
+    map->nleaves  = nleaves;
+
+    for (i = 0; i < 3; i++) {
+        map->bmin[i] = bbox[i];
+        map->bmax[i] = bbox[i + 3];
+    }
+
+    ok &= fread(map->photons, sizeof(ri_photon_t), nphotons, fp) ==
+          (size_t)nphotons;
+
+    if (nleaves > 1) {
+        map->split = (float *)ri_mem_alloc(sizeof(float) * (nleaves - 1));
+        map->axis  = (unsigned char *)ri_mem_alloc(nleaves - 1);
+
+        ok &= fread(map->split, sizeof(float), nleaves - 1, fp) ==
+              (size_t)(nleaves - 1);
+        ok &= fread(map->axis, 1, nleaves - 1, fp) == (size_t)(nleaves - 1);
+    }
+
+    fclose(fp);
+
+    if (!ok) {
+        ri_log(LOG_WARN, "(PMap   ) \"%s\" is truncated", filename);
+        ri_photonmap_free(map);
+        return NULL;
+    }
+
+    build_soa(map);
+
+    map->balanced = 1;
+
+    ri_log(LOG_INFO, "(PMap   ) Loaded %d photons from \"%s\"",
+           map->nphotons, filename);
+
+    return map;
+}
+
+int
+ri_photonmap_dump(
+    const ri_photonmap_t *map,
+    const char        *filename)
+{
+    int                i;
+    const ri_photon_t *photon;
+    FILE              *fp;
+
+    fp = fopen(filename, "w");
+    if (!fp) {
+        ri_log(LOG_WARN, "(PMap   ) Can't open file \"%s\"", filename);
+        return -1;
+    }
+
+    fprintf(fp, "%d\n", map->nphotons);
+    fprintf(fp, "%f %f %f\n", map->bmin[0], map->bmin[1], map->bmin[2]);
+    fprintf(fp, "%f %f %f\n", map->bmax[0], map->bmax[1], map->bmax[2]);
+
+    for (i = 0; i < map->nphotons; i++) {
+
+        photon = &map->photons[i];
+
+        fprintf(fp, "%f %f %f %g %g %g\n",
+                photon->pos[0], photon->pos[1], photon->pos[2],
+                photon->power[0], photon->power[1], photon->power[2]);
+    }
+
+    fclose(fp);
+
+    ri_log(LOG_INFO, "(PMap   ) Dumped %d photons to \"%s\"",
+           map->nphotons, filename);
+
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ *
+ * Private functions
+ *
+ * ------------------------------------------------------------------------ */
+
+static void
+init_dir_table()
+{
+    int    i;
+    double angle;
+
+    if (dir_table_initialized) return;
+
+    for (i = 0; i < 256; i++) {
+        angle = (double)i * (1.0 / 256.0) * M_PI;
+        costheta[i] = cos(angle);
+        sintheta[i] = sin(angle);
+        cosphi[i]   = cos(2.0 * angle);
+        sinphi[i]   = sin(2.0 * angle);
+    }
+
+    dir_table_initialized = 1;
+}
+
+/*
+ * Index of the first photon in `leaf'. Photons are evenly distributed over
+ * leaves.
+ */
+static int
+leaf_begin(
+    const ri_photonmap_t *map,
+    int                   leaf)
+{
+    return (int)(((long long)leaf * map->nphotons) / map->nleaves);
+}
+
+/*
+ * Partially sorts photons[begin, end) so that photons[m] is at its sorted
+ * position along `axis'(Hoare's selection).
+ */
+static void
+select_median(
+    ri_photon_t          *photons,
+    int                   begin,
+    int                   end,
+    int                   m,
+    int                   axis)
+{
+    int         i, j;
+    int         left, right;
+    float       pivot;
+    ri_photon_t tmp;
+
+    left  = begin;
+    right = end - 1;
+
+    while (right > left) {
+
+        pivot = photons[right].pos[axis];
+
+        i = left - 1;
+        j = right;
+
+        while (1) {
+            while (photons[++i].pos[axis] < pivot) ;
+            while (photons[--j].pos[axis] > pivot && j > left) ;
+
+            if (i >= j) break;
+
+            tmp = photons[i]; photons[i] = photons[j]; photons[j] = tmp;
+        }
+
+        tmp = photons[i]; photons[i] = photons[right]; photons[right] = tmp;
+
+        if (i >= m) right = i - 1;
+        if (i <= m) left  = i + 1;
+    }
+}
+
+static void
+balance_node(
+    ri_photonmap_t       *map,
+    int                   node,
+    int                   lo_leaf,
+    int                   hi_leaf)
+{
+    int          i, j;
+    int          begin, end;
+    int          mid_leaf;
+    int          m;
+    int          axis;
+    float        bmin[3], bmax[3];
+    float        w, maxw;
+
+    if (hi_leaf - lo_leaf < 2) return;
+
+    begin    = leaf_begin(map, lo_leaf);
+    end      = leaf_begin(map, hi_leaf);
+    mid_leaf = (lo_leaf + hi_leaf) / 2;
+    m        = leaf_begin(map, mid_leaf);
+
+    /*
+     * Split along the longest axis of the photons in the node.
+     */
+    bmin[0] = bmin[1] = bmin[2] =  RI_INFINITY;
+    bmax[0] = bmax[1] = bmax[2] = -RI_INFINITY;
+
+    for (i = begin; i < end; i++) {
+        for (j = 0; j < 3; j++) {
+            if (map->photons[i].pos[j] < bmin[j]) {
+                bmin[j] = map->photons[i].pos[j];
+            }
+            if (map->photons[i].pos[j] > bmax[j]) {
+                bmax[j] = map->photons[i].pos[j];
+            }
+        }
+    }
+
+    axis = 0;
+    maxw = -1.0f;
+    for (j = 0; j < 3; j++) {
+        w = bmax[j] - bmin[j];
+        if (w > maxw) {
+            maxw = w;
+            axis = j;
+        }
+    }
+
+    if (m < end) {
+        select_median(map->photons, begin, end, m, axis);
+        map->split[node] = map->photons[m].pos[axis];
+    } else {
+        /* No photon in the right half. */
+        map->split[node] = bmax[axis];
+    }
+
+    map->axis[node] = (unsigned char)axis;
+
+    balance_node(map, 2 * node + 1, lo_leaf, mid_leaf);
+    balance_node(map, 2 * node + 2, mid_leaf, hi_leaf);
+}
+
+static void
+build_soa(
+    ri_photonmap_t       *map)
+{
+    int    i;
+    size_t size;
+
+    ri_mem_free(map->px);
+    ri_mem_free(map->py);
+    ri_mem_free(map->pz);
+
+    /* Padded for 4-wide loads at the end of the array. */
+    size = sizeof(float) * (map->nphotons + 4);
+
+    map->px = (float *)ri_mem_alloc(size);
+    map->py = (float *)ri_mem_alloc(size);
+    map->pz = (float *)ri_mem_alloc(size);
+
+    for (i = 0; i < map->nphotons; i++) {
+        map->px[i] = map->photons[i].pos[0];
+        map->py[i] = map->photons[i].pos[1];
+        map->pz[i] = map->photons[i].pos[2];
+    }
+
+    for (i = map->nphotons; i < map->nphotons + 4; i++) {
+        map->px[i] = map->py[i] = map->pz[i] = (float)RI_INFINITY;
+    }
+}
+
+/*
+ * Adds a photon to the max heap of the nearest photons. `maxdist2' shrinks
+ * to the farthest one once the heap is full.
+ */
+static void
+heap_insert(
+    ri_photon_nearest_t  *nearest,
+    int                  *n,
+    int                   k,
+    float                 dist2,
+    int                   index,
+    float                *maxdist2)
+{
+    int                 i, parent, child;
+    ri_photon_nearest_t tmp;
+
+    if (*n < k) {
+
+        /* Sift up. */
+        i = (*n)++;
+
+        while (i > 0) {
+            parent = (i - 1) / 2;
+            if (nearest[parent].dist2 >= dist2) break;
+            nearest[i] = nearest[parent];
+            i = parent;
+        }
+
+        nearest[i].dist2 = dist2;
+        nearest[i].index = index;
+
+        if (*n == k) *maxdist2 = nearest[0].dist2;
+
+        return;
+    }
+
+    /* Replace the farthest one and sift down. */
+    tmp.dist2 = dist2;
+    tmp.index = index;
+
+    i = 0;
+    while ((child = 2 * i + 1) < k) {
+        if (child + 1 < k && nearest[child + 1].dist2 > nearest[child].dist2) {
+            child++;
+        }
+        if (nearest[child].dist2 <= tmp.dist2) break;
+        nearest[i] = nearest[child];
+        i = child;
+    }
+
+    nearest[i] = tmp;
+
+    *maxdist2 = nearest[0].dist2;
+}
@@ -0,0 +1,165 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Photon map [Jensen 1996].
+ *
+ * Photons are first stored into per-thread buffers while tracing, then
+ * merged into a single map and balanced into a kd-tree.
+ *
+ * The kd-tree is a complete binary tree whose nodes are kept in an implicit
+ * array(children of node i are 2i+1 and 2i+2), so no pointers are stored.
+ * Each leaf holds a small bucket of photons. Photons are sorted in leaf
+ * order, and their positions are also kept in SoA arrays, so that the
+ * distances to a bucket are computed 4 photons at a time with SSE.
+ *
+ * $Id$
+ */
+
+#ifndef LUCILLE_PHOTONMAP_H
+#define LUCILLE_PHOTONMAP_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "vector.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Max number of photons in a leaf of the kd-tree.
+ */
+#define RI_PHOTONMAP_LEAF_SIZE      8
+
+/*
+ * Max number of photons used in a radiance estimate.
+ */
+#define RI_PHOTONMAP_MAX_ESTIMATE   1024
+
+typedef struct _ri_photon_t {
+
+    float           pos[3];             /* position                     */
+    float           power[3];           /* flux(RGB)                    */
+    unsigned char   theta, phi;         /* incident direction           */
+    short           pad;
+
+} ri_photon_t;
+
+typedef struct _ri_photon_nearest_t {
+
+    float           dist2;              /* squared distance             */
+    int             index;              /* index of the photon          */
+
+} ri_photon_nearest_t;
+
+typedef struct _ri_photonmap_t {
+
+    ri_photon_t    *photons;
+    int             nphotons;
+    int             max_photons;        /* size of `photons'            */
+
+    ri_vector_t     bmin;               /* bounding box of photons      */
+    ri_vector_t     bmax;
+
+    /*
+     * kd-tree. Built by ri_photonmap_balance().
+     */
+    int             balanced;
+    int             nleaves;            /* power of 2                   */
+    float          *split;              /* nleaves - 1 inner nodes      */
+    unsigned char  *axis;
+
+    float          *px;                 /* SoA copy of photon positions */
+    float          *py;
+    float          *pz;
+
+} ri_photonmap_t;
+
+extern ri_photonmap_t *ri_photonmap_new(
+    int                max_photons);
+
+extern void ri_photonmap_free(
+    ri_photonmap_t    *map);
+
+/*
+ * Stores a photon with `power' arriving at `pos' along `dir'. Returns 0 if
+ * the map is full.
+ */
+extern int  ri_photonmap_store(
+    ri_photonmap_t    *map,                             /* [inout]  */
+    const ri_vector_t  pos,
+    const ri_vector_t  dir,
+    const ri_vector_t  power);
+
+/*
+ * Appends photons of `src' to `dst', scaling their power by `scale'.
+ */
+extern void ri_photonmap_merge(
+    ri_photonmap_t    *dst,                             /* [inout]  */
+    const ri_photonmap_t *src,
+    ri_float_t         scale);
+
+/*
+ * Builds the kd-tree. Photons are reordered.
+ */
+extern void ri_photonmap_balance(
+    ri_photonmap_t    *map);                            /* [inout]  */
+
+/*
+ * Finds at most `k' photons nearest to `P' within sqrt(`maxdist2').
+ * `nearest' must have room for `k' entries. Returns the number of photons
+ * found, which are arranged as a max heap on dist2.
+ */
+extern int  ri_photonmap_locate(
+    const ri_photonmap_t *map,
+    ri_photon_nearest_t *nearest,                       /* [out]    */
+    const ri_vector_t  P,
+    ri_float_t         maxdist2,
+    int                k);
+
+/*
+ * Estimates irradiance `E' at (P, N) from at most `nphotons' photons
+ * within `maxdist'.
+ */
+extern void ri_photonmap_irradiance(
+    const ri_photonmap_t *map,
+    ri_vector_t        E,                               /* [out]    */
+    const ri_vector_t  P,
+    const ri_vector_t  N,
+    ri_float_t         maxdist,
+    int                nphotons);
+
+extern void ri_photonmap_photon_dir(
+    ri_vector_t        dir,                             /* [out]    */
+    const ri_photon_t *photon);
+
+/*
+ * Saves the balanced map in binary, which is loaded by
+ * ri_photonmap_load() without rebuilding the kd-tree.
+ */
+extern int  ri_photonmap_save(
+    const ri_photonmap_t *map,
+    const char        *filename);
+
+extern ri_photonmap_t *ri_photonmap_load(
+    const char        *filename);
+
+/*
+ * Writes photons in the text format of tools/pmapview.
+ */
+extern int  ri_photonmap_dump(
+    const ri_photonmap_t *map,
+    const char        *filename);
+
+#ifdef __cplusplus
+}    /* extern "C" */
+#endif
+
+#endif    /* LUCILLE_PHOTONMAP_H */
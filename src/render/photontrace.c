@@ -0,0 +1,1053 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Photon tracing.
+ *
+ * Each thread emits photons and stores them into its own photon maps, so
+ * no lock is taken while tracing. Thread local maps are merged and
+ * balanced afterwards.
+ *
+ * A light is chosen in proportion to its power, so every emitted photon
+ * carries about the same power. Photons are reflected by Russian roulette
+ * on the material reflectance.
+ *
+ * The global map stores photons at every diffuse hit. The caustic map is
+ * traced separately and stores only photons of L S+ D paths.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "photontrace.h"
+#include "memory.h"
+#include "log.h"
+#include "thread.h"
+#include "random.h"
+#include "geometric.h"
+#include "raytrace.h"
+#include "reflection.h"
+#include "sunsky.h"
+#include "texture.h"
+#include "profile.h"
+#include "instance.h"
+
+/*
+ * Max number of bounces of a photon.
+ */
+#define PHOTON_MAX_DEPTH        16
+
+/*
+ * Photon tracing gives up when this many times of the requested photons
+ * are emitted, e.g. for photons escaping from the scene.
+ */
+#define PHOTON_MAX_EMIT_RATIO   100
+
+#define EMITTER_AREA            0
+#define EMITTER_POINT           1
+#define EMITTER_DIRECTIONAL     2
+#define EMITTER_DOME            3
+#define EMITTER_SKY             4
+
+typedef struct _photon_emitter_t {
+
+    int             type;
+    ri_light_t     *light;
+
+    ri_vector_t     power;              /* flux of the light            */
+    ri_float_t      cdf;                /* for choosing a light         */
+    ri_float_t      pdf;
+
+    /*
+     * Area light. Triangles are chosen in proportion to their area.
+     * An area light defined in an object block has an emitter for each
+     * instance, with the transformation of the instance.
+     */
+    ri_geom_t      *geom;
+    const ri_matrix_t *xform;           /* object to world, or NULL     */
+    ri_float_t     *tri_cdf;
+    int             ntris;
+    ri_float_t      area;
+
+} photon_emitter_t;
+
+typedef struct _photontrace_t {
+
+    ri_render_t        *render;
+
+    photon_emitter_t   *emitters;
+    int                 nemitters;
+
+    ri_vector_t         center;         /* bounding sphere of the scene */
+    ri_float_t          radius;
+    ri_float_t          eps;
+
+    ri_mutex_t         *sky_mutex;      /* sunsky evaluation isn't
+                                         * thread safe                  */
+
+} photontrace_t;
+
+typedef struct _photontrace_thread_t {
+
+    int                 thread_id;
+    photontrace_t      *pt;
+
+    ri_photonmap_t     *global;         /* thread local maps            */
+    ri_photonmap_t     *caustic;
+
+    long long           nemitted_global;
+    long long           nemitted_caustic;
+
+} photontrace_thread_t;
+
+static int  setup_emitters(
+    photontrace_t        *pt);
+static int  setup_area_emitter(
+    photon_emitter_t     *e,
+    const ri_vector_t     L,
+    ri_geom_t            *geom,
+    const ri_matrix_t    *xform);
+static void get_emitter_triangle(
+    ri_vector_t           v0,
+    ri_vector_t           v1,
+    ri_vector_t           v2,
+    const photon_emitter_t *e,
+    int                   i);
+static ri_object_t *find_object(
+    const ri_scene_t     *scene,
+    const ri_geom_t      *geom);
+static void free_emitters(
+    photontrace_t        *pt);
+static void emit_photon(
+    photontrace_t        *pt,
+    int                   thread_id,
+    ri_vector_t           org,
+    ri_vector_t           dir,
+    ri_vector_t           power);
+static void trace_photon(
+    photontrace_t        *pt,
+    photontrace_thread_t *info,
+    const ri_vector_t     org,
+    const ri_vector_t     dir,
+    const ri_vector_t     power,
+    int                   caustic);
+static int  list_has_specular(
+    ri_list_t            *geom_list);
+static int  has_specular(
+    const ri_render_t    *render);
+static void *photontrace_thread_func(
+    void                 *arg);
+static ri_photonmap_t *merge_maps(
+    photontrace_thread_t *infos,
+    int                   nthreads,
+    int                   caustic);
+
+/* ---------------------------------------------------------------------------
+ *
+ * Public functions
+ *
+ * ------------------------------------------------------------------------ */
+
+void
+ri_photontrace(
+    ri_render_t        *render,
+    ri_photonmap_t    **global_out,
+    ri_photonmap_t    **caustic_out,
+    int                 nglobal,
+    int                 ncaustics,
+    int                 nthreads)
+{
+    int                   i;
+    ri_scene_t           *scene;
+    photontrace_t         pt;
+    photontrace_thread_t  infos[RI_MAX_THREADS];
+    ri_thread_t           threads[RI_MAX_THREADS];
+
+    *global_out  = NULL;
+    *caustic_out = NULL;
+
+    if (nthreads < 1)              nthreads = 1;
+    if (nthreads > RI_MAX_THREADS) nthreads = RI_MAX_THREADS;
+
+    scene = render->scene;
+
+    memset(&pt, 0, sizeof(photontrace_t));
+
+    pt.render = render;
+
+    for (i = 0; i < 3; i++) {
+        pt.center[i] = 0.5 * (scene->bmin[i] + scene->bmax[i]);
+    }
+    pt.radius = 0.5 * sqrt(
+        (scene->bmax[0] - scene->bmin[0]) * (scene->bmax[0] - scene->bmin[0]) +
+        (scene->bmax[1] - scene->bmin[1]) * (scene->bmax[1] - scene->bmin[1]) +
+        (scene->bmax[2] - scene->bmin[2]) * (scene->bmax[2] - scene->bmin[2]));
+    pt.radius *= 1.01;
+    pt.eps     = 1.0e-5 * scene->maxwidth;
+
+    if (!setup_emitters(&pt)) {
+        ri_log(LOG_WARN, "(PMap   ) No light emits photons");
+        free_emitters(&pt);
+        return;
+    }
+
+    if (ncaustics > 0 && !has_specular(render)) {
+        ri_log(LOG_INFO, "(PMap   ) No specular surface. "
+               "Caustic photon map is not built");
+        ncaustics = 0;
+    }
+
+    pt.sky_mutex = ri_mutex_new();
+    ri_mutex_init(pt.sky_mutex);
+
+    for (i = 0; i < nthreads; i++) {
+
+        infos[i].thread_id        = i;
+        infos[i].pt               = &pt;
+        infos[i].global           = NULL;
+        infos[i].caustic          = NULL;
+        infos[i].nemitted_global  = 0;
+        infos[i].nemitted_caustic = 0;
+
+        /* Evenly divide photons over threads. */
+        if (nglobal > 0) {
+            infos[i].global  = ri_photonmap_new(
+                (nglobal * (i + 1)) / nthreads - (nglobal * i) / nthreads);
+        }
+
+        if (ncaustics > 0) {
+            infos[i].caustic = ri_photonmap_new(
+                (ncaustics * (i + 1)) / nthreads - (ncaustics * i) / nthreads);
+        }
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        ri_thread_create(&threads[i], photontrace_thread_func, &infos[i]);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        ri_thread_join(&threads[i]);
+    }
+
+    if (nglobal > 0) {
+        *global_out = merge_maps(infos, nthreads, 0);
+    }
+
+    if (ncaustics > 0) {
+        *caustic_out = merge_maps(infos, nthreads, 1);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        ri_photonmap_free(infos[i].global);
+        ri_photonmap_free(infos[i].caustic);
+    }
+
+    ri_mutex_free(pt.sky_mutex);
+    free_emitters(&pt);
+}
+
+/* ---------------------------------------------------------------------------
+ *
+ * Private functions
+ *
+ * ------------------------------------------------------------------------ */
+
+static ri_float_t
+power_luminance(const ri_vector_t power)
+{
+    return (power[0] + power[1] + power[2]) / 3.0;
+}
+
+/*
+ * Sky color of the direction `dir'(pointing toward the sky).
+ */
+static void
+sky_color(
+    photontrace_t        *pt,
+    ri_vector_t           L,
+    const ri_light_t     *light,
+    const ri_vector_t     dir)
+{
+    float v[3];
+    float rgb[3];
+
+    v[0] = (float)dir[0];
+    v[1] = (float)dir[1];
+    v[2] = (float)dir[2];
+
+    if (pt->sky_mutex) ri_mutex_lock(pt->sky_mutex);
+    ri_sunsky_get_sky_rgb(rgb, light->sunsky, v);
+    if (pt->sky_mutex) ri_mutex_unlock(pt->sky_mutex);
+
+    L[0] = rgb[0];
+    L[1] = rgb[1];
+    L[2] = rgb[2];
+}
+
+static void
+uniform_sphere(
+    ri_vector_t           dir,
+    ri_float_t            u0,
+    ri_float_t            u1)
+{
+    ri_float_t z   = 1.0 - 2.0 * u0;
+    ri_float_t r   = sqrt(1.0 - z * z);
+    ri_float_t phi = 2.0 * M_PI * u1;
+
+    dir[0] = r * cos(phi);
+    dir[1] = r * sin(phi);
+    dir[2] = z;
+}
+
+static void
+cosine_hemisphere(
+    ri_vector_t           dir,
+    const ri_vector_t     n,
+    ri_float_t            u0,
+    ri_float_t            u1)
+{
+    int         k;
+    ri_float_t  cos_theta, sin_theta, phi;
+    ri_vector_t basis[3];
+
+    ri_ortho_basis(basis, n);
+
+    cos_theta = sqrt(u0);
+    sin_theta = sqrt(1.0 - u0);
+    phi       = 2.0 * M_PI * u1;
+
+    for (k = 0; k < 3; k++) {
+        dir[k] = cos(phi) * sin_theta * basis[0][k]
+               + sin(phi) * sin_theta * basis[1][k]
+               + cos_theta            * basis[2][k];
+    }
+}
+
+/*
+ * Point on the disk of the bounding sphere, facing `dir', from which
+ * parallel photons are shot along -dir.
+ */
+static void
+disk_origin(
+    photontrace_t        *pt,
+    ri_vector_t           org,
+    const ri_vector_t     dir,
+    ri_float_t            u0,
+    ri_float_t            u1)
+{
+    int         k;
+    ri_float_t  r, phi;
+    ri_vector_t basis[3];
+
+    ri_ortho_basis(basis, dir);
+
+    r   = pt->radius * sqrt(u0);
+    phi = 2.0 * M_PI * u1;
+
+    for (k = 0; k < 3; k++) {
+        org[k] = pt->center[k] + pt->radius * dir[k]
+               + r * cos(phi) * basis[0][k]
+               + r * sin(phi) * basis[1][k];
+    }
+}
+
+static int
+setup_emitters(
+    photontrace_t        *pt)
+{
+    int               i, n;
+    int               count;
+    ri_float_t        sum;
+    ri_float_t        area;
+    ri_float_t        disk;
+    ri_vector_t       L, dir;
+    ri_list_t        *itr;
+    ri_list_t        *inst_itr;
+    ri_light_t       *light;
+    ri_object_t      *object;
+    ri_instance_t    *instance;
+    ri_scene_t       *scene;
+    photon_emitter_t *e;
+
+    scene = pt->render->scene;
+
+    /* An area light in an object block has an emitter per instance. */
+    count = 0;
+    for (itr = ri_list_first(scene->light_list);
+         itr != NULL;
+         itr = ri_list_next(itr)) {
+
+        light  = (ri_light_t *)itr->data;
+        object = light->geom ? find_object(scene, light->geom) : NULL;
+
+        count += object ? (int)object->ninstances : 1;
+    }
+
+    if (count == 0) return 0;
+
+    pt->emitters  = (photon_emitter_t *)ri_mem_alloc(
+                        sizeof(photon_emitter_t) * count);
+    pt->nemitters = 0;
+
+    disk = M_PI * pt->radius * pt->radius;
+
+    for (itr = ri_list_first(scene->light_list);
+         itr != NULL;
+         itr = ri_list_next(itr)) {
+
+        light = (ri_light_t *)itr->data;
+        e     = &pt->emitters[pt->nemitters];
+
+        memset(e, 0, sizeof(photon_emitter_t));
+        e->light = light;
+
+        ri_vector_scale(L, light->col, (ri_float_t)light->intensity);
+
+        if (light->geom) {
+
+            object = find_object(scene, light->geom);
+
+            if (object == NULL) {
+
+                pt->nemitters += setup_area_emitter(e, L, light->geom, NULL);
+
+            } else {
+
+                /*
+                 * The prototype itself is not in the scene. Emit from
+                 * each instance of it.
+                 */
+                for (inst_itr = ri_list_first(scene->instance_list);
+                     inst_itr != NULL;
+                     inst_itr = ri_list_next(inst_itr)) {
+
+                    instance = (ri_instance_t *)inst_itr->data;
+                    if (instance->object != object) continue;
+
+                    e = &pt->emitters[pt->nemitters];
+
+                    memset(e, 0, sizeof(photon_emitter_t));
+                    e->light = light;
+
+                    pt->nemitters += setup_area_emitter(e, L, light->geom,
+                                                        &instance->xform);
+                }
+            }
+
+            continue;
+
+        } else if (light->type == LIGHTTYPE_SUNLIGHT ||
+                   light->type == LIGHTTYPE_DIRECTIONAL) {
+
+            /*
+             * Parallel light crossing the disk of the bounding sphere.
+             */
+            e->type = EMITTER_DIRECTIONAL;
+            ri_vector_scale(e->power, L, disk);
+
+        } else if (light->type == LIGHTTYPE_DOME) {
+
+            /*
+             * Constant radiance from all directions. With uniform
+             * directions and origins on the disk, flux = 4 pi * disk * L.
+             */
+            e->type = EMITTER_DOME;
+            ri_vector_scale(e->power, L, 4.0 * M_PI * disk);
+
+        } else if (light->type == LIGHTTYPE_SUNSKY) {
+
+            /*
+             * Estimate the flux from the mean sky color. It is used only
+             * for choosing a light; each photon gets the exact color.
+             */
+            e->type = EMITTER_SKY;
+            ri_vector_setzero(e->power);
+
+            n = 256;
+            for (i = 0; i < n; i++) {
+                uniform_sphere(dir, (i + 0.5) / n, fmod(i * 0.618034, 1.0));
+                sky_color(pt, L, light, dir);
+                ri_vector_add(e->power, e->power, L);
+            }
+
+            ri_vector_scale(e->power, e->power, 4.0 * M_PI * disk / n);
+
+        } else if (light->type == LIGHTTYPE_NONE ||
+                   light->type == LIGHTTYPE_POINTLIGHT) {
+
+            /*
+             * Isotropic point light of intensity L: flux = 4 pi * L.
+             */
+            e->type = EMITTER_POINT;
+            ri_vector_scale(e->power, L, 4.0 * M_PI);
+
+        } else {
+
+            continue;
+
+        }
+
+        if (power_luminance(e->power) <= 0.0) {
+            ri_mem_free(e->tri_cdf);
+            continue;
+        }
+
+        pt->nemitters++;
+    }
+
+    if (pt->nemitters == 0) return 0;
+
+    sum = 0.0;
+    for (i = 0; i < pt->nemitters; i++) {
+        sum += power_luminance(pt->emitters[i].power);
+    }
+
+    area = 0.0;
+    for (i = 0; i < pt->nemitters; i++) {
+        pt->emitters[i].pdf = power_luminance(pt->emitters[i].power) / sum;
+        area += pt->emitters[i].pdf;
+        pt->emitters[i].cdf = area;
+    }
+
+    return 1;
+}
+
+/*
+ * Sets up the emitter of the area light `geom', transformed with `xform'
+ * if not NULL. Diffuse emitter of radiance L: flux = pi * A * L.
+ * Returns 1 if the emitter has power.
+ */
+static int
+setup_area_emitter(
+    photon_emitter_t     *e,
+    const ri_vector_t     L,
+    ri_geom_t            *geom,
+    const ri_matrix_t    *xform)
+{
+    int               i;
+    ri_float_t        sum;
+    ri_vector_t       v0, v1, v2;
+
+    e->type  = EMITTER_AREA;
+    e->geom  = geom;
+    e->xform = xform;
+    e->ntris = geom->nindices / 3;
+
+    if (e->ntris < 1) return 0;
+
+    e->tri_cdf = (ri_float_t *)ri_mem_alloc(sizeof(ri_float_t) * e->ntris);
+
+    sum = 0.0;
+    for (i = 0; i < e->ntris; i++) {
+        get_emitter_triangle(v0, v1, v2, e, i);
+        sum += ri_area(v0, v1, v2);
+        e->tri_cdf[i] = sum;
+    }
+
+    e->area = sum;
+    ri_vector_scale(e->power, L, M_PI * sum);
+
+    if (sum <= 0.0 || power_luminance(e->power) <= 0.0) {
+        ri_mem_free(e->tri_cdf);
+        e->tri_cdf = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Returns the vertices of the i'th triangle of the area light in world
+ * space.
+ */
+static void
+get_emitter_triangle(
+    ri_vector_t           v0,
+    ri_vector_t           v1,
+    ri_vector_t           v2,
+    const photon_emitter_t *e,
+    int                   i)
+{
+    const ri_geom_t *geom = e->geom;
+
+    ri_vector_copy(v0, geom->positions[geom->indices[3 * i + 0]]);
+    ri_vector_copy(v1, geom->positions[geom->indices[3 * i + 1]]);
+    ri_vector_copy(v2, geom->positions[geom->indices[3 * i + 2]]);
+
+    if (e->xform) {
+        v0[3] = v1[3] = v2[3] = 1.0;
+        ri_vector_transform(v0, v0, e->xform);
+        ri_vector_transform(v1, v1, e->xform);
+        ri_vector_transform(v2, v2, e->xform);
+    }
+}
+
+/*
+ * Returns the prototype which has `geom', or NULL if `geom' is not in an
+ * object block.
+ */
+static ri_object_t *
+find_object(
+    const ri_scene_t     *scene,
+    const ri_geom_t      *geom)
+{
+    ri_list_t     *itr;
+    ri_list_t     *geom_itr;
+    ri_object_t   *object;
+
+    for (itr = ri_list_first(scene->object_list);
+         itr != NULL;
+         itr = ri_list_next(itr)) {
+
+        object = (ri_object_t *)itr->data;
+
+        for (geom_itr = ri_list_first(object->geom_list);
+             geom_itr != NULL;
+             geom_itr = ri_list_next(geom_itr)) {
+
+            if ((const ri_geom_t *)geom_itr->data == geom) return object;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+free_emitters(
+    photontrace_t        *pt)
+{
+    int i;
+
+    if (pt->emitters == NULL) return;
+
+    for (i = 0; i < pt->nemitters; i++) {
+        ri_mem_free(pt->emitters[i].tri_cdf);
+    }
+
+    ri_mem_free(pt->emitters);
+    pt->emitters = NULL;
+}
+
+static void
+emit_photon(
+    photontrace_t        *pt,
+    int                   thread_id,
+    ri_vector_t           org,
+    ri_vector_t           dir,
+    ri_vector_t           power)
+{
+    int               i;
+    int               lo, hi, mid;
+    ri_float_t        u, s, t;
+    ri_float_t        scale;
+    ri_vector_t       L, n, w;
+    ri_vector_t       v0, v1, v2;
+    photon_emitter_t *e;
+
+    /*
+     * Choose a light.
+     */
+    u = randomMT2(thread_id);
+    for (i = 0; i < pt->nemitters - 1; i++) {
+        if (u < pt->emitters[i].cdf) break;
+    }
+
+    e     = &pt->emitters[i];
+    scale = 1.0 / e->pdf;
+
+    ri_vector_scale(L, e->light->col, (ri_float_t)e->light->intensity);
+
+    switch (e->type) {
+
+    case EMITTER_AREA:
+
+        /* Choose a triangle in proportion to its area. */
+        u  = randomMT2(thread_id) * e->area;
+        lo = 0;
+        hi = e->ntris - 1;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if (u < e->tri_cdf[mid]) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+
+        get_emitter_triangle(v0, v1, v2, e, lo);
+
+        s = sqrt(randomMT2(thread_id));
+        t = randomMT2(thread_id);
+
+        for (i = 0; i < 3; i++) {
+            org[i] = v0[i] * (1.0 - s) + v1[i] * (s - t * s) + v2[i] * s * t;
+        }
+
+        ri_normal_of_triangle(n, v0, v1, v2);
+
+        cosine_hemisphere(dir, n, randomMT2(thread_id), randomMT2(thread_id));
+
+        for (i = 0; i < 3; i++) {
+            org[i] += pt->eps * n[i];
+        }
+
+        ri_vector_copy(power, e->power);
+
+        break;
+
+    case EMITTER_POINT:
+
+        ri_vector_copy(org, e->light->pos);
+        uniform_sphere(dir, randomMT2(thread_id), randomMT2(thread_id));
+
+        ri_vector_copy(power, e->power);
+
+        break;
+
+    case EMITTER_DIRECTIONAL:
+
+        /* light->direction points toward the light. */
+        ri_vector_copy(w, e->light->direction);
+        ri_vector_normalize(w);
+
+        disk_origin(pt, org, w, randomMT2(thread_id), randomMT2(thread_id));
+        ri_vector_copy(dir, w);
+        ri_vector_neg(dir);
+
+        ri_vector_copy(power, e->power);
+
+        break;
+
+    case EMITTER_DOME:
+    case EMITTER_SKY:
+
+        /* w is the direction toward the sky. */
+        uniform_sphere(w, randomMT2(thread_id), randomMT2(thread_id));
+
+        disk_origin(pt, org, w, randomMT2(thread_id), randomMT2(thread_id));
+        ri_vector_copy(dir, w);
+        ri_vector_neg(dir);
+
+        if (e->type == EMITTER_SKY) {
+            sky_color(pt, L, e->light, w);
+        }
+
+        s = 4.0 * M_PI * M_PI * pt->radius * pt->radius;
+        ri_vector_scale(power, L, s);
+
+        break;
+
+    default:
+
+        assert(0);
+        break;
+
+    }
+
+    ri_vector_scale(power, power, scale);
+}
+
+/*
+ * Returns 1 if the geometries in `geom_list' have a specular or
+ * transmissive surface.
+ */
+static int
+list_has_specular(
+    ri_list_t            *geom_list)
+{
+    ri_list_t     *itr;
+    ri_geom_t     *geom;
+
+    for (itr = ri_list_first(geom_list);
+         itr != NULL;
+         itr = ri_list_next(itr)) {
+
+        geom = (ri_geom_t *)itr->data;
+
+        if (geom->material == NULL) continue;
+
+        if (ri_vector_ave(geom->material->ks) > 0.0 ||
+            ri_vector_ave(geom->material->kt) > 0.0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Returns 1 if the scene has a specular or transmissive surface, which may
+ * produce caustics. Prototypes are checked if they are instanced.
+ */
+static int
+has_specular(
+    const ri_render_t    *render)
+{
+    ri_list_t     *itr;
+    ri_object_t   *object;
+
+    if (list_has_specular(render->scene->geom_list)) return 1;
+
+    for (itr = ri_list_first(render->scene->object_list);
+         itr != NULL;
+         itr = ri_list_next(itr)) {
+
+        object = (ri_object_t *)itr->data;
+
+        if (object->ninstances == 0) continue;
+
+        if (list_has_specular(object->geom_list)) return 1;
+    }
+
+    return 0;
+}
+
+static void
+trace_photon(
+    photontrace_t        *pt,
+    photontrace_thread_t *info,
+    const ri_vector_t     org,
+    const ri_vector_t     dir,
+    const ri_vector_t     power,
+    int                   caustic)
+{
+    int                     i;
+    int                     depth;
+    int                     hit;
+    int                     nspecular;
+    int                     thread_id;
+    ri_float_t              pd, ps, pt_, sum;
+    ri_float_t              u;
+    ri_vector_t             kd, ks, kt;
+    ri_vector_t             N;
+    ri_vector_t             texcol;
+    ri_vector_t             newdir;
+    ri_vector_t             flux;
+    ri_material_t          *material;
+    ri_ray_t                ray;
+    ri_intersection_state_t state;
+
+    thread_id = info->thread_id;
+
+    ri_vector_copy(ray.org, org);
+    ri_vector_copy(ray.dir, dir);
+    ri_vector_copy(flux, power);
+    ray.thread_num = thread_id;
+    ray.has_differentials = 0;
+
+    /* A photon path sees the scene at a random time in the shutter. */
+    if (pt->render->scene->motion_blur) {
+        ray.time = (float)randomMT2(thread_id);
+    } else {
+        ray.time = 0.0f;
+    }
+
+    nspecular = 0;
+
+    for (depth = 0; depth < PHOTON_MAX_DEPTH; depth++) {
+
+        hit = ri_raytrace(pt->render, &ray, &state);
+        if (!hit) break;
+
+        /* Absorbed by lights. */
+        if (state.geom->light) break;
+
+        material = state.geom->material;
+
+        if (material) {
+            ri_vector_copy(kd, material->kd);
+            ri_vector_copy(ks, material->ks);
+            ri_vector_copy(kt, material->kt);
+
+            if (material->texture) {
+                ri_texture_fetch(texcol, material->texture,
+                                 state.stqr[0], state.stqr[1]);
+                kd[0] *= texcol[0];
+                kd[1] *= texcol[1];
+                kd[2] *= texcol[2];
+            }
+        } else {
+            ri_vector_set1(kd, 1.0);
+            ri_vector_setzero(ks);
+            ri_vector_setzero(kt);
+        }
+
+        /* Face forward. */
+        ri_vector_copy(N, state.Ns);
+        if (ri_vector_dot(N, ray.dir) > 0.0) {
+            ri_vector_neg(N);
+        }
+
+        pd  = ri_vector_ave(kd);
+        ps  = ri_vector_ave(ks);
+        pt_ = ri_vector_ave(kt);
+
+        if (pd > 0.0) {
+
+            if (caustic) {
+
+                /* Caustic paths end at the first diffuse surface. */
+                if (nspecular > 0) {
+                    ri_photonmap_store(info->caustic, state.P, ray.dir, flux);
+                }
+                break;
+
+            }
+
+            if (!ri_photonmap_store(info->global, state.P, ray.dir, flux)) {
+                break;
+            }
+        }
+
+        /*
+         * Russian roulette.
+         */
+        sum = pd + ps + pt_;
+        if (sum > 1.0) {
+            pd  /= sum;
+            ps  /= sum;
+            pt_ /= sum;
+        }
+
+        u = randomMT2(thread_id);
+
+        if (u < pd) {
+
+            cosine_hemisphere(newdir, N,
+                              randomMT2(thread_id), randomMT2(thread_id));
+
+            for (i = 0; i < 3; i++) flux[i] *= kd[i] / pd;
+
+        } else if (u < pd + ps) {
+
+            ri_reflect(newdir, ray.dir, N);
+            ri_vector_normalize(newdir);
+
+            for (i = 0; i < 3; i++) flux[i] *= ks[i] / ps;
+
+            nspecular++;
+
+        } else if (u < pd + ps + pt_) {
+
+            ri_refract(newdir, ray.dir, state.Ns, material->ior);
+            ri_vector_normalize(newdir);
+
+            for (i = 0; i < 3; i++) flux[i] *= kt[i] / pt_;
+
+            nspecular++;
+
+        } else {
+
+            break;
+
+        }
+
+        for (i = 0; i < 3; i++) {
+            ray.org[i] = state.P[i] + pt->eps * newdir[i];
+        }
+        ri_vector_copy(ray.dir, newdir);
+    }
+}
+
+static void *
+photontrace_thread_func(
+    void                 *arg)
+{
+    long long             max_emit;
+    ri_vector_t           org, dir, power;
+    photontrace_thread_t *info;
+    photontrace_t        *pt;
+
+    info = (photontrace_thread_t *)arg;
+    pt   = info->pt;
+
+    ri_prof_set_thread(info->thread_id);
+
+    if (info->global) {
+
+        max_emit = (long long)info->global->max_photons *
+                   PHOTON_MAX_EMIT_RATIO;
+
+        while (info->global->nphotons < info->global->max_photons &&
+               info->nemitted_global < max_emit) {
+
+            emit_photon(pt, info->thread_id, org, dir, power);
+            info->nemitted_global++;
+
+            trace_photon(pt, info, org, dir, power, 0);
+        }
+    }
+
+    if (info->caustic) {
+
+        max_emit = (long long)info->caustic->max_photons *
+                   PHOTON_MAX_EMIT_RATIO;
+
+        while (info->caustic->nphotons < info->caustic->max_photons &&
+               info->nemitted_caustic < max_emit) {
+
+            emit_photon(pt, info->thread_id, org, dir, power);
+            info->nemitted_caustic++;
+
+            trace_photon(pt, info, org, dir, power, 1);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Merges thread local maps. The power of photons is divided by the total
+ * number of emitted photons.
+ */
+static ri_photonmap_t *
+merge_maps(
+    photontrace_thread_t *infos,
+    int                   nthreads,
+    int                   caustic)
+{
+    int             i;
+    int             nphotons;
+    long long       nemitted;
+    ri_photonmap_t *local;
+    ri_photonmap_t *map;
+
+    nphotons = 0;
+    nemitted = 0;
+
+    for (i = 0; i < nthreads; i++) {
+        local     = caustic ? infos[i].caustic : infos[i].global;
+        nphotons += local->nphotons;
+        nemitted += caustic ? infos[i].nemitted_caustic
+                            : infos[i].nemitted_global;
+    }
+
+    ri_log(LOG_INFO, "(PMap   ) %s map: %d photons stored, %lld emitted",
+           caustic ? "Caustic" : "Global", nphotons, nemitted);
+
+    if (nphotons == 0) return NULL;
+
+    map = ri_photonmap_new(nphotons);
+
+    for (i = 0; i < nthreads; i++) {
+        local = caustic ? infos[i].caustic : infos[i].global;
+        ri_photonmap_merge(map, local, 1.0 / (ri_float_t)nemitted);
+    }
+
+    ri_photonmap_balance(map);
+
+    return map;
+}
@@ -0,0 +1,47 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Photon tracing. Emits photons from lights of the scene and stores them
+ * into photon maps.
+ *
+ * $Id$
+ */
+
+#ifndef LUCILLE_PHOTONTRACE_H
+#define LUCILLE_PHOTONTRACE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "render.h"
+#include "photonmap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Traces photons with `nthreads' threads until `nglobal' photons are
+ * stored into the global photon map and `ncaustics' photons into the
+ * caustic photon map. A map is not built if its count is 0. Maps are
+ * returned balanced, and NULL if no photon was stored.
+ */
+extern void ri_photontrace(
+    ri_render_t        *render,
+    ri_photonmap_t    **global_out,                     /* [out]    */
+    ri_photonmap_t    **caustic_out,                    /* [out]    */
+    int                 nglobal,
+    int                 ncaustics,
+    int                 nthreads);
+
+#ifdef __cplusplus
+}    /* extern "C" */
+#endif
+
+#endif    /* LUCILLE_PHOTONTRACE_H */
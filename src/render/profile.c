@@ -0,0 +1,172 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Lightweight profiling counters and timers for the render loop.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(LINUX) || defined(__MACH__)
+#include <sys/time.h>
+#endif
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "profile.h"
+
+#if defined(__GNUC__)
+ri_prof_block_t ri_prof_blocks[RI_MAX_THREADS]
+    __attribute__((aligned(RI_PROF_CACHE_LINE_SIZE)));
+#elif defined(_MSC_VER)
+__declspec(align(64)) ri_prof_block_t ri_prof_blocks[RI_MAX_THREADS];
+#else
+ri_prof_block_t ri_prof_blocks[RI_MAX_THREADS];
+#endif
+
+RI_PROF_TLS int ri_prof_thread_id = 0;
+
+/*
+ * Wall clock and tick count at ri_prof_reset(). Used to convert ticks into
+ * seconds.
+ */
+static double   gstart_seconds = 0.0;
+static uint64_t gstart_ticks   = 0;
+
+static const char *counter_names[RI_PROF_NCOUNTERS] = {
+    "Rays(closest hit)",
+    "Rays(any hit)",
+    "Packet rays(closest hit)",
+    "Packet rays(any hit)",
+    "Inner node traversals",
+    "Leaf node traversals",
+    "Triangle tests",
+    "BVH queries",
+    "Beam queries",
+    "Shader invocations",
+    "Texture fetches",
+    "Hemisphere rays",
+    "Irradiance cache lookups",
+    "Irradiance cache hits"
+};
+
+static const char *timer_names[RI_PROF_NTIMERS] = {
+    "Shader time(sec)"
+};
+
+static double
+wall_seconds()
+{
+#if defined(LINUX) || defined(__MACH__)
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec * 1.0e-6;
+#elif defined(WIN32)
+    return GetTickCount() * 1.0e-3;
+#else
+    return 0.0;
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ *
+ * Public functions
+ *
+ * ------------------------------------------------------------------------ */
+
+void
+ri_prof_reset()
+{
+    memset(ri_prof_blocks, 0, sizeof(ri_prof_block_t) * RI_MAX_THREADS);
+
+    gstart_seconds = wall_seconds();
+    gstart_ticks   = ri_prof_ticks();
+}
+
+void
+ri_prof_set_thread(int thread_id)
+{
+    assert(thread_id >= 0);
+    assert(thread_id < RI_MAX_THREADS);
+
+#ifndef RI_PROF_NO_TLS
+    ri_prof_thread_id = thread_id;
+#else
+    /* No TLS. All threads share the block 0. */
+    (void)thread_id;
+#endif
+}
+
+void
+ri_prof_merge(ri_prof_result_t *result_out)
+{
+    int      i, k;
+    uint64_t ticks;
+    double   seconds;
+    double   seconds_per_tick = 0.0;
+
+    /*
+     * Calibrate ticks with the wall clock elapsed since the last reset.
+     */
+    ticks   = ri_prof_ticks() - gstart_ticks;
+    seconds = wall_seconds()  - gstart_seconds;
+
+    if ((gstart_ticks != 0) && (ticks > 0)) {
+        seconds_per_tick = seconds / (double)ticks;
+    }
+
+    memset(result_out, 0, sizeof(ri_prof_result_t));
+
+    for (i = 0; i < RI_MAX_THREADS; i++) {
+
+        for (k = 0; k < RI_PROF_NCOUNTERS; k++) {
+            result_out->counters[k] += ri_prof_blocks[i].counters[k];
+        }
+
+        for (k = 0; k < RI_PROF_NTIMERS; k++) {
+            result_out->seconds[k] += ri_prof_blocks[i].ticks[k] *
+                                      seconds_per_tick;
+        }
+    }
+}
+
+void
+ri_prof_report(const ri_prof_result_t *result)
+{
+    int k;
+
+    printf( "\n" );
+    printf( "/= Profile counters ======================="
+        "====================================\n" );
+    printf( "|\n" );
+
+    for (k = 0; k < RI_PROF_NCOUNTERS; k++) {
+        printf( "| %-48s:  %20llu\n", counter_names[k],
+                (unsigned long long)result->counters[k] );
+    }
+
+    for (k = 0; k < RI_PROF_NTIMERS; k++) {
+        printf( "| %-48s:  %20.6f\n", timer_names[k], result->seconds[k] );
+    }
+
+    printf( "|\n" );
+    printf(
+        "\\------------------------------------------------------------------------------\n" );
+    fflush( stdout );
+}
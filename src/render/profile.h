@@ -0,0 +1,183 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Lightweight profiling counters and timers for the render loop.
+ *
+ * Each thread owns a cache line aligned block of counters, so hot paths
+ * update them with plain(non-atomic) additions without false sharing.
+ * Blocks are merged at the end of the frame.
+ *
+ * Timers count CPU ticks(TSC on x86, monotonic clock elsewhere). Ticks are
+ * converted to seconds when merged.
+ *
+ *   uint64_t t0 = ri_prof_ticks();
+ *   ...
+ *   ri_prof_timer_add(RI_PROF_TIMER_SHADER, ri_prof_ticks() - t0);
+ *
+ * Define RI_PROF_DISABLE to compile out all the instrumentation.
+ *
+ * $Id$
+ */
+
+#ifndef LUCILLE_PROFILE_H
+#define LUCILLE_PROFILE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+
+#if !defined(__x86__) && (defined(LINUX) || defined(__MACH__))
+#include <time.h>
+#endif
+
+#include "thread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Counters
+ */
+#define RI_PROF_NRAYS                   0   /* closest hit queries      */
+#define RI_PROF_NSHADOW_RAYS            1   /* any-hit queries          */
+#define RI_PROF_NPACKET_RAYS            2   /* closest hit in packets   */
+#define RI_PROF_NPACKET_SHADOW_RAYS     3   /* any-hit in packets       */
+#define RI_PROF_NINNER_NODES            4   /* inner node traversals    */
+#define RI_PROF_NLEAF_NODES             5   /* leaf node traversals     */
+#define RI_PROF_NTRIANGLE_TESTS         6   /* ray-triangle tests       */
+#define RI_PROF_NBVH_QUERIES            7   /* single and packet rays   */
+#define RI_PROF_NBEAMS                  8   /* beam queries             */
+#define RI_PROF_NSHADER_CALLS           9
+#define RI_PROF_NTEXTURE_FETCHES        10
+#define RI_PROF_NHEMISPHERE_RAYS        11  /* gathering rays           */
+#define RI_PROF_NIRRADCACHE_LOOKUPS     12
+#define RI_PROF_NIRRADCACHE_HITS        13
+#define RI_PROF_NCOUNTERS               14
+
+/*
+ * Timers
+ */
+#define RI_PROF_TIMER_SHADER            0
+#define RI_PROF_NTIMERS                 1
+
+#define RI_PROF_CACHE_LINE_SIZE         64
+
+/*
+ * Struct: ri_prof_block_t
+ *
+ *   Counters of a thread. Padded to the multiple of cache line size.
+ */
+typedef struct _ri_prof_block_t {
+
+    uint64_t    counters[RI_PROF_NCOUNTERS];
+    uint64_t    ticks[RI_PROF_NTIMERS];
+
+    uint8_t     pad[RI_PROF_CACHE_LINE_SIZE -
+                    ((sizeof(uint64_t) * (RI_PROF_NCOUNTERS + RI_PROF_NTIMERS))
+                     % RI_PROF_CACHE_LINE_SIZE)];
+
+} ri_prof_block_t;
+
+/*
+ * Struct: ri_prof_result_t
+ *
+ *   Counters merged over all threads.
+ */
+typedef struct _ri_prof_result_t {
+
+    uint64_t    counters[RI_PROF_NCOUNTERS];
+    double      seconds[RI_PROF_NTIMERS];
+
+} ri_prof_result_t;
+
+/*
+ * Thread local storage for the index of the thread's block.
+ * Old Apple gcc has no __thread, so all threads share the block 0 there.
+ */
+#if defined(__GNUC__) && !defined(__APPLE__)
+#define RI_PROF_TLS __thread
+#elif defined(_MSC_VER)
+#define RI_PROF_TLS __declspec(thread)
+#else
+#define RI_PROF_TLS
+#define RI_PROF_NO_TLS
+#endif
+
+extern ri_prof_block_t    ri_prof_blocks[RI_MAX_THREADS];
+extern RI_PROF_TLS int    ri_prof_thread_id;
+
+/*
+ * Clears counters of all threads. Call before the threads start.
+ */
+extern void ri_prof_reset     ();
+
+/*
+ * Binds the calling thread to the block `thread_id'.
+ */
+extern void ri_prof_set_thread(int               thread_id);
+
+/*
+ * Sums up counters of all threads. Call after the threads finished.
+ */
+extern void ri_prof_merge     (ri_prof_result_t *result_out);
+
+extern void ri_prof_report    (const ri_prof_result_t *result);
+
+
+static inline uint64_t ri_prof_ticks()
+{
+#if defined(RI_PROF_DISABLE)
+    return 0;
+#elif defined(__x86__) && defined(__GNUC__)
+    uint32_t lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+
+    return ((uint64_t)hi << 32) | lo;
+#elif defined(LINUX) || defined(__MACH__)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+static inline void ri_prof_add(int counter, uint64_t n)
+{
+#ifndef RI_PROF_DISABLE
+    ri_prof_blocks[ri_prof_thread_id].counters[counter] += n;
+#else
+    (void)counter; (void)n;
+#endif
+}
+
+static inline void ri_prof_inc(int counter)
+{
+    ri_prof_add(counter, 1);
+}
+
+static inline void ri_prof_timer_add(int timer, uint64_t ticks)
+{
+#ifndef RI_PROF_DISABLE
+    ri_prof_blocks[ri_prof_thread_id].ticks[timer] += ticks;
+#else
+    (void)timer; (void)ticks;
+#endif
+}
+
+#ifdef __cplusplus
+}    /* extern "C" */
+#endif
+
+#endif    /* LUCILLE_PROFILE_H */
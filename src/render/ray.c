@@ -9,6 +9,8 @@
 #include "config.h"
 #endif
 
+#include <assert.h>
+
 #include "ray.h"
 #include "memory.h"
 
@@ -59,3 +61,41 @@ ri_ray_perturb(
 	ray->org[1] += RAY_EPSILON * ray->dir[1];
 	ray->org[2] += RAY_EPSILON * ray->dir[2];
 }
+
+/*
+ * Function: ri_ray_packet_setup
+ *
+ *     Packs rays into a ray packet.
+ *
+ * Parameters:
+ *
+ *     packet - a ray packet to be filled.
+ *     rays   - array of rays.
+ *     nrays  - the number of rays. Must be <= RI_RAY_PACKET_MAX.
+ *
+ * Return
+ *
+ *     None.
+ */
+void
+ri_ray_packet_setup(
+	ri_ray_packet_t *packet,
+	ri_ray_t        *rays,
+	int              nrays )
+{
+	int i, k;
+
+	assert( nrays > 0 );
+	assert( nrays <= RI_RAY_PACKET_MAX );
+
+	packet->nrays = nrays;
+	packet->rays  = rays;
+
+	for ( i = 0; i < nrays; i++ ) {
+		for ( k = 0; k < 3; k++ ) {
+			packet->org[k][i]    = rays[i].org[k];
+			packet->dir[k][i]    = rays[i].dir[k];
+			packet->invdir[k][i] = 0.0;
+		}
+	}
+}
@@ -41,12 +41,28 @@ typedef struct _ri_ray_t {
     ri_vector_t dir_signv;          
     ri_vector_t invdir;             /* 1 / dir                      */
 
+    /*
+     * Single precision copies for the fp32 BVH. Set up only when the
+     * scene BVH is built with RI_ACCEL_PRECISION_FLOAT(see bvh.c).
+     */
+    float       org32[4];
+    float       invdir32[4];
+    int         wt_k[3];            /* kx, ky, kz. kz = major axis  */
+    float       wt_s[3];            /* shear of watertight test     */
+
     /*
      * quasi-Monte Carlo related variables.
      */
     int         d;                  /* current dimension            */
     int         i;                  /* instance number              */
 
+    /*
+     * Time in the shutter interval for motion blur, normalized to [0, 1]
+     * (0 = shutter open). Rays spawned at a hit point inherit the time of
+     * the incoming ray, so that a path sees the scene at a single time.
+     */
+    float       time;
+
     /*
      * variables for multi-threading
      */
@@ -56,18 +72,45 @@ typedef struct _ri_ray_t {
                                      * is turned on this value
                                      * should be set                */
 
-#if 0
-    /* Ray differentials for better texture mapping, etc.
-     * TODO: This feature is not yet implemented.
+    /*
+     * Ray differentials(Igehy 99) w.r.t. the screen x and y, for texture
+     * filtering. They are valid only if has_differentials is nonzero. The
+     * ray generator must set has_differentials, since rays are mostly
+     * created on the stack without initialization.
      */
+    int         has_differentials;
     ri_vector_t dPdx;        /*  dP / dx    */
     ri_vector_t dPdy;        /*  dP / dy    */
     ri_vector_t dDdx;        /*  dD / dx    */
     ri_vector_t dDdy;        /*  dD / dy    */
-#endif
 
 } ri_ray_t;
 
+/*
+ * Maximum number of rays in a ray packet.
+ */
+#define RI_RAY_PACKET_MAX   16
+
+/*
+ * Struct: ri_ray_packet_t
+ *
+ *     Bundle of up to RI_RAY_PACKET_MAX rays in SoA layout for packet
+ *     traversal. Rays in a packet should be coherent(e.g. camera rays of
+ *     neighboring pixels) to take benefit of packet tracing.
+ *
+ */
+typedef struct _ri_ray_packet_t {
+
+    int         nrays;
+
+    ri_float_t  org   [3][RI_RAY_PACKET_MAX];
+    ri_float_t  dir   [3][RI_RAY_PACKET_MAX];
+    ri_float_t  invdir[3][RI_RAY_PACKET_MAX];   /* filled by accel      */
+
+    ri_ray_t   *rays;                           /* source rays          */
+
+} ri_ray_packet_t;
+
 /*
  * Function: ri_ray_copy
  *
@@ -103,6 +146,27 @@ extern void    ri_ray_copy(
 extern void    ri_ray_perturb(
     ri_ray_t *ray );
 
+/*
+ * Function: ri_ray_packet_setup
+ *
+ *     Packs rays into a ray packet. The packet holds a reference to *rays*,
+ *     so *rays* must be alive while the packet is used.
+ *
+ * Parameters:
+ *
+ *     packet - a ray packet to be filled.
+ *     rays   - array of rays.
+ *     nrays  - the number of rays. Must be <= RI_RAY_PACKET_MAX.
+ *
+ * Return
+ *
+ *     None.
+ */
+extern void    ri_ray_packet_setup(
+    ri_ray_packet_t *packet,
+    ri_ray_t        *rays,
+    int              nrays );
+
 #ifdef __cplusplus
 }       /* extern "C" */
 #endif
@@ -20,6 +20,7 @@
 #include "util.h"
 #include "accel.h"
 #include "render.h"
+#include "profile.h"
 
 
 void
@@ -40,7 +41,7 @@ ri_raytrace(
     /*
      * Statistics
      */
-    render->stat.nrays++;
+    ri_prof_inc(RI_PROF_NRAYS);
 
     /*
      * Initialize
@@ -68,6 +69,207 @@ ri_raytrace(
     return hit;
 }
 
+int
+ri_raytrace_occluded(
+    ri_render_t             *render,
+    ri_ray_t                *ray,
+    ri_float_t               tmin,
+    ri_float_t               tmax )
+{
+    int                     hit = 0;
+    ri_intersection_state_t state;
+
+    /*
+     * Statistics
+     */
+    ri_prof_inc(RI_PROF_NSHADOW_RAYS);
+
+    ray->t = 0.0;
+
+    assert(render->scene);
+    assert(render->scene->accel);
+
+    if (render->scene->accel->occluded) {
+
+        return render->scene->accel->occluded(  render->scene->accel->data,
+                                                ray,
+                                                tmin,
+                                                tmax,
+                                                NULL );
+
+    }
+
+    /*
+     * Accelerator does not provide any-hit query. Use closest hit instead.
+     */
+    assert(render->scene->accel->intersect);
+
+    state.inside = 0;
+
+    hit = render->scene->accel->intersect(  render->scene->accel->data,
+                                            ray,
+                                           &state,
+                                            NULL );
+
+    return (hit && (state.t >= tmin) && (state.t <= tmax));
+}
+
+uint32_t
+ri_raytrace_packet(
+    ri_render_t             *render,
+    ri_ray_packet_t         *packet,
+    ri_intersection_state_t *states_out )
+{
+    int         i;
+    uint32_t    hitmask = 0;
+
+    /*
+     * Statistics
+     */
+    ri_prof_add(RI_PROF_NPACKET_RAYS, packet->nrays);
+
+    /*
+     * Initialize
+     */
+    for (i = 0; i < packet->nrays; i++) {
+        states_out[i].inside = 0;
+        packet->rays[i].t    = 0.0;
+    }
+
+    assert(render->scene);
+    assert(render->scene->accel);
+
+    if (render->scene->accel->intersect_packet) {
+
+        return render->scene->accel->intersect_packet(
+                                            render->scene->accel->data,
+                                            packet,
+                                            states_out,
+                                            NULL );
+
+    }
+
+    /*
+     * Accelerator does not support packet tracing. Trace rays one by one.
+     */
+    assert(render->scene->accel->intersect);
+
+    for (i = 0; i < packet->nrays; i++) {
+
+        if (render->scene->accel->intersect( render->scene->accel->data,
+                                            &packet->rays[i],
+                                            &states_out[i],
+                                             NULL )) {
+            hitmask |= (1 << i);
+        }
+    }
+
+    return hitmask;
+}
+
+uint32_t
+ri_raytrace_packet_occluded(
+    ri_render_t             *render,
+    ri_ray_packet_t         *packet,
+    ri_float_t               tmin,
+    ri_float_t               tmax )
+{
+    int         i;
+    uint32_t    hitmask = 0;
+
+    assert(render->scene);
+    assert(render->scene->accel);
+
+    if (render->scene->accel->occluded_packet) {
+
+        ri_prof_add(RI_PROF_NPACKET_SHADOW_RAYS, packet->nrays);
+
+        for (i = 0; i < packet->nrays; i++) {
+            packet->rays[i].t = 0.0;
+        }
+
+        return render->scene->accel->occluded_packet(
+                                            render->scene->accel->data,
+                                            packet,
+                                            tmin,
+                                            tmax,
+                                            NULL );
+
+    }
+
+    for (i = 0; i < packet->nrays; i++) {
+
+        if (ri_raytrace_occluded( render, &packet->rays[i], tmin, tmax )) {
+            hitmask |= (1 << i);
+        }
+    }
+
+    return hitmask;
+}
+
+int
+ri_raytrace_stream(
+    ri_render_t             *render,
+    ri_ray_t                *rays,
+    int                      nrays,
+    ri_intersection_state_t *states_out,
+    int                     *hits_out )
+{
+    int             i, j, n;
+    int             nhits = 0;
+    uint32_t        hitmask;
+    ri_ray_packet_t packet;
+
+    for (i = 0; i < nrays; i += RI_RAY_PACKET_MAX) {
+
+        n = nrays - i;
+        if (n > RI_RAY_PACKET_MAX) n = RI_RAY_PACKET_MAX;
+
+        ri_ray_packet_setup( &packet, &rays[i], n );
+
+        hitmask = ri_raytrace_packet( render, &packet, &states_out[i] );
+
+        for (j = 0; j < n; j++) {
+            hits_out[i + j] = (hitmask >> j) & 1;
+            nhits          += hits_out[i + j];
+        }
+    }
+
+    return nhits;
+}
+
+int
+ri_raytrace_stream_occluded(
+    ri_render_t             *render,
+    ri_ray_t                *rays,
+    int                      nrays,
+    ri_float_t               tmin,
+    ri_float_t               tmax,
+    int                     *hits_out )
+{
+    int             i, j, n;
+    int             nhits = 0;
+    uint32_t        hitmask;
+    ri_ray_packet_t packet;
+
+    for (i = 0; i < nrays; i += RI_RAY_PACKET_MAX) {
+
+        n = nrays - i;
+        if (n > RI_RAY_PACKET_MAX) n = RI_RAY_PACKET_MAX;
+
+        ri_ray_packet_setup( &packet, &rays[i], n );
+
+        hitmask = ri_raytrace_packet_occluded( render, &packet, tmin, tmax );
+
+        for (j = 0; j < n; j++) {
+            if (hits_out) hits_out[i + j] = (hitmask >> j) & 1;
+            nhits += (hitmask >> j) & 1;
+        }
+    }
+
+    return nhits;
+}
+
 void
 ri_raytrace_statistics()
 {
@@ -48,6 +48,112 @@ extern int    ri_raytrace(
     ri_ray_t                *ray,               /* [inout]      */
     ri_intersection_state_t *state_out );       /* [out]        */
 
+/*
+ * Function: ri_raytrace_occluded
+ *
+ *     Tests whether the ray hits any surface in the distance [tmin, tmax].
+ *     Stops at the first hit found and does not build intersection state,
+ *     thus it is suitable for shadow and ambient occlusion rays.
+ *
+ * Parameters:
+ *
+ *     render - render object
+ *     ray    - ray object to be traced into the scene.
+ *     tmin   - minimum distance of the hit.
+ *     tmax   - maximum distance of the hit.
+ *
+ * Returns:
+ *
+ *     1 if the ray is occluded, 0 if not.
+ */
+extern int    ri_raytrace_occluded(
+    ri_render_t             *render,            /* [inout]      */
+    ri_ray_t                *ray,               /* [inout]      */
+    ri_float_t               tmin,
+    ri_float_t               tmax );
+
+/*
+ * Function: ri_raytrace_packet
+ *
+ *     Traces a packet of rays into the scene at once. Coherent rays(e.g.
+ *     camera rays of neighboring pixels) are traced faster than calling
+ *     ri_raytrace() for each ray.
+ *
+ * Parameters:
+ *
+ *     render    - render object
+ *     packet    - ray packet set up with ri_ray_packet_setup().
+ *     states_out - array of packet->nrays intersection states. i'th state
+ *                  is filled only if i'th ray hits.
+ *
+ * Returns:
+ *
+ *     Bit mask of rays which hit(i'th bit for i'th ray).
+ */
+extern uint32_t ri_raytrace_packet(
+    ri_render_t             *render,            /* [inout]      */
+    ri_ray_packet_t         *packet,            /* [inout]      */
+    ri_intersection_state_t *states_out );      /* [out]        */
+
+/*
+ * Function: ri_raytrace_packet_occluded
+ *
+ *     Packet version of ri_raytrace_occluded().
+ *
+ * Returns:
+ *
+ *     Bit mask of rays which are occluded.
+ */
+extern uint32_t ri_raytrace_packet_occluded(
+    ri_render_t             *render,            /* [inout]      */
+    ri_ray_packet_t         *packet,            /* [inout]      */
+    ri_float_t               tmin,
+    ri_float_t               tmax );
+
+/*
+ * Function: ri_raytrace_stream
+ *
+ *     Traces an arbitrary number of rays. Rays are split into packets of
+ *     RI_RAY_PACKET_MAX rays in the given order.
+ *
+ * Parameters:
+ *
+ *     render     - render object
+ *     rays       - array of rays.
+ *     nrays      - the number of rays.
+ *     states_out - array of nrays intersection states. i'th state is
+ *                  filled only if i'th ray hits.
+ *     hits_out   - array of nrays hit flags.
+ *
+ * Returns:
+ *
+ *     The number of rays which hit.
+ */
+extern int    ri_raytrace_stream(
+    ri_render_t             *render,            /* [inout]      */
+    ri_ray_t                *rays,              /* [inout]      */
+    int                      nrays,
+    ri_intersection_state_t *states_out,        /* [out]        */
+    int                     *hits_out );        /* [out]        */
+
+/*
+ * Function: ri_raytrace_stream_occluded
+ *
+ *     Stream version of ri_raytrace_occluded(). `hits_out' may be NULL if
+ *     only the number of occluded rays is required.
+ *
+ * Returns:
+ *
+ *     The number of rays which are occluded.
+ */
+extern int    ri_raytrace_stream_occluded(
+    ri_render_t             *render,            /* [inout]      */
+    ri_ray_t                *rays,              /* [inout]      */
+    int                      nrays,
+    ri_float_t               tmin,
+    ri_float_t               tmax,
+    int                     *hits_out );        /* [out]        */
+
 
 extern void    ri_raytrace_shutdown();
 
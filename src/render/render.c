@@ -35,9 +35,12 @@
 #include "thread.h"
 #include "random.h"
 #include "queue.h"
+#include "atomic.h"
+#include "wsdeque.h"
 
 #include "framebufferdrv.h"
 #include "hdrdrv.h"
+#include "image_saver.h"
 #include "sockdrv.h"
 #include "openexrdrv.h"
 
@@ -54,11 +57,16 @@
 #include "qmc.h"
 //#include "pathtrace.h"
 #include "ambientocclusion.h"
+#include "photonmapping.h"
 //#include "whitted.h"
 #include "hilbert2d.h"
 #include "zorder2d.h"
 #include "spiral.h"
 #include "context.h"
+#include "profile.h"
+#include "checkpoint.h"
+#include "photontrace.h"
+#include "texcache.h"
 
 #ifndef M_PI
 #define M_PI 3.1415926532
@@ -67,20 +75,70 @@
 //#define MAXWIDTH 4096
 #define MAX_SAMPLES_IN_PIXEL 128
 
-static ri_render_t *grender = NULL;    /* global and unique renderer */
+/*
+ * Camera rays of PACKET_TILE_SIZE x PACKET_TILE_SIZE pixels are traced
+ * together as ray packets.
+ */
+#define PACKET_TILE_SIZE     4
 
+/*
+ * Initial size of per-thread arena. The arena grows on demand.
+ */
+#define RENDER_ARENA_SIZE           (1024 * 1024)
 
-typedef struct _render_thread_t
-{
-    int              thread_id;
+/*
+ * A bucket is split in half when some threads are idle, down to
+ * BUCKET_SPLIT_MIN_HEIGHT rows.
+ */
+#define BUCKET_SPLIT_MIN_HEIGHT     4
 
-    /*
-     * thread local storage for ri_queue operation.
-     */
-    int              var;
-    ri_queue_node_t *node;
+/*
+ * Adaptive supersampling adds at least ADAPTIVE_BATCH_MIN samples per round
+ * to a pixel which has not converged yet.
+ */
+#define ADAPTIVE_BATCH_MIN          4
+
+/*
+ * Luminance below this is regarded as black when the relative error of a
+ * pixel is estimated.
+ */
+#define ADAPTIVE_MIN_LUMINANCE      0.01
+
+/*
+ * Progressive rendering judges the noise level of a pixel after it has
+ * PROGRESSIVE_MIN_SAMPLES samples, and adds at most
+ * PROGRESSIVE_MAX_PASS_SAMPLES samples per pixel in a pass.
+ */
+#define PROGRESSIVE_MIN_SAMPLES         4
+#define PROGRESSIVE_MAX_PASS_SAMPLES    16
+
+/*
+ * Roles of the task in distributed rendering. Task 0 is the master, which
+ * deals buckets to workers on request and writes their tiles to the
+ * display driver.
+ */
+#define DIST_NONE           0       /* single task                      */
+#define DIST_MASTER         1
+#define DIST_WORKER         2
+#define DIST_IDLE           3       /* nothing to do in this frame      */
+
+/*
+ * Message tags of distributed rendering.
+ */
+#define DIST_TAG_REQUEST    100     /* worker -> master: next bucket?   */
+#define DIST_TAG_BUCKET     101     /* master -> worker: dist_region_t  */
+#define DIST_TAG_TILE       102     /* worker -> master: dist_tile_t    */
+
+/*
+ * Unless given by the option, the max radius of irradiance cache records is
+ * IRRADCACHE_MAX_RADIUS_SCALE times the scene width, and the min radius is
+ * IRRADCACHE_MIN_RADIUS_RATIO times the max radius.
+ */
+#define IRRADCACHE_MAX_RADIUS_SCALE 0.5
+#define IRRADCACHE_MIN_RADIUS_RATIO 0.01
+
+static ri_render_t *grender = NULL;    /* global and unique renderer */
 
-} render_thread_t;
 
 typedef struct _bucket_t {
     int             x, y;          /* bucket location.             */
@@ -90,8 +148,84 @@ typedef struct _bucket_t {
     ri_float_t     *alphas;        /* contents of alpha            */
     int             rendered;
     int             written;
+    uint64_t        nsamples;      /* # of camera samples taken    */
 } bucket_t;
 
+typedef struct _render_thread_t
+{
+    int              thread_id;
+
+    bucket_t         remote_bucket;     /* bucket given by the master */
+
+} render_thread_t;
+
+/*
+ * Work-stealing bucket scheduler. Each thread owns a deque of bucket ids and
+ * steals from others when its own deque is empty.
+ */
+typedef struct _bucket_scheduler_t {
+    bucket_t        *buckets;       /* bucket pool. split buckets are
+                                     * appended at the end.            */
+    volatile int     nbuckets;      /* # of buckets used in the pool  */
+    int              maxbuckets;
+
+    ri_ws_deque_t  **deques;        /* per-thread deque of bucket ids */
+    int              nthreads;
+
+    volatile int     nidle;         /* # of threads looking for work  */
+
+    int              npixels;
+    volatile int     npixels_done;
+    int              npixels_restored; /* # of pixels from checkpoint  */
+    uint64_t         nsamples_done; /* # of camera samples taken       */
+
+    volatile int     stop;          /* Set to abort the rest of buckets */
+
+} bucket_scheduler_t;
+
+/*
+ * Per pixel accumulation buffers of progressive rendering. They persist
+ * across passes.
+ */
+typedef struct _progressive_t {
+    int              enabled;
+    int              pass;
+    int              nsamples_pass; /* max samples per pixel in a pass */
+    int              maxsamples;
+    ri_float_t       threshold;     /* target noise level. 0 = none    */
+    double           time_budget;   /* in seconds. 0 = none            */
+
+    ri_vector_t     *radiance;      /* sum of sample radiance          */
+    ri_float_t      *lumsum;
+    ri_float_t      *lumsqsum;
+    int             *nsamples;
+
+    volatile int     nactive;       /* # of pixels not converged       */
+    uint64_t         nsamples_prev; /* # of samples in previous passes */
+} progressive_t;
+
+/*
+ * Messages of distributed rendering. A region with w = 0 tells the worker
+ * that no bucket is left.
+ */
+typedef struct _dist_region_t {
+    int32_t          x, y;
+    int32_t          w, h;
+} dist_region_t;
+
+typedef struct _dist_tile_t {
+    dist_region_t    region;
+    uint64_t         nsamples;
+    /* followed by w * h RGB pixels in float */
+} dist_tile_t;
+
+typedef struct _distributed_t {
+    int              role;
+    int              ntasks;
+    ri_mutex_t      *mutex;         /* one message at a time in a task */
+    int              finished;      /* worker: no bucket is left       */
+} distributed_t;
+
 typedef struct _sample_t {
     ri_vector_t     radiance;
     ri_float_t      depth;
@@ -108,6 +242,10 @@ typedef struct _pixelinfo_t {
     sample_t        samples[MAX_SAMPLES_IN_PIXEL];
     int             nsamples;
     int             x, y;          /* pixel position */
+
+    /* Running sums of sample luminance for adaptive supersampling */
+    ri_float_t      lumsum;
+    ri_float_t      lumsqsum;
 } pixelinfo_t;
 
 typedef struct _hammersley_sample_t {
@@ -121,11 +259,43 @@ static hammersley_sample_t hammsample;
 
 static int          initialized = 0;       /* grender is initialized?    */
 
+static bucket_scheduler_t gscheduler;
+
+static progressive_t gprogressive;
+
+static distributed_t gdist;
+
+static float   *gaov_nsamples = NULL;  /* per pixel sample count(RGBA)   */
+
+static ri_checkpoint_t *gcheckpoint = NULL;
+
 static unsigned int gqmc_instance;     /* QMC ray instance number */
 
-static void     subsample( pixelinfo_t * pixinfo, int x, int y,
-                           int threadid );
+static int      subsample_gen_rays( ri_ray_t * rays_out, int x, int y,
+                                    int threadid );
+static int      subsample_gen_extra_rays( ri_ray_t * rays_out,
+                                          int x, int y,
+                                          int first, int n,
+                                          int threadid );
+static void     subsample_begin( pixelinfo_t * pixinfo, int x, int y );
+static void     subsample_shade( pixelinfo_t * pixinfo,
+                                 const ri_ray_t * rays,
+                                 const ri_intersection_state_t * states,
+                                 const int * hits,
+                                 int n );
+static void     subsample_refine( pixelinfo_t * pixinfo,
+                                  int x, int y,
+                                  int batch,
+                                  int maxsamples,
+                                  ri_float_t threshold,
+                                  ri_ray_t * rays,
+                                  ri_intersection_state_t * states,
+                                  int * hits,
+                                  int threadid );
+static void     subsample_end( pixelinfo_t * pixinfo );
 static void     init_sigma( int xsamples, int ysamples );
+static ri_float_t pixel_time_shift( int x, int y );
+static ri_float_t differential_scale( int nsamples );
 static void     sample_subpixel( unsigned int *i,
                                  ri_float_t jitter[2],
                                  int xs, int ys, int xsamples,
@@ -133,8 +303,9 @@ static void     sample_subpixel( unsigned int *i,
 
 static void     bucket_write(
     const bucket_t      *bucket,
-    ri_display_drv_t    *drv,
-    ri_display_t        *disp );
+    ri_render_t         *render,
+    ri_arena_t          *arena,
+    int                  overwrite );
 
 static void     progress_bar(
     int                  progress,
@@ -143,11 +314,38 @@ static void     progress_bar(
 
 static int     create_bucket_list(
     const ri_render_t   *render,                            /* [in]     */
-    ri_mt_queue_t       *q);                                /* [inout]  */
+    bucket_scheduler_t  *scheduler);                        /* [out]    */
+static void    free_bucket_list(
+    bucket_scheduler_t  *scheduler);                        /* [inout]  */
 
 static int      render_bucket(
     bucket_t            *bucket,                            /* [inout]  */
     int                 thread_id);
+static int      render_bucket_progressive(
+    bucket_t            *bucket,                            /* [inout]  */
+    int                 thread_id);
+
+static void     dist_setup(
+    const ri_render_t   *render);
+static int      fetch_bucket(
+    render_thread_t     *info,
+    bucket_t           **bucket);                           /* [out]    */
+static void     dist_send_tile(
+    const bucket_t      *bucket,
+    ri_arena_t          *arena);
+
+static void     checkpoint_setup(
+    ri_render_t         *render);
+
+static void     irradcache_setup(
+    ri_render_t         *render);
+static void     irradcache_free(
+    ri_render_t         *render);
+
+static void     photonmap_setup(
+    ri_render_t         *render);
+static void     photonmap_free(
+    ri_render_t         *render);
 
 static void     render_frame_controller(
     ri_render_t         *render);
@@ -161,6 +359,8 @@ ri_render_init()
 {
     static int      ray_max_depth = 5;
 
+    int             i;
+
     ri_geom_drv_t  *polygon_drv;
 
 #ifdef HAVE_OPENEXR
@@ -193,7 +393,6 @@ ri_render_init()
 
     grender->scene            = ri_scene_new();
 
-    grender->bucket_queue     = ri_mt_queue_new();
     grender->bucket_size      = 32;
     grender->bucket_order     = BUCKET_ORDER_SPIRAL;
 
@@ -217,65 +416,97 @@ ri_render_init()
     grender->stat.nmailboxhits = 0;
     grender->stat.nrays        = 0;
 
+    grender->stat.nheap_allocs  = 0;
+    grender->stat.narena_allocs = 0;
+    grender->stat.narena_grows  = 0;
+    grender->stat.arena_peak    = 0;
+
+    for ( i = 0; i < RI_MAX_THREADS; i++ ) {
+        grender->arenas[i] = NULL;
+    }
+
+    grender->global_photonmap  = NULL;
+    grender->caustic_photonmap = NULL;
+
     polygon_drv = ( ri_geom_drv_t * ) ri_mem_alloc( sizeof( ri_geom_drv_t ) );
     polygon_drv->parse = ri_polygon_parse;
     ri_render_register_geom_drv( grender, "polygon", polygon_drv );
 
 #ifdef HAVE_OPENEXR
-    openexr_drv           = ( ri_display_drv_t * ) ri_mem_alloc(
+    openexr_drv               = ( ri_display_drv_t * ) ri_mem_alloc(
                                 sizeof( ri_display_drv_t ) );
-    openexr_drv->open     = openexr_dd_open;
-    openexr_drv->write    = openexr_dd_write;
-    openexr_drv->close    = openexr_dd_close;
-    openexr_drv->progress = openexr_dd_progress;
-    openexr_drv->name     = strdup( "openexr" );
-    openexr_drv->info     = strdup( "Save the image as a OpenEXR format(HDR)" );
+    openexr_drv->open         = openexr_dd_open;
+    openexr_drv->write        = openexr_dd_write;
+    openexr_drv->write_bucket = openexr_dd_write_bucket;
+    openexr_drv->update_bucket = openexr_dd_update_bucket;
+    openexr_drv->concurrent   = 1;
+    openexr_drv->close        = openexr_dd_close;
+    openexr_drv->progress     = openexr_dd_progress;
+    openexr_drv->name         = strdup( "openexr" );
+    openexr_drv->info         =
+        strdup( "Save the image as a OpenEXR format(HDR)" );
     ri_render_register_display_drv( grender, "openexr", openexr_drv );
 #endif
 
 #if defined(WIN32) || defined(WITH_AQUA) || defined(WITH_X11)
-    fb_drv           = ( ri_display_drv_t * )
+    fb_drv               = ( ri_display_drv_t * )
             ri_mem_alloc( sizeof( ri_display_drv_t ) );
-    fb_drv->open     = fb_dd_open;
-    fb_drv->write    = fb_dd_write;
-    fb_drv->close    = fb_dd_close;
-    fb_drv->progress = fb_dd_progress;
-    fb_drv->name     = strdup( "framebuffer" );
-    fb_drv->info     = strdup( "Output the image to window(LDR)" );
+    fb_drv->open         = fb_dd_open;
+    fb_drv->write        = fb_dd_write;
+    fb_drv->write_bucket = fb_dd_write_bucket;
+#if defined(WITH_AQUA)
+    fb_drv->update_bucket = NULL;   /* Pixels are added in the viewer. */
+#else
+    fb_drv->update_bucket = fb_dd_update_bucket;
+#endif
+    fb_drv->concurrent   = 1;
+    fb_drv->close        = fb_dd_close;
+    fb_drv->progress     = fb_dd_progress;
+    fb_drv->name         = strdup( "framebuffer" );
+    fb_drv->info         = strdup( "Output the image to window(LDR)" );
     ri_render_register_display_drv( grender, RI_FRAMEBUFFER, fb_drv );
 #endif
 
-    hdr_drv           = ( ri_display_drv_t * )
+    hdr_drv               = ( ri_display_drv_t * )
                 ri_mem_alloc( sizeof( ri_display_drv_t ) );
-    hdr_drv->open     = hdr_dd_open;
-    hdr_drv->write    = hdr_dd_write;
-    hdr_drv->close    = hdr_dd_close;
-    hdr_drv->progress = hdr_dd_progress;
-    hdr_drv->name     = strdup( "hdr" );
-    hdr_drv->info     =
+    hdr_drv->open         = hdr_dd_open;
+    hdr_drv->write        = hdr_dd_write;
+    hdr_drv->write_bucket = hdr_dd_write_bucket;
+    hdr_drv->update_bucket = hdr_dd_update_bucket;
+    hdr_drv->concurrent   = 1;
+    hdr_drv->close        = hdr_dd_close;
+    hdr_drv->progress     = hdr_dd_progress;
+    hdr_drv->name         = strdup( "hdr" );
+    hdr_drv->info         =
         strdup( "Save the image as a Radiance .hdr format(HDR) file" );
     ri_render_register_display_drv( grender, "hdr", hdr_drv );
 
-    file_drv           = ( ri_display_drv_t * )
+    file_drv               = ( ri_display_drv_t * )
                 ri_mem_alloc( sizeof( ri_display_drv_t ) );
-    file_drv->open     = hdr_dd_open;
-    file_drv->write    = hdr_dd_write;
-    file_drv->close    = hdr_dd_close;
-    file_drv->progress = hdr_dd_progress;
-    file_drv->name     = strdup( "file" );
-    file_drv->info     =
+    file_drv->open         = hdr_dd_open;
+    file_drv->write        = hdr_dd_write;
+    file_drv->write_bucket = hdr_dd_write_bucket;
+    file_drv->update_bucket = hdr_dd_update_bucket;
+    file_drv->concurrent   = 1;
+    file_drv->close        = hdr_dd_close;
+    file_drv->progress     = hdr_dd_progress;
+    file_drv->name         = strdup( "file" );
+    file_drv->info         =
         strdup( "Alias to \"hdr\" display driver" );
     ri_render_register_display_drv( grender, RI_FILE, file_drv );
 
 
-    sock_drv           = ( ri_display_drv_t * )
+    sock_drv               = ( ri_display_drv_t * )
                 ri_mem_alloc( sizeof( ri_display_drv_t ) );
-    sock_drv->open     = sock_dd_open;
-    sock_drv->write    = sock_dd_write;
-    sock_drv->close    = sock_dd_close;
-    sock_drv->progress = sock_dd_progress;
-    sock_drv->name     = strdup( "socket" );
-    sock_drv->info     = strdup( "Send image data to external program" );
+    sock_drv->open         = sock_dd_open;
+    sock_drv->write        = sock_dd_write;
+    sock_drv->write_bucket = sock_dd_write_bucket;
+    sock_drv->update_bucket = NULL;
+    sock_drv->concurrent   = 1;
+    sock_drv->close        = sock_dd_close;
+    sock_drv->progress     = sock_dd_progress;
+    sock_drv->name         = strdup( "socket" );
+    sock_drv->info         = strdup( "Send image data to external program" );
     ri_render_register_display_drv( grender, "socket", sock_drv );
 
 
@@ -304,9 +535,11 @@ ri_render_free()
     ri_hash_free( grender->geom_drvs );
     ri_hash_free( grender->display_drvs );
 
-    // ri_scene_free() was already called in render_frame_cleanup(),
-    // thus no need to to call it.
-    //ri_scene_free( grender->scene );
+    /*
+     * The scene persists across frames so that the accel can be updated
+     * rather than rebuilt for the next frame.
+     */
+    ri_scene_free( grender->scene );
 
     ri_context_free( grender->context );
     ri_mem_free( grender );
@@ -335,9 +568,21 @@ ri_render_frame(  )
     ri_scene_setup( scene );
     ri_camera_setup( ri_render_get()->context->option->camera );
 
+    dist_setup(ri_render_get());
+
+    /*
+     * Load the checkpoint before buckets are created, so that buckets
+     * finished in the previous run are skipped.
+     */
+    checkpoint_setup(ri_render_get());
+
+    irradcache_setup(ri_render_get());
+
+    photonmap_setup(ri_render_get());
+
     ri_render_get()->nbuckets = create_bucket_list(
                                     ri_render_get(),
-                                    ri_render_get()->bucket_queue);
+                                    &gscheduler);
 
     ri_parallel_barrier();
 
@@ -465,6 +710,16 @@ ri_render_setup(ri_render_t *render)
      */
     init_sigma( xsamples, ysamples );
 
+    /*
+     * Decide pixel format passed to the display driver here, rather than
+     * per pixel.
+     */
+    render->display_float = ( strcmp( disp->display_format, "float" ) == 0 ||
+                              strcmp( dsp_type, "hdr" ) == 0 ||
+                              strcmp( dsp_type, "openexr" ) == 0 ||
+                              strcmp( dsp_type, "socket" ) == 0 ||
+                              strcmp( dsp_type, RI_FILE ) == 0 );
+
     my_id = ri_parallel_taskid();
 
     if ( my_id == 0 ) {             /* Master node */
@@ -509,11 +764,14 @@ ri_render_setup(ri_render_t *render)
                         printf( " [ %s ].\n", dsp_type );
                         return;
                 }
+
+                ri_render_get()->display_drv = drv;
+                render->display_float        = 1;
             }
         }
     }
 
-    if ( !ri_list_first( scene->light_list ) ) {
+    if ( !ri_list_first( scene->light_list ) && !scene->envmap_light ) {
 
     /*
      * No light in the scene.
@@ -527,7 +785,7 @@ ri_render_setup(ri_render_t *render)
 
         ri_scene_add_light( scene, light );
 
-    } else {
+    } else if ( ri_list_first( scene->light_list ) ) {
 
         // TODO: support for multiple light sources.
 
@@ -579,10 +837,113 @@ ri_render_setup(ri_render_t *render)
  *
  * ------------------------------------------------------------------------- */
 
+/*
+ * Compacts even bits of `s' into lower 16 bits(inverse of bit interleaving).
+ */
+static uint32_t
+zorder_compact(uint32_t s)
+{
+    s &= 0x55555555;
+    s = (s | (s >> 1)) & 0x33333333;
+    s = (s | (s >> 2)) & 0x0f0f0f0f;
+    s = (s | (s >> 4)) & 0x00ff00ff;
+    s = (s | (s >> 8)) & 0x0000ffff;
+
+    return s;
+}
+
+/*
+ * Fills `order' with bucket ids in the order given by render->bucket_order.
+ * Locations outside of the screen are skipped, and buckets which the curve
+ * did not visit are appended in scanline order.
+ */
+static void
+create_bucket_order(
+    const ri_render_t *render,
+    int                nxbuckets,
+    int                nybuckets,
+    uint32_t          *order)          /* [out] */
+{
+    int              n;
+    int              level;
+    uint32_t         s, ns;
+    uint32_t         xp, yp;
+    uint32_t         bucket_id;
+    ri_camera_t     *camera;
+    char            *visited;
+
+    camera  = render->context->option->camera;
+
+    visited = (char *)ri_mem_alloc(nxbuckets * nybuckets);
+    memset(visited, 0, nxbuckets * nybuckets);
+
+    /* Curves cover [0, 2^level)^2 buckets. */
+    level = 0;
+    while ((1 << level) < nxbuckets || (1 << level) < nybuckets) level++;
+    ns = 1u << (2 * level);
+
+    n = 0;
+    s = 0;
+
+    // spiral order scan setup
+    spiral_setup( camera->horizontal_resolution,
+                  camera->vertical_resolution,
+                  render->bucket_size );
+
+    while (1) {
+
+        if (render->bucket_order == BUCKET_ORDER_SPIRAL) {
+
+            if (!spiral_get_nextlocation( &xp, &yp )) break;
+
+        } else if (render->bucket_order == BUCKET_ORDER_HILBERT) {
+
+            if (s >= ns) break;
+            hil_xy_from_s(s, level, &xp, &yp);
+            s++;
+
+        } else if (render->bucket_order == BUCKET_ORDER_ZORDER) {
+
+            if (s >= ns) break;
+            xp = zorder_compact(s);
+            yp = zorder_compact(s >> 1);
+            s++;
+
+        } else {
+
+            /* scanline order is generated below. */
+            break;
+        }
+
+        if (xp >= (uint32_t)nxbuckets || yp >= (uint32_t)nybuckets) {
+            continue;
+        }
+
+        bucket_id = yp * nxbuckets + xp;
+
+        if (visited[bucket_id]) continue;
+
+        visited[bucket_id] = 1;
+        order[n++] = bucket_id;
+    }
+
+    for (bucket_id = 0; bucket_id < (uint32_t)(nxbuckets * nybuckets);
+         bucket_id++) {
+
+        if (!visited[bucket_id]) {
+            order[n++] = bucket_id;
+        }
+    }
+
+    assert(n == nxbuckets * nybuckets);
+
+    ri_mem_free(visited);
+}
+
 static int
 create_bucket_list(
-    const ri_render_t *render,
-    ri_mt_queue_t     *q)            /* [inout] */
+    const ri_render_t  *render,
+    bucket_scheduler_t *scheduler)      /* [out] */
 {
 
     int              i, j;
@@ -596,11 +957,12 @@ create_bucket_list(
     int              nwidthdiv, nheightdiv;
     int              nxbuckets, nybuckets;
     int              width_reminder, height_reminder;
+    int              nthreads;
+    int              norder;
 
     bucket_t        *bucket_list;
-    uint32_t         bucket_id;
-
-    uint32_t         xp, yp;
+    bucket_t        *bucket;
+    uint32_t        *order;
 
     ri_camera_t     *camera;
 
@@ -631,8 +993,19 @@ create_bucket_list(
 
     nbuckets = nxbuckets * nybuckets;
 
+    nthreads = render->nthreads;
+    if (nthreads == 0) nthreads = 1;
+
+    /*
+     * Reserve room for buckets created by splitting. A bucket is never
+     * split below BUCKET_SPLIT_MIN_HEIGHT rows, which bounds the number of
+     * pieces.
+     */
+    scheduler->maxbuckets = nbuckets * (bucket_size / BUCKET_SPLIT_MIN_HEIGHT);
+    if (scheduler->maxbuckets < nbuckets) scheduler->maxbuckets = nbuckets;
+
     bucket_list = ( bucket_t * ) ri_mem_alloc( sizeof( bucket_t ) *
-                                              nbuckets );
+                                              scheduler->maxbuckets );
 
     for ( j = 0; j < nybuckets; j++ ) {
         for ( i = 0; i < nxbuckets; i++ ) {
@@ -661,210 +1034,593 @@ create_bucket_list(
         }
     }
 
-    // Z curve order scan setup
-    zorder_setup( screen_width, screen_height, bucket_size );
+    scheduler->buckets      = bucket_list;
+    scheduler->nbuckets     = nbuckets;
+    scheduler->nthreads     = nthreads;
+    scheduler->nidle        = 0;
+    scheduler->npixels      = screen_width * screen_height;
+    scheduler->npixels_done = 0;
+    scheduler->npixels_restored = 0;
 
-    // spiral order scan setup
-    spiral_setup( screen_width, screen_height, bucket_size );
+    scheduler->nsamples_done = 0;
+    scheduler->stop          = 0;
 
+    scheduler->deques = (ri_ws_deque_t **)ri_mem_alloc(
+                            sizeof(ri_ws_deque_t *) * nthreads);
+    for (i = 0; i < nthreads; i++) {
+        scheduler->deques[i] = ri_ws_deque_new(scheduler->maxbuckets);
+    }
 
-    while (1) {
+    /*
+     * Deal buckets to threads round-robin in the user specific rendering
+     * order(scanline, z order, spiral, etc.). Buckets are pushed in reverse
+     * so that each thread pops them in that order. The order is just a hint,
+     * since idle threads steal buckets from others.
+     */
+    order = (uint32_t *)ri_mem_alloc(sizeof(uint32_t) * nbuckets);
 
-        if (render->bucket_order == BUCKET_ORDER_SCANLINE) {
+    create_bucket_order(render, nxbuckets, nybuckets, order);
 
-            xp++;
-            if (xp >= (uint32_t)nxbuckets) {
-                yp++;
-                xp = 0;
-            }
+    /*
+     * Buckets restored from the checkpoint are not rendered again.
+     */
+    norder = 0;
+    for (i = 0; i < nbuckets; i++) {
 
-            if (yp >= (uint32_t)nybuckets) break;
-            
-        } else if (render->bucket_order == BUCKET_ORDER_SPIRAL) {
+        bucket = &bucket_list[order[i]];
 
-            if (!spiral_get_nextlocation( &xp, &yp )) break;
+        if (gcheckpoint &&
+            ri_checkpoint_region_done(gcheckpoint, bucket->x, bucket->y,
+                                      bucket->w, bucket->h)) {
+
+            bucket->rendered = 1;
+            scheduler->npixels_done += bucket->w * bucket->h;
+
+        } else {
+
+            order[norder++] = order[i];
 
         }
+    }
 
-        bucket_id = yp * nxbuckets + xp;
+    scheduler->npixels_restored = scheduler->npixels_done;
 
-        ri_mt_queue_push(
-            q,
-            (const void *)&bucket_list[bucket_id],
-            sizeof(bucket_t));
+    for (i = norder - 1; i >= 0; i--) {
+        ri_ws_deque_push(scheduler->deques[i % nthreads], (int64_t)order[i]);
     }
 
-    /*
-     * Now we have a queue of buckets,
-     * whose elements are ordered by user specific rendering order
-     * (scanline, z order, spiral, etc.)
-     */
-            
-    /*
-     * bucket data are copied into queue element,
-     * so bucket_list is no longer used.
-     */
-    ri_mem_free( bucket_list );
+    ri_mem_free(order);
 
     return nbuckets;
 }
 
-/*
- * sample subpixel. trace ray from camera through pixel in (x, y)
- */
 static void
-subsample( pixelinfo_t * pixinfo, int x, int y, int threadid )
+free_bucket_list(
+    bucket_scheduler_t *scheduler)
 {
-    int             i;
-    int             w, h;
-    int             xs, ys;
-    int             xsamples, ysamples;
-    int             currsample;
-    unsigned int    subinstance;
-    ri_float_t      inv_nsamples;
-    ri_float_t      jitter[2];
-    ri_vector_t     dir;
-    ri_vector_t     from;
-    ri_vector_t     accumrad;
-    ri_ray_t        ray;
-    ri_display_t   *disp;
-    ri_camera_t    *camera;
-    ri_transport_info_t result;
-
-    camera = ri_render_get()->context->option->camera;
-
-    w = camera->horizontal_resolution;
-    h = camera->vertical_resolution;
-
-    disp = ri_option_get_curr_display(ri_render_get()->context->option);
-    xsamples = disp->sampling_rates[0];
-    ysamples = disp->sampling_rates[1];
-
-    inv_nsamples = 1.0f / ( ri_float_t) ( ysamples * xsamples );
+    int i;
 
-    pixinfo->nsamples = xsamples * ysamples;
-    for ( i = 0; i < pixinfo->nsamples; i++ ) {
-        pixinfo->samples[i].depth = 0.0f;
-        ri_vector_setzero( pixinfo->samples[i].radiance );
-        //pixinfo->alpha = 0.0f;
+    for (i = 0; i < scheduler->nthreads; i++) {
+        ri_ws_deque_free(scheduler->deques[i]);
     }
 
-    /*
-     * Clear data
-     */
-    {
-        ri_vector_setzero(pixinfo->radiance); 
-    }    
-
-
-    currsample = 0;
-    ri_vector_setzero( accumrad );
-    for ( ys = 0; ys < ysamples; ys++ ) {
-        for ( xs = 0; xs < xsamples; xs++ ) {
-
-            sample_subpixel( &subinstance,
-                             jitter, xs, ys, xsamples,
-                             ysamples );
+    ri_mem_free(scheduler->deques);
+    ri_mem_free(scheduler->buckets);
 
+    scheduler->deques  = NULL;
+    scheduler->buckets = NULL;
+}
 
-            ri_camera_get_pos_and_dir(
-                from, dir,
-                camera,
-                (ri_float_t)(x + jitter[0]),
-                (ri_float_t)(y + jitter[1]));
+/*
+ * Gets the next bucket to render. Pops from own deque first, then tries to
+ * steal from other threads until the whole frame is rendered.
+ * Returns 0 when no bucket is left.
+ */
+static int
+next_bucket(
+    bucket_scheduler_t *scheduler,
+    int                 thread_id,
+    int64_t            *bucket_id)      /* [out] */
+{
+    int i;
+    int ret;
+    int victim;
 
-            ri_vector_copy( ray.org, from );
-            ri_vector_copy( ray.dir, dir );
-            //ri_vector_sub( ray.dir, dir, from );
-            ri_vector_normalize( ray.dir );
+    if (scheduler->stop) {
+        return 0;
+    }
 
-            /* dimension 1 for screen x coordinate sample point,
-             * dimension 2 for screen y coordinate sample point.
-             */
-            ray.d = 3;
+    if (ri_ws_deque_pop(scheduler->deques[thread_id], bucket_id) == 0) {
+        return 1;
+    }
 
-            /* Ray's instance number for generalized scrambled
-             * Halton sequence or generalized scrambled
-             * Hammersley point set.
-             * This is used in subsequent QMC sampling.
-             */
+    ri_atomic_add((int *)&scheduler->nidle, 1);
 
-            //ray.i = gqmc_instance * (xsamples * ysamples)
-            //      + subinstance;
-            ray.i = subinstance;
-            gqmc_instance += ( xsamples * ysamples );
+    while ((scheduler->npixels_done < scheduler->npixels) &&
+           !scheduler->stop) {
 
-            /* assign threadid to ray's thread number */
-            ray.thread_num = threadid;
+        for (i = 1; i < scheduler->nthreads; i++) {
 
-            /* HACK */
-            //ri_transport_sample( ri_render_get(  ),
-            //                     &ray, &result );
-            ri_transport_ambientocclusion(ri_render_get(), &ray, &result);
-            //ri_transport_whitted(ri_render_get(), &ray, &result);
+            victim = (thread_id + i) % scheduler->nthreads;
 
-            ri_vector_add( accumrad, accumrad, result.radiance );
+            do {
+                ret = ri_ws_deque_steal(scheduler->deques[victim], bucket_id);
+            } while (ret == 1);
 
-#if 0    // TODO: fixme!
-            if ( result.hit ) {
-                pixinfo->samples[currsample].depth
-                    += result.ray.isectt * inv_nsamples;
-            } else {
-                pixinfo->samples[currsample].depth
-                    += RI_INFINITY * inv_nsamples;
+            if (ret == 0) {
+                ri_atomic_add((int *)&scheduler->nidle, -1);
+                return 1;
             }
-#endif
         }
+
+        ri_thread_yield();
     }
 
-    ri_vector_scale( accumrad, accumrad, ( (ri_float_t)1.0 / ( xsamples * ysamples ) ) );
+    ri_atomic_add((int *)&scheduler->nidle, -1);
 
-    ri_vector_copy( pixinfo->radiance, accumrad );
+    return 0;
 }
 
-/* two-dimensional Hammersley points for anti-aliasing.
- * see:
- * "Strictly Deterministic Sampling Methods in Computer Graphics"
- * Alexander Keller, mental images technical report, 2001
+/*
+ * Halves the bucket and gives the bottom half to others through own deque
+ * while some threads are idle, or when own deque runs out, which happens
+ * near the end of the frame. Thus the last buckets of the frame are shared
+ * by all threads in finer pieces.
  */
 static void
-sample_subpixel( unsigned int *i, ri_float_t jitter[2],
-                 int xs, int ys, int xsamples, int ysamples )
+split_bucket(
+    bucket_scheduler_t *scheduler,
+    int                 thread_id,
+    bucket_t           *bucket)         /* [inout] */
 {
-    unsigned int    j, k;
-    ri_float_t          offsetx, offsety;
+    int       idx;
+    int       half;
+    bucket_t *lower;
 
-    j = xs & ( hammsample.periodx - 1 );
-    k = ys & ( hammsample.periodx - 1 );
+    if (scheduler->nthreads < 2) return;
 
-    /* Instance number. */
-    (*i) = j * hammsample.periodx + hammsample.sigmax[k];
+    while ((scheduler->nidle > 0 ||
+            ri_ws_deque_size(scheduler->deques[thread_id]) == 0) &&
+           bucket->h >= 2 * BUCKET_SPLIT_MIN_HEIGHT) {
 
-    jitter[0] = ( ri_float_t ) xs
-        +
-        ( ri_float_t ) hammsample.sigmax[k] /
-        ( ri_float_t ) hammsample.periodx;
-    jitter[1] =
-        ( ri_float_t ) ys +
-        ( ri_float_t ) hammsample.sigmay[j] /
-        ( ri_float_t ) hammsample.periody;
+        idx = ri_atomic_add((int *)&scheduler->nbuckets, 1);
+        assert(idx < scheduler->maxbuckets);
 
-    jitter[0] /= ( ri_float_t ) xsamples;
-    jitter[1] /= ( ri_float_t ) ysamples;
+        half   = bucket->h / 2;
 
-    offsetx = 0.5 / ( xsamples * xsamples );
-    offsety = 0.5 / ( ysamples * ysamples );
+        lower  = &scheduler->buckets[idx];
+        (*lower) = (*bucket);
+        lower->y += half;
+        lower->h -= half;
 
-    jitter[0] += offsetx;
-    jitter[1] += offsety;
+        bucket->h = half;
 
+        if (ri_ws_deque_push(scheduler->deques[thread_id], idx) != 0) {
+            /* Should not happen. Render it by myself. */
+            bucket->h += lower->h;
+            break;
+        }
+    }
 }
 
-/* Initialize permutation for two-dimensional Hammersley points for
- * anti-aliasing.
- *
- * see:
- * "Strictly Deterministic Sampling Methods in Computer Graphics"
+/*
+ * Returns pseudo random shift in [0, 1) of the time dimension for the pixel
+ * (x, y). Integer hash of the pixel position, so that it does not depend on
+ * the rendering order nor on the thread.
+ */
+static ri_float_t
+pixel_time_shift( int x, int y )
+{
+    unsigned int    h;
+
+    h  = (unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u;
+    h  = (h ^ 61u) ^ (h >> 16);
+    h += (h << 3);
+    h ^= (h >> 4);
+    h *= 0x27d4eb2du;
+    h ^= (h >> 15);
+
+    return (ri_float_t)h / 4294967296.0;
+}
+
+/*
+ * Returns the scale of camera ray differentials for `nsamples' samples per
+ * pixel. Ray differentials span the distance between subpixel samples, so
+ * that textures are not blurred more than the pixel filter does.
+ */
+static ri_float_t
+differential_scale( int nsamples )
+{
+    ri_float_t scale;
+
+    if ( nsamples < 1 ) nsamples = 1;
+
+    scale = 1.0 / sqrt( (ri_float_t)nsamples );
+    if ( scale < 0.125 ) scale = 0.125;
+
+    return scale;
+}
+
+/*
+ * Sets up the camera ray through the point (x + jitter[0], y + jitter[1])
+ * on the screen. Ray differentials are scaled by `dscale'
+ * (see differential_scale()).
+ */
+static void
+gen_camera_ray( ri_ray_t * ray, const ri_camera_t * camera,
+                int x, int y, const ri_float_t jitter[2],
+                ri_float_t dscale,
+                unsigned int instance, int threadid )
+{
+    ri_vector_t     dir;
+    ri_vector_t     from;
+    ri_float_t      time;
+
+    ri_camera_get_pos_and_dir(
+        from, dir,
+        camera,
+        (ri_float_t)(x + jitter[0]),
+        (ri_float_t)(y + jitter[1]));
+
+    ri_vector_copy( ray->org, from );
+    ri_vector_copy( ray->dir, dir );
+    //ri_vector_sub( ray->dir, dir, from );
+    ri_vector_normalize( ray->dir );
+
+    ri_camera_get_differentials(
+        ray->dPdx, ray->dPdy, ray->dDdx, ray->dDdy,
+        camera,
+        (ri_float_t)(x + jitter[0]),
+        (ri_float_t)(y + jitter[1]));
+
+    ri_vector_scale( ray->dPdx, ray->dPdx, dscale );
+    ri_vector_scale( ray->dPdy, ray->dPdy, dscale );
+    ri_vector_scale( ray->dDdx, ray->dDdx, dscale );
+    ri_vector_scale( ray->dDdy, ray->dDdy, dscale );
+
+    ray->has_differentials = 1;
+
+    /* dimension 1 for screen x coordinate sample point,
+     * dimension 2 for screen y coordinate sample point.
+     */
+    ray->d = 3;
+
+    /* Ray's instance number for generalized scrambled
+     * Halton sequence or generalized scrambled
+     * Hammersley point set.
+     * This is used in subsequent QMC sampling.
+     */
+    ray->i = instance;
+
+    /*
+     * Time in the shutter interval for motion blur is drawn from the next
+     * dimension, so that subpixel samples are also stratified in time.
+     * The instance number only counts subpixel samples, which are the same
+     * for every pixel. Thus the time is rotated per pixel
+     * (Cranley-Patterson rotation), otherwise whole frame would see the
+     * same shutter instants and moving objects would strobe.
+     */
+    if (ri_render_get()->scene->motion_blur) {
+        time = generalized_scrambled_halton(
+                   ray->i, 0, ray->d, ri_render_get()->perm_table);
+        time += pixel_time_shift(x, y);
+        if (time >= 1.0) time -= 1.0;
+        ray->time = (float)time;
+        if (ray->time >= 1.0f) ray->time = 0.0f;    /* rounding to float */
+        ray->d++;
+    } else {
+        ray->time = 0.0f;
+    }
+
+    /* assign threadid to ray's thread number */
+    ray->thread_num = threadid;
+}
+
+/*
+ * Generates subpixel camera rays through pixel in (x, y).
+ * Returns the number of rays generated.
+ */
+static int
+subsample_gen_rays( ri_ray_t * rays_out, int x, int y, int threadid )
+{
+    int             n;
+    int             xs, ys;
+    int             xsamples, ysamples;
+    unsigned int    subinstance;
+    ri_float_t      jitter[2];
+    ri_float_t      dscale;
+    ri_display_t   *disp;
+    ri_camera_t    *camera;
+
+    camera = ri_render_get()->context->option->camera;
+
+    disp = ri_option_get_curr_display(ri_render_get()->context->option);
+    xsamples = disp->sampling_rates[0];
+    ysamples = disp->sampling_rates[1];
+
+    dscale = differential_scale( xsamples * ysamples );
+
+    n = 0;
+    for ( ys = 0; ys < ysamples; ys++ ) {
+        for ( xs = 0; xs < xsamples; xs++ ) {
+
+            sample_subpixel( &subinstance,
+                             jitter, xs, ys, xsamples,
+                             ysamples );
+
+            //ray->i = gqmc_instance * (xsamples * ysamples)
+            //       + subinstance;
+            gen_camera_ray( &rays_out[n++], camera, x, y, jitter, dscale,
+                            subinstance, threadid );
+
+            gqmc_instance += ( xsamples * ysamples );
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Generates `n' additional camera rays through pixel in (x, y) for adaptive
+ * supersampling. Subpixel positions are taken from the generalized
+ * scrambled Halton sequence starting at the index `first', so that the
+ * samples added in each round fill the pixel progressively.
+ */
+static int
+subsample_gen_extra_rays( ri_ray_t * rays_out, int x, int y,
+                          int first, int n, int threadid )
+{
+    int             i;
+    ri_float_t      jitter[2];
+    ri_float_t      dscale;
+    ri_camera_t    *camera;
+    int           **perm;
+
+    camera = ri_render_get()->context->option->camera;
+    perm   = ri_render_get()->perm_table;
+
+    /* The pixel has `first + n' samples after this round. */
+    dscale = differential_scale( first + n );
+
+    for ( i = 0; i < n; i++ ) {
+
+        jitter[0] = generalized_scrambled_halton( first + i, 0, 1, perm );
+        jitter[1] = generalized_scrambled_halton( first + i, 0, 2, perm );
+
+        gen_camera_ray( &rays_out[i], camera, x, y, jitter, dscale,
+                        (unsigned int)(first + i), threadid );
+    }
+
+    return n;
+}
+
+static ri_float_t
+sample_luminance( const ri_vector_t rad )
+{
+    return 0.2126 * rad[0] + 0.7152 * rad[1] + 0.0722 * rad[2];
+}
+
+/*
+ * Clears the subpixel samples of a pixel.
+ */
+static void
+subsample_begin( pixelinfo_t * pixinfo, int x, int y )
+{
+    pixinfo->nsamples = 0;
+    pixinfo->x        = x;
+    pixinfo->y        = y;
+    pixinfo->lumsum   = 0.0;
+    pixinfo->lumsqsum = 0.0;
+
+    ri_vector_setzero( pixinfo->radiance );
+}
+
+/*
+ * Shades a camera ray which is already traced.
+ */
+static void
+shade_sample( const ri_ray_t * ray,
+              int hit,
+              const ri_intersection_state_t * state,
+              ri_transport_info_t * result )
+{
+    ri_render_t    *render = ri_render_get(  );
+
+    if ( render->global_photonmap || render->caustic_photonmap ) {
+        ri_transport_photonmapping_shade( render, ray, hit, state, result );
+    } else {
+        ri_transport_ambientocclusion_shade( render, ray, hit, state,
+                                             result );
+    }
+}
+
+/*
+ * Shades `n' subpixel samples of a pixel whose camera rays are already
+ * traced, and adds them to the pixel.
+ */
+static void
+subsample_shade( pixelinfo_t * pixinfo,
+                 const ri_ray_t * rays,
+                 const ri_intersection_state_t * states,
+                 const int * hits,
+                 int n )
+{
+    int             i;
+    int             k;
+    ri_float_t      lum;
+    ri_transport_info_t result;
+    uint64_t        t0;
+
+    t0 = ri_prof_ticks();
+
+    for ( i = 0; i < n; i++ ) {
+
+        /* HACK */
+        //ri_transport_sample( ri_render_get(  ),
+        //                     &ray, &result );
+        shade_sample( &rays[i], hits[i], &states[i], &result );
+        //ri_transport_whitted(ri_render_get(), &ray, &result);
+
+        ri_vector_add( pixinfo->radiance, pixinfo->radiance,
+                       result.radiance );
+
+        lum = sample_luminance( result.radiance );
+        pixinfo->lumsum   += lum;
+        pixinfo->lumsqsum += lum * lum;
+
+        k = pixinfo->nsamples + i;
+        if ( k < MAX_SAMPLES_IN_PIXEL ) {
+            ri_vector_copy( pixinfo->samples[k].radiance, result.radiance );
+            pixinfo->samples[k].depth = 0.0f;
+        }
+
+#if 0    // TODO: fixme!
+        if ( result.hit ) {
+            pixinfo->samples[currsample].depth
+                += result.ray.isectt * inv_nsamples;
+        } else {
+            pixinfo->samples[currsample].depth
+                += RI_INFINITY * inv_nsamples;
+        }
+#endif
+    }
+
+    pixinfo->nsamples += n;
+
+    ri_prof_timer_add( RI_PROF_TIMER_SHADER, ri_prof_ticks() - t0 );
+    ri_prof_add( RI_PROF_NSHADER_CALLS, n );
+}
+
+/*
+ * Relative standard error of the mean luminance of the pixel. Pixels
+ * darker than ADAPTIVE_MIN_LUMINANCE are measured in absolute error so
+ * that noise in black regions does not drive refinement.
+ */
+static ri_float_t
+subsample_error( const pixelinfo_t * pixinfo )
+{
+    ri_float_t      n;
+    ri_float_t      mean;
+    ri_float_t      var;
+
+    if ( pixinfo->nsamples < 2 ) return RI_INFINITY;
+
+    n    = (ri_float_t)pixinfo->nsamples;
+    mean = pixinfo->lumsum / n;
+    var  = ( pixinfo->lumsqsum - n * mean * mean ) / ( n - 1.0 );
+    if ( var < 0.0 ) var = 0.0;
+
+    if ( mean < ADAPTIVE_MIN_LUMINANCE ) mean = ADAPTIVE_MIN_LUMINANCE;
+
+    return sqrt( var / n ) / mean;
+}
+
+/*
+ * Adds samples to the pixel in (x, y) until its error drops below the
+ * threshold or `maxsamples' samples are taken.
+ */
+static void
+subsample_refine( pixelinfo_t * pixinfo,
+                  int x, int y,
+                  int batch,
+                  int maxsamples,
+                  ri_float_t threshold,
+                  ri_ray_t * rays,                          /* [buffer] */
+                  ri_intersection_state_t * states,         /* [buffer] */
+                  int * hits,                               /* [buffer] */
+                  int threadid )
+{
+    int             n;
+
+    while ( pixinfo->nsamples < maxsamples ) {
+
+        if ( subsample_error( pixinfo ) <= threshold ) break;
+
+        n = maxsamples - pixinfo->nsamples;
+        if ( n > batch ) n = batch;
+
+        subsample_gen_extra_rays( rays, x, y, pixinfo->nsamples, n,
+                                  threadid );
+
+        ri_raytrace_stream( ri_render_get(), rays, n, states, hits );
+
+        subsample_shade( pixinfo, rays, states, hits, n );
+    }
+}
+
+/*
+ * Resolves the pixel color from its subpixel samples.
+ */
+static void
+subsample_end( pixelinfo_t * pixinfo )
+{
+    ri_vector_scale( pixinfo->radiance, pixinfo->radiance,
+                     ( (ri_float_t)1.0 / pixinfo->nsamples ) );
+}
+
+/*
+ * Records the number of samples of the pixel in (x, y) to the sample count
+ * AOV, if requested.
+ */
+static void
+aov_write_nsamples( int x, int y, int nsamples )
+{
+    int             idx;
+
+    if ( gaov_nsamples == NULL ) return;
+
+    idx = y * ri_render_get()->context->option->camera->horizontal_resolution
+        + x;
+
+    gaov_nsamples[4 * idx + 0] = (float)nsamples;
+    gaov_nsamples[4 * idx + 1] = (float)nsamples;
+    gaov_nsamples[4 * idx + 2] = (float)nsamples;
+    gaov_nsamples[4 * idx + 3] = 1.0f;
+}
+
+/* two-dimensional Hammersley points for anti-aliasing.
+ * see:
+ * "Strictly Deterministic Sampling Methods in Computer Graphics"
+ * Alexander Keller, mental images technical report, 2001
+ */
+static void
+sample_subpixel( unsigned int *i, ri_float_t jitter[2],
+                 int xs, int ys, int xsamples, int ysamples )
+{
+    unsigned int    j, k;
+    ri_float_t          offsetx, offsety;
+
+    j = xs & ( hammsample.periodx - 1 );
+    k = ys & ( hammsample.periodx - 1 );
+
+    /* Instance number. */
+    (*i) = j * hammsample.periodx + hammsample.sigmax[k];
+
+    jitter[0] = ( ri_float_t ) xs
+        +
+        ( ri_float_t ) hammsample.sigmax[k] /
+        ( ri_float_t ) hammsample.periodx;
+    jitter[1] =
+        ( ri_float_t ) ys +
+        ( ri_float_t ) hammsample.sigmay[j] /
+        ( ri_float_t ) hammsample.periody;
+
+    jitter[0] /= ( ri_float_t ) xsamples;
+    jitter[1] /= ( ri_float_t ) ysamples;
+
+    offsetx = 0.5 / ( xsamples * xsamples );
+    offsety = 0.5 / ( ysamples * ysamples );
+
+    jitter[0] += offsetx;
+    jitter[1] += offsety;
+
+}
+
+/* Initialize permutation for two-dimensional Hammersley points for
+ * anti-aliasing.
+ *
+ * see:
+ * "Strictly Deterministic Sampling Methods in Computer Graphics"
  * Alexander Keller, mental images technical report, 2001
  */
 void
@@ -916,48 +1672,115 @@ init_sigma( int xsamples, int ysamples )
     }
 }
 
+/*
+ * Writes the bucket to the display driver. Display drivers add pixels to
+ * the image. If `overwrite' is non-zero, pixels replace the previous ones
+ * instead, which is done only by drivers with update_bucket(). Otherwise
+ * nothing is written.
+ */
 static void
 bucket_write(
     const bucket_t      *bucket,
-    ri_display_drv_t    *drv,
-    ri_display_t        *disp )
+    ri_render_t         *render,
+    ri_arena_t          *arena,
+    int                  overwrite )
 {
-    int             n;
-    int             width, height;
-    int             screenwidth, screenheight;
-    int             x, y;
-    int             sx, sy;
-    ri_vector_t     rad;
-    float           floatcol[3];
-    unsigned char   col[3];
-    ri_camera_t    *camera;
+    int                 n;
+    int                 width, height;
+    int                 screenheight;
+    int                 x, y;
+    int                 sx, sy;
+    int                 dy;
+    float              *rgba;
+    float              *dst;
+    float               floatcol[3];
+    unsigned char       col[3];
+    ri_display_drv_t   *drv;
+    int               (*write_bucket)(int x, int y, int w, int h,
+                                      const float *rgba, int stride);
+
+    /*
+     * Workers send pixels to the master, which owns the display driver.
+     */
+    if (gdist.role == DIST_WORKER) {
+        dist_send_tile(bucket, arena);
+        return;
+    }
+
+    drv          = render->display_drv;
+
+    write_bucket = drv->write_bucket;
 
-    camera      = ri_render_get(  )->context->option->camera;
+    if ( overwrite ) {
+        if ( drv->update_bucket == NULL ) return;
+        write_bucket = drv->update_bucket;
+    }
 
-    screenwidth = camera->horizontal_resolution;
-    screenheight = camera->vertical_resolution;
+    screenheight = render->context->option->camera->vertical_resolution;
 
     x = bucket->x;
     y = bucket->y;
     width = bucket->w;
     height = bucket->h;
 
+    if ( write_bucket ) {
+
+        /*
+         * Pass the whole bucket at once. Rows are stored in the order of
+         * the display driver's coordinate.
+         */
+        rgba = ( float * ) ri_arena_alloc( arena, sizeof( float ) * 4 *
+                                           width * height,
+                                           RI_MEM_DEFAULT_ALIGN );
+
+        for ( sy = 0; sy < height; sy++ ) {
+
+            if ( render->display_float ) {
+                dst = rgba + 4 * width * ( height - sy - 1 );
+            } else {
+                dst = rgba + 4 * width * sy;
+            }
+
+            for ( sx = 0; sx < width; sx++ ) {
+                n = sy * width + sx;
+
+                dst[4 * sx + 0] = ( float ) bucket->pixels[n][0];
+                dst[4 * sx + 1] = ( float ) bucket->pixels[n][1];
+                dst[4 * sx + 2] = ( float ) bucket->pixels[n][2];
+                dst[4 * sx + 3] = 1.0f;    /* TODO: alpha */
+            }
+        }
+
+        if ( render->display_float ) {
+            dy = screenheight - ( y + height );
+        } else {
+            dy = y;
+        }
+
+        if ( !drv->concurrent ) ri_mutex_lock( render->mutex );
+
+        write_bucket( x, dy, width, height, rgba, 4 * width );
+
+        if ( !drv->concurrent ) ri_mutex_unlock( render->mutex );
+
+        return;
+    }
+
+    /*
+     * Per pixel write. Needs a lock since the display driver is not
+     * thread-safe.
+     */
+    ri_mutex_lock( render->mutex );
+
     for ( sy = 0; sy < height; sy++ ) {
         for ( sx = 0; sx < width; sx++ ) {
             n = sy * width + sx;
-            ri_vector_copy( rad, bucket->pixels[n] );
 
-            if ( strcmp( disp->display_format,
-                         "float" ) == 0 ||
-                 strcmp( disp->display_type, "hdr" ) == 0 ||
-                 strcmp( disp->display_type, "openexr" ) == 0
-                 || strcmp( disp->display_type, "socket" ) == 0
-                 || strcmp( disp->display_type,
-                            RI_FILE ) == 0 ) {
+            if ( render->display_float ) {
 
-                floatcol[0] = (float)rad[0];
-                floatcol[1] = (float)rad[1];
-                floatcol[2] = (float)rad[2];
+                floatcol[0] = (float)bucket->pixels[n][0];
+                floatcol[1] = (float)bucket->pixels[n][1];
+                floatcol[2] = (float)bucket->pixels[n][2];
 
                 drv->write( sx + x,
                             screenheight - ( sy + y ) - 1,
@@ -966,9 +1789,9 @@ bucket_write(
             } else {
                 //ri_tonemap_apply( disp, &rad );
 
-                col[0] = ( unsigned char ) ( rad[0] * 255.0 );
-                col[1] = ( unsigned char ) ( rad[1] * 255.0 );
-                col[2] = ( unsigned char ) ( rad[2] * 255.0 );
+                col[0] = ( unsigned char ) ( bucket->pixels[n][0] * 255.0 );
+                col[1] = ( unsigned char ) ( bucket->pixels[n][1] * 255.0 );
+                col[2] = ( unsigned char ) ( bucket->pixels[n][2] * 255.0 );
 
                 drv->write( sx + x,
                             //screenheight - (sy + y) - 1,
@@ -976,6 +1799,8 @@ bucket_write(
             }
         }
     }
+
+    ri_mutex_unlock( render->mutex );
 }
 
 
@@ -1040,66 +1865,131 @@ progress_bar(
 
 }
 
-static void *
-render_bucket_thread_func(void *arg)
+/*
+ * Shows the progress bar of the frame. In progressive rendering, also stops
+ * the pass when the time budget is used up.
+ */
+static void
+show_progress()
 {
-    int              ret;
-    bucket_t        *bucket;
-    uint32_t         data_size;
-    render_thread_t *info;
-
     double           elapsed;
     double           eta;                   /* Estimated time for arrival */
-    int              nbuckets;
-    int              nbuckets_remain;
+    double           spp;                   /* Average samples/pixel  */
+    int              npixels;
+    int              npixels_done;
     int              progress;
 
-    info = (render_thread_t *)arg;
+    elapsed = ri_timer_elapsed_current(
+                ri_render_get()->context->timer, "Render frame");
 
-    while (1) {
+    npixels      = gscheduler.npixels;
+    npixels_done = gscheduler.npixels_done;
 
-        ret = ri_mt_queue_pop(
-            ri_render_get()->bucket_queue,
-            (void **)&bucket,
-            &data_size);
-        
-        if (ret != 0) {
-            /* no items in the queue. */
-            break;
+    if (gprogressive.enabled) {
+
+        /*
+         * Progress toward the sample cap or the time budget,
+         * whichever comes first.
+         */
+        spp  = (gprogressive.nsamples_prev +
+                gscheduler.nsamples_done) / (double)npixels;
+
+        progress = (int)(100.0 * spp / gprogressive.maxsamples);
+        eta      = elapsed / spp;
+        eta     *= gprogressive.maxsamples - spp;
+
+        if (gprogressive.time_budget > 0.0) {
+
+            if (eta > gprogressive.time_budget - elapsed) {
+                eta      = gprogressive.time_budget - elapsed;
+                progress = (int)(100.0 * elapsed /
+                                 gprogressive.time_budget);
+            }
+
+            /*
+             * Abort the rest of the pass when the budget is
+             * used up. The first pass always completes.
+             */
+            if ((gprogressive.pass > 0) &&
+                (elapsed >= gprogressive.time_budget)) {
+                gscheduler.stop = 1;
+            }
         }
 
+        if (eta < 0.0) eta = 0.0;
+        if (progress > 100) progress = 100;
+
+    } else {
+
+        /*
+         * With adaptive supersampling the cost of a pixel varies,
+         * so the rest of the frame is estimated in samples with
+         * the average samples per pixel so far.
+         */
+        spp  = gscheduler.nsamples_done /
+               (double)(npixels_done - gscheduler.npixels_restored);
+
+        eta  = elapsed / (double)gscheduler.nsamples_done;
+        eta *= spp * (double)(npixels - npixels_done);
+
+        progress = (int)(100.0 * npixels_done / (double)npixels);
+    }
+
+    printf("\r");
+    progress_bar(progress, eta, elapsed);
+    if (gprogressive.enabled ||
+        ri_render_get()->context->option->adaptive_max_samples > 0) {
+        printf("  %6.1f spp", spp);
+    }
+    fflush(stdout);
+}
+
+static void *
+render_bucket_thread_func(void *arg)
+{
+    int              ret;
+    bucket_t        *bucket;
+    render_thread_t *info;
+
+    info = (render_thread_t *)arg;
+
+    ri_prof_set_thread(info->thread_id);
+
+    while (fetch_bucket(info, &bucket)) {
+
         /* 
          * Trace rays in this bucker region and render the image.
          */
-        ret = render_bucket(bucket, info->thread_id);
+        if (gprogressive.enabled) {
+            ret = render_bucket_progressive(bucket, info->thread_id);
+        } else {
+            ret = render_bucket(bucket, info->thread_id);
+        }
         assert(ret == 0);
 
+        ri_atomic_add64(&gscheduler.nsamples_done, bucket->nsamples);
+        ri_atomic_add((int *)&gscheduler.npixels_done, bucket->w * bucket->h);
+
         /*
          * Display rendering progress if this thread is the main thread
-         * (thread_id == 0).
+         * (thread_id == 0). The master shows the progress of workers.
          *
          */
-        if (info->thread_id == 0) {
-
-            elapsed = ri_timer_elapsed_current(
-                        ri_render_get()->context->timer, "Render frame");
-
-            nbuckets        = ri_render_get()->nbuckets;
-            nbuckets_remain = ri_mt_queue_len(ri_render_get()->bucket_queue);
-
-            eta  = elapsed / (double)(nbuckets - nbuckets_remain);
-            eta *= (double)(nbuckets_remain);
+        if (info->thread_id == 0 && gdist.role != DIST_WORKER) {
 
-            progress = (int)(100.0 * (nbuckets - nbuckets_remain) / (double)nbuckets);
-
-            printf("\r");
-            progress_bar(progress, eta, elapsed);
-            fflush(stdout);
+            /*
+             * Let the writer thread save finished buckets. Progressive
+             * rendering saves its state between passes instead.
+             */
+            if (gcheckpoint && !gprogressive.enabled &&
+                ri_checkpoint_due(gcheckpoint)) {
+                ri_checkpoint_request(gcheckpoint);
+            }
 
+            show_progress();
         }
 
     }
-    
 
     return NULL;
 }
@@ -1109,11 +1999,30 @@ render_bucket(
     bucket_t *bucket,
     int       thread_id)
 {
+    ri_arena_t  *arena;
+
     unsigned int u, v;
     unsigned int x, y;
     unsigned int w, h;
+    unsigned int i;
+    unsigned int tv, th, tw;
+    unsigned int nsamples;
+    unsigned int n, ntile;
+    int          maxsamples;
+    int          batch;
 
     pixelinfo_t  pixinfo;
+    ri_display_t *disp;
+    ri_option_t  *option;
+
+    ri_ray_t                *rays;
+    ri_intersection_state_t *states;
+    int                     *hits;
+    unsigned int            *offsets;
+
+    ri_ray_t                *extra_rays   = NULL;
+    ri_intersection_state_t *extra_states = NULL;
+    int                     *extra_hits   = NULL;
 
     x = bucket->x;
     y = bucket->y;
@@ -1121,67 +2030,365 @@ render_bucket(
     h = bucket->h;
 
     /*
-     * Allocate bucket's pixel buffers here to save memory.
+     * Allocate bucket's pixel buffers and scratch memory from the thread's
+     * arena. All of them are released at once by the reset at the next
+     * bucket.
      */
+    arena = ri_render_get()->arenas[thread_id];
+    ri_arena_reset(arena);
 
-    bucket->pixels = (ri_vector_t *)ri_mem_alloc_aligned(sizeof(ri_vector_t) * w * h, 32);
-    bucket->depths = (ri_float_t *)ri_mem_alloc_aligned(sizeof(ri_float_t) * w * h, 32);
-    bucket->alphas = (ri_float_t *)ri_mem_alloc_aligned(sizeof(ri_float_t) * w * h, 32);
+    bucket->pixels = (ri_vector_t *)ri_arena_alloc(arena, sizeof(ri_vector_t) * w * h, 32);
+    bucket->depths = (ri_float_t *)ri_arena_alloc(arena, sizeof(ri_float_t) * w * h, 32);
+    bucket->alphas = (ri_float_t *)ri_arena_alloc(arena, sizeof(ri_float_t) * w * h, 32);
 
     //ri_log(LOG_INFO, "(Render) Rendering bucket region [%dx%d]", x, y);
 
-    for (v = y; v < y + h; v++) { 
-        for (u = x; u < x + w; u++) {
+    /*
+     * Camera rays are traced per PACKET_TILE_SIZE^2 pixel tile with ray
+     * packets, then shaded in scanline order so that the sequence of
+     * random numbers used in shading is the same as tracing per pixel.
+     */
+    option   = ri_render_get()->context->option;
+    disp     = ri_option_get_curr_display(option);
+    nsamples = disp->sampling_rates[0] * disp->sampling_rates[1];
 
-            subsample(&pixinfo, u, v, thread_id);
+    bucket->nsamples = 0;
 
-            /*
-             * Recored result
-             */
-            vcpy(bucket->pixels[(v - y) * w + (u - x)], pixinfo.radiance);
+    /*
+     * Adaptive supersampling takes up to `maxsamples' samples per pixel.
+     * The display's sampling rates give the base samples.
+     */
+    maxsamples = (int)nsamples;
+    batch      = (int)nsamples;
+    if (batch < ADAPTIVE_BATCH_MIN) batch = ADAPTIVE_BATCH_MIN;
 
-            /* TODO: Z, Alpha, etc. */
+    if (option->do_adaptive_supersampling &&
+        option->adaptive_max_samples > (int)nsamples) {
 
+        maxsamples = option->adaptive_max_samples;
+        if (maxsamples > MAX_SAMPLES_IN_PIXEL) {
+            maxsamples = MAX_SAMPLES_IN_PIXEL;
         }
+
+        extra_rays   = (ri_ray_t *)ri_arena_alloc(arena,
+                        sizeof(ri_ray_t) * batch, RI_MEM_DEFAULT_ALIGN);
+        extra_states = (ri_intersection_state_t *)ri_arena_alloc(arena,
+                        sizeof(ri_intersection_state_t) * batch,
+                        RI_MEM_DEFAULT_ALIGN);
+        extra_hits   = (int *)ri_arena_alloc(arena,
+                        sizeof(int) * batch, RI_MEM_DEFAULT_ALIGN);
     }
 
-    //
-    // Needs a lock to write out data to the display driver.
-    // More smarter idea is making the display driver thread-safe internally.
-    //
-    ri_mutex_lock(ri_render_get()->mutex);
+    rays    = (ri_ray_t *)ri_arena_alloc(arena,
+                sizeof(ri_ray_t) * PACKET_TILE_SIZE * w * nsamples,
+                RI_MEM_DEFAULT_ALIGN);
+    states  = (ri_intersection_state_t *)ri_arena_alloc(arena,
+                sizeof(ri_intersection_state_t) * PACKET_TILE_SIZE * w * nsamples,
+                RI_MEM_DEFAULT_ALIGN);
+    hits    = (int *)ri_arena_alloc(arena,
+                sizeof(int) * PACKET_TILE_SIZE * w * nsamples,
+                RI_MEM_DEFAULT_ALIGN);
+    offsets = (unsigned int *)ri_arena_alloc(arena,
+                sizeof(unsigned int) * PACKET_TILE_SIZE * w,
+                RI_MEM_DEFAULT_ALIGN);
+
+    for (tv = y; tv < y + h; tv += PACKET_TILE_SIZE) { 
+
+        th = (y + h) - tv;
+        if (th > PACKET_TILE_SIZE) th = PACKET_TILE_SIZE;
+
+        /*
+         * Generate and trace camera rays in this row of tiles.
+         */
+        n = 0;
+        for (u = x; u < x + w; u += PACKET_TILE_SIZE) {
+
+            tw = (x + w) - u;
+            if (tw > PACKET_TILE_SIZE) tw = PACKET_TILE_SIZE;
+
+            ntile = 0;
+            for (v = tv; v < tv + th; v++) {
+                for (i = u; i < u + tw; i++) {
+                    offsets[(v - tv) * w + (i - x)] = n + ntile;
+                    ntile += subsample_gen_rays(&rays[n + ntile], i, v,
+                                                thread_id);
+                }
+            }
+
+            ri_raytrace_stream(ri_render_get(), &rays[n], ntile,
+                               &states[n], &hits[n]);
+
+            n += ntile;
+        }
+
+        /*
+         * Shade in scanline order.
+         */
+        for (v = tv; v < tv + th; v++) {
+            for (u = x; u < x + w; u++) {
+
+                n = offsets[(v - tv) * w + (u - x)];
+
+                subsample_begin(&pixinfo, u, v);
+
+                subsample_shade(&pixinfo, &rays[n], &states[n], &hits[n],
+                                nsamples);
+
+                if (pixinfo.nsamples < maxsamples) {
+                    subsample_refine(&pixinfo, u, v, batch, maxsamples,
+                                     option->adaptive_threshold,
+                                     extra_rays, extra_states, extra_hits,
+                                     thread_id);
+                }
+
+                subsample_end(&pixinfo);
+
+                bucket->nsamples += pixinfo.nsamples;
+
+                aov_write_nsamples(u, v, pixinfo.nsamples);
 
-    bucket_write( bucket, 
-                  ri_render_get()->display_drv,
-                  ri_option_get_curr_display(ri_render_get()->context->option) );
+                /*
+                 * Recored result
+                 */
+                vcpy(bucket->pixels[(v - y) * w + (u - x)], pixinfo.radiance);
+
+                /* TODO: Z, Alpha, etc. */
+
+            }
+        }
+    }
 
-    ri_mutex_unlock(ri_render_get()->mutex);
+    /*
+     * bucket_write() takes a lock only if the display driver is not
+     * thread-safe.
+     */
+    bucket_write( bucket, ri_render_get(), arena, 0 );
 
-    ri_mem_free_aligned(bucket->pixels);
-    ri_mem_free_aligned(bucket->depths);
-    ri_mem_free_aligned(bucket->alphas);
+    if (gcheckpoint) {
+        ri_checkpoint_put_region(gcheckpoint, x, y, w, h, bucket->pixels);
+    }
 
     return 0;   /* OK */
 
 }
 
-void
-render_frame_controller(ri_render_t *render)
+/*
+ * Loads the accumulated samples of the pixel `idx' for progressive
+ * rendering.
+ */
+static void
+progressive_load( pixelinfo_t * pixinfo, int x, int y, int idx )
 {
-    int i;
-    int ret;
-    int nthreads;
-    ri_thread_t *threads;
+    pixinfo->nsamples = gprogressive.nsamples[idx];
+    pixinfo->x        = x;
+    pixinfo->y        = y;
+    pixinfo->lumsum   = gprogressive.lumsum[idx];
+    pixinfo->lumsqsum = gprogressive.lumsqsum[idx];
 
-    render_thread_t *thread_tls;
+    ri_vector_copy( pixinfo->radiance, gprogressive.radiance[idx] );
+}
 
-    nthreads   = render->nthreads;
+static void
+progressive_store( const pixelinfo_t * pixinfo, int idx )
+{
+    gprogressive.nsamples[idx] = pixinfo->nsamples;
+    gprogressive.lumsum[idx]   = pixinfo->lumsum;
+    gprogressive.lumsqsum[idx] = pixinfo->lumsqsum;
 
-    if (nthreads == 0) nthreads = 1;
+    ri_vector_copy( gprogressive.radiance[idx], pixinfo->radiance );
+}
 
-    threads    = (ri_thread_t *)ri_mem_alloc( sizeof(ri_thread_t) * nthreads);
-    thread_tls = (render_thread_t *)ri_mem_alloc(
-                    sizeof(render_thread_t) * nthreads);
+/*
+ * Returns the number of samples to add to the pixel in this pass. 0 if the
+ * pixel has reached the sample cap or the target noise level.
+ */
+static int
+progressive_nsamples( const pixelinfo_t * pixinfo )
+{
+    int             n;
+
+    if ( pixinfo->nsamples >= gprogressive.maxsamples ) return 0;
+
+    if ( ( gprogressive.threshold > 0.0 ) &&
+         ( pixinfo->nsamples >= PROGRESSIVE_MIN_SAMPLES ) &&
+         ( subsample_error( pixinfo ) <= gprogressive.threshold ) ) {
+        return 0;
+    }
+
+    n = gprogressive.maxsamples - pixinfo->nsamples;
+    if ( n > gprogressive.nsamples_pass ) n = gprogressive.nsamples_pass;
+
+    return n;
+}
+
+/*
+ * Adds one pass of samples to the pixels in the bucket and writes the
+ * running average to the display driver.
+ */
+static int
+render_bucket_progressive(
+    bucket_t *bucket,
+    int       thread_id)
+{
+    ri_arena_t  *arena;
+
+    unsigned int u, v;
+    unsigned int x, y;
+    unsigned int w, h;
+    unsigned int i;
+    unsigned int tv, th, tw;
+    unsigned int n, ntile;
+    int          idx;
+    int          width;
+    int          nactive;
+
+    pixelinfo_t  pixinfo;
+
+    ri_ray_t                *rays;
+    ri_intersection_state_t *states;
+    int                     *hits;
+    unsigned int            *offsets;
+    int                     *counts;
+
+    x = bucket->x;
+    y = bucket->y;
+    w = bucket->w;
+    h = bucket->h;
+
+    width = ri_render_get()->context->option->camera->horizontal_resolution;
+
+    arena = ri_render_get()->arenas[thread_id];
+    ri_arena_reset(arena);
+
+    bucket->pixels = (ri_vector_t *)ri_arena_alloc(arena, sizeof(ri_vector_t) * w * h, 32);
+    bucket->depths = (ri_float_t *)ri_arena_alloc(arena, sizeof(ri_float_t) * w * h, 32);
+    bucket->alphas = (ri_float_t *)ri_arena_alloc(arena, sizeof(ri_float_t) * w * h, 32);
+
+    bucket->nsamples = 0;
+
+    rays    = (ri_ray_t *)ri_arena_alloc(arena,
+                sizeof(ri_ray_t) * PACKET_TILE_SIZE * w *
+                gprogressive.nsamples_pass,
+                RI_MEM_DEFAULT_ALIGN);
+    states  = (ri_intersection_state_t *)ri_arena_alloc(arena,
+                sizeof(ri_intersection_state_t) * PACKET_TILE_SIZE * w *
+                gprogressive.nsamples_pass,
+                RI_MEM_DEFAULT_ALIGN);
+    hits    = (int *)ri_arena_alloc(arena,
+                sizeof(int) * PACKET_TILE_SIZE * w *
+                gprogressive.nsamples_pass,
+                RI_MEM_DEFAULT_ALIGN);
+    offsets = (unsigned int *)ri_arena_alloc(arena,
+                sizeof(unsigned int) * PACKET_TILE_SIZE * w,
+                RI_MEM_DEFAULT_ALIGN);
+    counts  = (int *)ri_arena_alloc(arena,
+                sizeof(int) * PACKET_TILE_SIZE * w,
+                RI_MEM_DEFAULT_ALIGN);
+
+    nactive = 0;
+
+    for (tv = y; tv < y + h; tv += PACKET_TILE_SIZE) { 
+
+        th = (y + h) - tv;
+        if (th > PACKET_TILE_SIZE) th = PACKET_TILE_SIZE;
+
+        /*
+         * Generate and trace camera rays of unconverged pixels in this
+         * row of tiles. Sample positions continue the sequence of samples
+         * taken in the previous passes.
+         */
+        n = 0;
+        for (u = x; u < x + w; u += PACKET_TILE_SIZE) {
+
+            tw = (x + w) - u;
+            if (tw > PACKET_TILE_SIZE) tw = PACKET_TILE_SIZE;
+
+            ntile = 0;
+            for (v = tv; v < tv + th; v++) {
+                for (i = u; i < u + tw; i++) {
+
+                    idx = v * width + i;
+
+                    progressive_load(&pixinfo, i, v, idx);
+
+                    offsets[(v - tv) * w + (i - x)] = n + ntile;
+                    counts [(v - tv) * w + (i - x)] =
+                        progressive_nsamples(&pixinfo);
+
+                    ntile += subsample_gen_extra_rays(
+                                &rays[n + ntile], i, v,
+                                pixinfo.nsamples + 1,
+                                counts[(v - tv) * w + (i - x)],
+                                thread_id);
+                }
+            }
+
+            if (ntile > 0) {
+                ri_raytrace_stream(ri_render_get(), &rays[n], ntile,
+                                   &states[n], &hits[n]);
+            }
+
+            n += ntile;
+        }
+
+        /*
+         * Shade in scanline order.
+         */
+        for (v = tv; v < tv + th; v++) {
+            for (u = x; u < x + w; u++) {
+
+                idx = v * width + u;
+
+                progressive_load(&pixinfo, u, v, idx);
+
+                n = offsets[(v - tv) * w + (u - x)];
+                i = counts [(v - tv) * w + (u - x)];
+
+                if (i > 0) {
+
+                    subsample_shade(&pixinfo, &rays[n], &states[n],
+                                    &hits[n], i);
+
+                    progressive_store(&pixinfo, idx);
+
+                    bucket->nsamples += i;
+                }
+
+                if (progressive_nsamples(&pixinfo) > 0) {
+                    nactive++;
+                }
+
+                aov_write_nsamples(u, v, pixinfo.nsamples);
+
+                subsample_end(&pixinfo);
+
+                vcpy(bucket->pixels[(v - y) * w + (u - x)], pixinfo.radiance);
+            }
+        }
+    }
+
+    ri_atomic_add((int *)&gprogressive.nactive, nactive);
+
+    /*
+     * Replace the bucket in the display with the refined one. Drivers
+     * which can't overwrite pixels get the image at the end of the frame.
+     */
+    bucket_write( bucket, ri_render_get(), arena, 1 );
+
+    return 0;   /* OK */
+}
+
+/*
+ * Renders all buckets in the scheduler with `nthreads' threads.
+ */
+static void
+render_pass(
+    ri_thread_t         *threads,
+    render_thread_t     *thread_tls,
+    int                  nthreads)
+{
+    int i;
+    int ret;
 
     /*
      * Invoke threads
@@ -1206,32 +2413,1135 @@ render_frame_controller(ri_render_t *render)
     }    
 }
 
-void
-render_frame_cleanup(ri_render_t *render)
+/*
+ * Sets up accumulation buffers if progressive rendering is requested.
+ * Returns 1 if progressive rendering is enabled, 0 if not.
+ */
+static int
+progressive_setup(
+    const ri_render_t   *render)
 {
-    char              message[1024];
+    int              npixels;
+    ri_option_t     *option;
+    ri_display_t    *disp;
 
-    int               my_id;
-    time_t            tm;
+    memset(&gprogressive, 0, sizeof(progressive_t));
 
-    assert(render != NULL);
+    option = render->context->option;
 
-    my_id = ri_parallel_taskid();
-        
-    if ( my_id == 0 ) {
-        printf( "\n" );
-        ri_raytrace_statistics(  );
+    if (!option->do_progressive) return 0;
 
-        ri_shade_statistics(  );
+    disp = ri_option_get_curr_display(option);
+
+    gprogressive.maxsamples = option->progressive_max_samples;
+    if (gprogressive.maxsamples <= 0) {
+        gprogressive.maxsamples = disp->sampling_rates[0] *
+                                  disp->sampling_rates[1];
     }
+    if (gprogressive.maxsamples < 1) gprogressive.maxsamples = 1;
 
-    assert(render->context);
-    assert(render->context->timer);
+    gprogressive.threshold   = option->progressive_threshold;
+    gprogressive.time_budget = option->progressive_time;
 
-    ri_timer_start( render->context->timer, "Clean up" );
+    npixels = option->camera->horizontal_resolution *
+              option->camera->vertical_resolution;
 
-    ri_scene_free( grender->scene );
-    grender->scene = NULL;
+    gprogressive.radiance = (ri_vector_t *)ri_mem_alloc(
+                                sizeof(ri_vector_t) * npixels);
+    gprogressive.lumsum   = (ri_float_t *)ri_mem_alloc(
+                                sizeof(ri_float_t) * npixels);
+    gprogressive.lumsqsum = (ri_float_t *)ri_mem_alloc(
+                                sizeof(ri_float_t) * npixels);
+    gprogressive.nsamples = (int *)ri_mem_alloc(
+                                sizeof(int) * npixels);
+
+    memset(gprogressive.radiance, 0, sizeof(ri_vector_t) * npixels);
+    memset(gprogressive.lumsum,   0, sizeof(ri_float_t)  * npixels);
+    memset(gprogressive.lumsqsum, 0, sizeof(ri_float_t)  * npixels);
+    memset(gprogressive.nsamples, 0, sizeof(int)         * npixels);
+
+    gprogressive.pass          = 0;
+    gprogressive.nsamples_pass = 1;
+    gprogressive.nsamples_prev = 0;
+
+    gprogressive.enabled = 1;
+
+    ri_log(LOG_INFO, "(Render) Progressive rendering: max %d samples/pixel, "
+           "threshold %f, time budget %.1f sec",
+           gprogressive.maxsamples, gprogressive.threshold,
+           gprogressive.time_budget);
+
+    return 1;
+}
+
+static void
+progressive_free()
+{
+    if (!gprogressive.enabled) return;
+
+    ri_mem_free(gprogressive.radiance);
+    ri_mem_free(gprogressive.lumsum);
+    ri_mem_free(gprogressive.lumsqsum);
+    ri_mem_free(gprogressive.nsamples);
+
+    memset(&gprogressive, 0, sizeof(progressive_t));
+}
+
+/*
+ * Writes the accumulated image to the display driver which can't overwrite
+ * pixels, after all passes are done.
+ */
+static void
+progressive_write_frame(
+    ri_render_t         *render)
+{
+    int              width, height;
+    int              y;
+    int              i, idx;
+    bucket_t         strip;
+    ri_arena_t      *arena;
+
+    if (render->display_drv->update_bucket) return;
+
+    width  = render->context->option->camera->horizontal_resolution;
+    height = render->context->option->camera->vertical_resolution;
+
+    arena  = render->arenas[0];
+
+    for (y = 0; y < height; y += render->bucket_size) {
+
+        ri_arena_reset(arena);
+
+        memset(&strip, 0, sizeof(bucket_t));
+
+        strip.x = 0;
+        strip.y = y;
+        strip.w = width;
+        strip.h = height - y;
+        if (strip.h > render->bucket_size) strip.h = render->bucket_size;
+
+        strip.pixels = (ri_vector_t *)ri_arena_alloc(arena,
+                         sizeof(ri_vector_t) * strip.w * strip.h, 32);
+
+        for (i = 0; i < strip.w * strip.h; i++) {
+
+            idx = y * width + i;
+
+            ri_vector_scale(strip.pixels[i], gprogressive.radiance[idx],
+                            (ri_float_t)1.0 / gprogressive.nsamples[idx]);
+        }
+
+        bucket_write(&strip, render, arena, 0);
+    }
+}
+
+/*
+ * Progressive rendering. The first pass takes 1 sample per pixel, and the
+ * following passes refine unconverged pixels. Each pass overwrites its
+ * buckets in the display driver. Stops when every pixel reached the sample
+ * cap or the target noise level, or the time budget is used up.
+ */
+static void
+render_progressive(
+    ri_render_t         *render,
+    ri_thread_t         *threads,
+    render_thread_t     *thread_tls,
+    int                  nthreads)
+{
+    double           elapsed;
+
+    while (1) {
+
+        gprogressive.nactive = 0;
+
+        render_pass(threads, thread_tls, nthreads);
+
+        gprogressive.nsamples_prev += gscheduler.nsamples_done;
+
+        elapsed = ri_timer_elapsed_current(render->context->timer,
+                                           "Render frame");
+
+        printf("\n");
+        ri_log(LOG_INFO, "(Render) Pass %d: %.2f samples/pixel, "
+               "%d pixels unconverged, %.2f sec",
+               gprogressive.pass,
+               gprogressive.nsamples_prev / (double)gscheduler.npixels,
+               gprogressive.nactive,
+               elapsed);
+
+        if (gscheduler.stop) {
+            ri_log(LOG_INFO, "(Render) Time budget exceeded. "
+                   "Pass %d is aborted.", gprogressive.pass);
+            break;
+        }
+
+        if (gprogressive.nactive == 0) break;
+
+        if ((gprogressive.time_budget > 0.0) &&
+            (elapsed >= gprogressive.time_budget)) {
+            ri_log(LOG_INFO, "(Render) Time budget exceeded.");
+            break;
+        }
+
+        /*
+         * Double the number of samples in each pass, up to
+         * PROGRESSIVE_MAX_PASS_SAMPLES per pixel.
+         */
+        if (gprogressive.pass > 0) {
+            gprogressive.nsamples_pass *= 2;
+        }
+        if (gprogressive.nsamples_pass > PROGRESSIVE_MAX_PASS_SAMPLES) {
+            gprogressive.nsamples_pass = PROGRESSIVE_MAX_PASS_SAMPLES;
+        }
+        gprogressive.pass++;
+
+        /*
+         * Save the state to resume from the next pass.
+         */
+        if (gcheckpoint && ri_checkpoint_due(gcheckpoint)) {
+            ri_checkpoint_put_progressive(gcheckpoint,
+                                          gprogressive.pass,
+                                          gprogressive.nsamples_pass,
+                                          gprogressive.nsamples_prev,
+                                          gprogressive.radiance,
+                                          gprogressive.lumsum,
+                                          gprogressive.lumsqsum,
+                                          gprogressive.nsamples);
+        }
+
+        free_bucket_list(&gscheduler);
+        create_bucket_list(render, &gscheduler);
+    }
+
+    progressive_write_frame(render);
+}
+
+/* ---------------------------------------------------------------------------
+ *
+ * Distributed rendering
+ *
+ * Task 0 renders nothing. It deals buckets of its scheduler to workers on
+ * request, and writes tiles returned from workers to the display driver.
+ * Threads of a worker request buckets one by one, so a faster task simply
+ * requests more. Progressive rendering is not distributed.
+ *
+ * ------------------------------------------------------------------------ */
+
+static void
+dist_setup(
+    const ri_render_t   *render)
+{
+    int              taskid;
+
+    memset(&gdist, 0, sizeof(distributed_t));
+
+    gdist.ntasks = ri_parallel_ntasks();
+    taskid       = ri_parallel_taskid();
+
+    if (gdist.ntasks < 2) {
+        gdist.role = DIST_NONE;
+        return;
+    }
+
+    if (render->context->option->do_progressive) {
+
+        if (taskid == 0) {
+            ri_log(LOG_WARN, "(Render) Progressive rendering is not "
+                   "distributed. Task 0 renders the whole frame.");
+            gdist.role = DIST_NONE;
+        } else {
+            gdist.role = DIST_IDLE;
+        }
+
+        return;
+    }
+
+    gdist.role  = (taskid == 0) ? DIST_MASTER : DIST_WORKER;
+
+    gdist.mutex = ri_mutex_new();
+    ri_mutex_init(gdist.mutex);
+
+    if (taskid == 0) {
+        ri_log(LOG_INFO, "(Render) Distributed rendering with %d workers",
+               gdist.ntasks - 1);
+    }
+}
+
+static void
+dist_free()
+{
+    if (gdist.mutex) ri_mutex_free(gdist.mutex);
+
+    memset(&gdist, 0, sizeof(distributed_t));
+}
+
+/*
+ * Asks the master for the next bucket. Returns 0 if no bucket is left.
+ */
+static int
+dist_next_bucket(
+    bucket_t            *bucket)        /* [out] */
+{
+    int                   dummy = 0;
+    dist_region_t         region;
+    ri_parallel_status_t  status;
+
+    ri_mutex_lock(gdist.mutex);
+
+    if (gdist.finished) {
+        ri_mutex_unlock(gdist.mutex);
+        return 0;
+    }
+
+    ri_parallel_send(&dummy, sizeof(int), 0, DIST_TAG_REQUEST);
+    ri_parallel_recv(&region, sizeof(dist_region_t), 0, DIST_TAG_BUCKET,
+                     &status);
+
+    if (region.w == 0) gdist.finished = 1;
+
+    ri_mutex_unlock(gdist.mutex);
+
+    if (region.w == 0) return 0;
+
+    memset(bucket, 0, sizeof(bucket_t));
+
+    bucket->x = region.x;
+    bucket->y = region.y;
+    bucket->w = region.w;
+    bucket->h = region.h;
+
+    return 1;
+}
+
+/*
+ * Gets the next bucket for the render thread, from the master if this task
+ * is a worker, or from the local scheduler.
+ */
+static int
+fetch_bucket(
+    render_thread_t     *info,
+    bucket_t           **bucket)        /* [out] */
+{
+    int64_t          bucket_id;
+
+    if (gdist.role == DIST_WORKER) {
+
+        if (!dist_next_bucket(&info->remote_bucket)) return 0;
+
+        (*bucket) = &info->remote_bucket;
+
+        return 1;
+    }
+
+    if (!next_bucket(&gscheduler, info->thread_id, &bucket_id)) return 0;
+
+    (*bucket) = &gscheduler.buckets[bucket_id];
+
+    split_bucket(&gscheduler, info->thread_id, (*bucket));
+
+    return 1;
+}
+
+/*
+ * Sends the rendered bucket to the master.
+ */
+static void
+dist_send_tile(
+    const bucket_t      *bucket,
+    ri_arena_t          *arena)
+{
+    int              i;
+    size_t           size;
+    dist_tile_t     *tile;
+    float           *rgb;
+
+    size = sizeof(dist_tile_t) + sizeof(float) * 3 * bucket->w * bucket->h;
+
+    tile = (dist_tile_t *)ri_arena_alloc(arena, size, RI_MEM_DEFAULT_ALIGN);
+
+    tile->region.x = bucket->x;
+    tile->region.y = bucket->y;
+    tile->region.w = bucket->w;
+    tile->region.h = bucket->h;
+    tile->nsamples = bucket->nsamples;
+
+    rgb = (float *)(tile + 1);
+
+    for (i = 0; i < bucket->w * bucket->h; i++) {
+        rgb[3 * i + 0] = (float)bucket->pixels[i][0];
+        rgb[3 * i + 1] = (float)bucket->pixels[i][1];
+        rgb[3 * i + 2] = (float)bucket->pixels[i][2];
+    }
+
+    ri_mutex_lock(gdist.mutex);
+
+    ri_parallel_send(tile, size, 0, DIST_TAG_TILE);
+
+    ri_mutex_unlock(gdist.mutex);
+}
+
+/*
+ * Takes a bucket out of the scheduler of the master. The master is single
+ * threaded and the only consumer, so buckets are popped from all deques in
+ * turn. Deques are filled in reverse so that pop follows bucket_order
+ * (see create_bucket_list()), while steal would return them backwards.
+ */
+static int
+dist_pop_bucket(
+    bucket_scheduler_t  *scheduler,
+    int                 *next,          /* [inout] deque to take from */
+    int64_t             *bucket_id)     /* [out] */
+{
+    int              i;
+    int              victim;
+
+    for (i = 0; i < scheduler->nthreads; i++) {
+
+        victim = *next;
+        *next  = (*next + 1) % scheduler->nthreads;
+
+        if (ri_ws_deque_pop(scheduler->deques[victim], bucket_id) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Deals buckets to workers and collects their tiles until the whole frame
+ * is rendered and all workers are told to finish.
+ */
+static void
+dist_master(
+    ri_render_t         *render)
+{
+    int                   i;
+    int                   source;
+    int                   nfinished;
+    int                   next;
+    int64_t               bucket_id;
+    size_t                maxsize;
+    char                 *msg;
+    float                *rgb;
+    bucket_t             *bucket;
+    bucket_t              tile_bucket;
+    dist_tile_t          *tile;
+    dist_region_t         region;
+    ri_arena_t           *arena;
+    ri_parallel_status_t  status;
+
+    maxsize = sizeof(dist_tile_t) +
+              sizeof(float) * 3 * render->bucket_size * render->bucket_size;
+
+    msg   = (char *)ri_mem_alloc(maxsize);
+    arena = render->arenas[0];
+
+    nfinished = 0;
+    next      = 0;
+
+    while ((nfinished < gdist.ntasks - 1) ||
+           (gscheduler.npixels_done < gscheduler.npixels)) {
+
+        ri_parallel_recv(msg, maxsize,
+                         RI_PARALLEL_ANY_SOURCE, RI_PARALLEL_ANY_TAG,
+                         &status);
+
+        source = ri_parallel_status_source(&status);
+
+        if (ri_parallel_status_tag(&status) == DIST_TAG_REQUEST) {
+
+            if (dist_pop_bucket(&gscheduler, &next, &bucket_id)) {
+
+                bucket   = &gscheduler.buckets[bucket_id];
+
+                region.x = bucket->x;
+                region.y = bucket->y;
+                region.w = bucket->w;
+                region.h = bucket->h;
+
+            } else {
+
+                memset(&region, 0, sizeof(dist_region_t));
+                nfinished++;
+
+            }
+
+            ri_parallel_send(&region, sizeof(dist_region_t), source,
+                             DIST_TAG_BUCKET);
+
+        } else if (ri_parallel_status_tag(&status) == DIST_TAG_TILE) {
+
+            tile = (dist_tile_t *)msg;
+            rgb  = (float *)(tile + 1);
+
+            ri_arena_reset(arena);
+
+            memset(&tile_bucket, 0, sizeof(bucket_t));
+
+            tile_bucket.x        = tile->region.x;
+            tile_bucket.y        = tile->region.y;
+            tile_bucket.w        = tile->region.w;
+            tile_bucket.h        = tile->region.h;
+            tile_bucket.nsamples = tile->nsamples;
+            tile_bucket.pixels   = (ri_vector_t *)ri_arena_alloc(arena,
+                                     sizeof(ri_vector_t) *
+                                     tile_bucket.w * tile_bucket.h, 32);
+
+            for (i = 0; i < tile_bucket.w * tile_bucket.h; i++) {
+                tile_bucket.pixels[i][0] = rgb[3 * i + 0];
+                tile_bucket.pixels[i][1] = rgb[3 * i + 1];
+                tile_bucket.pixels[i][2] = rgb[3 * i + 2];
+                tile_bucket.pixels[i][3] = 1.0;
+            }
+
+            bucket_write(&tile_bucket, render, arena, 0);
+
+            if (gcheckpoint) {
+                ri_checkpoint_put_region(gcheckpoint,
+                                         tile_bucket.x, tile_bucket.y,
+                                         tile_bucket.w, tile_bucket.h,
+                                         tile_bucket.pixels);
+
+                if (ri_checkpoint_due(gcheckpoint)) {
+                    ri_checkpoint_request(gcheckpoint);
+                }
+            }
+
+            gscheduler.nsamples_done += tile_bucket.nsamples;
+            gscheduler.npixels_done  += tile_bucket.w * tile_bucket.h;
+
+            show_progress();
+
+        } else {
+
+            ri_log(LOG_WARN, "(Render) Unknown message %d from task %d",
+                   ri_parallel_status_tag(&status), source);
+
+        }
+    }
+
+    ri_mem_free(msg);
+}
+
+/*
+ * Builds the signature of the frame to tell whether a checkpoint file was
+ * saved for this frame. Sample budgets of progressive rendering are not
+ * included, so they can be changed when resuming.
+ */
+static uint64_t
+checkpoint_signature(
+    const ri_render_t   *render)
+{
+    int              ngeoms;
+    uint64_t         h;
+    ri_list_t       *itr;
+    ri_option_t     *option;
+    ri_camera_t     *camera;
+    ri_display_t    *disp;
+
+    option = render->context->option;
+    camera = option->camera;
+    disp   = ri_option_get_curr_display(option);
+
+    ngeoms = 0;
+    for (itr  = ri_list_first(render->scene->geom_list);
+         itr != NULL;
+         itr  = ri_list_next(itr)) {
+        ngeoms++;
+    }
+
+    /* Instances count as geoms. */
+    for (itr  = ri_list_first(render->scene->instance_list);
+         itr != NULL;
+         itr  = ri_list_next(itr)) {
+        ngeoms++;
+    }
+
+    h = RI_CHECKPOINT_HASH_INIT;
+
+    h = ri_checkpoint_hash(h, &camera->horizontal_resolution, sizeof(RtInt));
+    h = ri_checkpoint_hash(h, &camera->vertical_resolution, sizeof(RtInt));
+    h = ri_checkpoint_hash(h, camera->screen_window, sizeof(RtFloat) * 4);
+    h = ri_checkpoint_hash(h, &camera->fov, sizeof(RtFloat));
+    h = ri_checkpoint_hash(h, &camera->world_to_camera, sizeof(ri_matrix_t));
+
+    h = ri_checkpoint_hash(h, disp->sampling_rates, sizeof(RtFloat) * 2);
+    h = ri_checkpoint_hash(h, &option->adaptive_threshold, sizeof(float));
+    h = ri_checkpoint_hash(h, &option->adaptive_max_samples, sizeof(int));
+    h = ri_checkpoint_hash(h, &option->enable_irradcache, sizeof(int));
+    h = ri_checkpoint_hash(h, &option->irradcache_error, sizeof(double));
+    h = ri_checkpoint_hash(h, &option->enable_indirect_lighting, sizeof(int));
+    h = ri_checkpoint_hash(h, &option->enable_caustics_lighting, sizeof(int));
+    h = ri_checkpoint_hash(h, &option->photon_nglobal, sizeof(int));
+    h = ri_checkpoint_hash(h, &option->photon_ncaustics, sizeof(int));
+
+    h = ri_checkpoint_hash(h, &ngeoms, sizeof(int));
+    h = ri_checkpoint_hash(h, render->scene->bmin, sizeof(ri_float_t) * 3);
+    h = ri_checkpoint_hash(h, render->scene->bmax, sizeof(ri_float_t) * 3);
+
+    return h;
+}
+
+/*
+ * Creates the checkpoint if requested, and loads the previous one.
+ */
+static void
+checkpoint_setup(
+    ri_render_t         *render)
+{
+    ri_option_t     *option;
+    ri_camera_t     *camera;
+
+    option = render->context->option;
+    camera = option->camera;
+
+    gcheckpoint = NULL;
+
+    if (option->checkpoint_file == NULL) return;
+    if (ri_parallel_taskid() != 0) return;
+
+    gcheckpoint = ri_checkpoint_new(option->checkpoint_file,
+                                    camera->horizontal_resolution,
+                                    camera->vertical_resolution,
+                                    checkpoint_signature(render),
+                                    option->do_progressive,
+                                    option->checkpoint_interval);
+
+    if (ri_checkpoint_load(gcheckpoint)) {
+        ri_log(LOG_INFO, "(Render) Resuming from checkpoint \"%s\"",
+               option->checkpoint_file);
+    }
+}
+
+/*
+ * Restores the frame from the checkpoint. Pixels of buckets skipped by
+ * create_bucket_list() are written to the display driver. In progressive
+ * mode, the accumulation state is restored and rendering continues from
+ * the next pass.
+ */
+static void
+checkpoint_restore(
+    ri_render_t         *render)
+{
+    int              i, u, v;
+    int              idx;
+    int              width;
+    bucket_t        *bucket;
+    ri_arena_t      *arena;
+    const float     *src;
+
+    if (gcheckpoint == NULL) return;
+
+    if (gprogressive.enabled) {
+
+        if (gcheckpoint->header.pass < 0) return;
+
+        ri_checkpoint_get_progressive(gcheckpoint,
+                                      gprogressive.radiance,
+                                      gprogressive.lumsum,
+                                      gprogressive.lumsqsum,
+                                      gprogressive.nsamples);
+
+        gprogressive.pass          = gcheckpoint->header.pass;
+        gprogressive.nsamples_pass = gcheckpoint->header.nsamples_pass;
+        gprogressive.nsamples_prev = gcheckpoint->header.nsamples_total;
+
+        ri_log(LOG_INFO, "(Render) Continue from pass %d, %.2f samples/pixel",
+               gprogressive.pass,
+               gprogressive.nsamples_prev / (double)gscheduler.npixels);
+
+        return;
+    }
+
+    if (gscheduler.npixels_restored == 0) return;
+
+    width = render->context->option->camera->horizontal_resolution;
+    arena = render->arenas[0];
+
+    for (i = 0; i < gscheduler.nbuckets; i++) {
+
+        bucket = &gscheduler.buckets[i];
+
+        if (!bucket->rendered) continue;
+
+        ri_arena_reset(arena);
+
+        bucket->pixels = (ri_vector_t *)ri_arena_alloc(arena,
+                            sizeof(ri_vector_t) * bucket->w * bucket->h, 32);
+
+        for (v = 0; v < bucket->h; v++) {
+            for (u = 0; u < bucket->w; u++) {
+
+                idx = (bucket->y + v) * width + (bucket->x + u);
+                src = &gcheckpoint->pixels[3 * idx];
+
+                bucket->pixels[v * bucket->w + u][0] = src[0];
+                bucket->pixels[v * bucket->w + u][1] = src[1];
+                bucket->pixels[v * bucket->w + u][2] = src[2];
+                bucket->pixels[v * bucket->w + u][3] = 1.0;
+            }
+        }
+
+        bucket_write(bucket, render, arena, 0);
+    }
+
+    ri_log(LOG_INFO, "(Render) %d of %d pixels are restored from checkpoint",
+           gscheduler.npixels_restored, gscheduler.npixels);
+}
+
+/*
+ * Creates the irradiance cache if requested. The master of distributed
+ * rendering doesn't shade, thus doesn't need it.
+ */
+static void
+irradcache_setup(
+    ri_render_t         *render)
+{
+    ri_float_t       rmin, rmax;
+    ri_option_t     *option;
+    ri_scene_t      *scene;
+
+    option = render->context->option;
+    scene  = render->scene;
+
+    render->irradcache = NULL;
+
+    if (!option->enable_irradcache) return;
+    if (gdist.role == DIST_MASTER || gdist.role == DIST_IDLE) return;
+
+    if (option->irradcache_max_radius > 0.0) {
+        rmax = option->irradcache_max_radius;
+    } else {
+        rmax = IRRADCACHE_MAX_RADIUS_SCALE * scene->maxwidth;
+    }
+    rmin = IRRADCACHE_MIN_RADIUS_RATIO * rmax;
+
+    render->irradcache = ri_irradcache_new(scene->bmin, scene->bmax,
+                                           option->irradcache_error,
+                                           rmin, rmax);
+
+    ri_log(LOG_INFO, "(Render) Irradiance cache: error = %f, "
+           "radius = [%f, %f]", option->irradcache_error, rmin, rmax);
+}
+
+static void
+irradcache_free(
+    ri_render_t         *render)
+{
+    ri_option_t     *option;
+
+    option = render->context->option;
+
+    if (render->irradcache == NULL) return;
+
+    /*
+     * Each task has its own cache. Records are saved in a single task only.
+     */
+    if (option->irradcache_file && gdist.role == DIST_NONE) {
+        ri_irradcache_dump(render->irradcache, option->irradcache_file);
+    }
+
+    ri_irradcache_free(render->irradcache);
+    render->irradcache = NULL;
+}
+
+static void *
+irradcache_prepass_thread_func(void *arg)
+{
+    int                     x, y;
+    int                     step;
+    int                     width, height;
+    int                     hit;
+    ri_float_t              jitter[2];
+    ri_ray_t                ray;
+    ri_intersection_state_t state;
+    ri_transport_info_t     result;
+    ri_option_t            *option;
+    ri_camera_t            *camera;
+    render_thread_t        *info;
+
+    info = (render_thread_t *)arg;
+
+    ri_prof_set_thread(info->thread_id);
+
+    option = ri_render_get()->context->option;
+    camera = option->camera;
+    width  = camera->horizontal_resolution;
+    height = camera->vertical_resolution;
+    step   = option->irradcache_prepass;
+
+    jitter[0] = 0.5;
+    jitter[1] = 0.5;
+
+    /*
+     * Threads take rows of the sparse grid in turn.
+     */
+    for (y = step / 2 + info->thread_id * step; y < height;
+         y += step * gscheduler.nthreads) {
+
+        for (x = step / 2; x < width; x += step) {
+
+            /* One sample per pixel. */
+            gen_camera_ray(&ray, camera, x, y, jitter, 1.0,
+                           (unsigned int)(y * width + x), info->thread_id);
+
+            hit = ri_raytrace(ri_render_get(), &ray, &state);
+
+            /* Only the records made in shading are needed. */
+            shade_sample(&ray, hit, &state, &result);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Fills the irradiance cache by shading a sparse grid of pixels, so that
+ * the main pass mostly interpolates records, and records are evenly placed
+ * regardless of the order of buckets.
+ */
+static void
+irradcache_prepass(
+    ri_render_t         *render,
+    ri_thread_t         *threads,
+    render_thread_t     *thread_tls,
+    int                  nthreads)
+{
+    int i;
+
+    if (render->irradcache == NULL) return;
+    if (render->context->option->irradcache_prepass <= 0) return;
+
+    for (i = 0; i < nthreads; i++) {
+
+        thread_tls[i].thread_id = i;
+
+        ri_thread_create(&threads[i], irradcache_prepass_thread_func,
+                         &thread_tls[i]);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        ri_thread_join(&threads[i]);
+    }
+
+    ri_log(LOG_INFO, "(Render) Irradiance cache prepass: %d records",
+           render->irradcache->nrecords);
+}
+
+/*
+ * Builds photon maps if indirect lighting(global map) or caustics
+ * lighting(caustic map) is enabled. If the file of a map exists, the map is
+ * loaded instead of traced, so that frames of a static scene share photons.
+ * Otherwise the traced map is saved to the file.
+ */
+static void
+photonmap_setup(
+    ri_render_t         *render)
+{
+    int              nglobal, ncaustics;
+    ri_photonmap_t  *global, *caustic;
+    ri_option_t     *option;
+
+    option = render->context->option;
+
+    render->global_photonmap  = NULL;
+    render->caustic_photonmap = NULL;
+
+    if (gdist.role == DIST_MASTER || gdist.role == DIST_IDLE) return;
+
+    nglobal   = option->enable_indirect_lighting ? option->photon_nglobal   : 0;
+    ncaustics = option->enable_caustics_lighting ? option->photon_ncaustics : 0;
+
+    if (nglobal > 0 && option->photon_globalmap_file) {
+        render->global_photonmap =
+            ri_photonmap_load(option->photon_globalmap_file);
+        if (render->global_photonmap) nglobal = 0;
+    }
+
+    if (ncaustics > 0 && option->photon_causticmap_file) {
+        render->caustic_photonmap =
+            ri_photonmap_load(option->photon_causticmap_file);
+        if (render->caustic_photonmap) ncaustics = 0;
+    }
+
+    if (nglobal > 0 || ncaustics > 0) {
+
+        ri_timer_start(render->context->timer, "Photon tracing");
+
+        ri_photontrace(render, &global, &caustic, nglobal, ncaustics,
+                       render->nthreads);
+
+        ri_timer_end(render->context->timer, "Photon tracing");
+
+        /*
+         * Each task traces its own photons. Maps are saved in a single
+         * task only.
+         */
+        if (global) {
+            render->global_photonmap = global;
+            if (option->photon_globalmap_file && gdist.role == DIST_NONE) {
+                ri_photonmap_save(global, option->photon_globalmap_file);
+            }
+        }
+
+        if (caustic) {
+            render->caustic_photonmap = caustic;
+            if (option->photon_causticmap_file && gdist.role == DIST_NONE) {
+                ri_photonmap_save(caustic, option->photon_causticmap_file);
+            }
+        }
+    }
+
+    if (render->global_photonmap && option->photon_dump_file &&
+        gdist.role == DIST_NONE) {
+        ri_photonmap_dump(render->global_photonmap, option->photon_dump_file);
+    }
+}
+
+static void
+photonmap_free(
+    ri_render_t         *render)
+{
+    ri_photonmap_free(render->global_photonmap);
+    ri_photonmap_free(render->caustic_photonmap);
+
+    render->global_photonmap  = NULL;
+    render->caustic_photonmap = NULL;
+}
+
+void
+render_frame_controller(ri_render_t *render)
+{
+    int i;
+    int nthreads;
+    int npixels;
+    ri_thread_t *threads;
+
+    render_thread_t *thread_tls;
+    ri_mem_stat_t    mem_stat_begin;
+    ri_mem_stat_t    mem_stat_end;
+    ri_prof_result_t prof;
+    ri_option_t     *option;
+    uint64_t         ntexlookups, ntexloads;
+    size_t           texbytes;
+
+    option     = render->context->option;
+
+    nthreads   = render->nthreads;
+
+    if (nthreads == 0) nthreads = 1;
+
+    threads    = (ri_thread_t *)ri_mem_alloc( sizeof(ri_thread_t) * nthreads);
+    thread_tls = (render_thread_t *)ri_mem_alloc(
+                    sizeof(render_thread_t) * nthreads);
+
+    for (i = 0; i < nthreads; i++) {
+        render->arenas[i] = ri_arena_new(RENDER_ARENA_SIZE);
+    }
+
+    npixels = gscheduler.npixels;
+
+    /*
+     * Workers don't send sample counts, so the AOV is available only in
+     * a single task.
+     */
+    if (option->adaptive_aov_file && gdist.role == DIST_NONE) {
+        gaov_nsamples = (float *)ri_mem_alloc(sizeof(float) * 4 * npixels);
+        memset(gaov_nsamples, 0, sizeof(float) * 4 * npixels);
+    }
+
+    progressive_setup(render);
+
+    checkpoint_restore(render);
+
+    ri_mem_get_stat(&mem_stat_begin);
+
+    ri_prof_reset();
+
+    irradcache_prepass(render, threads, thread_tls, nthreads);
+
+    if (gdist.role == DIST_MASTER) {
+
+        dist_master(render);
+
+    } else if (gdist.role == DIST_IDLE) {
+
+        /* Task 0 renders the frame. */
+
+    } else if (gprogressive.enabled) {
+
+        render_progressive(render, threads, thread_tls, nthreads);
+
+    } else {
+
+        render_pass(threads, thread_tls, nthreads);
+
+        assert((gdist.role == DIST_WORKER) ||
+               (gscheduler.npixels_done == gscheduler.npixels));
+
+    }
+
+    ri_mem_get_stat(&mem_stat_end);
+
+    /*
+     * Merge per thread profile counters into the raytracing statistics.
+     */
+    ri_prof_merge(&prof);
+
+    render->stat.nrays      += prof.counters[RI_PROF_NRAYS]
+                             + prof.counters[RI_PROF_NSHADOW_RAYS]
+                             + prof.counters[RI_PROF_NPACKET_RAYS]
+                             + prof.counters[RI_PROF_NPACKET_SHADOW_RAYS];
+    render->stat.ntesttris  += prof.counters[RI_PROF_NTRIANGLE_TESTS];
+    render->stat.ngridtravs += prof.counters[RI_PROF_NINNER_NODES]
+                             + prof.counters[RI_PROF_NLEAF_NODES];
+
+    /*
+     * Record allocation statistics. Heap allocations made by arenas to grow
+     * are counted in both nheap_allocs and narena_grows.
+     */
+    render->stat.nheap_allocs += mem_stat_end.nallocs -
+                                 mem_stat_begin.nallocs;
+
+    for (i = 0; i < nthreads; i++) {
+
+        render->stat.narena_allocs += render->arenas[i]->nallocs;
+        render->stat.narena_grows  += render->arenas[i]->nheap_allocs - 1;
+        if (render->arenas[i]->peak > render->stat.arena_peak) {
+            render->stat.arena_peak = render->arenas[i]->peak;
+        }
+
+        ri_arena_free(render->arenas[i]);
+        render->arenas[i] = NULL;
+    }
+
+    if (gdist.role == DIST_WORKER || gdist.role == DIST_IDLE) {
+        /* Statistics of the frame are shown by task 0. */
+    } else if (gprogressive.enabled) {
+        ri_log(LOG_INFO, "(Render) Progressive rendering: %.2f samples/pixel "
+               "in %d passes",
+               gprogressive.nsamples_prev / (double)npixels,
+               gprogressive.pass + 1);
+    } else if (option->adaptive_max_samples > 0) {
+        ri_log(LOG_INFO, "(Render) Adaptive sampling: %.2f samples/pixel",
+               gscheduler.nsamples_done / (double)npixels);
+    }
+
+    if (render->irradcache) {
+        ri_log(LOG_INFO, "(Render) Irradiance cache: %d records, "
+               "%llu of %llu lookups interpolated",
+               render->irradcache->nrecords,
+               (unsigned long long)prof.counters[RI_PROF_NIRRADCACHE_HITS],
+               (unsigned long long)prof.counters[RI_PROF_NIRRADCACHE_LOOKUPS]);
+    }
+
+    if (ri_texcache_stat(&ntexlookups, &ntexloads, &texbytes) == 0) {
+        ri_log(LOG_INFO, "(Render) Texture cache: %llu tiles loaded "
+               "in %llu lookups, %.1f MB used",
+               (unsigned long long)ntexloads,
+               (unsigned long long)ntexlookups,
+               texbytes / (1024.0 * 1024.0));
+    }
+
+    irradcache_free(render);
+
+    photonmap_free(render);
+
+    /*
+     * Save the sample count AOV.
+     */
+    if (gaov_nsamples) {
+        ri_log(LOG_INFO, "(Render) Saving sample count AOV to \"%s\"",
+               option->adaptive_aov_file);
+        ri_image_save_hdr(option->adaptive_aov_file,
+                          gaov_nsamples,
+                          option->camera->horizontal_resolution,
+                          option->camera->vertical_resolution);
+
+        ri_mem_free(gaov_nsamples);
+        gaov_nsamples = NULL;
+    }
+
+    progressive_free();
+
+    /*
+     * The frame is complete. The checkpoint is no longer needed.
+     */
+    if (gcheckpoint) {
+        ri_checkpoint_finish(gcheckpoint, 1);
+        ri_checkpoint_free(gcheckpoint);
+        gcheckpoint = NULL;
+    }
+
+    dist_free();
+
+    free_bucket_list(&gscheduler);
+
+    ri_mem_free(threads);
+    ri_mem_free(thread_tls);
+}
+
+/*
+ * Show memory allocation statistics of the render loop.
+ */
+static void
+alloc_statistics(
+    const ri_render_t *render )
+{
+    unsigned long long nheap_allocs;
+
+    nheap_allocs = render->stat.nheap_allocs - render->stat.narena_grows;
+
+    printf( "\n" );
+    printf( "/= Allocation statistics =================="
+        "====================================\n" );
+    printf( "|\n" );
+    printf( "| %-48s:  %20llu\n", "Arena allocations",
+            render->stat.narena_allocs );
+    printf( "| %-48s:  %20llu\n", "Arena growths",
+            render->stat.narena_grows );
+    printf( "| %-48s:  %20llu\n", "Arena peak usage(bytes)",
+            render->stat.arena_peak );
+    printf( "| %-48s:  %20llu\n", "Heap allocations(except arena growths)",
+            nheap_allocs );
+    printf( "|\n" );
+    printf(
+        "\\------------------------------------------------------------------------------\n" );
+    fflush( stdout );
+}
+
+void
+render_frame_cleanup(ri_render_t *render)
+{
+    char              message[1024];
+
+    int               my_id;
+    time_t            tm;
+    ri_prof_result_t  prof;
+
+    assert(render != NULL);
+
+    my_id = ri_parallel_taskid();
+        
+    if ( my_id == 0 ) {
+        printf( "\n" );
+        ri_raytrace_statistics(  );
+
+        alloc_statistics( render );
+
+        ri_prof_merge( &prof );
+        ri_prof_report( &prof );
+
+        ri_shade_statistics(  );
+    }
+
+    assert(render->context);
+    assert(render->context->timer);
+
+    ri_timer_start( render->context->timer, "Clean up" );
+
+    /* The scene is kept for the next frame(see ri_scene_begin_frame()). */
 
     ri_timer_end( render->context->timer, "Clean up" );
     ri_timer_end( render->context->timer,
@@ -24,6 +24,8 @@
 #include "display.h"
 #include "scene.h"
 #include "debugger.h"
+#include "irradcache.h"
+#include "photonmap.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -36,6 +38,7 @@ extern "C" {
 #define BUCKET_ORDER_SPIRAL          0
 #define BUCKET_ORDER_SCANLINE        1
 #define BUCKET_ORDER_HILBERT         2
+#define BUCKET_ORDER_ZORDER          3
 
 typedef struct _ri_statistic_t
 {
@@ -44,6 +47,12 @@ typedef struct _ri_statistic_t
     unsigned long long ntesttris;
     unsigned long long nrays;
     unsigned long long nmailboxhits;
+
+    /* memory allocation statistics of the render loop */
+    unsigned long long nheap_allocs;    /* ri_mem_alloc*() calls          */
+    unsigned long long narena_allocs;   /* allocations from arenas        */
+    unsigned long long narena_grows;    /* heap allocations by arenas     */
+    unsigned long long arena_peak;      /* max bytes used by an arena     */
 } ri_statistic_t;
 
 typedef struct _ri_render_t
@@ -57,6 +66,8 @@ typedef struct _ri_render_t
 
     ri_display_drv_t   *display_drv;        /* currently selected
                                              * display driver               */
+    int                 display_float;      /* pass float pixels to the
+                                             * display driver?              */
 
     ri_statistic_t      stat;               /* statistics for rendering     */
 
@@ -87,10 +98,10 @@ typedef struct _ri_render_t
     ri_scene_t         *scene;
 
     /*
-     * Render bucket info and queue data.
+     * Render bucket info. bucket_order is the order in which buckets are
+     * dealt to threads.
      */
     int                 bucket_size;
-    ri_mt_queue_t      *bucket_queue;
     int                 nbuckets;
     int                 bucket_order;    
 
@@ -99,6 +110,22 @@ typedef struct _ri_render_t
      */
     int                 nthreads;
 
+    /*
+     * Per-thread scratch memory. Reset at the beginning of each bucket.
+     */
+    ri_arena_t         *arenas[RI_MAX_THREADS];
+
+    /*
+     * Irradiance cache of the frame. NULL if not enabled.
+     */
+    ri_irradcache_t    *irradcache;
+
+    /*
+     * Photon maps of the frame. NULL if not enabled.
+     */
+    ri_photonmap_t     *global_photonmap;
+    ri_photonmap_t     *caustic_photonmap;
+
 } ri_render_t;
 
 extern void         ri_render_init();    /* should be called in RiBegin() */
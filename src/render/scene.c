@@ -3,6 +3,7 @@
 #endif
 
 #include <assert.h>
+#include <string.h>
 
 #include "scene.h"
 #include "memory.h"
@@ -11,17 +12,35 @@
 #include "log.h"
 #include "geom.h"
 #include "render.h"
+#include "ibl.h"
 
 /*
  * Predefined accelerator.
  */
 #include "ugrid.h"
 #include "bvh.h"
-
+#include "instance.h"
+#include "motionbvh.h"
+
+static void free_geoms(ri_list_t *geom_list);
+static void free_lights(ri_list_t *light_list);
+static void free_instances(ri_scene_t *scene);
+static void add_instance_bbox(const ri_list_t *instance_list,
+                              ri_vector_t      bmin,
+                              ri_vector_t      bmax,
+                              ri_float_t      *maxwidth);
 static void calc_scene_bbox(const ri_list_t *geom_list,
                             ri_vector_t      bmin,
                             ri_vector_t      bmax,
                             ri_float_t      *maxwidth);
+static int  has_motion(const ri_list_t *geom_list);
+static void get_modelview(ri_matrix_t       *om_out,
+                          const ri_matrix_t *m);
+static int  get_close_xform(ri_matrix_t *xform_out);
+static void set_xform_motion(ri_scene_t *scene,
+                             ri_geom_t  *geom);
+static void set_deform_motion(ri_scene_t      *scene,
+                              const ri_geom_t *last);
 
 /* ---------------------------------------------------------------------------
  *
@@ -39,6 +58,16 @@ ri_scene_new()
     p->geom_list    = ri_list_new();
     p->light_list   = ri_list_new();
 
+    p->prev_geom_list = NULL;
+    p->nframes        = 0;
+
+    p->object_list   = ri_list_new();
+    p->instance_list = ri_list_new();
+    p->object_block  = NULL;
+
+    p->motion_geom   = NULL;
+    p->motion_blur   = 0;
+
     p->envmap_light = NULL;
     p->sunsky_light = NULL;
 
@@ -50,12 +79,19 @@ ri_scene_new()
 void
 ri_scene_free( ri_scene_t * scene )
 {
-    
     ri_log_and_return_if(scene == NULL);
 
     ri_list_free( scene->geom_list );
     ri_list_free( scene->light_list );
 
+    if ( scene->prev_geom_list ) {
+        free_geoms( scene->prev_geom_list );
+    }
+
+    free_instances( scene );
+    ri_list_free( scene->instance_list );
+    ri_list_free( scene->object_list );
+
     if (scene->envmap_light) {
         ri_light_free(scene->envmap_light);
     }
@@ -75,6 +111,52 @@ ri_scene_free( ri_scene_t * scene )
     ri_mem_free( scene );
 }
 
+/*
+ * Function: ri_scene_begin_frame
+ *
+ *     Clears the scene description of the previous frame, keeping its
+ *     geoms in prev_geom_list for the accel update in ri_scene_setup().
+ *
+ */
+void
+ri_scene_begin_frame( ri_scene_t * scene )
+{
+    assert( scene != NULL );
+
+    if ( scene->nframes == 0 ) {
+        /* Nothing rendered yet. */
+        return;
+    }
+
+    if ( scene->prev_geom_list ) {
+        /* The previous frame was not set up. */
+        free_geoms( scene->prev_geom_list );
+    }
+
+    scene->prev_geom_list = scene->geom_list;
+    scene->geom_list      = ri_list_new();
+
+    /* Lights are defined again in the frame. */
+    free_lights( scene->light_list );
+    scene->light_list = ri_list_new();
+
+    if ( scene->envmap_light ) {
+        ri_light_free( scene->envmap_light );
+    }
+    scene->envmap_light = NULL;
+    scene->sunsky_light = NULL;
+
+    /* So are prototypes and their instances. */
+    free_instances( scene );
+    ri_list_free( scene->instance_list );
+    ri_list_free( scene->object_list );
+    scene->instance_list = ri_list_new();
+    scene->object_list   = ri_list_new();
+    scene->object_block  = NULL;
+
+    scene->motion_geom   = NULL;
+}
+
 /*
  * Function: ri_scene_setup
  *
@@ -84,16 +166,91 @@ ri_scene_free( ri_scene_t * scene )
 void
 ri_scene_setup( ri_scene_t * scene )
 {
+    int method;
+    int updated;
+
     calc_scene_bbox(
         scene->geom_list,
         scene->bmin,
         scene->bmax,
         &scene->maxwidth );
 
-    ri_accel_bind( scene->accel,    
-                   ri_render_get()->context->option->accel_method);
+    add_instance_bbox(
+        scene->instance_list,
+        scene->bmin,
+        scene->bmax,
+        &scene->maxwidth );
+
+    method = ri_render_get()->context->option->accel_method;
+
+    scene->motion_blur = has_motion( scene->geom_list );
+
+    /*
+     * Instances are only supported by the two-level BVH, thus it is used
+     * regardless of the accel method, otherwise instances are dropped.
+     */
+    if ( ri_list_first( scene->instance_list ) != NULL ) {
+        if ( method == RI_ACCEL_BVH ) {
+            ri_log( LOG_INFO, "(Scene ) Scene has instances. Use two-level BVH." );
+        } else {
+            ri_log( LOG_WARN, "(Scene ) Scene has instances, which are only supported by the BVH. Use two-level BVH instead of the specified accel." );
+        }
+        method = RI_ACCEL_BVH_INSTANCE;
+    }
+
+    /*
+     * Moving geoms need the BVH with bounds at shutter open and close.
+     * Others trace them at shutter open.
+     */
+    if ( scene->motion_blur ) {
+
+        if ( method == RI_ACCEL_BVH ) {
+            ri_log( LOG_INFO, "(Scene ) Scene has motion. Use motion BVH." );
+            method = RI_ACCEL_BVH_MOTION;
+        } else {
+            ri_log( LOG_WARN, "(Scene ) Motion blur is only supported by the BVH without instances. Geometries are traced at shutter open." );
+            scene->motion_blur = 0;
+        }
+    }
+
+    updated = 0;
+
+    if ( scene->accel->data != NULL ) {
+
+        /*
+         * The accel of the previous frame. Try to update it for this frame.
+         */
+        if ( ( scene->accel->method == method ) && scene->accel->update ) {
+            updated = ( scene->accel->update( scene->accel->data,
+                                              (const void *)scene ) == 0 );
+        }
+
+        if ( !updated ) {
+            scene->accel->free( scene->accel->data );
+            scene->accel->data = NULL;
+        }
+    }
+
+    if ( !updated ) {
+
+        ri_accel_bind( scene->accel, method );
+
+        scene->accel->data = scene->accel->build((const void *)scene);
 
-    scene->accel->data = scene->accel->build((const void *)scene);
+    }
+
+    /* Now no accel refers geoms of the previous frame. */
+    if ( scene->prev_geom_list ) {
+        free_geoms( scene->prev_geom_list );
+        scene->prev_geom_list = NULL;
+    }
+
+    scene->nframes++;
+
+    /* Precompute the sampling table of the environment map. */
+    if (scene->envmap_light) {
+        ri_ibl_setup(scene->envmap_light);
+    }
 
 }
 
@@ -119,7 +276,43 @@ ri_scene_parse_geom(
 void
 ri_scene_add_geom( ri_scene_t *scene, const ri_geom_t * geom )
 {
-    ri_list_append( scene->geom_list, ( void * ) geom );
+    int           sample;
+    ri_context_t *ctx = ri_render_get()->context;
+
+    if ( ctx->motion_block ) {
+
+        sample = ctx->motion_sample++;
+
+        if ( sample == 0 ) {
+
+            scene->motion_geom = ( ri_geom_t * ) geom;
+
+        } else {
+
+            /* Area light refers the geom of the first sample. */
+            if ( geom->light && scene->motion_geom ) {
+                geom->light->geom = scene->motion_geom;
+                scene->motion_geom->light = geom->light;
+            }
+
+            if ( sample == ctx->motion_nsamples - 1 ) {
+                set_deform_motion( scene, geom );
+                scene->motion_geom = NULL;
+            }
+
+            ri_geom_free( ( ri_geom_t * ) geom );
+
+            return;
+        }
+    }
+
+    set_xform_motion( scene, ( ri_geom_t * ) geom );
+
+    if ( scene->object_block ) {
+        ri_list_append( scene->object_block->geom_list, ( void * ) geom );
+    } else {
+        ri_list_append( scene->geom_list, ( void * ) geom );
+    }
 }
 
 void
@@ -213,6 +406,21 @@ calc_scene_bbox(
             if ( bmax[2] < v[2] ) bmax[2] = v[2];
 
         }
+
+        /* Moving geom covers its positions at shutter close too. */
+        for ( i = 0; geom->positions_close && ( i < geom->npositions ); i++ ) {
+
+            ri_vector_copy(v, geom->positions_close[i]);
+
+            if ( bmin[0] > v[0] ) bmin[0] = v[0];
+            if ( bmin[1] > v[1] ) bmin[1] = v[1];
+            if ( bmin[2] > v[2] ) bmin[2] = v[2];
+
+            if ( bmax[0] < v[0] ) bmax[0] = v[0];
+            if ( bmax[1] < v[1] ) bmax[1] = v[1];
+            if ( bmax[2] < v[2] ) bmax[2] = v[2];
+
+        }
     }
 
     ( *maxwidth ) = bmax[0] - bmin[0];
@@ -225,3 +433,269 @@ calc_scene_bbox(
             ( *maxwidth ) = bmax[2] - bmin[2];
     }
 }
+
+static void
+free_geoms( ri_list_t *geom_list )
+{
+    ri_list_t *itr;
+
+    for ( itr = ri_list_first( geom_list );
+          itr != NULL;
+          itr = ri_list_next( itr ) ) {
+        ri_geom_free( ( ri_geom_t * ) itr->data );
+    }
+
+    ri_list_free( geom_list );
+}
+
+/*
+ * Frees lights and the list. Geoms of area lights are owned by geom lists
+ * of the scene or prototypes, thus they are not freed here.
+ */
+static void
+free_lights( ri_list_t *light_list )
+{
+    ri_list_t  *itr;
+    ri_light_t *light;
+
+    for ( itr = ri_list_first( light_list );
+          itr != NULL;
+          itr = ri_list_next( itr ) ) {
+        light       = ( ri_light_t * ) itr->data;
+        light->geom = NULL;
+        ri_light_free( light );
+    }
+
+    ri_list_free( light_list );
+}
+
+/*
+ * Frees prototypes and instances, but not the lists.
+ */
+static void
+free_instances( ri_scene_t *scene )
+{
+    ri_list_t *itr;
+
+    for ( itr = ri_list_first( scene->instance_list );
+          itr != NULL;
+          itr = ri_list_next( itr ) ) {
+        ri_instance_free( ( ri_instance_t * ) itr->data );
+    }
+
+    for ( itr = ri_list_first( scene->object_list );
+          itr != NULL;
+          itr = ri_list_next( itr ) ) {
+        ri_object_free( ( ri_object_t * ) itr->data );
+    }
+}
+
+/*
+ * Extends the scene bounding box with world space bounds of instances.
+ */
+static void
+add_instance_bbox(
+    const ri_list_t *instance_list,
+    ri_vector_t      bmin,
+    ri_vector_t      bmax,
+    ri_float_t      *maxwidth )
+{
+    int             i;
+    ri_list_t      *itr;
+    ri_instance_t  *instance;
+
+    for ( itr = ri_list_first( (ri_list_t *)instance_list );
+          itr != NULL;
+          itr = ri_list_next( itr ) ) {
+
+        instance = ( ri_instance_t * ) itr->data;
+
+        for ( i = 0; i < 3; i++ ) {
+            if ( bmin[i] > instance->bmin[i] ) bmin[i] = instance->bmin[i];
+            if ( bmax[i] < instance->bmax[i] ) bmax[i] = instance->bmax[i];
+        }
+    }
+
+    for ( i = 0; i < 3; i++ ) {
+        if ( ( *maxwidth ) < ( bmax[i] - bmin[i] ) ) {
+            ( *maxwidth ) = bmax[i] - bmin[i];
+        }
+    }
+}
+
+/*
+ * Returns 1 if some geom moves in the shutter interval.
+ */
+static int
+has_motion( const ri_list_t *geom_list )
+{
+    ri_list_t *itr;
+
+    for ( itr = ri_list_first( (ri_list_t *)geom_list );
+          itr != NULL;
+          itr = ri_list_next( itr ) ) {
+
+        if ( ( ( ri_geom_t * ) itr->data )->positions_close ) return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Modelview used to transform geometries into world space, i.e. the
+ * transformation with the orientation(see ri_polygon_parse()).
+ */
+static void
+get_modelview(
+    ri_matrix_t       *om_out,
+    const ri_matrix_t *m )
+{
+    ri_matrix_t orientation;
+
+    ri_matrix_identity( &orientation );
+    if ( strcmp( ri_render_get()->context->option->orientation, RI_RH ) == 0 ) {
+        orientation.f[2][2] = -orientation.f[2][2];
+    }
+
+    ri_matrix_mul( om_out, m, &orientation );
+}
+
+/*
+ * Computes the transformation which brings positions of a geom, which is
+ * transformed with the current transformation, to the ones at shutter
+ * close. Returns 0 if the geom does not move.
+ */
+static int
+get_close_xform( ri_matrix_t *xform_out )
+{
+    ri_context_t *ctx = ri_render_get()->context;
+    ri_matrix_t  *m;
+    ri_matrix_t  *mclose;
+    ri_matrix_t   om, omclose;
+    ri_matrix_t   invom;
+
+    m      = ( ri_matrix_t * ) ri_stack_get( ctx->trans_stack );
+    mclose = ( ri_matrix_t * ) ri_stack_get( ctx->trans_close_stack );
+
+    if ( ( m == NULL ) || ( mclose == NULL ) ) return 0;
+
+    if ( memcmp( m, mclose, sizeof( ri_matrix_t ) ) == 0 ) return 0;
+
+    get_modelview( &om, m );
+    get_modelview( &omclose, mclose );
+
+    if ( ri_matrix_invert( &invom, &om ) != 0 ) {
+        ri_log( LOG_WARN, "(Scene ) Singular transformation. Motion ignored." );
+        return 0;
+    }
+
+    /* object space -> world space at shutter close */
+    ri_matrix_mul( xform_out, &invom, &omclose );
+
+    return 1;
+}
+
+/*
+ * Transformation motion blur. Sets positions at shutter close from the
+ * transformation at shutter close.
+ */
+static void
+set_xform_motion(
+    ri_scene_t *scene,
+    ri_geom_t  *geom )
+{
+    unsigned int i;
+    ri_matrix_t  xform;
+
+    if ( !get_close_xform( &xform ) ) return;
+
+    if ( scene->object_block ) {
+        ri_log_once( LOG_WARN, "(Scene ) Motion blur of object instances is not supported. Ignored." );
+        return;
+    }
+
+    ri_mem_free( geom->positions_close );
+    geom->positions_close = ( ri_vector_t * ) ri_mem_alloc(
+        sizeof( ri_vector_t ) * geom->npositions );
+
+    for ( i = 0; i < geom->npositions; i++ ) {
+        ri_vector_transform( geom->positions_close[i], geom->positions[i],
+                             &xform );
+    }
+}
+
+/*
+ * Deformation motion blur. `last' is the geom of the last sample in the
+ * motion block, and scene->motion_geom is the one of the first sample.
+ * Positions of the first geom are replaced with the ones at shutter open,
+ * and the ones at shutter close are set.
+ */
+static void
+set_deform_motion(
+    ri_scene_t      *scene,
+    const ri_geom_t *last )
+{
+    int           k;
+    unsigned int  i;
+    int           moving;
+    ri_float_t    wopen, wclose;
+    ri_float_t    p0, p1;
+    ri_vector_t  *close;
+    ri_matrix_t   xform;
+    ri_geom_t    *first = scene->motion_geom;
+    ri_context_t *ctx   = ri_render_get()->context;
+
+    if ( first == NULL ) {
+        ri_log( LOG_WARN, "(Scene ) The first sample of the motion block is not a geometry. Motion ignored." );
+        return;
+    }
+
+    if ( ( first->npositions != last->npositions ) ||
+         ( first->nindices   != last->nindices   ) ) {
+        ri_log( LOG_WARN, "(Scene ) Topology of the motion samples differs. Motion ignored." );
+        return;
+    }
+
+    if ( scene->object_block ) {
+        ri_log_once( LOG_WARN, "(Scene ) Motion blur of object instances is not supported. Ignored." );
+        return;
+    }
+
+    close = ( ri_vector_t * ) ri_mem_alloc(
+        sizeof( ri_vector_t ) * first->npositions );
+
+    /* The last sample under the transformation at shutter close. */
+    if ( get_close_xform( &xform ) ) {
+        for ( i = 0; i < last->npositions; i++ ) {
+            ri_vector_transform( close[i], last->positions[i], &xform );
+        }
+    } else {
+        memcpy( close, last->positions,
+                sizeof( ri_vector_t ) * last->npositions );
+    }
+
+    ri_context_motion_weights( ctx, &wopen, &wclose );
+
+    moving = 0;
+
+    for ( i = 0; i < first->npositions; i++ ) {
+        for ( k = 0; k < 4; k++ ) {
+            p0 = first->positions[i][k];
+            p1 = close[i][k];
+
+            first->positions[i][k] = ( 1.0 - wopen  ) * p0 + wopen  * p1;
+            close[i][k]            = ( 1.0 - wclose ) * p0 + wclose * p1;
+
+            if ( first->positions[i][k] != close[i][k] ) moving = 1;
+        }
+    }
+
+    ri_mem_free( first->positions_close );
+
+    if ( moving ) {
+        first->positions_close = close;
+    } else {
+        first->positions_close = NULL;
+        ri_mem_free( close );
+    }
+}
@@ -31,8 +31,34 @@ extern "C" {
 typedef struct _ri_scene_t
 {
     ri_list_t      *geom_list;         /* geoms in the scene                */
+
+    /*
+     * Geoms of the previous frame. The scene persists across frames, and
+     * the accel built for the previous frame still refers these geoms
+     * until it is updated for the current frame in ri_scene_setup().
+     */
+    ri_list_t      *prev_geom_list;
+    int             nframes;           /* # of frames set up                */
     ri_list_t      *light_list;        /* lights in the scene               */
 
+    /*
+     * Object instancing(see instance.h)
+     */
+    ri_list_t      *object_list;       /* prototypes(ri_object_t)           */
+    ri_list_t      *instance_list;     /* instances(ri_instance_t)          */
+    struct _ri_object_t *object_block; /* prototype being defined in
+                                        * RiObjectBegin()/RiObjectEnd().
+                                        * NULL outside of the block.        */
+
+    /*
+     * Motion blur
+     */
+    ri_geom_t      *motion_geom;       /* geom of the first sample in the
+                                        * current RiMotionBegin() block     */
+    int             motion_blur;       /* nonzero if some geom moves in the
+                                        * shutter interval. Set up in
+                                        * ri_scene_setup().                 */
+
     /*
      * for IBL
      */
@@ -62,6 +88,14 @@ extern ri_scene_t *ri_scene_new();
 extern void        ri_scene_free(
     ri_scene_t       *scene);
 
+/*
+ * Starts the scene description of the next frame. Geoms, lights and
+ * instances of the previous frame are dropped, but the accel is kept so
+ * that it can be updated rather than rebuilt.
+ */
+extern void        ri_scene_begin_frame(
+    ri_scene_t       *scene);       /* [inout] */
+
 extern void        ri_scene_setup(
     ri_scene_t       *scene);       /* [inout] */   
 
@@ -74,6 +108,16 @@ extern void        ri_scene_parse_geom(
     RtToken           tokens[],
     RtPointer         params[] );
 
+/*
+ * Adds the geom to the scene, or to the prototype if it is called in
+ * RiObjectBegin()/RiObjectEnd() block.
+ *
+ * In RiMotionBegin()/RiMotionEnd() block, the geom of the first sample is
+ * added, and the positions of the last sample are taken as its positions at
+ * shutter close. The geoms of the other samples are freed. Outside of the
+ * block, positions at shutter close are computed if the transformation at
+ * shutter close differs from the current one.
+ */
 extern void        ri_scene_add_geom(
     ri_scene_t       *scene,
     const ri_geom_t  *geom );
@@ -43,9 +43,16 @@ typedef struct _lightsource_info_t
     ri_vector_t       N;
 } lightsource_info_t;
 
+/* checker board pattern of texture_coords() */
+#define CHECKER_STEP    0x8
+#define CHECKER_WIDTH   64
+
 static unsigned int hash    (const char        *str);
 static void status_copy     (ri_status_t       *dst,
                              const ri_status_t *src);
+static void checker_filtered(ri_color_t         dst,
+                             const ri_vector_t  coords,
+                             const ri_float_t   fw[2]);
 
 static ri_light_t *get_light(ri_render_t *render);
 
@@ -604,15 +611,15 @@ vtransform(
     (void)src;
 }
 
-void
-environment(
-    const ri_status_t *status,
-    ri_color_t         dst,
-    const char        *name,
+/*
+ * Sphere map coord of the direction for environment().
+ */
+static void
+spheremap_coords(
+    ri_vector_t        tex_coords,
     const ri_vector_t  coords)
 {
     double      m;
-    ri_vector_t tex_coords;
 
     m = 2.0 * sqrt(coords[0] * coords[0] +
                    coords[1] * coords[1] +
@@ -626,8 +633,41 @@ environment(
         tex_coords[0] = 0.5;
         tex_coords[1] = 0.5;
     }
+}
+
+void
+environment(
+    const ri_status_t *status,
+    ri_color_t         dst,
+    const char        *name,
+    const ri_vector_t  coords)
+{
+    int         i;
+    ri_float_t  fw[2];
+    ri_vector_t d;
+    ri_vector_t tex_coords;
+    ri_vector_t tcx, tcy;
+
+    spheremap_coords(tex_coords, coords);
+
+    /*
+     * Filter width from the differentials of I. They are not the exact
+     * differentials of `coords', but have the same magnitude for the
+     * reflection vector of a flat surface.
+     */
+    for (i = 0; i < 3; i++) d[i] = coords[i] + status->dIdx[i];
+    spheremap_coords(tcx, d);
+    for (i = 0; i < 3; i++) d[i] = coords[i] + status->dIdy[i];
+    spheremap_coords(tcy, d);
+
+    fw[0] = fabs(tcx[0] - tex_coords[0]) + fabs(tcy[0] - tex_coords[0]);
+    fw[1] = fabs(tcx[1] - tex_coords[1]) + fabs(tcy[1] - tex_coords[1]);
 
-    texture_coords(status, dst, name, tex_coords);
+    if (fw[0] > 0.0 || fw[1] > 0.0) {
+        checker_filtered(dst, tex_coords, fw);
+    } else {
+        texture_coords(status, dst, name, tex_coords);
+    }
 }
 
 void
@@ -643,8 +683,10 @@ texture(
     texture = ri_texture_load(name);
     if (!texture) return;
 
-    ri_texture_fetch(dst, texture,
-             (double)status->input.s, (double)status->input.t);
+    ri_texture_fetch_filtered(dst, texture,
+             (double)status->input.s, (double)status->input.t,
+             (double)status->dsdx, (double)status->dtdx,
+             (double)status->dsdy, (double)status->dtdy);
 }
 
 void
@@ -654,8 +696,8 @@ texture_coords(
     const char        *name,
     const ri_vector_t  coords)
 {
-    const int step = 0x8;
-    const int texwidth = 64;
+    const int step = CHECKER_STEP;
+    const int texwidth = CHECKER_WIDTH;
     int u, v;
     int c;
 
@@ -676,6 +718,57 @@ texture_coords(
     (void)status;
 }
 
+/*
+ * Integral of the pulse train which is 1 in [step, 2 step) of each period
+ * 2 step.
+ */
+static ri_float_t
+pulsetrain_integral(ri_float_t x, ri_float_t step)
+{
+    ri_float_t n;
+    ri_float_t r;
+
+    n = floor(x / (2.0 * step));
+    r = x - n * 2.0 * step - step;
+
+    return n * step + ((r > 0.0) ? r : 0.0);
+}
+
+/*
+ * Box filtered version of the checker board pattern of texture_coords(),
+ * with the filter width `fw' in texture coord.
+ */
+static void
+checker_filtered(
+    ri_color_t         dst,
+    const ri_vector_t  coords,
+    const ri_float_t   fw[2])
+{
+    int        i;
+    ri_float_t x, w;
+    ri_float_t p[2];
+
+    for (i = 0; i < 2; i++) {
+
+        x = CHECKER_WIDTH * coords[i];
+        w = CHECKER_WIDTH * fw[i];
+
+        if (w < 1.0e-6) {
+            /* Point sample. */
+            x    = x - floor(x / (2.0 * CHECKER_STEP)) * 2.0 * CHECKER_STEP;
+            p[i] = (x >= CHECKER_STEP) ? 1.0 : 0.0;
+        } else {
+            p[i] = (pulsetrain_integral(x + 0.5 * w, CHECKER_STEP) -
+                    pulsetrain_integral(x - 0.5 * w, CHECKER_STEP)) / w;
+        }
+    }
+
+    /* Mean of p0 xor p1 for independent p0 and p1. */
+    dst[0] = p[0] + p[1] - 2.0 * p[0] * p[1];
+    dst[1] = dst[0];
+    dst[2] = dst[0];
+}
+
 float
 occlusion(
     const ri_status_t *status,
@@ -691,7 +784,6 @@ occlusion(
     ri_vector_t       dir;
     ri_vector_t       basis[3];
     ri_ray_t          ray;
-    ri_intersection_state_t state;
 
 #if defined(__APPLE__) && defined(__MACH__)
     //int               inst;
@@ -751,8 +843,9 @@ occlusion(
             ray.org[2] += 0.0001 * ray.dir[2]; 
 
             ray.thread_num = status->thread_num;
+            ray.time       = status->time;
 
-            hit = ri_raytrace(ri_render_get(), &ray, &state);
+            hit = ri_raytrace_occluded(ri_render_get(), &ray, 0.0, RI_INFINITY);
 
             if (hit) {
                 /* there is a occluder. */
@@ -874,6 +967,8 @@ occlusion_altivec(const ri_status_t *status,
 
 
             ray.thread_num = status->thread_num;
+            ray.time       = status->time;
+            ray.has_differentials = 0;
 
             hit = ri_raytrace(ri_render_get(), &ray, &surfinfo);
 
@@ -921,6 +1016,10 @@ trace(
     ray.org[2] += 0.0001 * ray.dir[2];
 
     ray.thread_num = status->thread_num;
+    ray.time       = status->time;
+
+    /* The footprint of an arbitrary direction R is unknown. */
+    ray.has_differentials = 0;
 
     hit = ri_raytrace(ri_render_get(), &ray, &state);
 
@@ -964,6 +1063,12 @@ trace(
     ri_vector_copy(newstatus.input.I,    eye);
     newstatus.input.s = state.u;
     newstatus.input.t = state.v;
+    newstatus.dsdx = state.dudx;
+    newstatus.dtdx = state.dvdx;
+    newstatus.dsdy = state.dudy;
+    newstatus.dtdy = state.dvdy;
+    ri_vector_copy(newstatus.dIdx, state.dDdx);
+    ri_vector_copy(newstatus.dIdy, state.dDdy);
 
     //opa = state.opacity;
     //ri_vector_set4(&newstatus.input.Os, opa, opa, opa, opa);
@@ -1126,7 +1231,6 @@ next_lightsource(
     ri_float_t         ndotl;
     ri_lightsource_t  *l = NULL;
     ri_ray_t           ray;
-    ri_intersection_state_t  state;
 
     tid = status->thread_num;
 
@@ -1142,6 +1246,7 @@ next_lightsource(
     ray.org[2] += N[2] * 0.0001;    
 
     ray.thread_num = tid;
+    ray.time       = status->time;
 
     if (glightinfo[tid].light->type == LIGHTTYPE_IBL) {
 
@@ -1161,7 +1266,7 @@ next_lightsource(
             ri_vector_copy(ray.dir, l->L);
             ri_vector_normalize(ray.dir);
 
-            hit = ri_raytrace(ri_render_get(), &ray, &state);
+            hit = ri_raytrace_occluded(ri_render_get(), &ray, 0.0, RI_INFINITY);
 
             if (hit) {
                 /* there is a occluder */
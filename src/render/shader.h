@@ -149,6 +149,18 @@ typedef struct _ri_status_t
     
     /* Intersect variables */
     //ri_geom_t    *geom;        /* Pointer to geometry info    */
+
+    /*
+     * Screen space derivatives of s, t and I from the ray differentials,
+     * for filtering in texture() and environment(). Zero if unknown.
+     * Appended here so that the layout of the fields above is kept for
+     * compiled shaders.
+     */
+    float         dsdx, dtdx;
+    float         dsdy, dtdy;
+    ri_vector_t   dIdx, dIdy;
+
+    float         time;          /* shutter time of the ray */
 } ri_status_t;
 
 /* light source data structure used for illuminance loop. */
@@ -28,6 +28,7 @@
 #include "shading.h"
 #include "timer.h"
 #include "thread.h"
+#include "profile.h"
 
 #ifndef M_PI
 #define M_PI 3.141592
@@ -95,13 +96,13 @@ shader_shading(
     ri_status_t status;
     ri_vector_t lightpos;
     ri_vector_t Idir;
+    uint64_t    t0;
 
     shader = state->geom->shader;
 
     if (shader) {
     
-        ri_timer_start(ri_render_get()->context->timer,
-                   "Surface shader execution");    
+        t0 = ri_prof_ticks();
         
         lightpos[0] =  1.0;
         lightpos[1] =  0.5;
@@ -112,6 +113,7 @@ shader_shading(
         ri_vector_normalize(Idir);
 
         status.thread_num = ray->thread_num;
+        status.time       = ray->time;
         status.ray_depth  = 0;
 
         /* Setup predefined surface shader variables. */
@@ -128,6 +130,12 @@ shader_shading(
         ri_vector_copy(status.input.L,    lightpos);
         status.input.s = state->u;
         status.input.t = state->v;
+        status.dsdx = state->dudx;
+        status.dtdx = state->dvdx;
+        status.dsdy = state->dudy;
+        status.dtdy = state->dvdy;
+        ri_vector_copy(status.dIdx, state->dDdx);
+        ri_vector_copy(status.dIdy, state->dDdy);
 
 #if 0
         status.input.Os[0] = state->opacity;
@@ -141,8 +149,8 @@ shader_shading(
 
         shader->shaderproc(&out, &status, shader->param);    
 
-        ri_timer_end(ri_render_get()->context->timer,
-                 "Surface shader execution");    
+        ri_prof_timer_add(RI_PROF_TIMER_SHADER, ri_prof_ticks() - t0);
+        ri_prof_inc(RI_PROF_NSHADER_CALLS);
 
         ri_vector_copy(radiance, out.Ci);
     } else {
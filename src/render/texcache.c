@@ -0,0 +1,340 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Texture cache for blocked mipmap textures.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "memory.h"
+#include "log.h"
+#include "render.h"
+#include "texcache.h"
+
+static ri_texcache_t *gtexcache = NULL;
+
+static ri_texcache_t      *texcache_new(size_t size);
+static unsigned int        tile_hash(int id, int index);
+static ri_texcache_tile_t *shard_lookup(ri_texcache_shard_t *shard,
+                                        unsigned int         hash,
+                                        int                  id,
+                                        int                  index);
+static ri_texcache_tile_t *shard_load(ri_texcache_t         *cache,
+                                      ri_texcache_shard_t   *shard,
+                                      unsigned int           hash,
+                                      const ri_blockedtex_t *btex,
+                                      int                    index);
+static void                lru_unlink(ri_texcache_shard_t *shard,
+                                      ri_texcache_tile_t  *tile);
+static void                lru_push_front(ri_texcache_shard_t *shard,
+                                          ri_texcache_tile_t  *tile);
+
+/* ---------------------------------------------------------------------------
+ *
+ * Public functions
+ *
+ * ------------------------------------------------------------------------ */
+
+ri_texcache_t *
+ri_texcache_get()
+{
+    int size = RI_TEXCACHE_DEFAULT_SIZE;
+
+    if (gtexcache == NULL) {
+
+        if (ri_render_get() && ri_render_get()->context) {
+            size = ri_render_get()->context->option->texture_cache_size;
+            if (size < 1) size = 1;
+        }
+
+        gtexcache = texcache_new((size_t)size * 1024 * 1024);
+
+        ri_log(LOG_INFO, "(TexCache) Texture cache size = %d MB", size);
+    }
+
+    return gtexcache;
+}
+
+void
+ri_texcache_fetch2x2(
+    float                   texel[4][4],
+    ri_texcache_t          *cache,
+    const ri_blockedtex_t  *btex,
+    int                     level,
+    int                     x,
+    int                     y)
+{
+    int                  i;
+    int                  w, h;
+    int                  tx, ty;
+    int                  lx, ly;
+    int                  index;
+    int                  stride;
+    unsigned int         hash;
+    const float         *p;
+    ri_texcache_shard_t *shard;
+    ri_texcache_tile_t  *tile;
+
+    w = btex->level_width[level];
+    h = btex->level_height[level];
+
+    if (x < 0) x = 0;
+    if (x > w - 1) x = w - 1;
+    if (y < 0) y = 0;
+    if (y > h - 1) y = h - 1;
+
+    tx = x / btex->tilesize;
+    ty = y / btex->tilesize;
+    lx = x - tx * btex->tilesize;
+    ly = y - ty * btex->tilesize;
+
+    index  = btex->first_tile[level] + ty * btex->nxtiles[level] + tx;
+    stride = 4 * (btex->tilesize + 1);
+
+    hash  = tile_hash(btex->id, index);
+    shard = &cache->shards[hash % cache->nshards];
+
+    ri_mutex_lock(shard->mutex);
+
+    shard->nlookups++;
+
+    tile = shard_lookup(shard, hash, btex->id, index);
+
+    if (tile == NULL) {
+        tile = shard_load(cache, shard, hash, btex, index);
+    } else if (shard->head != tile) {
+        lru_unlink(shard, tile);
+        lru_push_front(shard, tile);
+    }
+
+    /* The border column and row of the tile cover x+1 and y+1. */
+    p = tile->texels + ly * stride + 4 * lx;
+
+    for (i = 0; i < 4; i++) {
+        texel[0][i] = p[i];
+        texel[1][i] = p[stride + i];
+        texel[2][i] = p[4 + i];
+        texel[3][i] = p[stride + 4 + i];
+    }
+
+    ri_mutex_unlock(shard->mutex);
+
+    if (btex->scale != 1.0f) {
+        for (i = 0; i < 4; i++) {
+            texel[0][i] *= btex->scale;
+            texel[1][i] *= btex->scale;
+            texel[2][i] *= btex->scale;
+            texel[3][i] *= btex->scale;
+        }
+    }
+}
+
+int
+ri_texcache_stat(
+    uint64_t               *nlookups_out,
+    uint64_t               *nloads_out,
+    size_t                 *bytes_out)
+{
+    int i;
+
+    (*nlookups_out) = 0;
+    (*nloads_out)   = 0;
+    (*bytes_out)    = 0;
+
+    if (gtexcache == NULL) return -1;
+
+    for (i = 0; i < gtexcache->nshards; i++) {
+        (*nlookups_out) += gtexcache->shards[i].nlookups;
+        (*nloads_out)   += gtexcache->shards[i].nloads;
+        (*bytes_out)    += gtexcache->shards[i].ntiles * gtexcache->tilebytes;
+    }
+
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ *
+ * Private functions
+ *
+ * ------------------------------------------------------------------------ */
+
+static ri_texcache_t *
+texcache_new(size_t size)
+{
+    int            i;
+    int            ntiles;
+    int            nshards;
+    int            maxtiles;
+    ri_texcache_t *cache;
+
+    cache = (ri_texcache_t *)ri_mem_alloc(sizeof(ri_texcache_t));
+    memset(cache, 0, sizeof(ri_texcache_t));
+
+    cache->size      = size;
+    cache->tilebytes = sizeof(float) * 4 *
+                       (RI_BTEX_TILESIZE + 1) * (RI_BTEX_TILESIZE + 1);
+
+    /*
+     * Tiles are allocated on demand up to the budget. Each shard holds at
+     * least 2 tiles, so a small budget is split into fewer shards rather
+     * than rounded up per shard.
+     */
+    ntiles = (int)(size / cache->tilebytes);
+    if (ntiles < 2) ntiles = 2;
+
+    nshards = ntiles / 2;
+    if (nshards > RI_TEXCACHE_NSHARDS) nshards = RI_TEXCACHE_NSHARDS;
+
+    maxtiles = ntiles / nshards;
+
+    cache->nshards = nshards;
+
+    for (i = 0; i < nshards; i++) {
+
+        cache->shards[i].mutex = ri_mutex_new();
+        ri_mutex_init(cache->shards[i].mutex);
+
+        cache->shards[i].maxtiles = maxtiles;
+        cache->shards[i].nbuckets = 2 * maxtiles;
+        cache->shards[i].buckets  = (ri_texcache_tile_t **)ri_mem_alloc(
+            sizeof(ri_texcache_tile_t *) * cache->shards[i].nbuckets);
+        memset(cache->shards[i].buckets, 0,
+               sizeof(ri_texcache_tile_t *) * cache->shards[i].nbuckets);
+    }
+
+    return cache;
+}
+
+static unsigned int
+tile_hash(int id, int index)
+{
+    unsigned int h;
+
+    h  = (unsigned int)id * 2654435761u;
+    h ^= (unsigned int)index * 2246822519u;
+    h ^= h >> 15;
+
+    return h;
+}
+
+static ri_texcache_tile_t *
+shard_lookup(
+    ri_texcache_shard_t *shard,
+    unsigned int         hash,
+    int                  id,
+    int                  index)
+{
+    ri_texcache_tile_t *tile;
+
+    tile = shard->buckets[(hash / RI_TEXCACHE_NSHARDS) % shard->nbuckets];
+
+    while (tile) {
+        if (tile->id == id && tile->index == index) return tile;
+        tile = tile->hnext;
+    }
+
+    return NULL;
+}
+
+/*
+ * Reads a tile into a new slot, or into the slot of the least recently used
+ * tile if the shard is full. Called with the shard locked.
+ */
+static ri_texcache_tile_t *
+shard_load(
+    ri_texcache_t         *cache,
+    ri_texcache_shard_t   *shard,
+    unsigned int           hash,
+    const ri_blockedtex_t *btex,
+    int                    index)
+{
+    unsigned int         b;
+    ri_texcache_tile_t  *tile;
+    ri_texcache_tile_t **pp;
+
+    if (shard->ntiles < shard->maxtiles) {
+
+        tile = (ri_texcache_tile_t *)ri_mem_alloc(sizeof(ri_texcache_tile_t));
+        tile->texels = (float *)ri_mem_alloc(cache->tilebytes);
+        shard->ntiles++;
+
+    } else {
+
+        /* Evict the least recently used tile. */
+        tile = shard->tail;
+        lru_unlink(shard, tile);
+
+        b  = tile_hash(tile->id, tile->index);
+        pp = &shard->buckets[(b / RI_TEXCACHE_NSHARDS) % shard->nbuckets];
+        while ((*pp) != tile) {
+            pp = &((*pp)->hnext);
+        }
+        (*pp) = tile->hnext;
+    }
+
+    if (ri_blockedtex_read_tile(btex, index, tile->texels) != 0) {
+        ri_log(LOG_WARN, "(TexCache) Can't read tile %d of texture %d",
+               index, btex->id);
+        memset(tile->texels, 0, cache->tilebytes);
+    }
+
+    shard->nloads++;
+
+    tile->id    = btex->id;
+    tile->index = index;
+
+    b = (hash / RI_TEXCACHE_NSHARDS) % shard->nbuckets;
+    tile->hnext = shard->buckets[b];
+    shard->buckets[b] = tile;
+
+    lru_push_front(shard, tile);
+
+    return tile;
+}
+
+static void
+lru_unlink(ri_texcache_shard_t *shard, ri_texcache_tile_t *tile)
+{
+    if (tile->prev) {
+        tile->prev->next = tile->next;
+    } else {
+        shard->head = tile->next;
+    }
+
+    if (tile->next) {
+        tile->next->prev = tile->prev;
+    } else {
+        shard->tail = tile->prev;
+    }
+
+    tile->prev = tile->next = NULL;
+}
+
+static void
+lru_push_front(ri_texcache_shard_t *shard, ri_texcache_tile_t *tile)
+{
+    tile->prev = NULL;
+    tile->next = shard->head;
+
+    if (shard->head) {
+        shard->head->prev = tile;
+    } else {
+        shard->tail = tile;
+    }
+
+    shard->head = tile;
+}
@@ -0,0 +1,184 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Texture cache for blocked mipmap textures.
+ *
+ * A blocked mipmap texture(.btex) stores every mipmap level of a texture
+ * as tiles of TILESIZE x TILESIZE texels on disk. Only its header is read
+ * by ri_texture_load(). Tiles are paged in on demand into the texture
+ * cache, which holds them up to a fixed memory budget and evicts the least
+ * recently used tile. Thus the memory used for texels does not depend on
+ * the size or the number of textures in the scene.
+ *
+ * Each tile has one extra column and row copied from its right and lower
+ * neighbors(or the edge texel), so that the 2x2 texels of a bilinear
+ * lookup are always found in a single tile.
+ *
+ * File layout(byte order of the host that wrote the file):
+ *
+ *   char      magic[4]             "LBT1"
+ *   int32     byteorder            0x01020304
+ *   int32     width, height        size of mipmap level 0
+ *   int32     tilesize
+ *   int32     nlevels
+ *   int32     compressed           tiles are zlib compressed if nonzero
+ *   int32     level_width[nlevels], level_height[nlevels]
+ *   uint64    offset[ntiles + 1]   tile i occupies [offset[i], offset[i+1])
+ *   ...       tiles                (tilesize+1)^2 RGBA fp32 texels each.
+ *
+ * Tiles are ordered by level, then in scanline order in the level.
+ *
+ * The cache is split into shards by the hash of the tile, and each shard
+ * has its own lock and LRU list, so that render threads rarely contend.
+ * Small budgets use fewer shards so that the tiles of all shards fit in the
+ * budget.
+ *
+ * $Id$
+ */
+
+#ifndef LUCILLE_TEXCACHE_H
+#define LUCILLE_TEXCACHE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "thread.h"
+#include "texture.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RI_BTEX_MAGIC               "LBT1"
+#define RI_BTEX_BYTEORDER           0x01020304
+#define RI_BTEX_TILESIZE            64
+
+#define RI_TEXCACHE_NSHARDS         16
+#define RI_TEXCACHE_DEFAULT_SIZE    256     /* MB                           */
+
+/*
+ * Opened blocked mipmap texture. Texels are not kept here.
+ */
+typedef struct _ri_blockedtex_t
+{
+    int             id;                 /* unique id for the cache key      */
+    FILE           *fp;
+    ri_mutex_t     *mutex;              /* serializes reads of fp           */
+
+    int             width, height;      /* size of level 0                  */
+    int             tilesize;
+    int             nlevels;
+    int             compressed;
+    float           scale;              /* multiplied to fetched texels     */
+
+    int             level_width[RI_MAX_MIPMAP_SIZE];
+    int             level_height[RI_MAX_MIPMAP_SIZE];
+    int             nxtiles[RI_MAX_MIPMAP_SIZE];
+    int             nytiles[RI_MAX_MIPMAP_SIZE];
+    int             first_tile[RI_MAX_MIPMAP_SIZE];
+
+    int             ntiles;
+    uint64_t       *offset;             /* [ntiles + 1]                     */
+
+} ri_blockedtex_t;
+
+typedef struct _ri_texcache_tile_t
+{
+    int             id;                 /* id of the blocked texture        */
+    int             index;              /* tile index in the file           */
+    float          *texels;             /* (tilesize+1)^2 RGBA texels       */
+
+    struct _ri_texcache_tile_t *hnext;  /* hash chain                       */
+    struct _ri_texcache_tile_t *prev;   /* LRU list. head = recently used   */
+    struct _ri_texcache_tile_t *next;
+
+} ri_texcache_tile_t;
+
+typedef struct _ri_texcache_shard_t
+{
+    ri_mutex_t             *mutex;
+
+    ri_texcache_tile_t    **buckets;
+    int                     nbuckets;
+
+    ri_texcache_tile_t     *head;
+    ri_texcache_tile_t     *tail;
+
+    int                     ntiles;     /* # of allocated tiles             */
+    int                     maxtiles;
+
+    uint64_t                nlookups;
+    uint64_t                nloads;     /* # of tiles read from disk        */
+
+} ri_texcache_shard_t;
+
+typedef struct _ri_texcache_t
+{
+    size_t                  size;       /* memory budget in bytes           */
+    size_t                  tilebytes;
+
+    int                     nshards;    /* <= RI_TEXCACHE_NSHARDS           */
+    ri_texcache_shard_t     shards[RI_TEXCACHE_NSHARDS];
+
+} ri_texcache_t;
+
+/*
+ * Returns the texture cache. It is created with the memory budget of the
+ * "texture" "cachesize" option at the first call.
+ */
+extern ri_texcache_t *ri_texcache_get();
+
+/*
+ * Copies texels (x, y), (x, y+1), (x+1, y) and (x+1, y+1) of mipmap level
+ * `level' into texel[0..3], reading the tile from disk if it is not in the
+ * cache. Texels outside of the level are clamped to the edge.
+ */
+extern void ri_texcache_fetch2x2(
+    float                   texel[4][4],            /* [out]            */
+    ri_texcache_t          *cache,
+    const ri_blockedtex_t  *btex,
+    int                     level,
+    int                     x,
+    int                     y);
+
+/*
+ * Statistics of the cache, summed over shards. Returns -1 if the cache is
+ * not created, i.e. no blocked texture is used.
+ */
+extern int  ri_texcache_stat(
+    uint64_t               *nlookups_out,
+    uint64_t               *nloads_out,
+    size_t                 *bytes_out);         /* allocated tile memory    */
+
+/*
+ * Blocked mipmap texture files(texture_loader.c).
+ */
+extern ri_blockedtex_t *ri_blockedtex_open(
+    const char             *filename);
+
+extern void ri_blockedtex_close(
+    ri_blockedtex_t        *btex);
+
+/*
+ * Reads tile `index' into `texels', which has (tilesize+1)^2 RGBA texels.
+ * Returns 0 on success.
+ */
+extern int ri_blockedtex_read_tile(
+    const ri_blockedtex_t  *btex,
+    int                     index,
+    float                  *texels);
+
+#ifdef __cplusplus
+}    /* extern "C" */
+#endif
+
+#endif  /* LUCILLE_TEXCACHE_H */
@@ -19,46 +19,13 @@
 #include <ctype.h>
 
 
-#ifdef HAVE_ZLIB
-#include <zlib.h>        /* Blocked texture is saved with zlib comporession. */
-#endif
-
 #include "memory.h"
 #include "log.h"
 #include "texture.h"
+#include "texcache.h"
 #include "hash.h"
 #include "render.h"
-
-#define TEXBLOCKSIZE 64        /* block map size in miplevel 0. */
-#define MAXMIPLEVEL  16        /* 16 can represent a mipmap for 65536x65536. */
-
-typedef struct _texblock_t
-{
-    int          x, y;        /* upper-left position in original texture map. 
-                               * (in miplevel 0)
-                               */
-
-    ri_vector_t *image;
-
-} texblock_t;
-
-typedef struct _blockedmipmap_t
-{
-    int nmiplevels;             /* The number of mipmap levels              */
-
-    int width, height;          /* Original texture size                    */
-
-    int nxblocks, nyblocks;     /* The number of texture blocks.
-                                 * Counted in miplevel 0.
-                                 * Thus e.g. miplevel 1 contains
-                                 * (nxblocks/2) * (nyblocks/2) texture blocks.
-                                 */
-
-    texblock_t *blocks[MAXMIPLEVEL];    /* list of texture blocks
-                                         * in each miplevel.
-                                         */
-
-} blockedmipmap_t;
+#include "profile.h"
 
 //#define LOCAL_DEBUG
 #undef LOCAL_DEBUG
@@ -81,6 +48,30 @@ static FILE         *open_file(const char *filename);
 /* store texel memory in scanline order -> z curve order. */ 
 static void build_z_table();
 
+static void blocked_bilinear(ri_vector_t            color_out,
+                             const ri_blockedtex_t *btex,
+                             int                    level,
+                             ri_float_t             u,
+                             ri_float_t             v);
+static void blocked_trilinear(ri_vector_t            color_out,
+                              const ri_blockedtex_t *btex,
+                              ri_float_t             lod,
+                              ri_float_t             u,
+                              ri_float_t             v);
+static void mipmap_bilinear(ri_vector_t            color_out,
+                            const ri_mipmap_t     *mipmap,
+                            int                    level,
+                            ri_float_t             u,
+                            ri_float_t             v);
+static void trilinear(ri_vector_t            color_out,
+                      const ri_texture_t    *texture,
+                      ri_float_t             lod,
+                      ri_float_t             u,
+                      ri_float_t             v);
+static void angularmap_uv(ri_float_t        *u_out,
+                          ri_float_t        *v_out,
+                          const ri_vector_t  dir);
+
 
 void
 ri_texture_fetch(
@@ -98,6 +89,13 @@ ri_texture_fetch(
     ri_float_t px, py;
     ri_float_t dx, dy;
 
+    ri_prof_inc(RI_PROF_NTEXTURE_FETCHES);
+
+    if (texture->blocked) {
+        blocked_bilinear(color_out, texture->blocked, 0, u, v);
+        return;
+    }
+
     sx = floor(u); sy = floor(v);
 
     u = u - sx; v = v - sy;
@@ -234,11 +232,175 @@ ri_texture_fetch(
     }
 }
 
+void
+ri_texture_fetch_filtered(
+    ri_vector_t         color_out,      /* [out] */
+    const ri_texture_t *texture,
+    ri_float_t          u,
+    ri_float_t          v,
+    ri_float_t          dudx,
+    ri_float_t          dvdx,
+    ri_float_t          dudy,
+    ri_float_t          dvdy)
+{
+    int         i, k;
+    int         nprobes;
+    ri_float_t  ax, ay, bx, by;
+    ri_float_t  la, lb;
+    ri_float_t  du, dv;
+    ri_float_t  t;
+    ri_float_t  major, minor;
+    ri_float_t  lod;
+    ri_vector_t col;
+
+    if (!texture->blocked && !texture->mipmap) {
+        ri_texture_fetch(color_out, texture, u, v);
+        return;
+    }
+
+    ri_prof_inc(RI_PROF_NTEXTURE_FETCHES);
+
+    /* Axes of the footprint in texels of level 0. */
+    ax = dudx * texture->width;
+    ay = dvdx * texture->height;
+    bx = dudy * texture->width;
+    by = dvdy * texture->height;
+
+    la = ax * ax + ay * ay;
+    lb = bx * bx + by * by;
+
+    if (la >= lb) {
+        major = sqrt(la); minor = sqrt(lb);
+        du    = dudx;     dv    = dvdx;
+    } else {
+        major = sqrt(lb); minor = sqrt(la);
+        du    = dudy;     dv    = dvdy;
+    }
+
+    if (major <= 0.0) {
+        trilinear(color_out, texture, 0.0, u, v);
+        return;
+    }
+
+    /* Limit the anisotropy by blurring the minor axis. */
+    if (minor * RI_TEXTURE_MAX_ANISOTROPY < major) {
+        minor = major / RI_TEXTURE_MAX_ANISOTROPY;
+    }
+
+    nprobes = (int)ceil(major / minor);
+    if (nprobes < 1) nprobes = 1;
+    if (nprobes > RI_TEXTURE_MAX_ANISOTROPY) {
+        nprobes = RI_TEXTURE_MAX_ANISOTROPY;
+    }
+
+    lod = (minor > 1.0) ? log(minor) / log(2.0) : 0.0;
+
+    if (nprobes == 1) {
+        trilinear(color_out, texture, lod, u, v);
+        return;
+    }
+
+    /* Probes are evenly placed along the major axis of the footprint. */
+    ri_vector_setzero(color_out);
+
+    for (i = 0; i < nprobes; i++) {
+        t = (i + 0.5) / (ri_float_t)nprobes - 0.5;
+
+        trilinear(col, texture, lod, u + t * du, v + t * dv);
+
+        for (k = 0; k < 4; k++) {
+            color_out[k] += col[k];
+        }
+    }
+
+    for (k = 0; k < 4; k++) {
+        color_out[k] /= (ri_float_t)nprobes;
+    }
+}
+
 void
 ri_texture_ibl_fetch(
     ri_vector_t         color_out,
     const ri_texture_t *texture,
     const ri_vector_t   dir)
+{
+    ri_float_t u, v;
+
+    angularmap_uv(&u, &v, dir);
+
+    ri_texture_fetch(color_out, texture, u, v);
+}
+
+void
+ri_texture_ibl_fetch_filtered(
+    ri_vector_t         color_out,
+    const ri_texture_t *texture,
+    const ri_vector_t   dir,
+    const ri_vector_t   dDdx,
+    const ri_vector_t   dDdy)
+{
+    int         i;
+    ri_float_t  u, v;
+    ri_float_t  ux, vx, uy, vy;
+    ri_vector_t d;
+
+    angularmap_uv(&u, &v, dir);
+
+    for (i = 0; i < 3; i++) d[i] = dir[i] + dDdx[i];
+    angularmap_uv(&ux, &vx, d);
+
+    for (i = 0; i < 3; i++) d[i] = dir[i] + dDdy[i];
+    angularmap_uv(&uy, &vy, d);
+
+    ux -= u; vx -= v;
+    uy -= u; vy -= v;
+
+    /*
+     * The angular map is singular at the rim(the direction of -z), where
+     * neighboring directions are mapped far apart. Don't filter there.
+     */
+    if (fabs(ux) + fabs(vx) + fabs(uy) + fabs(vy) > 0.5) {
+        ri_texture_fetch(color_out, texture, u, v);
+        return;
+    }
+
+    ri_texture_fetch_filtered(color_out, texture, u, v, ux, vx, uy, vy);
+}
+
+void
+ri_texture_scale(ri_texture_t *texture, ri_float_t scale)
+{
+    int i, j;
+
+    if (texture->blocked) {
+        /* Texels are scaled when they are fetched from the cache. */
+        texture->blocked->scale *= (float)scale;
+        return;
+    }
+
+    for (i = 0; i < texture->width * texture->height * 4; i++) {
+        texture->data[i] *= scale;
+    }
+
+    if (texture->mipmap) {
+        /* Level 0 is texture->data. */
+        for (j = 1; j < texture->mipmap->nlevels; j++) {
+            for (i = 0; i < texture->mipmap->width[j] *
+                            texture->mipmap->height[j] * 4; i++) {
+                texture->mipmap->data[j][i] *= scale;
+            }
+        }
+    }
+}
+
+/*
+ * Angular map coord of the direction.
+ */
+static void
+angularmap_uv(
+    ri_float_t        *u_out,
+    ri_float_t        *v_out,
+    const ri_vector_t  dir)
 {
     const ri_float_t pi = 3.1415926535;
     ri_float_t u, v;
@@ -272,19 +434,187 @@ ri_texture_ibl_fetch(
     u = 0.5 * u + 0.5;
     v = 0.5 - 0.5 * v;
 
-    ri_texture_fetch(color_out, texture, u, v);
+    (*u_out) = u;
+    (*v_out) = v;
 }
 
-void
-ri_texture_scale(ri_texture_t *texture, ri_float_t scale)
+/*
+ * Bilinear lookup of mipmap level `level' through the texture cache, with
+ * the same addressing as ri_texture_fetch().
+ */
+static void
+blocked_bilinear(
+    ri_vector_t            color_out,
+    const ri_blockedtex_t *btex,
+    int                    level,
+    ri_float_t             u,
+    ri_float_t             v)
 {
-    int i;
+    int        i;
+    int        x, y;
+    ri_float_t px, py;
+    ri_float_t dx, dy;
+    ri_float_t w[4];
+    float      texel[4][4];
 
-    for (i = 0; i < texture->width * texture->height * 4; i++) {
-        texture->data[i] *= scale;
+    u = u - floor(u); v = v - floor(v);
+
+    if (u < 0.0) u = 0.0;
+    if (u >= 1.0) u = 1.0;
+    if (v < 0.0) v = 0.0;
+    if (v >= 1.0) v = 1.0;
+
+    px = u * (btex->level_width[level]  - 1);
+    py = v * (btex->level_height[level] - 1);
+
+    x = (int)px; y = (int)py;
+
+    dx = px - x; dy = py - y;
+
+    w[0] = (1.0 - dx) * (1.0 - dy);
+    w[1] = (1.0 - dx) *        dy ;
+    w[2] =        dx  * (1.0 - dy);
+    w[3] =        dx  *        dy ;
+
+    ri_texcache_fetch2x2(texel, ri_texcache_get(), btex, level, x, y);
+
+    for (i = 0; i < 4; i++) {
+        color_out[i] = (ri_float_t)(
+                  w[0] * texel[0][i] +
+                  w[1] * texel[1][i] +
+                  w[2] * texel[2][i] +
+                  w[3] * texel[3][i]);
+    }
+}
+
+static void
+blocked_trilinear(
+    ri_vector_t            color_out,
+    const ri_blockedtex_t *btex,
+    ri_float_t             lod,
+    ri_float_t             u,
+    ri_float_t             v)
+{
+    int         i;
+    int         level;
+    ri_float_t  t;
+    ri_vector_t c0, c1;
+
+    if (lod <= 0.0) {
+        blocked_bilinear(color_out, btex, 0, u, v);
+        return;
+    }
+
+    if (lod >= btex->nlevels - 1) {
+        blocked_bilinear(color_out, btex, btex->nlevels - 1, u, v);
+        return;
+    }
+
+    level = (int)lod;
+    t     = lod - level;
+
+    blocked_bilinear(c0, btex, level,     u, v);
+    blocked_bilinear(c1, btex, level + 1, u, v);
+
+    for (i = 0; i < 4; i++) {
+        color_out[i] = (1.0 - t) * c0[i] + t * c1[i];
     }
 }
 
+/*
+ * Bilinear lookup of mipmap level `level' of a texture in memory, with the
+ * same addressing as ri_texture_fetch().
+ */
+static void
+mipmap_bilinear(
+    ri_vector_t            color_out,
+    const ri_mipmap_t     *mipmap,
+    int                    level,
+    ri_float_t             u,
+    ri_float_t             v)
+{
+    int          i;
+    int          x, y;
+    int          x1, y1;
+    int          w, h;
+    ri_float_t   px, py;
+    ri_float_t   dx, dy;
+    const float *data;
+
+    w    = mipmap->width[level];
+    h    = mipmap->height[level];
+    data = mipmap->data[level];
+
+    u = u - floor(u); v = v - floor(v);
+
+    if (u < 0.0) u = 0.0;
+    if (u >= 1.0) u = 1.0;
+    if (v < 0.0) v = 0.0;
+    if (v >= 1.0) v = 1.0;
+
+    px = u * (w - 1);
+    py = v * (h - 1);
+
+    x = (int)px; y = (int)py;
+
+    dx = px - x; dy = py - y;
+
+    x1 = (x < w - 1) ? x + 1 : x;
+    y1 = (y < h - 1) ? y + 1 : y;
+
+    for (i = 0; i < 4; i++) {
+        color_out[i] = (ri_float_t)(
+            (1.0 - dx) * (1.0 - dy) * data[4 * (y  * w + x ) + i] +
+            (1.0 - dx) *        dy  * data[4 * (y1 * w + x ) + i] +
+                   dx  * (1.0 - dy) * data[4 * (y  * w + x1) + i] +
+                   dx  *        dy  * data[4 * (y1 * w + x1) + i]);
+    }
+}
+
+/*
+ * Trilinear lookup of the blocked texture or the mipmap of the texture.
+ */
+static void
+trilinear(
+    ri_vector_t            color_out,
+    const ri_texture_t    *texture,
+    ri_float_t             lod,
+    ri_float_t             u,
+    ri_float_t             v)
+{
+    int                i;
+    int                level;
+    ri_float_t         t;
+    ri_vector_t        c0, c1;
+    const ri_mipmap_t *mipmap;
+
+    if (texture->blocked) {
+        blocked_trilinear(color_out, texture->blocked, lod, u, v);
+        return;
+    }
+
+    mipmap = texture->mipmap;
+
+    if (lod <= 0.0) {
+        mipmap_bilinear(color_out, mipmap, 0, u, v);
+        return;
+    }
+
+    if (lod >= mipmap->nlevels - 1) {
+        mipmap_bilinear(color_out, mipmap, mipmap->nlevels - 1, u, v);
+        return;
+    }
+
+    level = (int)lod;
+    t     = lod - level;
+
+    mipmap_bilinear(c0, mipmap, level,     u, v);
+    mipmap_bilinear(c1, mipmap, level + 1, u, v);
+
+    for (i = 0; i < 4; i++) {
+        color_out[i] = (1.0 - t) * c0[i] + t * c1[i];
+    }
+}
 
 static void
 build_z_table()
@@ -18,6 +18,11 @@ extern "C" {
 
 #define RI_MAX_MIPMAP_SIZE 16           /* Up to 65536x65536                */
 
+#define RI_TEXTURE_MAX_ANISOTROPY 8     /* max probes of filtered fetch     */
+
+struct _ri_blockedtex_t;
+struct _ri_mipmap_t;
+
 typedef struct _ri_texture_t
 {
     float         *data;                /* texel is strictly fp32 value.    */
@@ -26,6 +31,15 @@ typedef struct _ri_texture_t
                                          * width or height.
                                          */
     int            mapping;             /* mapping method for IBL           */
+
+    struct _ri_blockedtex_t
+                  *blocked;             /* non-NULL if texels are paged in
+                                         * by the texture cache. `data' is
+                                         * NULL then.                       */
+
+    struct _ri_mipmap_t
+                  *mipmap;              /* mipmap of `data' for filtered
+                                         * fetch. May be NULL.              */
 } ri_texture_t;
 
 typedef struct _ri_mipmap_t
@@ -73,20 +87,57 @@ extern ri_texture_t *ri_texture_load (const char *filename);
 
 extern void          ri_texture_free (ri_texture_t *texture);
 
-// TODO: LOD
 extern void          ri_texture_fetch(ri_vector_t         color,   /* [out] */
                                       const ri_texture_t *texture,
                                       ri_float_t           u,
                                       ri_float_t           v);
 
+/*
+ * Filtered texture fetch with the screen space derivatives of (u, v).
+ * The mipmap level is chosen from the minor axis of the footprint, and up
+ * to RI_TEXTURE_MAX_ANISOTROPY trilinear probes are taken along the major
+ * axis. Textures without mipmap are filtered bilinearly.
+ */
+extern void          ri_texture_fetch_filtered(
+                                      ri_vector_t         color,   /* [out] */
+                                      const ri_texture_t *texture,
+                                      ri_float_t          u,
+                                      ri_float_t          v,
+                                      ri_float_t          dudx,
+                                      ri_float_t          dvdx,
+                                      ri_float_t          dudy,
+                                      ri_float_t          dvdy);
+
 extern void          ri_texture_ibl_fetch(
                                       ri_vector_t         color,
                                       const ri_texture_t *texture,
                                       const ri_vector_t   dir);
 
+/*
+ * IBL fetch filtered over the footprint of the direction differentials.
+ */
+extern void          ri_texture_ibl_fetch_filtered(
+                                      ri_vector_t         color,   /* [out] */
+                                      const ri_texture_t *texture,
+                                      const ri_vector_t   dir,
+                                      const ri_vector_t   dDdx,
+                                      const ri_vector_t   dDdy);
+
 extern void          ri_texture_scale(ri_texture_t *texture,
                                       ri_float_t scale);
 
+/*
+ * Writes the texture as a blocked mipmap texture(.btex) which is paged in
+ * by the texture cache at rendering time. Returns 0 on success.
+ */
+extern int           ri_texture_save_blocked(
+                                      const char         *filename,
+                                      const ri_texture_t *texture);
+
+/*
+ * Create a box filtered mipmap down to 1x1. Level 0 refers to the texels of
+ * the texture and is not copied.
+ */
 extern ri_mipmap_t  *ri_texture_make_mipmap(
                                       const ri_texture_t *texture);
 
@@ -1,13 +1,11 @@
 /*
  * texture data loader.
  *
- * TODO:
- * 
  * To handle large texture maps,
  * a imagemap(e.g. jpeg) is first converted into blocked,
  * mipmapped and hierarchical manner, and saved it to disk.
  * In rendering time, a portion(block) of texture map to be texture-mapped
- * is load into memory from file.
+ * is load into memory from file by the texture cache(texcache.c).
  *
  *
  *  +-----------------+         +-----+-----+-----+
@@ -27,6 +25,9 @@
  * | miplevel 0 blocks     | lv 1 blks     | lv 2 blks  |      |
  * +-----------------------+---------------+------------+--||--+
  *
+ * See texcache.h for the file layout.
+ *
+ * TODO:
  *
  *  o Use rip-map for anisotropic texturing.
  *
@@ -47,7 +48,7 @@
 #include <assert.h>
 
 
-#ifdef HAVE_ZLIB
+#ifdef WITH_ZLIB
 #include <zlib.h>        /* Blocked texture is saved with zlib comporession. */
 #endif
 
@@ -57,19 +58,11 @@
 #include "hash.h"
 #include "render.h"
 #include "image_loader.h"       /* ../imageo                                */
+#include "texcache.h"
 
-#define TEXBLOCKSIZE 64         /* block map size in miplevel 0. */
-#define MAXMIPLEVEL  16         /* 16 can represent a mipmap for 65536x65536. */
-
-typedef struct _texblock_t
-{
-    int          x, y;        /* upper-left position in original texture map. 
-                               * (in miplevel 0)
-                               */
-
-    ri_vector_t *image;
-
-} texblock_t;
+#define TEXBLOCKSIZE RI_BTEX_TILESIZE   /* block map size.                */
+#define MAXMIPLEVEL  RI_MAX_MIPMAP_SIZE /* 16 can represent a mipmap for
+                                         * 65536x65536.                   */
 
 typedef struct _blockedmipmap_t
 {
@@ -77,15 +70,13 @@ typedef struct _blockedmipmap_t
 
     int width, height;          /* Original texture size                    */
 
-    int nxblocks, nyblocks;     /* The number of texture blocks.
-                                 * Counted in miplevel 0.
-                                 * Thus e.g. miplevel 1 contains
-                                 * (nxblocks/2) * (nyblocks/2) texture blocks.
-                                 */
+    int level_width[MAXMIPLEVEL];
+    int level_height[MAXMIPLEVEL];
+
+    int nxblocks[MAXMIPLEVEL];  /* The number of texture blocks             */
+    int nyblocks[MAXMIPLEVEL];  /* in each miplevel.                        */
 
-    texblock_t *blocks[MAXMIPLEVEL];    /* list of texture blocks
-                                         * in each miplevel.
-                                         */
+    float *images[MAXMIPLEVEL]; /* RGBA image of each miplevel              */
 
 } blockedmipmap_t;
 
@@ -103,6 +94,12 @@ static ri_hash_t    *texture_cache;
                ((unsigned int)((g_z_table[((x) >> 8) & 0xFF]) | \
                 (g_z_table[((y) >> 8) & 0xFF] << 1)) << 16))
 
+static blockedmipmap_t *gen_blockedmipmap(const ri_texture_t *texture);
+static int               write_blockedmipmap(const char      *filename,
+                                             blockedmipmap_t *blkmipmap);
+static void              free_blockedmipmap(blockedmipmap_t *blkmipmap);
+static int               is_blockedmipmap_file(const char *filename);
+
 #if USE_ZORDER
 /* table for z curve order */
 static unsigned short g_z_table[256];
@@ -183,6 +180,39 @@ ri_texture_load(const char *filename)
     
     }
 
+    if (is_blockedmipmap_file(fullpath)) {
+
+        /*
+         * Blocked mipmap texture. Only the header is read here, and
+         * texels are paged in by the texture cache.
+         */
+        ri_blockedtex_t *btex;
+
+        btex = ri_blockedtex_open(fullpath);
+        if (!btex) {
+            ri_log(LOG_WARN, "(TexLdr) Can't load textue file \"%s\"", fullpath);
+            exit(-1);
+        }
+
+        p = ri_mem_alloc(sizeof(ri_texture_t));
+        assert(p != NULL);
+        memset(p, 0, sizeof(ri_texture_t));
+
+        p->width   = btex->width;
+        p->height  = btex->height;
+        p->data    = NULL;
+        p->blocked = btex;
+
+        (void)ri_texcache_get();
+
+        ri_log(LOG_INFO, "(TexLdr) Opened blocked texture [ %s ] size = %d x %d, %d levels", fullpath, btex->width, btex->height, btex->nlevels);
+
+        /* add to texture cache */
+        ri_hash_insert(texture_cache, filename, p);
+
+        return p;
+    }
+
     {
         unsigned int  width;
         unsigned int  height;
@@ -203,6 +233,9 @@ ri_texture_load(const char *filename)
         p->height = height;
         p->data   = image;
 
+        /* Mipmap for filtered fetch with ray differentials. */
+        p->mipmap = ri_texture_make_mipmap(p);
+
         ri_log(LOG_INFO, "(TexLdr) Loaded texture [ %s ] size = %d x %d", fullpath, width, height);
     }
 
@@ -221,10 +254,46 @@ ri_texture_load(const char *filename)
 void
 ri_texture_free(ri_texture_t *texture)
 {
+    int i;
+
+    if (texture->blocked) {
+        ri_blockedtex_close(texture->blocked);
+    }
+    if (texture->mipmap) {
+        /* Level 0 is texture->data. */
+        for (i = 1; i < texture->mipmap->nlevels; i++) {
+            ri_mem_free(texture->mipmap->data[i]);
+        }
+        ri_mem_free(texture->mipmap);
+    }
     ri_mem_free(texture->data);
     ri_mem_free(texture);
 }
 
+/*
+ * Converts a texture into the blocked mipmap texture file.
+ */
+int
+ri_texture_save_blocked(const char *filename, const ri_texture_t *texture)
+{
+    int              ret;
+    blockedmipmap_t *blkmipmap;
+
+    if (texture->data == NULL) {
+        ri_log(LOG_ERROR, "(TexLdr) No texels to save.");
+        return -1;
+    }
+
+    blkmipmap = gen_blockedmipmap(texture);
+    if (!blkmipmap) return -1;
+
+    ret = write_blockedmipmap(filename, blkmipmap);
+
+    free_blockedmipmap(blkmipmap);
+
+    return ret;
+}
+
 
 #if USE_ZORDER
 
@@ -362,28 +431,35 @@ make_texture(ri_rawtexture_t *rawtex)
 }
 
 //
-// Simple 2x2 -> 1x1 minification.
+// Simple 2x2 -> 1x1 minification. The last row and column of an odd sized
+// level are clamped.
 // TODO: Add sophisticated filtering when calculating mipmap.
 //
-static void gen_mipmap(float *dst, float *src, int srcw, int srch)
+static void gen_mipmap(float *dst, int dstw, int dsth,
+                       const float *src, int srcw, int srch)
 {
     
     int k;
     int w, h;
-    int dstw, dsth;
-
-    dstw = srcw / 2;
-    dsth = srch / 2;
+    int x0, x1, y0, y1;
 
     ri_float_t val[4];
 
     for (h = 0; h < dsth; h++) {
+
+        y0 = 2 * h;
+        y1 = (2 * h + 1 < srch) ? 2 * h + 1 : srch - 1;
+
         for (w = 0; w < dstw; w++) {
+
+            x0 = 2 * w;
+            x1 = (2 * w + 1 < srcw) ? 2 * w + 1 : srcw - 1;
+
             for (k = 0; k < 4; k++) {   /* RGBA */
-                val[0] = src[4 * ((2 * h + 0) * srcw + (2 * w + 0)) + k];
-                val[1] = src[4 * ((2 * h + 0) * srcw + (2 * w + 1)) + k];
-                val[2] = src[4 * ((2 * h + 1) * srcw + (2 * w + 0)) + k];
-                val[3] = src[4 * ((2 * h + 1) * srcw + (2 * w + 1)) + k];
+                val[0] = src[4 * (y0 * srcw + x0) + k];
+                val[1] = src[4 * (y0 * srcw + x1) + k];
+                val[2] = src[4 * (y1 * srcw + x0) + k];
+                val[3] = src[4 * (y1 * srcw + x1) + k];
 
                 dst[4 * (h * dstw + w) + k] =
                     0.25 * (val[0] + val[1] + val[2] + val[3]);
@@ -403,67 +479,40 @@ ri_mipmap_t *
 ri_texture_make_mipmap(
     const ri_texture_t *texture)
 {
-    int max_size;
-    int nlevels;
-
+    int          i;
+    int          w, h;
     ri_mipmap_t *mipmap;
 
-    if (texture->width > texture->height) {
-        max_size = texture->width;
-    } else {
-        max_size = texture->height;
-    }
-
-    /*
-     * 1. Calculate the number of mipmap levels.
-     */
-    {
-        int size     = max_size;
-        nlevels      = 0;
-
-        while (size < 2) {
-            nlevels++;
-            size /= 2;
-        }
-    }
-
-    assert(nlevels < RI_MAX_MIPMAP_SIZE);
-
-    /*
-     * 2. Calculate mipmaps
-     */
-    {
-        int      i;
-        int      w, h;
-        float   *src;
-
-        mipmap  = (ri_mipmap_t *)ri_mem_alloc(sizeof(ri_mipmap_t));
-        w       = texture->width;
-        h       = texture->height;
+    mipmap = (ri_mipmap_t *)ri_mem_alloc(sizeof(ri_mipmap_t));
+    memset(mipmap, 0, sizeof(ri_mipmap_t));
 
-        mipmap->width[0]    = w;
-        mipmap->height[0]   = h;
-        mipmap->data[0]     = ri_mem_alloc(sizeof(float) * w * h * 4);
-        memcpy(&mipmap->data[0], texture->data, sizeof(float) * w * h * 4);
+    w = texture->width;
+    h = texture->height;
 
-        for (i = 1; i < nlevels; i++) {
+    mipmap->width[0]  = w;
+    mipmap->height[0] = h;
+    mipmap->data[0]   = texture->data;
+    mipmap->nlevels   = 1;
 
-            w /= 2; h /= 2;
+    for (i = 1; i < RI_MAX_MIPMAP_SIZE; i++) {
 
-            mipmap->width[i]    = w;
-            mipmap->height[i]   = h;
-            mipmap->data[i]     = ri_mem_alloc(sizeof(float) * w * h * 4);
+        if (w == 1 && h == 1) break;
 
-            src = mipmap->data[i-1];
+        w = (w > 1) ? w / 2 : 1;
+        h = (h > 1) ? h / 2 : 1;
 
-            gen_mipmap(mipmap->data[i], src, w, h);
+        mipmap->width[i]  = w;
+        mipmap->height[i] = h;
+        mipmap->data[i]   = (float *)ri_mem_alloc(sizeof(float) * w * h * 4);
 
-        }
+        gen_mipmap(mipmap->data[i], w, h,
+                   mipmap->data[i - 1],
+                   mipmap->width[i - 1], mipmap->height[i - 1]);
 
+        mipmap->nlevels++;
     }
 
     return mipmap;
-
 }
     
 
@@ -647,6 +696,7 @@ ri_texture_make_longlat_from_angularmap(
     ri_texture_t *dst;
 
     dst = (ri_texture_t *)ri_mem_alloc(sizeof(ri_texture_t));
+    memset(dst, 0, sizeof(ri_texture_t));
     dst->width  = longlat_width;
     dst->height = longlat_height;
     dst->data   = (float *)ri_mem_alloc(
@@ -659,90 +709,407 @@ ri_texture_make_longlat_from_angularmap(
     return dst;
 }
 
-#if 0   // TODO
-// Generate blocked mipmap from raw texture map.
-// TODO: implement.
+/*
+ * Generate blocked mipmap from a texture.
+ * Each level is minified from the previous level with a box filter. For an
+ * odd sized level, the last texel also covers the remaining column(row).
+ */
 static blockedmipmap_t *
-gen_blockedmipmap(const char *filename, ri_rawtexture_t *texture)
+gen_blockedmipmap(const ri_texture_t *texture)
 {
-    int i;
-    int w, h;
-    int xblocks, yblocks;
-    int miplevels;
-    int minsize;
-    int u, v;
+    int              i, k;
+    int              x, y;
+    int              sx, sy;
+    int              xs, xe, ys, ye;
+    int              w, h;
+    int              srcw, srch;
+    float            sum[4];
+    float           *src;
+    float           *dst;
+    blockedmipmap_t *blkmipmap;
+
+    if (texture->width <= 0 || texture->height <= 0) return NULL;
+
+    blkmipmap = (blockedmipmap_t *)ri_mem_alloc(sizeof(blockedmipmap_t));
+    memset(blkmipmap, 0, sizeof(blockedmipmap_t));
+
+    w = texture->width;
+    h = texture->height;
+
+    blkmipmap->width  = w;
+    blkmipmap->height = h;
+
+    blkmipmap->images[0] = (float *)ri_mem_alloc(sizeof(float) * w * h * 4);
+    memcpy(blkmipmap->images[0], texture->data, sizeof(float) * w * h * 4);
 
-    w = texture->width; h = texture->height;
+    for (i = 0; i < MAXMIPLEVEL; i++) {
 
-    xblocks = (int)ceil(w / TEXBLOCKSIZE);
-    yblocks = (int)ceil(h / TEXBLOCKSIZE);
+        blkmipmap->level_width[i]  = w;
+        blkmipmap->level_height[i] = h;
+        blkmipmap->nxblocks[i]     = (w + TEXBLOCKSIZE - 1) / TEXBLOCKSIZE;
+        blkmipmap->nyblocks[i]     = (h + TEXBLOCKSIZE - 1) / TEXBLOCKSIZE;
+        blkmipmap->nmiplevels      = i + 1;
 
-    ri_log(LOG_INFO, "texsize = (%d, %d). blocks = (%d, %d)\n",
-        w, h, xblocks, yblocks);
+        if ((w == 1 && h == 1) || (i == MAXMIPLEVEL - 1)) break;
 
-    minsize = (w < h) ? w : h;
-    miplevels = (int)ceil(log((ri_float_t)minsize) / log(2.0));
+        srcw = w;
+        srch = h;
+        src  = blkmipmap->images[i];
 
-    ri_log(LOG_INFO, "miplevels = %d\n", miplevels);
+        w = (w > 1) ? w / 2 : 1;
+        h = (h > 1) ? h / 2 : 1;
 
-    for (i = 0; i < miplevels; i++) {
+        dst = (float *)ri_mem_alloc(sizeof(float) * w * h * 4);
 
-        for (v = 0; v < yblocks; v++) {
-            for (u = 0; u < xblocks; u++) {
-                
+        for (y = 0; y < h; y++) {
+
+            ys = (srch > 1) ? 2 * y : 0;
+            ye = (y == h - 1) ? srch - 1 : 2 * y + 1;
+
+            for (x = 0; x < w; x++) {
+
+                xs = (srcw > 1) ? 2 * x : 0;
+                xe = (x == w - 1) ? srcw - 1 : 2 * x + 1;
+
+                sum[0] = sum[1] = sum[2] = sum[3] = 0.0f;
+
+                for (sy = ys; sy <= ye; sy++) {
+                    for (sx = xs; sx <= xe; sx++) {
+                        for (k = 0; k < 4; k++) {   /* RGBA */
+                            sum[k] += src[4 * (sy * srcw + sx) + k];
+                        }
+                    }
+                }
+
+                for (k = 0; k < 4; k++) {
+                    dst[4 * (y * w + x) + k] =
+                        sum[k] / (float)((xe - xs + 1) * (ye - ys + 1));
+                }
             }
         }
 
+        blkmipmap->images[i + 1] = dst;
     }
-    
-    return NULL;    // not yet implemented.
+
+    ri_log(LOG_INFO, "(TexLdr) texsize = (%d, %d). blocks = (%d, %d). miplevels = %d",
+        blkmipmap->width, blkmipmap->height,
+        blkmipmap->nxblocks[0], blkmipmap->nyblocks[0],
+        blkmipmap->nmiplevels);
+
+    return blkmipmap;
 }
 
-// Write mipmap to disk with zlib compression.
 static void
+free_blockedmipmap(blockedmipmap_t *blkmipmap)
+{
+    int i;
+
+    for (i = 0; i < blkmipmap->nmiplevels; i++) {
+        ri_mem_free(blkmipmap->images[i]);
+    }
+
+    ri_mem_free(blkmipmap);
+}
+
+// Write mipmap to disk(with zlib compression if available).
+static int
 write_blockedmipmap(const char *filename, blockedmipmap_t *blkmipmap)
 {
-    int i, j;
-    int u, v;
-    int size;
-    int xblocks, yblocks;
+    int       i, k;
+    int       u, v;
+    int       x, y;
+    int       sx, sy;
+    int       w, h;
+    int       n;
+    int       ntiles;
+    int       ival[5];
+    int       compressed = 0;
+    size_t    size;
+    long      table_pos;
+    uint64_t *offset;
+    float    *block;
+    float    *src;
+    FILE     *fp;
+#ifdef WITH_ZLIB
+    uLongf    zsize;
+    Bytef    *zbuf;
+#endif
 
-    gzFile *fp;
-    
-    fp = gzopen(filename, "wb");
+    fp = fopen(filename, "wb");
     if (!fp) {
-        
-        ri_log(LOG_ERROR, "Can't write file [%s]", filename);
+        ri_log(LOG_ERROR, "(TexLdr) Can't write file [%s]", filename);
+        return -1;
+    }
+
+#ifdef WITH_ZLIB
+    compressed = 1;
+#endif
+
+    ntiles = 0;
+    for (i = 0; i < blkmipmap->nmiplevels; i++) {
+        ntiles += blkmipmap->nxblocks[i] * blkmipmap->nyblocks[i];
     }
 
     // Write header
-    gzwrite(fp, &blkmipmap->nmiplevels, sizeof(int));
-    gzwrite(fp, &blkmipmap->width, sizeof(int));
-    gzwrite(fp, &blkmipmap->height, sizeof(int));
-    gzwrite(fp, &blkmipmap->nxblocks, sizeof(int));
-    gzwrite(fp, &blkmipmap->nyblocks, sizeof(int));
-    
-    size = sizeof(ri_float_t) * TEXBLOCKSIZE * TEXBLOCKSIZE;
-    
+    ival[0] = RI_BTEX_BYTEORDER;
+    fwrite(RI_BTEX_MAGIC, 1, 4, fp);
+    fwrite(&ival[0], sizeof(int), 1, fp);
+
+    ival[0] = blkmipmap->width;
+    ival[1] = blkmipmap->height;
+    ival[2] = TEXBLOCKSIZE;
+    ival[3] = blkmipmap->nmiplevels;
+    ival[4] = compressed;
+    fwrite(ival, sizeof(int), 5, fp);
+
+    fwrite(blkmipmap->level_width,  sizeof(int), blkmipmap->nmiplevels, fp);
+    fwrite(blkmipmap->level_height, sizeof(int), blkmipmap->nmiplevels, fp);
+
+    // Tile offsets are filled after writing tiles.
+    offset = (uint64_t *)ri_mem_alloc(sizeof(uint64_t) * (ntiles + 1));
+    memset(offset, 0, sizeof(uint64_t) * (ntiles + 1));
+
+    table_pos = ftell(fp);
+    fwrite(offset, sizeof(uint64_t), ntiles + 1, fp);
+
+    size  = sizeof(float) * 4 * (TEXBLOCKSIZE + 1) * (TEXBLOCKSIZE + 1);
+    block = (float *)ri_mem_alloc(size);
+
+#ifdef WITH_ZLIB
+    zbuf  = (Bytef *)ri_mem_alloc(compressBound(size));
+#endif
+
+    n = 0;
+
     for (i = 0; i < blkmipmap->nmiplevels; i++) {
 
-        xblocks = blkmipmap->nxblocks >> i;
-        yblocks = blkmipmap->nyblocks >> i;
+        w   = blkmipmap->level_width[i];
+        h   = blkmipmap->level_height[i];
+        src = blkmipmap->images[i];
 
-        for (v = 0; v < yblocks; v++) {
-            for (u = 0; u < xblocks; u++) {
+        for (v = 0; v < blkmipmap->nyblocks[i]; v++) {
+            for (u = 0; u < blkmipmap->nxblocks[i]; u++) {
 
-                j = v * xblocks + u;
+                // Cut out the block with one texel border, clamped to
+                // the edge of the level.
+                for (y = 0; y <= TEXBLOCKSIZE; y++) {
 
-                // Write texture block.
-                gzwrite(fp, blkmipmap->blocks[i][j].image,
-                    size);
+                    sy = v * TEXBLOCKSIZE + y;
+                    if (sy > h - 1) sy = h - 1;
 
+                    for (x = 0; x <= TEXBLOCKSIZE; x++) {
+
+                        sx = u * TEXBLOCKSIZE + x;
+                        if (sx > w - 1) sx = w - 1;
+
+                        for (k = 0; k < 4; k++) {
+                            block[4 * (y * (TEXBLOCKSIZE + 1) + x) + k] =
+                                src[4 * (sy * w + sx) + k];
+                        }
+                    }
+                }
+
+                offset[n++] = (uint64_t)ftell(fp);
+
+                // Write texture block.
+#ifdef WITH_ZLIB
+                zsize = compressBound(size);
+                compress2(zbuf, &zsize, (const Bytef *)block, size, 6);
+                fwrite(zbuf, 1, zsize, fp);
+#else
+                fwrite(block, 1, size, fp);
+#endif
             }
         }
 
     }
 
-    gzclose(fp);
+    offset[ntiles] = (uint64_t)ftell(fp);
+
+    fseek(fp, table_pos, SEEK_SET);
+    fwrite(offset, sizeof(uint64_t), ntiles + 1, fp);
+
+    if (ferror(fp)) {
+        ri_log(LOG_ERROR, "(TexLdr) Failed to write file [%s]", filename);
+        fclose(fp);
+        ri_mem_free(offset);
+        ri_mem_free(block);
+#ifdef WITH_ZLIB
+        ri_mem_free(zbuf);
+#endif
+        return -1;
+    }
+
+    fclose(fp);
+
+    ri_log(LOG_INFO, "(TexLdr) Wrote %d blocks to [%s]", ntiles, filename);
+
+    ri_mem_free(offset);
+    ri_mem_free(block);
+#ifdef WITH_ZLIB
+    ri_mem_free(zbuf);
+#endif
+
+    return 0;
+}
+
+static int
+is_blockedmipmap_file(const char *filename)
+{
+    const char *ext;
+
+    ext = strrchr(filename, '.');
+    if (ext == NULL) return 0;
+
+    return (strcmp(ext, ".btex") == 0) || (strcmp(ext, ".BTEX") == 0);
+}
+
+ri_blockedtex_t *
+ri_blockedtex_open(const char *filename)
+{
+    static int       id = 0;
+    int              i;
+    int              ival[5];
+    char             magic[4];
+    ri_blockedtex_t *btex;
+    FILE            *fp;
+
+    fp = fopen(filename, "rb");
+    if (!fp) return NULL;
+
+    if (fread(magic, 1, 4, fp) != 4 ||
+        memcmp(magic, RI_BTEX_MAGIC, 4) != 0 ||
+        fread(&ival[0], sizeof(int), 1, fp) != 1 ||
+        ival[0] != RI_BTEX_BYTEORDER) {
+        ri_log(LOG_ERROR, "(TexLdr) [%s] is not a blocked texture of this host.",
+               filename);
+        fclose(fp);
+        return NULL;
+    }
+
+    if (fread(ival, sizeof(int), 5, fp) != 5 ||
+        ival[0] <= 0 || ival[1] <= 0 ||
+        ival[2] != RI_BTEX_TILESIZE ||
+        ival[3] <= 0 || ival[3] > MAXMIPLEVEL) {
+        ri_log(LOG_ERROR, "(TexLdr) Invalid header of [%s].", filename);
+        fclose(fp);
+        return NULL;
+    }
+
+#ifndef WITH_ZLIB
+    if (ival[4]) {
+        ri_log(LOG_ERROR, "(TexLdr) [%s] is compressed, "
+                          "but zlib is not available.", filename);
+        fclose(fp);
+        return NULL;
+    }
+#endif
+
+    btex = (ri_blockedtex_t *)ri_mem_alloc(sizeof(ri_blockedtex_t));
+    memset(btex, 0, sizeof(ri_blockedtex_t));
+
+    btex->width      = ival[0];
+    btex->height     = ival[1];
+    btex->tilesize   = ival[2];
+    btex->nlevels    = ival[3];
+    btex->compressed = ival[4];
+    btex->scale      = 1.0f;
+
+    fread(btex->level_width,  sizeof(int), btex->nlevels, fp);
+    fread(btex->level_height, sizeof(int), btex->nlevels, fp);
+
+    btex->ntiles = 0;
+    for (i = 0; i < btex->nlevels; i++) {
+        btex->nxtiles[i]    = (btex->level_width[i]  + btex->tilesize - 1) /
+                              btex->tilesize;
+        btex->nytiles[i]    = (btex->level_height[i] + btex->tilesize - 1) /
+                              btex->tilesize;
+        btex->first_tile[i] = btex->ntiles;
+        btex->ntiles       += btex->nxtiles[i] * btex->nytiles[i];
+    }
+
+    btex->offset = (uint64_t *)ri_mem_alloc(sizeof(uint64_t) *
+                                            (btex->ntiles + 1));
+
+    if (fread(btex->offset, sizeof(uint64_t), btex->ntiles + 1, fp) !=
+        (size_t)(btex->ntiles + 1)) {
+        ri_log(LOG_ERROR, "(TexLdr) Invalid header of [%s].", filename);
+        fclose(fp);
+        ri_mem_free(btex->offset);
+        ri_mem_free(btex);
+        return NULL;
+    }
+
+    btex->fp    = fp;
+    btex->mutex = ri_mutex_new();
+    ri_mutex_init(btex->mutex);
+    btex->id    = id++;
+
+    return btex;
+}
+
+void
+ri_blockedtex_close(ri_blockedtex_t *btex)
+{
+    if (btex == NULL) return;
+
+    fclose(btex->fp);
+    ri_mutex_free(btex->mutex);
+    ri_mem_free(btex->offset);
+    ri_mem_free(btex);
 }
+
+int
+ri_blockedtex_read_tile(
+    const ri_blockedtex_t *btex,
+    int                    index,
+    float                 *texels)
+{
+    int       ret = 0;
+    size_t    size;
+    size_t    nbytes;
+#ifdef WITH_ZLIB
+    uLongf    len;
+    Bytef    *zbuf;
 #endif
+
+    if (index < 0 || index >= btex->ntiles) return -1;
+
+    size   = sizeof(float) * 4 * (btex->tilesize + 1) * (btex->tilesize + 1);
+    nbytes = (size_t)(btex->offset[index + 1] - btex->offset[index]);
+
+    ri_mutex_lock(btex->mutex);
+
+    if (fseek(btex->fp, (long)btex->offset[index], SEEK_SET) != 0) {
+
+        ret = -1;
+
+    } else if (btex->compressed) {
+
+#ifdef WITH_ZLIB
+        zbuf = (Bytef *)ri_mem_alloc(nbytes);
+
+        len = size;
+        if (fread(zbuf, 1, nbytes, btex->fp) != nbytes ||
+            uncompress((Bytef *)texels, &len, zbuf, nbytes) != Z_OK ||
+            len != size) {
+            ret = -1;
+        }
+
+        ri_mem_free(zbuf);
+#else
+        ret = -1;
+#endif
+
+    } else {
+
+        if (nbytes != size || fread(texels, 1, size, btex->fp) != size) {
+            ret = -1;
+        }
+
+    }
+
+    ri_mutex_unlock(btex->mutex);
+
+    return ret;
+}
@@ -367,7 +367,7 @@ ri_ugrid_free(void *accel)
         }
     }
 
-    ri_mem_free(ugrid->tridata);
+    ri_mem_free_aligned(ugrid->tridata);
 
     ri_mem_free(ugrid);
 }
@@ -543,7 +543,7 @@ conv_simd(ri_ugrid_t *ugrid,
      * 9 = (xyz 3 components) * (3 vertices) = compose 1 triangle
      */
     /* allocate 16-byte aligned memory */
-    ugrid->tridata = ri_mem_alloc_aligned(4 * 9 * nblocks, 16);
+    ugrid->tridata = ri_mem_alloc_aligned(sizeof(float) * 4 * 9 * nblocks, 16);
 
     for (z = 0; z < zvoxels; z++) {
         for (y = 0; y < yvoxels; y++) {
@@ -631,7 +631,7 @@ copy_simd(ri_tri_list_t *dst)
      * 9 = (xyz 3 components) * (3 vertices) = 1 triangle
      */
     /* allocate 16-byte aligned memory */
-    simdinfo->tridata = ri_mem_alloc_aligned(4 * 9 * nblocks, 16);
+    simdinfo->tridata = ri_mem_alloc_aligned(sizeof(float) * 4 * 9 * nblocks, 16);
 
     simdinfo->geoms = (ri_geom_t **)ri_mem_alloc(
                 sizeof(ri_geom_t *) * nblocks * 4);
@@ -783,7 +783,7 @@ copy_simd_flat(ri_ugrid_t *ugrid, int xvoxels, int yvoxels, int zvoxels)
                 array_idx += simdinfo->nblocks * 4 * 9;
 
                 /* frees unflatten simd data array */
-                ri_mem_free(simdinfo->tridata);
+                ri_mem_free_aligned(simdinfo->tridata);
             }
         }
     }
@@ -21,6 +21,7 @@
 #include "util.h"
 #include "render.h"
 #include "log.h"
+#include "memory.h"
 
 RtVoid
 RiBegin(RtToken name)
@@ -41,16 +42,13 @@ RiEnd(void)
 RtVoid
 RiFrameBegin(RtInt frame)
 {
-    ri_log_once(LOG_WARN, "(RI    ) RiFrameBegin() is not yet implemented, ignored.");
-    //ri_api_frame_begin(frame);
-    (void)frame;
+    ri_api_frame_begin(frame);
 }
 
 RtVoid
 RiFrameEnd(void)
 {
-    ri_log_once(LOG_WARN, "(RI    ) RiFrameEnd() is not yet implemented, ignored.");
-    //ri_api_frame_end();
+    ri_api_frame_end();
 }
 
 RtToken
@@ -579,9 +577,7 @@ RiShadingInterpolation(RtToken type)
 RtVoid
 RiShutter(RtFloat min, RtFloat max)
 {
-    ri_log_once(LOG_WARN, "(RI    ) RiShutter() is not yet implemented, ignored.");
-    (void)min;
-    (void)max;
+    ri_api_shutter(min, max);
 }
 
 RtVoid
@@ -788,23 +784,59 @@ RiMatte(RtBoolean onoff)
 RtVoid
 RiMotionBegin(RtInt n, ...)
 {
-    ri_log_once(LOG_WARN, "(RI    ) RiMotionBegin() is not yet implemented, ignored.");
-    (void)n;
+    int      i;
+    va_list  args;
+    RtFloat *times;
+
+    if (n < 1) {
+        RiMotionBeginV(n, NULL);
+        return;
+    }
+
+    times = (RtFloat *)ri_mem_alloc(sizeof(RtFloat) * n);
+
+    va_start(args, n);
 
+    /* float is promoted to double in variable arguments. */
+    for (i = 0; i < n; i++) {
+        times[i] = (RtFloat)va_arg(args, double);
+    }
+
+    va_end(args);
+
+    RiMotionBeginV(n, times);
+
+    ri_mem_free(times);
 }
 
 RtVoid
 RiMotionBeginV(RtInt n, RtFloat times[])
 {
-    ri_log_once(LOG_WARN, "(RI    ) RiMotionBeginV() is not yet implemented, ignored.");
-    (void)n;
-    (void)times;
+    ri_api_motion_begin(n, times);
 }
 
 RtVoid
 RiMotionEnd()
 {
-    ri_log_once(LOG_WARN, "(RI    ) RiMotionEnd() is not yet implemented, ignored.");
+    ri_api_motion_end();
+}
+
+RtObjectHandle
+RiObjectBegin(void)
+{
+    return ri_api_object_begin();
+}
+
+RtVoid
+RiObjectEnd(void)
+{
+    ri_api_object_end();
+}
+
+RtVoid
+RiObjectInstance(RtObjectHandle handle)
+{
+    ri_api_object_instance(handle);
 }
 
 RtVoid
@@ -23,10 +23,8 @@ extern void ri_api_world_end  ();
 
 extern RtToken ri_api_declare(char *name, char *declaration);
 
-#if 0   // TODO
 extern void ri_api_frame_begin(RtInt frame);
 extern void ri_api_frame_end();
-#endif
 
 /* options */
 extern void ri_api_format            (RtInt     xresplution,
@@ -162,6 +160,11 @@ extern void ri_patch_mesh            (RtToken   type,
 extern void ri_api_transform_begin();
 extern void ri_api_transform_end  ();
 
+/* motion block */
+extern void ri_api_motion_begin   (RtInt     n,
+                                   RtFloat   times[]);
+extern void ri_api_motion_end     ();
+
 extern void ri_api_orientation(RtToken orientation);
 
 extern void ri_api_polygon       (RtInt nverts,
@@ -187,6 +190,11 @@ extern void ri_api_imager(RtToken name,
 
 extern void ri_api_sides(RtInt sides);
 
+/* object instancing(render/instance.c) */
+extern RtObjectHandle ri_api_object_begin   ();
+extern void           ri_api_object_end     ();
+extern void           ri_api_object_instance(RtObjectHandle handle);
+
 extern void ri_api_hider(RtToken type,
              RtInt n, RtToken tokens[], RtPointer params[]);
 
@@ -90,6 +90,13 @@ ri_api_attribute_begin()
 
     ri_stack_push(ctx->trans_stack, (void *)newmat);
 
+    mat = (ri_matrix_t *)ri_stack_get(ctx->trans_close_stack);
+    ri_log_and_return_if(mat == NULL);
+
+    newmat = (ri_matrix_t *)ri_mem_alloc(sizeof(ri_matrix_t));
+    ri_matrix_copy(newmat, mat);
+
+    ri_stack_push(ctx->trans_close_stack, (void *)newmat);
 
     attr = (ri_attribute_t *)ri_stack_get(ctx->attr_stack);
     ri_log_and_return_if(attr == NULL);
@@ -146,6 +153,13 @@ ri_api_attribute_end()
 
     ri_stack_pop(ri_render_get()->context->trans_stack);
 
+    mat = (ri_matrix_t *)ri_stack_get(ctx->trans_close_stack);
+    ri_log_and_return_if(mat == NULL);
+
+    ri_matrix_free(mat);
+
+    ri_stack_pop(ctx->trans_close_stack);
+
     attr = (ri_attribute_t *)ri_stack_get(ctx->attr_stack);
 
     if (attr != NULL) {
@@ -350,6 +350,39 @@ ri_camera_get_pos_and_dir(
     }
 }
 
+void
+ri_camera_get_differentials(
+    ri_vector_t        dPdx,  /* [out] */
+    ri_vector_t        dPdy,  /* [out] */
+    ri_vector_t        dDdx,  /* [out] */
+    ri_vector_t        dDdy,  /* [out] */
+    const ri_camera_t *camera,
+    ri_float_t         x,
+    ri_float_t         y)
+{
+    ri_vector_t         pos, dir;
+    ri_vector_t         xpos, xdir;
+    ri_vector_t         ypos, ydir;
+
+    /*
+     * The projection is linear in (x, y) before normalization of the
+     * direction, so the difference to the ray one pixel away is exact
+     * for the origin and accurate enough for the direction.
+     */
+    ri_camera_get_pos_and_dir( pos,  dir,  camera, x,       y       );
+    ri_camera_get_pos_and_dir( xpos, xdir, camera, x + 1.0, y       );
+    ri_camera_get_pos_and_dir( ypos, ydir, camera, x,       y + 1.0 );
+
+    ri_vector_normalize( dir );
+    ri_vector_normalize( xdir );
+    ri_vector_normalize( ydir );
+
+    vsub( dPdx, xpos, pos );
+    vsub( dPdy, ypos, pos );
+    vsub( dDdx, xdir, dir );
+    vsub( dDdy, ydir, dir );
+}
+
 /* -----------------------------------------------------------------------------
  *
  * RenderMan Interface implemenataion
@@ -471,8 +504,6 @@ void
 ri_api_shutter(
     RtFloat min, RtFloat max )
 {
-    ri_log( LOG_WARN, "(Camera) RiShutter is not yet implemented" );
-
     ri_render_get()->context->option->camera->shutter_open  = min;
     ri_render_get()->context->option->camera->shutter_close = max;
 }
@@ -112,6 +112,19 @@ extern void ri_camera_get_pos_and_dir(
     ri_float_t          x,
     ri_float_t          y);
 
+/*
+ * Differentials of the ray origin and the normalized ray direction of
+ * ri_camera_get_pos_and_dir() w.r.t. the raster position (x, y).
+ */
+extern void ri_camera_get_differentials(
+    ri_vector_t         dPdx,   /* [out] */
+    ri_vector_t         dPdy,   /* [out] */
+    ri_vector_t         dDdx,   /* [out] */
+    ri_vector_t         dDdy,   /* [out] */
+    const ri_camera_t  *camera,
+    ri_float_t          x,
+    ri_float_t          y);
+
 #ifdef __cplusplus
 }       /* extern "C" */
 #endif
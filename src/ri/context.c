@@ -28,12 +28,21 @@ ri_context_new()
 
 	ctx->option          = ri_option_new();
 	ctx->trans_stack     = ri_stack_new();
+	ctx->trans_close_stack = ri_stack_new();
 	ctx->attr_stack      = ri_stack_new();
 	ctx->timer           = ri_timer_new();
 	ctx->declares        = ri_hash_new();
 	ctx->world_block     = 0;
+	ctx->frame_block     = 0;
+	ctx->frame_number    = 0;
 	ctx->arealight_block = 0;
 
+	ctx->motion_block    = 0;
+	ctx->motion_nsamples = 0;
+	ctx->motion_sample   = 0;
+	ctx->motion_times[0] = 0.0f;
+	ctx->motion_times[1] = 0.0f;
+
 	ctx->world_begin_cb  = NULL;
 	ctx->world_end_cb    = NULL;
 	ctx->render_end_cb   = NULL;
@@ -43,6 +52,10 @@ ri_context_new()
 	ri_matrix_identity(ident);
 	ri_stack_push(ctx->trans_stack, (void *)ident);
 
+	ident = ri_matrix_new();
+	ri_matrix_identity(ident);
+	ri_stack_push(ctx->trans_close_stack, (void *)ident);
+
 	/* add default attribute state */
 	attr = ri_attribute_new();
 	ri_stack_push(ctx->attr_stack, (void *)attr);
@@ -68,6 +81,14 @@ ri_context_free(ri_context_t *ctx)
 	}
 	ri_stack_free(ctx->trans_stack);
 
+	matptr = (ri_matrix_t *)ri_stack_get(ctx->trans_close_stack);
+	while (matptr != NULL) {
+		ri_matrix_free(matptr);
+		ri_stack_pop(ctx->trans_close_stack);
+		matptr = (ri_matrix_t *)ri_stack_get(ctx->trans_close_stack);
+	}
+	ri_stack_free(ctx->trans_close_stack);
+
 	attrptr = (ri_attribute_t *)ri_stack_get(ctx->attr_stack);
 	while (attrptr != NULL) {
 		ri_attribute_free(attrptr);
@@ -79,6 +100,32 @@ ri_context_free(ri_context_t *ctx)
 	ri_mem_free(ctx);
 }
 
+void
+ri_context_motion_weights(const ri_context_t *ctx,
+			  ri_float_t         *open,
+			  ri_float_t         *close)
+{
+	ri_camera_t *camera = ctx->option->camera;
+	ri_float_t   t0, t1;
+
+	t0 = ctx->motion_times[0];
+	t1 = ctx->motion_times[1];
+
+	if (t1 - t0 <= 0.0) {
+		(*open)  = 0.0;
+		(*close) = 0.0;
+		return;
+	}
+
+	(*open)  = (camera->shutter_open  - t0) / (t1 - t0);
+	(*close) = (camera->shutter_close - t0) / (t1 - t0);
+
+	/* No motion blur without a shutter interval. */
+	if (camera->shutter_close <= camera->shutter_open) {
+		(*close) = (*open);
+	}
+}
+
 void
 ri_api_transform_begin()
 {
@@ -95,6 +142,19 @@ ri_api_transform_begin()
 	ri_matrix_copy(newmat, mat);
 
 	ri_stack_push(ri_render_get()->context->trans_stack, (void *)newmat);
+
+	/* Same for the transformation at shutter close. */
+	newmat = (ri_matrix_t *)ri_mem_alloc(sizeof(ri_matrix_t));
+
+	mat = (ri_matrix_t *)ri_stack_get(
+				ri_render_get()->context->trans_close_stack);
+
+	ri_log_and_return_if(mat == NULL);
+
+	ri_matrix_copy(newmat, mat);
+
+	ri_stack_push(ri_render_get()->context->trans_close_stack,
+		      (void *)newmat);
 }
 
 void
@@ -110,6 +170,15 @@ ri_api_transform_end()
 	ri_matrix_free(mat);
 
 	ri_stack_pop(ri_render_get()->context->trans_stack);
+
+	mat = (ri_matrix_t *)ri_stack_get(
+				ri_render_get()->context->trans_close_stack);
+
+	ri_log_and_return_if(mat == NULL);
+
+	ri_matrix_free(mat);
+
+	ri_stack_pop(ri_render_get()->context->trans_close_stack);
 }
 
 void
@@ -140,6 +209,24 @@ ri_api_world_begin()
 	
 	ri_render_get()->context->world_block++;
 
+	/*
+	 * Timing statistics are reported per frame. The timers of the first
+	 * frame were started in ri_render_init() and lsh/main.c.
+	 */
+	if (ri_render_get()->scene->nframes > 0) {
+		ri_timer_free(ri_render_get()->context->timer);
+		ri_render_get()->context->timer = ri_timer_new();
+		ri_timer_start(ri_render_get()->context->timer,
+			       "TOTAL rendering time");
+		ri_timer_start(ri_render_get()->context->timer, "RIB parsing");
+	}
+
+	/*
+	 * Drop the scene description of the previous frame. Its accel is
+	 * updated for this frame in ri_scene_setup().
+	 */
+	ri_scene_begin_frame(ri_render_get()->scene);
+
 	/* copy current transformation matrix to world_to_camera */
 	m = (ri_matrix_t *)ri_stack_get(ri_render_get()->context->trans_stack);
 	if (m != NULL) {
@@ -152,6 +239,12 @@ ri_api_world_begin()
 
 	ri_stack_push(ri_render_get()->context->trans_stack, (void *)ident);
 
+	ident = ri_matrix_new();
+	ri_matrix_identity(ident);
+
+	ri_stack_push(ri_render_get()->context->trans_close_stack,
+		      (void *)ident);
+
 	if (ri_render_get()->context->world_begin_cb) {
 		ri_render_get()->context->world_begin_cb();
 	}
@@ -177,6 +270,83 @@ ri_api_world_end()
 	if (ri_render_get()->context->world_end_cb) {
 		ri_render_get()->context->world_end_cb();
 	}
+
+	/* Restore the transformation at RiWorldBegin(). */
+	ri_api_transform_end();
+}
+
+/*
+ * Frames share the scene, thus geometries not changed from the previous
+ * frame do not cost the accel build(see ri_scene_begin_frame()).
+ * The transformation and attributes are restored at RiFrameEnd().
+ */
+void
+ri_api_frame_begin(RtInt frame)
+{
+	ri_render_get()->context->frame_block++;
+	ri_render_get()->context->frame_number = frame;
+
+	ri_log(LOG_INFO, "(RI    ) Frame %d", frame);
+
+	ri_api_transform_begin();
+	ri_api_attribute_begin();
+}
+
+void
+ri_api_frame_end()
+{
+	ri_log_and_return_if(ri_render_get()->context->frame_block == 0);
+	ri_render_get()->context->frame_block--;
+
+	ri_api_attribute_end();
+	ri_api_transform_end();
+}
+
+/*
+ * Motion blur. Transformations and geometries given in the block are the
+ * samples at `times'. Only the first and the last samples are used: they
+ * are mapped to shutter open and close(see ri_context_motion_weights()),
+ * and rays see them linearly interpolated by their time.
+ */
+void
+ri_api_motion_begin(RtInt n, RtFloat times[])
+{
+	ri_context_t *ctx = ri_render_get()->context;
+
+	if (ctx->motion_block) {
+		ri_log(LOG_WARN, "(RI    ) Nested RiMotionBegin() is not allowed");
+		return;
+	}
+
+	if (n < 1) {
+		ri_log(LOG_WARN, "(RI    ) RiMotionBegin() without time samples");
+		return;
+	}
+
+	if (n > 2) {
+		ri_log_once(LOG_INFO, "(RI    ) Motion is linear between the first and the last sample. Intermediate samples are ignored.");
+	}
+
+	ctx->motion_block    = 1;
+	ctx->motion_nsamples = n;
+	ctx->motion_sample   = 0;
+	ctx->motion_times[0] = times[0];
+	ctx->motion_times[1] = times[n - 1];
+}
+
+void
+ri_api_motion_end()
+{
+	ri_context_t *ctx = ri_render_get()->context;
+
+	ri_log_and_return_if(ctx->motion_block == 0);
+
+	if (ctx->motion_sample != ctx->motion_nsamples) {
+		ri_log(LOG_WARN, "(RI    ) RiMotionBegin() has %d time samples, but %d are given",
+		       ctx->motion_nsamples, ctx->motion_sample);
+	}
+
+	ctx->motion_block = 0;
 }
 
 void
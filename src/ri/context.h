@@ -22,9 +22,24 @@ typedef struct _ri_context_t
 {
     ri_option_t     *option;
     ri_stack_t      *trans_stack;        /* transformation stack */
+    ri_stack_t      *trans_close_stack;  /* transformation at shutter close.
+                                            Pushed and popped together with
+                                            trans_stack. */
     ri_stack_t      *attr_stack;         /* attribute stack */
     unsigned int     world_block;
+    unsigned int     frame_block;
+    int              frame_number;       /* of the last RiFrameBegin() */
     unsigned int     arealight_block;              
+
+    /*
+     * RiMotionBegin()/RiMotionEnd() block. Each RI call in the block is
+     * counted as a motion sample.
+     */
+    unsigned int     motion_block;
+    int              motion_nsamples;
+    int              motion_sample;      /* # of samples given so far */
+    RtFloat          motion_times[2];    /* times of the first and the
+                                            last sample */
     ri_matrix_t      world_to_camera;    /*  World to camera
                                              transformation matrix */
     ri_timer_t      *timer;
@@ -39,6 +54,16 @@ typedef struct _ri_context_t
 extern ri_context_t *ri_context_new ();
 extern void          ri_context_free(ri_context_t *ctx);
 
+/*
+ * Weights to map the first and the last sample of the current motion block
+ * to shutter open and close. Motion is linear between the samples, thus
+ * the value at shutter open is (1 - open) * first + open * last, and
+ * likewise for close.
+ */
+extern void          ri_context_motion_weights(const ri_context_t *ctx,
+                                               ri_float_t         *open,
+                                               ri_float_t         *close);
+
 #ifdef __cplusplus
 }    /* extern "C" */
 #endif
@@ -129,6 +129,9 @@ ri_dd_callback(int (*opencb)(const char *name,
 	drv->open  = opencb;
 	drv->close = closecb;
 	drv->write = writecb;
+	drv->write_bucket  = NULL;
+	drv->update_bucket = NULL;
+	drv->concurrent    = 0;
 
 	ri_render_register_display_drv(ri_render_get(), "callback", drv);
 
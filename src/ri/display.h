@@ -76,6 +76,30 @@ typedef struct _ri_display_drv_t
 	int (* close)(void);
 	int (* write)(int x, int y, const void *pixel);
 	int (* progress)(void);
+
+	/*
+	 * Writes w x h pixels to (x, y) - (x + w - 1, y + h - 1) at once.
+	 * `rgba' is float RGBA pixels, `stride' is the number of floats
+	 * between rows. Coordinates are the same as write().
+	 * Optional(may be NULL).
+	 */
+	int (* write_bucket)(int x, int y, int w, int h,
+			     const float *rgba, int stride);
+
+	/*
+	 * Same as write_bucket(), but pixels replace what was written before
+	 * instead of being added. Progressive rendering uses this to send the
+	 * same bucket in every pass. Optional(may be NULL).
+	 */
+	int (* update_bucket)(int x, int y, int w, int h,
+			      const float *rgba, int stride);
+
+	/*
+	 * Non-zero if write_bucket() can be called from multiple threads
+	 * concurrently. Otherwise calls are serialized by the renderer.
+	 */
+	int concurrent;
+
 	char *name;
 	char *info;			/* DD information string */
 } ri_display_drv_t;
@@ -350,6 +350,7 @@ create_sunsky_image(const ri_sunsky_t *sunsky)
      * Precompute sunsky image(in angular map)
      */
     texture = ri_mem_alloc(sizeof(ri_texture_t));
+    memset(texture, 0, sizeof(ri_texture_t));
     texture->width  = size;
     texture->height = size;
     texture->data = ri_mem_alloc(sizeof(float) * size * size * 4);
@@ -395,6 +396,8 @@ create_sunsky_image(const ri_sunsky_t *sunsky)
         }
     }
 
+    texture->mipmap = ri_texture_make_mipmap(texture);
+
     return texture;
 
 }
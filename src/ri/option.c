@@ -30,6 +30,7 @@
 #include "render.h"
 #include "parallel.h"
 #include "transport.h"
+#include "texcache.h"
 
 typedef struct _opt_t
 {
@@ -98,8 +99,11 @@ ri_option_new()
 	p->narealight_rays           = 16;
 	p->max_ray_depth             = 5;
 
+	p->enable_irradcache         = 0;
 	p->irradcache_find_tolerance = 5.0;
-	p->irradcache_max_radius     = 1.0;
+	p->irradcache_max_radius     = 0.0;
+	p->irradcache_error          = 0.2;
+	p->irradcache_prepass        = 8;
 
 	p->bssrdf_nsamples           = 100;
 	p->bssrdf_scatter            = 2.19;
@@ -113,7 +117,19 @@ ri_option_new()
 	p->enable_caustics_lighting  = 0;
 	p->irradcache_file           = NULL;
 
+	p->photon_nglobal            = 200000;
+	p->photon_ncaustics          = 100000;
+	p->photon_estimate           = 100;
+	p->photon_maxdist            = 0.0;
+	p->photon_finalgather        = 1;
+	p->photon_globalmap_file     = NULL;
+	p->photon_causticmap_file    = NULL;
+	p->photon_dump_file          = NULL;
+	p->texture_cache_size        = RI_TEXCACHE_DEFAULT_SIZE;
+
 	p->accel_method              = RI_ACCEL_BVH;
+	p->accel_precision           = RI_ACCEL_PRECISION_DOUBLE;
+	p->accel_rebuild_threshold   = RI_ACCEL_REBUILD_THRESHOLD_DEFAULT;
 
 	p->compute_prt               = 0;
 	p->prt_is_glossy             = 0;
@@ -152,6 +168,17 @@ ri_option_new()
 	p->pixel_filter_widthy = 1.0;
 
 	p->do_adaptive_supersampling = 1;
+	p->adaptive_threshold        = 0.05f;
+	p->adaptive_max_samples      = 0;
+	p->adaptive_aov_file         = NULL;
+
+	p->do_progressive            = 0;
+	p->progressive_max_samples   = 0;
+	p->progressive_threshold     = 0.0f;
+	p->progressive_time          = 0.0f;
+
+	p->checkpoint_file           = NULL;
+	p->checkpoint_interval       = 60.0f;
 
 	return p;
 }
@@ -175,6 +202,30 @@ ri_option_free(ri_option_t *option)
 	ri_ptr_array_traverse(option->searchpath, free_func);
 	ri_ptr_array_free(option->searchpath);
 
+	if (option->adaptive_aov_file) {
+		free(option->adaptive_aov_file);
+	}
+
+	if (option->checkpoint_file) {
+		free(option->checkpoint_file);
+	}
+
+	if (option->irradcache_file) {
+		free(option->irradcache_file);
+	}
+
+	if (option->photon_globalmap_file) {
+		free(option->photon_globalmap_file);
+	}
+
+	if (option->photon_causticmap_file) {
+		free(option->photon_causticmap_file);
+	}
+
+	if (option->photon_dump_file) {
+		free(option->photon_dump_file);
+	}
+
 	ri_mem_free(option);
 }
 
@@ -460,6 +511,23 @@ ri_api_option(RtToken token, RtInt n, RtToken tokens[], RtPointer params[])
 					ctxopt->accel_method = RI_ACCEL_BVH;	
 					ri_log(LOG_INFO, "Use BVH");
 				}
+			} else if (strcmp(tokens[i], "accel_precision") == 0) {
+				tokp = (RtToken *)params[i];
+
+				if (strcmp(*tokp, "float") == 0) {
+					ctxopt->accel_precision =
+						RI_ACCEL_PRECISION_FLOAT;
+				} else if (strcmp(*tokp, "double") == 0) {
+					ctxopt->accel_precision =
+						RI_ACCEL_PRECISION_DOUBLE;
+				}
+			} else if (strcmp(tokens[i], "accel_rebuild_threshold") == 0) {
+				valp = (RtFloat *)params[i];
+
+				ctxopt->accel_rebuild_threshold = (*valp);
+				if (ctxopt->accel_rebuild_threshold < 1.0f) {
+					ctxopt->accel_rebuild_threshold = 1.0f;
+				}
 			}
 		}
 	} else if (strcmp(token, "lighting") == 0) {
@@ -532,6 +600,41 @@ ri_api_option(RtToken token, RtInt n, RtToken tokens[], RtPointer params[])
 				if (strcmp(*tokp, "no") == 0) {
 					ctxopt->do_adaptive_supersampling = 0;
 				}
+			} else if (strcmp(tokens[i], "adaptive_threshold") == 0) {
+				valp = (RtFloat *)params[i];
+				ctxopt->adaptive_threshold = (float)(*valp);
+			} else if (strcmp(tokens[i], "adaptive_maxsamples") == 0) {
+				ctxopt->adaptive_max_samples = to_int(params[i]);
+			} else if (strcmp(tokens[i], "adaptive_aov") == 0) {
+				tokp = (RtToken *)params[i];
+				if (ctxopt->adaptive_aov_file) {
+					free(ctxopt->adaptive_aov_file);
+				}
+				ctxopt->adaptive_aov_file = strdup(*tokp);
+			} else if (strcmp(tokens[i], "progressive") == 0) {
+				tokp = (RtToken *)params[i];
+				if (strcmp(*tokp, "yes") == 0) {
+					ctxopt->do_progressive = 1;
+				} else {
+					ctxopt->do_progressive = 0;
+				}
+			} else if (strcmp(tokens[i], "progressive_maxsamples") == 0) {
+				ctxopt->progressive_max_samples = to_int(params[i]);
+			} else if (strcmp(tokens[i], "progressive_threshold") == 0) {
+				valp = (RtFloat *)params[i];
+				ctxopt->progressive_threshold = (float)(*valp);
+			} else if (strcmp(tokens[i], "progressive_time") == 0) {
+				valp = (RtFloat *)params[i];
+				ctxopt->progressive_time = (float)(*valp);
+			} else if (strcmp(tokens[i], "checkpoint") == 0) {
+				tokp = (RtToken *)params[i];
+				if (ctxopt->checkpoint_file) {
+					free(ctxopt->checkpoint_file);
+				}
+				ctxopt->checkpoint_file = strdup(*tokp);
+			} else if (strcmp(tokens[i], "checkpoint_interval") == 0) {
+				valp = (RtFloat *)params[i];
+				ctxopt->checkpoint_interval = (float)(*valp);
 			}
 		}
 	} else if (strcmp(token, "mlt") == 0) {
@@ -548,6 +651,75 @@ ri_api_option(RtToken token, RtInt n, RtToken tokens[], RtPointer params[])
 				ctxopt->gather_nsamples = (int)(*valp);
 			}
 		}
+	} else if (strcmp(token, "irradcache") == 0) {
+		for (i = 0; i < n; i++) {
+			if (strcmp(tokens[i], "enable") == 0) {
+				tokp = (RtToken *)params[i];
+				if (strcmp(*tokp, "yes") == 0) {
+					ctxopt->enable_irradcache = 1;
+				} else {
+					ctxopt->enable_irradcache = 0;
+				}
+			} else if (strcmp(tokens[i], "error") == 0) {
+				valp = (RtFloat *)params[i];
+				ctxopt->irradcache_error = (double)(*valp);
+			} else if (strcmp(tokens[i], "max_radius") == 0) {
+				valp = (RtFloat *)params[i];
+				ctxopt->irradcache_max_radius = (double)(*valp);
+			} else if (strcmp(tokens[i], "prepass") == 0) {
+				ctxopt->irradcache_prepass = to_int(params[i]);
+			} else if (strcmp(tokens[i], "file") == 0) {
+				tokp = (RtToken *)params[i];
+				if (ctxopt->irradcache_file) {
+					free(ctxopt->irradcache_file);
+				}
+				ctxopt->irradcache_file = strdup(*tokp);
+			}
+		}
+	} else if (strcmp(token, "photon") == 0) {
+		for (i = 0; i < n; i++) {
+			if (strcmp(tokens[i], "nphotons") == 0) {
+				ctxopt->photon_nglobal = to_int(params[i]);
+			} else if (strcmp(tokens[i], "ncaustics") == 0) {
+				ctxopt->photon_ncaustics = to_int(params[i]);
+			} else if (strcmp(tokens[i], "estimate") == 0) {
+				ctxopt->photon_estimate = to_int(params[i]);
+			} else if (strcmp(tokens[i], "maxdist") == 0) {
+				valp = (RtFloat *)params[i];
+				ctxopt->photon_maxdist = (double)(*valp);
+			} else if (strcmp(tokens[i], "finalgather") == 0) {
+				tokp = (RtToken *)params[i];
+				if (strcmp(*tokp, "yes") == 0) {
+					ctxopt->photon_finalgather = 1;
+				} else {
+					ctxopt->photon_finalgather = 0;
+				}
+			} else if (strcmp(tokens[i], "globalmap") == 0) {
+				tokp = (RtToken *)params[i];
+				if (ctxopt->photon_globalmap_file) {
+					free(ctxopt->photon_globalmap_file);
+				}
+				ctxopt->photon_globalmap_file = strdup(*tokp);
+			} else if (strcmp(tokens[i], "causticmap") == 0) {
+				tokp = (RtToken *)params[i];
+				if (ctxopt->photon_causticmap_file) {
+					free(ctxopt->photon_causticmap_file);
+				}
+				ctxopt->photon_causticmap_file = strdup(*tokp);
+			} else if (strcmp(tokens[i], "dumpfile") == 0) {
+				tokp = (RtToken *)params[i];
+				if (ctxopt->photon_dump_file) {
+					free(ctxopt->photon_dump_file);
+				}
+				ctxopt->photon_dump_file = strdup(*tokp);
+			}
+		}
+	} else if (strcmp(token, "texture") == 0) {
+		for (i = 0; i < n; i++) {
+			if (strcmp(tokens[i], "cachesize") == 0) {
+				ctxopt->texture_cache_size = to_int(params[i]);
+			}
+		}
 	} else if (strcmp(token, "pathtrace") == 0) {
 		for (i = 0; i < n; i++) {
 			if (strcmp(tokens[i], "nsamples") == 0) {
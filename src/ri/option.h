@@ -54,8 +54,11 @@ typedef struct _ri_option_t
 	int          enable_irradcache; /* do irradiance caching ? 	*/
 	double       irradcache_find_tolerance;
 	double       irradcache_insert_tolerance;
-	double       irradcache_max_radius;
-	char         *irradcache_file;
+	double       irradcache_max_radius;	/* 0 = from scene size	*/
+	double       irradcache_error;	/* allowed error `a' of [Ward88] */
+	int          irradcache_prepass;	/* pixel spacing of the
+					 * prepass. 0 = no prepass	*/
+	char         *irradcache_file;	/* records are saved here	*/
 	unsigned int bssrdf_nsamples;
 	double       bssrdf_scatter;
 	double       bssrdf_absorb;
@@ -66,7 +69,27 @@ typedef struct _ri_option_t
 	int          enable_indirect_lighting;
 	int          enable_caustics_lighting;
 
+	/*
+	 * Photon mapping. The global photon map is built if
+	 * indirect_lighting is enabled, the caustic photon map if
+	 * caustics_lighting is enabled.
+	 */
+	int          photon_nglobal;	/* photons stored in global map	*/
+	int          photon_ncaustics;	/* photons stored in caustic map */
+	int          photon_estimate;	/* photons in radiance estimate	*/
+	double       photon_maxdist;	/* 0 = from scene size		*/
+	int          photon_finalgather;
+	char        *photon_globalmap_file;	/* reused if exists	*/
+	char        *photon_causticmap_file;	/* reused if exists	*/
+	char        *photon_dump_file;	/* global map for pmapview	*/
+
+	int          texture_cache_size;	/* in MB, for blocked textures	*/
+
 	int          accel_method;
+	int          accel_precision;	/* RI_ACCEL_PRECISION_*		*/
+	float        accel_rebuild_threshold;	/* SAH degradation ratio
+						 * over which refitted
+						 * subtrees are rebuilt	*/
 
 	/* precompted radiance transfer options */
 	int          compute_prt;
@@ -104,7 +127,37 @@ typedef struct _ri_option_t
 	float        pixel_filter_widthx;	/* width of filter in x dir */
 	float        pixel_filter_widthy; 	/* width of filter in y dir */
 
+	/*
+	 * Adaptive supersampling. Pixels are first sampled with the display's
+	 * sampling rates, then refined until the relative error of the pixel
+	 * drops below adaptive_threshold or adaptive_max_samples is reached.
+	 * adaptive_max_samples = 0 means no refinement.
+	 */
 	int          do_adaptive_supersampling;
+	float        adaptive_threshold;
+	int          adaptive_max_samples;
+	char        *adaptive_aov_file;	   /* sample count image (.hdr) */
+
+	/*
+	 * Progressive rendering. The image is refined in passes and each pass
+	 * is sent to the display. Stops at progressive_max_samples(0 = use
+	 * PixelSamples), when all pixels reach progressive_threshold(0 =
+	 * none), or after progressive_time seconds(0 = none).
+	 * Adaptive supersampling options are not used in this mode.
+	 */
+	int          do_progressive;
+	int          progressive_max_samples;
+	float        progressive_threshold;
+	float        progressive_time;
+
+	/*
+	 * Checkpointing. Finished pixels(or the accumulation state in
+	 * progressive mode) are saved to checkpoint_file every
+	 * checkpoint_interval seconds. Rendering the same scene again resumes
+	 * from the file. NULL = no checkpoint.
+	 */
+	char        *checkpoint_file;
+	float        checkpoint_interval;
 
 } ri_option_t;
 
@@ -28,73 +28,178 @@
 #include "stack.h"
 
 
+/*
+ * Transformations which an RI call applies to: the current ones at shutter
+ * open and close. In RiMotionBegin()/RiMotionEnd() block, the first sample
+ * applies to the one at shutter open, the last sample to the one at shutter
+ * close, and the others are ignored.
+ *
+ * Returns the number of transformations stored in `targets'.
+ */
+static int
+get_targets(ri_matrix_t *targets[2])
+{
+	int           n = 0;
+	int           sample;
+	ri_context_t *ctx = ri_render_get()->context;
+
+	if (ctx->motion_block == 0) {
+		targets[n++] = (ri_matrix_t *)ri_stack_get(ctx->trans_stack);
+		targets[n++] = (ri_matrix_t *)ri_stack_get(ctx->trans_close_stack);
+		return n;
+	}
+
+	sample = ctx->motion_sample++;
+
+	if (sample == 0) {
+		targets[n++] = (ri_matrix_t *)ri_stack_get(ctx->trans_stack);
+	}
+
+	if (sample == ctx->motion_nsamples - 1) {
+		targets[n++] = (ri_matrix_t *)ri_stack_get(ctx->trans_close_stack);
+	}
+
+	return n;
+}
+
+/*
+ * Called after the RI call of a motion block is applied. At the last sample,
+ * maps the transformations at the first and the last sample times to the
+ * ones at shutter open and close.
+ */
+static void
+finish_motion_sample()
+{
+	int           i, j;
+	ri_float_t    wopen, wclose;
+	ri_matrix_t  *mopen, *mclose;
+	ri_matrix_t   first, last;
+	ri_context_t *ctx = ri_render_get()->context;
+
+	if (ctx->motion_block == 0) return;
+	if (ctx->motion_nsamples < 2) return;
+	if (ctx->motion_sample != ctx->motion_nsamples) return;
+
+	ri_context_motion_weights(ctx, &wopen, &wclose);
+
+	if ((wopen == 0.0) && (wclose == 1.0)) {
+		/* The samples are already at shutter open and close. */
+		return;
+	}
+
+	mopen  = (ri_matrix_t *)ri_stack_get(ctx->trans_stack);
+	mclose = (ri_matrix_t *)ri_stack_get(ctx->trans_close_stack);
+
+	ri_matrix_copy(&first, mopen);
+	ri_matrix_copy(&last,  mclose);
+
+	for (j = 0; j < 4; j++) {
+		for (i = 0; i < 4; i++) {
+			mopen->f[j][i]  = (1.0 - wopen)  * first.f[j][i]
+					+ wopen  * last.f[j][i];
+			mclose->f[j][i] = (1.0 - wclose) * first.f[j][i]
+					+ wclose * last.f[j][i];
+		}
+	}
+}
+
 void
 ri_api_identity(void)
 {
-	ri_matrix_t  *m;
+	int           i, n;
+	ri_matrix_t  *m[2];
+
+	n = get_targets(m);
 
-	m = (ri_matrix_t *)ri_stack_get(ri_render_get()->context->trans_stack);
+	for (i = 0; i < n; i++) {
+		ri_matrix_identity(m[i]);
+	}
 
-	ri_matrix_identity(m);
+	finish_motion_sample();
 }
 
 void
 ri_api_transform(RtMatrix transform)
 {
-	ri_matrix_t *m;
+	int          i, n;
+	ri_matrix_t *m[2];
 
-	// pointer to topmost transformation matrix stack
-	m = (ri_matrix_t *)ri_stack_get(ri_render_get()->context->trans_stack);
+	// pointers to topmost transformation matrix stacks
+	n = get_targets(m);
 
-	// m = transform
-	ri_matrix_set(m, transform); 
+	for (i = 0; i < n; i++) {
+		// m = transform
+		ri_matrix_set(m[i], transform); 
+	}
+
+	finish_motion_sample();
 }
 
 void
 ri_api_concat_transform(RtMatrix transform)
 {
-	ri_matrix_t *m;
+	int          i, n;
+	ri_matrix_t *m[2];
 	ri_matrix_t  tmp, trans;
 
-	// pointer to topmost transformation matrix stack
-	m = (ri_matrix_t *)ri_stack_get(ri_render_get()->context->trans_stack);
+	// pointers to topmost transformation matrix stacks
+	n = get_targets(m);
 
-	// m = m transform
-	ri_matrix_copy(&tmp, m); 
 	ri_matrix_set(&trans, transform); 
-	ri_matrix_mul(m, &trans, &tmp); 
+
+	for (i = 0; i < n; i++) {
+		// m = m transform
+		ri_matrix_copy(&tmp, m[i]); 
+		ri_matrix_mul(m[i], &trans, &tmp); 
+	}
+
+	finish_motion_sample();
 }
 
 void
 ri_api_translate(RtFloat dx, RtFloat dy, RtFloat dz)
 {
-	ri_matrix_t *m;
+	int          i, n;
+	ri_matrix_t *m[2];
 
-	// pointer to topmost transformation matrix stack
-	m = (ri_matrix_t *)ri_stack_get(ri_render_get()->context->trans_stack);
+	// pointers to topmost transformation matrix stacks
+	n = get_targets(m);
 
-	ri_matrix_translate(m, dx, dy, dz);
+	for (i = 0; i < n; i++) {
+		ri_matrix_translate(m[i], dx, dy, dz);
+	}
+
+	finish_motion_sample();
 }
 
 void
 ri_api_rotate(RtFloat angle, RtFloat dx, RtFloat dy, RtFloat dz)
 {
-	ri_matrix_t *m;
+	int          i, n;
+	ri_matrix_t *m[2];
+
+	// pointers to topmost transformation matrix stacks
+	n = get_targets(m);
 
-	// pointer to topmost transformation matrix stack
-	m = (ri_matrix_t *)ri_stack_get(ri_render_get()->context->trans_stack);
+	for (i = 0; i < n; i++) {
+		ri_matrix_rotate(m[i], angle, dx, dy, dz);
+	}
 
-	ri_matrix_rotate(m, angle, dx, dy, dz);
+	finish_motion_sample();
 }
 
 void
 ri_api_scale(RtFloat sx, RtFloat sy, RtFloat sz)
 {
-	ri_matrix_t *m;
+	int          i, n;
+	ri_matrix_t *m[2];
 
-	// pointer to topmost transformation matrix stack
-	m = (ri_matrix_t *)ri_stack_get(ri_render_get()->context->trans_stack);
+	// pointers to topmost transformation matrix stacks
+	n = get_targets(m);
 
-	ri_matrix_scale(m, sx, sy, sz);
+	for (i = 0; i < n; i++) {
+		ri_matrix_scale(m[i], sx, sy, sz);
+	}
 
+	finish_motion_sample();
 }
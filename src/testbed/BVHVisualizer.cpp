@@ -119,49 +119,31 @@ drawBoundingBoxWithColor(float bmin[4], float bmax[4], float col[4])
 
 }
 
-typedef struct _triangle_t {
-
-    ri_float_t v0x, v0y, v0z;
-    ri_float_t v1x, v1y, v1z;
-    ri_float_t v2x, v2y, v2z;
-
-    void       *geom;
-    uint32_t    index;
-
-} triangle_t;
-
 static void
-drawTriangles( ri_qbvh_node_t *node )
+drawTriangles( ri_bvh_t *bvh, uint32_t ref )
 {
-    float v[3][3];
-
-    int i;
-    triangle_t *triangles;
+    int i, k;
+    ri_bvh_triref_t *trirefs;
+    ri_geom_t *geom;
+    ri_vector_t *v;
     int ntriangles;
 
-    if (node == NULL) return;
-    if (!node->is_leaf) return;
+    if (RI_QBVH_IS_EMPTY(ref)) return;
+    if (!RI_QBVH_IS_LEAF(ref)) return;
 
-    triangles = (triangle_t *)node->child[0];
-    ntriangles = (int)node->child[1];
+    trirefs    = bvh->trirefs + bvh->leaves[RI_QBVH_LEAF_INDEX(ref)].offset;
+    ntriangles = bvh->leaves[RI_QBVH_LEAF_INDEX(ref)].ntriangles;
 
     glBegin(GL_TRIANGLES);
 
     for (i = 0; i < ntriangles; i++) {
 
-        v[0][0] = triangles[i].v0x;
-        v[0][1] = triangles[i].v0y;
-        v[0][2] = triangles[i].v0z;
-        v[1][0] = triangles[i].v1x;
-        v[1][1] = triangles[i].v1y;
-        v[1][2] = triangles[i].v1z;
-        v[2][0] = triangles[i].v2x;
-        v[2][1] = triangles[i].v2y;
-        v[2][2] = triangles[i].v2z;
+        geom = bvh->geoms[trirefs[i].geom_id];
 
-        glVertex3f( v[0][0], v[0][1], v[0][2] );
-        glVertex3f( v[1][0], v[1][1], v[1][2] );
-        glVertex3f( v[2][0], v[2][1], v[2][2] );
+        for (k = 0; k < 3; k++) {
+            v = &geom->positions[geom->indices[3 * trirefs[i].index + k]];
+            glVertex3d( (*v)[0], (*v)[1], (*v)[2] );
+        }
 
     }
 
@@ -171,82 +153,70 @@ drawTriangles( ri_qbvh_node_t *node )
 void
 BVHVisualizer::drawBVH()
 {
-    float colors[2][4] = {
+    float colors[4][4] = {
         {0.7f, 0.2f, 0.2f, 0.5f},
-        {0.2f, 0.7f, 0.2f, 0.5f} };
+        {0.7f, 0.5f, 0.2f, 0.5f},
+        {0.2f, 0.7f, 0.2f, 0.5f},
+        {0.2f, 0.5f, 0.7f, 0.5f} };
 
     ri_qbvh_node_t *node;
 
     node = this->getCurrentNode();
 
-    if (node->is_leaf) {
-        return;
-    }
-
     float bmin[3], bmax[3];
 
-    // printf("left\n");
-    // drawTriangles( node->child[0] );
-    // printf("right\n");
-    // drawTriangles( node->child[1] );
-
-    // left
-    bmin[0] = node->bbox[BMIN_X0] - 0.01;
-    bmin[1] = node->bbox[BMIN_Y0] - 0.01;
-    bmin[2] = node->bbox[BMIN_Z0] - 0.01;
-    bmax[0] = node->bbox[BMAX_X0] + 0.01;
-    bmax[1] = node->bbox[BMAX_Y0] + 0.01;
-    bmax[2] = node->bbox[BMAX_Z0] + 0.01;
-    drawBoundingBoxWithColor(bmin, bmax, colors[0]);
-
-    // right
-    bmin[0] = node->bbox[BMIN_X1] - 0.01;
-    bmin[1] = node->bbox[BMIN_Y1] - 0.01;
-    bmin[2] = node->bbox[BMIN_Z1] - 0.01;
-    bmax[0] = node->bbox[BMAX_X1] + 0.01;
-    bmax[1] = node->bbox[BMAX_Y1] + 0.01;
-    bmax[2] = node->bbox[BMAX_Z1] + 0.01;
-    drawBoundingBoxWithColor(bmin, bmax, colors[1]);
-
-}
-
-int
-BVHVisualizer::followLeft()
-{
-    ri_qbvh_node_t *nextNode;
-
-    if (this->getCurrentNode()->is_leaf) {
+    for (int i = 0; i < 4; i++) {
 
-        return 1;
+        if (RI_QBVH_IS_EMPTY(node->child[i])) continue;
 
-    } else {
+        // drawTriangles( this->bvh, node->child[i] );
 
-        nextNode = this->getCurrentNode()->child[0];
+        bmin[0] = node->bbox[BMIN_X0 + i] - 0.01;
+        bmin[1] = node->bbox[BMIN_Y0 + i] - 0.01;
+        bmin[2] = node->bbox[BMIN_Z0 + i] - 0.01;
+        bmax[0] = node->bbox[BMAX_X0 + i] + 0.01;
+        bmax[1] = node->bbox[BMAX_Y0 + i] + 0.01;
+        bmax[2] = node->bbox[BMAX_Z0 + i] + 0.01;
+        drawBoundingBoxWithColor(bmin, bmax, colors[i]);
 
-        this->nodeStack.push_back(nextNode);
     }
 
-    return 0;
 }
 
+//
+// Follow the first inner node in the left(child[0:1]) or right(child[2:3])
+// half of the current node.
+//
 int
-BVHVisualizer::followRight()
+BVHVisualizer::followHalf(int half)
 {
-    ri_qbvh_node_t *nextNode;
+    uint32_t ref;
 
-    if (this->getCurrentNode()->is_leaf) {
-
-        return 1;
+    for (int i = 0; i < 2; i++) {
 
-    } else {
+        ref = this->getCurrentNode()->child[2 * half + i];
 
-        nextNode = this->getCurrentNode()->child[1];
+        if (!RI_QBVH_IS_LEAF(ref)) {
 
-        this->nodeStack.push_back(nextNode);
+            this->nodeStack.push_back(ref);
 
+            return 0;
+        }
     }
 
-    return 0;
+    return 1;
+}
+
+int
+BVHVisualizer::followLeft()
+{
+    return this->followHalf(0);
+}
+
+int
+BVHVisualizer::followRight()
+{
+    return this->followHalf(1);
 }
 
 int
@@ -20,7 +20,7 @@ class BVHVisualizer {
 
         this->bvh = bvh;
 
-        this->nodeStack.push_back( bvh->root );
+        this->nodeStack.push_back( 0 );     // root
     }
 
     void drawBVH();
@@ -33,12 +33,14 @@ class BVHVisualizer {
   private:
 
     ri_qbvh_node_t *getCurrentNode() {
-        return this->nodeStack[this->nodeStack.size() - 1];
+        return &this->bvh->nodes[this->nodeStack[this->nodeStack.size() - 1]];
     }
 
+    int  followHalf(int half);
+
     ri_bvh_t                      *bvh;
 
-    std::vector<ri_qbvh_node_t *>  nodeStack;
+    std::vector<uint32_t>          nodeStack;   // offsets to bvh->nodes
 
 };
 
@@ -32,6 +32,9 @@
 #include "random.h"
 #include "sunsky.h"
 #include "texture.h"
+#include "irradcache.h"
+#include "ibl.h"
+#include "profile.h"
 
 /* ---------------------------------------------------------------------------
  *
@@ -47,8 +50,8 @@ calculate_occlusion(
     uint32_t                       ntheta_samples,
     uint32_t                       nphi_samples)
 {
-    int                     hit;
     uint32_t                i, j, k;
+    uint32_t                n;
     int                     thread_id = 0;
 
     double                  z0, z1;
@@ -60,7 +63,7 @@ calculate_occlusion(
     vec                     basis[3];
 
     ri_ray_t                ray;
-    ri_intersection_state_t state;
+    ri_ray_t                rays[RI_RAY_PACKET_MAX];
 
     ri_ortho_basis(basis, isect->Ns);
 
@@ -79,6 +82,9 @@ calculate_occlusion(
     assert(thread_id <  16);
 
     ray.thread_num = thread_id;
+    ray.time       = inray->time;
+
+    n = 0;
 
     for (j = 0; j < nphi_samples; j++) {
         for (i = 0; i < ntheta_samples; i++) {
@@ -118,14 +124,20 @@ calculate_occlusion(
 
             /*
              * 2. Do raytracing to check visibility.
+             *    Rays are traced in packets since they share the origin.
              */
-
-            hit = ri_raytrace(ri_render_get(), &ray, &state);
-
-            if (hit) {
-
-                /* There's an occluder. */
-                occlusion += 1.0;
+            rays[n++] = ray;
+
+            if ((n == RI_RAY_PACKET_MAX) ||
+                ((j == nphi_samples - 1) && (i == ntheta_samples - 1))) {
+
+                /* Count rays which have an occluder. */
+                occlusion += ri_raytrace_stream_occluded(ri_render_get(),
+                                                         rays, n,
+                                                         0.0, RI_INFINITY,
+                                                         NULL);
+                ri_prof_add(RI_PROF_NHEMISPHERE_RAYS, n);
+                n = 0;
             }
 
         }
@@ -161,7 +173,6 @@ contribution_from_sunlight(
 
     int                      hit;
     ri_ray_t                 ray;
-    ri_intersection_state_t  state;
 
     double                   eps = 1.0e-5;
 
@@ -183,8 +194,9 @@ contribution_from_sunlight(
         ray.dir[2] = light->direction[2];
 
         ray.thread_num = inray->thread_num;
+        ray.time       = inray->time;
 
-        hit = ri_raytrace(ri_render_get(), &ray, &state);
+        hit = ri_raytrace_occluded(ri_render_get(), &ray, 0.0, RI_INFINITY);
 
         if (!hit) {
 
@@ -227,7 +239,6 @@ gather_sunsky(
     float                   v[3];
 
     ri_ray_t                ray;
-    ri_intersection_state_t state;
 
     ri_ortho_basis(basis, isect->Ns);
 
@@ -247,6 +258,7 @@ gather_sunsky(
     assert(thread_id <  16);
 
     ray.thread_num = thread_id;
+    ray.time       = inray->time;
 
     for (j = 0; j < nphi_samples; j++) {
         for (i = 0; i < ntheta_samples; i++) {
@@ -288,7 +300,9 @@ gather_sunsky(
              * 2. Do raytracing to check visibility.
              */
 
-            hit = ri_raytrace(ri_render_get(), &ray, &state);
+            hit = ri_raytrace_occluded(ri_render_get(), &ray,
+                                       0.0, RI_INFINITY);
+            ri_prof_inc(RI_PROF_NHEMISPHERE_RAYS);
 
             if (!hit) {
 
@@ -323,6 +337,165 @@ gather_sunsky(
     return 0;   /* OK */
 }
 
+/*
+ * Incident radiance for the irradiance cache: 1 for unoccluded directions.
+ */
+static void
+visibility_radiance(
+    ri_vector_t                    L,
+    const ri_ray_t                *ray,
+    int                            hit,
+    const ri_intersection_state_t *state,
+    void                          *data)
+{
+    (void)ray;
+    (void)state;
+    (void)data;
+
+    L[0] = L[1] = L[2] = hit ? 0.0 : 1.0;
+}
+
+/*
+ * Incident radiance for the irradiance cache: sky color for unoccluded
+ * directions.
+ */
+static void
+sky_radiance(
+    ri_vector_t                    L,
+    const ri_ray_t                *ray,
+    int                            hit,
+    const ri_intersection_state_t *state,
+    void                          *data)
+{
+    float                   sunskycol[3];
+    float                   v[3];
+
+    (void)state;
+    (void)data;
+
+    if (hit) {
+        L[0] = L[1] = L[2] = 0.0;
+        return;
+    }
+
+    v[0] = ray->dir[0];
+    v[1] = ray->dir[1];
+    v[2] = ray->dir[2];
+
+    ri_sunsky_get_sky_rgb(sunskycol,
+                          ri_render_get()->scene->sunsky_light->sunsky,
+                          v);
+
+    L[0] = sunskycol[0];
+    L[1] = sunskycol[1];
+    L[2] = sunskycol[2];
+}
+
+/*
+ * Irradiance cached version of calculate_occlusion().
+ */
+static int
+calculate_occlusion_cached(
+    ri_vector_t                    Lo,              /* [out] */
+    const ri_ray_t                *inray,
+    const ri_intersection_state_t *isect,
+    uint32_t                       ntheta_samples,
+    uint32_t                       nphi_samples)
+{
+    ri_irradcache_gather(ri_render_get()->irradcache, Lo, inray,
+                         isect->P, isect->Ns,
+                         ntheta_samples, nphi_samples,
+                         visibility_radiance, NULL);
+
+    return 0;   /* OK */
+}
+
+/*
+ * Irradiance cached version of gather_sunsky(). Only the sky is cached,
+ * since the sun casts sharp shadows.
+ */
+static int
+gather_sunsky_cached(
+    ri_vector_t                    Lo,              /* [out] */
+    const ri_ray_t                *inray,
+    const ri_intersection_state_t *isect,
+    uint32_t                       ntheta_samples,
+    uint32_t                       nphi_samples)
+{
+    vec                     E;
+    vec                     sun;
+
+    ri_irradcache_gather(ri_render_get()->irradcache, E, inray,
+                         isect->P, isect->Ns,
+                         ntheta_samples, nphi_samples,
+                         sky_radiance, NULL);
+
+    vzero(sun);
+    contribution_from_sunlight(sun, inray, isect);
+
+    double nsamples = ntheta_samples * nphi_samples;
+    double m =(1.0 / M_PI);
+    Lo[0] = m * (E[0] + sun[0] / nsamples);
+    Lo[1] = m * (E[1] + sun[1] / nsamples);
+    Lo[2] = m * (E[2] + sun[2] / nsamples);
+
+    return 0;   /* OK */
+}
+
+/*
+ * Incident radiance from the environment map for the irradiance cache.
+ */
+static void
+envmap_radiance(
+    ri_vector_t                    L,
+    const ri_ray_t                *ray,
+    int                            hit,
+    const ri_intersection_state_t *state,
+    void                          *data)
+{
+    const ri_light_t *light = (const ri_light_t *)data;
+
+    (void)state;
+
+    if (hit) {
+        ri_vector_setzero(L);
+    } else {
+        ri_texture_ibl_fetch(L, light->texture, ray->dir);
+    }
+}
+
+/*
+ * Derived version of ambient occlusion: gather radiance of the environment
+ * map with the sampling method of the IBL light.
+ */
+static int
+gather_envmap(
+    ri_vector_t                    Lo,              /* [out] */
+    const ri_ray_t                *inray,
+    const ri_intersection_state_t *isect,
+    uint32_t                       ntheta_samples,
+    uint32_t                       nphi_samples)
+{
+    ri_light_t             *light = ri_render_get()->scene->envmap_light;
+
+    if (ri_render_get()->irradcache) {
+
+        /* The irradiance cache gathers with its own stratified samples. */
+        ri_irradcache_gather(ri_render_get()->irradcache, Lo, inray,
+                             isect->P, isect->Ns,
+                             ntheta_samples, nphi_samples,
+                             envmap_radiance, (void *)light);
+
+    } else {
+
+        ri_ibl_sample(Lo, isect->Ns, ntheta_samples * nphi_samples,
+                      inray, isect->P, inray->org, light);
+
+    }
+
+    return 0;   /* OK */
+}
+
 /* ---------------------------------------------------------------------------
  *
  * Public functions 
@@ -338,10 +511,35 @@ ri_transport_ambientocclusion(
 
     ri_ray_t                eyeray;
     ri_intersection_state_t state;
+
+    int                     hit;
+
+    memcpy(&eyeray, ray, sizeof(ri_ray_t));
+
+    /*
+     * Shoot eye ray.
+     */
+    hit = ri_raytrace(render, &eyeray, &state);
+
+    return ri_transport_ambientocclusion_shade(render, &eyeray, hit, &state,
+                                               result);
+}
+
+int
+ri_transport_ambientocclusion_shade(
+    ri_render_t                   *render,
+    const ri_ray_t                *eyeray,
+    int                            hit,
+    const ri_intersection_state_t *state,
+    ri_transport_info_t           *result)
+{
     ri_vector_t             texcol;
 
     int                     nsamples;
     int                     nphi, ntheta;
+    int                     ret;
+
+    (void)render;
 
     /*
      * Initialize
@@ -351,27 +549,23 @@ ri_transport_ambientocclusion(
         result->nbound_diffuse  = 0;
         result->nbound_specular = 0;
         ri_intersection_state_clear( &result->state );
-
-        memcpy(&eyeray, ray, sizeof(ri_ray_t));
     }    
 
-
-    /*
-     * Shoot eye ray.
-     */
-    int hit;
-    int ret;
-
-    hit = ri_raytrace(render, &eyeray, &state);
-
     if (hit) {
 
         if (ri_render_get()->scene->sunsky_light) {
 
-            ret = gather_sunsky(result->radiance,
-                                &eyeray,
-                                &state,
-                                8, 8);
+            if (ri_render_get()->irradcache) {
+                ret = gather_sunsky_cached(result->radiance,
+                                           eyeray,
+                                           state,
+                                           8, 8);
+            } else {
+                ret = gather_sunsky(result->radiance,
+                                    eyeray,
+                                    state,
+                                    8, 8);
+            }
 
         } else {
 
@@ -381,19 +575,34 @@ ri_transport_ambientocclusion(
             nphi     = sqrt((double)nsamples);
             ntheta   = nphi;
 
-            ret = calculate_occlusion(result->radiance,
-                                      &eyeray,
-                                      &state,
-                                      ntheta, nphi);
+            if (ri_render_get()->scene->envmap_light) {
+                ret = gather_envmap(result->radiance,
+                                    eyeray,
+                                    state,
+                                    ntheta, nphi);
+            } else if (ri_render_get()->irradcache) {
+                ret = calculate_occlusion_cached(result->radiance,
+                                                 eyeray,
+                                                 state,
+                                                 ntheta, nphi);
+            } else {
+                ret = calculate_occlusion(result->radiance,
+                                          eyeray,
+                                          state,
+                                          ntheta, nphi);
+            }
 
             // result->radiance[0] = state.stqr[0];
             // result->radiance[1] = state.stqr[1];
             // result->radiance[2] = 0.0;
 
-            if (state.geom->material && state.geom->material->texture) {
+            if (state->geom->material && state->geom->material->texture) {
 
-                ri_texture_fetch(texcol, state.geom->material->texture,
-                                 state.stqr[0], state.stqr[1]);
+                ri_texture_fetch_filtered(texcol,
+                                          state->geom->material->texture,
+                                          state->stqr[0], state->stqr[1],
+                                          state->dsdx, state->dtdx,
+                                          state->dsdy, state->dtdy);
 
                 result->radiance[0] *= texcol[0];
                 result->radiance[1] *= texcol[1];
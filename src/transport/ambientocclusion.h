@@ -27,6 +27,17 @@ extern int  ri_transport_ambientocclusion(
     const ri_ray_t      *ray,
     ri_transport_info_t *result);
 
+/*
+ * Shades the hit point of an eye ray which is already traced(e.g. with
+ * ri_raytrace_packet()). `state' is referenced only if `hit' is nonzero.
+ */
+extern int  ri_transport_ambientocclusion_shade(
+    ri_render_t                   *render,
+    const ri_ray_t                *eyeray,
+    int                            hit,
+    const ri_intersection_state_t *state,
+    ri_transport_info_t           *result);
+
 #ifdef __cplusplus
 }	/* extern "C" */
 #endif
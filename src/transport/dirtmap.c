@@ -142,6 +142,8 @@ calculate_dirt(
     assert(thread_id <  16);
 
     ray.thread_num = thread_id;
+    ray.time       = inray->time;
+    ray.has_differentials = 0;
 
     for (j = 0; j < nphi_samples; j++) {
         for (i = 0; i < ntheta_samples; i++) {
@@ -183,7 +185,16 @@ calculate_dirt(
              * 2. Do raytracing to check visibility.
              */
 
-            hit = ri_raytrace(ri_render_get(), &ray, &state);
+            /*
+             * Rays which reach far_clip get base_color regardless of the
+             * hit distance, thus first test visibility with cheap any-hit
+             * query and compute the actual hit distance only when required.
+             */
+            hit = ri_raytrace_occluded(ri_render_get(), &ray, 0.0, far_clip);
+
+            if (hit) {
+                hit = ri_raytrace(ri_render_get(), &ray, &state);
+            }
 
             if (hit) {
 
@@ -272,8 +283,10 @@ ri_transport_dirtmap(
 
         if (state.geom->material && state.geom->material->texture) {
 
-            ri_texture_fetch(texcol, state.geom->material->texture,
-                             state.stqr[0], state.stqr[1]);
+            ri_texture_fetch_filtered(texcol, state.geom->material->texture,
+                                      state.stqr[0], state.stqr[1],
+                                      state.dsdx, state.dtdx,
+                                      state.dsdy, state.dtdy);
 
             result->radiance[0] *= texcol[0];
             result->radiance[1] *= texcol[1];
@@ -0,0 +1,537 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Photon mapping renderer [Jensen 1996].
+ *
+ * Radiance at a diffuse surface is split into
+ *
+ *   - direct and indirect lighting, computed by final gathering. Gather rays
+ *     take the radiance estimate of the global photon map at the surface
+ *     they hit(and the radiance of lights and the sky),
+ *   - direct lighting from point and directional lights, which gather rays
+ *     can't hit, computed with shadow rays,
+ *   - caustics, estimated from the caustic photon map.
+ *
+ * Without final gathering, the radiance estimate of the global photon map
+ * is used directly, which is fast but blotchy.
+ *
+ * Specular reflection and refraction are traced recursively.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "photonmapping.h"
+
+#include "raytrace.h"
+#include "reflection.h"
+#include "random.h"
+#include "sunsky.h"
+#include "texture.h"
+#include "irradcache.h"
+#include "photonmap.h"
+#include "profile.h"
+
+/*
+ * Max distance of photons in an estimate relative to the scene size, if
+ * not specified by the option.
+ */
+#define PHOTON_MAXDIST_SCALE    0.1
+
+static void shade(
+    ri_render_t                   *render,
+    ri_vector_t                    Lo,              /* [out] */
+    const ri_ray_t                *ray,
+    int                            hit,
+    const ri_intersection_state_t *state,
+    int                            depth);
+
+/* ---------------------------------------------------------------------------
+ *
+ * Private functions
+ *
+ * ------------------------------------------------------------------------ */
+
+static ri_float_t
+photon_maxdist(ri_render_t *render)
+{
+    ri_option_t *option = render->context->option;
+
+    if (option->photon_maxdist > 0.0) return option->photon_maxdist;
+
+    return PHOTON_MAXDIST_SCALE * render->scene->maxwidth;
+}
+
+static ri_float_t
+surface_eps(ri_render_t *render)
+{
+    return 1.0e-5 * render->scene->maxwidth;
+}
+
+/*
+ * Gets diffuse, specular and transmission reflectance of the surface.
+ * Surfaces without material are white diffuse.
+ */
+static void
+get_reflectance(
+    ri_vector_t                    kd,              /* [out] */
+    ri_vector_t                    ks,              /* [out] */
+    ri_vector_t                    kt,              /* [out] */
+    const ri_intersection_state_t *state)
+{
+    ri_vector_t    texcol;
+    ri_material_t *material;
+
+    material = state->geom->material;
+
+    if (material == NULL) {
+        ri_vector_set1(kd, 1.0);
+        ri_vector_setzero(ks);
+        ri_vector_setzero(kt);
+        return;
+    }
+
+    ri_vector_copy(kd, material->kd);
+    ri_vector_copy(ks, material->ks);
+    ri_vector_copy(kt, material->kt);
+
+    if (material->texture) {
+
+        ri_texture_fetch_filtered(texcol, material->texture,
+                                  state->stqr[0], state->stqr[1],
+                                  state->dsdx, state->dtdx,
+                                  state->dsdy, state->dtdy);
+
+        kd[0] *= texcol[0];
+        kd[1] *= texcol[1];
+        kd[2] *= texcol[2];
+    }
+}
+
+/*
+ * Radiance of the dome light and the sky in the direction `dir'.
+ */
+static void
+environment_radiance(
+    ri_render_t                   *render,
+    ri_vector_t                    L,               /* [out] */
+    const ri_vector_t              dir)
+{
+    ri_list_t               *itr;
+    ri_light_t              *light;
+
+    float                    sunskycol[3];
+    float                    v[3];
+
+    ri_vector_setzero(L);
+
+    for (itr = ri_list_first(render->scene->light_list);
+         itr != NULL;
+         itr = ri_list_next(itr)) {
+
+        light = (ri_light_t *)itr->data;
+
+        if (light->type == LIGHTTYPE_DOME) {
+
+            L[0] += light->col[0] * light->intensity;
+            L[1] += light->col[1] * light->intensity;
+            L[2] += light->col[2] * light->intensity;
+
+        } else if (light->type == LIGHTTYPE_SUNSKY) {
+
+            v[0] = dir[0];
+            v[1] = dir[1];
+            v[2] = dir[2];
+
+            ri_sunsky_get_sky_rgb(sunskycol, light->sunsky, v);
+
+            L[0] += sunskycol[0];
+            L[1] += sunskycol[1];
+            L[2] += sunskycol[2];
+        }
+    }
+}
+
+/*
+ * Irradiance from point and directional lights.
+ */
+static void
+direct_irradiance(
+    ri_render_t                   *render,
+    ri_vector_t                    E,               /* [out] */
+    const ri_ray_t                *inray,
+    const ri_vector_t              P,
+    const ri_vector_t              N)
+{
+    int                      k;
+    int                      hit;
+    ri_float_t               dist;
+    ri_float_t               cosine;
+    ri_float_t               eps;
+    ri_list_t               *itr;
+    ri_light_t              *light;
+    ri_vector_t              d;
+    ri_ray_t                 ray;
+
+    ri_vector_setzero(E);
+
+    eps = surface_eps(render);
+
+    for (itr = ri_list_first(render->scene->light_list);
+         itr != NULL;
+         itr = ri_list_next(itr)) {
+
+        light = (ri_light_t *)itr->data;
+
+        if (light->geom) continue;
+
+        if (light->type == LIGHTTYPE_SUNLIGHT ||
+            light->type == LIGHTTYPE_DIRECTIONAL) {
+
+            ri_vector_copy(d, light->direction);
+            ri_vector_normalize(d);
+            dist = RI_INFINITY;
+
+        } else if (light->type == LIGHTTYPE_NONE ||
+                   light->type == LIGHTTYPE_POINTLIGHT) {
+
+            ri_vector_sub(d, light->pos, P);
+            dist = ri_vector_length(d);
+            if (dist <= eps) continue;
+            ri_vector_scale(d, d, 1.0 / dist);
+
+        } else {
+
+            continue;
+
+        }
+
+        cosine = ri_vector_dot(d, N);
+        if (cosine <= 0.0) continue;
+
+        for (k = 0; k < 3; k++) {
+            ray.org[k] = P[k] + eps * N[k];
+            ray.dir[k] = d[k];
+        }
+        ray.thread_num = inray->thread_num;
+        ray.time       = inray->time;
+
+        hit = ri_raytrace_occluded(render, &ray, 0.0, dist);
+
+        if (hit) continue;
+
+        if (dist < RI_INFINITY) {
+            cosine /= dist * dist;
+        }
+
+        E[0] += light->col[0] * light->intensity * cosine;
+        E[1] += light->col[1] * light->intensity * cosine;
+        E[2] += light->col[2] * light->intensity * cosine;
+    }
+}
+
+/*
+ * Incident radiance along a gather ray: radiance estimate of the global
+ * photon map at the surface it hits.
+ */
+static void
+photon_radiance(
+    ri_vector_t                    L,
+    const ri_ray_t                *ray,
+    int                            hit,
+    const ri_intersection_state_t *state,
+    void                          *data)
+{
+    ri_render_t             *render = (ri_render_t *)data;
+    ri_light_t              *light;
+
+    ri_vector_t              kd, ks, kt;
+    ri_vector_t              N;
+    ri_vector_t              E;
+
+    if (!hit) {
+        environment_radiance(render, L, ray->dir);
+        return;
+    }
+
+    if (state->geom->light) {
+        light = state->geom->light;
+        ri_vector_scale(L, light->col, (ri_float_t)light->intensity);
+        return;
+    }
+
+    ri_vector_setzero(L);
+
+    if (render->global_photonmap == NULL) return;
+
+    get_reflectance(kd, ks, kt, state);
+
+    ri_vector_copy(N, state->Ns);
+    if (ri_vector_dot(N, ray->dir) > 0.0) {
+        ri_vector_neg(N);
+    }
+
+    ri_photonmap_irradiance(render->global_photonmap, E, state->P, N,
+                            photon_maxdist(render),
+                            render->context->option->photon_estimate);
+
+    L[0] = kd[0] * E[0] / M_PI;
+    L[1] = kd[1] * E[1] / M_PI;
+    L[2] = kd[2] * E[2] / M_PI;
+}
+
+/*
+ * Cosine weighted mean of the incident radiance over the hemisphere.
+ */
+static void
+final_gather(
+    ri_render_t                   *render,
+    ri_vector_t                    M,               /* [out] */
+    const ri_ray_t                *inray,
+    const ri_vector_t              P,
+    const ri_vector_t              N)
+{
+    uint32_t                i, j, k;
+    int                     nsamples;
+    int                     ntheta, nphi;
+    int                     hit;
+    int                     thread_id;
+    double                  z0, z1;
+    double                  cos_theta, sin_theta, phi;
+    double                  eps;
+
+    vec                     basis[3];
+    vec                     L;
+
+    ri_ray_t                ray;
+    ri_intersection_state_t state;
+
+    nsamples = render->context->option->gather_nsamples;
+
+    /* Evenly distribute samples to phi and theta direction.    */
+    nphi     = (int)sqrt((double)nsamples);
+    if (nphi < 1) nphi = 1;
+    ntheta   = nphi;
+
+    if (render->irradcache) {
+        ri_irradcache_gather(render->irradcache, M, inray, P, N,
+                             ntheta, nphi, photon_radiance, (void *)render);
+        return;
+    }
+
+    ri_vector_setzero(M);
+
+    ri_ortho_basis(basis, N);
+
+    eps       = surface_eps(render);
+    thread_id = inray->thread_num;
+
+    for (k = 0; k < 3; k++) {
+        ray.org[k] = P[k] + eps * N[k];
+    }
+    ray.thread_num = thread_id;
+    ray.time       = inray->time;
+    ray.has_differentials = 0;
+
+    for (j = 0; j < (uint32_t)nphi; j++) {
+        for (i = 0; i < (uint32_t)ntheta; i++) {
+
+            /* Stratified, cosine weighted sampling. */
+            z0 = (i + randomMT2(thread_id)) / (double)ntheta;
+            z1 = (j + randomMT2(thread_id)) / (double)nphi;
+
+            cos_theta = sqrt(z0);
+            sin_theta = sqrt(1.0 - z0);
+            phi       = 2.0 * M_PI * z1;
+
+            for (k = 0; k < 3; k++) {
+                ray.dir[k] = cos(phi) * sin_theta * basis[0][k]
+                           + sin(phi) * sin_theta * basis[1][k]
+                           + cos_theta            * basis[2][k];
+            }
+
+            hit = ri_raytrace(render, &ray, &state);
+            ri_prof_inc(RI_PROF_NHEMISPHERE_RAYS);
+
+            photon_radiance(L, &ray, hit, &state, (void *)render);
+
+            ri_vector_add(M, M, L);
+        }
+    }
+
+    ri_vector_scale(M, M, 1.0 / (double)(ntheta * nphi));
+}
+
+/*
+ * Traces a specular ray and adds its radiance scaled by `weight' to `Lo'.
+ * The direction and the differentials of `specray' must be set by the
+ * caller.
+ */
+static void
+trace_specular(
+    ri_render_t                   *render,
+    ri_vector_t                    Lo,              /* [inout] */
+    const ri_ray_t                *inray,
+    const ri_ray_t                *specray,
+    const ri_vector_t              P,
+    const ri_vector_t              weight,
+    int                            depth)
+{
+    int                     k;
+    int                     hit;
+    ri_ray_t                ray;
+    ri_intersection_state_t state;
+    ri_vector_t             L;
+
+    ri_ray_copy(&ray, specray);
+    ri_vector_normalize(ray.dir);
+
+    for (k = 0; k < 3; k++) {
+        ray.org[k] = P[k] + surface_eps(render) * ray.dir[k];
+    }
+    ray.thread_num = inray->thread_num;
+    ray.time       = inray->time;
+
+    hit = ri_raytrace(render, &ray, &state);
+
+    shade(render, L, &ray, hit, &state, depth + 1);
+
+    Lo[0] += weight[0] * L[0];
+    Lo[1] += weight[1] * L[1];
+    Lo[2] += weight[2] * L[2];
+}
+
+static void
+shade(
+    ri_render_t                   *render,
+    ri_vector_t                    Lo,
+    const ri_ray_t                *ray,
+    int                            hit,
+    const ri_intersection_state_t *state,
+    int                            depth)
+{
+    ri_option_t             *option;
+    ri_light_t              *light;
+    ri_material_t           *material;
+
+    ri_vector_t              kd, ks, kt;
+    ri_vector_t              N;
+    ri_vector_t              E, Ec;
+    ri_vector_t              M;
+    ri_ray_t                 specray;
+
+    option = render->context->option;
+
+    if (!hit) {
+        environment_radiance(render, Lo, ray->dir);
+        return;
+    }
+
+    if (state->geom->light) {
+        light = state->geom->light;
+        ri_vector_scale(Lo, light->col, (ri_float_t)light->intensity);
+        return;
+    }
+
+    ri_vector_setzero(Lo);
+
+    get_reflectance(kd, ks, kt, state);
+
+    ri_vector_copy(N, state->Ns);
+    if (ri_vector_dot(N, ray->dir) > 0.0) {
+        ri_vector_neg(N);
+    }
+
+    if (ri_vector_ave(kd) > 0.0) {
+
+        if (render->global_photonmap && !option->photon_finalgather) {
+
+            /* The global map has all of direct, indirect and caustics. */
+            ri_photonmap_irradiance(render->global_photonmap, E,
+                                    state->P, N,
+                                    photon_maxdist(render),
+                                    option->photon_estimate);
+
+        } else {
+
+            final_gather(render, M, ray, state->P, N);
+
+            Lo[0] += kd[0] * M[0];
+            Lo[1] += kd[1] * M[1];
+            Lo[2] += kd[2] * M[2];
+
+            direct_irradiance(render, E, ray, state->P, N);
+
+            if (render->caustic_photonmap) {
+
+                ri_photonmap_irradiance(render->caustic_photonmap, Ec,
+                                        state->P, N,
+                                        photon_maxdist(render),
+                                        option->photon_estimate);
+
+                ri_vector_add(E, E, Ec);
+            }
+        }
+
+        Lo[0] += kd[0] * E[0] / M_PI;
+        Lo[1] += kd[1] * E[1] / M_PI;
+        Lo[2] += kd[2] * E[2] / M_PI;
+    }
+
+    if (depth >= (int)option->max_ray_depth) return;
+
+    if (ri_vector_ave(ks) > 0.0) {
+
+        ri_reflect(specray.dir, ray->dir, N);
+        ri_intersection_state_reflect_differentials(&specray, state);
+        trace_specular(render, Lo, ray, &specray, state->P, ks, depth);
+    }
+
+    if (ri_vector_ave(kt) > 0.0) {
+
+        material = state->geom->material;
+
+        ri_refract(specray.dir, ray->dir, state->Ns, material->ior);
+        ri_intersection_state_refract_differentials(&specray, state,
+                                                    material->ior);
+        trace_specular(render, Lo, ray, &specray, state->P, kt, depth);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ *
+ * Public functions
+ *
+ * ------------------------------------------------------------------------ */
+
+int
+ri_transport_photonmapping_shade(
+    ri_render_t                   *render,
+    const ri_ray_t                *eyeray,
+    int                            hit,
+    const ri_intersection_state_t *state,
+    ri_transport_info_t           *result)
+{
+    /*
+     * Initialize
+     */
+    {
+        ri_vector_setzero(result->radiance);
+        result->nbound_diffuse  = 0;
+        result->nbound_specular = 0;
+        ri_intersection_state_clear( &result->state );
+    }
+
+    shade(render, result->radiance, eyeray, hit, state, 0);
+
+    return 0;   /* OK */
+}
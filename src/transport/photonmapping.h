@@ -0,0 +1,41 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Photon mapping renderer. Shades with radiance estimates of the global
+ * and caustic photon maps of the renderer.
+ *
+ */
+
+#ifndef LUCILLE_PHOTONMAPPING_H
+#define LUCILLE_PHOTONMAPPING_H
+
+#include "render.h"
+#include "raytrace.h"
+
+#include "transport.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Shades the hit point of an eye ray which is already traced. `state' is
+ * referenced only if `hit' is nonzero.
+ */
+extern int  ri_transport_photonmapping_shade(
+    ri_render_t                   *render,
+    const ri_ray_t                *eyeray,
+    int                            hit,
+    const ri_intersection_state_t *state,
+    ri_transport_info_t           *result);
+
+#ifdef __cplusplus
+}	/* extern "C" */
+#endif
+
+#endif  /* LUCILLE_PHOTONMAPPING_H */
@@ -50,13 +50,15 @@ static void trace_whitted(
     }
 
     //ri_reflect(Rd, isect->I, isect->Ns);
-    ri_refract(Rd, isect->I, isect->Ns, 1.33);
+    ri_refract(Rd, isect->I, isect->Ns, eta);
     vcpy(Rr.dir, Rd);
 
     Rr.org[0] = isect->P[0] + eps * Rd[0];
     Rr.org[1] = isect->P[1] + eps * Rd[1];
     Rr.org[2] = isect->P[2] + eps * Rd[2];
 
+    ri_intersection_state_refract_differentials(&Rr, isect, eta);
+
     hit = ri_raytrace(render, &Rr, &state);
 
     if (hit) {
@@ -71,9 +73,15 @@ static void trace_whitted(
          */
         if (render->scene->envmap_light) {
 
-            ri_texture_ibl_fetch(result->radiance,
-                                 render->scene->envmap_light->texture,
-                                 Rd); 
+            if (Rr.has_differentials) {
+                ri_texture_ibl_fetch_filtered(result->radiance,
+                                     render->scene->envmap_light->texture,
+                                     Rd, Rr.dDdx, Rr.dDdy);
+            } else {
+                ri_texture_ibl_fetch(result->radiance,
+                                     render->scene->envmap_light->texture,
+                                     Rd);
+            }
 
         } else {
 
@@ -134,9 +142,15 @@ ri_transport_whitted(
          */
         if (render->scene->envmap_light) {
 
-            ri_texture_ibl_fetch(result->radiance,
-                                 render->scene->envmap_light->texture,
-                                 eyeray.dir); 
+            if (eyeray.has_differentials) {
+                ri_texture_ibl_fetch_filtered(result->radiance,
+                                     render->scene->envmap_light->texture,
+                                     eyeray.dir, eyeray.dDdx, eyeray.dDdy);
+            } else {
+                ri_texture_ibl_fetch(result->radiance,
+                                     render->scene->envmap_light->texture,
+                                     eyeray.dir);
+            }
 
         } else {
 
@@ -3,8 +3,5 @@
 #include "memory.h"
 %}
 
+%include "stdint.i"
 %include "../../../../src/base/memory.h"
-
-// private functions
-void *aligned_malloc(size_t size, unsigned int align);
-int   aligned_free(void *addr);
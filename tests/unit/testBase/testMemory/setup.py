@@ -2,6 +2,7 @@ import distutils
 from distutils.core import setup, Extension
 
 import os
+import struct
 
 srcPath = "../../../../src/base"
 
@@ -11,6 +12,12 @@ srcList = [ "memory.i"
           ]
 
 
+# ri_mem_free_aligned() reads the embedded address as 64bit only with
+# __64bit__.
+macros = []
+if struct.calcsize("P") == 8:
+    macros.append(("__64bit__", None))
+
 setup(name = "base_memory",
       version = "1.0",
-      ext_modules = [Extension("_base_memory", sources=srcList, include_dirs = [srcPath])])
+      ext_modules = [Extension("_base_memory", sources=srcList, include_dirs = [srcPath], define_macros = macros)])
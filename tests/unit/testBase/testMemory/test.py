@@ -2,6 +2,7 @@ from base_memory import *
 
 import os, sys
 import random
+import ctypes
 
 class TestMemoryAllocDoesNotReturnNull():
 
@@ -33,7 +34,11 @@ class TestMemoryFreeReturnsZero():
 class TestAlignedMallocWithRandomArg():
 
     def setup(self):
-        pass
+        # malloc_usable_size() tells the size of the block behind the
+        # aligned pointer.
+        self.libc = ctypes.CDLL(None)
+        self.libc.malloc_usable_size.argtypes = [ctypes.c_void_p]
+        self.libc.malloc_usable_size.restype  = ctypes.c_size_t
 
     def teardown(self):
         pass
@@ -44,19 +49,148 @@ class TestAlignedMallocWithRandomArg():
 
         for i in range(nTests):
         
-            sz    = random.randint(0, 1024*1024)
-            align = random.randint(0, 1024)
+            sz    = random.randint(0, 64*1024)
+            align = 16 << random.randint(0, 6)
 
-            print "sz = %d, align = %d" % (sz, align)
+            p = ri_mem_alloc_aligned(sz, align)
 
-            p = aligned_malloc(sz, align);
+            addr = int(p)
 
-            assert int(p) % 16 == 0, "Not 16-byte aligned: addr(p) = %d" % int(p)
+            assert addr % align == 0, "Not %d-byte aligned: addr(p) = %d" % (align, addr)
 
-            aligned_free(p)
+            # The address of malloc() is embedded just before p.
+            base = ctypes.c_uint64.from_address(addr - 8).value
 
-        
+            assert base <= addr - 8
+
+            usable = self.libc.malloc_usable_size(base)
+
+            assert addr + sz <= base + usable, "Overrun: sz = %d, align = %d" % (sz, align)
+
+            # Touch every byte. An overrun would corrupt the heap.
+            ctypes.memset(addr, 0xa5, sz)
+
+            ret = ri_mem_free_aligned(p)
+
+            assert ret == 0, ret
+
+class TestArenaOverflowResetThenNoHeap():
+
+    def setup(self):
+        self.arena = ri_arena_new(256)
+
+    def teardown(self):
+        ri_arena_free(self.arena)
+
+    def allocate(self):
+        ptrs = []
+        for i in range(64):
+            align = 1 << (i % 8)
+            p = ri_arena_alloc(self.arena, 8 + 3 * i, align)
+            assert int(p) % align == 0
+            ctypes.memset(int(p), i, 8 + 3 * i)
+            ptrs.append((int(p), 8 + 3 * i, i))
+
+        # Nothing was overwritten by the later allocations.
+        for (addr, sz, val) in ptrs:
+            assert ctypes.string_at(addr, sz) == bytes(bytearray([val] * sz))
+
+        return ptrs
+
+    def test(self):
+
+        n = self.arena.nheap_allocs
+
+        self.allocate()
+
+        assert self.arena.nheap_allocs > n, "Overflow does not take heap"
+
+        ri_arena_reset(self.arena)
+
+        assert self.arena.used == 0
+
+        # The block is enlarged at the reset, so the second pass fits in it.
+        n = self.arena.nheap_allocs
+
+        ptrs = self.allocate()
+
+        assert self.arena.nheap_allocs == n, "Second pass takes heap"
+
+        base = int(self.arena.base)
+        for (addr, sz, val) in ptrs:
+            assert base <= addr and addr + sz <= base + self.arena.size
+
+class TestArenaReleaseReusesMemoryAfterMark():
+
+    def setup(self):
+        self.arena = ri_arena_new(1024)
+
+    def teardown(self):
+        ri_arena_free(self.arena)
+
+    def test(self):
+
+        p0   = ri_arena_alloc(self.arena, 100, 16)
+        mark = ri_arena_mark(self.arena)
+        p1   = ri_arena_alloc(self.arena, 200, 16)
+        p2   = ri_arena_alloc(self.arena, 300, 16)
+
+        ri_arena_release(self.arena, mark)
+
+        assert ri_arena_mark(self.arena) == mark
+
+        p3   = ri_arena_alloc(self.arena, 200, 16)
+
+        assert int(p3) == int(p1)
+
+        # Memory before the mark is kept.
+        assert int(p0) < int(p3)
+        assert int(p0) + 100 <= int(p3)
+
+class TestPoolReusesReleasedObject():
+
+    def setup(self):
+        self.pool = ri_pool_new(24, 8)
+
+    def teardown(self):
+        ri_pool_free(self.pool)
+
+    def test(self):
+
+        objs = [ri_pool_alloc(self.pool) for i in range(8)]
+        ptrs = [int(p) for p in objs]
+
+        assert self.pool.nheap_allocs == 1
+        assert len(set(ptrs)) == 8
+
+        for addr in ptrs:
+            assert addr % 16 == 0
+
+        # Objects do not overlap.
+        s = sorted(ptrs)
+        for a, b in zip(s[:-1], s[1:]):
+            assert b - a >= 24
+
+        ri_pool_release(self.pool, objs[3])
+
+        p = ri_pool_alloc(self.pool)
+
+        assert int(p) == ptrs[3]
+        assert self.pool.nheap_allocs == 1
+
+        # Released objects are recycled before a new chunk is taken.
+        objs[3] = p
+        for p in objs:
+            ri_pool_release(self.pool, p)
+
+        again = [int(ri_pool_alloc(self.pool)) for i in range(8)]
+
+        assert sorted(again) == sorted(ptrs)
+        assert self.pool.nheap_allocs == 1
+
+        ri_pool_alloc(self.pool)
 
+        assert self.pool.nheap_allocs == 2
 
 # class TestMemoryAllocWithLargeSizeWillReturnNull():
 # 
@@ -0,0 +1,26 @@
+import distutils
+from distutils.core import setup, Extension
+
+import os
+import platform
+import struct
+
+srcPath = "../../../../src/base"
+
+srcList = [ "wsdeque.i"
+          , os.path.join(srcPath, "wsdeque.c") 
+          , os.path.join(srcPath, "memory.c") 
+          , os.path.join(srcPath, "list.c") 
+          ]
+
+
+# Use the same atomic ops as the renderer(see atomic.h).
+macros = []
+if platform.machine() in ("i386", "i686", "x86_64", "AMD64"):
+    macros.append(("__x86__", None))
+if struct.calcsize("P") == 8:
+    macros.append(("__64bit__", None))
+
+setup(name = "base_wsdeque",
+      version = "1.0",
+      ext_modules = [Extension("_base_wsdeque", sources=srcList, include_dirs = [srcPath], define_macros = macros, libraries = ["pthread"])])
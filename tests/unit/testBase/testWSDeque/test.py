@@ -0,0 +1,99 @@
+from base_wsdeque import *
+
+import os, sys
+
+class TestWSDequePopIsLIFO():
+
+    def setup(self):
+        self.deque = ri_ws_deque_new(128)
+
+    def teardown(self):
+        ri_ws_deque_free(self.deque)
+
+    def test(self):
+        for i in range(100):
+            assert ri_ws_deque_push(self.deque, i) == 0
+
+        for i in reversed(range(100)):
+            ret, item = ri_ws_deque_pop(self.deque)
+            assert ret == 0
+            assert item == i
+
+        ret, item = ri_ws_deque_pop(self.deque)
+        assert ret == -1
+
+
+class TestWSDequeStealIsFIFO():
+
+    def setup(self):
+        self.deque = ri_ws_deque_new(128)
+
+    def teardown(self):
+        ri_ws_deque_free(self.deque)
+
+    def test(self):
+        for i in range(100):
+            ri_ws_deque_push(self.deque, i)
+
+        for i in range(100):
+            ret, item = ri_ws_deque_steal(self.deque)
+            assert ret == 0
+            assert item == i
+
+        ret, item = ri_ws_deque_steal(self.deque)
+        assert ret == -1
+
+
+class TestWSDequePopAndStealTakeBothEnds():
+
+    def setup(self):
+        self.deque = ri_ws_deque_new(16)
+
+    def teardown(self):
+        ri_ws_deque_free(self.deque)
+
+    def test(self):
+        for i in range(5):
+            ri_ws_deque_push(self.deque, i)
+
+        assert ri_ws_deque_steal(self.deque)[1] == 0
+        assert ri_ws_deque_pop(self.deque)[1]   == 4
+        assert ri_ws_deque_size(self.deque)     == 3
+
+        # The owner pushes again after items were stolen.
+        ri_ws_deque_push(self.deque, 5)
+        assert ri_ws_deque_pop(self.deque)[1]   == 5
+        assert ri_ws_deque_steal(self.deque)[1] == 1
+        assert ri_ws_deque_size(self.deque)     == 2
+
+
+class TestWSDequePushFailsWhenFull():
+
+    def setup(self):
+        self.deque = ri_ws_deque_new(16)
+
+    def teardown(self):
+        ri_ws_deque_free(self.deque)
+
+    def test(self):
+        for i in range(16):
+            assert ri_ws_deque_push(self.deque, i) == 0
+
+        assert ri_ws_deque_push(self.deque, 16) == -1
+
+        # Stealing makes room at the other end.
+        ri_ws_deque_steal(self.deque)
+        assert ri_ws_deque_push(self.deque, 16) == 0
+
+
+class TestWSDequeConcurrentStealTakesEachItemOnce():
+
+    def setup(self):
+        pass
+
+    def teardown(self):
+        pass
+
+    def test(self):
+        for n in range(10):
+            assert ws_deque_stress(100000, 3) == 0
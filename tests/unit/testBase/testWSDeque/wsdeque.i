@@ -0,0 +1,110 @@
+%module base_wsdeque
+%{
+#include <pthread.h>
+
+#include "memory.h"
+#include "wsdeque.h"
+
+/*
+ * Concurrent steal test. Python threads can't call the deque concurrently,
+ * thus threads are run here.
+ */
+
+typedef struct _ws_stress_t {
+    ri_ws_deque_t   *deque;
+    int             *taken;         /* # of times each item was taken   */
+    volatile int     done;          /* owner finished pushing           */
+} ws_stress_t;
+
+static void
+ws_stress_take(ws_stress_t *s, int64_t item)
+{
+    __sync_fetch_and_add(&s->taken[item], 1);
+}
+
+static void *
+ws_stress_thief(void *arg)
+{
+    int          ret;
+    int64_t      item;
+    ws_stress_t *s = (ws_stress_t *)arg;
+
+    for (;;) {
+        ret = ri_ws_deque_steal(s->deque, &item);
+        if (ret == 0) {
+            ws_stress_take(s, item);
+        } else if (ret < 0 && s->done) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+%}
+
+%include "stdint.i"
+%include "typemaps.i"
+
+%apply int64_t *OUTPUT { int64_t *item_out };
+
+%include "../../../../src/base/wsdeque.h"
+
+%inline %{
+
+/*
+ * The owner pushes `nitems' items, popping every third one, then pops the
+ * rest while `nthieves' threads steal. Returns the number of items which
+ * were not taken exactly once.
+ */
+int
+ws_deque_stress(int nitems, int nthieves)
+{
+    int          i;
+    int          nbad;
+    int64_t      item;
+    pthread_t    threads[16];
+    ws_stress_t  s;
+
+    if (nthieves > 16) nthieves = 16;
+
+    s.deque = ri_ws_deque_new(nitems);
+    s.taken = (int *)ri_mem_alloc(sizeof(int) * nitems);
+    s.done  = 0;
+
+    for (i = 0; i < nitems; i++) {
+        s.taken[i] = 0;
+    }
+
+    for (i = 0; i < nthieves; i++) {
+        pthread_create(&threads[i], NULL, ws_stress_thief, &s);
+    }
+
+    for (i = 0; i < nitems; i++) {
+        ri_ws_deque_push(s.deque, i);
+        if ((i % 3) == 0 && ri_ws_deque_pop(s.deque, &item) == 0) {
+            ws_stress_take(&s, item);
+        }
+    }
+
+    while (ri_ws_deque_pop(s.deque, &item) == 0) {
+        ws_stress_take(&s, item);
+    }
+
+    s.done = 1;
+
+    for (i = 0; i < nthieves; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    nbad = 0;
+    for (i = 0; i < nitems; i++) {
+        if (s.taken[i] != 1) nbad++;
+    }
+
+    ri_mem_free(s.taken);
+    ri_ws_deque_free(s.deque);
+
+    return nbad;
+}
+
+%}
@@ -0,0 +1,168 @@
+%module render_checkpoint
+%{
+#include "memory.h"
+#include "checkpoint.h"
+%}
+
+%include "stdint.i"
+%include "../../../../src/render/checkpoint.h"
+
+%inline %{
+
+/*
+ * Helpers to pass frames, which SWIG can't convert from Python lists.
+ * Pixel (x, y) of the test frame has (x, y, x + y) + `offset'.
+ */
+
+void
+checkpoint_put_test_region(
+    ri_checkpoint_t *checkpoint,
+    int              x,
+    int              y,
+    int              w,
+    int              h,
+    double           offset)
+{
+    int          i, j;
+    ri_vector_t *pixels;
+
+    pixels = (ri_vector_t *)ri_mem_alloc(sizeof(ri_vector_t) * w * h);
+
+    for (j = 0; j < h; j++) {
+        for (i = 0; i < w; i++) {
+            pixels[j * w + i][0] = (x + i) + offset;
+            pixels[j * w + i][1] = (y + j) + offset;
+            pixels[j * w + i][2] = (x + i) + (y + j) + offset;
+            pixels[j * w + i][3] = 1.0;
+        }
+    }
+
+    ri_checkpoint_put_region(checkpoint, x, y, w, h,
+                             (const ri_vector_t *)pixels);
+
+    ri_mem_free(pixels);
+}
+
+/*
+ * Returns 1 if pixels of the region are those of the test frame.
+ */
+int
+checkpoint_check_test_region(
+    const ri_checkpoint_t *checkpoint,
+    int              x,
+    int              y,
+    int              w,
+    int              h,
+    double           offset)
+{
+    int          i, j;
+    int          width;
+    const float *p;
+
+    width = checkpoint->header.width;
+
+    for (j = y; j < y + h; j++) {
+        for (i = x; i < x + w; i++) {
+            p = &checkpoint->pixels[3 * (j * width + i)];
+            if (p[0] != (float)(i + offset))     return 0;
+            if (p[1] != (float)(j + offset))     return 0;
+            if (p[2] != (float)(i + j + offset)) return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Progressive state of the test frame. Pixel i has radiance (i, 2i, 3i),
+ * lumsum 4i, lumsqsum 5i and i % 7 + `pass' samples.
+ */
+int
+checkpoint_put_test_progressive(
+    ri_checkpoint_t *checkpoint,
+    int              pass)
+{
+    int          i, n;
+    int          ret;
+    ri_vector_t *radiance;
+    ri_float_t  *lumsum;
+    ri_float_t  *lumsqsum;
+    int         *nsamples;
+
+    n = checkpoint->npixels;
+
+    radiance = (ri_vector_t *)ri_mem_alloc(sizeof(ri_vector_t) * n);
+    lumsum   = (ri_float_t *)ri_mem_alloc(sizeof(ri_float_t) * n);
+    lumsqsum = (ri_float_t *)ri_mem_alloc(sizeof(ri_float_t) * n);
+    nsamples = (int *)ri_mem_alloc(sizeof(int) * n);
+
+    for (i = 0; i < n; i++) {
+        radiance[i][0] = i;
+        radiance[i][1] = 2.0 * i;
+        radiance[i][2] = 3.0 * i;
+        radiance[i][3] = 0.0;
+        lumsum[i]      = 4.0 * i;
+        lumsqsum[i]    = 5.0 * i;
+        nsamples[i]    = i % 7 + pass;
+    }
+
+    ret = ri_checkpoint_put_progressive(checkpoint, pass, 4,
+                                        (uint64_t)n * 4 * (pass + 1),
+                                        (const ri_vector_t *)radiance,
+                                        lumsum, lumsqsum, nsamples);
+
+    ri_mem_free(radiance);
+    ri_mem_free(lumsum);
+    ri_mem_free(lumsqsum);
+    ri_mem_free(nsamples);
+
+    return ret;
+}
+
+/*
+ * Returns 1 if the restored progressive state is that of the test frame.
+ */
+int
+checkpoint_check_test_progressive(
+    const ri_checkpoint_t *checkpoint,
+    int              pass)
+{
+    int          i, n;
+    int          ok;
+    ri_vector_t *radiance;
+    ri_float_t  *lumsum;
+    ri_float_t  *lumsqsum;
+    int         *nsamples;
+
+    n = checkpoint->npixels;
+
+    radiance = (ri_vector_t *)ri_mem_alloc(sizeof(ri_vector_t) * n);
+    lumsum   = (ri_float_t *)ri_mem_alloc(sizeof(ri_float_t) * n);
+    lumsqsum = (ri_float_t *)ri_mem_alloc(sizeof(ri_float_t) * n);
+    nsamples = (int *)ri_mem_alloc(sizeof(int) * n);
+
+    ri_checkpoint_get_progressive(checkpoint, radiance, lumsum, lumsqsum,
+                                  nsamples);
+
+    ok = (checkpoint->header.pass == pass);
+
+    for (i = 0; i < n; i++) {
+        if (radiance[i][0] != i       ||
+            radiance[i][1] != 2.0 * i ||
+            radiance[i][2] != 3.0 * i ||
+            lumsum[i]      != 4.0 * i ||
+            lumsqsum[i]    != 5.0 * i ||
+            nsamples[i]    != i % 7 + pass) {
+            ok = 0;
+        }
+    }
+
+    ri_mem_free(radiance);
+    ri_mem_free(lumsum);
+    ri_mem_free(lumsqsum);
+    ri_mem_free(nsamples);
+
+    return ok;
+}
+
+%}
@@ -0,0 +1,123 @@
+from render_checkpoint import *
+
+import os, sys, time
+
+CKPT_FILE = "test.ckpt"
+
+def remove_file(path):
+    if os.path.exists(path):
+        os.remove(path)
+
+
+class TestCheckpointRegionRoundTrip():
+
+    def setup(self):
+        remove_file(CKPT_FILE)
+        self.ckpt = ri_checkpoint_new(CKPT_FILE, 64, 32, 1234, 0, 0.0)
+
+    def teardown(self):
+        ri_checkpoint_free(self.ckpt)
+        remove_file(CKPT_FILE)
+
+    def test(self):
+        checkpoint_put_test_region(self.ckpt,  0, 0, 16, 8, 0.5)
+        checkpoint_put_test_region(self.ckpt, 16, 8,  8, 8, 0.5)
+        ri_checkpoint_finish(self.ckpt, 0)
+
+        ckpt = ri_checkpoint_new(CKPT_FILE, 64, 32, 1234, 0, 0.0)
+
+        assert ri_checkpoint_load(ckpt) == 1
+
+        assert ri_checkpoint_region_done(ckpt,  0,  0, 16, 8) == 1
+        assert ri_checkpoint_region_done(ckpt, 16,  8,  8, 8) == 1
+        assert ri_checkpoint_region_done(ckpt,  0,  8, 16, 8) == 0
+        assert ri_checkpoint_region_done(ckpt, 12,  4,  8, 8) == 0
+
+        assert checkpoint_check_test_region(ckpt,  0, 0, 16, 8, 0.5) == 1
+        assert checkpoint_check_test_region(ckpt, 16, 8,  8, 8, 0.5) == 1
+
+        ri_checkpoint_finish(ckpt, 1)
+        ri_checkpoint_free(ckpt)
+
+
+class TestCheckpointIgnoresAnotherFrame():
+
+    def setup(self):
+        remove_file(CKPT_FILE)
+
+    def teardown(self):
+        remove_file(CKPT_FILE)
+
+    def test(self):
+        # Different signature, size and mode.
+        for args in [(64, 32, 5678, 0), (32, 64, 1234, 0), (64, 32, 1234, 1)]:
+
+            ckpt = ri_checkpoint_new(CKPT_FILE, 64, 32, 1234, 0, 0.0)
+            checkpoint_put_test_region(ckpt, 0, 0, 16, 8, 0.0)
+            ri_checkpoint_finish(ckpt, 0)
+            ri_checkpoint_free(ckpt)
+
+            ckpt = ri_checkpoint_new(CKPT_FILE, args[0], args[1], args[2],
+                                     args[3], 0.0)
+
+            assert ri_checkpoint_load(ckpt) == 0
+
+            # finish() with a complete frame removes the file.
+            ri_checkpoint_finish(ckpt, 1)
+            ri_checkpoint_free(ckpt)
+
+            assert not os.path.exists(CKPT_FILE)
+
+
+class TestCheckpointProgressiveRoundTrip():
+
+    def setup(self):
+        remove_file(CKPT_FILE)
+        self.ckpt = ri_checkpoint_new(CKPT_FILE, 40, 30, 42, 1, 0.0)
+
+    def teardown(self):
+        ri_checkpoint_free(self.ckpt)
+        remove_file(CKPT_FILE)
+
+    def test(self):
+        checkpoint_put_test_progressive(self.ckpt, 3)
+        ri_checkpoint_finish(self.ckpt, 0)
+
+        ckpt = ri_checkpoint_new(CKPT_FILE, 40, 30, 42, 1, 0.0)
+
+        assert ri_checkpoint_load(ckpt) == 1
+        assert checkpoint_check_test_progressive(ckpt, 3) == 1
+
+        ri_checkpoint_finish(ckpt, 1)
+        ri_checkpoint_free(ckpt)
+
+
+class TestCheckpointWriterThreadSavesOnRequest():
+
+    def setup(self):
+        remove_file(CKPT_FILE)
+        self.ckpt = ri_checkpoint_new(CKPT_FILE, 64, 32, 99, 0, 0.0)
+
+    def teardown(self):
+        ri_checkpoint_finish(self.ckpt, 1)
+        ri_checkpoint_free(self.ckpt)
+        remove_file(CKPT_FILE)
+
+    def test(self):
+        checkpoint_put_test_region(self.ckpt, 8, 8, 8, 8, 0.0)
+        ri_checkpoint_request(self.ckpt)
+
+        # The file appears when the writer renamed the complete file.
+        for i in range(500):
+            if os.path.exists(CKPT_FILE):
+                break
+            time.sleep(0.01)
+
+        ckpt = ri_checkpoint_new(CKPT_FILE, 64, 32, 99, 0, 0.0)
+
+        assert ri_checkpoint_load(ckpt) == 1
+        assert ri_checkpoint_region_done(ckpt, 8, 8, 8, 8) == 1
+        assert checkpoint_check_test_region(ckpt, 8, 8, 8, 8, 0.0) == 1
+
+        ri_checkpoint_finish(ckpt, 1)
+        ri_checkpoint_free(ckpt)
@@ -0,0 +1,226 @@
+%module render_photonmap
+%{
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "memory.h"
+#include "photonmap.h"
+
+static unsigned int
+photonmap_test_rand(unsigned int *seed)
+{
+    (*seed) = (*seed) * 1103515245u + 12345u;
+
+    return ((*seed) >> 8) & 0xffffff;
+}
+
+static double
+photonmap_test_uniform(unsigned int *seed)
+{
+    return photonmap_test_rand(seed) / (double)0x1000000;
+}
+
+static float
+photonmap_test_dist2(const ri_photon_t *photon, const float q[3])
+{
+    float dx, dy, dz;
+
+    dx = photon->pos[0] - q[0];
+    dy = photon->pos[1] - q[1];
+    dz = photon->pos[2] - q[2];
+
+    return dx * dx + (dy * dy + dz * dz);
+}
+
+/*
+ * The SSE and the scalar search sum squares in different order.
+ */
+static int
+photonmap_test_close(float a, float b)
+{
+    return fabs(a - b) <= 1.0e-6 * (1.0 + fabs(b));
+}
+
+static int
+photonmap_test_cmp(const void *a, const void *b)
+{
+    float fa = *(const float *)a;
+    float fb = *(const float *)b;
+
+    return (fa < fb) ? -1 : ((fa > fb) ? 1 : 0);
+}
+%}
+
+%include "stdint.i"
+%include "../../../../src/render/photonmap.h"
+
+%inline %{
+
+/*
+ * Helpers to build maps and to compare the kd-tree search with brute force,
+ * which is too slow in Python for thousands of photons.
+ */
+
+/*
+ * Builds a balanced map of `nphotons' photons in the unit cube. A half of
+ * them lie on the plane z = 0.5 and some share positions, as photons on
+ * surfaces do.
+ */
+ri_photonmap_t *
+photonmap_test_new(
+    int              nphotons,
+    unsigned int     seed)
+{
+    int             i;
+    ri_vector_t     pos, dir, power;
+    ri_photonmap_t *map;
+
+    map = ri_photonmap_new(nphotons);
+
+    dir[0] = 0.0; dir[1] = 0.0; dir[2] = -1.0; dir[3] = 0.0;
+
+    for (i = 0; i < nphotons; i++) {
+
+        if (i % 10 != 9) {
+            pos[0] = photonmap_test_uniform(&seed);
+            pos[1] = photonmap_test_uniform(&seed);
+            pos[2] = (i % 2) ? 0.5 : photonmap_test_uniform(&seed);
+        }   /* else same position as the previous photon */
+
+        power[0] = i;
+        power[1] = 1.0;
+        power[2] = 1.0;
+
+        ri_photonmap_store(map, pos, dir, power);
+    }
+
+    ri_photonmap_balance(map);
+
+    return map;
+}
+
+/*
+ * Runs `nqueries' kNN queries at random points and returns the number of
+ * queries whose results differ from brute force.
+ */
+int
+photonmap_test_knn(
+    const ri_photonmap_t *map,
+    int              nqueries,
+    int              k,
+    double           maxdist,
+    unsigned int     seed)
+{
+    int                  i, j;
+    int                  n, nref;
+    int                  nbad;
+    float                q[3];
+    float               *dist2;
+    float               *ref;
+    char                *seen;
+    ri_vector_t          P;
+    ri_photon_nearest_t *nearest;
+
+    nearest = (ri_photon_nearest_t *)ri_mem_alloc(
+                  sizeof(ri_photon_nearest_t) * k);
+    dist2   = (float *)ri_mem_alloc(sizeof(float) * k);
+    ref     = (float *)ri_mem_alloc(sizeof(float) * (map->nphotons + 1));
+    seen    = (char *)ri_mem_alloc(map->nphotons + 1);
+
+    nbad = 0;
+
+    for (i = 0; i < nqueries; i++) {
+
+        /* Also query outside of the cube. */
+        P[0] = 1.2 * photonmap_test_uniform(&seed) - 0.1;
+        P[1] = 1.2 * photonmap_test_uniform(&seed) - 0.1;
+        P[2] = (i % 4) ? 0.5 : 1.2 * photonmap_test_uniform(&seed) - 0.1;
+        P[3] = 0.0;
+
+        q[0] = (float)P[0];
+        q[1] = (float)P[1];
+        q[2] = (float)P[2];
+
+        n = ri_photonmap_locate(map, nearest, P, maxdist * maxdist, k);
+
+        /* Indices are distinct and distances are those of the photons. */
+        memset(seen, 0, map->nphotons);
+        for (j = 0; j < n; j++) {
+            if (seen[nearest[j].index] ||
+                !photonmap_test_close(nearest[j].dist2,
+                    photonmap_test_dist2(&map->photons[nearest[j].index], q))) {
+                break;
+            }
+            seen[nearest[j].index] = 1;
+            dist2[j] = nearest[j].dist2;
+        }
+
+        if (j < n) {
+            nbad++;
+            continue;
+        }
+
+        nref = 0;
+        for (j = 0; j < map->nphotons; j++) {
+            ref[nref] = photonmap_test_dist2(&map->photons[j], q);
+            if (ref[nref] < (float)(maxdist * maxdist)) nref++;
+        }
+
+        qsort(ref, nref, sizeof(float), photonmap_test_cmp);
+        qsort(dist2, n, sizeof(float), photonmap_test_cmp);
+
+        if (nref > k) nref = k;
+
+        if (n != nref) {
+            nbad++;
+            continue;
+        }
+
+        for (j = 0; j < n; j++) {
+            if (!photonmap_test_close(dist2[j], ref[j])) break;
+        }
+
+        if (j < n) nbad++;
+    }
+
+    ri_mem_free(nearest);
+    ri_mem_free(dist2);
+    ri_mem_free(ref);
+    ri_mem_free(seen);
+
+    return nbad;
+}
+
+/*
+ * Returns 1 if two maps have the same photons and kd-tree.
+ */
+int
+photonmap_test_equal(
+    const ri_photonmap_t *a,
+    const ri_photonmap_t *b)
+{
+    int ninner;
+
+    if (a->nphotons != b->nphotons ||
+        a->nleaves  != b->nleaves  ||
+        a->balanced != b->balanced) {
+        return 0;
+    }
+
+    if (memcmp(a->photons, b->photons,
+               sizeof(ri_photon_t) * a->nphotons) != 0) {
+        return 0;
+    }
+
+    ninner = a->nleaves - 1;
+
+    if (memcmp(a->split, b->split, sizeof(float) * ninner) != 0 ||
+        memcmp(a->axis,  b->axis,  ninner) != 0) {
+        return 0;
+    }
+
+    return 1;
+}
+
+%}
@@ -0,0 +1,37 @@
+import distutils
+from distutils.core import setup, Extension
+
+import os
+import platform
+import struct
+
+basePath   = "../../../../src/base"
+renderPath = "../../../../src/render"
+incPath    = "../../../../include"
+
+srcList = [ "photonmap.i"
+          , os.path.join(renderPath, "photonmap.c") 
+          , os.path.join(basePath, "memory.c") 
+          , os.path.join(basePath, "list.c") 
+          , os.path.join(basePath, "array.c") 
+          , os.path.join(basePath, "hash.c") 
+          , os.path.join(basePath, "util.c") 
+          , os.path.join(basePath, "log.c") 
+          , os.path.join(basePath, "parallel.c") 
+          , os.path.join(basePath, "thread.c") 
+          ]
+
+
+# Test the SSE search as the renderer is built with it on x86.
+macros = [("WITH_PTHREAD", None)]
+if platform.system() == "Linux":
+    macros.append(("LINUX", None))
+if platform.machine() in ("i386", "i686", "x86_64", "AMD64"):
+    macros.append(("__x86__", None))
+    macros.append(("WITH_SSE", None))
+if struct.calcsize("P") == 8:
+    macros.append(("__64bit__", None))
+
+setup(name = "render_photonmap",
+      version = "1.0",
+      ext_modules = [Extension("_render_photonmap", sources=srcList, include_dirs = [basePath, renderPath, incPath], define_macros = macros, libraries = ["pthread", "m"])])
@@ -0,0 +1,74 @@
+from render_photonmap import *
+
+import os, sys
+
+PMAP_FILE = "test.pmap"
+
+class TestPhotonMapKNNMatchesBruteForce():
+
+    def setup(self):
+        self.map = photonmap_test_new(5000, 1)
+
+    def teardown(self):
+        ri_photonmap_free(self.map)
+
+    def test(self):
+        for k in [1, 8, 50, 200]:
+            # Limited by k, and by the radius.
+            assert photonmap_test_knn(self.map, 200, k, 10.0, 7) == 0
+            assert photonmap_test_knn(self.map, 200, k, 0.03, 7) == 0
+
+
+class TestPhotonMapKNNWithFewPhotons():
+
+    def setup(self):
+        self.maps = [photonmap_test_new(n, 3) for n in [1, 3, 9, 17]]
+
+    def teardown(self):
+        for m in self.maps:
+            ri_photonmap_free(m)
+
+    def test(self):
+        for m in self.maps:
+            assert photonmap_test_knn(m, 50, 4, 10.0, 5) == 0
+            assert photonmap_test_knn(m, 50, 32, 0.5, 5) == 0
+
+
+class TestPhotonMapSaveLoad():
+
+    def setup(self):
+        self.map = photonmap_test_new(3000, 11)
+
+        if os.path.exists(PMAP_FILE):
+            os.remove(PMAP_FILE)
+
+    def teardown(self):
+        ri_photonmap_free(self.map)
+
+        if os.path.exists(PMAP_FILE):
+            os.remove(PMAP_FILE)
+
+    def test(self):
+        assert ri_photonmap_save(self.map, PMAP_FILE) == 0
+
+        loaded = ri_photonmap_load(PMAP_FILE)
+
+        assert loaded != None
+        assert photonmap_test_equal(self.map, loaded) == 1
+        assert photonmap_test_knn(loaded, 100, 50, 0.1, 13) == 0
+
+        ri_photonmap_free(loaded)
+
+
+class TestPhotonMapLoadRejectsOtherFile():
+
+    def setup(self):
+        f = open(PMAP_FILE, "wb")
+        f.write(b"not a photon map")
+        f.close()
+
+    def teardown(self):
+        os.remove(PMAP_FILE)
+
+    def test(self):
+        assert ri_photonmap_load(PMAP_FILE) == None
@@ -0,0 +1,45 @@
+import distutils
+from distutils.core import setup, Extension
+
+import os
+import platform
+import struct
+
+basePath   = "../../../../src/base"
+renderPath = "../../../../src/render"
+incPath    = [ basePath
+             , renderPath
+             , "../../../../src/ri"
+             , "../../../../src/imageio"
+             , "../../../../src/display"
+             , "../../../../src/transport"
+             , "../../../../include"
+             ]
+
+# The renderer is not linked. texcache.i provides ri_render_get() and
+# functions used only for non blocked textures.
+srcList = [ "texcache.i"
+          , os.path.join(renderPath, "texcache.c") 
+          , os.path.join(renderPath, "texture_loader.c") 
+          , os.path.join(basePath, "memory.c") 
+          , os.path.join(basePath, "list.c") 
+          , os.path.join(basePath, "array.c") 
+          , os.path.join(basePath, "hash.c") 
+          , os.path.join(basePath, "util.c") 
+          , os.path.join(basePath, "log.c") 
+          , os.path.join(basePath, "parallel.c") 
+          , os.path.join(basePath, "thread.c") 
+          ]
+
+
+macros = [("WITH_PTHREAD", None)]
+if platform.system() == "Linux":
+    macros.append(("LINUX", None))
+if platform.machine() in ("i386", "i686", "x86_64", "AMD64"):
+    macros.append(("__x86__", None))
+if struct.calcsize("P") == 8:
+    macros.append(("__64bit__", None))
+
+setup(name = "render_texcache",
+      version = "1.0",
+      ext_modules = [Extension("_render_texcache", sources=srcList, include_dirs = incPath, define_macros = macros, libraries = ["pthread", "m"])])
@@ -0,0 +1,82 @@
+from render_texcache import *
+
+import os, sys
+
+BTEX_FILE = "test.btex"
+
+TILESIZE = 64
+
+class TestTexCacheFetchReturnsTexels():
+
+    def setup(self):
+        # Not a multiple of the tile size.
+        assert texcache_test_save(BTEX_FILE, 300, 200) == 0
+        self.btex = ri_blockedtex_open(BTEX_FILE)
+
+    def teardown(self):
+        ri_blockedtex_close(self.btex)
+        os.remove(BTEX_FILE)
+
+    def test(self):
+        points = [ (0, 0), (10, 20), (63, 63), (64, 0), (127, 64)
+                 , (299, 199), (298, 198), (-5, -5), (400, 50), (150, 300)
+                 ]
+
+        for (x, y) in points:
+            assert texcache_test_fetch(self.btex, x, y) == 1
+
+
+class TestTexCacheHitDoesNotLoad():
+
+    def setup(self):
+        assert texcache_test_save(BTEX_FILE, 256, 256) == 0
+        self.btex = ri_blockedtex_open(BTEX_FILE)
+
+    def teardown(self):
+        ri_blockedtex_close(self.btex)
+        os.remove(BTEX_FILE)
+
+    def test(self):
+        nlookups = texcache_test_nlookups()
+        nloads   = texcache_test_nloads()
+
+        # Texels in the same tile.
+        assert texcache_test_fetch(self.btex, 10, 10) == 1
+        assert texcache_test_fetch(self.btex, 11, 12) == 1
+        assert texcache_test_fetch(self.btex, 10, 10) == 1
+
+        assert texcache_test_nlookups() == nlookups + 3
+        assert texcache_test_nloads()   == nloads + 1
+
+
+class TestTexCacheEvictsWithinBudget():
+
+    def setup(self):
+        # 256 tiles in level 0, more than the cache holds.
+        assert texcache_test_save(BTEX_FILE, 1024, 1024) == 0
+        self.btex = ri_blockedtex_open(BTEX_FILE)
+
+    def teardown(self):
+        ri_blockedtex_close(self.btex)
+        os.remove(BTEX_FILE)
+
+    def test(self):
+        ntiles = (1024 // TILESIZE) * (1024 // TILESIZE)
+        nloads = texcache_test_nloads()
+
+        # Scanning more tiles than the cache holds evicts every tile
+        # before it is used again.
+        for n in range(2):
+            for ty in range(1024 // TILESIZE):
+                for tx in range(1024 // TILESIZE):
+                    x = tx * TILESIZE + 1
+                    y = ty * TILESIZE + 1
+                    assert texcache_test_fetch(self.btex, x, y) == 1
+
+            assert texcache_test_bytes() <= texcache_test_budget()
+
+        assert texcache_test_nloads() == nloads + 2 * ntiles
+
+        # The most recently used tile is still in the cache.
+        assert texcache_test_fetch(self.btex, x, y) == 1
+        assert texcache_test_nloads() == nloads + 2 * ntiles
@@ -0,0 +1,201 @@
+%module render_texcache
+%{
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "render.h"
+#include "option.h"
+#include "image_loader.h"
+#include "texture.h"
+#include "texcache.h"
+
+/*
+ * Stand-ins for the renderer. The texture cache is created with the budget
+ * of 1 MB, which holds 15 tiles.
+ */
+
+#define TEXCACHE_TEST_SIZE  1       /* MB */
+
+static ri_option_t  test_option;
+static ri_context_t test_context;
+static ri_render_t  test_render;
+
+ri_render_t *
+ri_render_get()
+{
+    test_option.texture_cache_size = TEXCACHE_TEST_SIZE;
+    test_context.option            = &test_option;
+    test_render.context            = &test_context;
+
+    return &test_render;
+}
+
+int
+ri_option_find_file(char *fullpath, const ri_option_t *option,
+                    const char *file)
+{
+    (void)option;
+
+    strcpy(fullpath, file);
+
+    return 1;
+}
+
+void
+ri_option_show_searchpath(ri_option_t *option)
+{
+    (void)option;
+}
+
+float *
+ri_image_load(const char *filename, unsigned int *width_out,
+              unsigned int *height_out, unsigned int *component_out)
+{
+    (void)filename;
+    (void)width_out;
+    (void)height_out;
+    (void)component_out;
+
+    return NULL;
+}
+
+/*
+ * Texel (x, y) of the test texture.
+ */
+static void
+texcache_test_texel(float texel[4], int x, int y)
+{
+    texel[0] = (float)x;
+    texel[1] = (float)y;
+    texel[2] = 0.5f;
+    texel[3] = 1.0f;
+}
+%}
+
+%include "stdint.i"
+%include "../../../../src/render/texcache.h"
+
+%inline %{
+
+/*
+ * Saves the test texture of `width' x `height' as a blocked mipmap.
+ * Returns 0 on success.
+ */
+int
+texcache_test_save(
+    const char      *filename,
+    int              width,
+    int              height)
+{
+    int          x, y;
+    int          ret;
+    ri_texture_t texture;
+
+    memset(&texture, 0, sizeof(ri_texture_t));
+
+    texture.width  = width;
+    texture.height = height;
+    texture.data   = (float *)malloc(sizeof(float) * 4 * width * height);
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            texcache_test_texel(&texture.data[4 * (y * width + x)], x, y);
+        }
+    }
+
+    ret = ri_texture_save_blocked(filename, &texture);
+
+    free(texture.data);
+
+    return ret;
+}
+
+/*
+ * Fetches 2x2 texels at (x, y) of level 0 through the cache. Returns 1 if
+ * they are the texels of the test texture.
+ */
+int
+texcache_test_fetch(
+    const ri_blockedtex_t *btex,
+    int              x,
+    int              y)
+{
+    int   i, k;
+    int   w, h;
+    int   tx, ty;
+    float texel[4][4];
+    float expected[4];
+
+    ri_texcache_fetch2x2(texel, ri_texcache_get(), btex, 0, x, y);
+
+    w = btex->width;
+    h = btex->height;
+
+    /* (x, y) is clamped to the edge, then x+1 and y+1 are. */
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x > w - 1) x = w - 1;
+    if (y > h - 1) y = h - 1;
+
+    for (k = 0; k < 4; k++) {
+
+        /* (x, y), (x, y+1), (x+1, y), (x+1, y+1) */
+        tx = x + k / 2;
+        ty = y + k % 2;
+        if (tx > w - 1) tx = w - 1;
+        if (ty > h - 1) ty = h - 1;
+
+        texcache_test_texel(expected, tx, ty);
+
+        for (i = 0; i < 4; i++) {
+            if (texel[k][i] != expected[i]) return 0;
+        }
+    }
+
+    return 1;
+}
+
+uint64_t
+texcache_test_nlookups()
+{
+    uint64_t nlookups, nloads;
+    size_t   bytes;
+
+    ri_texcache_stat(&nlookups, &nloads, &bytes);
+
+    return nlookups;
+}
+
+uint64_t
+texcache_test_nloads()
+{
+    uint64_t nlookups, nloads;
+    size_t   bytes;
+
+    ri_texcache_stat(&nlookups, &nloads, &bytes);
+
+    return nloads;
+}
+
+/*
+ * Memory allocated for tiles.
+ */
+uint64_t
+texcache_test_bytes()
+{
+    uint64_t nlookups, nloads;
+    size_t   bytes;
+
+    ri_texcache_stat(&nlookups, &nloads, &bytes);
+
+    return (uint64_t)bytes;
+}
+
+uint64_t
+texcache_test_budget()
+{
+    return (uint64_t)ri_texcache_get()->size;
+}
+
+%}
@@ -0,0 +1,51 @@
+/*
+ *   lucille | Global Illumination renderer
+ *
+ *             written by Syoyo Fujita.
+ *
+ */
+
+/*
+ * Converts a texture(.hdr, .tex, .jpg) into a blocked mipmap texture(.btex),
+ * whose tiles are paged in on demand by the texture cache of the renderer.
+ *
+ * usage: tex2btex input.{hdr,tex,jpg} output.btex
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "texture.h"
+
+int
+main(int argc, char **argv)
+{
+    ri_texture_t *texture;
+
+    if (argc < 3) {
+        printf("usage: %s input.{hdr,tex,jpg} output.btex\n", argv[0]);
+        exit(-1);
+    }
+
+    texture = ri_texture_load(argv[1]);
+    if (!texture) {
+        fprintf(stderr, "Can't load texture [ %s ]\n", argv[1]);
+        exit(-1);
+    }
+
+    if (texture->blocked) {
+        fprintf(stderr, "[ %s ] is already a blocked texture.\n", argv[1]);
+        exit(-1);
+    }
+
+    if (ri_texture_save_blocked(argv[2], texture) != 0) {
+        fprintf(stderr, "Can't write blocked texture [ %s ]\n", argv[2]);
+        exit(-1);
+    }
+
+    printf("Wrote [ %s ] (%d x %d)\n", argv[2], texture->width, texture->height);
+
+    return 0;
+}